@@ -0,0 +1,409 @@
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "affinity.h"
+
+/* set_mempolicy modes from numaif.h, which would need libnuma */
+#define AFFINITY_MPOL_DEFAULT 0
+#define AFFINITY_MPOL_BIND 2
+
+typedef struct affinity_role affinity_role_t;
+
+struct affinity_role {
+	char role[16];
+	bool nic; /* Numbered instances alternate between the NICs' nodes */
+	cpu_set_t cpus;
+	uint64_t nodes;
+};
+
+/* Read once, never changed after */
+static pthread_once_t nodes_once = PTHREAD_ONCE_INIT;
+static cpu_set_t node_cpus[AFFINITY_MAXNODES];
+static uint64_t node_mask;
+static int nnodes;
+
+/* Set up by affinity_configure before any placed thread is started */
+static affinity_role_t roles[AFFINITY_MAXROLES];
+static int nroles;
+static bool numabind;
+static bool configured;
+static cpu_set_t default_cpus; /* Where threads without a role are put back */
+static int nic_nodes[AFFINITY_MAXNODES];
+static cpu_set_t nic_cpus[AFFINITY_MAXNODES]; /* Each nic node's CPUs in default_cpus */
+static int nnic_nodes;
+
+static void read_nodes(void)
+{
+	char path[64], buf[4096];
+	int node;
+
+	for (node = 0; node < AFFINITY_MAXNODES; node++) {
+		FILE *fp;
+
+		snprintf(path, 64, "/sys/devices/system/node/node%d/cpulist", node);
+		fp = fopen(path, "re");
+		if (!fp)
+			continue;
+		/* Nodes with memory but no CPUs are left out */
+		if (fgets(buf, sizeof(buf), fp) && affinity_parse_cpus(buf, &node_cpus[node])) {
+			node_mask |= 1ULL << node;
+			nnodes++;
+		}
+		fclose(fp);
+	}
+	/* Without NUMA every CPU is on node 0 */
+	if (!nnodes) {
+		sched_getaffinity(0, sizeof(cpu_set_t), &node_cpus[0]);
+		node_mask = 1;
+		nnodes = 1;
+	}
+}
+
+int affinity_nodes(void)
+{
+	pthread_once(&nodes_once, read_nodes);
+	return nnodes;
+}
+
+bool affinity_node_cpus(const int node, cpu_set_t *set)
+{
+	pthread_once(&nodes_once, read_nodes);
+	if (node < 0 || node >= AFFINITY_MAXNODES || !(node_mask & (1ULL << node)))
+		return false;
+	memcpy(set, &node_cpus[node], sizeof(cpu_set_t));
+	return true;
+}
+
+/* Mask of the nodes any CPU in set is on */
+uint64_t affinity_cpus_nodes(const cpu_set_t *set)
+{
+	uint64_t ret = 0;
+	int node;
+
+	pthread_once(&nodes_once, read_nodes);
+	for (node = 0; node < AFFINITY_MAXNODES; node++) {
+		cpu_set_t both;
+
+		if (!(node_mask & (1ULL << node)))
+			continue;
+		CPU_AND(&both, set, &node_cpus[node]);
+		if (CPU_COUNT(&both))
+			ret |= 1ULL << node;
+	}
+	return ret;
+}
+
+/* Allocate the calling thread's memory only from the nodes in nodemask, or
+ * anywhere again with an empty mask */
+bool affinity_bind_nodes(const uint64_t nodemask)
+{
+	unsigned long mask = nodemask;
+
+	if (!nodemask)
+		return !syscall(SYS_set_mempolicy, AFFINITY_MPOL_DEFAULT, NULL, 0);
+	return !syscall(SYS_set_mempolicy, AFFINITY_MPOL_BIND, &mask, AFFINITY_MAXNODES + 1);
+}
+
+/* A list of CPUs and ranges such as 0-3,8 in the form of sysfs cpulists, where
+ * nodeN also stands for all of node N's CPUs */
+bool affinity_parse_cpus(const char *spec, cpu_set_t *set)
+{
+	const char *p = spec;
+
+	CPU_ZERO(set);
+	while (*p) {
+		long first, last;
+		char *end;
+
+		if (isspace(*p) || *p == ',') {
+			p++;
+			continue;
+		}
+		if (!strncmp(p, "node", 4)) {
+			first = strtol(p + 4, &end, 10);
+			pthread_once(&nodes_once, read_nodes);
+			if (end == p + 4 || first < 0 || first >= AFFINITY_MAXNODES ||
+			    !(node_mask & (1ULL << first)))
+				return false;
+			CPU_OR(set, set, &node_cpus[first]);
+		} else {
+			first = last = strtol(p, &end, 10);
+			if (end == p || first < 0)
+				return false;
+			if (*end == '-') {
+				p = end + 1;
+				last = strtol(p, &end, 10);
+				if (end == p || last < first)
+					return false;
+			}
+			if (last >= CPU_SETSIZE)
+				return false;
+			while (first <= last)
+				CPU_SET(first++, set);
+		}
+		p = end;
+		if (*p && *p != ',' && !isspace(*p))
+			return false;
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+/* The reverse of affinity_parse_cpus without node names */
+void affinity_format_cpus(const cpu_set_t *set, char *buf, const int len)
+{
+	int cpu, ofs = 0;
+
+	buf[0] = '\0';
+	for (cpu = 0; cpu < CPU_SETSIZE && ofs < len; cpu++) {
+		int last = cpu;
+
+		if (!CPU_ISSET(cpu, set))
+			continue;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+			last++;
+		if (last > cpu)
+			ofs += snprintf(buf + ofs, len - ofs, "%s%d-%d", ofs ? "," : "", cpu, last);
+		else
+			ofs += snprintf(buf + ofs, len - ofs, "%s%d", ofs ? "," : "", cpu);
+		cpu = last;
+	}
+}
+
+static void format_nodes(const uint64_t mask, char *buf, const int len)
+{
+	int node, ofs = 0;
+
+	buf[0] = '\0';
+	for (node = 0; node < AFFINITY_MAXNODES && ofs < len; node++) {
+		if (mask & (1ULL << node))
+			ofs += snprintf(buf + ofs, len - ofs, "%s%d", ofs ? "," : "", node);
+	}
+}
+
+/* NUMA node of a network interface's device, -1 for virtual ones */
+static int nic_node(const char *ifname)
+{
+	char path[128];
+	int node = -1;
+	FILE *fp;
+
+	snprintf(path, 128, "/sys/class/net/%s/device/numa_node", ifname);
+	fp = fopen(path, "re");
+	if (!fp)
+		return node;
+	if (fscanf(fp, "%d", &node) != 1)
+		node = -1;
+	fclose(fp);
+	return node;
+}
+
+static bool wildcard_addr(const struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET)
+		return ((const struct sockaddr_in *)sa)->sin_addr.s_addr == htonl(INADDR_ANY);
+	if (sa->sa_family == AF_INET6)
+		return !memcmp(&((const struct sockaddr_in6 *)sa)->sin6_addr, &in6addr_any,
+			       sizeof(struct in6_addr));
+	return false;
+}
+
+static bool same_addr(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a->sa_family != b->sa_family)
+		return false;
+	if (a->sa_family == AF_INET)
+		return ((const struct sockaddr_in *)a)->sin_addr.s_addr ==
+			((const struct sockaddr_in *)b)->sin_addr.s_addr;
+	if (a->sa_family == AF_INET6)
+		return !memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr,
+			       &((const struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr));
+	return false;
+}
+
+/* Nodes of the NICs with the addresses we listen on, or of every NIC for
+ * wildcard addresses. Falls back to every node when none report one. */
+static void read_nic_nodes(char **serverurl, const int serverurls)
+{
+	struct ifaddrs *ifaddr, *ifa;
+	uint64_t mask = 0;
+	char buf[256];
+	int i, node;
+
+	if (getifaddrs(&ifaddr))
+		ifaddr = NULL;
+	for (i = 0; i < serverurls && ifaddr; i++) {
+		struct addrinfo hints, *res = NULL;
+		char *url = NULL, *port = NULL;
+		bool any = false;
+
+		if (!extract_sockaddr(serverurl[i], &url, &port))
+			continue;
+		memset(&hints, 0, sizeof(struct addrinfo));
+		hints.ai_family = AF_UNSPEC;
+		if (!strlen(url))
+			any = true;
+		else if (getaddrinfo(url, NULL, &hints, &res))
+			res = NULL;
+		else
+			any = wildcard_addr(res->ai_addr);
+		for (ifa = ifaddr; ifa && (any || res); ifa = ifa->ifa_next) {
+			if (!ifa->ifa_addr || (ifa->ifa_flags & IFF_LOOPBACK))
+				continue;
+			if (!any && !same_addr(ifa->ifa_addr, res->ai_addr))
+				continue;
+			node = nic_node(ifa->ifa_name);
+			if (node >= 0 && node < AFFINITY_MAXNODES && (node_mask & (1ULL << node))) {
+				if (!(mask & (1ULL << node)))
+					LOGNOTICE("Listening on %s NIC %s on NUMA node %d", url, ifa->ifa_name, node);
+				mask |= 1ULL << node;
+			}
+		}
+		if (res)
+			freeaddrinfo(res);
+		free(url);
+		free(port);
+	}
+	if (ifaddr)
+		freeifaddrs(ifaddr);
+	if (!mask) {
+		mask = node_mask;
+		format_nodes(mask, buf, 256);
+		LOGNOTICE("No NIC reports a NUMA node, using nodes %s for nic affinity", buf);
+	}
+	/* Only alternate between nodes with CPUs ckpool was started on */
+	for (node = 0; node < AFFINITY_MAXNODES; node++) {
+		if (!(mask & (1ULL << node)))
+			continue;
+		CPU_AND(&nic_cpus[nnic_nodes], &node_cpus[node], &default_cpus);
+		if (CPU_COUNT(&nic_cpus[nnic_nodes]))
+			nic_nodes[nnic_nodes++] = node;
+	}
+}
+
+/* Place each thread role named in roles_val, an object of role names to CPU
+ * lists or "nic", reporting the topology and placement chosen. Returns false
+ * if any role could not be used. Must be called before the threads to be
+ * placed are started. */
+bool affinity_configure(const json_t *roles_val, const bool bind, char **serverurl,
+			const int serverurls)
+{
+	char cpubuf[256], nodebuf[256];
+	const char *key;
+	bool ret = true;
+	json_t *spec;
+	int node;
+
+	pthread_once(&nodes_once, read_nodes);
+	for (node = 0; node < AFFINITY_MAXNODES; node++) {
+		if (!(node_mask & (1ULL << node)))
+			continue;
+		affinity_format_cpus(&node_cpus[node], cpubuf, 256);
+		LOGNOTICE("NUMA node %d of %d: CPUs %s", node, nnodes, cpubuf);
+	}
+	if (!roles_val || !json_is_object(roles_val) || !json_object_size(roles_val)) {
+		if (bind)
+			LOGWARNING("numabind has no effect without affinity roles");
+		return ret;
+	}
+
+	sched_getaffinity(0, sizeof(cpu_set_t), &default_cpus);
+	json_object_foreach((json_t *)roles_val, key, spec) {
+		affinity_role_t *ar = &roles[nroles];
+		const char *str = json_string_value(spec);
+		int i;
+
+		if (nroles >= AFFINITY_MAXROLES) {
+			LOGWARNING("Too many affinity roles, ignoring %s", key);
+			ret = false;
+			continue;
+		}
+		if (!str) {
+			LOGWARNING("Invalid affinity for %s, expected a string", key);
+			ret = false;
+			continue;
+		}
+		memset(ar, 0, sizeof(affinity_role_t));
+		snprintf(ar->role, 16, "%s", key);
+		if (!strcmp(str, "nic")) {
+			if (!nnic_nodes)
+				read_nic_nodes(serverurl, serverurls);
+			ar->nic = true;
+			for (i = 0; i < nnic_nodes; i++)
+				CPU_OR(&ar->cpus, &ar->cpus, &nic_cpus[i]);
+		} else if (!affinity_parse_cpus(str, &ar->cpus)) {
+			LOGWARNING("Invalid affinity CPUs %s for %s", str, key);
+			ret = false;
+			continue;
+		}
+		CPU_AND(&ar->cpus, &ar->cpus, &default_cpus);
+		if (!CPU_COUNT(&ar->cpus)) {
+			LOGWARNING("Affinity %s for %s has no CPUs available to ckpool", str, key);
+			ret = false;
+			continue;
+		}
+		ar->nodes = affinity_cpus_nodes(&ar->cpus);
+		affinity_format_cpus(&ar->cpus, cpubuf, 256);
+		format_nodes(ar->nodes, nodebuf, 256);
+		LOGNOTICE("Placing %s threads on CPUs %s, NUMA nodes %s%s%s", ar->role, cpubuf,
+			  nodebuf, bind ? " with memory bound" : "",
+			  ar->nic ? ", numbered instances alternating between nodes" : "");
+		nroles++;
+	}
+	numabind = bind;
+	__atomic_store_n(&configured, nroles > 0, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/* Called by rename_proc to place the calling thread by its role, the name
+ * without any instance number. Threads without a role are put back on every
+ * CPU since threads inherit the placement of the thread starting them. */
+void affinity_apply(const char *name)
+{
+	cpu_set_t *cpus = &default_cpus;
+	int len, instance = -1, i;
+	uint64_t nodes = 0;
+	char role[16];
+
+	if (likely(!__atomic_load_n(&configured, __ATOMIC_ACQUIRE)))
+		return;
+
+	snprintf(role, 16, "%s", name);
+	len = strlen(role);
+	while (len > 1 && isdigit(role[len - 1]))
+		len--;
+	if (role[len])
+		instance = atoi(role + len);
+	role[len] = '\0';
+
+	for (i = 0; i < nroles; i++) {
+		affinity_role_t *ar = &roles[i];
+
+		if (strcmp(ar->role, role))
+			continue;
+		cpus = &ar->cpus;
+		nodes = ar->nodes;
+		if (ar->nic && instance >= 0 && nnic_nodes) {
+			i = instance % nnic_nodes;
+			cpus = &nic_cpus[i];
+			nodes = 1ULL << nic_nodes[i];
+		}
+		break;
+	}
+	if (unlikely(sched_setaffinity(0, sizeof(cpu_set_t), cpus)))
+		LOGWARNING("Failed to set CPU affinity of %s", name);
+	if (numabind && unlikely(!affinity_bind_nodes(nodes)))
+		LOGWARNING("Failed to bind memory of %s to its NUMA nodes", name);
+}
@@ -0,0 +1,28 @@
+/* Placement of the threads named with rename_proc on CPU sets by role, with
+ * their memory optionally bound to the NUMA nodes of those CPUs */
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <jansson.h>
+
+/* NUMA nodes handled, the width of a node mask */
+#define AFFINITY_MAXNODES 64
+
+/* Roles configured at once */
+#define AFFINITY_MAXROLES 32
+
+int affinity_nodes(void);
+bool affinity_node_cpus(const int node, cpu_set_t *set);
+uint64_t affinity_cpus_nodes(const cpu_set_t *set);
+bool affinity_bind_nodes(const uint64_t nodemask);
+bool affinity_parse_cpus(const char *spec, cpu_set_t *set);
+void affinity_format_cpus(const cpu_set_t *set, char *buf, const int len);
+
+bool affinity_configure(const json_t *roles, const bool numabind, char **serverurl,
+			const int serverurls);
+void affinity_apply(const char *name);
+
+#endif /* AFFINITY_H */
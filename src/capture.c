@@ -0,0 +1,229 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "capture.h"
+#include "metrics.h"
+
+/* Write buffer for each capture file, flushed at least once a second */
+#define CAPTURE_BUFSIZ (1024 * 1024)
+#define CAPTURE_FLUSH_NS 1000000000LL
+
+bool capture_enabled;
+
+/* Everything below is protected by capture_lock */
+static mutex_t capture_lock;
+static char *capture_prefix;
+static int64_t capture_maxsize;
+static FILE *capture_fp;
+static char *capture_buf;
+static int64_t capture_size;
+static int64_t capture_last;
+static int64_t capture_flushed;
+
+/* Name each file by the time it was started in milliseconds so a directory
+ * listing sorts them into replay order */
+static bool __open_file(void)
+{
+	uchar header[CAPTURE_HEADER];
+	int64_t now_us, ms;
+	char *path = NULL;
+	tv_t now;
+
+	tv_time(&now);
+	now_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+	for (ms = now_us / 1000; ; ms++) {
+		dealloc(path);
+		ASPRINTF(&path, "%s.%"PRId64, capture_prefix, ms);
+		if (access(path, F_OK))
+			break;
+	}
+	capture_fp = fopen(path, "we");
+	if (unlikely(!capture_fp)) {
+		LOGERR("Failed to open capture file %s", path);
+		free(path);
+		return false;
+	}
+	if (!capture_buf)
+		capture_buf = ckalloc(CAPTURE_BUFSIZ);
+	setvbuf(capture_fp, capture_buf, _IOFBF, CAPTURE_BUFSIZ);
+	memcpy(header, CAPTURE_MAGIC, 8);
+	now_us = htole64(now_us);
+	memcpy(header + 8, &now_us, 8);
+	fwrite(header, CAPTURE_HEADER, 1, capture_fp);
+	capture_size = CAPTURE_HEADER;
+	capture_last = capture_flushed = lat_now();
+	LOGNOTICE("Capturing stratum traffic to %s", path);
+	free(path);
+	return true;
+}
+
+static void __close_file(void)
+{
+	if (capture_fp) {
+		fclose(capture_fp);
+		capture_fp = NULL;
+	}
+}
+
+/* Files started after this use the new prefix and size */
+bool capture_configure(const char *prefix, const int size_mb)
+{
+	if (!capture_prefix)
+		mutex_init(&capture_lock);
+	mutex_lock(&capture_lock);
+	free(capture_prefix);
+	capture_prefix = strdup(prefix);
+	capture_maxsize = (int64_t)(size_mb > 0 ? size_mb : CAPTURE_SIZE) * 1024 * 1024;
+	mutex_unlock(&capture_lock);
+	return true;
+}
+
+/* Start a new file or finish the current one */
+bool capture_enable(const bool enable)
+{
+	bool ret = true;
+
+	if (!capture_prefix)
+		return false;
+	mutex_lock(&capture_lock);
+	if (enable && !capture_fp)
+		ret = __open_file();
+	else if (!enable) {
+		__atomic_store_n(&capture_enabled, false, __ATOMIC_RELAXED);
+		__close_file();
+	}
+	if (enable && ret)
+		__atomic_store_n(&capture_enabled, true, __ATOMIC_RELAXED);
+	mutex_unlock(&capture_lock);
+	return ret;
+}
+
+static int put_varint(uchar *buf, uint64_t val)
+{
+	int len = 0;
+
+	while (val >= 0x80) {
+		buf[len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	buf[len++] = val;
+	return len;
+}
+
+void capture_record(const int type, const int64_t client_id, const char *buf, int len)
+{
+	uchar header[32];
+	int hlen;
+	int64_t now;
+
+	/* Lines are recorded without their line ending */
+	while (len && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+		len--;
+
+	mutex_lock(&capture_lock);
+	if (unlikely(!capture_fp))
+		goto out;
+	now = lat_now();
+	header[0] = type;
+	hlen = 1 + put_varint(header + 1, now - capture_last);
+	hlen += put_varint(header + hlen, client_id);
+	hlen += put_varint(header + hlen, len);
+	fwrite(header, hlen, 1, capture_fp);
+	if (len)
+		fwrite(buf, len, 1, capture_fp);
+	capture_last = now;
+	capture_size += hlen + len;
+	if (capture_size >= capture_maxsize) {
+		__close_file();
+		if (!__open_file())
+			__atomic_store_n(&capture_enabled, false, __ATOMIC_RELAXED);
+	} else if (now - capture_flushed > CAPTURE_FLUSH_NS) {
+		fflush(capture_fp);
+		capture_flushed = now;
+	}
+out:
+	mutex_unlock(&capture_lock);
+}
+
+capture_reader_t *capture_open(const char *path)
+{
+	uchar header[CAPTURE_HEADER];
+	capture_reader_t *cr;
+	int64_t start_us;
+	FILE *fp;
+
+	fp = fopen(path, "re");
+	if (!fp) {
+		LOGWARNING("Failed to open capture file %s", path);
+		return NULL;
+	}
+	if (fread(header, CAPTURE_HEADER, 1, fp) != 1 || memcmp(header, CAPTURE_MAGIC, 8)) {
+		LOGWARNING("%s is not a capture file", path);
+		fclose(fp);
+		return NULL;
+	}
+	cr = ckzalloc(sizeof(capture_reader_t));
+	cr->fp = fp;
+	memcpy(&start_us, header + 8, 8);
+	cr->start_us = le64toh(start_us);
+	cr->bufsize = PAGESIZE;
+	cr->buf = ckalloc(cr->bufsize);
+	return cr;
+}
+
+static bool get_varint(FILE *fp, uint64_t *val)
+{
+	int shift = 0, c;
+
+	*val = 0;
+	do {
+		c = fgetc(fp);
+		if (c == EOF || shift > 63)
+			return false;
+		*val |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return true;
+}
+
+/* Read the next record, returning false at the end of the file or when the
+ * rest of it is truncated */
+bool capture_read(capture_reader_t *cr, capture_rec_t *rec)
+{
+	uint64_t delta, id, len;
+	int type;
+
+	type = fgetc(cr->fp);
+	if (type == EOF)
+		return false;
+	if (!get_varint(cr->fp, &delta) || !get_varint(cr->fp, &id) ||
+	    !get_varint(cr->fp, &len) || len > 0x7fffffff)
+		return false;
+	if ((int64_t)len >= cr->bufsize) {
+		cr->bufsize = round_up_page(len + 1);
+		cr->buf = realloc(cr->buf, cr->bufsize);
+		if (unlikely(!cr->buf))
+			quit(1, "Failed to realloc capture buffer of %d bytes", cr->bufsize);
+	}
+	if (len && fread(cr->buf, len, 1, cr->fp) != 1)
+		return false;
+	cr->buf[len] = '\0';
+	cr->ns += delta;
+	rec->type = type;
+	rec->ns = cr->ns;
+	rec->client_id = id;
+	rec->buf = cr->buf;
+	rec->len = len;
+	return true;
+}
+
+void capture_close(capture_reader_t *cr)
+{
+	fclose(cr->fp);
+	free(cr->buf);
+	free(cr);
+}
@@ -0,0 +1,59 @@
+/* Optional capture of timestamped stratum traffic and template events to
+ * compact binary files, and reading them back for replay */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Each file starts with CAPTURE_MAGIC and its start time as 64 bit little
+ * endian microseconds since the epoch. Records follow, each a type byte then
+ * varints of the nanoseconds since the previous record, the client id and
+ * the payload length, then the payload. */
+#define CAPTURE_MAGIC "CKCAP001"
+#define CAPTURE_HEADER 16
+
+/* Default size in MB before a capture file is rotated */
+#define CAPTURE_SIZE 64
+
+enum capture_type {
+	CAPTURE_CONNECT = 1,	/* Payload is the client's address */
+	CAPTURE_IN,		/* A line from the client without its newline */
+	CAPTURE_OUT,		/* A line queued to the client without its newline */
+	CAPTURE_CLOSE,		/* Client dropped, no payload */
+	CAPTURE_TEMPLATE	/* Template json, client id 0 */
+};
+
+/* Checked by every capture point; the only cost when disabled */
+extern bool capture_enabled;
+
+bool capture_configure(const char *prefix, const int size_mb);
+bool capture_enable(const bool enable);
+void capture_record(const int type, const int64_t client_id, const char *buf, int len);
+
+typedef struct capture_rec capture_rec_t;
+
+struct capture_rec {
+	int type;
+	int64_t ns; /* Since the start of the file */
+	int64_t client_id;
+	char *buf; /* NULL terminated, valid until the next read */
+	int len;
+};
+
+typedef struct capture_reader capture_reader_t;
+
+struct capture_reader {
+	FILE *fp;
+	int64_t start_us; /* Realtime the file was started */
+	int64_t ns;
+	char *buf;
+	int bufsize;
+};
+
+capture_reader_t *capture_open(const char *path);
+bool capture_read(capture_reader_t *cr, capture_rec_t *rec);
+void capture_close(capture_reader_t *cr);
+
+#endif /* CAPTURE_H */
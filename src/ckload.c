@@ -0,0 +1,1259 @@
+/*
+ * Stratum V1 load generator for testing ckpool without a farm of miners.
+ *
+ * Opens many client connections spread over epoll driven threads, subscribes
+ * and authorises each of them, then submits shares at a target rate with a
+ * chosen mix of valid, duplicate, stale and invalid shares. Valid shares are
+ * really mined at the difficulty the pool sets so the pool under test should
+ * run against a test bitcoind with tiny mindiff, startdiff and maxdiff
+ * values. Client side latencies are reported as histograms along with how
+ * the pool answered each kind of share.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "metrics.h"
+#include "sha2.h"
+#include "target256.h"
+
+/* Requests in flight per client that latencies can be matched to */
+#define LOAD_PENDING 64
+#define LOAD_EVENTS 256
+#define LOAD_BUFSIZ 2048
+#define LOAD_MAXBUF 65536
+#define LOAD_MERKLES 32
+/* How often each thread looks for reconnects, storms and slow readers */
+#define LOAD_SCAN_NS 10000000LL
+
+enum load_state {
+	LS_IDLE,
+	LS_CONNECTING,
+	LS_CONFIGURING,
+	LS_SUBSCRIBING,
+	LS_AUTHORISING,
+	LS_MINING
+};
+
+enum load_req {
+	LR_NONE,
+	LR_CONFIGURE,
+	LR_SUBSCRIBE,
+	LR_AUTHORISE,
+	LR_SUBMIT
+};
+
+enum share_kind {
+	SK_VALID,
+	SK_DUPE,
+	SK_STALE,
+	SK_INVALID,
+	SK_KINDS
+};
+
+static const char *share_kinds[SK_KINDS] = { "valid", "duplicate", "stale", "invalid" };
+
+/* How the pool answered, from the stratum error code of rejects */
+enum share_res {
+	SR_ACCEPTED,
+	SR_REJECTED,
+	SR_STALE,
+	SR_DUPE,
+	SR_LOWDIFF,
+	SR_RESULTS
+};
+
+static const char *share_results[SR_RESULTS] = { "accepted", "rejected", "stale", "duplicate", "lowdiff" };
+
+typedef struct load_job load_job_t;
+
+struct load_job {
+	bool valid;
+	char jobid[24];
+	char ntime[12];
+	uchar *coinb1;
+	int coinb1len;
+	uchar *coinb2;
+	int coinb2len;
+	uchar merkles[LOAD_MERKLES][32];
+	int nmerkles;
+	uchar header[80];
+};
+
+typedef struct load_thread load_thread_t;
+typedef struct load_client load_client_t;
+
+struct load_client {
+	int id;
+	int fd;
+	load_thread_t *thread;
+	enum load_state state;
+
+	/* Slow readers only read once every slow_ms and are left disarmed in
+	 * between, so the pool's sends back up behind them */
+	bool slow;
+	bool armed;
+	/* Reconnect time when idle, or next read time for slow readers */
+	int64_t wake;
+	int64_t connect_start;
+
+	char *rbuf;
+	int rlen;
+	int rsize;
+	char *wbuf;
+	int wlen;
+
+	char username[128];
+	uchar enonce1[16];
+	int enonce1len;
+	int nonce2len;
+	uint64_t nonce2;
+	double diff;
+	uint32_t version_mask;
+	uint32_t vroll;
+
+	load_job_t job;
+	/* The job from before the last clean notify, for stale shares */
+	load_job_t oldjob;
+	/* Params of the last valid share, resubmitted as a duplicate */
+	char lastshare[256];
+
+	int64_t msgid;
+	int64_t ids[LOAD_PENDING];
+	int64_t sent[LOAD_PENDING];
+	uchar req[LOAD_PENDING];
+	uchar kind[LOAD_PENDING];
+};
+
+struct load_thread {
+	int id;
+	pthread_t pth;
+	int epfd;
+	load_client_t *clients;
+	int nclients;
+	int next; /* Round robin position of the next client to submit */
+	int64_t interval_ns; /* Between share submissions, 0 for none */
+	int64_t next_submit;
+	uint64_t rand;
+	int storm; /* Last reconnect storm acted on */
+};
+
+typedef struct load_conf load_conf_t;
+
+struct load_conf {
+	char *url;
+	int clients;
+	int threads;
+	char *user;
+	int users;
+	char *worker;
+	char *password;
+	double rate;
+	int duration;
+	int interval;
+	double dupe;
+	double stale;
+	double invalid;
+	int storm;
+	double storm_pct;
+	double slow;
+	int slow_ms;
+	bool vroll;
+	uint32_t maxhashes;
+};
+
+static load_conf_t conf = {
+	.clients = 100,
+	.threads = 4,
+	.users = 1,
+	.rate = 100,
+	.duration = 60,
+	.interval = 10,
+	.storm_pct = 100,
+	.slow_ms = 1000,
+	.maxhashes = 1 << 20,
+};
+
+/* Totals from every thread, all updated atomically */
+struct load_stats {
+	uint64_t connects;
+	uint64_t connfails;
+	uint64_t disconnects;
+	uint64_t authorised;
+	uint64_t authfails;
+	uint64_t mining;
+	uint64_t storms;
+	uint64_t notifies;
+	uint64_t hashes;
+	uint64_t behind;
+	uint64_t sent[SK_KINDS];
+	uint64_t results[SK_KINDS][SR_RESULTS];
+	lat_hist_t connect;
+	lat_hist_t configure;
+	lat_hist_t subscribe;
+	lat_hist_t authorise;
+	lat_hist_t submit;
+};
+
+static struct load_stats stats;
+
+#define stat_add(field, val) __atomic_add_fetch(&stats.field, val, __ATOMIC_RELAXED)
+#define stat_read(field) __atomic_load_n(&stats.field, __ATOMIC_RELAXED)
+
+static struct sockaddr_storage load_addr;
+static socklen_t load_addrlen;
+
+static volatile bool load_stop;
+static int storm_gen;
+static int load_loglevel = LOG_NOTICE;
+
+/* Logs go to stderr leaving stdout for the summary */
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= load_loglevel) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+static inline uint64_t load_rand(load_thread_t *thr)
+{
+	uint64_t x = thr->rand;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return thr->rand = x;
+}
+
+/* Replace the first %d in a user or worker pattern with num */
+static void expand_pattern(char *buf, const int len, const char *pattern, const int num)
+{
+	const char *pos = strstr(pattern, "%d");
+
+	if (!pos)
+		snprintf(buf, len, "%s", pattern);
+	else
+		snprintf(buf, len, "%.*s%d%s", (int)(pos - pattern), pattern, num, pos + 2);
+}
+
+static void client_arm(load_client_t *client, const int op)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.data.ptr = client;
+	if (client->state == LS_CONNECTING)
+		event.events = EPOLLOUT;
+	else {
+		event.events = EPOLLIN | EPOLLRDHUP;
+		if (client->wlen)
+			event.events |= EPOLLOUT;
+		if (client->slow)
+			event.events |= EPOLLONESHOT;
+	}
+	if (unlikely(epoll_ctl(client->thread->epfd, op, client->fd, &event)))
+		LOGWARNING("Failed to epoll_ctl client %d: %s", client->id, strerror(errno));
+}
+
+/* Write what the socket will take now and buffer the rest for EPOLLOUT.
+ * Write errors are left for the read side to notice as a close. */
+static void client_write(load_client_t *client, const char *buf, int len)
+{
+	int ret;
+
+	if (!client->wlen) {
+		ret = write(client->fd, buf, len);
+		if (ret == len)
+			return;
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return;
+			ret = 0;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	client->wbuf = realloc(client->wbuf, client->wlen + len);
+	if (unlikely(!client->wbuf))
+		quit(1, "Failed to realloc write buffer of %d bytes", client->wlen + len);
+	memcpy(client->wbuf + client->wlen, buf, len);
+	client->wlen += len;
+	if (!client->slow || client->armed)
+		client_arm(client, EPOLL_CTL_MOD);
+}
+
+static bool client_flush(load_client_t *client)
+{
+	int ret;
+
+	ret = write(client->fd, client->wbuf, client->wlen);
+	if (ret < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	client->wlen -= ret;
+	memmove(client->wbuf, client->wbuf + ret, client->wlen);
+	if (!client->wlen)
+		client_arm(client, EPOLL_CTL_MOD);
+	return true;
+}
+
+static void client_send(load_client_t *client, const enum load_req req, const int kind,
+			const char *method, const char *params)
+{
+	int64_t id = client->msgid++;
+	int slot = id % LOAD_PENDING, len;
+	char buf[512];
+
+	client->ids[slot] = id;
+	client->req[slot] = req;
+	client->kind[slot] = kind;
+	client->sent[slot] = lat_now();
+	len = snprintf(buf, sizeof(buf), "{\"id\":%"PRId64",\"method\":\"%s\",\"params\":%s}\n",
+		       id, method, params);
+	client_write(client, buf, len);
+}
+
+static void client_subscribe(load_client_t *client)
+{
+	client->state = LS_SUBSCRIBING;
+	client_send(client, LR_SUBSCRIBE, 0, "mining.subscribe", "[\"ckload/" VERSION "\"]");
+}
+
+static void free_job(load_job_t *job)
+{
+	dealloc(job->coinb1);
+	dealloc(job->coinb2);
+	job->valid = false;
+}
+
+static void client_connect(load_client_t *client, const int64_t now)
+{
+	int rcvbuf = 4096;
+
+	client->wake = 0;
+	client->fd = socket(load_addr.ss_family, SOCK_STREAM, 0);
+	if (unlikely(client->fd < 0)) {
+		LOGWARNING("Failed to open socket for client %d: %s", client->id, strerror(errno));
+		client->wake = now + 1000000000LL;
+		return;
+	}
+	noblock_socket(client->fd);
+	if (client->slow)
+		setsockopt(client->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	client->connect_start = now;
+	client->state = LS_CONNECTING;
+	if (connect(client->fd, (struct sockaddr *)&load_addr, load_addrlen) && !sock_connecting()) {
+		LOGINFO("Client %d failed to connect: %s", client->id, strerror(errno));
+		stat_add(connfails, 1);
+		Close(client->fd);
+		client->state = LS_IDLE;
+		client->wake = now + 1000000000LL;
+		return;
+	}
+	client->armed = true;
+	client_arm(client, EPOLL_CTL_ADD);
+}
+
+/* Close a client, reconnecting it after delay ms */
+static void client_drop(load_client_t *client, const int delay)
+{
+	int i;
+
+	if (client->state == LS_MINING)
+		stat_add(mining, -1);
+	Close(client->fd);
+	client->state = LS_IDLE;
+	client->rlen = client->wlen = 0;
+	client->diff = 0;
+	client->version_mask = 0;
+	client->lastshare[0] = '\0';
+	free_job(&client->job);
+	free_job(&client->oldjob);
+	for (i = 0; i < LOAD_PENDING; i++)
+		client->req[i] = LR_NONE;
+	client->wake = lat_now() + (int64_t)delay * 1000000;
+}
+
+static void connect_done(load_client_t *client)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		LOGINFO("Client %d failed to connect: %s", client->id, strerror(err));
+		stat_add(connfails, 1);
+		client_drop(client, 1000);
+		return;
+	}
+	lat_observe(&stats.connect, lat_now() - client->connect_start);
+	stat_add(connects, 1);
+	if (conf.vroll) {
+		client->state = LS_CONFIGURING;
+		client_arm(client, EPOLL_CTL_MOD);
+		client_send(client, LR_CONFIGURE, 0, "mining.configure",
+			    "[[\"version-rolling\"],{\"version-rolling.mask\":\"1fffe000\","
+			    "\"version-rolling.min-bit-count\":2}]");
+	} else {
+		client->state = LS_SUBSCRIBING;
+		client_arm(client, EPOLL_CTL_MOD);
+		client_subscribe(client);
+	}
+}
+
+static bool parse_notify(load_client_t *client, json_t *params)
+{
+	const char *jobid, *prevhash, *coinb1, *coinb2, *version, *nbit, *ntime;
+	char header[161];
+	json_t *merkle_arr;
+	load_job_t *job;
+	size_t i;
+
+	jobid = json_string_value(json_array_get(params, 0));
+	prevhash = json_string_value(json_array_get(params, 1));
+	coinb1 = json_string_value(json_array_get(params, 2));
+	coinb2 = json_string_value(json_array_get(params, 3));
+	merkle_arr = json_array_get(params, 4);
+	version = json_string_value(json_array_get(params, 5));
+	nbit = json_string_value(json_array_get(params, 6));
+	ntime = json_string_value(json_array_get(params, 7));
+	if (unlikely(!jobid || !prevhash || !coinb1 || !coinb2 || !json_is_array(merkle_arr) ||
+		     !version || !nbit || !ntime || strlen(jobid) >= 24 || strlen(prevhash) != 64 ||
+		     strlen(version) != 8 || strlen(nbit) != 8 || strlen(ntime) != 8 ||
+		     json_array_size(merkle_arr) > LOAD_MERKLES)) {
+		LOGWARNING("Client %d got invalid notify", client->id);
+		return false;
+	}
+
+	/* Keep the job from before a block change for stale shares */
+	if (json_is_true(json_array_get(params, 8)) && client->job.valid) {
+		free_job(&client->oldjob);
+		memcpy(&client->oldjob, &client->job, sizeof(load_job_t));
+		client->job.coinb1 = client->job.coinb2 = NULL;
+	}
+	job = &client->job;
+	free_job(job);
+
+	snprintf(job->jobid, 24, "%s", jobid);
+	snprintf(job->ntime, 12, "%s", ntime);
+	job->coinb1len = strlen(coinb1) / 2;
+	job->coinb1 = ckalloc(job->coinb1len + 1);
+	job->coinb2len = strlen(coinb2) / 2;
+	job->coinb2 = ckalloc(job->coinb2len + 1);
+	if (!hex2bin(job->coinb1, coinb1, job->coinb1len) ||
+	    !hex2bin(job->coinb2, coinb2, job->coinb2len))
+		goto out_invalid;
+	job->nmerkles = json_array_size(merkle_arr);
+	for (i = 0; i < (size_t)job->nmerkles; i++) {
+		const char *merkle = json_string_value(json_array_get(merkle_arr, i));
+
+		if (!merkle || strlen(merkle) != 64 || !hex2bin(job->merkles[i], merkle, 32))
+			goto out_invalid;
+	}
+	/* The same layout as the pool's cached header, the merkle root and
+	 * nonce being filled in per share */
+	snprintf(header, 161, "%s%s%064d%s%s%08d", version, prevhash, 0, ntime, nbit, 0);
+	if (!hex2bin(job->header, header, 80))
+		goto out_invalid;
+	job->valid = true;
+	stat_add(notifies, 1);
+	return true;
+
+out_invalid:
+	LOGWARNING("Client %d got invalid notify hex", client->id);
+	free_job(job);
+	return false;
+}
+
+/* Returns false if the client should be dropped */
+static bool parse_method(load_client_t *client, const char *method, json_t *params)
+{
+	const char *mask;
+
+	if (!strcmp(method, "mining.notify"))
+		return parse_notify(client, params);
+	if (!strcmp(method, "mining.set_difficulty")) {
+		client->diff = json_number_value(json_array_get(params, 0));
+		return true;
+	}
+	if (!strcmp(method, "mining.set_version_mask")) {
+		mask = json_string_value(json_array_get(params, 0));
+		if (mask && conf.vroll)
+			sscanf(mask, "%x", &client->version_mask);
+		return true;
+	}
+	if (!strcmp(method, "client.reconnect")) {
+		LOGINFO("Client %d asked to reconnect", client->id);
+		return false;
+	}
+	return true;
+}
+
+static bool parse_response(load_client_t *client, json_t *val)
+{
+	json_t *id_val = json_object_get(val, "id"), *res_val, *err_val;
+	const char *enonce1;
+	int slot, kind, res;
+	enum load_req req;
+	int64_t id, ns;
+
+	if (!json_is_integer(id_val))
+		return true;
+	id = json_integer_value(id_val);
+	slot = id % LOAD_PENDING;
+	if (id < 0 || client->ids[slot] != id || client->req[slot] == LR_NONE)
+		return true;
+	req = client->req[slot];
+	client->req[slot] = LR_NONE;
+	ns = lat_now() - client->sent[slot];
+	res_val = json_object_get(val, "result");
+	err_val = json_object_get(val, "error");
+
+	switch (req) {
+		case LR_CONFIGURE:
+			lat_observe(&stats.configure, ns);
+			if (json_is_true(json_object_get(res_val, "version-rolling"))) {
+				enonce1 = json_string_value(json_object_get(res_val, "version-rolling.mask"));
+				if (enonce1)
+					sscanf(enonce1, "%x", &client->version_mask);
+			}
+			client_subscribe(client);
+			break;
+		case LR_SUBSCRIBE:
+			lat_observe(&stats.subscribe, ns);
+			enonce1 = json_string_value(json_array_get(res_val, 1));
+			client->nonce2len = json_integer_value(json_array_get(res_val, 2));
+			if (!enonce1 || strlen(enonce1) > 32 || client->nonce2len < 1 ||
+			    client->nonce2len > 8) {
+				LOGWARNING("Client %d got invalid subscribe response", client->id);
+				return false;
+			}
+			client->enonce1len = strlen(enonce1) / 2;
+			if (!hex2bin(client->enonce1, enonce1, client->enonce1len))
+				return false;
+			client->state = LS_AUTHORISING;
+			{
+				char params[256];
+
+				snprintf(params, 256, "[\"%s\",\"%s\"]", client->username, conf.password);
+				client_send(client, LR_AUTHORISE, 0, "mining.authorize", params);
+			}
+			break;
+		case LR_AUTHORISE:
+			lat_observe(&stats.authorise, ns);
+			if (!json_is_true(res_val)) {
+				LOGWARNING("Client %d failed to authorise as %s", client->id,
+					   client->username);
+				stat_add(authfails, 1);
+				return false;
+			}
+			stat_add(authorised, 1);
+			stat_add(mining, 1);
+			client->state = LS_MINING;
+			break;
+		case LR_SUBMIT:
+			lat_observe(&stats.submit, ns);
+			kind = client->kind[slot];
+			if (json_is_true(res_val))
+				res = SR_ACCEPTED;
+			else {
+				switch (json_integer_value(json_array_get(err_val, 0))) {
+					case 21:
+						res = SR_STALE;
+						break;
+					case 22:
+						res = SR_DUPE;
+						break;
+					case 23:
+						res = SR_LOWDIFF;
+						break;
+					default:
+						res = SR_REJECTED;
+						break;
+				}
+			}
+			stat_add(results[kind][res], 1);
+			break;
+		default:
+			break;
+	}
+	return true;
+}
+
+static bool parse_line(load_client_t *client, const char *line)
+{
+	json_t *val, *method_val;
+	json_error_t err;
+	bool ret;
+
+	val = json_loads(line, 0, &err);
+	if (unlikely(!val)) {
+		LOGWARNING("Client %d got invalid json: %s", client->id, err.text);
+		return false;
+	}
+	method_val = json_object_get(val, "method");
+	if (json_is_string(method_val))
+		ret = parse_method(client, json_string_value(method_val), json_object_get(val, "params"));
+	else
+		ret = parse_response(client, val);
+	json_decref(val);
+	return ret;
+}
+
+/* Read and parse every complete line waiting, or just one read's worth for
+ * slow readers */
+static bool client_read(load_client_t *client)
+{
+	char *start, *eol;
+	int ret;
+
+	while (42) {
+		if (client->rlen + 1 >= client->rsize) {
+			if (client->rsize >= LOAD_MAXBUF) {
+				LOGWARNING("Client %d got an overlong line", client->id);
+				return false;
+			}
+			client->rsize *= 2;
+			client->rbuf = realloc(client->rbuf, client->rsize);
+			if (unlikely(!client->rbuf))
+				quit(1, "Failed to realloc read buffer of %d bytes", client->rsize);
+		}
+		ret = read(client->fd, client->rbuf + client->rlen, client->rsize - client->rlen - 1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		if (!ret)
+			return false;
+		client->rlen += ret;
+		client->rbuf[client->rlen] = '\0';
+		start = client->rbuf;
+		while ((eol = strchr(start, '\n'))) {
+			*eol = '\0';
+			if (!parse_line(client, start))
+				return false;
+			start = eol + 1;
+		}
+		client->rlen -= start - client->rbuf;
+		memmove(client->rbuf, start, client->rlen);
+		if (client->slow)
+			return true;
+	}
+}
+
+static void client_event(load_client_t *client, const uint32_t events)
+{
+	/* Dropped by an earlier event in this batch */
+	if (client->fd < 0)
+		return;
+	if (client->state == LS_CONNECTING) {
+		connect_done(client);
+		return;
+	}
+	if ((events & EPOLLOUT) && client->wlen && !client_flush(client))
+		goto out_drop;
+	if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !client_read(client))
+		goto out_drop;
+	if (client->slow) {
+		client->armed = false;
+		client->wake = lat_now() + (int64_t)conf.slow_ms * 1000000;
+	}
+	return;
+
+out_drop:
+	stat_add(disconnects, 1);
+	client_drop(client, 1000);
+}
+
+/* Spread a counter over the bits the pool lets us roll */
+static uint32_t version_bits(uint32_t mask, uint32_t count)
+{
+	uint32_t ret = 0;
+	int i;
+
+	for (i = 0; i < 32 && count; i++) {
+		if (!(mask & (1U << i)))
+			continue;
+		if (count & 1)
+			ret |= 1U << i;
+		count >>= 1;
+	}
+	return ret;
+}
+
+/* Build the coinbase and hash it up the merkle branches into the header as
+ * the pool's submission_diff does, leaving the header byte swapped ready
+ * for hashing */
+static void share_header(const load_client_t *client, const load_job_t *job, const uint64_t nonce2,
+			 const uint32_t vbits, uchar *swap)
+{
+	uchar merkle_root[32], merkle_sha[64], data[80];
+	uchar *coinbase;
+	int cblen, i;
+
+	coinbase = alloca(job->coinb1len + client->enonce1len + client->nonce2len + job->coinb2len);
+	memcpy(coinbase, job->coinb1, job->coinb1len);
+	cblen = job->coinb1len;
+	memcpy(coinbase + cblen, client->enonce1, client->enonce1len);
+	cblen += client->enonce1len;
+	memcpy(coinbase + cblen, &nonce2, client->nonce2len);
+	cblen += client->nonce2len;
+	memcpy(coinbase + cblen, job->coinb2, job->coinb2len);
+	cblen += job->coinb2len;
+
+	gen_hash(coinbase, merkle_root, cblen);
+	memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < job->nmerkles; i++) {
+		memcpy(merkle_sha + 32, job->merkles[i], 32);
+		gen_hash(merkle_sha, merkle_root, 64);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
+	flip_32(merkle_root, merkle_sha);
+
+	memcpy(data, job->header, 80);
+	memcpy(data + 36, merkle_root, 32);
+	if (vbits)
+		*(uint32_t *)data |= htobe32(vbits);
+	flip_80(swap, data);
+}
+
+/* Search for a nonce meeting diff, giving up after maxhashes. Returns the
+ * nonce in the byte swapped header. */
+static uint32_t mine_share(load_thread_t *thr, uchar *swap, const double diff)
+{
+	uint32_t *swap32 = (uint32_t *)swap, nonce = load_rand(thr), n;
+	uchar hash1[32], hash[32];
+
+	for (n = 1; n <= conf.maxhashes; n++, nonce++) {
+		swap32[19] = nonce;
+		sha256(swap, 80, hash1);
+		sha256(hash1, 32, hash);
+		if (target256_meets_diff(hash, diff))
+			break;
+	}
+	stat_add(hashes, n > conf.maxhashes ? conf.maxhashes : n);
+	return nonce;
+}
+
+static void submit_share(load_thread_t *thr, load_client_t *client, int kind)
+{
+	char nonce2hex[20], noncehex[12], vhex[16] = "", params[256];
+	load_job_t *job = &client->job;
+	const char *jobid = job->jobid;
+	uint32_t nonce, vbits = 0;
+	uint64_t nonce2;
+	uchar swap[80];
+
+	if (kind == SK_DUPE && !client->lastshare[0])
+		kind = SK_VALID;
+	stat_add(sent[kind], 1);
+	if (kind == SK_DUPE) {
+		client_send(client, LR_SUBMIT, kind, "mining.submit", client->lastshare);
+		return;
+	}
+	/* Without a block change yet, use a job id the pool never issued */
+	if (kind == SK_STALE) {
+		if (client->oldjob.valid)
+			jobid = (job = &client->oldjob)->jobid;
+		else
+			jobid = "ffffffffffffffff";
+	}
+
+	nonce2 = client->nonce2++;
+	__bin2hex(nonce2hex, &nonce2, client->nonce2len);
+	if (client->version_mask) {
+		vbits = version_bits(client->version_mask, ++client->vroll);
+		snprintf(vhex, 16, ",\"%08x\"", vbits);
+	}
+	share_header(client, job, nonce2, vbits, swap);
+	if (kind == SK_INVALID)
+		nonce = load_rand(thr);
+	else
+		nonce = mine_share(thr, swap, client->diff);
+	nonce = bswap_32(nonce);
+	__bin2hex(noncehex, &nonce, 4);
+
+	snprintf(params, 256, "[\"%s\",\"%s\",\"%s\",\"%s\",\"%s\"%s]", client->username, jobid,
+		 nonce2hex, job->ntime, noncehex, vhex);
+	if (kind == SK_VALID)
+		strcpy(client->lastshare, params);
+	client_send(client, LR_SUBMIT, kind, "mining.submit", params);
+}
+
+static int share_kind(load_thread_t *thr)
+{
+	double pct = (double)(load_rand(thr) % 10000) / 100;
+
+	if (pct < conf.dupe)
+		return SK_DUPE;
+	pct -= conf.dupe;
+	if (pct < conf.stale)
+		return SK_STALE;
+	pct -= conf.stale;
+	if (pct < conf.invalid)
+		return SK_INVALID;
+	return SK_VALID;
+}
+
+static load_client_t *next_miner(load_thread_t *thr)
+{
+	int i;
+
+	for (i = 0; i < thr->nclients; i++) {
+		load_client_t *client = &thr->clients[thr->next++ % thr->nclients];
+
+		if (client->state == LS_MINING && client->job.valid && client->diff > 0 &&
+		    !client->slow)
+			return client;
+	}
+	return NULL;
+}
+
+/* Submit whatever shares are due, round robin across the mining clients,
+ * returning to epoll after a scan interval's worth of mining so responses are
+ * still read when hashing can't keep up */
+static void submit_due(load_thread_t *thr)
+{
+	int64_t now = lat_now(), end = now + LOAD_SCAN_NS;
+	load_client_t *client;
+
+	/* Don't try to catch up more than a second's worth when mining can't
+	 * keep up with the rate */
+	if (now - thr->next_submit > 1000000000LL) {
+		stat_add(behind, 1);
+		thr->next_submit = now;
+	}
+	while (thr->next_submit <= now && now < end && !load_stop) {
+		client = next_miner(thr);
+		if (!client) {
+			thr->next_submit = now + thr->interval_ns;
+			break;
+		}
+		submit_share(thr, client, share_kind(thr));
+		thr->next_submit += thr->interval_ns;
+		now = lat_now();
+	}
+}
+
+/* Reconnect idle clients, drop clients in a reconnect storm and rearm slow
+ * readers that are due another read */
+static void client_scan(load_thread_t *thr, const int64_t now)
+{
+	int storm = __atomic_load_n(&storm_gen, __ATOMIC_RELAXED), i;
+	bool storming = storm != thr->storm;
+
+	thr->storm = storm;
+	for (i = 0; i < thr->nclients; i++) {
+		load_client_t *client = &thr->clients[i];
+
+		if (client->state == LS_IDLE) {
+			if (client->wake <= now)
+				client_connect(client, now);
+			continue;
+		}
+		if (storming && client->state != LS_CONNECTING &&
+		    load_rand(thr) % 10000 < conf.storm_pct * 100) {
+			stat_add(disconnects, 1);
+			client_drop(client, 0);
+			continue;
+		}
+		if (client->slow && !client->armed && client->wake <= now) {
+			client->armed = true;
+			client_arm(client, EPOLL_CTL_MOD);
+		}
+	}
+}
+
+static void *load_thread(void *arg)
+{
+	struct epoll_event events[LOAD_EVENTS];
+	load_thread_t *thr = arg;
+	int64_t now, next_scan = 0;
+	char name[16];
+	int i;
+
+	snprintf(name, 16, "load%d", thr->id);
+	rename_proc(name);
+	thr->next_submit = lat_now();
+	while (!load_stop) {
+		int nfds, timeout = LOAD_SCAN_NS / 1000000;
+
+		now = lat_now();
+		if (thr->interval_ns && thr->next_submit - now < LOAD_SCAN_NS)
+			timeout = thr->next_submit > now ? (thr->next_submit - now) / 1000000 : 0;
+		nfds = epoll_wait(thr->epfd, events, LOAD_EVENTS, timeout);
+		for (i = 0; i < nfds; i++)
+			client_event(events[i].data.ptr, events[i].events);
+		now = lat_now();
+		if (now >= next_scan) {
+			client_scan(thr, now);
+			next_scan = now + LOAD_SCAN_NS;
+		}
+		if (thr->interval_ns)
+			submit_due(thr);
+	}
+	for (i = 0; i < thr->nclients; i++)
+		client_drop(&thr->clients[i], 0);
+	return NULL;
+}
+
+static uint64_t kind_results(const int kind)
+{
+	uint64_t ret = 0;
+	int res;
+
+	for (res = 0; res < SR_RESULTS; res++)
+		ret += stat_read(results[kind][res]);
+	return ret;
+}
+
+static json_t *load_summary(const double elapsed)
+{
+	json_t *val = json_object(), *subval;
+	int kind, res;
+
+	json_set_double(val, "elapsed", elapsed);
+	json_set_int(val, "clients", conf.clients);
+	json_set_int(val, "threads", conf.threads);
+	json_set_int64(val, "connects", stat_read(connects));
+	json_set_int64(val, "connfails", stat_read(connfails));
+	json_set_int64(val, "disconnects", stat_read(disconnects));
+	json_set_int64(val, "authorised", stat_read(authorised));
+	json_set_int64(val, "authfails", stat_read(authfails));
+	json_set_int64(val, "storms", stat_read(storms));
+	json_set_int64(val, "notifies", stat_read(notifies));
+	json_set_int64(val, "behind", stat_read(behind));
+	json_set_double(val, "hashrate", elapsed > 0 ? stat_read(hashes) / elapsed : 0);
+
+	subval = json_object();
+	json_set_object(subval, "connect", lat_hist_json(&stats.connect));
+	if (conf.vroll)
+		json_set_object(subval, "configure", lat_hist_json(&stats.configure));
+	json_set_object(subval, "subscribe", lat_hist_json(&stats.subscribe));
+	json_set_object(subval, "authorise", lat_hist_json(&stats.authorise));
+	json_set_object(subval, "submit", lat_hist_json(&stats.submit));
+	json_set_object(val, "latency", subval);
+
+	subval = json_object();
+	for (kind = 0; kind < SK_KINDS; kind++) {
+		uint64_t sent = stat_read(sent[kind]);
+		json_t *kind_val = json_object();
+
+		json_set_int64(kind_val, "sent", sent);
+		for (res = 0; res < SR_RESULTS; res++)
+			json_set_int64(kind_val, share_results[res], stat_read(results[kind][res]));
+		json_set_int64(kind_val, "unanswered", sent - kind_results(kind));
+		json_set_object(subval, share_kinds[kind], kind_val);
+	}
+	json_set_object(val, "shares", subval);
+	return val;
+}
+
+static void load_progress(uint64_t *last_sent, uint64_t *last_accepted, uint64_t *last_hashes,
+			  const double interval)
+{
+	uint64_t sent = 0, accepted = 0, rejected = 0, hashes;
+	lat_hist_t submit;
+	int kind, res;
+
+	for (kind = 0; kind < SK_KINDS; kind++) {
+		sent += stat_read(sent[kind]);
+		accepted += stat_read(results[kind][SR_ACCEPTED]);
+		for (res = SR_REJECTED; res < SR_RESULTS; res++)
+			rejected += stat_read(results[kind][res]);
+	}
+	hashes = stat_read(hashes);
+	lat_hist_copy(&submit, &stats.submit);
+	LOGNOTICE("%"PRIu64"/%d mining, %.1f shares/s, %.1f accepted/s, %"PRIu64" rejected, "
+		  "submit p50 %.2fms p99 %.2fms, %.1f kH/s",
+		  stat_read(mining), conf.clients, (sent - *last_sent) / interval,
+		  (accepted - *last_accepted) / interval, rejected,
+		  (double)lat_percentile(&submit, 50) / 1000000,
+		  (double)lat_percentile(&submit, 99) / 1000000,
+		  (hashes - *last_hashes) / interval / 1000);
+	*last_sent = sent;
+	*last_accepted = accepted;
+	*last_hashes = hashes;
+}
+
+static void sighandler(const int __maybe_unused sig)
+{
+	load_stop = true;
+}
+
+static bool resolve_url(char *url)
+{
+	struct addrinfo hints, *res;
+	char *host = NULL, *port = NULL;
+	bool ret = false;
+
+	if (!extract_sockaddr(url, &host, &port))
+		return ret;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res))
+		goto out;
+	memcpy(&load_addr, res->ai_addr, res->ai_addrlen);
+	load_addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+	ret = true;
+out:
+	free(host);
+	free(port);
+	return ret;
+}
+
+/* Each client needs a descriptor so raise the soft limit as far as allowed */
+static void raise_nofile(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim))
+		return;
+	if (rlim.rlim_cur < (rlim_t)conf.clients + 64) {
+		rlim.rlim_cur = conf.clients + 64;
+		if (rlim.rlim_max != RLIM_INFINITY && rlim.rlim_cur > rlim.rlim_max)
+			rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+	if (rlim.rlim_cur < (rlim_t)conf.clients + 64)
+		LOGWARNING("Open file limit %lu is too low for %d clients",
+			   (unsigned long)rlim.rlim_cur, conf.clients);
+}
+
+static struct option long_options[] = {
+	{"url",		required_argument,	0,	'a'},
+	{"clients",	required_argument,	0,	'c'},
+	{"dupe",	required_argument,	0,	'D'},
+	{"duration",	required_argument,	0,	'd'},
+	{"help",	no_argument,		0,	'h'},
+	{"invalid",	required_argument,	0,	'I'},
+	{"interval",	required_argument,	0,	'i'},
+	{"loglevel",	required_argument,	0,	'l'},
+	{"maxhashes",	required_argument,	0,	'm'},
+	{"slowms",	required_argument,	0,	'M'},
+	{"password",	required_argument,	0,	'p'},
+	{"stormpct",	required_argument,	0,	'P'},
+	{"rate",	required_argument,	0,	'r'},
+	{"storm",	required_argument,	0,	'R'},
+	{"stale",	required_argument,	0,	'S'},
+	{"threads",	required_argument,	0,	't'},
+	{"user",	required_argument,	0,	'u'},
+	{"users",	required_argument,	0,	'U'},
+	{"versionroll",	no_argument,		0,	'v'},
+	{"worker",	required_argument,	0,	'w'},
+	{"slow",	required_argument,	0,	'W'},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char **argv)
+{
+	uint64_t last_sent = 0, last_accepted = 0, last_hashes = 0;
+	int64_t start, now, last_report, next_storm = 0;
+	load_thread_t *threads;
+	struct sigaction handler;
+	int c, i = 0, j;
+	char *dump;
+	json_t *val;
+
+	while ((c = getopt_long(argc, argv, "a:c:D:d:hI:i:l:m:M:p:P:r:R:S:t:u:U:vw:W:",
+				long_options, &i)) != -1) {
+		switch(c) {
+			case 'a':
+				conf.url = optarg;
+				break;
+			case 'c':
+				conf.clients = atoi(optarg);
+				break;
+			case 'D':
+				conf.dupe = atof(optarg);
+				break;
+			case 'd':
+				conf.duration = atoi(optarg);
+				break;
+			case 'h':
+				for (j = 0; long_options[j].val; j++) {
+					struct option *jopt = &long_options[j];
+
+					if (jopt->has_arg) {
+						char *upper = alloca(strlen(jopt->name) + 1);
+						int offset = 0;
+
+						do {
+							upper[offset] = toupper(jopt->name[offset]);
+						} while (upper[offset++] != '\0');
+						printf("-%c %s | --%s %s\n", jopt->val,
+						       upper, jopt->name, upper);
+					} else
+						printf("-%c | --%s\n", jopt->val, jopt->name);
+				}
+				exit(0);
+			case 'I':
+				conf.invalid = atof(optarg);
+				break;
+			case 'i':
+				conf.interval = atoi(optarg);
+				break;
+			case 'l':
+				load_loglevel = atoi(optarg);
+				break;
+			case 'm':
+				conf.maxhashes = strtoul(optarg, NULL, 10);
+				break;
+			case 'M':
+				conf.slow_ms = atoi(optarg);
+				break;
+			case 'p':
+				conf.password = optarg;
+				break;
+			case 'P':
+				conf.storm_pct = atof(optarg);
+				break;
+			case 'r':
+				conf.rate = atof(optarg);
+				break;
+			case 'R':
+				conf.storm = atoi(optarg);
+				break;
+			case 'S':
+				conf.stale = atof(optarg);
+				break;
+			case 't':
+				conf.threads = atoi(optarg);
+				break;
+			case 'u':
+				conf.user = optarg;
+				break;
+			case 'U':
+				conf.users = atoi(optarg);
+				break;
+			case 'v':
+				conf.vroll = true;
+				break;
+			case 'w':
+				conf.worker = optarg;
+				break;
+			case 'W':
+				conf.slow = atof(optarg);
+				break;
+		}
+	}
+	if (!conf.url)
+		conf.url = "127.0.0.1:3333";
+	if (!conf.user)
+		conf.user = "ckload";
+	if (!conf.worker)
+		conf.worker = "%d";
+	if (!conf.password)
+		conf.password = "x";
+	if (conf.clients < 1 || conf.threads < 1 || conf.users < 1 || conf.interval < 1 ||
+	    conf.maxhashes < 1)
+		quit(1, "Clients, threads, users, interval and maxhashes must be positive");
+	if (conf.threads > conf.clients)
+		conf.threads = conf.clients;
+	if (conf.dupe + conf.stale + conf.invalid > 100)
+		quit(1, "Duplicate, stale and invalid percentages add up to more than 100");
+	if (!resolve_url(conf.url))
+		quit(1, "Failed to resolve url %s", conf.url);
+	raise_nofile();
+
+	signal(SIGPIPE, SIG_IGN);
+	handler.sa_handler = &sighandler;
+	handler.sa_flags = 0;
+	sigemptyset(&handler.sa_mask);
+	sigaction(SIGTERM, &handler, NULL);
+	sigaction(SIGINT, &handler, NULL);
+
+	/* Clients are dealt out to the threads in turn */
+	threads = ckzalloc(sizeof(load_thread_t) * conf.threads);
+	for (i = 0; i < conf.threads; i++) {
+		load_thread_t *thr = &threads[i];
+
+		thr->id = i;
+		thr->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (thr->epfd < 0)
+			quit(1, "Failed to create epoll fd");
+		thr->nclients = conf.clients / conf.threads + (i < conf.clients % conf.threads);
+		thr->clients = ckzalloc(sizeof(load_client_t) * thr->nclients);
+		thr->rand = 0x9e3779b97f4a7c15ULL * (i + 1) ^ lat_now();
+		if (conf.rate > 0)
+			thr->interval_ns = 1000000000.0 * conf.threads / conf.rate;
+		for (j = 0; j < thr->nclients; j++) {
+			load_client_t *client = &thr->clients[j];
+			char worker[64];
+
+			client->id = j * conf.threads + i;
+			client->fd = -1;
+			client->thread = thr;
+			client->rsize = LOAD_BUFSIZ;
+			client->rbuf = ckalloc(client->rsize);
+			client->slow = load_rand(thr) % 10000 < conf.slow * 100;
+			expand_pattern(client->username, 128, conf.user, client->id % conf.users);
+			expand_pattern(worker, 64, conf.worker, client->id);
+			if (*worker) {
+				strncat(client->username, ".", 127 - strlen(client->username));
+				strncat(client->username, worker, 127 - strlen(client->username));
+			}
+		}
+	}
+
+	LOGNOTICE("Starting %d clients on %d threads to %s at %.1f shares/s", conf.clients,
+		  conf.threads, conf.url, conf.rate);
+	start = last_report = lat_now();
+	if (conf.storm)
+		next_storm = start + (int64_t)conf.storm * 1000000000;
+	for (i = 0; i < conf.threads; i++)
+		create_pthread(&threads[i].pth, load_thread, &threads[i]);
+
+	while (!load_stop) {
+		cksleep_ms(100);
+		now = lat_now();
+		if (conf.duration && now - start >= (int64_t)conf.duration * 1000000000)
+			break;
+		if (next_storm && now >= next_storm) {
+			LOGNOTICE("Reconnect storm dropping %.0f%% of clients", conf.storm_pct);
+			stat_add(storms, 1);
+			__atomic_add_fetch(&storm_gen, 1, __ATOMIC_RELAXED);
+			next_storm += (int64_t)conf.storm * 1000000000;
+		}
+		if (now - last_report >= (int64_t)conf.interval * 1000000000) {
+			load_progress(&last_sent, &last_accepted, &last_hashes,
+				      (double)(now - last_report) / 1000000000);
+			last_report = now;
+		}
+	}
+	load_stop = true;
+	for (i = 0; i < conf.threads; i++)
+		join_pthread(threads[i].pth);
+
+	val = load_summary((double)(lat_now() - start) / 1000000000);
+	dump = json_dumps(val, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
+	printf("%s\n", dump);
+	free(dump);
+	json_decref(val);
+	return 0;
+}
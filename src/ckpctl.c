@@ -0,0 +1,151 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "ckpctl.h"
+
+/* Write one length prefixed frame in a single write */
+bool ckpctl_write_frame(int sockd, const char *buf, const uint32_t len)
+{
+	uint32_t msglen = htole32(len);
+	char *frame;
+	bool ret;
+
+	frame = ckalloc(len + 4);
+	memcpy(frame, &msglen, 4);
+	if (len)
+		memcpy(frame + 4, buf, len);
+	ret = write_length(sockd, frame, len + 4) == (int)len + 4;
+	free(frame);
+	return ret;
+}
+
+/* Read one frame, waiting up to timeout seconds for it to start or forever if
+ * timeout is not positive. Returns an allocated nul terminated buffer with
+ * the payload length stored in len, or NULL on timeout or disconnect. */
+char *ckpctl_read_frame(int sockd, uint32_t *len, const float timeout)
+{
+	uint32_t msglen;
+	char *buf;
+
+	if (timeout > 0 && wait_read_select(sockd, timeout) < 1)
+		return NULL;
+	if (read_length(sockd, &msglen, 4) < 4)
+		return NULL;
+	msglen = le32toh(msglen);
+	if (unlikely(msglen > CKPCTL_MAXFRAME)) {
+		LOGWARNING("Invalid control frame length %u", msglen);
+		return NULL;
+	}
+	buf = ckalloc(msglen + 1);
+	if (msglen && read_length(sockd, buf, msglen) < (int)msglen) {
+		free(buf);
+		return NULL;
+	}
+	buf[msglen] = '\0';
+	*len = msglen;
+	return buf;
+}
+
+/* Split a "<tag> <target> <command>" request in place */
+bool ckpctl_parse_request(char *buf, uint32_t *tag, char **target, char **cmd)
+{
+	char *endp;
+
+	*tag = strtoul(buf, &endp, 10);
+	if (endp == buf || *endp != ' ')
+		return false;
+	*target = endp + 1;
+	endp = strchr(*target, ' ');
+	if (!endp || endp == *target)
+		return false;
+	*endp = '\0';
+	*cmd = endp + 1;
+	return **cmd != '\0';
+}
+
+ckpctl_t *ckpctl_open(const char *path)
+{
+	ckpctl_t *ctl;
+	int sockd;
+
+	sockd = open_unix_client(path);
+	if (sockd < 0)
+		return NULL;
+	ctl = ckzalloc(sizeof(ckpctl_t));
+	ctl->sockd = sockd;
+	return ctl;
+}
+
+void ckpctl_close(ckpctl_t *ctl)
+{
+	if (!ctl)
+		return;
+	Close(ctl->sockd);
+	free(ctl);
+}
+
+/* Send a request without waiting for its reply. Returns its tag or -1 if the
+ * connection has failed. */
+int64_t ckpctl_send(ckpctl_t *ctl, const char *target, const char *cmd)
+{
+	char *buf;
+	int len;
+
+	ctl->tag++;
+	ASPRINTF(&buf, "%u %s %s", ctl->tag, target, cmd);
+	len = strlen(buf);
+	if (!ckpctl_write_frame(ctl->sockd, buf, len)) {
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	ctl->pending++;
+	return ctl->tag;
+}
+
+/* Receive the next reply, storing its tag. Returns the allocated response
+ * without the tag, or NULL on failure. */
+char *ckpctl_recv(ckpctl_t *ctl, uint32_t *tag, const float timeout)
+{
+	char *buf, *endp, *ret;
+	uint32_t len;
+
+	buf = ckpctl_read_frame(ctl->sockd, &len, timeout);
+	if (!buf)
+		return NULL;
+	ctl->pending--;
+	*tag = strtoul(buf, &endp, 10);
+	if (endp == buf) {
+		LOGWARNING("Untagged control reply %s", buf);
+		free(buf);
+		return NULL;
+	}
+	if (*endp == ' ')
+		endp++;
+	ret = strdup(endp);
+	free(buf);
+	return ret;
+}
+
+/* Send a request and wait for its reply, discarding replies to any earlier
+ * requests that are still pending. */
+char *ckpctl_request(ckpctl_t *ctl, const char *target, const char *cmd, const float timeout)
+{
+	int64_t tag = ckpctl_send(ctl, target, cmd);
+	uint32_t rtag;
+	char *ret;
+
+	if (tag < 0)
+		return NULL;
+	while (42) {
+		ret = ckpctl_recv(ctl, &rtag, timeout);
+		if (!ret || rtag == tag)
+			break;
+		free(ret);
+	}
+	return ret;
+}
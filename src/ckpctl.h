@@ -0,0 +1,34 @@
+/* Persistent control channel: many tagged requests over one unix socket */
+#ifndef CKPCTL_H
+#define CKPCTL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Frames in both directions are a 4 byte little endian length followed by
+ * the payload, as with send_unix_msg, but the socket stays open for further
+ * frames. Requests are "<tag> <target> <command>" where target is one of
+ * listener, stratifier, connector or generator, and each reply is
+ * "<tag> <response>". Replies are returned in the order requests are
+ * received so requests may be pipelined. */
+#define CKPCTL_MAXFRAME 0x10000000
+
+typedef struct ckpctl ckpctl_t;
+
+struct ckpctl {
+	int sockd;
+	uint32_t tag; /* Tag of the last request sent */
+	int pending; /* Requests sent that have no reply yet */
+};
+
+bool ckpctl_write_frame(int sockd, const char *buf, const uint32_t len);
+char *ckpctl_read_frame(int sockd, uint32_t *len, const float timeout);
+bool ckpctl_parse_request(char *buf, uint32_t *tag, char **target, char **cmd);
+
+ckpctl_t *ckpctl_open(const char *path);
+void ckpctl_close(ckpctl_t *ctl);
+int64_t ckpctl_send(ckpctl_t *ctl, const char *target, const char *cmd);
+char *ckpctl_recv(ckpctl_t *ctl, uint32_t *tag, const float timeout);
+char *ckpctl_request(ckpctl_t *ctl, const char *target, const char *cmd, const float timeout);
+
+#endif /* CKPCTL_H */
@@ -19,6 +19,8 @@
 #include <ctype.h>
 
 #include "libckpool.h"
+#include "ckpctl.h"
+#include "evstream.h"
 #include "utlist.h"
 
 struct input_log {
@@ -85,12 +87,14 @@ void mkstamp(char *stamp, size_t siz)
 
 static struct option long_options[] = {
 	{"counter",	no_argument,		0,	'c'},
+	{"control",	no_argument,		0,	'C'},
 	{"help",	no_argument,		0,	'h'},
 	{"loglevel",	required_argument,	0,	'l'},
 	{"name",	required_argument,	0,	'n'},
 	{"sockname",	required_argument,	0,	'N'},
 	{"proxy",	no_argument,		0,	'p'},
 	{"sockdir",	required_argument,	0,	's'},
+	{"subscribe",	no_argument,		0,	'S'},
 	{"timeout1",	required_argument,	0,	't'},
 	{"timeout2",	required_argument,	0,	'T'},
 	{0, 0, 0, 0}
@@ -180,10 +184,97 @@ out:
 	return len;
 }
 
+/* Send the subscription request to an event stream socket and print every
+ * frame received until the stream goes away. JSON frames are printed one per
+ * line so the output can be piped into other tools. */
+static void subscribe(const char *path, const char *req)
+{
+	int sockd, len;
+	char *buf;
+
+	sockd = evstream_subscribe(path, req);
+	if (sockd < 0) {
+		LOGERR("Failed to subscribe to %s", path);
+		return;
+	}
+	while ((buf = evstream_recv(sockd, &len)) != NULL) {
+		if (buf[0] == '{')
+			printf("%s\n", buf);
+		else if (len >= (int)sizeof(struct evstream_binhdr)) {
+			struct evstream_binhdr *hdr = (struct evstream_binhdr *)buf;
+
+			printf("seq %"PRId64" type %u time %"PRId64" len %u\n",
+			       (int64_t)le64toh(hdr->seq), le32toh(hdr->type),
+			       (int64_t)le64toh(hdr->time_us), le32toh(hdr->len));
+		}
+		fflush(stdout);
+		free(buf);
+	}
+	LOGNOTICE("Subscription to %s ended", path);
+	close(sockd);
+}
+
+/* Most control requests left unanswered before we wait for replies when
+ * commands are piped in */
+#define CONTROL_WINDOW 16
+
+/* Read and print the next reply on a control channel */
+static bool control_reply(ckpctl_t *ctl, const int tmo)
+{
+	char stamp[128], *buf;
+	uint32_t tag;
+
+	buf = ckpctl_recv(ctl, &tag, tmo);
+	if (!buf) {
+		LOGERR("Failed to receive control reply");
+		return false;
+	}
+	mkstamp(stamp, sizeof(stamp));
+	LOGMSGSIZ(65536, LOG_NOTICE, "%s Received response %u: %s", stamp, tag, buf);
+	free(buf);
+	return true;
+}
+
+/* Send a line over a persistent control channel. A line starting with
+ * @target sends the rest of it to that target instead of the default. Replies
+ * are read straight away interactively, otherwise requests are pipelined. */
+static bool control_request(ckpctl_t *ctl, const char *target, const char *buf, const int tmo)
+{
+	const char *cmd;
+	char *tgt = NULL;
+	int64_t tag;
+
+	if (buf[0] == '@' && (cmd = strchr(buf, ' ')) != NULL) {
+		tgt = strndup(buf + 1, cmd - buf - 1);
+		target = tgt;
+		while (*cmd == ' ')
+			cmd++;
+	} else
+		cmd = buf;
+	if (!*cmd) {
+		LOGERR("No command for control request: %s", buf);
+		free(tgt);
+		return true;
+	}
+	tag = ckpctl_send(ctl, target, cmd);
+	if (tag < 0) {
+		LOGERR("Failed to send control request: %s", buf);
+		free(tgt);
+		return false;
+	}
+	LOGDEBUG("Sent control request %"PRId64" to %s", tag, target);
+	free(tgt);
+	if (isatty(fileno((FILE *)stdin)) || ctl->pending >= CONTROL_WINDOW)
+		return control_reply(ctl, tmo);
+	return true;
+}
+
 int main(int argc, char **argv)
 {
 	char *name = NULL, *socket_dir = NULL, *buf = NULL, *sockname = "listener";
-	bool proxy = false, counter = false;
+	bool proxy = false, counter = false, sub = false, control = false;
+	char *control_path = NULL;
+	ckpctl_t *ctl = NULL;
 	int tmo1 = RECV_UNIX_TIMEOUT1;
 	int tmo2 = RECV_UNIX_TIMEOUT2;
 	struct sigaction handler;
@@ -192,13 +283,18 @@ int main(int argc, char **argv)
 
 	tcgetattr(STDIN_FILENO, &oldctrl);
 
-	while ((c = getopt_long(argc, argv, "chl:N:n:ps:t:T:", long_options, &i)) != -1) {
+	while ((c = getopt_long(argc, argv, "cChl:N:n:ps:St:T:", long_options, &i)) != -1) {
 		switch(c) {
 			/* You'd normally disable most logmsg with -l 3 to
 			 * only see the counter */
 			case 'c':
 				counter = true;
 				break;
+			/* Send every line over one persistent control
+			 * connection instead of a connection per message */
+			case 'C':
+				control = true;
+				break;
 			case 'h':
 				for (j = 0; long_options[j].val; j++) {
 					struct option *jopt = &long_options[j];
@@ -241,6 +337,11 @@ int main(int argc, char **argv)
 			case 's':
 				socket_dir = strdup(optarg);
 				break;
+			/* Stream events from a subscription socket, such as
+			 * -N shares, using the first line as the request */
+			case 'S':
+				sub = true;
+				break;
 			case 't':
 				tmo1 = atoi(optarg);
 				break;
@@ -261,6 +362,8 @@ int main(int argc, char **argv)
 	realloc_strcat(&socket_dir, name);
 	dealloc(name);
 	trail_slash(&socket_dir);
+	if (control)
+		ASPRINTF(&control_path, "%scontrol", socket_dir);
 	realloc_strcat(&socket_dir, sockname);
 
 	signal(SIGPIPE, SIG_IGN);
@@ -273,6 +376,12 @@ int main(int argc, char **argv)
 	sigaction(SIGKILL, &handler, NULL);
 	sigaction(SIGHUP, &handler, NULL);
 
+	if (control) {
+		ctl = ckpctl_open(control_path);
+		if (!ctl)
+			quit(1, "Failed to open control socket: %s", control_path);
+	}
+
 	count = 0;
 	while (42) {
 		struct input_log *log_entry;
@@ -296,6 +405,17 @@ int main(int argc, char **argv)
 		log_entry->buf = buf;
 		CDL_PREPEND(input_log, log_entry);
 
+		if (sub) {
+			subscribe(socket_dir, buf);
+			break;
+		}
+
+		if (ctl) {
+			if (!control_request(ctl, sockname, buf, tmo1))
+				break;
+			continue;
+		}
+
 		sockd = open_unix_client(socket_dir);
 		if (sockd < 0) {
 			LOGERR("Failed to open socket: %s", socket_dir);
@@ -323,6 +443,13 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* Collect the replies to anything still pipelined */
+	while (ctl && ctl->pending > 0) {
+		if (!control_reply(ctl, tmo1))
+			break;
+	}
+	ckpctl_close(ctl);
+	dealloc(control_path);
 	dealloc(socket_dir);
 	sighandler(0);
 
@@ -28,9 +28,17 @@
 
 #include "ckpool.h"
 #include "libckpool.h"
+#include "affinity.h"
 #include "generator.h"
 #include "stratifier.h"
 #include "connector.h"
+#include "capture.h"
+#include "ckpctl.h"
+#include "lockprof.h"
+#include "logring.h"
+#include "probes.h"
+#include "threadstats.h"
+#include "vardiff.h"
 
 #define RECOMMENDED_MIN_DIFF 0.001
 
@@ -55,35 +63,17 @@ static bool open_logfile(ckpool_t *ckp)
 	return true;
 }
 
-/* Use ckmsgqs for logging to console and files to prevent logmsg from blocking
- * on any delays. */
-static void console_log(ckpool_t __maybe_unused *ckp, char *msg)
+/* Called by the log flusher before each drain. Reopen log file every minute,
+ * allowing us to move/rename it and create a new logfile */
+static int log_fd(void *arg)
 {
-	/* Add clear line only if stderr is going to console */
-	if (isatty(fileno(stderr)))
-		fprintf(stderr, "\33[2K\r");
-	fprintf(stderr, "%s", msg);
-	fflush(stderr);
+	ckpool_t *ckp = (ckpool_t *)arg;
 
-	free(msg);
-}
-
-static void proclog(ckpool_t *ckp, char *msg)
-{
-	time_t log_t = time(NULL);
-
-	/* Reopen log file every minute, allowing us to move/rename it and
-	 * create a new logfile */
-	if (log_t > ckp->lastopen_t + 60) {
+	if (time(NULL) > ckp->lastopen_t + 60) {
 		LOGDEBUG("Reopening logfile");
 		open_logfile(ckp);
 	}
-
-	flock(ckp->logfd, LOCK_EX);
-	fprintf(ckp->logfp, "%s", msg);
-	flock(ckp->logfd, LOCK_UN);
-
-	free(msg);
+	return ckp->logfd > 0 ? ckp->logfd : -1;
 }
 
 void get_timestamp(char *stamp)
@@ -104,47 +94,20 @@ void get_timestamp(char *stamp)
 			tm.tm_sec, ms);
 }
 
-/* Log everything to the logfile, but display warnings on the console as well */
+/* Log everything to the logfile, but display warnings on the console as well.
+ * Lines are formatted into the calling thread's log ring and written out by
+ * the log flusher, or straight to stderr before it is started. */
 void logmsg(int loglevel, const char *fmt, ...)
 {
-	int logfd = global_ckp->logfd;
-	char *log, *buf = NULL;
-	char stamp[128];
+	int errn = errno;
 	va_list ap;
 
 	if (global_ckp->loglevel < loglevel || !fmt)
 		return;
 
 	va_start(ap, fmt);
-	VASPRINTF(&buf, fmt, ap);
+	logring_vlog(loglevel, loglevel <= LOG_ERR ? errn : 0, fmt, ap);
 	va_end(ap);
-
-	if (unlikely(!buf)) {
-		fprintf(stderr, "Null buffer sent to logmsg\n");
-		return;
-	}
-	if (unlikely(!strlen(buf))) {
-		fprintf(stderr, "Zero length string sent to logmsg\n");
-		goto out;
-	}
-	get_timestamp(stamp);
-	if (loglevel <= LOG_ERR && errno != 0)
-		ASPRINTF(&log, "%s %s with errno %d: %s\n", stamp, buf, errno, strerror(errno));
-	else
-		ASPRINTF(&log, "%s %s\n", stamp, buf);
-
-	if (unlikely(!global_ckp->console_logger)) {
-		fprintf(stderr, "%s", log);
-		goto out_free;
-	}
-	if (loglevel <= LOG_WARNING)
-		ckmsgq_add(global_ckp->console_logger, strdup(log));
-	if (logfd > 0)
-		ckmsgq_add(global_ckp->logger, strdup(log));
-out_free:
-	free(log);
-out:
-	free(buf);
 }
 
 /* Generic function for creating a message queue receiving and parsing thread */
@@ -158,6 +121,7 @@ static void *ckmsg_queue(void *arg)
 	ckmsgq->active = true;
 
 	while (42) {
+		int64_t start, end;
 		ckmsg_t *msg;
 		tv_t now;
 		ts_t abs;
@@ -175,7 +139,13 @@ static void *ckmsg_queue(void *arg)
 
 		if (!msg)
 			continue;
+		start = lat_now();
+		CKPROBE2(queue_dequeue, ckmsgq->name, start - msg->queued);
+		lat_observe(ckmsgq->wait, start - msg->queued);
 		ckmsgq->func(ckp, msg->data);
+		end = lat_now();
+		lat_observe(ckmsgq->service, end - start);
+		__atomic_add_fetch(&ckmsgq->busy, end - start, __ATOMIC_RELAXED);
 		free(msg);
 	}
 	return NULL;
@@ -184,6 +154,8 @@ static void *ckmsg_queue(void *arg)
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
 {
 	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t));
+	int64_t now;
+	int i;
 
 	strncpy(ckmsgq->name, name, 15);
 	ckmsgq->func = func;
@@ -192,6 +164,12 @@ ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
 	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
 	mutex_init(ckmsgq->lock);
 	cond_init(ckmsgq->cond);
+	ckmsgq->threads = 1;
+	ckmsgq->wait = ckzalloc(sizeof(lat_hist_t));
+	ckmsgq->service = ckzalloc(sizeof(lat_hist_t));
+	now = lat_now();
+	for (i = 0; i < QREADERS; i++)
+		ckmsgq->busy_since[i] = now;
 	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
 
 	return ckmsgq;
@@ -200,21 +178,32 @@ ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
 {
 	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
+	lat_hist_t *wait, *service;
 	mutex_t *lock;
 	pthread_cond_t *cond;
-	int i;
+	int64_t now;
+	int i, j;
 
 	lock = ckalloc(sizeof(mutex_t));
 	cond = ckalloc(sizeof(pthread_cond_t));
 	mutex_init(lock);
 	cond_init(cond);
+	wait = ckzalloc(sizeof(lat_hist_t));
+	service = ckzalloc(sizeof(lat_hist_t));
+	now = lat_now();
 
 	for (i = 0; i < count; i++) {
-		snprintf(ckmsgq[i].name, 15, "%.6s%x", name, i);
+		/* Bounded so the name always fits in 15 chars */
+		snprintf(ckmsgq[i].name, 15, "%.6s%u", name, (unsigned int)i % 1000);
 		ckmsgq[i].func = func;
 		ckmsgq[i].ckp = ckp;
 		ckmsgq[i].lock = lock;
 		ckmsgq[i].cond = cond;
+		ckmsgq[i].threads = count;
+		ckmsgq[i].wait = wait;
+		ckmsgq[i].service = service;
+		for (j = 0; j < QREADERS; j++)
+			ckmsgq[i].busy_since[j] = now;
 		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
 	}
 
@@ -239,7 +228,9 @@ bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *fun
 
 	msg = ckalloc(sizeof(ckmsg_t));
 	msg->data = data;
+	msg->queued = lat_now();
 
+	CKPROBE1(queue_enqueue, ckmsgq->name);
 	mutex_lock(ckmsgq->lock);
 	ckmsgq->messages++;
 	DL_APPEND(ckmsgq->msgs, msg);
@@ -265,6 +256,58 @@ out:
 	return ret;
 }
 
+/* Number of messages currently waiting on a message queue */
+int ckmsgq_count(ckmsgq_t *ckmsgq)
+{
+	ckmsg_t *msg;
+	int ret = 0;
+
+	if (unlikely(!ckmsgq || !ckmsgq->active))
+		return ret;
+
+	mutex_lock(ckmsgq->lock);
+	DL_COUNT(ckmsgq->msgs, msg, ret);
+	mutex_unlock(ckmsgq->lock);
+	return ret;
+}
+
+/* Summarise a message queue: the messages waiting and their memory assuming
+ * size bytes of data each, how long messages waited and were serviced, and
+ * the percentage of time each of its threads was busy since the last time
+ * the queue was reported to this reader. */
+void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val, const int reader)
+{
+	int64_t memsize, generated, now, busy;
+	json_t *busy_val;
+	ckmsg_t *msg;
+	int objects, i;
+
+	busy_val = json_array();
+	mutex_lock(ckmsgq->lock);
+	DL_COUNT(ckmsgq->msgs, msg, objects);
+	generated = ckmsgq->messages;
+	now = lat_now();
+	for (i = 0; i < ckmsgq->threads; i++) {
+		ckmsgq_t *thr = &ckmsgq[i];
+		double pct = 0;
+
+		busy = __atomic_load_n(&thr->busy, __ATOMIC_RELAXED);
+		if (now > thr->busy_since[reader])
+			pct = (double)(busy - thr->busy_last[reader]) * 100 /
+				(now - thr->busy_since[reader]);
+		thr->busy_last[reader] = busy;
+		thr->busy_since[reader] = now;
+		json_array_append_new(busy_val, json_real((double)(int)(pct * 10) / 10));
+	}
+	mutex_unlock(ckmsgq->lock);
+
+	memsize = (sizeof(ckmsg_t) + size) * objects;
+	JSON_CPACK(*val, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
+	json_set_object(*val, "wait", lat_hist_json(ckmsgq->wait));
+	json_set_object(*val, "service", lat_hist_json(ckmsgq->service));
+	json_set_object(*val, "busy", busy_val);
+}
+
 /* Create a standalone thread that queues received unix messages for a proc
  * instance and adds them to linked list of received messages with their
  * associated receive socket, then signal the associated rmsg_cond for the
@@ -377,6 +420,140 @@ static void api_message(ckpool_t *ckp, char **buf, int *sockd)
 	ckmsgq_add(ckp->ckpapi, apimsg);
 }
 
+/* Every message queue in the pool, grouped by the process that owns it */
+static char *queue_stats(ckpool_t *ckp)
+{
+	json_t *val = json_object(), *subval;
+	char *buf;
+
+	subval = json_object();
+	json_set_object(subval, "logger", logring_stats());
+	json_set_object(val, "ckpool", subval);
+
+	subval = json_object();
+	stratifier_queues(ckp, subval, QREAD_QUEUESTATS);
+	json_set_object(val, "stratifier", subval);
+
+	subval = json_object();
+	connector_queues(ckp, subval, QREAD_QUEUESTATS);
+	json_set_object(val, "connector", subval);
+
+	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_REAL_PRECISION(6));
+	json_decref(val);
+	return buf;
+}
+
+/* Handle the listener commands that only need a reply, shared by the one
+ * shot listener socket and the persistent control channel. Always returns an
+ * allocated response. */
+static char *listener_command(ckpool_t *ckp, const char *buf)
+{
+	if (cmdmatch(buf, "ping")) {
+		LOGDEBUG("Listener received ping request");
+		return strdup("pong");
+	}
+	if (cmdmatch(buf, "loglevel")) {
+		int loglevel;
+
+		if (sscanf(buf, "loglevel=%d", &loglevel) != 1) {
+			LOGWARNING("Failed to parse loglevel message %s", buf);
+			return strdup("Failed");
+		}
+		if (loglevel < LOG_EMERG || loglevel > LOG_DEBUG) {
+			LOGWARNING("Invalid loglevel %d sent", loglevel);
+			return strdup("Invalid");
+		}
+		ckp->loglevel = loglevel;
+		logmsg_level = loglevel;
+		return strdup("success");
+	}
+	if (cmdmatch(buf, "accept")) {
+		LOGWARNING("Listener received accept message, accepting clients");
+		send_proc(ckp->connector, "accept");
+		return strdup("accepting");
+	}
+	if (cmdmatch(buf, "reject")) {
+		LOGWARNING("Listener received reject message, rejecting clients");
+		send_proc(ckp->connector, "reject");
+		return strdup("rejecting");
+	}
+	if (cmdmatch(buf, "dropall")) {
+		LOGWARNING("Listener received dropall message, disconnecting all clients");
+		send_proc(ckp->stratifier, buf);
+		return strdup("dropping all");
+	}
+	if (cmdmatch(buf, "reconnect")) {
+		LOGWARNING("Listener received request to send reconnect to clients");
+		send_proc(ckp->stratifier, buf);
+		return strdup("reconnecting");
+	}
+	if (cmdmatch(buf, "stratifierstats")) {
+		LOGDEBUG("Listener received stratifierstats request");
+		return stratifier_stats(ckp, ckp->sdata);
+	}
+	if (cmdmatch(buf, "connectorstats")) {
+		LOGDEBUG("Listener received connectorstats request");
+		return connector_stats(ckp->cdata, 0);
+	}
+	if (cmdmatch(buf, "queuestats")) {
+		LOGDEBUG("Listener received queuestats request");
+		return queue_stats(ckp);
+	}
+	if (cmdmatch(buf, "lockprofile")) {
+		int enable;
+
+		if (sscanf(buf, "lockprofile=%d", &enable) != 1) {
+			LOGWARNING("Failed to parse lockprofile message %s", buf);
+			return strdup("Failed");
+		}
+		LOGWARNING("Listener received lockprofile message, %s lock profiling",
+			   enable ? "enabling" : "disabling");
+		lockprof_enable(enable);
+		return strdup("success");
+	}
+	if (cmdmatch(buf, "capture")) {
+		int enable;
+
+		if (sscanf(buf, "capture=%d", &enable) != 1) {
+			LOGWARNING("Failed to parse capture message %s", buf);
+			return strdup("Failed");
+		}
+		LOGWARNING("Listener received capture message, %s stratum capture",
+			   enable ? "enabling" : "disabling");
+		if (!capture_enable(enable))
+			return strdup("Failed");
+		return strdup("success");
+	}
+	if (cmdmatch(buf, "lockstats")) {
+		int top = LOCKPROF_TOP;
+		json_t *val;
+		char *ret;
+
+		LOGDEBUG("Listener received lockstats request");
+		sscanf(buf, "lockstats=%d", &top);
+		val = lockprof_json(top);
+		ret = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_REAL_PRECISION(6));
+		json_decref(val);
+		return ret;
+	}
+	if (cmdmatch(buf, "threadstats")) {
+		json_t *val = threadstats_json(true);
+		char *ret;
+
+		LOGDEBUG("Listener received threadstats request");
+		ret = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_REAL_PRECISION(6));
+		json_decref(val);
+		return ret;
+	}
+	if (cmdmatch(buf, "resetshares")) {
+		LOGWARNING("Resetting best shares");
+		send_proc(ckp->stratifier, buf);
+		return strdup("resetting");
+	}
+	LOGINFO("Listener received unhandled message: %s", buf);
+	return strdup("unknown");
+}
+
 /* Listen for incoming global requests. Always returns a response if possible */
 static void *listener(void *arg)
 {
@@ -406,43 +583,11 @@ retry:
 		LOGWARNING("Listener received shutdown message, terminating ckpool");
 		send_unix_msg(sockd, "exiting");
 		goto out;
-	} else if (cmdmatch(buf, "ping")) {
-		LOGDEBUG("Listener received ping request");
-		send_unix_msg(sockd, "pong");
-	} else if (cmdmatch(buf, "loglevel")) {
-		int loglevel;
-
-		if (sscanf(buf, "loglevel=%d", &loglevel) != 1) {
-			LOGWARNING("Failed to parse loglevel message %s", buf);
-			send_unix_msg(sockd, "Failed");
-		} else if (loglevel < LOG_EMERG || loglevel > LOG_DEBUG) {
-			LOGWARNING("Invalid loglevel %d sent", loglevel);
-			send_unix_msg(sockd, "Invalid");
-		} else {
-			ckp->loglevel = loglevel;
-			send_unix_msg(sockd, "success");
-		}
 	} else if (cmdmatch(buf, "getxfd")) {
 		int fdno = -1;
 
 		sscanf(buf, "getxfd%d", &fdno);
 		connector_send_fd(ckp, fdno, sockd);
-	} else if (cmdmatch(buf, "accept")) {
-		LOGWARNING("Listener received accept message, accepting clients");
-		send_proc(ckp->connector, "accept");
-		send_unix_msg(sockd, "accepting");
-	} else if (cmdmatch(buf, "reject")) {
-		LOGWARNING("Listener received reject message, rejecting clients");
-		send_proc(ckp->connector, "reject");
-		send_unix_msg(sockd, "rejecting");
-	} else if (cmdmatch(buf, "dropall")) {
-		LOGWARNING("Listener received dropall message, disconnecting all clients");
-		send_proc(ckp->stratifier, buf);
-		send_unix_msg(sockd, "dropping all");
-	} else if (cmdmatch(buf, "reconnect")) {
-		LOGWARNING("Listener received request to send reconnect to clients");
-		send_proc(ckp->stratifier, buf);
-		send_unix_msg(sockd, "reconnecting");
 	} else if (cmdmatch(buf, "restart")) {
 		LOGWARNING("Listener received restart message, attempting handover");
 		send_unix_msg(sockd, "restarting");
@@ -453,23 +598,10 @@ retry:
 			}
 			execv(ckp->initial_args[0], (char *const *)ckp->initial_args);
 		}
-	} else if (cmdmatch(buf, "stratifierstats")) {
-		LOGDEBUG("Listener received stratifierstats request");
-		msg = stratifier_stats(ckp, ckp->sdata);
-		send_unix_msg(sockd, msg);
-		dealloc(msg);
-	} else if (cmdmatch(buf, "connectorstats")) {
-		LOGDEBUG("Listener received connectorstats request");
-		msg = connector_stats(ckp->cdata, 0);
+	} else {
+		msg = listener_command(ckp, buf);
 		send_unix_msg(sockd, msg);
 		dealloc(msg);
-	} else if (cmdmatch(buf, "resetshares")) {
-		LOGWARNING("Resetting best shares");
-		send_proc(ckp->stratifier, buf);
-		send_unix_msg(sockd, "resetting");
-	} else {
-		LOGINFO("Listener received unhandled message: %s", buf);
-		send_unix_msg(sockd, "unknown");
 	}
 	Close(sockd);
 	goto retry;
@@ -479,6 +611,268 @@ out:
 	return NULL;
 }
 
+typedef struct control_session {
+	ckpool_t *ckp;
+	int sockd;
+} control_session_t;
+
+/* Number of control sessions being served, bounded by controlsessions */
+static int control_sessions;
+
+/* Queue one control request straight onto a process's unix message queue, or
+ * the API queue if pi is NULL, with one end of a socket pair standing in for
+ * the socket a one shot client would have connected with. The reply is read
+ * from the other end, NULL if the request closes it without one. */
+static char *control_queue(ckpool_t *ckp, proc_instance_t *pi, const char *cmd)
+{
+	int sockd[2];
+	char *ret;
+
+	if (unlikely(socketpair(AF_UNIX, SOCK_STREAM, 0, sockd))) {
+		LOGERR("Failed to create control socket pair");
+		return NULL;
+	}
+	if (pi) {
+		unix_msg_t *umsg = ckalloc(sizeof(unix_msg_t));
+
+		umsg->sockd = sockd[1];
+		umsg->buf = strdup(cmd);
+
+		mutex_lock(&pi->rmsg_lock);
+		DL_APPEND(pi->unix_msgs, umsg);
+		pthread_cond_signal(&pi->rmsg_cond);
+		mutex_unlock(&pi->rmsg_lock);
+	} else {
+		char *buf = strdup(cmd);
+
+		api_message(ckp, &buf, &sockd[1]);
+	}
+	ret = recv_unix_msg(sockd[0]);
+	Close(sockd[0]);
+	return ret;
+}
+
+/* Route one control channel request to its target, returning the allocated
+ * reply. Requests are handed to the same queues the one shot sockets feed so
+ * they are handled exactly as one shot messages are, without a connection to
+ * the target's socket for each. */
+static char *control_command(ckpool_t *ckp, const char *target, const char *cmd)
+{
+	proc_instance_t *pi = NULL;
+	char *ret;
+
+	if (!strcmp(target, "listener")) {
+		if (cmd[0] == '{') {
+			if (!ckp->ckpapi)
+				return strdup("unsupported");
+			ret = control_queue(ckp, NULL, cmd);
+			goto out;
+		}
+		/* These would take down or hand over the very socket we are
+		 * replying on so go through the listener socket */
+		if (cmdmatch(cmd, "shutdown") || cmdmatch(cmd, "restart")) {
+			ret = send_recv_proc(ckp->main, cmd);
+			goto out;
+		}
+		if (cmdmatch(cmd, "getxfd"))
+			return strdup("unsupported");
+		return listener_command(ckp, cmd);
+	} else if (!strcmp(target, "stratifier"))
+		pi = &ckp->stratifier;
+	else if (!strcmp(target, "connector"))
+		pi = &ckp->connector;
+	else if (!strcmp(target, "generator"))
+		pi = &ckp->generator;
+	if (!pi) {
+		LOGINFO("Control channel received request for unknown target %s", target);
+		return strdup("unknown");
+	}
+	ret = control_queue(ckp, pi, cmd);
+out:
+	if (!ret)
+		ret = strdup("failed");
+	return ret;
+}
+
+/* Serve one persistent control connection. Requests are handled in the order
+ * they arrive so a client may pipeline many before reading any replies. */
+static void *control_session(void *arg)
+{
+	control_session_t *cs = (control_session_t *)arg;
+	ckpool_t *ckp = cs->ckp;
+	int sockd = cs->sockd;
+
+	pthread_detach(pthread_self());
+	rename_proc("ctlsession");
+	free(cs);
+
+	while (42) {
+		char *buf, *target, *cmd, *msg, *reply;
+		uint32_t len, tag;
+		int replylen;
+
+		buf = ckpctl_read_frame(sockd, &len, 0);
+		if (!buf)
+			break;
+		if (!ckpctl_parse_request(buf, &tag, &target, &cmd)) {
+			LOGINFO("Control channel received malformed request %s", buf);
+			free(buf);
+			break;
+		}
+		msg = control_command(ckp, target, cmd);
+		ASPRINTF(&reply, "%u %s", tag, msg);
+		replylen = strlen(reply);
+		free(msg);
+		free(buf);
+		if (!ckpctl_write_frame(sockd, reply, replylen)) {
+			free(reply);
+			break;
+		}
+		free(reply);
+	}
+	Close(sockd);
+	__atomic_sub_fetch(&control_sessions, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* Accept persistent control connections on the control socket next to the
+ * listener socket, handing each to its own session thread up to
+ * controlsessions at a time. */
+static void *control_listener(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	char *path = NULL;
+	int sockd, fd;
+
+	rename_proc("control");
+
+	ASPRINTF(&path, "%scontrol", ckp->socket_dir);
+	sockd = open_unix_server(path);
+	if (sockd < 0) {
+		LOGWARNING("Failed to open control socket %s", path);
+		goto out;
+	}
+	LOGNOTICE("Accepting control connections on %s", path);
+
+	while (42) {
+		control_session_t *cs;
+		pthread_t pth;
+
+		fd = accept(sockd, NULL, NULL);
+		if (unlikely(fd < 0)) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				LOGERR("Failed to accept on control socket");
+			continue;
+		}
+		if (__atomic_add_fetch(&control_sessions, 1, __ATOMIC_RELAXED) > ckp->controlsessions) {
+			__atomic_sub_fetch(&control_sessions, 1, __ATOMIC_RELAXED);
+			LOGNOTICE("Rejecting control connection with %d sessions open",
+				  ckp->controlsessions);
+			Close(fd);
+			continue;
+		}
+		cs = ckalloc(sizeof(control_session_t));
+		cs->ckp = ckp;
+		cs->sockd = fd;
+		create_pthread(&pth, control_session, cs);
+	}
+out:
+	free(path);
+	return NULL;
+}
+
+/* Render the full set of metrics from all parts of ckpool that are up */
+static void ckpool_metrics(ckpool_t *ckp, metrics_buf_t *mb)
+{
+	metrics_header(mb, "ckpool_uptime_seconds", "gauge", "Seconds since ckpool started");
+	metrics_value(mb, "ckpool_uptime_seconds", NULL, time(NULL) - ckp->starttime);
+	if (ckp->generator_ready)
+		generator_metrics(ckp, mb);
+	if (ckp->stratifier_ready)
+		stratifier_metrics(ckp, mb);
+	if (ckp->connector_ready)
+		connector_metrics(ckp, mb);
+}
+
+/* Scrapes are served one at a time so a scraper that stalls may only hold up
+ * the next one for this long reading and again writing */
+#define METRICS_TIMEOUT 1
+
+static void send_metrics(ckpool_t *ckp, int sockd)
+{
+	const struct timeval tv = { METRICS_TIMEOUT, 0 };
+	char buf[1024], *header;
+	metrics_buf_t mb = {};
+	int len;
+
+	/* We serve the same metrics to any GET so only need the request line */
+	if (wait_read_select(sockd, METRICS_TIMEOUT) < 1)
+		return;
+	setsockopt(sockd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	len = recv(sockd, buf, sizeof(buf) - 1, 0);
+	if (len < 1)
+		return;
+	buf[len] = '\0';
+	if (strncmp(buf, "GET ", 4)) {
+		const char *err = "HTTP/1.0 405 Method Not Allowed\r\nConnection: close\r\n\r\n";
+
+		write_socket(sockd, err, strlen(err));
+		return;
+	}
+
+	ckpool_metrics(ckp, &mb);
+	ASPRINTF(&header, "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: text/plain; version=0.0.4\r\n"
+		 "Content-Length: %lu\r\n"
+		 "Connection: close\r\n\r\n", (unsigned long)mb.len);
+	if (write_socket(sockd, header, strlen(header)) > 0 && mb.len)
+		write_socket(sockd, mb.buf, mb.len);
+	free(header);
+	free(mb.buf);
+}
+
+/* Serve prometheus text exposition over plain http on metricsurl. Scrapes are
+ * rare and cheap so they are handled serially, one connection at a time. */
+static void *metrics_listener(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	char *url = NULL, *port = NULL;
+	int sockd, fd;
+
+	rename_proc("metrics");
+
+	if (!extract_sockaddr(ckp->metricsurl, &url, &port) || !port) {
+		LOGWARNING("Failed to extract address from metricsurl %s", ckp->metricsurl);
+		goto out;
+	}
+	sockd = bind_socket(url, port);
+	if (sockd < 0) {
+		LOGWARNING("Failed to bind metrics socket to %s:%s", url, port);
+		goto out;
+	}
+	if (listen(sockd, SOMAXCONN) < 0) {
+		LOGERR("Failed to listen on metrics socket %s:%s", url, port);
+		Close(sockd);
+		goto out;
+	}
+	LOGWARNING("Serving prometheus metrics on %s:%s", url, port);
+
+	while (42) {
+		fd = accept(sockd, NULL, NULL);
+		if (unlikely(fd < 0)) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				LOGERR("Failed to accept on metrics socket");
+			continue;
+		}
+		send_metrics(ckp, fd);
+		Close(fd);
+	}
+out:
+	free(url);
+	free(port);
+	return NULL;
+}
+
 void empty_buffer(connsock_t *cs)
 {
 	if (cs->buf)
@@ -801,6 +1195,7 @@ static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool in
 		 cs->auth, cs->url, cs->port, len, rpc_req);
 
 	len = strlen(http_req);
+	CKPROBE2(rpc_start, cs->url, rpc_req);
 	tv_time(&stt_tv);
 	ret = write_socket(cs->fd, http_req, len);
 	if (ret != len) {
@@ -849,17 +1244,21 @@ static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool in
 	} while (strncmp(cs->buf, "{", 1));
 	tv_time(&fin_tv);
 	elapsed = tvdiff(&fin_tv, &stt_tv);
+	metric_observe(&cs->rpc_latency, elapsed);
 	if (elapsed > 5.0) {
 		ASPRINTF(&warning, "HTTP socket read+write took %.3fs in %s (%.10s...)",
 			 elapsed, __func__, rpc_method(rpc_req));
 	}
 
-	val = json_loads(cs->buf, 0, &err_val);
+	/* The line's length is known so save plain runs of the template's
+	 * long hex strings straight from the buffer */
+	val = json_loadb(cs->buf, ret, 0, &err_val);
 	if (!val) {
 		ASPRINTF(&warning, "JSON decode (%.10s...) failed(%d): %s",
 			 rpc_method(rpc_req), err_val.line, err_val.text);
 	}
 out_empty:
+	CKPROBE2(rpc_end, rpc_req, val != NULL);
 	empty_socket(cs->fd);
 	empty_buffer(cs);
 out:
@@ -1069,8 +1468,16 @@ static void rm_namepid(const proc_instance_t *pi)
 
 static void launch_logger(ckpool_t *ckp)
 {
-	ckp->logger = create_ckmsgq(ckp, "logger", &proclog);
-	ckp->console_logger = create_ckmsgq(ckp, "conlog", &console_log);
+	logring_sink_t sink = {
+		.logfd = log_fd,
+		.arg = ckp,
+		.console_level = LOG_WARNING,
+		.console_fd = STDERR_FILENO,
+		/* Add clear line only if stderr is going to console */
+		.console_clear = isatty(STDERR_FILENO),
+	};
+
+	logring_start(&sink);
 }
 
 static void clean_up(ckpool_t *ckp)
@@ -1529,6 +1936,19 @@ static void parse_config(ckpool_t *ckp)
 	json_get_double(&ckp->highdiff, json_conf, "highdiff");
 	json_get_double(&ckp->maxdiff, json_conf, "maxdiff");
 	json_get_bool(&ckp->allow_low_diff, json_conf, "allow_low_diff");
+	json_get_string(&ckp->vardiffpolicy, json_conf, "vardiffpolicy");
+	if (ckp->vardiffpolicy) {
+		ckp->vardiff = vardiff_policy(ckp->vardiffpolicy);
+		if (ckp->vardiff < 0) {
+			LOGWARNING("Unknown vardiffpolicy %s, using ckpool", ckp->vardiffpolicy);
+			ckp->vardiff = VARDIFF_CKPOOL;
+		}
+	}
+	json_get_double(&ckp->vardifftarget, json_conf, "vardifftarget");
+	if (ckp->vardifftarget < 0) {
+		LOGWARNING("Invalid negative value for vardifftarget (%f), setting to default", ckp->vardifftarget);
+		ckp->vardifftarget = 0;
+	}
 	json_get_string(&ckp->logdir, json_conf, "logdir");
 	json_get_int(&ckp->maxclients, json_conf, "maxclients");
 	arr_val = json_object_get(json_conf, "proxy");
@@ -1541,6 +1961,36 @@ static void parse_config(ckpool_t *ckp)
 	if (arr_val)
 		parse_redirecturls(ckp, arr_val);
 	json_get_string(&ckp->zmqblock, json_conf, "zmqblock");
+	json_get_string(&ckp->metricsurl, json_conf, "metricsurl");
+	json_get_int(&ckp->sharestream, json_conf, "sharestream");
+	if (ckp->sharestream < 0) {
+		LOGWARNING("Invalid negative value for sharestream (%d), setting to 0", ckp->sharestream);
+		ckp->sharestream = 0;
+	}
+	json_get_int(&ckp->eventstream, json_conf, "eventstream");
+	if (ckp->eventstream < 0) {
+		LOGWARNING("Invalid negative value for eventstream (%d), setting to 0", ckp->eventstream);
+		ckp->eventstream = 0;
+	}
+	json_get_int(&ckp->controlsessions, json_conf, "controlsessions");
+	if (ckp->controlsessions < 0) {
+		LOGWARNING("Invalid negative value for controlsessions (%d), setting to 0", ckp->controlsessions);
+		ckp->controlsessions = 0;
+	}
+	json_get_int(&ckp->latencysample, json_conf, "latencysample");
+	if (ckp->latencysample < 0) {
+		LOGWARNING("Invalid negative value for latencysample (%d), setting to 0", ckp->latencysample);
+		ckp->latencysample = 0;
+	}
+	json_get_bool(&ckp->lockprofile, json_conf, "lockprofile");
+	json_get_string(&ckp->capturefile, json_conf, "capturefile");
+	json_get_int(&ckp->capturesize, json_conf, "capturesize");
+	if (ckp->capturesize < 0) {
+		LOGWARNING("Invalid negative value for capturesize (%d), setting to default", ckp->capturesize);
+		ckp->capturesize = 0;
+	}
+	ckp->affinity = json_deep_copy(json_object_get(json_conf, "affinity"));
+	json_get_bool(&ckp->numabind, json_conf, "numabind");
 
 	json_decref(json_conf);
 }
@@ -1743,6 +2193,7 @@ int main(int argc, char **argv)
 				break;
 		}
 	}
+	logmsg_level = ckp.loglevel;
 
 	if (!ckp.name) {
 		if (ckp.node)
@@ -1852,6 +2303,8 @@ int main(int argc, char **argv)
 		quit(0, "maxdiff must not be negative");
 	if (ckp.maxdiff && ckp.maxdiff < ckp.mindiff)
 		quit(0, "maxdiff %.10g must not be less than mindiff %.10g", ckp.maxdiff, ckp.mindiff);
+	if (!ckp.vardifftarget)
+		ckp.vardifftarget = VARDIFF_TARGET;
 
 	if (!ckp.logdir)
 		ckp.logdir = strdup("logs");
@@ -1887,6 +2340,7 @@ int main(int argc, char **argv)
 	if (!open_logfile(&ckp))
 		quit(1, "Failed to make open log file %s", buf);
 	launch_logger(&ckp);
+	atexit(logring_flush);
 
 	ckp.main.ckp = &ckp;
 	ckp.main.processname = strdup("main");
@@ -1931,6 +2385,8 @@ int main(int argc, char **argv)
 	if (ckp.daemon) {
 		int fd;
 
+		/* The log flusher thread does not survive the fork */
+		logring_stop();
 		if (fork())
 			exit(0);
 		setsid();
@@ -1940,6 +2396,7 @@ int main(int argc, char **argv)
 			dup2(fd, STDOUT_FILENO);
 			dup2(fd, STDERR_FILENO);
 		}
+		launch_logger(&ckp);
 	}
 
 	write_namepid(&ckp.main);
@@ -1956,6 +2413,15 @@ int main(int argc, char **argv)
 		ckp.maxclients = ret * 9 / 10;
 	}
 
+	if (ckp.lockprofile)
+		lockprof_enable(true);
+	if (ckp.capturefile) {
+		capture_configure(ckp.capturefile, ckp.capturesize);
+		capture_enable(true);
+	}
+	if (!affinity_configure(ckp.affinity, ckp.numabind, ckp.serverurl, ckp.serverurls))
+		LOGWARNING("Some affinity roles are invalid and left unplaced");
+
 	// ckp.ckpapi = create_ckmsgq(&ckp, "api", &ckpool_api);
 	create_pthread(&ckp.pth_listener, listener, &ckp.main);
 
@@ -1970,6 +2436,11 @@ int main(int argc, char **argv)
 	prepare_child(&ckp, &ckp.stratifier, stratifier, "stratifier");
 	prepare_child(&ckp, &ckp.connector, connector, "connector");
 
+	if (ckp.metricsurl)
+		create_pthread(&ckp.pth_metrics, metrics_listener, &ckp);
+	if (ckp.controlsessions)
+		create_pthread(&ckp.pth_control, control_listener, &ckp);
+
 	/* Shutdown from here if the listener is sent a shutdown message */
 	if (ckp.pth_listener)
 		join_pthread(ckp.pth_listener);
@@ -17,6 +17,7 @@
 #include <sys/types.h>
 
 #include "libckpool.h"
+#include "metrics.h"
 #include "uthash.h"
 
 #define RPC_TIMEOUT 60
@@ -28,6 +29,7 @@ struct ckmsg {
 	struct ckmsg *next;
 	struct ckmsg *prev;
 	void *data;
+	int64_t queued; /* Monotonic ns when added */
 };
 
 typedef struct ckmsg ckmsg_t;
@@ -41,6 +43,15 @@ struct unix_msg {
 	char *buf;
 };
 
+/* Readers of message queue summaries, each shown how busy the threads were
+ * since its own previous report */
+enum ckmsgq_reader {
+	QREAD_QUEUESTATS,	/* queuestats requests */
+	QREAD_PROCSTATS,	/* stratifier and connector stats requests */
+	QREAD_LOG,		/* Periodic stats logging */
+	QREADERS
+};
+
 struct ckmsgq {
 	ckpool_t *ckp;
 	char name[16];
@@ -51,6 +62,17 @@ struct ckmsgq {
 	void (*func)(ckpool_t *, void *);
 	int64_t messages;
 	bool active;
+
+	/* Threads sharing the message list, and the wait and service time
+	 * histograms they share */
+	int threads;
+	lat_hist_t *wait;
+	lat_hist_t *service;
+	/* Ns this thread has spent in func, and the values when each reader
+	 * last reported */
+	int64_t busy;
+	int64_t busy_last[QREADERS];
+	int64_t busy_since[QREADERS];
 };
 
 typedef struct ckmsgq ckmsgq_t;
@@ -90,6 +112,9 @@ struct connsock {
 	sem_t sem;
 
 	bool alive;
+
+	/* Round trip time of json rpc calls on this connection */
+	metric_hist_t rpc_latency;
 };
 
 typedef struct connsock connsock_t;
@@ -170,10 +195,6 @@ struct ckpool_instance {
 	/* API message queue */
 	ckmsgq_t *ckpapi;
 
-	/* Logger message queue */
-	ckmsgq_t *logger;
-	ckmsgq_t *console_logger;
-
 	/* Process instance data of parent/child processes */
 	proc_instance_t main;
 
@@ -191,6 +212,38 @@ struct ckpool_instance {
 	/* Threads of main process */
 	pthread_t pth_listener;
 	pthread_t pth_watchdog;
+	pthread_t pth_metrics;
+	pthread_t pth_control;
+
+	/* Address to serve prometheus metrics on over http, disabled if unset */
+	char *metricsurl;
+
+	/* Persistent control connections served at once, 0 to disable */
+	int controlsessions;
+
+	/* Number of share events kept for stream subscribers, 0 to disable */
+	int sharestream;
+
+	/* Number of pool status, block and template events kept for stream
+	 * subscribers, 0 to disable */
+	int eventstream;
+
+	/* Time every stage of one in every n share submissions from socket
+	 * read to response write, 0 to disable */
+	int latencysample;
+
+	/* Profile lock acquisition, contention and hold times per call site */
+	bool lockprofile;
+
+	/* Prefix of files to capture stratum traffic to, disabled if unset, and
+	 * the size in MB each file is rotated at */
+	char *capturefile;
+	int capturesize;
+
+	/* Thread roles mapped to the CPUs they run on, and whether each role's
+	 * memory is bound to the NUMA nodes of its CPUs */
+	json_t *affinity;
+	bool numabind;
 
 	/* Are we running in trusted remote node mode */
 	bool remote;
@@ -240,6 +293,9 @@ struct ckpool_instance {
 	double highdiff; // Default 1000000
 	double maxdiff; // No default
 	bool allow_low_diff; // Allow network diff below 1.0 (for regtest testing)
+	char *vardiffpolicy; // Default ckpool
+	int vardiff; // Parsed vardiffpolicy
+	double vardifftarget; // Default 3.33
 
 	/* Coinbase data */
 	char *btcaddress; // Address to mine to
@@ -320,6 +376,7 @@ enum stratum_msgtype {
 	SM_WORKERSTATS,
 	SM_REQTXNS,
 	SM_CONFIGURE,
+	SM_SETEXTRANONCE,
 	SM_NONE
 };
 
@@ -348,6 +405,7 @@ static const char __maybe_unused *stratum_msgs[] = {
 	"workerstats",
 	"reqtxns",
 	"mining.configure",
+	"mining.set_extranonce",
 	""
 };
 
@@ -360,6 +418,8 @@ ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, cons
 bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line);
 #define ckmsgq_add(ckmsgq, data) _ckmsgq_add(ckmsgq, data, __FILE__, __func__, __LINE__)
 bool ckmsgq_empty(ckmsgq_t *ckmsgq);
+int ckmsgq_count(ckmsgq_t *ckmsgq);
+void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val, const int reader);
 unix_msg_t *get_unix_msg(proc_instance_t *pi);
 
 extern ckpool_t *global_ckp;
@@ -0,0 +1,969 @@
+/*
+ * Stratum capture replay for reproducing pool behaviour offline.
+ *
+ * Reads the files written by ckpool's capturefile option and plays every
+ * captured client back against a pool, normally one running on mockbitcoind,
+ * at the original pace or scaled by a speed factor. Each client's requests
+ * are sent on their own connection at the time they originally arrived, job
+ * ids in shares are mapped onto the jobs the replayed pool sent that client
+ * and, given the mock bitcoind's url, captured block changes are reproduced
+ * with its generate call. The replayed pool's responses are compared with
+ * the captured ones and divergences are reported along with the latency of
+ * each request method in the capture and in the replay.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "capture.h"
+#include "metrics.h"
+#include "uthash.h"
+#include "utlist.h"
+
+#define REPLAY_EVENTS 256
+#define REPLAY_BUFSIZ 2048
+#define REPLAY_MAXBUF 65536
+/* Notified job ids remembered per client for mapping shares */
+#define REPLAY_JOBS 64
+#define REPLAY_JOBLEN 24
+/* Longest epoll wait so the record schedule is never late by more */
+#define REPLAY_TICK_MS 100
+/* Divergences reported in full, the rest are only counted */
+#define REPLAY_EXAMPLES 20
+
+enum replay_method {
+	RM_SUBSCRIBE,
+	RM_AUTHORISE,
+	RM_SUBMIT,
+	RM_CONFIGURE,
+	RM_SUGGEST,
+	RM_OTHER,
+	RM_METHODS
+};
+
+static const char *replay_methods[RM_METHODS] = {
+	"mining.subscribe", "mining.authorize", "mining.submit", "mining.configure",
+	"mining.suggest_difficulty", "other"
+};
+
+typedef struct replay_req replay_req_t;
+
+/* A request sent by a captured client, matched with its captured response
+ * and the replayed pool's response by id in the order they were sent */
+struct replay_req {
+	replay_req_t *next;
+	replay_req_t *prev;
+
+	char id[64];
+	int method;
+	int64_t cap_in;
+	int64_t cap_out;
+	int64_t sent;
+	int64_t received;
+	bool cap_done;
+	bool rep_done;
+	char cap_class[64];
+	char rep_class[64];
+};
+
+typedef struct replay_job replay_job_t;
+
+struct replay_job {
+	char jobid[REPLAY_JOBLEN];
+	uint32_t ntime;
+};
+
+typedef struct replay_client replay_client_t;
+
+struct replay_client {
+	UT_hash_handle hh;
+	int64_t id; /* In the capture */
+	int fd;
+	bool connecting;
+	bool closing; /* Shut down once the write buffer is flushed */
+	bool shut;
+	int64_t connect_start;
+
+	char *rbuf;
+	int rlen;
+	int rsize;
+	char *wbuf;
+	int wlen;
+
+	replay_req_t *reqs;
+
+	/* The nth job notified in the capture maps to the nth job the
+	 * replayed pool notified */
+	replay_job_t cap_jobs[REPLAY_JOBS];
+	int64_t cap_njobs;
+	replay_job_t rep_jobs[REPLAY_JOBS];
+	int64_t rep_njobs;
+};
+
+struct replay_conf {
+	char *url;
+	char *btcd;
+	double speed;
+	int wait;
+};
+
+static struct replay_conf conf = {
+	.speed = 1,
+	.wait = 5,
+};
+
+struct replay_method_stats {
+	uint64_t sent;
+	uint64_t matched;
+	uint64_t diverged;
+	uint64_t unanswered;
+	uint64_t uncaptured;
+	lat_hist_t captured;
+	lat_hist_t replayed;
+};
+
+static struct replay_stats {
+	uint64_t records;
+	uint64_t files;
+	uint64_t connects;
+	uint64_t connfails;
+	uint64_t closes;
+	uint64_t drops;
+	uint64_t unsent;
+	uint64_t templates;
+	uint64_t blocks;
+	uint64_t cap_notifies;
+	uint64_t rep_notifies;
+	uint64_t remapped;
+	uint64_t unmapped;
+	int64_t inflight;
+	int64_t span;
+	struct replay_method_stats methods[RM_METHODS];
+	lat_hist_t connect;
+	json_t *divergences;
+	json_t *examples;
+} stats;
+
+static replay_client_t *replay_clients;
+static struct sockaddr_storage replay_addr;
+static socklen_t replay_addrlen;
+static int replay_epfd;
+
+static volatile bool replay_stop;
+static int replay_loglevel = LOG_NOTICE;
+
+/* Logs go to stderr leaving stdout for the summary */
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= replay_loglevel) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+static int method_index(const char *method)
+{
+	int i;
+
+	for (i = 0; i < RM_OTHER; i++) {
+		if (!strcmp(method, replay_methods[i]))
+			return i;
+	}
+	return RM_OTHER;
+}
+
+/* Reduce a response to what should match between runs: the stratum error
+ * of a failure or the kind of result, not enonce1s, job ids or times */
+static void response_class(json_t *val, char *buf, const int len)
+{
+	json_t *res_val = json_object_get(val, "result"), *err_val = json_object_get(val, "error");
+	const char *msg;
+
+	if (err_val && !json_is_null(err_val)) {
+		/* Many rejects share a code so keep the message too */
+		msg = json_string_value(json_array_get(err_val, 1));
+		if (json_is_integer(json_array_get(err_val, 0)))
+			snprintf(buf, len, "error %"JSON_INTEGER_FORMAT" %s",
+				 json_integer_value(json_array_get(err_val, 0)), msg ? msg : "");
+		else if (json_is_string(err_val))
+			snprintf(buf, len, "error %s", json_string_value(err_val));
+		else
+			snprintf(buf, len, "error");
+	} else if (json_is_true(res_val))
+		snprintf(buf, len, "true");
+	else if (json_is_false(res_val))
+		snprintf(buf, len, "false");
+	else if (!res_val || json_is_null(res_val))
+		snprintf(buf, len, "null");
+	else
+		snprintf(buf, len, "result");
+}
+
+static void id_string(json_t *id_val, char *buf, const int len)
+{
+	char *id = json_dumps(id_val, JSON_COMPACT | JSON_ENCODE_ANY);
+
+	snprintf(buf, len, "%s", id ? id : "null");
+	free(id);
+}
+
+/* Tally a request once both responses are in */
+static void req_complete(replay_client_t *client, replay_req_t *req)
+{
+	struct replay_method_stats *ms = &stats.methods[req->method];
+	json_t *val;
+	char *key;
+
+	lat_observe(&ms->captured, req->cap_out - req->cap_in);
+	lat_observe(&ms->replayed, req->received - req->sent);
+	if (!strcmp(req->cap_class, req->rep_class))
+		ms->matched++;
+	else {
+		ms->diverged++;
+		ASPRINTF(&key, "%s: %s -> %s", replay_methods[req->method], req->cap_class,
+			 req->rep_class);
+		val = json_object_get(stats.divergences, key);
+		json_set_int64(stats.divergences, key, val ? json_integer_value(val) + 1 : 1);
+		free(key);
+		if (json_array_size(stats.examples) < REPLAY_EXAMPLES) {
+			JSON_CPACK(val, "{sIssssssss}", "client", client->id, "id", req->id,
+				   "method", replay_methods[req->method],
+				   "captured", req->cap_class, "replayed", req->rep_class);
+			json_array_append_new(stats.examples, val);
+		}
+		LOGINFO("Client %"PRId64" %s id %s diverged: %s -> %s", client->id,
+			replay_methods[req->method], req->id, req->cap_class, req->rep_class);
+	}
+	DL_DELETE(client->reqs, req);
+	free(req);
+}
+
+static void client_arm(replay_client_t *client, const int op)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.data.ptr = client;
+	if (client->connecting)
+		event.events = EPOLLOUT;
+	else {
+		event.events = EPOLLIN | EPOLLRDHUP;
+		if (client->wlen)
+			event.events |= EPOLLOUT;
+	}
+	if (unlikely(epoll_ctl(replay_epfd, op, client->fd, &event)))
+		LOGWARNING("Failed to epoll_ctl client %"PRId64": %s", client->id, strerror(errno));
+}
+
+static void client_close(replay_client_t *client)
+{
+	replay_req_t *req, *tmp;
+
+	Close(client->fd);
+	client->connecting = client->closing = client->shut = false;
+	client->rlen = client->wlen = 0;
+	/* Nothing more will arrive for requests still waiting */
+	DL_FOREACH_SAFE(client->reqs, req, tmp) {
+		if (req->rep_done)
+			continue;
+		req->rep_done = true;
+		req->received = lat_now();
+		snprintf(req->rep_class, sizeof(req->rep_class), "closed");
+		stats.inflight--;
+		if (req->cap_done)
+			req_complete(client, req);
+	}
+}
+
+/* Half close once everything is written and answered, as the pool drops a
+ * client on reading its close without answering what it has queued */
+static void client_shutdown(replay_client_t *client)
+{
+	replay_req_t *req;
+
+	DL_FOREACH(client->reqs, req) {
+		if (!req->rep_done) {
+			client->closing = true;
+			return;
+		}
+	}
+	if (client->connecting || client->wlen) {
+		client->closing = true;
+		return;
+	}
+	client->closing = false;
+	client->shut = true;
+	shutdown(client->fd, SHUT_WR);
+}
+
+/* Write what the socket will take now and buffer the rest for EPOLLOUT */
+static void client_write(replay_client_t *client, const char *buf, int len)
+{
+	int ret;
+
+	if (!client->wlen && !client->connecting) {
+		ret = write(client->fd, buf, len);
+		if (ret == len)
+			return;
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return;
+			ret = 0;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	client->wbuf = realloc(client->wbuf, client->wlen + len);
+	if (unlikely(!client->wbuf))
+		quit(1, "Failed to realloc write buffer of %d bytes", client->wlen + len);
+	memcpy(client->wbuf + client->wlen, buf, len);
+	client->wlen += len;
+	if (!client->connecting)
+		client_arm(client, EPOLL_CTL_MOD);
+}
+
+static bool client_flush(replay_client_t *client)
+{
+	int ret;
+
+	ret = write(client->fd, client->wbuf, client->wlen);
+	if (ret < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	client->wlen -= ret;
+	memmove(client->wbuf, client->wbuf + ret, client->wlen);
+	if (!client->wlen) {
+		client_arm(client, EPOLL_CTL_MOD);
+		if (client->closing)
+			client_shutdown(client);
+	}
+	return true;
+}
+
+static replay_client_t *client_connect(const int64_t id)
+{
+	replay_client_t *client;
+
+	HASH_FIND_I64(replay_clients, &id, client);
+	if (client) {
+		/* Ids are never reused by a pool so this is a capture that
+		 * started before the client's close was recorded */
+		if (client->fd >= 0)
+			client_close(client);
+	} else {
+		client = ckzalloc(sizeof(replay_client_t));
+		client->id = id;
+		client->rsize = REPLAY_BUFSIZ;
+		client->rbuf = ckalloc(client->rsize);
+		HASH_ADD_I64(replay_clients, id, client);
+	}
+	client->cap_njobs = client->rep_njobs = 0;
+	client->fd = socket(replay_addr.ss_family, SOCK_STREAM, 0);
+	if (unlikely(client->fd < 0)) {
+		LOGWARNING("Failed to open socket for client %"PRId64": %s", id, strerror(errno));
+		stats.connfails++;
+		return client;
+	}
+	noblock_socket(client->fd);
+	client->connect_start = lat_now();
+	client->connecting = true;
+	if (connect(client->fd, (struct sockaddr *)&replay_addr, replay_addrlen) && !sock_connecting()) {
+		LOGINFO("Client %"PRId64" failed to connect: %s", id, strerror(errno));
+		stats.connfails++;
+		Close(client->fd);
+		client->connecting = false;
+		return client;
+	}
+	client_arm(client, EPOLL_CTL_ADD);
+	return client;
+}
+
+static void connect_done(replay_client_t *client)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	client->connecting = false;
+	if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		LOGINFO("Client %"PRId64" failed to connect: %s", client->id, strerror(err));
+		stats.connfails++;
+		client_close(client);
+		return;
+	}
+	lat_observe(&stats.connect, lat_now() - client->connect_start);
+	stats.connects++;
+	client_arm(client, EPOLL_CTL_MOD);
+	if (client->wlen && !client_flush(client))
+		client_close(client);
+	else if (client->closing && !client->wlen)
+		client_shutdown(client);
+}
+
+static void add_job(replay_job_t *jobs, int64_t *njobs, json_t *params)
+{
+	const char *jobid = json_string_value(json_array_get(params, 0));
+	const char *ntime = json_string_value(json_array_get(params, 7));
+	replay_job_t *job;
+
+	if (!jobid)
+		return;
+	job = &jobs[*njobs % REPLAY_JOBS];
+	snprintf(job->jobid, REPLAY_JOBLEN, "%s", jobid);
+	job->ntime = ntime ? strtoul(ntime, NULL, 16) : 0;
+	(*njobs)++;
+}
+
+/* Find the replayed job notified in the same position as a captured one */
+static bool map_job(replay_client_t *client, const char *jobid, replay_job_t **cap_job,
+		    replay_job_t **rep_job)
+{
+	int64_t i;
+
+	for (i = client->cap_njobs - 1; i >= 0 && i >= client->cap_njobs - REPLAY_JOBS; i--) {
+		if (strcmp(client->cap_jobs[i % REPLAY_JOBS].jobid, jobid))
+			continue;
+		if (i >= client->rep_njobs || i < client->rep_njobs - REPLAY_JOBS)
+			return false;
+		*cap_job = &client->cap_jobs[i % REPLAY_JOBS];
+		*rep_job = &client->rep_jobs[i % REPLAY_JOBS];
+		return true;
+	}
+	return false;
+}
+
+/* Match a response from either side to the oldest request with its id still
+ * waiting for that side */
+static void parse_response(replay_client_t *client, json_t *val, const bool captured,
+			   const int64_t ns)
+{
+	replay_req_t *req;
+	char id[64];
+
+	id_string(json_object_get(val, "id"), id, sizeof(id));
+	DL_FOREACH(client->reqs, req) {
+		if (strcmp(req->id, id) || (captured ? req->cap_done : req->rep_done))
+			continue;
+		if (captured) {
+			req->cap_done = true;
+			req->cap_out = ns;
+			response_class(val, req->cap_class, sizeof(req->cap_class));
+		} else {
+			req->rep_done = true;
+			req->received = ns;
+			response_class(val, req->rep_class, sizeof(req->rep_class));
+			stats.inflight--;
+		}
+		if (req->cap_done && req->rep_done)
+			req_complete(client, req);
+		if (!captured && client->closing && !client->wlen)
+			client_shutdown(client);
+		return;
+	}
+}
+
+/* Lines from the pool, either from the capture or from the replayed pool */
+static void parse_line(replay_client_t *client, const char *line, const bool captured,
+		       const int64_t ns)
+{
+	json_t *val, *method_val;
+	json_error_t err;
+
+	val = json_loads(line, 0, &err);
+	if (unlikely(!val)) {
+		LOGINFO("Client %"PRId64" got invalid json from the %s pool: %s", client->id,
+			captured ? "captured" : "replayed", err.text);
+		return;
+	}
+	method_val = json_object_get(val, "method");
+	if (json_is_string(method_val)) {
+		if (!strcmp(json_string_value(method_val), "mining.notify")) {
+			if (captured) {
+				add_job(client->cap_jobs, &client->cap_njobs, json_object_get(val, "params"));
+				stats.cap_notifies++;
+			} else {
+				add_job(client->rep_jobs, &client->rep_njobs, json_object_get(val, "params"));
+				stats.rep_notifies++;
+			}
+		}
+	} else
+		parse_response(client, val, captured, ns);
+	json_decref(val);
+}
+
+static bool client_read(replay_client_t *client)
+{
+	char *start, *eol;
+	int ret;
+
+	while (42) {
+		if (client->rlen + 1 >= client->rsize) {
+			if (client->rsize >= REPLAY_MAXBUF) {
+				LOGWARNING("Client %"PRId64" got an overlong line", client->id);
+				return false;
+			}
+			client->rsize *= 2;
+			client->rbuf = realloc(client->rbuf, client->rsize);
+			if (unlikely(!client->rbuf))
+				quit(1, "Failed to realloc read buffer of %d bytes", client->rsize);
+		}
+		ret = read(client->fd, client->rbuf + client->rlen, client->rsize - client->rlen - 1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		if (!ret)
+			return false;
+		client->rlen += ret;
+		client->rbuf[client->rlen] = '\0';
+		start = client->rbuf;
+		while ((eol = strchr(start, '\n'))) {
+			*eol = '\0';
+			parse_line(client, start, false, lat_now());
+			start = eol + 1;
+		}
+		client->rlen -= start - client->rbuf;
+		memmove(client->rbuf, start, client->rlen);
+	}
+}
+
+static void client_event(replay_client_t *client, const uint32_t events)
+{
+	if (client->fd < 0)
+		return;
+	if (client->connecting) {
+		connect_done(client);
+		return;
+	}
+	if ((events & EPOLLOUT) && client->wlen && !client_flush(client))
+		goto out_close;
+	if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !client_read(client))
+		goto out_close;
+	return;
+
+out_close:
+	/* The pool closing on its own rather than after our half close */
+	if (!client->shut) {
+		stats.drops++;
+		LOGINFO("Pool dropped client %"PRId64, client->id);
+	}
+	client_close(client);
+}
+
+/* Send a captured request, mapping the job id of shares onto the replay and
+ * moving ntime by as much as the mapped job's ntime differs */
+static void send_request(replay_client_t *client, const capture_rec_t *rec)
+{
+	replay_job_t *cap_job, *rep_job;
+	json_t *val, *method_val, *params;
+	const char *jobid, *ntime;
+	replay_req_t *req;
+	char hex[12];
+	char *buf = NULL;
+	int method;
+
+	val = json_loads(rec->buf, 0, NULL);
+	if (!val) {
+		/* Invalid lines are replayed as is to see what the pool does */
+		ASPRINTF(&buf, "%s\n", rec->buf);
+		client_write(client, buf, strlen(buf));
+		free(buf);
+		return;
+	}
+	method_val = json_object_get(val, "method");
+	method = json_is_string(method_val) ? method_index(json_string_value(method_val)) : RM_OTHER;
+	params = json_object_get(val, "params");
+	if (method == RM_SUBMIT && (jobid = json_string_value(json_array_get(params, 1)))) {
+		if (map_job(client, jobid, &cap_job, &rep_job)) {
+			json_array_set_new(params, 1, json_string(rep_job->jobid));
+			ntime = json_string_value(json_array_get(params, 3));
+			if (ntime) {
+				snprintf(hex, sizeof(hex), "%08x", (uint32_t)(strtoul(ntime, NULL, 16) -
+					 cap_job->ntime + rep_job->ntime));
+				json_array_set_new(params, 3, json_string(hex));
+			}
+			buf = json_dumps(val, JSON_EOL | JSON_COMPACT | JSON_PRESERVE_ORDER);
+			stats.remapped++;
+		} else
+			stats.unmapped++;
+	}
+	if (!buf)
+		ASPRINTF(&buf, "%s\n", rec->buf);
+
+	/* Notifications with a null id get no response */
+	if (!json_is_null(json_object_get(val, "id"))) {
+		req = ckzalloc(sizeof(replay_req_t));
+		id_string(json_object_get(val, "id"), req->id, sizeof(req->id));
+		req->method = method;
+		req->cap_in = rec->ns;
+		req->sent = lat_now();
+		DL_APPEND(client->reqs, req);
+		stats.methods[method].sent++;
+		stats.inflight++;
+	}
+	json_decref(val);
+	client_write(client, buf, strlen(buf));
+	free(buf);
+}
+
+/* A blocking call to the mock bitcoind to find a block elsewhere */
+static void generate_block(void)
+{
+	char *host = NULL, *port = NULL, *req, buf[4096];
+	const char *body = "{\"method\": \"generate\", \"params\": [1], \"id\": 0}";
+	int fd, ret;
+
+	if (!extract_sockaddr(conf.btcd, &host, &port))
+		goto out;
+	fd = connect_socket(host, port);
+	if (fd < 0) {
+		LOGWARNING("Failed to connect to mock bitcoind %s", conf.btcd);
+		goto out;
+	}
+	ASPRINTF(&req, "POST / HTTP/1.1\nHost: %s\nContent-type: application/json\n"
+		 "Content-Length: %d\n\n%s", host, (int)strlen(body), body);
+	ret = write_socket(fd, req, strlen(req));
+	free(req);
+	if (ret > 0 && wait_read_select(fd, 5) > 0 && read(fd, buf, sizeof(buf) - 1) > 0)
+		stats.blocks++;
+	else
+		LOGWARNING("Failed to generate a block on mock bitcoind %s", conf.btcd);
+	Close(fd);
+out:
+	free(host);
+	free(port);
+}
+
+static void replay_record(const capture_rec_t *rec)
+{
+	replay_client_t *client = NULL;
+	int64_t id = rec->client_id;
+	json_t *val;
+
+	stats.records++;
+	if (rec->type == CAPTURE_TEMPLATE) {
+		/* The first template seen is the captured pool's own startup
+		 * or the one current when capturing began */
+		val = json_loads(rec->buf, 0, NULL);
+		if (conf.btcd && stats.templates && json_is_true(json_object_get(val, "new_block")))
+			generate_block();
+		json_decref(val);
+		stats.templates++;
+		return;
+	}
+	if (rec->type == CAPTURE_CONNECT) {
+		LOGDEBUG("Client %"PRId64" connecting from %s", rec->client_id, rec->buf);
+		client_connect(rec->client_id);
+		return;
+	}
+	HASH_FIND_I64(replay_clients, &id, client);
+	/* Capture began after this client connected */
+	if (!client)
+		client = client_connect(rec->client_id);
+	switch (rec->type) {
+		case CAPTURE_IN:
+			if (client->fd < 0) {
+				stats.unsent++;
+				break;
+			}
+			send_request(client, rec);
+			break;
+		case CAPTURE_OUT:
+			parse_line(client, rec->buf, true, rec->ns);
+			break;
+		case CAPTURE_CLOSE:
+			stats.closes++;
+			if (client->fd >= 0)
+				client_shutdown(client);
+			break;
+		default:
+			LOGDEBUG("Skipping unknown capture record type %d", rec->type);
+			break;
+	}
+}
+
+typedef struct replay_files replay_files_t;
+
+/* The capture files in order, read as one stream of records with their
+ * times relative to the start of the first */
+struct replay_files {
+	char **paths;
+	int npaths;
+	int next;
+	capture_reader_t *cr;
+	int64_t first_us;
+	int64_t offset;
+};
+
+static bool next_record(replay_files_t *rf, capture_rec_t *rec)
+{
+	while (42) {
+		if (!rf->cr) {
+			if (rf->next >= rf->npaths)
+				return false;
+			rf->cr = capture_open(rf->paths[rf->next++]);
+			if (!rf->cr)
+				continue;
+			if (!stats.files++)
+				rf->first_us = rf->cr->start_us;
+			rf->offset = (rf->cr->start_us - rf->first_us) * 1000;
+		}
+		if (capture_read(rf->cr, rec)) {
+			rec->ns += rf->offset;
+			return true;
+		}
+		capture_close(rf->cr);
+		rf->cr = NULL;
+	}
+}
+
+static void replay_tally(void)
+{
+	replay_client_t *client, *tmp;
+	replay_req_t *req, *rtmp;
+
+	HASH_ITER(hh, replay_clients, client, tmp) {
+		DL_FOREACH_SAFE(client->reqs, req, rtmp) {
+			/* Answered by the replayed pool after the capture ended */
+			if (!req->cap_done && req->rep_done)
+				stats.methods[req->method].uncaptured++;
+			else
+				stats.methods[req->method].unanswered++;
+			DL_DELETE(client->reqs, req);
+			free(req);
+		}
+		if (client->fd >= 0)
+			Close(client->fd);
+		HASH_DEL(replay_clients, client);
+		free(client->rbuf);
+		free(client->wbuf);
+		free(client);
+	}
+}
+
+static json_t *replay_summary(const double elapsed)
+{
+	json_t *val = json_object(), *subval, *method_val, *lat_val;
+	int i;
+
+	json_set_double(val, "elapsed", elapsed);
+	json_set_double(val, "captured", (double)stats.span / 1000000000);
+	json_set_double(val, "speed", conf.speed);
+	json_set_int64(val, "files", stats.files);
+	json_set_int64(val, "records", stats.records);
+	json_set_int64(val, "connects", stats.connects);
+	json_set_int64(val, "connfails", stats.connfails);
+	json_set_int64(val, "closes", stats.closes);
+	json_set_int64(val, "drops", stats.drops);
+	json_set_int64(val, "unsent", stats.unsent);
+	json_set_int64(val, "templates", stats.templates);
+	json_set_int64(val, "blocks", stats.blocks);
+	subval = json_object();
+	json_set_int64(subval, "captured", stats.cap_notifies);
+	json_set_int64(subval, "replayed", stats.rep_notifies);
+	json_set_object(val, "notifies", subval);
+	subval = json_object();
+	json_set_int64(subval, "remapped", stats.remapped);
+	json_set_int64(subval, "unmapped", stats.unmapped);
+	json_set_object(val, "jobs", subval);
+	json_set_object(val, "connect", lat_hist_json(&stats.connect));
+	subval = json_object();
+	for (i = 0; i < RM_METHODS; i++) {
+		struct replay_method_stats *ms = &stats.methods[i];
+
+		if (!ms->sent)
+			continue;
+		method_val = json_object();
+		json_set_int64(method_val, "sent", ms->sent);
+		json_set_int64(method_val, "matched", ms->matched);
+		json_set_int64(method_val, "diverged", ms->diverged);
+		json_set_int64(method_val, "unanswered", ms->unanswered);
+		json_set_int64(method_val, "uncaptured", ms->uncaptured);
+		lat_val = json_object();
+		json_set_object(lat_val, "captured", lat_hist_json(&ms->captured));
+		json_set_object(lat_val, "replayed", lat_hist_json(&ms->replayed));
+		json_set_object(method_val, "latency", lat_val);
+		json_set_object(subval, replay_methods[i], method_val);
+	}
+	json_set_object(val, "requests", subval);
+	json_set_object(val, "divergences", stats.divergences);
+	json_set_object(val, "examples", stats.examples);
+	return val;
+}
+
+static void sighandler(const int __maybe_unused sig)
+{
+	replay_stop = true;
+}
+
+static bool resolve_url(char *url)
+{
+	struct addrinfo hints, *res;
+	char *host = NULL, *port = NULL;
+	bool ret = false;
+
+	if (!extract_sockaddr(url, &host, &port))
+		return ret;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res))
+		goto out;
+	memcpy(&replay_addr, res->ai_addr, res->ai_addrlen);
+	replay_addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+	ret = true;
+out:
+	free(host);
+	free(port);
+	return ret;
+}
+
+static struct option long_options[] = {
+	{"url",		required_argument,	0,	'a'},
+	{"btcd",	required_argument,	0,	'b'},
+	{"help",	no_argument,		0,	'h'},
+	{"loglevel",	required_argument,	0,	'l'},
+	{"speed",	required_argument,	0,	's'},
+	{"wait",	required_argument,	0,	'w'},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char **argv)
+{
+	struct epoll_event events[REPLAY_EVENTS];
+	int64_t start, now, due = 0, base = 0, drain = 0;
+	struct sigaction handler;
+	replay_files_t files;
+	capture_rec_t rec;
+	int c, i = 0, j;
+	bool have;
+	char *dump;
+	json_t *val;
+
+	while ((c = getopt_long(argc, argv, "a:b:hl:s:w:", long_options, &i)) != -1) {
+		switch(c) {
+			case 'a':
+				conf.url = optarg;
+				break;
+			case 'b':
+				conf.btcd = optarg;
+				break;
+			case 'h':
+				printf("Usage: %s [options] capturefile...\n", argv[0]);
+				for (j = 0; long_options[j].val; j++) {
+					struct option *jopt = &long_options[j];
+
+					if (jopt->has_arg) {
+						char *upper = alloca(strlen(jopt->name) + 1);
+						int offset = 0;
+
+						do {
+							upper[offset] = toupper(jopt->name[offset]);
+						} while (upper[offset++] != '\0');
+						printf("-%c %s | --%s %s\n", jopt->val,
+						       upper, jopt->name, upper);
+					} else
+						printf("-%c | --%s\n", jopt->val, jopt->name);
+				}
+				exit(0);
+			case 'l':
+				replay_loglevel = atoi(optarg);
+				break;
+			case 's':
+				conf.speed = atof(optarg);
+				break;
+			case 'w':
+				conf.wait = atoi(optarg);
+				break;
+		}
+	}
+	if (optind >= argc)
+		quit(1, "No capture files given");
+	if (!conf.url)
+		conf.url = "127.0.0.1:3333";
+	if (conf.speed < 0 || conf.wait < 0)
+		quit(1, "Speed and wait must not be negative");
+	if (!resolve_url(conf.url))
+		quit(1, "Failed to resolve url %s", conf.url);
+
+	signal(SIGPIPE, SIG_IGN);
+	handler.sa_handler = &sighandler;
+	handler.sa_flags = 0;
+	sigemptyset(&handler.sa_mask);
+	sigaction(SIGTERM, &handler, NULL);
+	sigaction(SIGINT, &handler, NULL);
+
+	replay_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (replay_epfd < 0)
+		quit(1, "Failed to create epoll fd");
+	stats.divergences = json_object();
+	stats.examples = json_array();
+	memset(&files, 0, sizeof(files));
+	files.paths = argv + optind;
+	files.npaths = argc - optind;
+
+	start = lat_now();
+	have = next_record(&files, &rec);
+	if (have)
+		base = rec.ns;
+	LOGNOTICE("Replaying %d capture files to %s at %.1fx speed", files.npaths, conf.url,
+		  conf.speed);
+	while (!replay_stop) {
+		int nfds, timeout = REPLAY_TICK_MS;
+
+		now = lat_now();
+		while (have) {
+			/* Speed 0 replays as fast as possible */
+			if (conf.speed > 0)
+				due = start + (rec.ns - base) / conf.speed;
+			if (due > now)
+				break;
+			stats.span = rec.ns - base;
+			replay_record(&rec);
+			have = next_record(&files, &rec);
+		}
+		if (!have) {
+			/* Give the pool time to answer whatever is outstanding */
+			if (!drain)
+				drain = now + (int64_t)conf.wait * 1000000000;
+			else if (now >= drain || stats.inflight <= 0)
+				break;
+		} else if (due - now < REPLAY_TICK_MS * 1000000LL)
+			timeout = (due - now) / 1000000;
+		nfds = epoll_wait(replay_epfd, events, REPLAY_EVENTS, timeout);
+		for (i = 0; i < nfds; i++)
+			client_event(events[i].data.ptr, events[i].events);
+	}
+	if (files.cr)
+		capture_close(files.cr);
+
+	replay_tally();
+	val = replay_summary((double)(lat_now() - start) / 1000000000);
+	dump = json_dumps(val, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
+	printf("%s\n", dump);
+	free(dump);
+	json_decref(val);
+	return 0;
+}
@@ -22,14 +22,31 @@
 #include "utlist.h"
 #include "stratifier.h"
 #include "generator.h"
+#include "capture.h"
+#include "probes.h"
 
 #define MAX_MSGSIZE 1024
 
 typedef struct client_instance client_instance_t;
 typedef struct sender_send sender_send_t;
+typedef struct msg_trace msg_trace_t;
 typedef struct share share_t;
 typedef struct redirect redirect_t;
 
+/* Stages of a sampled share that are timed by the connector */
+enum {
+	CLAT_PARSE,	/* Socket read to queued for the stratifier */
+	CLAT_CMPQ,	/* Response queued by the stratifier to processed here */
+	CLAT_SENDQ,	/* Queued for the sender to first write */
+	CLAT_WRITE,	/* First write to response fully written */
+	CLAT_TOTAL,	/* Socket read to response fully written */
+	CLAT_STAGES
+};
+
+static const char *clat_names[] = {
+	"parse", "cmpq", "sendq", "write", "total"
+};
+
 struct client_instance {
 	/* For clients hashtable */
 	UT_hash_handle hh;
@@ -87,6 +104,13 @@ struct client_instance {
 	int sendbufsize;
 };
 
+/* Timing carried by traced messages to the sender, all 0 if not traced */
+struct msg_trace {
+	int64_t start; /* Monotonic ns a sampled share was read */
+	int64_t last; /* Monotonic ns its last stage finished */
+	int64_t block; /* Block change trace id of a notify */
+};
+
 struct sender_send {
 	struct sender_send *next;
 	struct sender_send *prev;
@@ -95,6 +119,8 @@ struct sender_send {
 	char *buf;
 	int len;
 	int ofs;
+
+	msg_trace_t trace;
 };
 
 struct share {
@@ -172,6 +198,10 @@ struct connector_data {
 
 	/* Have we given the warning about inability to raise sendbuf size */
 	bool wmem_warn;
+
+	/* Share submissions seen while sampling for latency */
+	int64_t trace_count;
+	lat_hist_t share_lat[CLAT_STAGES];
 };
 
 typedef struct connector_data cdata_t;
@@ -271,6 +301,9 @@ bool connector_client_exists(ckpool_t *ckp, int64_t id)
 {
 	cdata_t *cdata = ckp->cdata;
 
+	/* No connector when the stratifier is benchmarked on its own */
+	if (unlikely(!cdata))
+		return false;
 	return client_exists(cdata, id);
 }
 
@@ -362,6 +395,13 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 		dec_instance_ref(cdata, client);
 		return 0;
 	}
+	CKPROBE3(client_accept, client->id, fd, client->address_name);
+	if (unlikely(capture_enabled)) {
+		char address[INET6_ADDRSTRLEN + 8];
+
+		snprintf(address, sizeof(address), "%s:%d", client->address_name, port);
+		capture_record(CAPTURE_CONNECT, client->id, address, strlen(address));
+	}
 
 	return 1;
 }
@@ -374,6 +414,8 @@ static int __drop_client(cdata_t *cdata, client_instance_t *client)
 		goto out;
 	client->invalid = true;
 	ret = client->fd;
+	if (unlikely(capture_enabled))
+		capture_record(CAPTURE_CLOSE, client->id, NULL, 0);
 	/* Closing the fd will automatically remove it from the epoll list */
 	Close(client->fd);
 	HASH_DEL(cdata->clients, client);
@@ -416,6 +458,7 @@ static int drop_client(cdata_t *cdata, client_instance_t *client)
 				   client_id, address_name);
 		}
 		LOGDEBUG("Connector dropped fd %d", fd);
+		CKPROBE2(client_close, client_id, fd);
 		stratifier_drop_id(cdata->ckp, client_id);
 	}
 
@@ -484,7 +527,9 @@ static void drop_all_clients(cdata_t *cdata)
 	ck_wunlock(&cdata->lock);
 }
 
-static void send_client(ckpool_t *ckp, cdata_t *cdata, int64_t id, char *buf);
+static void _send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf,
+			 const msg_trace_t *trace);
+#define send_client(ckp, cdata, id, buf) _send_client(ckp, cdata, id, buf, NULL)
 
 /* Look for shares being submitted via a redirector and add them to a linked
  * list for looking up the responses. */
@@ -520,10 +565,28 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 	ck_wunlock(&cdata->lock);
 }
 
+/* Tag one in every latencysample share submissions with the time it was
+ * read and the time it was queued for the stratifier. Each later stage records
+ * its own duration and passes on the time it finished. */
+static void trace_share(ckpool_t *ckp, cdata_t *cdata, json_t *val, const int64_t tread)
+{
+	int64_t now;
+
+	if (!cmdmatch(json_string_value(json_object_get(val, "method")), "mining.submit"))
+		return;
+	if (__atomic_fetch_add(&cdata->trace_count, 1, __ATOMIC_RELAXED) % ckp->latencysample)
+		return;
+	now = lat_now();
+	lat_observe(&cdata->share_lat[CLAT_PARSE], now - tread);
+	json_object_set_new_nocheck(val, "trace", json_pack("[II]", (json_int_t)tread,
+							    (json_int_t)now));
+}
+
 /* Client is holding a reference count from being on the epoll list. Returns
  * true if we will still be receiving messages from this client. */
 static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
 {
+	int64_t tread = 0;
 	int buflen, ret;
 	json_t *val;
 	char *eol;
@@ -547,6 +610,8 @@ retry:
 		return false;
 	}
 	client->bufofs += ret;
+	if (unlikely(ckp->latencysample))
+		tread = lat_now();
 reparse:
 	eol = memchr(client->buf, '\n', client->bufofs);
 	if (!eol)
@@ -558,14 +623,20 @@ reparse:
 		LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
 		return false;
 	}
+	if (unlikely(capture_enabled))
+		capture_record(CAPTURE_IN, client->id, client->buf, buflen);
 
-	if (!(val = json_loads(client->buf, JSON_DISABLE_EOF_CHECK, NULL))) {
+	if (!(val = json_loadb(client->buf, buflen, JSON_DISABLE_EOF_CHECK, NULL))) {
 		char *buf = strdup("Invalid JSON, disconnecting\n");
 
-		LOGINFO("Client id %"PRId64" sent invalid json message %s", client->id, client->buf);
+		LOGINFO("Client id %"PRId64" sent invalid json message %.*s", client->id, buflen,
+			client->buf);
 		send_client(ckp, cdata, client->id, buf);
 		return false;
 	} else {
+		CKPROBE2(client_parse, client->id, buflen);
+		/* trace is only ever set by us, never trust a client's own */
+		json_object_del(val, "trace");
 		if (client->passthrough) {
 			int64_t passthrough_id;
 
@@ -579,6 +650,8 @@ reparse:
 			json_object_set_new_nocheck(val, "address", json_string(client->address_name));
 		}
 		json_object_set_new_nocheck(val, "server", json_integer(client->server));
+		if (unlikely(tread && !client->passthrough && !ckp->passthrough && !ckp->node))
+			trace_share(ckp, cdata, val, tread);
 
 		/* Do not send messages of clients we've already dropped. We
 		 * do this unlocked as the occasional false negative can be
@@ -774,6 +847,12 @@ static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sende
 
 	client->sending = sender_send;
 	now_t = time(NULL);
+	if (unlikely(sender_send->trace.start && !sender_send->ofs)) {
+		int64_t now = lat_now();
+
+		lat_observe(&cdata->share_lat[CLAT_SENDQ], now - sender_send->trace.last);
+		sender_send->trace.last = now;
+	}
 
 	/* Increase sendbufsize to match large messages sent to clients - this
 	 * usually only applies to clients as mining nodes. */
@@ -805,6 +884,14 @@ static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sende
 		sender_send->len -= ret;
 		client->blocked_time = 0;
 	}
+	if (unlikely(sender_send->trace.start)) {
+		int64_t now = lat_now();
+
+		lat_observe(&cdata->share_lat[CLAT_WRITE], now - sender_send->trace.last);
+		lat_observe(&cdata->share_lat[CLAT_TOTAL], now - sender_send->trace.start);
+	}
+	if (unlikely(sender_send->trace.block))
+		stratifier_block_delivered(ckp, sender_send->trace.block, lat_now());
 out_true:
 	client->sending = NULL;
 	return true;
@@ -907,6 +994,9 @@ static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 	buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
 	json_decref(val);
 
+	if (unlikely(capture_enabled))
+		capture_record(CAPTURE_OUT, client->id, buf, strlen(buf));
+
 	sender_send = ckzalloc(sizeof(sender_send_t));
 	sender_send->client = client;
 	sender_send->buf = buf;
@@ -984,7 +1074,8 @@ out:
 
 /* Send a client by id a heap allocated buffer, allowing this function to
  * free the ram. */
-static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf)
+static void _send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf,
+			 const msg_trace_t *trace)
 {
 	sender_send_t *sender_send;
 	client_instance_t *client;
@@ -1049,10 +1140,15 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 		}
 	}
 
+	if (unlikely(capture_enabled))
+		capture_record(CAPTURE_OUT, id, buf, len);
+
 	sender_send = ckzalloc(sizeof(sender_send_t));
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = len;
+	if (unlikely(trace))
+		sender_send->trace = *trace;
 
 	mutex_lock(&cdata->sender_lock);
 	cdata->sends_generated++;
@@ -1065,7 +1161,8 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 		redirect_client(ckp, client);
 }
 
-static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, json_t *json_msg)
+static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, json_t *json_msg,
+			     const msg_trace_t *trace)
 {
 	client_instance_t *client;
 	char *msg;
@@ -1083,7 +1180,7 @@ static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, j
 		json_object_del(json_msg, "node.method");
 
 	msg = json_dumps(json_msg, JSON_EOL | JSON_COMPACT);
-	send_client(ckp, cdata, client_id, msg);
+	_send_client(ckp, cdata, client_id, msg, trace);
 	json_decref(json_msg);
 }
 
@@ -1111,7 +1208,7 @@ static void passthrough_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t
 	LOGINFO("Connector adding passthrough client %"PRId64, client->id);
 	client->passthrough = true;
 	JSON_CPACK(val, "{sb}", "result", true);
-	send_client_json(ckp, cdata, client->id, val);
+	send_client_json(ckp, cdata, client->id, val, NULL);
 	if (!ckp->rmem_warn)
 		set_recvbufsize(ckp, client->fd, 1048576);
 	if (!ckp->wmem_warn)
@@ -1306,8 +1403,10 @@ out:
 
 static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
 {
+	msg_trace_t trace = {}, *tracep = NULL;
 	cdata_t *cdata = ckp->cdata;
 	client_instance_t *client;
+	json_t *trace_val;
 	int64_t client_id;
 
 	/* Extract the client id from the json message and remove its entry */
@@ -1329,7 +1428,22 @@ static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
 		}
 		dec_instance_ref(cdata, client);
 	}
-	send_client_json(ckp, cdata, client_id, json_msg);
+	/* Sampled share responses carry their trace times to the sender */
+	if (unlikely(ckp->latencysample && (trace_val = json_object_get(json_msg, "trace")))) {
+		trace.start = json_integer_value(json_array_get(trace_val, 0));
+		trace.last = lat_now();
+		lat_observe(&cdata->share_lat[CLAT_CMPQ],
+			    trace.last - json_integer_value(json_array_get(trace_val, 1)));
+		json_object_del(json_msg, "trace");
+		tracep = &trace;
+	}
+	/* As do notifies of a block change */
+	if (unlikely((trace_val = json_object_get(json_msg, "btrace")))) {
+		trace.block = json_integer_value(trace_val);
+		json_object_del(json_msg, "btrace");
+		tracep = &trace;
+	}
+	send_client_json(ckp, cdata, client_id, json_msg, tracep);
 }
 
 void connector_add_message(ckpool_t *ckp, json_t *val)
@@ -1353,6 +1467,38 @@ static void drop_passthrough_client(ckpool_t *ckp, cdata_t *cdata, const int64_t
 	send_client(ckp, cdata, id, msg);
 }
 
+/* Add the per stage share latency summaries measured by the connector */
+void connector_latency(ckpool_t *ckp, json_t *val)
+{
+	cdata_t *cdata = ckp->cdata;
+	int i;
+
+	if (unlikely(!cdata))
+		return;
+	for (i = 0; i < CLAT_STAGES; i++)
+		json_set_object(val, clat_names[i], lat_hist_json(&cdata->share_lat[i]));
+}
+
+/* Add the connector's message queue summaries */
+void connector_queues(ckpool_t *ckp, json_t *val, const int reader)
+{
+	cdata_t *cdata = ckp->cdata;
+	json_t *subval;
+
+	/* Not started yet */
+	if (unlikely(!cdata || !cdata->cevents))
+		return;
+	ckmsgq_stats(cdata->cmpq, sizeof(json_t), &subval, reader);
+	json_set_object(val, "cmpq", subval);
+	ckmsgq_stats(cdata->cevents, sizeof(struct epoll_event), &subval, reader);
+	json_set_object(val, "cevents", subval);
+	if (cdata->upstream_sends) {
+		/* Just the pointer to the string */
+		ckmsgq_stats(cdata->upstream_sends, sizeof(char *), &subval, reader);
+		json_set_object(val, "usender", subval);
+	}
+}
+
 char *connector_stats(void *data, const int runtime)
 {
 	json_t *val = json_object(), *subval;
@@ -1401,6 +1547,14 @@ char *connector_stats(void *data, const int runtime)
 
 	json_set_object(val, "delays", subval);
 
+	connector_queues(cdata->ckp, val, runtime ? QREAD_LOG : QREAD_PROCSTATS);
+
+	if (cdata->ckp->latencysample) {
+		subval = json_object();
+		connector_latency(cdata->ckp, subval);
+		json_set_object(val, "latency", subval);
+	}
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	if (runtime)
@@ -1410,6 +1564,39 @@ char *connector_stats(void *data, const int runtime)
 	return buf;
 }
 
+void connector_metrics(ckpool_t *ckp, metrics_buf_t *mb)
+{
+	cdata_t *cdata = ckp->cdata;
+	int clients, dead, nfds;
+	client_instance_t *client;
+	int64_t sends, delayed;
+
+	ck_rlock(&cdata->lock);
+	clients = HASH_COUNT(cdata->clients);
+	DL_COUNT2(cdata->dead_clients, client, dead, dead_next);
+	nfds = cdata->nfds;
+	ck_runlock(&cdata->lock);
+
+	mutex_lock(&cdata->sender_lock);
+	sends = cdata->sends_queued;
+	delayed = cdata->sends_delayed;
+	mutex_unlock(&cdata->sender_lock);
+
+	metrics_header(mb, "ckpool_connector_clients", "gauge", "Connected clients");
+	metrics_value(mb, "ckpool_connector_clients", NULL, clients);
+	metrics_header(mb, "ckpool_connector_dead_clients", "gauge", "Dead clients awaiting release");
+	metrics_value(mb, "ckpool_connector_dead_clients", NULL, dead);
+	metrics_header(mb, "ckpool_connector_clients_total", "counter", "Clients accepted since startup");
+	metrics_value(mb, "ckpool_connector_clients_total", NULL, nfds);
+	metrics_header(mb, "ckpool_connector_sends_queued", "gauge", "Sends waiting on slow clients");
+	metrics_value(mb, "ckpool_connector_sends_queued", NULL, sends);
+	metrics_header(mb, "ckpool_connector_sends_delayed_total", "counter", "Sends that could not complete immediately");
+	metrics_value(mb, "ckpool_connector_sends_delayed_total", NULL, delayed);
+	metrics_header(mb, "ckpool_connector_queue_depth", "gauge", "Messages waiting on connector queues");
+	metrics_value(mb, "ckpool_connector_queue_depth", "queue=\"cevents\"", ckmsgq_count(cdata->cevents));
+	metrics_value(mb, "ckpool_connector_queue_depth", "queue=\"cmpq\"", ckmsgq_count(cdata->cmpq));
+}
+
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd)
 {
 	cdata_t *cdata = ckp->cdata;
@@ -13,7 +13,10 @@
 int64_t connector_newclientid(ckpool_t *ckp);
 void connector_upstream_msg(ckpool_t *ckp, char *msg);
 void connector_add_message(ckpool_t *ckp, json_t *val);
+void connector_latency(ckpool_t *ckp, json_t *val);
+void connector_queues(ckpool_t *ckp, json_t *val, const int reader);
 char *connector_stats(void *data, const int runtime);
+void connector_metrics(ckpool_t *ckp, metrics_buf_t *mb);
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd);
 bool connector_client_exists(ckpool_t *ckp, int64_t id);
 void *connector(void *arg);
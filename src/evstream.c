@@ -0,0 +1,608 @@
+#include "config.h"
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "evstream.h"
+
+/* Drop subscribers that connect but never send a subscription request */
+#define EVSTREAM_REQTIMEOUT 5
+#define EVSTREAM_MAXREQ 1024
+
+typedef struct evsub evsub_t;
+
+struct evsub {
+	evsub_t *next;
+	evsub_t *prev;
+	int fd;
+
+	/* Subscription request, read before any events are sent */
+	bool subscribed;
+	char req[EVSTREAM_MAXREQ + 4];
+	int reqlen;
+	time_t connected;
+
+	/* Next event sequence number to send */
+	int64_t cursor;
+	char *user;
+	char *worker;
+	int format;
+
+	/* Encoded frames not yet written to the socket */
+	char *wbuf;
+	size_t wlen;
+	size_t wofs;
+	size_t wsize;
+	time_t last_send;
+};
+
+struct evstream {
+	char name[16];
+	char *path;
+	int sockd;
+	int evfd;
+	/* Set when evfd has been written and the stream thread hasn't woken
+	 * yet so publishers only make one syscall per wakeup */
+	bool notified;
+
+	/* Protects the ring and sequence numbers */
+	mutex_t lock;
+	evstream_event_t **ring;
+	int size;
+	int64_t first; /* Sequence number of the first event ever published */
+	int64_t seq; /* Sequence number of the next event to be published */
+
+	const char **types;
+	int ntypes;
+	evstream_binfn binfn;
+	int heartbeat;
+
+	evsub_t *subs;
+	int nconns; /* Connections including those yet to send a request */
+	int nsubs; /* Active subscriptions */
+	pthread_t pth;
+};
+
+static void put_event(evstream_event_t *ev)
+{
+	if (__atomic_sub_fetch(&ev->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	json_decref(ev->val);
+	free(ev->user);
+	free(ev->worker);
+	free(ev->json);
+	free(ev->bin);
+	free(ev);
+}
+
+/* Publish an event to the stream, stealing the reference to val. Never blocks
+ * on subscribers; at worst it overwrites the oldest event in the ring. */
+int64_t evstream_publish(evstream_t *es, const int type, const char *user,
+			 const char *worker, json_t *val)
+{
+	evstream_event_t *ev = ckzalloc(sizeof(evstream_event_t)), *old;
+	int64_t ret;
+
+	ev->type = type;
+	tv_time(&ev->when);
+	if (user)
+		ev->user = strdup(user);
+	if (worker)
+		ev->worker = strdup(worker);
+	ev->val = val;
+	ev->refs = 1;
+
+	mutex_lock(&es->lock);
+	ret = ev->seq = es->seq++;
+	old = es->ring[ret % es->size];
+	es->ring[ret % es->size] = ev;
+	mutex_unlock(&es->lock);
+
+	if (old)
+		put_event(old);
+	if (__atomic_load_n(&es->nsubs, __ATOMIC_RELAXED) &&
+	    !__atomic_exchange_n(&es->notified, true, __ATOMIC_ACQ_REL)) {
+		uint64_t one = 1;
+
+		if (unlikely(write(es->evfd, &one, sizeof(one)) != sizeof(one)))
+			LOGDEBUG("Failed to wake %s stream", es->name);
+	}
+	return ret;
+}
+
+/* Sequence number the next published event will have */
+int64_t evstream_seq(evstream_t *es)
+{
+	int64_t ret;
+
+	mutex_lock(&es->lock);
+	ret = es->seq;
+	mutex_unlock(&es->lock);
+	return ret;
+}
+
+/* Number of subscribers that have sent a valid request */
+int evstream_subscribers(evstream_t *es)
+{
+	return __atomic_load_n(&es->nsubs, __ATOMIC_RELAXED);
+}
+
+/* Parse "subscribe [seq=n] [user=name] [worker=name] [format=json|binary]".
+ * Without a seq the subscription starts with the next published event. */
+bool evstream_parse_request(const char *buf, int64_t *seq, char **user, char **worker,
+			    int *format)
+{
+	char *copy, *tok, *saveptr = NULL;
+	bool ret = false;
+
+	*seq = -1;
+	*user = *worker = NULL;
+	*format = EVSTREAM_JSON;
+
+	if (!buf || strncmp(buf, "subscribe", 9))
+		return ret;
+	copy = strdup(buf + 9);
+	for (tok = strtok_r(copy, " \t\r\n", &saveptr); tok;
+	     tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+		if (!strncmp(tok, "seq=", 4)) {
+			if (sscanf(tok + 4, "%"PRId64, seq) != 1 || *seq < 0)
+				goto out;
+		} else if (!strncmp(tok, "user=", 5) && tok[5]) {
+			free(*user);
+			*user = strdup(tok + 5);
+		} else if (!strncmp(tok, "worker=", 7) && tok[7]) {
+			free(*worker);
+			*worker = strdup(tok + 7);
+		} else if (!strcmp(tok, "format=json"))
+			*format = EVSTREAM_JSON;
+		else if (!strcmp(tok, "format=binary"))
+			*format = EVSTREAM_BINARY;
+		else
+			goto out;
+	}
+	ret = true;
+out:
+	free(copy);
+	if (!ret) {
+		dealloc(*user);
+		dealloc(*worker);
+	}
+	return ret;
+}
+
+static void sub_append(evsub_t *sub, const void *data, const size_t len)
+{
+	if (sub->wlen + len > sub->wsize) {
+		sub->wsize = round_up_page(sub->wlen + len);
+		sub->wbuf = realloc(sub->wbuf, sub->wsize);
+		if (unlikely(!sub->wbuf))
+			quit(1, "Failed to realloc subscriber buffer size %lu", (unsigned long)sub->wsize);
+	}
+	memcpy(sub->wbuf + sub->wlen, data, len);
+	sub->wlen += len;
+}
+
+static void sub_frame(evsub_t *sub, const void *hdr, const uint32_t hdrlen,
+		      const void *data, const uint32_t len)
+{
+	uint32_t msglen = htole32(hdrlen + len);
+
+	sub_append(sub, &msglen, 4);
+	sub_append(sub, hdr, hdrlen);
+	if (len)
+		sub_append(sub, data, len);
+}
+
+static void sub_binframe(evsub_t *sub, const int64_t seq, const int64_t time_us,
+			 const uint32_t type, const void *data, const uint32_t len)
+{
+	struct evstream_binhdr hdr;
+
+	hdr.seq = htole64(seq);
+	hdr.time_us = htole64(time_us);
+	hdr.type = htole32(type);
+	hdr.len = htole32(len);
+	sub_frame(sub, &hdr, sizeof(hdr), data, len);
+}
+
+static void sub_jsonframe(evsub_t *sub, const int64_t seq, const char *type,
+			  const struct timeval *when, const char *data, const int len)
+{
+	uint32_t msglen;
+	char hdr[128];
+	int hlen;
+
+	hlen = snprintf(hdr, 128, "{\"seq\":%"PRId64",\"type\":\"%s\",\"time\":%ld.%06ld,\"data\":",
+			seq, type, (long)when->tv_sec, (long)when->tv_usec);
+	msglen = htole32(hlen + len + 1);
+	sub_append(sub, &msglen, 4);
+	sub_append(sub, hdr, hlen);
+	sub_append(sub, data, len);
+	sub_append(sub, "}", 1);
+}
+
+static void sub_gap(evsub_t *sub, const int64_t from, const int64_t to)
+{
+	struct timeval now;
+	char buf[64];
+	int len;
+
+	tv_time(&now);
+	if (sub->format == EVSTREAM_BINARY) {
+		int64_t range[2] = { htole64(from), htole64(to) };
+
+		sub_binframe(sub, from, now.tv_sec * 1000000ll + now.tv_usec, EVSTREAM_GAP,
+			     range, sizeof(range));
+		return;
+	}
+	len = snprintf(buf, 64, "{\"from\":%"PRId64",\"to\":%"PRId64"}", from, to);
+	sub_jsonframe(sub, from, "gap", &now, buf, len);
+}
+
+static void sub_heartbeat(evstream_t *es, evsub_t *sub)
+{
+	struct timeval now;
+
+	tv_time(&now);
+	if (sub->format == EVSTREAM_BINARY)
+		sub_binframe(sub, sub->cursor, now.tv_sec * 1000000ll + now.tv_usec,
+			     EVSTREAM_HEARTBEAT, NULL, 0);
+	else
+		sub_jsonframe(sub, sub->cursor, "heartbeat", &now, "{}", 2);
+	LOGDEBUG("Sent %s heartbeat to fd %d", es->name, sub->fd);
+}
+
+static bool sub_matches(const evsub_t *sub, const evstream_event_t *ev)
+{
+	if (sub->user && (!ev->user || strcmp(sub->user, ev->user)))
+		return false;
+	if (sub->worker && (!ev->worker || strcmp(sub->worker, ev->worker)))
+		return false;
+	return true;
+}
+
+static void sub_event(evstream_t *es, evsub_t *sub, evstream_event_t *ev)
+{
+	const char *type = ev->type < es->ntypes ? es->types[ev->type] : "unknown";
+
+	/* Only the stream thread touches the cached encodings */
+	if (!ev->json) {
+		ev->json = json_dumps(ev->val, JSON_COMPACT | JSON_PRESERVE_ORDER);
+		if (unlikely(!ev->json))
+			ev->json = strdup("null");
+		ev->jsonlen = strlen(ev->json);
+	}
+	if (sub->format == EVSTREAM_BINARY) {
+		if (!ev->bin && es->binfn)
+			ev->bin = es->binfn(ev, &ev->binlen);
+		if (ev->bin)
+			sub_binframe(sub, ev->seq, ev->when.tv_sec * 1000000ll + ev->when.tv_usec,
+				     ev->type, ev->bin, ev->binlen);
+		else
+			sub_binframe(sub, ev->seq, ev->when.tv_sec * 1000000ll + ev->when.tv_usec,
+				     ev->type, ev->json, ev->jsonlen);
+		return;
+	}
+	sub_jsonframe(sub, ev->seq, type, &ev->when, ev->json, ev->jsonlen);
+}
+
+/* Encode as many events as fit in the subscriber's buffer */
+static void fill_sub(evstream_t *es, evsub_t *sub)
+{
+	while (sub->wlen - sub->wofs < EVSTREAM_SUBBUF) {
+		evstream_event_t *ev = NULL;
+		int64_t oldest;
+
+		mutex_lock(&es->lock);
+		oldest = es->seq - es->size;
+		if (oldest < es->first)
+			oldest = es->first;
+		if (sub->cursor >= oldest && sub->cursor < es->seq) {
+			ev = es->ring[sub->cursor % es->size];
+			__atomic_add_fetch(&ev->refs, 1, __ATOMIC_ACQ_REL);
+		}
+		mutex_unlock(&es->lock);
+
+		if (!ev) {
+			if (sub->cursor >= oldest)
+				break;
+			LOGINFO("%s subscriber fd %d missed events %"PRId64"-%"PRId64,
+				es->name, sub->fd, sub->cursor, oldest - 1);
+			sub_gap(sub, sub->cursor, oldest - 1);
+			sub->cursor = oldest;
+			continue;
+		}
+		sub->cursor = ev->seq + 1;
+		if (sub_matches(sub, ev))
+			sub_event(es, sub, ev);
+		put_event(ev);
+	}
+}
+
+/* Write what we can without blocking. Returns false if the subscriber has
+ * gone away. */
+static bool flush_sub(evsub_t *sub)
+{
+	while (sub->wofs < sub->wlen) {
+		ssize_t ret = send(sub->fd, sub->wbuf + sub->wofs, sub->wlen - sub->wofs,
+				   MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		sub->wofs += ret;
+		sub->last_send = time(NULL);
+	}
+	if (sub->wofs == sub->wlen)
+		sub->wofs = sub->wlen = 0;
+	else if (sub->wofs > sub->wsize / 2) {
+		memmove(sub->wbuf, sub->wbuf + sub->wofs, sub->wlen - sub->wofs);
+		sub->wlen -= sub->wofs;
+		sub->wofs = 0;
+	}
+	return true;
+}
+
+/* Read the length prefixed subscription request. Returns false if the
+ * subscriber should be dropped. */
+static bool read_request(evstream_t *es, evsub_t *sub)
+{
+	uint32_t msglen;
+	ssize_t ret;
+	int want;
+
+	if (sub->reqlen < 4)
+		want = 4 - sub->reqlen;
+	else {
+		memcpy(&msglen, sub->req, 4);
+		msglen = le32toh(msglen);
+		if (msglen < 1 || msglen > EVSTREAM_MAXREQ)
+			return false;
+		want = msglen + 4 - sub->reqlen;
+	}
+	ret = recv(sub->fd, sub->req + sub->reqlen, want, MSG_DONTWAIT);
+	if (ret < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if (!ret)
+		return false;
+	sub->reqlen += ret;
+	if (sub->reqlen < 4)
+		return true;
+	memcpy(&msglen, sub->req, 4);
+	msglen = le32toh(msglen);
+	if (msglen < 1 || msglen > EVSTREAM_MAXREQ)
+		return false;
+	if (sub->reqlen < (int)msglen + 4)
+		return read_request(es, sub);
+	sub->req[sub->reqlen] = '\0';
+	if (!evstream_parse_request(sub->req + 4, &sub->cursor, &sub->user, &sub->worker,
+				    &sub->format)) {
+		LOGNOTICE("Invalid %s subscription request: %s", es->name, sub->req + 4);
+		return false;
+	}
+	mutex_lock(&es->lock);
+	if (sub->cursor < 0 || sub->cursor > es->seq)
+		sub->cursor = es->seq;
+	mutex_unlock(&es->lock);
+	sub->subscribed = true;
+	sub->last_send = time(NULL);
+	__atomic_add_fetch(&es->nsubs, 1, __ATOMIC_RELAXED);
+	LOGNOTICE("New %s subscriber fd %d from seq %"PRId64"%s%s%s%s %s", es->name, sub->fd,
+		  sub->cursor, sub->user ? " user " : "", sub->user ? sub->user : "",
+		  sub->worker ? " worker " : "", sub->worker ? sub->worker : "",
+		  sub->format == EVSTREAM_BINARY ? "binary" : "json");
+	return true;
+}
+
+static void drop_sub(evstream_t *es, evsub_t *sub)
+{
+	LOGINFO("Dropping %s subscriber fd %d", es->name, sub->fd);
+	DL_DELETE(es->subs, sub);
+	es->nconns--;
+	if (sub->subscribed)
+		__atomic_sub_fetch(&es->nsubs, 1, __ATOMIC_RELAXED);
+	Close(sub->fd);
+	free(sub->user);
+	free(sub->worker);
+	free(sub->wbuf);
+	free(sub);
+}
+
+static void accept_sub(evstream_t *es)
+{
+	evsub_t *sub;
+	int fd;
+
+	fd = accept(es->sockd, NULL, NULL);
+	if (unlikely(fd < 0)) {
+		if (errno != EAGAIN && errno != EINTR)
+			LOGWARNING("Failed to accept on %s stream socket", es->name);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	sub = ckzalloc(sizeof(evsub_t));
+	sub->fd = fd;
+	sub->connected = time(NULL);
+	DL_APPEND(es->subs, sub);
+	es->nconns++;
+}
+
+static void *evstream_thread(void *arg)
+{
+	evstream_t *es = (evstream_t *)arg;
+	struct pollfd *pfds = NULL;
+	int npfds = 0, used;
+
+	rename_proc(es->name);
+
+	while (42) {
+		evsub_t *sub, *tmp;
+		time_t now_t;
+		int i, ret;
+
+		if (npfds < es->nconns + 2) {
+			npfds = es->nconns + 16;
+			pfds = realloc(pfds, sizeof(struct pollfd) * npfds);
+			if (unlikely(!pfds))
+				quit(1, "Failed to realloc pollfds in %s", es->name);
+		}
+		pfds[0].fd = es->sockd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = es->evfd;
+		pfds[1].events = POLLIN;
+		i = 2;
+		DL_FOREACH(es->subs, sub) {
+			pfds[i].fd = sub->fd;
+			/* Once subscribed the client may shut down its write
+			 * side so only look for errors and write space */
+			pfds[i].events = sub->subscribed ? 0 : POLLIN;
+			if (sub->wofs < sub->wlen)
+				pfds[i].events |= POLLOUT;
+			pfds[i++].revents = 0;
+		}
+		used = i;
+		ret = poll(pfds, used, 1000);
+		if (unlikely(ret < 0)) {
+			if (errno != EINTR)
+				LOGWARNING("Poll failed in %s", es->name);
+			continue;
+		}
+		if (pfds[1].revents & POLLIN) {
+			uint64_t val;
+
+			__atomic_store_n(&es->notified, false, __ATOMIC_RELEASE);
+			if (read(es->evfd, &val, sizeof(val)) < 0)
+				LOGDEBUG("Failed to read %s eventfd", es->name);
+		}
+		if (pfds[0].revents & POLLIN)
+			accept_sub(es);
+
+		now_t = time(NULL);
+		i = 2;
+		DL_FOREACH_SAFE(es->subs, sub, tmp) {
+			short revents = 0;
+
+			/* Newly accepted subscribers have no pollfd entry yet */
+			if (i < used && pfds[i].fd == sub->fd)
+				revents = pfds[i++].revents;
+			if (!sub->subscribed) {
+				if ((revents & POLLIN) && !read_request(es, sub)) {
+					drop_sub(es, sub);
+					continue;
+				}
+				if (!sub->subscribed) {
+					if (revents & (POLLHUP | POLLERR) ||
+					    now_t - sub->connected > EVSTREAM_REQTIMEOUT)
+						drop_sub(es, sub);
+					continue;
+				}
+			} else if (revents & (POLLHUP | POLLERR | POLLNVAL)) {
+				drop_sub(es, sub);
+				continue;
+			}
+			fill_sub(es, sub);
+			if (sub->wofs == sub->wlen && es->heartbeat &&
+			    now_t - sub->last_send >= es->heartbeat)
+				sub_heartbeat(es, sub);
+			if (!flush_sub(sub))
+				drop_sub(es, sub);
+		}
+	}
+	return NULL;
+}
+
+/* Subscribe to the stream at path with request req, returning the socket to
+ * read frames from with evstream_recv or -1 on failure. */
+int evstream_subscribe(const char *path, const char *req)
+{
+	int sockd = open_unix_client(path);
+
+	if (sockd < 0)
+		return sockd;
+	/* send_unix_msg shuts down our write side which the stream expects */
+	if (!send_unix_msg(sockd, req))
+		Close(sockd);
+	return sockd;
+}
+
+/* Blocking read of one frame from a subscription. Returns an allocated nul
+ * terminated buffer with its length stored in len, or NULL on disconnect. */
+char *evstream_recv(int sockd, int *len)
+{
+	uint32_t msglen;
+	char *buf;
+
+	if (read_length(sockd, &msglen, 4) < 4)
+		return NULL;
+	msglen = le32toh(msglen);
+	if (unlikely(msglen < 1 || msglen > 0x10000000))
+		return NULL;
+	buf = ckalloc(msglen + 1);
+	if (read_length(sockd, buf, msglen) < (int)msglen) {
+		free(buf);
+		return NULL;
+	}
+	buf[msglen] = '\0';
+	*len = msglen;
+	return buf;
+}
+
+/* Create a stream of up to size events served on the unix socket at path.
+ * types names each event type for the JSON encoding, binfn optionally
+ * provides a compact binary payload, and heartbeat is the number of idle
+ * seconds before subscribers are sent a heartbeat (0 to disable). */
+evstream_t *evstream_create(const char *name, const char *path, const int size,
+			    const char **types, const int ntypes, evstream_binfn binfn,
+			    const int heartbeat)
+{
+	evstream_t *es;
+
+	if (unlikely(size < 1)) {
+		LOGWARNING("Invalid %s stream size %d", name, size);
+		return NULL;
+	}
+	es = ckzalloc(sizeof(evstream_t));
+	strncpy(es->name, name, 15);
+	es->path = strdup(path);
+	es->size = size;
+	es->ring = ckzalloc(sizeof(evstream_event_t *) * size);
+	es->types = types;
+	es->ntypes = ntypes;
+	es->binfn = binfn;
+	es->heartbeat = heartbeat;
+	/* Start from the time in the high bits so sequence numbers never go
+	 * backwards across restarts */
+	es->first = es->seq = (int64_t)time(NULL) << 32;
+	mutex_init(&es->lock);
+
+	es->sockd = open_unix_server(path);
+	if (unlikely(es->sockd < 0)) {
+		LOGWARNING("Failed to open %s stream socket %s", name, path);
+		goto out_free;
+	}
+	es->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(es->evfd < 0)) {
+		LOGWARNING("Failed to create eventfd for %s stream", name);
+		close_unix_socket(es->sockd, path);
+		goto out_free;
+	}
+	create_pthread(&es->pth, evstream_thread, es);
+	LOGWARNING("Publishing %s stream of %d events on %s", name, size, path);
+	return es;
+
+out_free:
+	free(es->ring);
+	free(es->path);
+	free(es);
+	return NULL;
+}
@@ -0,0 +1,68 @@
+/* Event streams: bounded rings of events published to unix socket subscribers */
+#ifndef EVSTREAM_H
+#define EVSTREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <jansson.h>
+
+/* Most data buffered for any one subscriber before we stop encoding events
+ * for it. A subscriber that stays this far behind falls off the end of the
+ * ring and is sent a gap event instead of stalling the publisher. */
+#define EVSTREAM_SUBBUF 262144
+
+#define EVSTREAM_JSON 0
+#define EVSTREAM_BINARY 1
+
+/* Every frame on the wire is a 4 byte little endian length followed by the
+ * frame itself, matching send_unix_msg. JSON frames are a single object:
+ * {"seq":n,"type":"name","time":s.us,"data":{...}}
+ * Binary frames start with this header followed by the event payload. */
+struct evstream_binhdr {
+	uint64_t seq;
+	int64_t time_us;
+	uint32_t type;
+	uint32_t len; /* Length of payload after header */
+} __attribute__((packed));
+
+/* Pseudo event types sent on the stream itself */
+#define EVSTREAM_GAP 0xfffffffe
+#define EVSTREAM_HEARTBEAT 0xffffffff
+
+typedef struct evstream_event evstream_event_t;
+
+struct evstream_event {
+	int64_t seq;
+	int type;
+	struct timeval when;
+	char *user;
+	char *worker;
+	json_t *val;
+	/* Encodings are generated lazily by the stream thread and cached */
+	char *json;
+	int jsonlen;
+	char *bin;
+	int binlen;
+	int refs;
+};
+
+/* Generate a binary payload for an event. Returns an allocated buffer and
+ * stores its length in len. */
+typedef char *(*evstream_binfn)(const evstream_event_t *ev, int *len);
+
+typedef struct evstream evstream_t;
+
+evstream_t *evstream_create(const char *name, const char *path, const int size,
+			    const char **types, const int ntypes, evstream_binfn binfn,
+			    const int heartbeat);
+int64_t evstream_publish(evstream_t *es, const int type, const char *user,
+			 const char *worker, json_t *val);
+int64_t evstream_seq(evstream_t *es);
+int evstream_subscribers(evstream_t *es);
+int evstream_subscribe(const char *path, const char *req);
+char *evstream_recv(int sockd, int *len);
+bool evstream_parse_request(const char *buf, int64_t *seq, char **user, char **worker,
+			    int *format);
+
+#endif /* EVSTREAM_H */
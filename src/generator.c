@@ -3299,6 +3299,42 @@ static char *read_cookie(const char *path)
 	return cookie;
 }
 
+void generator_metrics(ckpool_t *ckp, metrics_buf_t *mb)
+{
+	int i;
+
+	if (ckp->proxy || !ckp->servers)
+		return;
+
+	metrics_header(mb, "ckpool_rpc_latency_seconds", "histogram",
+		       "Round trip time of successful json rpc calls to each btcd");
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+		char *url, *labels;
+
+		if (!si)
+			continue;
+		url = metrics_escape(si->url);
+		ASPRINTF(&labels, "btcd=\"%s\"", url);
+		metrics_hist(mb, "ckpool_rpc_latency_seconds", labels, &si->cs.rpc_latency);
+		free(labels);
+		free(url);
+	}
+	metrics_header(mb, "ckpool_btcd_alive", "gauge", "Whether each btcd is responding");
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+		char *url, *labels;
+
+		if (!si)
+			continue;
+		url = metrics_escape(si->url);
+		ASPRINTF(&labels, "btcd=\"%s\"", url);
+		metrics_value(mb, "ckpool_btcd_alive", labels, si->alive);
+		free(labels);
+		free(url);
+	}
+}
+
 /* Check which servers are alive, maintaining a connection with them and
  * reconnect if a higher priority one is available. */
 static void *server_watchdog(void *arg)
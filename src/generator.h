@@ -25,6 +25,7 @@ char *generator_get_txn(ckpool_t *ckp, const char *hash);
 bool generator_submitblock(ckpool_t *ckp, const char *buf);
 void generator_preciousblock(ckpool_t *ckp, const char *hash);
 bool generator_get_blockhash(ckpool_t *ckp, int height, char *hash);
+void generator_metrics(ckpool_t *ckp, metrics_buf_t *mb);
 void *generator(void *arg);
 
 #endif /* GENERATOR_H */
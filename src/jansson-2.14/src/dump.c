@@ -108,6 +108,12 @@ static int dump_string(const char *str, size_t len, json_dump_callback_t dump, v
         int length;
 
         while (end < lim) {
+            /* skip plain ASCII in bulk, leaving the rest to be decoded */
+            pos += jsonp_scan_plain(pos, lim - pos, flags & JSON_ESCAPE_SLASH);
+            end = pos;
+            if (pos == lim)
+                break;
+
             end = utf8_iterate(pos, lim - pos, &codepoint, flags & JSON_NO_UTF8);
             if (!end)
                 return -1;
@@ -82,6 +82,9 @@ void jsonp_error_vset(json_error_t *error, int line, int column, size_t position
 int jsonp_strtod(strbuffer_t *strbuffer, double *out);
 int jsonp_dtostr(char *buffer, size_t size, double value, int prec);
 
+/* Vectorised skip over string bytes needing no escaping */
+size_t jsonp_scan_plain(const char *str, size_t len, int slash);
+
 /* Wrappers for custom memory functions */
 void *jsonp_malloc(size_t size) JANSSON_ATTRS((warn_unused_result));
 void _jsonp_free(void **ptr);
@@ -51,9 +51,16 @@
    behaviour of fgetc(). */
 typedef int (*get_func)(void *data);
 
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t pos;
+} buffer_data_t;
+
 typedef struct {
     get_func get;
     void *data;
+    buffer_data_t *mem; /* input held in memory, NULL when read through get */
     char buffer[5];
     size_t buffer_pos;
     int state;
@@ -139,6 +146,7 @@ static void error_set(json_error_t *error, const lex_t *lex, enum json_error_cod
 static void stream_init(stream_t *stream, get_func get, void *data) {
     stream->get = get;
     stream->data = data;
+    stream->mem = NULL;
     stream->buffer[0] = '\0';
     stream->buffer_pos = 0;
 
@@ -236,6 +244,27 @@ static int lex_get_save(lex_t *lex, json_error_t *error) {
     return c;
 }
 
+/* Save the run of plain ASCII ahead of in-memory input in one go once the
+   stream buffer is drained, rather than a byte at a time through get */
+static void lex_save_plain(lex_t *lex) {
+    stream_t *stream = &lex->stream;
+    buffer_data_t *mem = stream->mem;
+    size_t n;
+
+    if (!mem || stream->buffer[stream->buffer_pos] != '\0' ||
+        stream->state != STREAM_STATE_OK)
+        return;
+
+    n = jsonp_scan_plain(mem->data + mem->pos, mem->len - mem->pos, 0);
+    if (!n)
+        return;
+
+    strbuffer_append_bytes(&lex->saved_text, mem->data + mem->pos, n);
+    mem->pos += n;
+    stream->position += n;
+    stream->column += n;
+}
+
 static void lex_unget(lex_t *lex, int c) { stream_unget(&lex->stream, c); }
 
 static void lex_unget_unsave(lex_t *lex, int c) {
@@ -344,8 +373,10 @@ static void lex_scan_string(lex_t *lex, json_error_t *error) {
                 error_set(error, lex, json_error_invalid_syntax, "invalid escape");
                 goto out;
             }
-        } else
+        } else {
+            lex_save_plain(lex);
             c = lex_get_save(lex, error);
+        }
     }
 
     /* the actual value is at most of the same length as the source
@@ -899,6 +930,17 @@ static int string_get(void *data) {
     }
 }
 
+static int buffer_get(void *data) {
+    char c;
+    buffer_data_t *stream = data;
+    if (stream->pos >= stream->len)
+        return EOF;
+
+    c = stream->data[stream->pos];
+    stream->pos++;
+    return (unsigned char)c;
+}
+
 json_t *json_loads(const char *string, size_t flags, json_error_t *error) {
     lex_t lex;
     json_t *result;
@@ -914,6 +956,9 @@ json_t *json_loads(const char *string, size_t flags, json_error_t *error) {
     stream_data.data = string;
     stream_data.pos = 0;
 
+    /* The length isn't known without scanning the whole string, which may
+       hold more than one value, so this reads a byte at a time up to the
+       NUL. json_loadb saves plain runs straight from its buffer instead */
     if (lex_init(&lex, string_get, flags, (void *)&stream_data))
         return NULL;
 
@@ -923,23 +968,6 @@ json_t *json_loads(const char *string, size_t flags, json_error_t *error) {
     return result;
 }
 
-typedef struct {
-    const char *data;
-    size_t len;
-    size_t pos;
-} buffer_data_t;
-
-static int buffer_get(void *data) {
-    char c;
-    buffer_data_t *stream = data;
-    if (stream->pos >= stream->len)
-        return EOF;
-
-    c = stream->data[stream->pos];
-    stream->pos++;
-    return (unsigned char)c;
-}
-
 json_t *json_loadb(const char *buffer, size_t buflen, size_t flags, json_error_t *error) {
     lex_t lex;
     json_t *result;
@@ -958,6 +986,7 @@ json_t *json_loadb(const char *buffer, size_t buflen, size_t flags, json_error_t
 
     if (lex_init(&lex, buffer_get, flags, (void *)&stream_data))
         return NULL;
+    lex.stream.mem = &stream_data;
 
     result = parse_json(&lex, flags, error);
 
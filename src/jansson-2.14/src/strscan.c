@@ -0,0 +1,137 @@
+/*
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/* Bulk scanning for the runs of plain ASCII that make up most strings, such
+ * as the hex of coinbases, merkle branches and transactions, so the lexer and
+ * dumper only handle quotes, escapes, control characters and UTF-8 one byte at
+ * a time. */
+
+#include "jansson_private.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_SSE2 1
+#if !defined(__AVX2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* Built for plain x86-64, use AVX2 where the CPU has it */
+#define SCAN_AVX2_RUNTIME 1
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SCAN_NEON 1
+#endif
+
+static int plain_byte(unsigned char c, int slash) {
+    return c >= 0x20 && c < 0x80 && c != '"' && c != '\\' && !(slash && c == '/');
+}
+
+static size_t scan_bytes(const char *str, size_t len, int slash) {
+    size_t i = 0;
+
+    while (i < len && plain_byte((unsigned char)str[i], slash))
+        i++;
+    return i;
+}
+
+#ifdef SCAN_SSE2
+/* Bytes below 0x20 and from 0x80 up are both below 0x20 as signed chars */
+static size_t scan_sse2(const char *str, size_t len, int slash) {
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i solidus = _mm_set1_epi8(slash ? '/' : '"');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, quote)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, backslash), _mm_cmpeq_epi8(v, solidus)));
+        int mask = _mm_movemask_epi8(special);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_bytes(str + i, len - i, slash);
+}
+#endif
+
+#if defined(__AVX2__) || defined(SCAN_AVX2_RUNTIME)
+#ifdef SCAN_AVX2_RUNTIME
+__attribute__((target("avx2")))
+#endif
+static size_t scan_avx2(const char *str, size_t len, int slash) {
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i solidus = _mm256_set1_epi8(slash ? '/' : '"');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(str + i));
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, quote)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, backslash), _mm256_cmpeq_epi8(v, solidus)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(special);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_sse2(str + i, len - i, slash);
+}
+#endif
+
+#ifdef SCAN_AVX2_RUNTIME
+static int have_avx2(void) {
+    static int avx2 = -1;
+
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return avx2;
+}
+#endif
+
+#ifdef SCAN_NEON
+static size_t scan_neon(const char *str, size_t len, int slash) {
+    const uint8x16_t space = vdupq_n_u8(0x20);
+    const uint8x16_t high = vdupq_n_u8(0x7F);
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t solidus = vdupq_n_u8(slash ? '/' : '"');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)(str + i));
+        uint8x16_t special =
+            vorrq_u8(vorrq_u8(vcltq_u8(v, space), vcgtq_u8(v, high)),
+                     vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)),
+                              vceqq_u8(v, solidus)));
+
+        if (vmaxvq_u8(special))
+            return i + scan_bytes(str + i, 16, slash);
+    }
+    return i + scan_bytes(str + i, len - i, slash);
+}
+#endif
+
+/* Length of the run of printable ASCII at the start of str that needs no
+   escaping: no quote, backslash, control character, non-ASCII byte or, with
+   slash set, solidus */
+size_t jsonp_scan_plain(const char *str, size_t len, int slash) {
+#if defined(__AVX2__)
+    return scan_avx2(str, len, slash);
+#elif defined(SCAN_SSE2)
+#ifdef SCAN_AVX2_RUNTIME
+    if (len >= 64 && have_avx2())
+        return scan_avx2(str, len, slash);
+#endif
+    return scan_sse2(str, len, slash);
+#elif defined(SCAN_NEON)
+    return scan_neon(str, len, slash);
+#else
+    return scan_bytes(str, len, slash);
+#endif
+}
@@ -20,6 +20,7 @@
 #include <sys/file.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -34,7 +35,11 @@
 #include <arpa/inet.h>
 
 #include "libckpool.h"
+#include "affinity.h"
+#include "lockprof.h"
+#include "threadstats.h"
 #include "sha2.h"
+#include "target256.h"
 #include "utlist.h"
 
 #ifndef UNIX_PATH_MAX
@@ -56,6 +61,44 @@ void __attribute__((weak)) logmsg(int __maybe_unused loglevel, const char *fmt,
 	free(buf);
 }
 
+int logmsg_level = LOG_DEBUG;
+
+/* Format a message on the stack and pass it to logmsg, only allocating and
+ * splitting it into DEFLOGBUFSIZ - 2 byte chunks when it does not fit. errno
+ * is preserved for logmsg to report. */
+void logmsg_chunks(int loglevel, const char *fmt, ...)
+{
+	int errn = errno, len, offset = 0;
+	char buf[DEFLOGBUFSIZ], *msg;
+	va_list ap;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, DEFLOGBUFSIZ - 1, fmt, ap);
+	va_end(ap);
+	if (len < 1)
+		return;
+	if (likely(len <= DEFLOGBUFSIZ - 2)) {
+		errno = errn;
+		logmsg(loglevel, "%s", buf);
+		return;
+	}
+
+	va_start(ap, fmt);
+	VASPRINTF(&msg, fmt, ap);
+	va_end(ap);
+	while (len > 0) {
+		int cpy = MIN(len, DEFLOGBUFSIZ - 2);
+
+		memcpy(buf, msg + offset, cpy);
+		buf[cpy] = '\0';
+		errno = errn;
+		logmsg(loglevel, "%s", buf);
+		offset += cpy;
+		len -= cpy;
+	}
+	free(msg);
+}
+
 void rename_proc(const char *name)
 {
 	char buf[16];
@@ -63,6 +106,8 @@ void rename_proc(const char *name)
 	snprintf(buf, 15, "ckp@%s", name);
 	buf[15] = '\0';
 	prctl(PR_SET_NAME, buf, 0, 0, 0);
+	threadstats_register(name);
+	affinity_apply(name);
 }
 
 void create_pthread(pthread_t *thread, void *(*start_routine)(void *), void *arg)
@@ -115,25 +160,45 @@ bool ck_completion_timeout(void *fn, void *fnarg, int timeout)
 	return !ret;
 }
 
+/* The mutex is released while waiting so a profiled hold ends before the
+ * wait and starts again once it has been reacquired */
 int _cond_wait(pthread_cond_t *cond, mutex_t *lock, const char *file, const char *func, const int line)
 {
+	lockprof_site_t *site = lock->prof_site;
 	int ret;
 
+	if (unlikely(site)) {
+		lock->prof_site = NULL;
+		lockprof_released(site, lock->prof_since);
+	}
 	ret = pthread_cond_wait(cond, &lock->mutex);
 	lock->file = file;
 	lock->func = func;
 	lock->line = line;
+	if (unlikely(site)) {
+		lock->prof_site = site;
+		lock->prof_since = lat_now();
+	}
 	return ret;
 }
 
 int _cond_timedwait(pthread_cond_t *cond, mutex_t *lock, const struct timespec *abstime, const char *file, const char *func, const int line)
 {
+	lockprof_site_t *site = lock->prof_site;
 	int ret;
 
+	if (unlikely(site)) {
+		lock->prof_site = NULL;
+		lockprof_released(site, lock->prof_since);
+	}
 	ret = pthread_cond_timedwait(cond, &lock->mutex, abstime);
 	lock->file = file;
 	lock->func = func;
 	lock->line = line;
+	if (unlikely(site)) {
+		lock->prof_site = site;
+		lock->prof_since = lat_now();
+	}
 	return ret;
 }
 
@@ -162,8 +227,15 @@ int _mutex_timedlock(mutex_t *lock, int timeout, const char *file, const char *f
  * than 10 seconds and fail if we can't get it for longer than a minute. */
 void _mutex_lock(mutex_t *lock, const char *file, const char *func, const int line)
 {
+	bool prof = __atomic_load_n(&lockprof_enabled, __ATOMIC_RELAXED);
+	int64_t wait_start = 0;
 	int ret, retries = 0;
 
+	if (unlikely(prof)) {
+		if (!_mutex_trylock(lock, file, func, line))
+			goto out;
+		wait_start = lat_now();
+	}
 retry:
 	ret = _mutex_timedlock(lock, 10, file, func, line);
 	if (unlikely(ret)) {
@@ -176,13 +248,26 @@ retry:
 		}
 		quitfrom(1, file, func, line, "WTF MUTEX ERROR ON LOCK!");
 	}
+out:
+	if (unlikely(prof))
+		lockprof_acquired(&lock->prof_site, &lock->prof_since, file, func, line,
+				  LOCKPROF_MUTEX, wait_start);
 }
 
 /* Does not unset lock->file/func/line since they're only relevant when the lock is held */
 void _mutex_unlock(mutex_t *lock, const char *file, const char *func, const int line)
 {
+	lockprof_site_t *site = lock->prof_site;
+	int64_t since = 0;
+
+	if (unlikely(site)) {
+		since = lock->prof_since;
+		lock->prof_site = NULL;
+	}
 	if (unlikely(pthread_mutex_unlock(&lock->mutex)))
 		quitfrom(1, file, func, line, "WTF MUTEX ERROR ON UNLOCK!");
+	if (unlikely(site))
+		lockprof_released(site, since);
 }
 
 int _mutex_trylock(mutex_t *lock, __maybe_unused const char *file, __maybe_unused const char *func, __maybe_unused const int line)
@@ -221,8 +306,15 @@ static int wr_timedlock(pthread_rwlock_t *lock, int timeout)
 
 void _wr_lock(rwlock_t *lock, const char *file, const char *func, const int line)
 {
+	bool prof = __atomic_load_n(&lockprof_enabled, __ATOMIC_RELAXED);
+	int64_t wait_start = 0;
 	int ret, retries = 0;
 
+	if (unlikely(prof)) {
+		if (!pthread_rwlock_trywrlock(&lock->rwlock))
+			goto out;
+		wait_start = lat_now();
+	}
 retry:
 	ret = wr_timedlock(&lock->rwlock, 10);
 	if (unlikely(ret)) {
@@ -235,9 +327,13 @@ retry:
 		}
 		quitfrom(1, file, func, line, "WTF ERROR ON WRITE LOCK!");
 	}
+out:
 	lock->file = file;
 	lock->func = func;
 	lock->line = line;
+	if (unlikely(prof))
+		lockprof_acquired(&lock->prof_site, &lock->prof_since, file, func, line,
+				  LOCKPROF_WRLOCK, wait_start);
 }
 
 int _wr_trylock(rwlock_t *lock, __maybe_unused const char *file, __maybe_unused const char *func, __maybe_unused const int line)
@@ -269,8 +365,15 @@ static int rd_timedlock(pthread_rwlock_t *lock, int timeout)
 
 void _rd_lock(rwlock_t *lock, const char *file, const char *func, const int line)
 {
+	bool prof = __atomic_load_n(&lockprof_enabled, __ATOMIC_RELAXED);
+	int64_t wait_start = 0;
 	int ret, retries = 0;
 
+	if (unlikely(prof)) {
+		if (!pthread_rwlock_tryrdlock(&lock->rwlock))
+			goto out;
+		wait_start = lat_now();
+	}
 retry:
 	ret = rd_timedlock(&lock->rwlock, 10);
 	if (unlikely(ret)) {
@@ -283,15 +386,29 @@ retry:
 		}
 		quitfrom(1, file, func, line, "WTF ERROR ON READ LOCK!");
 	}
+out:
 	lock->file = file;
 	lock->func = func;
 	lock->line = line;
+	/* Readers share the lock so only their wait is profiled */
+	if (unlikely(prof))
+		lockprof_acquired(NULL, NULL, file, func, line, LOCKPROF_RDLOCK, wait_start);
 }
 
+/* Only a profiled writer sets prof_site so readers always find it unset */
 void _rw_unlock(rwlock_t *lock, const char *file, const char *func, const int line)
 {
+	lockprof_site_t *site = lock->prof_site;
+	int64_t since = 0;
+
+	if (unlikely(site)) {
+		since = lock->prof_since;
+		lock->prof_site = NULL;
+	}
 	if (unlikely(pthread_rwlock_unlock(&lock->rwlock)))
 		quitfrom(1, file, func, line, "WTF RWLOCK ERROR ON UNLOCK!");
+	if (unlikely(site))
+		lockprof_released(site, since);
 }
 
 void _rd_unlock(rwlock_t *lock, const char *file, const char *func, const int line)
@@ -306,12 +423,14 @@ void _wr_unlock(rwlock_t *lock, const char *file, const char *func, const int li
 
 void _mutex_init(mutex_t *lock, const char *file, const char *func, const int line)
 {
+	lock->prof_site = NULL;
 	if (unlikely(pthread_mutex_init(&lock->mutex, NULL)))
 		quitfrom(1, file, func, line, "Failed to pthread_mutex_init");
 }
 
 void _rwlock_init(rwlock_t *lock, const char *file, const char *func, const int line)
 {
+	lock->prof_site = NULL;
 	if (unlikely(pthread_rwlock_init(&lock->rwlock, NULL)))
 		quitfrom(1, file, func, line, "Failed to pthread_rwlock_init");
 }
@@ -1348,40 +1467,227 @@ char *rotating_filename(const char *path, time_t when)
 	return filename;
 }
 
-/* Creates a logfile entry which changes filename hourly with exclusive access */
-bool rotating_log(const char *path, const char *msg)
+/* Every rotating log, so that all are flushed at exit */
+static rotlog_t *rotlogs;
+static pthread_mutex_t rotlogs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Write out anything buffered in every rotating log */
+void rotlog_flush_all(void)
 {
-	mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-	char *filename;
-	FILE *fp;
-	int fd;
-	bool ok = false;
+	rotlog_t *rl;
 
-	filename = rotating_filename(path, time(NULL));
-	fd = open(filename, O_CREAT | O_RDWR | O_CLOEXEC , mode);
-	if (unlikely(fd == -1)) {
-		LOGERR("Failed to open %s in rotating_log!", filename);
-		goto stageleft;
+	pthread_mutex_lock(&rotlogs_lock);
+	DL_FOREACH(rotlogs, rl)
+		rotlog_flush(rl);
+	pthread_mutex_unlock(&rotlogs_lock);
+}
+
+static rotlog_t *__rotlog_create(const char *path, const int bufsiz)
+{
+	static bool registered;
+	rotlog_t *rl = ckzalloc(sizeof(rotlog_t));
+
+	mutex_init(&rl->lock);
+	if (path)
+		rl->path = strdup(path);
+	rl->fd = -1;
+	rl->hour = -1;
+	if (bufsiz > 0) {
+		rl->bufsiz = bufsiz;
+		rl->buf = ckalloc(bufsiz);
 	}
-	fp = fdopen(fd, "ae");
-	if (unlikely(!fp)) {
-		Close(fd);
-		LOGERR("Failed to fdopen %s in rotating_log!", filename);
-		goto stageleft;
+	rl->flushed = time(NULL);
+	if (!registered) {
+		atexit(rotlog_flush_all);
+		registered = true;
 	}
-	if (unlikely(flock(fd, LOCK_EX))) {
-		fclose(fp);
-		LOGERR("Failed to flock %s in rotating_log!", filename);
-		goto stageleft;
+	DL_APPEND(rotlogs, rl);
+	return rl;
+}
+
+/* Buffer up to bufsiz bytes of lines, or write each line through with no
+ * buffer when bufsiz is 0. path is the prefix of hourly files written by
+ * rotlog_write and may be NULL when only rotlog_write_to is used. */
+rotlog_t *rotlog_create(const char *path, const int bufsiz)
+{
+	rotlog_t *rl;
+
+	pthread_mutex_lock(&rotlogs_lock);
+	rl = __rotlog_create(path, bufsiz);
+	pthread_mutex_unlock(&rotlogs_lock);
+	return rl;
+}
+
+static bool writev_all(const int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t ret = writev(fd, iov, iovcnt);
+
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		while (iovcnt && ret >= (ssize_t)iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
 	}
-	fprintf(fp, "%s\n", msg);
-	fclose(fp);
-	ok = true;
+	return true;
+}
+
+/* Write whole lines, adding a newline if nl, under an exclusive flock for
+ * readers of the file */
+static bool __rotlog_write(rotlog_t *rl, const char *buf, const int len, const bool nl)
+{
+	struct iovec iov[2] = { { (void *)buf, len }, { "\n", 1 } };
+	bool ret;
+
+	if (unlikely(flock(rl->fd, LOCK_EX))) {
+		LOGERR("Failed to flock %s in rotating log!", rl->filename);
+		return false;
+	}
+	ret = writev_all(rl->fd, iov, nl ? 2 : 1);
+	flock(rl->fd, LOCK_UN);
+	if (unlikely(!ret))
+		LOGERR("Failed to write %d bytes to %s in rotating log!", len, rl->filename);
+	rl->writes++;
+	return ret;
+}
 
-stageleft:
-	free(filename);
+static bool __rotlog_flush(rotlog_t *rl)
+{
+	bool ret = true;
 
-	return ok;
+	if (rl->buflen && rl->fd != -1)
+		ret = __rotlog_write(rl, rl->buf, rl->buflen, false);
+	rl->buflen = 0;
+	rl->flushed = time(NULL);
+	return ret;
+}
+
+/* Switch to filename if it is not already the open file */
+static bool __rotlog_open(rotlog_t *rl, const char *filename)
+{
+	mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+
+	if (rl->fd != -1 && !strcmp(rl->filename, filename))
+		return true;
+	__rotlog_flush(rl);
+	if (rl->fd != -1)
+		Close(rl->fd);
+	dealloc(rl->filename);
+	rl->fd = open(filename, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, mode);
+	if (unlikely(rl->fd == -1)) {
+		LOGERR("Failed to open %s in rotating log!", filename);
+		return false;
+	}
+	rl->filename = strdup(filename);
+	rl->opens++;
+	return true;
+}
+
+/* Add msg of len bytes to the open file, with a newline if it lacks one */
+static bool __rotlog_append(rotlog_t *rl, const char *msg, const int len)
+{
+	bool nl = !len || msg[len - 1] != '\n';
+	int total = nl ? len + 1 : len;
+	bool ret = true;
+
+	rl->lines++;
+	if (rl->buflen + total > rl->bufsiz)
+		ret = __rotlog_flush(rl);
+	if (total > rl->bufsiz)
+		return __rotlog_write(rl, msg, len, nl) && ret;
+
+	memcpy(rl->buf + rl->buflen, msg, len);
+	rl->buflen += len;
+	if (nl)
+		rl->buf[rl->buflen++] = '\n';
+	if (time(NULL) != rl->flushed)
+		ret = __rotlog_flush(rl);
+	return ret;
+}
+
+/* Append msg as a line to the hourly file named from path, moving to the
+ * next file when the hour changes */
+bool rotlog_write(rotlog_t *rl, const char *msg)
+{
+	time_t now = time(NULL);
+	bool ret = false;
+
+	mutex_lock(&rl->lock);
+	if (rl->fd == -1 || now / 3600 != rl->hour) {
+		char *filename = rotating_filename(rl->path, now);
+
+		rl->hour = now / 3600;
+		ret = __rotlog_open(rl, filename);
+		free(filename);
+		if (unlikely(!ret))
+			goto out;
+	}
+	ret = __rotlog_append(rl, msg, strlen(msg));
+out:
+	mutex_unlock(&rl->lock);
+	return ret;
+}
+
+/* Append msg of len bytes as a line to filename, keeping it open for the
+ * next line written to the same file */
+bool rotlog_write_to(rotlog_t *rl, const char *filename, const char *msg, const int len)
+{
+	bool ret = false;
+
+	mutex_lock(&rl->lock);
+	if (likely(__rotlog_open(rl, filename)))
+		ret = __rotlog_append(rl, msg, len);
+	mutex_unlock(&rl->lock);
+	return ret;
+}
+
+/* Write out anything buffered, such as periodically when idle */
+void rotlog_flush(rotlog_t *rl)
+{
+	mutex_lock(&rl->lock);
+	__rotlog_flush(rl);
+	mutex_unlock(&rl->lock);
+}
+
+void rotlog_close(rotlog_t *rl)
+{
+	pthread_mutex_lock(&rotlogs_lock);
+	DL_DELETE(rotlogs, rl);
+	pthread_mutex_unlock(&rotlogs_lock);
+	__rotlog_flush(rl);
+	if (rl->fd != -1)
+		Close(rl->fd);
+	mutex_destroy(&rl->lock);
+	free(rl->filename);
+	free(rl->path);
+	free(rl->buf);
+	free(rl);
+}
+
+/* Creates a logfile entry which changes filename hourly with exclusive access.
+ * Each path keeps its file open and writes every line through. */
+bool rotating_log(const char *path, const char *msg)
+{
+	rotlog_t *rl;
+
+	pthread_mutex_lock(&rotlogs_lock);
+	DL_FOREACH(rotlogs, rl) {
+		if (rl->path && !rl->bufsiz && !strcmp(rl->path, path))
+			break;
+	}
+	if (!rl)
+		rl = __rotlog_create(path, 0);
+	pthread_mutex_unlock(&rotlogs_lock);
+	return rotlog_write(rl, msg);
 }
 
 /* Align a size_t to 4 byte boundaries for fussy arches */
@@ -1483,6 +1789,28 @@ void *_ckzalloc(size_t len, const char *file, const char *func, const int line)
 	return ptr;
 }
 
+/* As ckzalloc for structures with members aligned beyond what malloc
+ * guarantees, such as cacheline aligned counters. Freed with free. */
+void *_ckzalloc_aligned(size_t align, size_t len, const char *file, const char *func, const int line)
+{
+	int backoff = 1;
+	void *ptr;
+
+	align_len(&len);
+	while (42) {
+		if (likely(!posix_memalign(&ptr, align, len)))
+			break;
+		if (backoff == 1) {
+			fprintf(stderr, "Failed to ckzalloc_aligned %d, retrying from %s %s:%d\n",
+				(int)len, file, func, line);
+		}
+		cksleep_ms(backoff);
+		backoff <<= 1;
+	}
+	memset(ptr, 0, len);
+	return ptr;
+}
+
 /* Round up to the nearest page size for efficient malloc */
 size_t round_up_page(size_t len)
 {
@@ -1887,25 +2215,10 @@ int get_sernumber(uchar *s)
 /* For testing a le encoded 256 byte hash against a target */
 bool fulltest(const uchar *hash, const uchar *target)
 {
-	uint32_t *hash32 = (uint32_t *)hash;
-	uint32_t *target32 = (uint32_t *)target;
-	bool ret = true;
-	int i;
+	target256_t t256;
 
-	for (i = 28 / 4; i >= 0; i--) {
-		uint32_t h32tmp = le32toh(hash32[i]);
-		uint32_t t32tmp = le32toh(target32[i]);
-
-		if (h32tmp > t32tmp) {
-			ret = false;
-			break;
-		}
-		if (h32tmp < t32tmp) {
-			ret = true;
-			break;
-		}
-	}
-	return ret;
+	target256_from_le(&t256, target);
+	return target256_meets(hash, &t256);
 }
 
 void copy_tv(tv_t *dest, const tv_t *src)
@@ -2244,47 +2557,13 @@ double diff_from_nbits(char *nbits)
 	return diff_from_betarget(target);
 }
 
+/* Exact rather than through doubles, see target256.c */
 void target_from_diff(uchar *target, double diff)
 {
-	uint64_t *data64, h64;
-	double d64, dcut64;
-
-	if (unlikely(diff == 0.0)) {
-		/* This shouldn't happen but best we check to prevent a crash */
-		memset(target, 0xff, 32);
-		return;
-	}
-
-	d64 = truediffone;
-	d64 /= diff;
+	target256_t t256;
 
-	dcut64 = d64 / bits192;
-	h64 = dcut64;
-	data64 = (uint64_t *)(target + 24);
-	*data64 = htole64(h64);
-	dcut64 = h64;
-	dcut64 *= bits192;
-	d64 -= dcut64;
-
-	dcut64 = d64 / bits128;
-	h64 = dcut64;
-	data64 = (uint64_t *)(target + 16);
-	*data64 = htole64(h64);
-	dcut64 = h64;
-	dcut64 *= bits128;
-	d64 -= dcut64;
-
-	dcut64 = d64 / bits64;
-	h64 = dcut64;
-	data64 = (uint64_t *)(target + 8);
-	*data64 = htole64(h64);
-	dcut64 = h64;
-	dcut64 *= bits64;
-	d64 -= dcut64;
-
-	h64 = d64;
-	data64 = (uint64_t *)(target);
-	*data64 = htole64(h64);
+	target256_from_diff(&t256, diff);
+	target256_to_le(target, &t256);
 }
 
 void gen_hash(uchar *data, uchar *hash, int len)
@@ -227,6 +227,7 @@ static inline double normalize_pool_diff_ceil(const double diff)
 
 #define ckalloc(len) _ckalloc(len, __FILE__, __func__, __LINE__)
 #define ckzalloc(len) _ckzalloc(len, __FILE__, __func__, __LINE__)
+#define ckzalloc_aligned(align, len) _ckzalloc_aligned(align, len, __FILE__, __func__, __LINE__)
 
 #define dealloc(ptr) do { \
 	free(ptr); \
@@ -244,23 +245,18 @@ static inline double normalize_pool_diff_ceil(const double diff)
 } while (0)
 
 void logmsg(int loglevel, const char *fmt, ...);
+void logmsg_chunks(int loglevel, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+/* Messages less urgent than this are discarded before being formatted */
+extern int logmsg_level;
 
 #define DEFLOGBUFSIZ 512
 
+/* Messages are passed to logmsg in chunks of at most DEFLOGBUFSIZ - 2 bytes.
+ * __siz is kept for existing callers, it never changed the chunk size. */
 #define LOGMSGSIZ(__siz, __lvl, __fmt, ...) do { \
-	char *BUF; \
-	int LEN, OFFSET = 0; \
-	ASPRINTF(&BUF, __fmt, ##__VA_ARGS__); \
-	LEN = strlen(BUF); \
-	while (LEN > 0) { \
-		char tmp42[__siz] = {}; \
-		int CPY = MIN(LEN, DEFLOGBUFSIZ - 2); \
-		memcpy(tmp42, BUF + OFFSET, CPY); \
-		logmsg(__lvl, "%s", tmp42);\
-		OFFSET += CPY; \
-		LEN -= CPY; \
-	} \
-	free(BUF); \
+	if ((__lvl) <= logmsg_level) \
+		logmsg_chunks(__lvl, __fmt, ##__VA_ARGS__); \
 } while(0)
 
 #define LOGMSG(_lvl, _fmt, ...) \
@@ -353,6 +349,10 @@ static const char __maybe_unused *share_errs[] = {
 
 #define SHARE_ERR(x) share_errs[((x) + 9)]
 
+/* Index of a share result in arrays with a slot for every share_err */
+#define SHARE_RESULT_IDX(x) ((x) - SE_INVALID_NONCE2)
+#define SHARE_RESULTS (SHARE_RESULT_IDX(SE_INVALID_VERSION_MASK) + 1)
+
 /* Standard Stratum error codes for each share_err value.
  * Indexed same as share_errs: (enum value + 9). */
 static const int __maybe_unused share_codes[] = {
@@ -389,6 +389,8 @@ static inline json_t *json_err_array(const enum share_err err)
 	return arr;
 }
 
+struct lockprof_site;
+
 typedef struct ckmutex mutex_t;
 
 struct ckmutex {
@@ -396,6 +398,9 @@ struct ckmutex {
 	const char *file;
 	const char *func;
 	int line;
+	/* Profiled call site holding the lock, and since when */
+	struct lockprof_site *prof_site;
+	int64_t prof_since;
 };
 
 typedef struct ckrwlock rwlock_t;
@@ -405,6 +410,9 @@ struct ckrwlock {
 	const char *file;
 	const char *func;
 	int line;
+	/* Profiled call site holding the write lock, and since when */
+	struct lockprof_site *prof_site;
+	int64_t prof_since;
 };
 
 /* ck locks, a write biased variant of rwlocks */
@@ -636,7 +644,42 @@ const char *__json_array_string(json_t *val, unsigned int entry);
 char *json_array_string(json_t *val, unsigned int entry);
 json_t *json_object_dup(json_t *val, const char *entry);
 
+/* Default bytes of whole lines a rotating log buffers between writes */
+#define ROTLOG_BUFSIZ (64 * 1024)
+
+typedef struct rotlog rotlog_t;
+
+/* A log file kept open between lines, either hourly files named from path
+ * or whichever file each line is written to. Lines are buffered and only
+ * whole lines are written, under flock, at least once a second when lines
+ * are being added, on rotation, rotlog_flush and at exit. */
+struct rotlog {
+	rotlog_t *next;
+	rotlog_t *prev;
+	mutex_t lock;
+
+	char *path; /* Prefix of hourly files */
+	char *filename; /* Currently open file */
+	int fd;
+	time_t hour; /* Hours since the epoch of the open hourly file */
+
+	char *buf; /* No buffer writes each line through */
+	int buflen;
+	int bufsiz;
+	time_t flushed;
+
+	int64_t lines;
+	int64_t writes;
+	int64_t opens;
+};
+
 char *rotating_filename(const char *path, time_t when);
+rotlog_t *rotlog_create(const char *path, const int bufsiz);
+bool rotlog_write(rotlog_t *rl, const char *msg);
+bool rotlog_write_to(rotlog_t *rl, const char *filename, const char *msg, const int len);
+void rotlog_flush(rotlog_t *rl);
+void rotlog_flush_all(void);
+void rotlog_close(rotlog_t *rl);
 bool rotating_log(const char *path, const char *msg);
 
 void align_len(size_t *len);
@@ -645,6 +688,7 @@ void trail_slash(char **buf);
 void *_ckalloc(size_t len, const char *file, const char *func, const int line);
 void *json_ckalloc(size_t size);
 void *_ckzalloc(size_t len, const char *file, const char *func, const int line);
+void *_ckzalloc_aligned(size_t align, size_t len, const char *file, const char *func, const int line);
 size_t round_up_page(size_t len);
 
 extern const int hex2bin_tbl[];
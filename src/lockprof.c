@@ -0,0 +1,172 @@
+#include "config.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libckpool.h"
+#include "lockprof.h"
+
+bool lockprof_enabled;
+
+/* Allocated on first enable and never freed so sites looked up by lock
+ * holders stay valid after profiling is disabled again */
+static lockprof_site_t *sites;
+
+/* Only taken to add a new site; the plain pthread mutex avoids recursing
+ * into the profiled wrappers */
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *lockprof_types[] = {
+	"mutex", "read", "write"
+};
+
+void lockprof_enable(const bool enable)
+{
+	if (enable && !__atomic_load_n(&sites, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&sites_lock);
+		if (!sites)
+			__atomic_store_n(&sites, ckzalloc(sizeof(lockprof_site_t) * LOCKPROF_SITES),
+					 __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&sites_lock);
+	}
+	__atomic_store_n(&lockprof_enabled, enable, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t site_hash(const char *file, const int line, const int type)
+{
+	uint64_t key = (uintptr_t)file ^ ((uint64_t)line << 2) ^ type;
+
+	key *= 0x9E3779B97F4A7C15ULL;
+	return key >> 32;
+}
+
+static inline bool site_match(const lockprof_site_t *site, const char *file, const int line,
+			      const int type)
+{
+	return site->file == file && site->line == line && site->type == type;
+}
+
+/* Find the site for a call site, adding it if it is new. Lookups of existing
+ * sites take no locks. Returns NULL once the table is full. */
+static lockprof_site_t *find_site(lockprof_site_t *table, const char *file, const char *func,
+				  const int line, const int type)
+{
+	uint32_t hash = site_hash(file, line, type), i;
+	lockprof_site_t *site;
+
+	for (i = 0; i < LOCKPROF_SITES; i++) {
+		site = &table[(hash + i) & (LOCKPROF_SITES - 1)];
+		if (!__atomic_load_n(&site->ready, __ATOMIC_ACQUIRE))
+			break;
+		if (site_match(site, file, line, type))
+			return site;
+	}
+	if (i == LOCKPROF_SITES)
+		return NULL;
+
+	/* Slots only become ready under sites_lock so probe again with it held */
+	pthread_mutex_lock(&sites_lock);
+	for (; i < LOCKPROF_SITES; i++) {
+		site = &table[(hash + i) & (LOCKPROF_SITES - 1)];
+		if (!site->ready) {
+			site->file = file;
+			site->func = func;
+			site->line = line;
+			site->type = type;
+			__atomic_store_n(&site->ready, true, __ATOMIC_RELEASE);
+			break;
+		}
+		if (site_match(site, file, line, type))
+			break;
+	}
+	pthread_mutex_unlock(&sites_lock);
+	return i < LOCKPROF_SITES ? site : NULL;
+}
+
+/* Account for a lock just acquired by a call site. wait_start is when the
+ * caller started blocking on it, or 0 if it was taken without waiting. For
+ * exclusive locks the site and time are stored with the lock via site and
+ * since so the holder's unlock can record the hold time. */
+void lockprof_acquired(lockprof_site_t **site, int64_t *since, const char *file,
+		       const char *func, const int line, const int type, const int64_t wait_start)
+{
+	lockprof_site_t *table = __atomic_load_n(&sites, __ATOMIC_ACQUIRE), *ls;
+	int64_t now = lat_now();
+
+	if (unlikely(!table))
+		return;
+	ls = find_site(table, file, func, line, type);
+	if (unlikely(!ls))
+		return;
+	__atomic_add_fetch(&ls->acquires, 1, __ATOMIC_RELAXED);
+	if (wait_start) {
+		__atomic_add_fetch(&ls->contended, 1, __ATOMIC_RELAXED);
+		lat_observe(&ls->wait, now - wait_start);
+	} else
+		lat_observe(&ls->wait, 0);
+	if (site) {
+		*site = ls;
+		*since = now;
+	}
+}
+
+void lockprof_released(lockprof_site_t *site, const int64_t since)
+{
+	lat_observe(&site->hold, lat_now() - since);
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+	const lockprof_site_t *sa = *(lockprof_site_t * const *)a;
+	const lockprof_site_t *sb = *(lockprof_site_t * const *)b;
+	uint64_t wa = __atomic_load_n(&sa->wait.sum_ns, __ATOMIC_RELAXED);
+	uint64_t wb = __atomic_load_n(&sb->wait.sum_ns, __ATOMIC_RELAXED);
+
+	if (wa != wb)
+		return wa < wb ? 1 : -1;
+	if (sa->contended != sb->contended)
+		return sa->contended < sb->contended ? 1 : -1;
+	return 0;
+}
+
+/* The top call sites by total time spent waiting for their lock, with wait
+ * and hold time percentiles in microseconds */
+json_t *lockprof_json(const int top)
+{
+	lockprof_site_t *table = __atomic_load_n(&sites, __ATOMIC_ACQUIRE), **sorted;
+	json_t *val = json_object(), *arr_val = json_array(), *site_val;
+	int i, count = 0;
+
+	json_set_bool(val, "enabled", __atomic_load_n(&lockprof_enabled, __ATOMIC_RELAXED));
+	if (!table)
+		goto out;
+
+	sorted = ckalloc(sizeof(lockprof_site_t *) * LOCKPROF_SITES);
+	for (i = 0; i < LOCKPROF_SITES; i++) {
+		if (__atomic_load_n(&table[i].ready, __ATOMIC_ACQUIRE))
+			sorted[count++] = &table[i];
+	}
+	/* Counters are still changing, so the order is approximate */
+	qsort(sorted, count, sizeof(lockprof_site_t *), site_cmp);
+	for (i = 0; i < count && i < top; i++) {
+		lockprof_site_t *ls = sorted[i];
+
+		JSON_CPACK(site_val, "{ss,ss,si,ss,sI,sI}",
+			   "file", ls->file,
+			   "func", ls->func,
+			   "line", ls->line,
+			   "type", lockprof_types[ls->type],
+			   "acquires", __atomic_load_n(&ls->acquires, __ATOMIC_RELAXED),
+			   "contended", __atomic_load_n(&ls->contended, __ATOMIC_RELAXED));
+		json_set_object(site_val, "wait", lat_hist_json(&ls->wait));
+		if (ls->type != LOCKPROF_RDLOCK)
+			json_set_object(site_val, "hold", lat_hist_json(&ls->hold));
+		json_array_append_new(arr_val, site_val);
+	}
+	free(sorted);
+out:
+	json_set_int(val, "sites", count);
+	json_set_object(val, "top", arr_val);
+	return val;
+}
@@ -0,0 +1,47 @@
+/* Optional per call site lock contention profiler for the libckpool lock
+ * wrappers */
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <jansson.h>
+
+#include "metrics.h"
+
+/* Call sites tracked, a power of two. Sites beyond this are not profiled. */
+#define LOCKPROF_SITES 1024
+
+/* Default number of sites returned by the report */
+#define LOCKPROF_TOP 20
+
+enum lockprof_type {
+	LOCKPROF_MUTEX,
+	LOCKPROF_RDLOCK,
+	LOCKPROF_WRLOCK
+};
+
+typedef struct lockprof_site lockprof_site_t;
+
+struct lockprof_site {
+	const char *file;
+	const char *func;
+	int line;
+	int type;
+	bool ready; /* Set once the fields above are filled in */
+	int64_t acquires;
+	int64_t contended; /* Acquisitions that could not be taken immediately */
+	lat_hist_t wait;
+	lat_hist_t hold; /* Not kept for read locks which may be shared */
+};
+
+/* Checked by every lock acquisition; the only cost when disabled */
+extern bool lockprof_enabled;
+
+void lockprof_enable(const bool enable);
+void lockprof_acquired(lockprof_site_t **site, int64_t *since, const char *file,
+		       const char *func, const int line, const int type, const int64_t wait_start);
+void lockprof_released(lockprof_site_t *site, const int64_t since);
+json_t *lockprof_json(const int top);
+
+#endif /* LOCKPROF_H */
@@ -0,0 +1,484 @@
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "logring.h"
+
+/* Records gathered into each writev */
+#define LOGRING_BATCH 128
+
+static const char console_clear[] = "\33[2K\r";
+
+typedef struct logrec logrec_t;
+
+struct logrec {
+	uint64_t seq;
+	int level;
+	int len;
+	bool cont; /* Continues the line in the previous record */
+	char buf[LOGRING_RECSIZ];
+};
+
+typedef struct logring logring_t;
+
+struct logring {
+	logring_t *next;
+	logring_t *prev;
+	bool dead; /* Owning thread has exited */
+
+	/* Only written by the owning thread */
+	char pad0[64];
+	uint64_t head;
+	char pad1[64];
+
+	/* Only written by the flusher. Records between tail and cursor are
+	 * being written and are handed back to the owner at tail. */
+	uint64_t tail;
+	uint64_t cursor;
+	char pad2[64];
+
+	logrec_t recs[LOGRING_RECS];
+};
+
+static struct {
+	int64_t lines;
+	int64_t bytes;
+	int64_t batches;
+	int64_t waits; /* Lines that waited for space in a full ring */
+	int64_t drops; /* Lines dropped from a full ring that could not wait */
+	int64_t gaps; /* Records written out of sequence */
+} stats;
+
+#define stat_add(field, val) __atomic_add_fetch(&stats.field, val, __ATOMIC_RELAXED)
+#define stat_read(field) __atomic_load_n(&stats.field, __ATOMIC_RELAXED)
+
+static logring_sink_t ring_sink;
+static bool ring_running;
+static bool ring_kicked;
+static uint64_t ring_seq; /* Next sequence number handed out */
+static logring_t *rings;
+static pthread_t ring_flusher;
+static sem_t ring_sem;
+
+/* Plain pthread primitives as any thread may log before anything else is
+ * set up. ring_lock protects the list of rings and flush_lock allows only
+ * one thread at a time to drain them. */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+/* Drain state, only used under flush_lock */
+static uint64_t flush_seq;
+static int64_t gap_start;
+
+static __thread logring_t *ring_self;
+static __thread bool ring_draining;
+
+/* Timestamp up to the seconds, only rebuilt when the second changes */
+static __thread time_t stamp_sec = -1;
+static __thread char stamp[32];
+static __thread int stamplen;
+
+/* Called as a thread that has logged exits, its ring is freed once drained */
+static void ring_exit(void *arg)
+{
+	logring_t *ring = arg;
+
+	__atomic_store_n(&ring->dead, true, __ATOMIC_RELEASE);
+}
+
+static void ring_init(void)
+{
+	pthread_key_create(&ring_key, ring_exit);
+	cksem_init(&ring_sem);
+}
+
+static logring_t *ring_get(void)
+{
+	logring_t *ring = ring_self;
+
+	if (likely(ring))
+		return ring;
+	ring = ckzalloc(sizeof(logring_t));
+	pthread_mutex_lock(&ring_lock);
+	DL_APPEND(rings, ring);
+	pthread_mutex_unlock(&ring_lock);
+	pthread_setspecific(ring_key, ring);
+	ring_self = ring;
+	return ring;
+}
+
+static void ring_kick(void)
+{
+	if (!__atomic_exchange_n(&ring_kicked, true, __ATOMIC_ACQ_REL))
+		cksem_post(&ring_sem);
+}
+
+/* Wait for the flusher to free n records in the calling thread's ring. The
+ * flusher itself and anything logging while draining can only drop. */
+static bool ring_space(logring_t *ring, const int n)
+{
+	bool waited = false;
+
+	while (ring->head + n - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > LOGRING_RECS) {
+		if (ring_draining || !__atomic_load_n(&ring_running, __ATOMIC_ACQUIRE)) {
+			stat_add(drops, 1);
+			return false;
+		}
+		if (!waited) {
+			stat_add(waits, 1);
+			waited = true;
+		}
+		ring_kick();
+		sched_yield();
+	}
+	return true;
+}
+
+/* [YYYY-MM-DD HH:MM:SS.mmm] as get_timestamp with a trailing space */
+static int log_stamp(char *buf)
+{
+	ts_t now;
+	int ms;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (unlikely(now.tv_sec != stamp_sec)) {
+		struct tm tm;
+
+		localtime_r(&now.tv_sec, &tm);
+		stamplen = snprintf(stamp, sizeof(stamp), "[%d-%02d-%02d %02d:%02d:%02d.",
+				    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+				    tm.tm_hour, tm.tm_min, tm.tm_sec);
+		stamp_sec = now.tv_sec;
+	}
+	ms = now.tv_nsec / 1000000;
+	memcpy(buf, stamp, stamplen);
+	buf[stamplen] = '0' + ms / 100;
+	buf[stamplen + 1] = '0' + ms / 10 % 10;
+	buf[stamplen + 2] = '0' + ms % 10;
+	buf[stamplen + 3] = ']';
+	buf[stamplen + 4] = ' ';
+	return stamplen + 5;
+}
+
+/* Format a whole line into buf of LOGRING_RECSIZ bytes returning its length,
+ * or 0 for an empty message. A line that does not fit is allocated in *line
+ * from aq, a copy of ap. */
+static int log_format(char *buf, const int errn, const char *fmt, va_list ap, va_list aq,
+		      char **line)
+{
+	int slen, len, msglen;
+	char *msg;
+
+	slen = len = log_stamp(buf);
+	msglen = vsnprintf(buf + len, LOGRING_RECSIZ - len, fmt, ap);
+	if (unlikely(msglen < 1))
+		return 0;
+	if (likely(msglen < LOGRING_RECSIZ - len)) {
+		len += msglen;
+		if (errn) {
+			len += snprintf(buf + len, LOGRING_RECSIZ - len, " with errno %d: %s",
+					errn, strerror(errn));
+		}
+		if (likely(len < LOGRING_RECSIZ)) {
+			buf[len++] = '\n';
+			return len;
+		}
+	}
+
+	VASPRINTF(&msg, fmt, aq);
+	if (errn)
+		ASPRINTF(line, "%.*s%s with errno %d: %s\n", slen, buf, msg, errn, strerror(errn));
+	else
+		ASPRINTF(line, "%.*s%s\n", slen, buf, msg);
+	free(msg);
+	return strlen(*line);
+}
+
+/* Without a flusher lines are written straight to stderr */
+static void log_direct(const int errn, const char *fmt, va_list ap)
+{
+	char buf[LOGRING_RECSIZ], *line = NULL;
+	va_list aq;
+	int len;
+
+	va_copy(aq, ap);
+	len = log_format(buf, errn, fmt, ap, aq, &line);
+	va_end(aq);
+	if (len) {
+		fwrite(line ? line : buf, len, 1, stderr);
+		fflush(stderr);
+	}
+	free(line);
+}
+
+/* Format a line straight into the calling thread's ring. Nothing is locked
+ * or allocated unless this is the thread's first line or the line spans
+ * more than one record. errn is appended when non zero. */
+void logring_vlog(const int loglevel, const int errn, const char *fmt, va_list ap)
+{
+	char *line = NULL, *src;
+	logring_t *ring;
+	logrec_t *rec;
+	int len, span, i;
+	uint64_t seq;
+	va_list aq;
+
+	if (unlikely(!__atomic_load_n(&ring_running, __ATOMIC_ACQUIRE))) {
+		log_direct(errn, fmt, ap);
+		return;
+	}
+	ring = ring_get();
+	if (unlikely(!ring_space(ring, 1)))
+		return;
+	rec = &ring->recs[ring->head % LOGRING_RECS];
+	va_copy(aq, ap);
+	len = log_format(rec->buf, errn, fmt, ap, aq, &line);
+	va_end(aq);
+	if (unlikely(!len))
+		return;
+	if (likely(!line)) {
+		rec->level = loglevel;
+		rec->len = len;
+		rec->cont = false;
+		rec->seq = __atomic_fetch_add(&ring_seq, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+		goto out_kick;
+	}
+
+	/* Consecutive records with consecutive sequence numbers */
+	span = (len + LOGRING_RECSIZ - 1) / LOGRING_RECSIZ;
+	if (unlikely(span > LOGRING_MAXSPAN)) {
+		span = LOGRING_MAXSPAN;
+		len = span * LOGRING_RECSIZ;
+		line[len - 1] = '\n';
+	}
+	if (unlikely(!ring_space(ring, span)))
+		goto out_free;
+	seq = __atomic_fetch_add(&ring_seq, span, __ATOMIC_RELAXED);
+	for (i = 0, src = line; i < span; i++) {
+		int cpy = MIN(len, LOGRING_RECSIZ);
+
+		rec = &ring->recs[(ring->head + i) % LOGRING_RECS];
+		memcpy(rec->buf, src, cpy);
+		rec->level = loglevel;
+		rec->len = cpy;
+		rec->cont = !!i;
+		rec->seq = seq + i;
+		src += cpy;
+		len -= cpy;
+	}
+	__atomic_store_n(&ring->head, ring->head + span, __ATOMIC_RELEASE);
+out_kick:
+	if (loglevel <= ring_sink.console_level ||
+	    ring->head - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) >= LOGRING_RECS / 2)
+		ring_kick();
+out_free:
+	free(line);
+}
+
+static int64_t ring_ms(void)
+{
+	ts_t now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Write the whole iovec array, resuming after short writes */
+static void writev_all(const int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t ret = writev(fd, iov, iovcnt);
+
+		if (unlikely(ret < 1)) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return;
+		}
+		while (iovcnt && ret >= (ssize_t)iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+/* Merge every ring by sequence number and write batches of records out. A
+ * record that has been numbered but not yet published holds back the ones
+ * after it for up to LOGRING_GAPMS unless forced. */
+static void ring_drain(const bool force)
+{
+	struct iovec fiov[LOGRING_BATCH], civ[LOGRING_BATCH * 2];
+	logring_t *ring, *tmp;
+	int fd, nrecs;
+
+	pthread_mutex_lock(&flush_lock);
+	ring_draining = true;
+	fd = ring_sink.logfd ? ring_sink.logfd(ring_sink.arg) : -1;
+	pthread_mutex_lock(&ring_lock);
+	do {
+		int64_t lines = 0, bytes = 0;
+		int ncon = 0;
+
+		for (nrecs = 0; nrecs < LOGRING_BATCH; nrecs++) {
+			logring_t *best = NULL;
+			logrec_t *rec = NULL;
+
+			DL_FOREACH(rings, ring) {
+				logrec_t *next;
+
+				if (ring->cursor == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+					continue;
+				next = &ring->recs[ring->cursor % LOGRING_RECS];
+				if (!rec || next->seq < rec->seq) {
+					best = ring;
+					rec = next;
+				}
+			}
+			if (!best)
+				break;
+			if (rec->seq != flush_seq) {
+				if (!force && rec->seq > flush_seq) {
+					int64_t now = ring_ms();
+
+					if (!gap_start)
+						gap_start = now;
+					if (now - gap_start < LOGRING_GAPMS)
+						break;
+				}
+				stat_add(gaps, 1);
+			}
+			gap_start = 0;
+			if (rec->seq >= flush_seq)
+				flush_seq = rec->seq + 1;
+			best->cursor++;
+
+			fiov[nrecs].iov_base = rec->buf;
+			fiov[nrecs].iov_len = rec->len;
+			bytes += rec->len;
+			if (!rec->cont)
+				lines++;
+			if (rec->level <= ring_sink.console_level) {
+				if (ring_sink.console_clear && !rec->cont) {
+					civ[ncon].iov_base = (void *)console_clear;
+					civ[ncon++].iov_len = sizeof(console_clear) - 1;
+				}
+				civ[ncon].iov_base = rec->buf;
+				civ[ncon++].iov_len = rec->len;
+			}
+		}
+		if (!nrecs)
+			break;
+		if (fd >= 0) {
+			flock(fd, LOCK_EX);
+			writev_all(fd, fiov, nrecs);
+			flock(fd, LOCK_UN);
+		}
+		if (ncon)
+			writev_all(ring_sink.console_fd, civ, ncon);
+		DL_FOREACH(rings, ring)
+			__atomic_store_n(&ring->tail, ring->cursor, __ATOMIC_RELEASE);
+		stat_add(lines, lines);
+		stat_add(bytes, bytes);
+		stat_add(batches, 1);
+	} while (nrecs == LOGRING_BATCH);
+
+	DL_FOREACH_SAFE(rings, ring, tmp) {
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+		    ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			DL_DELETE(rings, ring);
+			free(ring);
+		}
+	}
+	pthread_mutex_unlock(&ring_lock);
+	ring_draining = false;
+	pthread_mutex_unlock(&flush_lock);
+}
+
+static void *ring_flush_thread(void __maybe_unused *arg)
+{
+	rename_proc("logflush");
+
+	while (42) {
+		cksem_mswait(&ring_sem, ring_sink.flush_ms);
+		__atomic_store_n(&ring_kicked, false, __ATOMIC_RELEASE);
+		if (!__atomic_load_n(&ring_running, __ATOMIC_ACQUIRE))
+			break;
+		ring_drain(false);
+	}
+	ring_drain(true);
+	return NULL;
+}
+
+/* Start a flusher thread writing to sink, false if one is already running */
+bool logring_start(const logring_sink_t *sink)
+{
+	pthread_once(&ring_once, ring_init);
+	if (__atomic_load_n(&ring_running, __ATOMIC_ACQUIRE))
+		return false;
+
+	pthread_mutex_lock(&flush_lock);
+	memcpy(&ring_sink, sink, sizeof(logring_sink_t));
+	if (ring_sink.flush_ms < 1)
+		ring_sink.flush_ms = LOGRING_FLUSHMS;
+	flush_seq = __atomic_load_n(&ring_seq, __ATOMIC_RELAXED);
+	gap_start = 0;
+	pthread_mutex_unlock(&flush_lock);
+
+	__atomic_store_n(&ring_running, true, __ATOMIC_RELEASE);
+	create_pthread(&ring_flusher, ring_flush_thread, NULL);
+	return true;
+}
+
+/* Drain everything and stop the flusher, such as before a fork. Lines go
+ * straight to stderr until it is started again. */
+void logring_stop(void)
+{
+	if (!__atomic_exchange_n(&ring_running, false, __ATOMIC_ACQ_REL))
+		return;
+	cksem_post(&ring_sem);
+	join_pthread(ring_flusher);
+}
+
+/* Write out everything logged so far from the calling thread, for exit */
+void logring_flush(void)
+{
+	ring_drain(true);
+}
+
+json_t *logring_stats(void)
+{
+	int64_t pending = 0;
+	logring_t *ring;
+	int nrings = 0;
+	json_t *val;
+
+	pthread_mutex_lock(&ring_lock);
+	DL_FOREACH(rings, ring) {
+		pending += __atomic_load_n(&ring->head, __ATOMIC_RELAXED) -
+			   __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		nrings++;
+	}
+	pthread_mutex_unlock(&ring_lock);
+
+	JSON_CPACK(val, "{sI,sI,sI,sI,sI,sI,sI,si}",
+		   "lines", stat_read(lines), "bytes", stat_read(bytes),
+		   "batches", stat_read(batches), "waits", stat_read(waits),
+		   "drops", stat_read(drops), "gaps", stat_read(gaps),
+		   "pending", pending, "rings", nrings);
+	return val;
+}
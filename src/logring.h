@@ -0,0 +1,50 @@
+/* Per thread lock free rings of preformatted log lines, drained in order by a
+ * single flusher thread with writev */
+#ifndef LOGRING_H
+#define LOGRING_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <jansson.h>
+
+/* Records in each thread's ring and bytes per record. Lines longer than a
+ * record span several consecutive records. */
+#define LOGRING_RECS 128
+#define LOGRING_RECSIZ 640
+
+/* Most records one line may span, longer lines are truncated */
+#define LOGRING_MAXSPAN (LOGRING_RECS / 2)
+
+/* Default interval the flusher drains lines not urgent enough to kick it */
+#define LOGRING_FLUSHMS 50
+
+/* How long the flusher holds back lines behind one that has been numbered
+ * but not yet written to its ring */
+#define LOGRING_GAPMS 100
+
+typedef struct logring_sink logring_sink_t;
+
+struct logring_sink {
+	/* Returns the fd every line is appended to under flock, or -1 for
+	 * none. Called by the flusher before each drain so it may reopen the
+	 * file. */
+	int (*logfd)(void *arg);
+	void *arg;
+
+	/* Lines at this level or more urgent are also written to console_fd,
+	 * each preceded by a clear line when console_clear is set, and wake
+	 * the flusher immediately */
+	int console_level;
+	int console_fd;
+	bool console_clear;
+
+	int flush_ms; /* LOGRING_FLUSHMS when 0 */
+};
+
+bool logring_start(const logring_sink_t *sink);
+void logring_stop(void);
+void logring_vlog(const int loglevel, const int errn, const char *fmt, va_list ap);
+void logring_flush(void);
+json_t *logring_stats(void);
+
+#endif /* LOGRING_H */
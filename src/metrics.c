@@ -0,0 +1,294 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libckpool.h"
+#include "metrics.h"
+
+static int slot_ids;
+static __thread int slotid = -1;
+
+int metric_slotid(void)
+{
+	if (unlikely(slotid < 0))
+		slotid = __atomic_fetch_add(&slot_ids, 1, __ATOMIC_RELAXED) % METRIC_SLOTS;
+	return slotid;
+}
+
+/* Sum of all slots. Readers may race with writers but each slot is only ever
+ * increasing so the worst case is a value a few increments stale. */
+uint64_t metric_read(const metric_counter_t *mc)
+{
+	uint64_t ret = 0;
+	int i;
+
+	for (i = 0; i < METRIC_SLOTS; i++)
+		ret += __atomic_load_n(&mc->slot[i].val, __ATOMIC_RELAXED);
+	return ret;
+}
+
+/* Bucket i holds values <= 2^i microseconds */
+int metric_bucket(const double seconds)
+{
+	uint64_t us;
+	int ret;
+
+	if (seconds <= 0.000001)
+		return 0;
+	if (seconds > (double)(1ull << (METRIC_BUCKETS - 2)) / 1000000)
+		return METRIC_BUCKETS - 1;
+	us = ceil(seconds * 1000000);
+	ret = 64 - __builtin_clzll(us - 1);
+	if (ret > METRIC_BUCKETS - 1)
+		ret = METRIC_BUCKETS - 1;
+	return ret;
+}
+
+void metric_observe(metric_hist_t *mh, const double seconds)
+{
+	uint64_t ns = seconds > 0 ? seconds * 1000000000 : 0;
+
+	__atomic_fetch_add(&mh->bucket[metric_bucket(seconds)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&mh->sum_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&mh->count, 1, __ATOMIC_RELAXED);
+}
+
+void metric_hist_copy(metric_hist_t *dest, const metric_hist_t *src)
+{
+	int i;
+
+	for (i = 0; i < METRIC_BUCKETS; i++)
+		dest->bucket[i] = __atomic_load_n(&src->bucket[i], __ATOMIC_RELAXED);
+	dest->sum_ns = __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+	dest->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+}
+
+/* Sum of all slots, each copied as metric_hist_copy does */
+void metric_slothist_read(metric_hist_t *dest, const metric_slothist_t *src)
+{
+	metric_hist_t hist;
+	int i, j;
+
+	memset(dest, 0, sizeof(metric_hist_t));
+	for (i = 0; i < METRIC_SLOTS; i++) {
+		metric_hist_copy(&hist, &src->slot[i].hist);
+		for (j = 0; j < METRIC_BUCKETS; j++)
+			dest->bucket[j] += hist.bucket[j];
+		dest->sum_ns += hist.sum_ns;
+		dest->count += hist.count;
+	}
+}
+
+/* Monotonic clock in nanoseconds for timing stages that may cross threads */
+int64_t lat_now(void)
+{
+	ts_t ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int lat_bucket(const uint64_t ns)
+{
+	int msb, shift, ret;
+
+	if (ns < LAT_SUBBUCKETS * 2)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	shift = msb - LAT_SUBBITS;
+	ret = (shift + 1) * LAT_SUBBUCKETS + (ns >> shift) - LAT_SUBBUCKETS;
+	if (ret > LAT_BUCKETS - 1)
+		ret = LAT_BUCKETS - 1;
+	return ret;
+}
+
+/* Largest value that falls in bucket */
+uint64_t lat_bucket_max(const int bucket)
+{
+	int shift;
+
+	if (bucket < LAT_SUBBUCKETS * 2)
+		return bucket;
+	shift = bucket / LAT_SUBBUCKETS - 1;
+	return ((uint64_t)(bucket % LAT_SUBBUCKETS + LAT_SUBBUCKETS + 1) << shift) - 1;
+}
+
+void lat_observe(lat_hist_t *lh, const int64_t ns)
+{
+	uint64_t val = ns > 0 ? ns : 0, max;
+
+	__atomic_fetch_add(&lh->bucket[lat_bucket(val)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&lh->sum_ns, val, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&lh->count, 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&lh->max_ns, __ATOMIC_RELAXED);
+	while (val > max) {
+		if (__atomic_compare_exchange_n(&lh->max_ns, &max, val, true, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			break;
+	}
+}
+
+/* Readers take a copy and work from that. The count is recalculated from the
+ * buckets so percentiles are consistent even when racing with lat_observe. */
+void lat_hist_copy(lat_hist_t *dest, const lat_hist_t *src)
+{
+	int i;
+
+	dest->count = 0;
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		dest->bucket[i] = __atomic_load_n(&src->bucket[i], __ATOMIC_RELAXED);
+		dest->count += dest->bucket[i];
+	}
+	dest->sum_ns = __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+	dest->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+}
+
+/* Upper bound of the bucket holding the pct percentile of a copied
+ * histogram, never more than the largest value seen */
+uint64_t lat_percentile(const lat_hist_t *lh, const double pct)
+{
+	uint64_t target, cumulative = 0, ret = 0;
+	int i;
+
+	if (!lh->count)
+		return 0;
+	target = ceil(lh->count * pct / 100);
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		cumulative += lh->bucket[i];
+		if (cumulative >= target) {
+			ret = lat_bucket_max(i);
+			break;
+		}
+	}
+	if (ret > lh->max_ns)
+		ret = lh->max_ns;
+	return ret;
+}
+
+/* Summary of a live histogram as a json object with microsecond values */
+json_t *lat_hist_json(const lat_hist_t *lh)
+{
+	lat_hist_t hist;
+	json_t *val;
+
+	lat_hist_copy(&hist, lh);
+	JSON_CPACK(val, "{sI,sf,sf,sf,sf,sf}",
+		   "count", (json_int_t)hist.count,
+		   "mean", hist.count ? (double)hist.sum_ns / hist.count / 1000 : 0.0,
+		   "p50", (double)lat_percentile(&hist, 50) / 1000,
+		   "p99", (double)lat_percentile(&hist, 99) / 1000,
+		   "p999", (double)lat_percentile(&hist, 99.9) / 1000,
+		   "max", (double)hist.max_ns / 1000);
+	return val;
+}
+
+void metrics_printf(metrics_buf_t *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	while (42) {
+		size_t left = mb->size - mb->len;
+
+		va_start(ap, fmt);
+		len = vsnprintf(mb->buf ? mb->buf + mb->len : NULL, left, fmt, ap);
+		va_end(ap);
+		if (unlikely(len < 0))
+			return;
+		if ((size_t)len < left)
+			break;
+		mb->size = round_up_page(mb->len + len + 1);
+		mb->buf = realloc(mb->buf, mb->size);
+		if (unlikely(!mb->buf))
+			quit(1, "Failed to realloc metrics buffer size %zu", mb->size);
+	}
+	mb->len += len;
+}
+
+/* Returns an allocated copy of s suitable for use as a label value */
+char *metrics_escape(const char *s)
+{
+	char *ret, *p;
+
+	if (!s)
+		s = "";
+	p = ret = ckalloc(strlen(s) * 2 + 1);
+	for (; *s; s++) {
+		if (*s == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+			continue;
+		}
+		if (*s == '\\' || *s == '"')
+			*p++ = '\\';
+		*p++ = *s;
+	}
+	*p = '\0';
+	return ret;
+}
+
+void metrics_header(metrics_buf_t *mb, const char *name, const char *type, const char *help)
+{
+	metrics_printf(mb, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_value(metrics_buf_t *mb, const char *name, const char *labels, const double val)
+{
+	if (labels && *labels)
+		metrics_printf(mb, "%s{%s} %.17g\n", name, labels, val);
+	else
+		metrics_printf(mb, "%s %.17g\n", name, val);
+}
+
+void metrics_counter(metrics_buf_t *mb, const char *name, const char *labels,
+		     const metric_counter_t *mc)
+{
+	uint64_t val = metric_read(mc);
+
+	if (labels && *labels)
+		metrics_printf(mb, "%s{%s} %"PRIu64"\n", name, labels, val);
+	else
+		metrics_printf(mb, "%s %"PRIu64"\n", name, val);
+}
+
+void metrics_hist(metrics_buf_t *mb, const char *name, const char *labels,
+		  const metric_hist_t *mh)
+{
+	const char *sep = labels && *labels ? "," : "";
+	uint64_t cumulative = 0;
+	metric_hist_t hist;
+	int i;
+
+	if (!labels)
+		labels = "";
+	/* Report the bucket total as the count so the two always agree even
+	 * when racing with metric_observe */
+	metric_hist_copy(&hist, mh);
+	for (i = 0; i < METRIC_BUCKETS - 1; i++) {
+		cumulative += hist.bucket[i];
+		metrics_printf(mb, "%s_bucket{%s%sle=\"%g\"} %"PRIu64"\n", name, labels, sep,
+			       (double)(1ull << i) / 1000000, cumulative);
+	}
+	cumulative += hist.bucket[i];
+	metrics_printf(mb, "%s_bucket{%s%sle=\"+Inf\"} %"PRIu64"\n", name, labels, sep, cumulative);
+	if (*labels) {
+		metrics_printf(mb, "%s_sum{%s} %.9f\n", name, labels, (double)hist.sum_ns / 1000000000);
+		metrics_printf(mb, "%s_count{%s} %"PRIu64"\n", name, labels, cumulative);
+	} else {
+		metrics_printf(mb, "%s_sum %.9f\n", name, (double)hist.sum_ns / 1000000000);
+		metrics_printf(mb, "%s_count %"PRIu64"\n", name, cumulative);
+	}
+}
+
+void metrics_slothist(metrics_buf_t *mb, const char *name, const char *labels,
+		      const metric_slothist_t *msh)
+{
+	metric_hist_t hist;
+
+	metric_slothist_read(&hist, msh);
+	metrics_hist(mb, name, labels, &hist);
+}
@@ -0,0 +1,115 @@
+/* Metrics primitives for the optional Prometheus endpoint */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <jansson.h>
+
+/* Number of slots per counter. Each thread picks a slot round robin on first
+ * use so that the share processing threads increment separate cachelines
+ * instead of bouncing a single shared one. */
+#define METRIC_SLOTS 32
+
+/* Histogram buckets are powers of two microseconds, 1us to ~33s, with the
+ * final bucket catching everything above (+Inf). */
+#define METRIC_BUCKETS 27
+
+struct metric_slot {
+	uint64_t val;
+	char pad[64 - sizeof(uint64_t)];
+} __attribute__((aligned(64)));
+
+typedef struct metric_counter metric_counter_t;
+
+struct metric_counter {
+	struct metric_slot slot[METRIC_SLOTS];
+};
+
+typedef struct metric_hist metric_hist_t;
+
+struct metric_hist {
+	uint64_t bucket[METRIC_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+};
+
+/* Histograms observed by every share processing thread get a slot per thread
+ * the same way counters do */
+struct metric_hist_slot {
+	metric_hist_t hist;
+} __attribute__((aligned(64)));
+
+typedef struct metric_slothist metric_slothist_t;
+
+struct metric_slothist {
+	struct metric_hist_slot slot[METRIC_SLOTS];
+};
+
+/* Log-linear latency histograms in nanoseconds. Values below 16ns get a
+ * bucket each, above that every power of two is split into 8 linear
+ * sub-buckets so percentiles are accurate to within 12.5%, up to ~2000s. */
+#define LAT_SUBBITS 3
+#define LAT_SUBBUCKETS (1 << LAT_SUBBITS)
+#define LAT_BUCKETS 312
+
+typedef struct lat_hist lat_hist_t;
+
+struct lat_hist {
+	uint64_t bucket[LAT_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+};
+
+/* Growable text buffer used to render the exposition output */
+typedef struct metrics_buf metrics_buf_t;
+
+struct metrics_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+int metric_slotid(void);
+
+static inline void metric_add(metric_counter_t *mc, const uint64_t val)
+{
+	__atomic_fetch_add(&mc->slot[metric_slotid()].val, val, __ATOMIC_RELAXED);
+}
+
+#define metric_inc(mc) metric_add(mc, 1)
+
+uint64_t metric_read(const metric_counter_t *mc);
+int metric_bucket(const double seconds);
+void metric_observe(metric_hist_t *mh, const double seconds);
+void metric_hist_copy(metric_hist_t *dest, const metric_hist_t *src);
+
+static inline void metric_slot_observe(metric_slothist_t *msh, const double seconds)
+{
+	metric_observe(&msh->slot[metric_slotid()].hist, seconds);
+}
+
+void metric_slothist_read(metric_hist_t *dest, const metric_slothist_t *src);
+
+int64_t lat_now(void);
+int lat_bucket(const uint64_t ns);
+uint64_t lat_bucket_max(const int bucket);
+void lat_observe(lat_hist_t *lh, const int64_t ns);
+void lat_hist_copy(lat_hist_t *dest, const lat_hist_t *src);
+uint64_t lat_percentile(const lat_hist_t *lh, const double pct);
+json_t *lat_hist_json(const lat_hist_t *lh);
+
+void metrics_printf(metrics_buf_t *mb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+char *metrics_escape(const char *s);
+void metrics_header(metrics_buf_t *mb, const char *name, const char *type, const char *help);
+void metrics_value(metrics_buf_t *mb, const char *name, const char *labels, const double val);
+void metrics_counter(metrics_buf_t *mb, const char *name, const char *labels,
+		     const metric_counter_t *mc);
+void metrics_hist(metrics_buf_t *mb, const char *name, const char *labels,
+		  const metric_hist_t *mh);
+void metrics_slothist(metrics_buf_t *mb, const char *name, const char *labels,
+		      const metric_slothist_t *msh);
+
+#endif /* METRICS_H */
@@ -0,0 +1,166 @@
+/*
+ * Mock bitcoind for running ckpool offline. Serves the JSON-RPC calls ckpool
+ * makes from a made up chain and mempool, validates submitted blocks against
+ * the template and can publish zmq hashblock. SIGUSR1 or the "generate" RPC
+ * finds a new block elsewhere on the network.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "mockbtc.h"
+
+static int mock_loglevel = LOG_NOTICE;
+static volatile bool mock_stop;
+static volatile int mock_newblocks;
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= mock_loglevel) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+static void sighandler(const int sig)
+{
+	if (sig == SIGUSR1)
+		mock_newblocks++;
+	else
+		mock_stop = true;
+}
+
+static struct option long_options[] = {
+	{"url",		required_argument,	0,	'a'},
+	{"bits",	required_argument,	0,	'b'},
+	{"blocktime",	required_argument,	0,	'B'},
+	{"drops",	required_argument,	0,	'd'},
+	{"errors",	required_argument,	0,	'e'},
+	{"height",	required_argument,	0,	'H'},
+	{"help",	no_argument,		0,	'h'},
+	{"jitter",	required_argument,	0,	'j'},
+	{"latency",	required_argument,	0,	'L'},
+	{"loglevel",	required_argument,	0,	'l'},
+	{"txnsize",	required_argument,	0,	's'},
+	{"txns",	required_argument,	0,	't'},
+	{"zmq",		required_argument,	0,	'z'},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char **argv)
+{
+	mockbtc_conf_t conf;
+	struct sigaction handler;
+	int c, i = 0, j;
+	mockbtc_t *mb;
+	json_t *val;
+	char *dump;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.url = "127.0.0.1:8332";
+	conf.height = 100000;
+	conf.txns = 100;
+	while ((c = getopt_long(argc, argv, "a:b:B:d:e:H:hj:L:l:s:t:z:", long_options, &i)) != -1) {
+		switch(c) {
+			case 'a':
+				conf.url = optarg;
+				break;
+			case 'b':
+				conf.bits = optarg;
+				break;
+			case 'B':
+				conf.blocktime = atoi(optarg);
+				break;
+			case 'd':
+				conf.drops = atof(optarg);
+				break;
+			case 'e':
+				conf.errors = atof(optarg);
+				break;
+			case 'H':
+				conf.height = atoi(optarg);
+				break;
+			case 'h':
+				for (j = 0; long_options[j].val; j++) {
+					struct option *jopt = &long_options[j];
+
+					if (jopt->has_arg) {
+						char *upper = alloca(strlen(jopt->name) + 1);
+						int offset = 0;
+
+						do {
+							upper[offset] = toupper(jopt->name[offset]);
+						} while (upper[offset++] != '\0');
+						printf("-%c %s | --%s %s\n", jopt->val,
+						       upper, jopt->name, upper);
+					} else
+						printf("-%c | --%s\n", jopt->val, jopt->name);
+				}
+				exit(0);
+			case 'j':
+				conf.jitter = atoi(optarg);
+				break;
+			case 'L':
+				conf.latency = atoi(optarg);
+				break;
+			case 'l':
+				mock_loglevel = atoi(optarg);
+				break;
+			case 's':
+				conf.txnsize = atoi(optarg);
+				break;
+			case 't':
+				conf.txns = atoi(optarg);
+				break;
+			case 'z':
+				conf.zmq = optarg;
+				break;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	handler.sa_handler = &sighandler;
+	handler.sa_flags = 0;
+	sigemptyset(&handler.sa_mask);
+	sigaction(SIGTERM, &handler, NULL);
+	sigaction(SIGINT, &handler, NULL);
+	sigaction(SIGUSR1, &handler, NULL);
+
+	mb = mockbtc_start(&conf);
+	if (!mb)
+		quit(1, "Failed to start mock bitcoind");
+	while (!mock_stop) {
+		cksleep_ms(100);
+		while (mock_newblocks) {
+			mock_newblocks--;
+			mockbtc_newblock(mb);
+		}
+	}
+
+	val = mockbtc_stats(mb);
+	dump = json_dumps(val, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
+	printf("%s\n", dump);
+	free(dump);
+	json_decref(val);
+	mockbtc_stop(mb);
+	return 0;
+}
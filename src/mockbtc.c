@@ -0,0 +1,937 @@
+#include "config.h"
+
+#include <sys/socket.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ZMQ_H
+#include <zmq.h>
+#endif
+
+#include "libckpool.h"
+#include "mockbtc.h"
+
+/* Block subsidy paid on top of the fees of the synthetic mempool */
+#define MOCK_SUBSIDY 312500000ULL
+#define MOCK_MAXREQ (64 * 1024 * 1024)
+
+typedef struct mock_txn mock_txn_t;
+
+struct mock_txn {
+	char *data;
+	char txid[68];
+	uchar txidbin[32];
+	uchar wtxidbin[32];
+	int size;
+};
+
+/* What parse_txn found in a serialised transaction */
+struct mock_parsed {
+	int len;
+	uchar txid[32];
+	uchar wtxid[32];
+	bool coinbase;
+	const uchar *sig;
+	int siglen;
+	uint64_t value;
+	const uchar *commitment;
+};
+
+struct mockbtc {
+	mockbtc_conf_t conf;
+	int listenfd;
+	int port;
+	pthread_t accept_pth;
+	pthread_t block_pth;
+	volatile bool stop;
+	int conns; /* Connection threads still running */
+
+	/* Everything below is protected by lock */
+	mutex_t lock;
+	uchar target[32];
+	char bits[12];
+	/* Block hashes in header byte order, indexed by height - base */
+	uchar (*chain)[32];
+	int base;
+	int height;
+	int chainsize;
+	uint64_t seq;
+
+	mock_txn_t *txns;
+	int ntxns;
+	uint64_t fees;
+	json_t *txn_array;
+	char commitment[80];
+	int64_t curtime;
+
+	json_t *calls;
+	int accepted;
+	int rejected;
+	char lastreject[64];
+
+#ifdef HAVE_ZMQ_H
+	void *zmq_ctx;
+	void *zmq_pub;
+	uint32_t zmq_seq;
+#endif
+};
+
+struct mock_conn {
+	mockbtc_t *mb;
+	int fd;
+};
+
+/* Display order hex of a hash kept in header byte order */
+static void hash_hex(char *hex, const uchar *hash)
+{
+	uchar swap[32];
+
+	bswap_256(swap, hash);
+	__bin2hex(hex, swap, 32);
+}
+
+static void merkle_root(uchar *hashes, int count, uchar *root)
+{
+	int i;
+
+	while (count > 1) {
+		if (count % 2) {
+			memcpy(hashes + 32 * count, hashes + 32 * (count - 1), 32);
+			count++;
+		}
+		for (i = 0; i < count; i += 2)
+			gen_hash(hashes + 32 * i, hashes + 32 * (i / 2), 64);
+		count /= 2;
+	}
+	memcpy(root, hashes, 32);
+}
+
+static bool read_varint(const uchar *buf, const int len, int *ofs, uint64_t *val)
+{
+	int size = 1;
+
+	if (*ofs >= len)
+		return false;
+	if (buf[*ofs] < 0xfd)
+		*val = buf[*ofs];
+	else {
+		size = buf[*ofs] == 0xfd ? 3 : buf[*ofs] == 0xfe ? 5 : 9;
+		if (*ofs + size > len)
+			return false;
+		*val = 0;
+		memcpy(val, buf + *ofs + 1, size - 1);
+		*val = le64toh(*val);
+	}
+	*ofs += size;
+	return true;
+}
+
+static int write_varint(uchar *buf, const uint64_t val)
+{
+	if (val < 0xfd) {
+		buf[0] = val;
+		return 1;
+	}
+	buf[0] = 0xfd;
+	buf[1] = val & 0xff;
+	buf[2] = val >> 8;
+	return 3;
+}
+
+/* Parse a serialised transaction at buf, finding its length and its txid
+ * over the serialisation without any witness data. Returns false if it's
+ * malformed. */
+static bool parse_txn(const uchar *buf, const int len, struct mock_parsed *txn)
+{
+	static const uchar commit_header[] = {0x6a, 0x24, 0xaa, 0x21, 0xa9, 0xed};
+	int ofs = 4, body, bodyend, i, j;
+	uint64_t vins, vouts, items, size;
+	bool witness = false;
+	uchar *stripped;
+
+	memset(txn, 0, sizeof(struct mock_parsed));
+	if (len < 10)
+		return false;
+	if (buf[4] == 0 && buf[5] == 1) {
+		witness = true;
+		ofs += 2;
+	}
+	body = ofs;
+	if (!read_varint(buf, len, &ofs, &vins) || !vins)
+		return false;
+	for (i = 0; i < (int)vins; i++) {
+		if (ofs + 36 > len)
+			return false;
+		if (!i && vins == 1) {
+			static const uchar null_prevout[32];
+
+			txn->coinbase = !memcmp(buf + ofs, null_prevout, 32) &&
+					!memcmp(buf + ofs + 32, "\xff\xff\xff\xff", 4);
+		}
+		ofs += 36;
+		if (!read_varint(buf, len, &ofs, &size) || ofs + (int64_t)size + 4 > len)
+			return false;
+		if (!i) {
+			txn->sig = buf + ofs;
+			txn->siglen = size;
+		}
+		ofs += size + 4;
+	}
+	if (!read_varint(buf, len, &ofs, &vouts))
+		return false;
+	for (i = 0; i < (int)vouts; i++) {
+		uint64_t value;
+
+		if (ofs + 8 > len)
+			return false;
+		memcpy(&value, buf + ofs, 8);
+		txn->value += le64toh(value);
+		ofs += 8;
+		if (!read_varint(buf, len, &ofs, &size) || ofs + (int64_t)size > len)
+			return false;
+		if (size >= 38 && !memcmp(buf + ofs, commit_header, sizeof(commit_header)))
+			txn->commitment = buf + ofs + sizeof(commit_header);
+		ofs += size;
+	}
+	bodyend = ofs;
+	if (witness) {
+		for (i = 0; i < (int)vins; i++) {
+			if (!read_varint(buf, len, &ofs, &items))
+				return false;
+			for (j = 0; j < (int)items; j++) {
+				if (!read_varint(buf, len, &ofs, &size) || ofs + (int64_t)size > len)
+					return false;
+				ofs += size;
+			}
+		}
+	}
+	if (ofs + 4 > len)
+		return false;
+	txn->len = ofs + 4;
+
+	stripped = ckalloc(bodyend - body + 8);
+	memcpy(stripped, buf, 4);
+	memcpy(stripped + 4, buf + body, bodyend - body);
+	memcpy(stripped + 4 + bodyend - body, buf + ofs, 4);
+	gen_hash(stripped, txn->txid, bodyend - body + 8);
+	free(stripped);
+	if (witness)
+		gen_hash((uchar *)buf, txn->wtxid, txn->len);
+	else
+		memcpy(txn->wtxid, txn->txid, 32);
+	return true;
+}
+
+static void next_random(mockbtc_t *mb, uchar *hash)
+{
+	uchar data[40];
+
+	memcpy(data, "mockbtc\0", 8);
+	memcpy(data + 8, &mb->seq, 8);
+	memcpy(data + 16, mb->chain[mb->height - mb->base], 24);
+	mb->seq++;
+	gen_hash(data, hash, 40);
+}
+
+/* Add a transaction to the mempool. The template's transaction array is
+ * shared with replies being sent so the caller must have made it private. */
+static void __add_txn(mockbtc_t *mb, const uchar *buf, const int len, const struct mock_parsed *txn,
+		      const uint64_t fee)
+{
+	char wtxid[68];
+	json_t *txn_val;
+	mock_txn_t *mtx;
+
+	mb->txns = realloc(mb->txns, sizeof(mock_txn_t) * (mb->ntxns + 1));
+	if (unlikely(!mb->txns))
+		quit(1, "Failed to realloc mock mempool of %d transactions", mb->ntxns + 1);
+	mtx = &mb->txns[mb->ntxns++];
+	mtx->data = bin2hex(buf, len);
+	mtx->size = len;
+	memcpy(mtx->txidbin, txn->txid, 32);
+	memcpy(mtx->wtxidbin, txn->wtxid, 32);
+	hash_hex(mtx->txid, txn->txid);
+	hash_hex(wtxid, txn->wtxid);
+	mb->fees += fee;
+
+	JSON_CPACK(txn_val, "{ss,ss,ss,s[],sI,si,si}",
+		   "data", mtx->data, "txid", mtx->txid, "hash", wtxid, "depends",
+		   "fee", (json_int_t)fee, "sigops", 0, "weight", len * 4);
+	json_array_append_new(mb->txn_array, txn_val);
+}
+
+/* Commit to the witness merkle root with a null witness nonce, the
+ * coinbase's own wtxid counting as zero */
+static void __commit_txns(mockbtc_t *mb)
+{
+	uchar *hashes = ckzalloc(32 * (mb->ntxns + 3));
+	int i;
+
+	for (i = 0; i < mb->ntxns; i++)
+		memcpy(hashes + 32 * (i + 1), mb->txns[i].wtxidbin, 32);
+	merkle_root(hashes, mb->ntxns + 1, hashes);
+	memset(hashes + 32, 0, 32);
+	gen_hash(hashes, hashes + 64, 64);
+	strcpy(mb->commitment, "6a24aa21a9ed");
+	__bin2hex(mb->commitment + 12, hashes + 64, 32);
+	free(hashes);
+}
+
+/* Fill the mempool with new transactions spending made up outputs, each
+ * paying a fee of a satoshi a byte and one output to OP_TRUE */
+static void __new_mempool(mockbtc_t *mb)
+{
+	int i, padding = mb->conf.txnsize - 62;
+	uint64_t value = htole64(1000);
+	struct mock_parsed txn;
+	uchar *buf;
+
+	for (i = 0; i < mb->ntxns; i++)
+		free(mb->txns[i].data);
+	dealloc(mb->txns);
+	mb->ntxns = 0;
+	mb->fees = 0;
+	if (mb->txn_array)
+		json_decref(mb->txn_array);
+	mb->txn_array = json_array();
+
+	/* Everything bar the scriptSig is 61 bytes plus its length varint */
+	if (padding < 0)
+		padding = 0;
+	if (padding >= 0xfd)
+		padding -= 2;
+	buf = ckzalloc(padding + 64);
+	for (i = 0; i < mb->conf.txns; i++) {
+		int ofs;
+
+		memcpy(buf, "\x02\x00\x00\x00\x01", 5);
+		ofs = 5;
+		next_random(mb, buf + ofs);
+		ofs += 32;
+		memset(buf + ofs, 0, 4);
+		ofs += 4;
+		ofs += write_varint(buf + ofs, padding);
+		memset(buf + ofs, 0x51, padding);
+		ofs += padding;
+		memcpy(buf + ofs, "\xff\xff\xff\xff\x01", 5);
+		ofs += 5;
+		memcpy(buf + ofs, &value, 8);
+		ofs += 8;
+		memcpy(buf + ofs, "\x01\x51\x00\x00\x00\x00", 6);
+		ofs += 6;
+		parse_txn(buf, ofs, &txn);
+		__add_txn(mb, buf, ofs, &txn, ofs);
+	}
+	free(buf);
+	__commit_txns(mb);
+	mb->curtime = time(NULL);
+}
+
+static void __publish_block(mockbtc_t *mb)
+{
+#ifdef HAVE_ZMQ_H
+	uchar swap[32];
+	uint32_t seq;
+
+	if (!mb->zmq_pub)
+		return;
+	bswap_256(swap, mb->chain[mb->height - mb->base]);
+	seq = htole32(mb->zmq_seq++);
+	zmq_send(mb->zmq_pub, "hashblock", 9, ZMQ_SNDMORE);
+	zmq_send(mb->zmq_pub, swap, 32, ZMQ_SNDMORE);
+	zmq_send(mb->zmq_pub, &seq, 4, 0);
+#else
+	(void)mb;
+#endif
+}
+
+/* Extend the chain with hash as the new tip */
+static void __add_block(mockbtc_t *mb, const uchar *hash)
+{
+	char hex[68];
+
+	if (mb->height - mb->base + 1 >= mb->chainsize) {
+		mb->chainsize *= 2;
+		mb->chain = realloc(mb->chain, 32 * mb->chainsize);
+		if (unlikely(!mb->chain))
+			quit(1, "Failed to realloc mock chain of %d blocks", mb->chainsize);
+	}
+	mb->height++;
+	memcpy(mb->chain[mb->height - mb->base], hash, 32);
+	__new_mempool(mb);
+	__publish_block(mb);
+	hash_hex(hex, hash);
+	LOGINFO("Mock bitcoind new block %d %s", mb->height, hex);
+}
+
+/* A block found elsewhere on the network */
+static void __new_block(mockbtc_t *mb)
+{
+	uchar hash[32];
+
+	next_random(mb, hash);
+	__add_block(mb, hash);
+}
+
+void mockbtc_newblock(mockbtc_t *mb)
+{
+	mutex_lock(&mb->lock);
+	__new_block(mb);
+	mutex_unlock(&mb->lock);
+}
+
+static json_t *__template(mockbtc_t *mb)
+{
+	char prevhash[68], target[68];
+	uchar swap[32];
+	json_t *val;
+
+	hash_hex(prevhash, mb->chain[mb->height - mb->base]);
+	bswap_256(swap, mb->target);
+	__bin2hex(target, swap, 32);
+	JSON_CPACK(val, "{si,s[sss],ss,sO,s{ss},sI,ss,ss,sI,ss,sI,ss,si,ss}",
+		   "version", 0x20000000,
+		   "rules", "csv", "!segwit", "taproot",
+		   "previousblockhash", prevhash,
+		   "transactions", mb->txn_array,
+		   "coinbaseaux", "flags", "",
+		   "coinbasevalue", (json_int_t)(MOCK_SUBSIDY + mb->fees),
+		   "longpollid", prevhash,
+		   "target", target,
+		   "mintime", (json_int_t)mb->curtime - 600,
+		   "noncerange", "00000000ffffffff",
+		   "curtime", (json_int_t)time(NULL),
+		   "bits", mb->bits,
+		   "height", mb->height + 1,
+		   "default_witness_commitment", mb->commitment);
+	return val;
+}
+
+/* Validate a block against the current template the way bitcoind would,
+ * returning NULL if it's accepted or the reason it was rejected */
+static const char *__submit_block(mockbtc_t *mb, const char *hex)
+{
+	uchar hash[32], root[32], *block, *hashes = NULL;
+	struct mock_parsed txn, coinbase = {0};
+	int len = strlen(hex) / 2, ofs, i, j, height;
+	const char *ret = NULL;
+	uint64_t txns;
+
+	if (len < 81 || strlen(hex) % 2)
+		return "invalid";
+	block = ckalloc(len);
+	if (!hex2bin(block, hex, len)) {
+		ret = "invalid";
+		goto out;
+	}
+	gen_hash(block, hash, 80);
+	for (i = 0; i <= mb->height - mb->base; i++) {
+		if (!memcmp(mb->chain[i], hash, 32)) {
+			ret = "duplicate";
+			goto out;
+		}
+	}
+	if (memcmp(block + 4, mb->chain[mb->height - mb->base], 32)) {
+		ret = "prev-blk-not-found";
+		for (i = 0; i < mb->height - mb->base; i++) {
+			if (!memcmp(block + 4, mb->chain[i], 32))
+				ret = "inconclusive";
+		}
+		goto out;
+	}
+	if (!fulltest(hash, mb->target)) {
+		ret = "high-hash";
+		goto out;
+	}
+	ofs = 80;
+	if (!read_varint(block, len, &ofs, &txns) || !txns) {
+		ret = "bad-blk-length";
+		goto out;
+	}
+	hashes = ckalloc(32 * (txns + 1));
+	for (i = 0; i < (int)txns; i++) {
+		if (!parse_txn(block + ofs, len - ofs, &txn)) {
+			ret = "bad-txns-decode";
+			goto out;
+		}
+		if (!i)
+			memcpy(&coinbase, &txn, sizeof(txn));
+		else {
+			if (txn.coinbase) {
+				ret = "bad-cb-multiple";
+				goto out;
+			}
+			/* Transactions are usually in template order */
+			j = i - 1;
+			if (j >= mb->ntxns || memcmp(mb->txns[j].txidbin, txn.txid, 32)) {
+				for (j = 0; j < mb->ntxns; j++) {
+					if (!memcmp(mb->txns[j].txidbin, txn.txid, 32))
+						break;
+				}
+			}
+			if (j >= mb->ntxns) {
+				ret = "bad-txns-inputs-missingorspent";
+				goto out;
+			}
+		}
+		memcpy(hashes + 32 * i, txn.txid, 32);
+		ofs += txn.len;
+	}
+	if (ofs != len) {
+		ret = "bad-blk-length";
+		goto out;
+	}
+	if (!coinbase.coinbase) {
+		ret = "bad-cb-missing";
+		goto out;
+	}
+	merkle_root(hashes, txns, root);
+	if (memcmp(root, block + 36, 32)) {
+		ret = "bad-txnmrklroot";
+		goto out;
+	}
+	height = coinbase.siglen > 1 && coinbase.sig[0] <= 4 && coinbase.sig[0] < coinbase.siglen ?
+		 get_sernumber((uchar *)coinbase.sig) : -1;
+	if (height != mb->height + 1) {
+		ret = "bad-cb-height";
+		goto out;
+	}
+	if (coinbase.value > MOCK_SUBSIDY + mb->fees) {
+		ret = "bad-cb-amount";
+		goto out;
+	}
+	/* Only a full block of template transactions has the commitment we
+	 * advertised */
+	if (coinbase.commitment && (int)txns == mb->ntxns + 1) {
+		char commitment[68];
+
+		__bin2hex(commitment, coinbase.commitment, 32);
+		if (strcmp(commitment, mb->commitment + 12)) {
+			ret = "bad-witness-merkle-match";
+			goto out;
+		}
+	}
+	__add_block(mb, hash);
+out:
+	free(hashes);
+	free(block);
+	return ret;
+}
+
+static bool valid_address(const char *address)
+{
+	int len = strlen(address), i;
+
+	if (len < 26 || len > 90)
+		return false;
+	for (i = 0; i < len; i++) {
+		if (!isalnum(address[i]))
+			return false;
+	}
+	return true;
+}
+
+static json_t *rpc_error(const int code, const char *message)
+{
+	json_t *val;
+
+	JSON_CPACK(val, "{si,ss}", "code", code, "message", message);
+	return val;
+}
+
+/* Answer a call with its result, or set *error for failures */
+static json_t *mock_call(mockbtc_t *mb, const char *method, json_t *params, json_t **error)
+{
+	const char *param = json_string_value(json_array_get(params, 0)), *reject;
+	struct mock_parsed txn;
+	json_t *ret = NULL;
+	char hex[68];
+	int i, num;
+
+	mutex_lock(&mb->lock);
+	if (!strcmp(method, "getblocktemplate"))
+		ret = __template(mb);
+	else if (!strcmp(method, "getbestblockhash")) {
+		hash_hex(hex, mb->chain[mb->height - mb->base]);
+		ret = json_string(hex);
+	} else if (!strcmp(method, "getblockcount"))
+		ret = json_integer(mb->height);
+	else if (!strcmp(method, "getblockhash")) {
+		num = json_integer_value(json_array_get(params, 0));
+		if (num < mb->base || num > mb->height)
+			*error = rpc_error(-8, "Block height out of range");
+		else {
+			hash_hex(hex, mb->chain[num - mb->base]);
+			ret = json_string(hex);
+		}
+	} else if (!strcmp(method, "validateaddress")) {
+		if (!param)
+			*error = rpc_error(-1, "validateaddress needs an address");
+		else if (!valid_address(param))
+			JSON_CPACK(ret, "{sb}", "isvalid", false);
+		else {
+			JSON_CPACK(ret, "{sb,ss,sb,sb}", "isvalid", true, "address", param,
+				   "isscript", param[0] == '3' || param[0] == '2',
+				   "iswitness", !strncmp(param, "bc1", 3) || !strncmp(param, "tb1", 3) ||
+				   !strncmp(param, "bcrt1", 5));
+		}
+	} else if (!strcmp(method, "decoderawtransaction") || !strcmp(method, "sendrawtransaction")) {
+		uchar *buf;
+		int len;
+
+		len = param ? strlen(param) / 2 : 0;
+		buf = ckalloc(len + 1);
+		if (!len || !hex2bin(buf, param, len) || !parse_txn(buf, len, &txn) || txn.len != len)
+			*error = rpc_error(-22, "TX decode failed");
+		else {
+			hash_hex(hex, txn.txid);
+			if (!strcmp(method, "decoderawtransaction"))
+				JSON_CPACK(ret, "{ss,si,sb}", "txid", hex, "size", len, "coinbase", txn.coinbase);
+			else {
+				json_t *arr_val = json_copy(mb->txn_array);
+
+				json_decref(mb->txn_array);
+				mb->txn_array = arr_val;
+				__add_txn(mb, buf, len, &txn, 0);
+				__commit_txns(mb);
+				ret = json_string(hex);
+			}
+		}
+		free(buf);
+	} else if (!strcmp(method, "getrawtransaction")) {
+		for (i = 0; param && i < mb->ntxns; i++) {
+			if (!strcmp(mb->txns[i].txid, param)) {
+				ret = json_string(mb->txns[i].data);
+				break;
+			}
+		}
+		if (!ret)
+			*error = rpc_error(-5, "No such mempool or blockchain transaction");
+	} else if (!strcmp(method, "submitblock")) {
+		reject = param ? __submit_block(mb, param) : "invalid";
+		if (reject) {
+			mb->rejected++;
+			snprintf(mb->lastreject, sizeof(mb->lastreject), "%s", reject);
+			LOGNOTICE("Mock bitcoind rejected block: %s", reject);
+			ret = json_string(reject);
+		} else {
+			mb->accepted++;
+			LOGNOTICE("Mock bitcoind accepted block at height %d", mb->height);
+			ret = json_null();
+		}
+	} else if (!strcmp(method, "preciousblock"))
+		ret = json_null();
+	else if (!strcmp(method, "generate")) {
+		num = json_integer_value(json_array_get(params, 0));
+		ret = json_array();
+		for (i = 0; i < (num > 0 ? num : 1); i++) {
+			__new_block(mb);
+			hash_hex(hex, mb->chain[mb->height - mb->base]);
+			json_array_append_new(ret, json_string(hex));
+		}
+	} else
+		*error = rpc_error(-32601, "Method not found");
+	mutex_unlock(&mb->lock);
+	return ret;
+}
+
+static void count_call(mockbtc_t *mb, const char *method)
+{
+	json_t *count_val;
+
+	mutex_lock(&mb->lock);
+	count_val = json_object_get(mb->calls, method);
+	if (count_val)
+		json_integer_set(count_val, json_integer_value(count_val) + 1);
+	else if (json_object_size(mb->calls) < 64)
+		json_object_set_new(mb->calls, method, json_integer(1));
+	mutex_unlock(&mb->lock);
+}
+
+static bool percent_chance(const double pct)
+{
+	return pct > 0 && random() % 10000 < pct * 100;
+}
+
+/* Read one HTTP request, returning the body or NULL on failure */
+static char *read_request(const int fd)
+{
+	int len = 0, size = PAGESIZE, body = -1, clen = 0, ret;
+	char *buf = ckalloc(size), *eoh;
+
+	while (body < 0 || len < body + clen) {
+		if (len + 1 >= size) {
+			size *= 2;
+			if (size > MOCK_MAXREQ)
+				goto out_fail;
+			buf = realloc(buf, size);
+			if (unlikely(!buf))
+				quit(1, "Failed to realloc mock request of %d bytes", size);
+		}
+		if (wait_read_select(fd, 5) < 1)
+			goto out_fail;
+		ret = read(fd, buf + len, size - len - 1);
+		if (ret < 1)
+			goto out_fail;
+		len += ret;
+		buf[len] = '\0';
+		if (body < 0) {
+			char *cl;
+
+			eoh = strstr(buf, "\n\n");
+			if (!eoh)
+				eoh = strstr(buf, "\r\n\r\n");
+			if (!eoh)
+				continue;
+			body = eoh - buf + (*eoh == '\r' ? 4 : 2);
+			cl = strcasestr(buf, "Content-Length:");
+			if (cl && cl < eoh)
+				clen = atoi(cl + 15);
+		}
+	}
+	memmove(buf, buf + body, clen);
+	buf[clen] = '\0';
+	return buf;
+
+out_fail:
+	free(buf);
+	return NULL;
+}
+
+static void send_response(const int fd, const int status, json_t *val)
+{
+	char *body, *http;
+	int len;
+
+	body = json_dumps(val, JSON_COMPACT);
+	len = strlen(body) + 1;
+	ASPRINTF(&http, "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+		 "Content-Length: %d\r\nConnection: close\r\n\r\n%s\n",
+		 status, status == 200 ? "OK" : "Internal Server Error", len, body);
+	write_socket(fd, http, strlen(http));
+	free(http);
+	free(body);
+}
+
+static void *mock_conn(void *arg)
+{
+	json_t *val = NULL, *res_val, *err_val = NULL, *reply;
+	struct mock_conn *mc = arg;
+	mockbtc_t *mb = mc->mb;
+	const char *method;
+	int fd = mc->fd;
+	char *req;
+
+	pthread_detach(pthread_self());
+	free(mc);
+	req = read_request(fd);
+	if (!req)
+		goto out;
+	val = json_loads(req, 0, NULL);
+	free(req);
+	method = json_string_value(json_object_get(val, "method"));
+	if (!method)
+		goto out;
+	count_call(mb, method);
+
+	if (percent_chance(mb->conf.drops))
+		goto out;
+	if (mb->conf.latency || mb->conf.jitter)
+		cksleep_ms(mb->conf.latency + (mb->conf.jitter ? random() % mb->conf.jitter : 0));
+	if (percent_chance(mb->conf.errors)) {
+		res_val = NULL;
+		err_val = rpc_error(-28, "Mock bitcoind injected error");
+	} else
+		res_val = mock_call(mb, method, json_object_get(val, "params"), &err_val);
+	JSON_CPACK(reply, "{soso}", "result", res_val ? res_val : json_null(),
+		   "error", err_val ? err_val : json_null());
+	json_object_set(reply, "id", json_object_get(val, "id") ? : json_null());
+	send_response(fd, err_val ? 500 : 200, reply);
+	json_decref(reply);
+out:
+	if (val)
+		json_decref(val);
+	Close(fd);
+	__atomic_sub_fetch(&mb->conns, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+static void *mock_accept(void *arg)
+{
+	mockbtc_t *mb = arg;
+	pthread_t pth;
+
+	rename_proc("mockaccept");
+	while (!mb->stop) {
+		struct mock_conn *mc;
+		int fd;
+
+		if (wait_read_select(mb->listenfd, 0.1) < 1)
+			continue;
+		fd = accept(mb->listenfd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		mc = ckalloc(sizeof(struct mock_conn));
+		mc->mb = mb;
+		mc->fd = fd;
+		__atomic_add_fetch(&mb->conns, 1, __ATOMIC_SEQ_CST);
+		create_pthread(&pth, mock_conn, mc);
+	}
+	return NULL;
+}
+
+/* Find blocks elsewhere on the network every blocktime seconds */
+static void *mock_blocks(void *arg)
+{
+	mockbtc_t *mb = arg;
+	int64_t next;
+
+	rename_proc("mockblocks");
+	next = time(NULL) + mb->conf.blocktime;
+	while (!mb->stop) {
+		cksleep_ms(100);
+		if (time(NULL) < next)
+			continue;
+		mockbtc_newblock(mb);
+		next += mb->conf.blocktime;
+	}
+	return NULL;
+}
+
+static void target_from_bits(uchar *target, const char *bits)
+{
+	uint32_t nbits = strtoul(bits, NULL, 16);
+	int exponent = nbits >> 24, i;
+
+	memset(target, 0, 32);
+	for (i = 0; i < 3; i++) {
+		int pos = exponent - 3 + i;
+
+		if (pos >= 0 && pos < 32)
+			target[pos] = (nbits >> (8 * i)) & 0xff;
+	}
+}
+
+mockbtc_t *mockbtc_start(const mockbtc_conf_t *conf)
+{
+	char *url = NULL, *port = NULL;
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	mockbtc_t *mb;
+
+	mb = ckzalloc(sizeof(mockbtc_t));
+	memcpy(&mb->conf, conf, sizeof(mockbtc_conf_t));
+	if (!mb->conf.txnsize)
+		mb->conf.txnsize = 250;
+	snprintf(mb->bits, sizeof(mb->bits), "%s", conf->bits ? conf->bits : "1d00ffff");
+	target_from_bits(mb->target, mb->bits);
+	mutex_init(&mb->lock);
+	mb->calls = json_object();
+
+	mb->base = mb->height = conf->height;
+	mb->chainsize = 1024;
+	mb->chain = ckzalloc(32 * mb->chainsize);
+	gen_hash((uchar *)"mockbtc genesis", mb->chain[0], 15);
+	__new_mempool(mb);
+
+	if (!extract_sockaddr((char *)(conf->url ? conf->url : "127.0.0.1:0"), &url, &port))
+		goto out_fail;
+	mb->listenfd = bind_socket(url, port);
+	free(url);
+	free(port);
+	if (mb->listenfd < 0 || listen(mb->listenfd, SOMAXCONN))
+		goto out_fail;
+	getsockname(mb->listenfd, (struct sockaddr *)&addr, &addrlen);
+	mb->port = ntohs(addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&addr)->sin6_port :
+			 ((struct sockaddr_in *)&addr)->sin_port);
+
+#ifdef HAVE_ZMQ_H
+	if (conf->zmq) {
+		mb->zmq_ctx = zmq_ctx_new();
+		mb->zmq_pub = zmq_socket(mb->zmq_ctx, ZMQ_PUB);
+		if (zmq_bind(mb->zmq_pub, conf->zmq)) {
+			LOGWARNING("Mock bitcoind failed to bind zmq to %s", conf->zmq);
+			goto out_fail;
+		}
+	}
+#else
+	if (conf->zmq)
+		LOGWARNING("Mock bitcoind built without zmq, not publishing hashblock");
+#endif
+	create_pthread(&mb->accept_pth, mock_accept, mb);
+	if (conf->blocktime > 0)
+		create_pthread(&mb->block_pth, mock_blocks, mb);
+	LOGNOTICE("Mock bitcoind listening on port %d at height %d", mb->port, mb->height);
+	return mb;
+
+out_fail:
+	LOGWARNING("Mock bitcoind failed to listen on %s", conf->url ? conf->url : "127.0.0.1:0");
+	mb->stop = true;
+	mockbtc_stop(mb);
+	return NULL;
+}
+
+void mockbtc_stop(mockbtc_t *mb)
+{
+	int i;
+
+	if (!mb->stop) {
+		mb->stop = true;
+		join_pthread(mb->accept_pth);
+		if (mb->conf.blocktime > 0)
+			join_pthread(mb->block_pth);
+	}
+	while (__atomic_load_n(&mb->conns, __ATOMIC_SEQ_CST) > 0)
+		cksleep_ms(1);
+	Close(mb->listenfd);
+#ifdef HAVE_ZMQ_H
+	if (mb->zmq_pub)
+		zmq_close(mb->zmq_pub);
+	if (mb->zmq_ctx)
+		zmq_ctx_destroy(mb->zmq_ctx);
+#endif
+	for (i = 0; i < mb->ntxns; i++)
+		free(mb->txns[i].data);
+	free(mb->txns);
+	if (mb->txn_array)
+		json_decref(mb->txn_array);
+	json_decref(mb->calls);
+	free(mb->chain);
+	free(mb);
+}
+
+int mockbtc_port(const mockbtc_t *mb)
+{
+	return mb->port;
+}
+
+void mockbtc_faults(mockbtc_t *mb, const int latency, const int jitter, const double errors,
+		    const double drops)
+{
+	mb->conf.latency = latency;
+	mb->conf.jitter = jitter;
+	mb->conf.errors = errors;
+	mb->conf.drops = drops;
+}
+
+json_t *mockbtc_stats(mockbtc_t *mb)
+{
+	char hex[68];
+	json_t *val;
+
+	mutex_lock(&mb->lock);
+	hash_hex(hex, mb->chain[mb->height - mb->base]);
+	JSON_CPACK(val, "{si,ss,si,si,si,ss,so}",
+		   "height", mb->height,
+		   "tip", hex,
+		   "txns", mb->ntxns,
+		   "accepted", mb->accepted,
+		   "rejected", mb->rejected,
+		   "lastreject", mb->lastreject,
+		   "calls", json_deep_copy(mb->calls));
+	mutex_unlock(&mb->lock);
+	return val;
+}
@@ -0,0 +1,38 @@
+/* Mock bitcoind serving the JSON-RPC calls ckpool makes, for testing the
+ * generator, templates and block submission without a real node */
+#ifndef MOCKBTC_H
+#define MOCKBTC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <jansson.h>
+
+typedef struct mockbtc_conf mockbtc_conf_t;
+
+struct mockbtc_conf {
+	const char *url; /* Address to listen on, port 0 picks a free one */
+	const char *bits; /* Compact network target, 1d00ffff if NULL */
+	int height; /* Height of the initial chain tip */
+	int txns; /* Synthetic mempool transactions in each template */
+	int txnsize; /* Approximate bytes per transaction */
+	int blocktime; /* Seconds between blocks found elsewhere, 0 for none */
+	const char *zmq; /* Endpoint to publish hashblock on, NULL for none */
+
+	/* Fault injection, changeable later with mockbtc_faults */
+	int latency; /* ms added to every response */
+	int jitter; /* Up to this many random ms more */
+	double errors; /* Percent of calls answered with an RPC error */
+	double drops; /* Percent of calls dropped without an answer */
+};
+
+typedef struct mockbtc mockbtc_t;
+
+mockbtc_t *mockbtc_start(const mockbtc_conf_t *conf);
+void mockbtc_stop(mockbtc_t *mb);
+int mockbtc_port(const mockbtc_t *mb);
+void mockbtc_newblock(mockbtc_t *mb);
+void mockbtc_faults(mockbtc_t *mb, const int latency, const int jitter, const double errors,
+		    const double drops);
+json_t *mockbtc_stats(mockbtc_t *mb);
+
+#endif /* MOCKBTC_H */
@@ -0,0 +1,87 @@
+/* Statically defined user space tracepoints (USDT) for bpftrace, perf and
+ * systemtap. Each probe is a nop in the code plus an ELF .note.stapsdt
+ * entry describing where it is and where its arguments live, so there is no
+ * cost unless a tracer attaches. All probes use the "ckpool" provider, eg:
+ *   bpftrace -e 'usdt:./ckpool:ckpool:share { @[arg2] = count(); }'
+ * The system <sys/sdt.h> is used when available, otherwise an equivalent
+ * note is emitted here on x86_64 and aarch64. Elsewhere, or when configured
+ * with --disable-probes, the probes compile to nothing. */
+#ifndef PROBES_H
+#define PROBES_H
+
+#if defined(DISABLE_PROBES)
+#define CKPROBE_NONE
+#elif defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+
+#define CKPROBE(name) DTRACE_PROBE(ckpool, name)
+#define CKPROBE1(name, a) DTRACE_PROBE1(ckpool, name, a)
+#define CKPROBE2(name, a, b) DTRACE_PROBE2(ckpool, name, a, b)
+#define CKPROBE3(name, a, b, c) DTRACE_PROBE3(ckpool, name, a, b, c)
+#define CKPROBE4(name, a, b, c, d) DTRACE_PROBE4(ckpool, name, a, b, c, d)
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+/* Argument sizes are negative for signed types, as sdt.h describes them.
+ * Pointers are treated as unsigned. */
+#define _CKPROBE_TYPE(x) __typeof__(__builtin_choose_expr( \
+	((__builtin_classify_type(x) + 3) & -4) == 4, (x), 0U))
+#define _CKPROBE_SIGNED(x) (!(__builtin_constant_p((_CKPROBE_TYPE(x))-1) && \
+			      ((_CKPROBE_TYPE(x))-1) > 0))
+#define _CKPROBE_ARG(n, x) \
+	[_s##n] "n" ((_CKPROBE_SIGNED(x) ? 1 : -1) * (int)sizeof(x)), \
+	[_a##n] "nor" (x)
+
+#define _CKPROBE_NOTE(provider, name, args) \
+	"990:	nop\n" \
+	"	.pushsection .note.stapsdt,\"\",\"note\"\n" \
+	"	.balign 4\n" \
+	"	.4byte 992f-991f, 994f-993f, 3\n" \
+	"991:	.asciz \"stapsdt\"\n" \
+	"992:	.balign 4\n" \
+	"993:	.8byte 990b\n" \
+	"	.8byte _.stapsdt.base\n" \
+	"	.8byte 0\n" \
+	"	.asciz \"" #provider "\"\n" \
+	"	.asciz \"" #name "\"\n" \
+	"	.asciz \"" args "\"\n" \
+	"994:	.balign 4\n" \
+	"	.popsection\n" \
+	"	.ifndef _.stapsdt.base\n" \
+	"	.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	"	.weak _.stapsdt.base\n" \
+	"	.hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	"	.size _.stapsdt.base, 1\n" \
+	"	.popsection\n" \
+	"	.endif\n"
+
+#define CKPROBE(name) \
+	__asm__ __volatile__(_CKPROBE_NOTE(ckpool, name, ""))
+#define CKPROBE1(name, a) \
+	__asm__ __volatile__(_CKPROBE_NOTE(ckpool, name, "%n[_s1]@%[_a1]") \
+			     :: _CKPROBE_ARG(1, a))
+#define CKPROBE2(name, a, b) \
+	__asm__ __volatile__(_CKPROBE_NOTE(ckpool, name, "%n[_s1]@%[_a1] %n[_s2]@%[_a2]") \
+			     :: _CKPROBE_ARG(1, a), _CKPROBE_ARG(2, b))
+#define CKPROBE3(name, a, b, c) \
+	__asm__ __volatile__(_CKPROBE_NOTE(ckpool, name, \
+					   "%n[_s1]@%[_a1] %n[_s2]@%[_a2] %n[_s3]@%[_a3]") \
+			     :: _CKPROBE_ARG(1, a), _CKPROBE_ARG(2, b), _CKPROBE_ARG(3, c))
+#define CKPROBE4(name, a, b, c, d) \
+	__asm__ __volatile__(_CKPROBE_NOTE(ckpool, name, \
+					   "%n[_s1]@%[_a1] %n[_s2]@%[_a2] %n[_s3]@%[_a3] %n[_s4]@%[_a4]") \
+			     :: _CKPROBE_ARG(1, a), _CKPROBE_ARG(2, b), _CKPROBE_ARG(3, c), \
+			     _CKPROBE_ARG(4, d))
+#else
+#define CKPROBE_NONE
+#endif
+
+#ifdef CKPROBE_NONE
+#define CKPROBE(name) do {} while (0)
+#define CKPROBE1(name, a) do {} while (0)
+#define CKPROBE2(name, a, b) do {} while (0)
+#define CKPROBE3(name, a, b, c) do {} while (0)
+#define CKPROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif /* PROBES_H */
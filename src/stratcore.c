@@ -0,0 +1,596 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <string.h>
+
+#include "libckpool.h"
+#include "sha2.h"
+#include "stratcore.h"
+
+static const char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
+static const char *scriptsig_header = "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff";
+
+static const int witnessdata_size = 36; // commitment header + hash
+
+void stratcore_now(const stratcore_t *sc, ts_t *ts)
+{
+	if (sc->clock)
+		sc->clock(sc->arg, ts);
+	else
+		ts_realtime(ts);
+}
+
+void stratcore_send(const stratcore_t *sc, json_t *val, const int64_t client_id, const int msg_type)
+{
+	if (sc->send)
+		sc->send(sc->arg, val, client_id, msg_type);
+	else
+		json_decref(val);
+}
+
+/* Cache the binary header template with a zero merkle root and nonce */
+void stratcore_header(workbase_t *wb)
+{
+	char header[272];
+
+	snprintf(header, 270, "%s%s%s%s%s%s%s",
+		 wb->bbversion, wb->prevhash,
+		 "0000000000000000000000000000000000000000000000000000000000000000",
+		 wb->ntime, wb->nbit,
+		 "00000000", /* nonce */
+		 workpadding);
+	header[224] = 0;
+	LOGDEBUG("Header: %s", header);
+	hex2bin(wb->headerbin, header, 112);
+}
+
+/* Build the coinbase templates and header for a new workbase. Without
+ * btcsolo the generation address and coinb3 are appended to coinb2, otherwise
+ * coinb3 is kept for each user's coinb2 */
+void stratcore_coinbase(const stratcore_t *sc, workbase_t *wb)
+{
+	uint64_t *u64, g64, d64 = 0;
+	int len, ofs = 0;
+	ts_t now;
+
+	/* Set fixed length coinb1 arrays to be more than enough */
+	wb->coinb1 = ckzalloc(256);
+	wb->coinb1bin = ckzalloc(128);
+
+	/* Strings in wb should have been zero memset prior. Generate binary
+	 * templates first, then convert to hex */
+	hex2bin(wb->coinb1bin, scriptsig_header, 41);
+	ofs += 41; // Fixed header length;
+
+	ofs++; // Script length is filled in at the end @wb->coinb1bin[41];
+
+	/* Put block height at start of template */
+	len = ser_number(wb->coinb1bin + ofs, wb->height);
+	ofs += len;
+
+	/* Followed by flag */
+	len = strlen(wb->flags) / 2;
+	wb->coinb1bin[ofs++] = len;
+	hex2bin(wb->coinb1bin + ofs, wb->flags, len);
+	ofs += len;
+
+	/* Followed by timestamp */
+	stratcore_now(sc, &now);
+	len = ser_number(wb->coinb1bin + ofs, now.tv_sec);
+	ofs += len;
+
+	/* Followed by our unique randomiser based on the nsec timestamp */
+	len = ser_number(wb->coinb1bin + ofs, now.tv_nsec);
+	ofs += len;
+
+	wb->enonce1varlen = sc->nonce1length;
+	wb->enonce2varlen = sc->nonce2length;
+	wb->coinb1bin[ofs++] = wb->enonce1varlen + wb->enonce2varlen;
+
+	wb->coinb1len = ofs;
+
+	len = wb->coinb1len - 41;
+
+	len += wb->enonce1varlen;
+	len += wb->enonce2varlen;
+
+	wb->coinb2bin = ckzalloc(512);
+	memcpy(wb->coinb2bin, "\x0a\x63\x6b\x70\x6f\x6f\x6c\x2d\x6c\x68\x72", 11);
+	wb->coinb2len = 11;
+	if (sc->btcsig) {
+		int siglen = strlen(sc->btcsig);
+
+		LOGDEBUG("Len %d sig %s", siglen, sc->btcsig);
+		if (siglen) {
+			wb->coinb2bin[wb->coinb2len++] = siglen;
+			memcpy(wb->coinb2bin + wb->coinb2len, sc->btcsig, siglen);
+			wb->coinb2len += siglen;
+		}
+	}
+	len += wb->coinb2len;
+
+	wb->coinb1bin[41] = len - 1; /* Set the length now */
+	__bin2hex(wb->coinb1, wb->coinb1bin, wb->coinb1len);
+	LOGDEBUG("Coinb1: %s", wb->coinb1);
+	/* Coinbase 1 complete */
+
+	memcpy(wb->coinb2bin + wb->coinb2len, "\xff\xff\xff\xff", 4);
+	wb->coinb2len += 4;
+
+	// Generation value
+	g64 = wb->coinbasevalue;
+	if (sc->donation > 0) {
+		double dbl64 = (double)g64 / 100 * sc->donation;
+		d64 = dbl64;
+		g64 -= d64; // To guarantee integers add up to the original coinbasevalue
+		wb->coinb2bin[wb->coinb2len++] = 2 + wb->insert_witness;
+	} else
+		wb->coinb2bin[wb->coinb2len++] = 1 + wb->insert_witness;
+
+	u64 = (uint64_t *)&wb->coinb2bin[wb->coinb2len];
+	*u64 = htole64(g64);
+	wb->coinb2len += 8;
+
+	/* Coinb2 address goes here, takes up 23~25 bytes + 1 byte for length */
+
+	wb->coinb3len = 0;
+	wb->coinb3bin = ckzalloc(256 + wb->insert_witness * (8 + witnessdata_size + 2));
+
+	if (sc->donation > 0) {
+		u64 = (uint64_t *)wb->coinb3bin;
+		*u64 = htole64(d64);
+		wb->coinb3len += 8;
+
+		wb->coinb3bin[wb->coinb3len++] = sc->dontxnlen;
+		memcpy(wb->coinb3bin + wb->coinb3len, sc->dontxnbin, sc->dontxnlen);
+		wb->coinb3len += sc->dontxnlen;
+	}
+
+	if (wb->insert_witness) {
+		// 0 value
+		wb->coinb3len += 8;
+
+		wb->coinb3bin[wb->coinb3len++] = witnessdata_size + 2; // total scriptPubKey size
+		wb->coinb3bin[wb->coinb3len++] = 0x6a; // OP_RETURN
+		wb->coinb3bin[wb->coinb3len++] = witnessdata_size;
+
+		hex2bin(&wb->coinb3bin[wb->coinb3len], wb->witnessdata, witnessdata_size);
+		wb->coinb3len += witnessdata_size;
+	}
+
+	wb->coinb3len += 4; // Blank lock
+
+	if (!sc->btcsolo) {
+		/* Append the generation address and coinb3 in !solo mode */
+		wb->coinb2bin[wb->coinb2len++] = sc->txnlen;
+		memcpy(wb->coinb2bin + wb->coinb2len, sc->txnbin, sc->txnlen);
+		wb->coinb2len += sc->txnlen;
+		memcpy(wb->coinb2bin + wb->coinb2len, wb->coinb3bin, wb->coinb3len);
+		wb->coinb2len += wb->coinb3len;
+		wb->coinb3len = 0;
+		dealloc(wb->coinb3bin);
+	}
+
+	/* Set this just for node compatibility, though it's unused */
+	wb->coinb2 = bin2hex(wb->coinb2bin, wb->coinb2len);
+	LOGDEBUG("Coinb2: %s", wb->coinb2);
+	/* Coinbases 2 +/- 3 templates complete */
+
+	stratcore_header(wb);
+}
+
+/* Validate the mining.submit params into share, pointing at the strings in
+ * params_val. Returns SE_NONE if they're usable */
+enum share_err stratcore_submit_params(const stratcore_t *sc, const json_t *params_val,
+				       stratcore_share_t *share)
+{
+	const char *version_mask;
+
+	if (unlikely(!json_is_array(params_val)))
+		return SE_NOT_ARRAY;
+	if (unlikely(json_array_size(params_val) < 5))
+		return SE_INVALID_SIZE;
+	share->workername = json_string_value(json_array_get(params_val, 0));
+	if (unlikely(!share->workername || !strlen(share->workername)))
+		return SE_NO_USERNAME;
+	share->job_id = json_string_value(json_array_get(params_val, 1));
+	if (unlikely(!share->job_id || !strlen(share->job_id)))
+		return SE_NO_JOBID;
+	share->nonce2 = json_string_value(json_array_get(params_val, 2));
+	if (unlikely(!share->nonce2 || !strlen(share->nonce2) || !validhex(share->nonce2)))
+		return SE_NO_NONCE2;
+	share->ntime = json_string_value(json_array_get(params_val, 3));
+	if (unlikely(!share->ntime || !strlen(share->ntime) || !validhex(share->ntime)))
+		return SE_NO_NTIME;
+	share->nonce = json_string_value(json_array_get(params_val, 4));
+	if (unlikely(!share->nonce || strlen(share->nonce) < 8 || !validhex(share->nonce)))
+		return SE_NO_NONCE;
+
+	share->version_mask32 = 0;
+	version_mask = json_string_value(json_array_get(params_val, 5));
+	if (version_mask && strlen(version_mask) && validhex(version_mask)) {
+		sscanf(version_mask, "%x", &share->version_mask32);
+		// check version mask
+		if (share->version_mask32 && ((~sc->version_mask) & share->version_mask32) != 0) {
+			// means client changed some bits which server doesn't allow to change
+			return SE_INVALID_VERSION_MASK;
+		}
+	}
+	share->id = 0;
+	share->ntime32 = 0;
+	sscanf(share->job_id, "%lx", &share->id);
+	sscanf(share->ntime, "%x", &share->ntime32);
+	return SE_NONE;
+}
+
+/* Calculate share diff and fill in hash and swap. Need to hold workbase read
+ * count */
+double stratcore_hash_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb,
+			   const uchar *coinb2bin, const int cb2len, const char *nonce2,
+			   const uint32_t ntime32, uint32_t version_mask, const char *nonce,
+			   uchar *hash, uchar *swap, int *cblen)
+{
+	unsigned char merkle_root[32], merkle_sha[64];
+	uint32_t *data32, *swap32, benonce32;
+	uchar hash1[32];
+	char data[80];
+	int i;
+
+	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
+	*cblen = wb->coinb1len;
+	memcpy(coinbase + *cblen, enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
+	*cblen += wb->enonce1constlen + wb->enonce1varlen;
+	hex2bin(coinbase + *cblen, nonce2, wb->enonce2varlen);
+	*cblen += wb->enonce2varlen;
+	memcpy(coinbase + *cblen, coinb2bin, cb2len);
+	*cblen += cb2len;
+
+	gen_hash((uchar *)coinbase, merkle_root, *cblen);
+	memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < wb->merkles; i++) {
+		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
+		gen_hash(merkle_sha, merkle_root, 64);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
+	data32 = (uint32_t *)merkle_sha;
+	swap32 = (uint32_t *)merkle_root;
+	flip_32(swap32, data32);
+
+	/* Copy the cached header binary and insert the merkle root */
+	memcpy(data, wb->headerbin, 80);
+	memcpy(data + 36, merkle_root, 32);
+
+	/* Update nVersion when version_mask is in use */
+	if (version_mask) {
+		version_mask = htobe32(version_mask);
+		data32 = (uint32_t *)data;
+		*data32 |= version_mask;
+	}
+
+	/* Insert the nonce value into the data */
+	hex2bin(&benonce32, nonce, 4);
+	data32 = (uint32_t *)(data + 64 + 12);
+	*data32 = benonce32;
+
+	/* Insert the ntime value into the data */
+	data32 = (uint32_t *)(data + 68);
+	*data32 = htobe32(ntime32);
+
+	/* Hash the share */
+	data32 = (uint32_t *)data;
+	swap32 = (uint32_t *)swap;
+	flip_80(swap32, data32);
+	sha256(swap, 80, hash1);
+	sha256(hash1, 32, hash);
+
+	/* Calculate the diff of the share here */
+	return diff_from_target(hash);
+}
+
+/* Hash a share from validated params against its workbase with the client's
+ * enonce1 and coinb2. Fixes broken clients sending the wrong number of nonce2
+ * chars or too many nonce chars first. Need to hold workbase read count */
+double stratcore_share_diff(const workbase_t *wb, const uchar *enonce1bin, const uchar *coinb2bin,
+			    const int cb2len, stratcore_share_t *share)
+{
+	int nlen, len;
+
+	len = MIN(wb->enonce2varlen * 2, STRATCORE_NONCE2_MAX);
+	nlen = strlen(share->nonce2);
+	if (unlikely(nlen != len)) {
+		memset(share->nonce2buf, '0', len);
+		memcpy(share->nonce2buf, share->nonce2, MIN(nlen, len));
+		share->nonce2buf[len] = '\0';
+		share->nonce2 = share->nonce2buf;
+	}
+	/* Same with nonce, but we need at least 8 chars which
+	 * stratcore_submit_params checked for */
+	if (unlikely(strlen(share->nonce) > 8)) {
+		memcpy(share->noncebuf, share->nonce, 8);
+		share->noncebuf[8] = '\0';
+		share->nonce = share->noncebuf;
+	}
+	share->sdiff = stratcore_hash_diff(share->coinbase, enonce1bin, wb, coinb2bin, cb2len,
+					   share->nonce2, share->ntime32, share->version_mask32,
+					   share->nonce, share->hash, share->swap, &share->cblen);
+	return share->sdiff;
+}
+
+/* Move a client to enonce1bin with mining.set_extranonce, or give it its
+ * first. Shares on jobs up to last_job_id may still be mined with the one it
+ * replaces, a last_job_id of -1 for none when its old jobs went elsewhere */
+void stratcore_move_enonce1(stratcore_enonce1_t *data, const uchar *enonce1bin,
+			    const int64_t last_job_id)
+{
+	if (last_job_id < 0)
+		data->change_job_id = 0;
+	else {
+		memcpy(data->old_enonce1bin, data->enonce1bin, 16);
+		data->change_job_id = last_job_id + 1;
+	}
+	memcpy(data->enonce1bin, enonce1bin, 16);
+}
+
+/* Hash a share with the enonce1 its job was mined with. Miners are meant to
+ * keep an enonce1 replaced by mining.set_extranonce until the next notify but
+ * some switch as soon as they're told, so jobs from before a move hash with
+ * the old one first and only with the new one when that misses diff, the
+ * diff the job was sent at. Leaves the enonce1 used in share->enonce1 */
+double stratcore_enonce1_share_diff(const workbase_t *wb, const stratcore_enonce1_t *data,
+				    const uchar *coinb2bin, const int cb2len, const double diff,
+				    stratcore_share_t *share)
+{
+	if (unlikely(share->id < data->change_job_id)) {
+		stratcore_share_diff(wb, data->old_enonce1bin, coinb2bin, cb2len, share);
+		if (!target256_meets_diff(share->hash, diff))
+			stratcore_share_diff(wb, data->enonce1bin, coinb2bin, cb2len, share);
+	} else
+		stratcore_share_diff(wb, data->enonce1bin, coinb2bin, cb2len, share);
+	__bin2hex(share->enonce1, share->coinbase + wb->coinb1len,
+		  wb->enonce1constlen + wb->enonce1varlen);
+	return share->sdiff;
+}
+
+/* Ntime cannot be less, but allow forward ntime rolling up to max */
+bool stratcore_ntime_valid(const workbase_t *wb, const uint32_t ntime32)
+{
+	return ntime32 >= wb->ntime32 && ntime32 <= wb->ntime32 + STRATCORE_NTIME_ROLL;
+}
+
+/* Process a block into a message for the generator to submit. Must hold
+ * workbase readcount */
+char *stratcore_block(const workbase_t *wb, const char *coinbase, const int cblen,
+		      const uchar *data, const uchar *hash, uchar *flip32, char *blockhash)
+{
+	char *gbt_block, varint[12];
+	int txns = wb->txns + 1;
+	char hexcoinbase[1024];
+
+	flip_32(flip32, hash);
+	__bin2hex(blockhash, flip32, 32);
+
+	/* Message format: "data" */
+	gbt_block = ckzalloc(1024);
+	__bin2hex(gbt_block, data, 80);
+	if (txns < 0xfd) {
+		uint8_t val8 = txns;
+
+		__bin2hex(varint, (const unsigned char *)&val8, 1);
+	} else if (txns <= 0xffff) {
+		uint16_t val16 = htole16(txns);
+
+		strcat(gbt_block, "fd");
+		__bin2hex(varint, (const unsigned char *)&val16, 2);
+	} else {
+		uint32_t val32 = htole32(txns);
+
+		strcat(gbt_block, "fe");
+		__bin2hex(varint, (const unsigned char *)&val32, 4);
+	}
+	strcat(gbt_block, varint);
+	__bin2hex(hexcoinbase, coinbase, cblen);
+	strcat(gbt_block, hexcoinbase);
+	if (wb->txns)
+		realloc_strcat(&gbt_block, wb->txn_data);
+	return gbt_block;
+}
+
+/* Submit block data through the rpc hooks, absorbing and freeing gbt_block */
+bool stratcore_submit_block(const stratcore_t *sc, char *gbt_block, const uchar *flip32, int height)
+{
+	bool ret = sc->submitblock ? sc->submitblock(sc->arg, gbt_block) : false;
+	char heighthash[68] = {}, rhash[68] = {};
+	uchar swap256[32];
+
+	free(gbt_block);
+	swap_256(swap256, flip32);
+	__bin2hex(rhash, swap256, 32);
+	if (sc->preciousblock)
+		sc->preciousblock(sc->arg, rhash);
+
+	/* Check failures that may be inconclusive but were submitted via other
+	 * means or accepted due to precious block call. */
+	if (!ret && sc->get_blockhash) {
+		/* If the block is accepted locally, it means we may have
+		 * displaced a known block, and are now working on this fork.
+		 * This makes the most sense since if we solve the next block,
+		 * it validates this one as the best chain, orphaning the other
+		 * block. In the case of mainnet, it means we have found a stale
+		 * block and are trying to force ours ahead of the other. In
+		 * a low diff environment we may have successive blocks, and
+		 * this will be the last one solved locally. Trying to optimise
+		 * regtest/testnet will optimise against the mainnet case. */
+		if (sc->get_blockhash(sc->arg, height, heighthash)) {
+			ret = !strncmp(rhash, heighthash, 64);
+			LOGWARNING("Hash for forced possibly stale block, height %d confirms block was %s",
+				   height, ret ? "ACCEPTED" : "REJECTED");
+		}
+	}
+	return ret;
+}
+
+/* The mining.notify for a workbase with the given coinb2. Must enter with
+ * workbase_lock held */
+json_t *stratcore_notify(const workbase_t *wb, const char *coinb2, const bool clean)
+{
+	json_t *val;
+
+	JSON_CPACK(val, "{s:[ssssosssb],s:o,s:s}",
+			"params",
+			wb->idstring,
+			wb->prevhash,
+			wb->coinb1,
+			coinb2,
+			json_deep_copy(wb->merkle_array),
+			wb->bbversion,
+			wb->nbit,
+			wb->ntime,
+			clean,
+			"id", json_null(),
+			"method", "mining.notify");
+	return val;
+}
+
+/* Move a client that sent mining.extranonce.subscribe to a new enonce1 and
+ * nonce2 length, taking effect from its next notify */
+json_t *stratcore_set_extranonce(const char *enonce1, const int n2len)
+{
+	json_t *val;
+
+	JSON_CPACK(val, "{s:[si],s:o,s:s}",
+			"params", enonce1, n2len,
+			"id", json_null(),
+			"method", "mining.set_extranonce");
+	return val;
+}
+
+static const uchar *pool_coinb2(const stratcore_t __maybe_unused *sc, const workbase_t *wb,
+				void __maybe_unused *user, int *cb2len)
+{
+	*cb2len = wb->coinb2len;
+	return wb->coinb2bin;
+}
+
+static const uchar *solo_coinb2(const stratcore_t *sc, const workbase_t *wb, void *user, int *cb2len)
+{
+	const uchar *ret = sc->user_coinb2(sc->arg, user, wb, cb2len);
+
+	if (unlikely(!ret))
+		return pool_coinb2(sc, wb, user, cb2len);
+	return ret;
+}
+
+static double pool_network_diff(const workbase_t *wb)
+{
+	return wb->network_diff;
+}
+
+static double proxy_network_diff(const workbase_t *wb)
+{
+	return wb->diff;
+}
+
+static void pool_retarget(const stratcore_t *sc, void *client, const double diff, tv_t *now,
+			  const double network_diff, const int64_t next_blockid,
+			  const int64_t current_blockid)
+{
+	sc->retarget(sc->arg, client, diff, now, network_diff, next_blockid, current_blockid);
+}
+
+/* Once we've updated user/client statistics in node mode, we can't alter
+ * diff ourselves. */
+static void node_retarget(const stratcore_t __maybe_unused *sc, void __maybe_unused *client,
+			  const double __maybe_unused diff, tv_t __maybe_unused *now,
+			  const double __maybe_unused network_diff,
+			  const int64_t __maybe_unused next_blockid,
+			  const int64_t __maybe_unused current_blockid)
+{
+}
+
+/* Only proxies send shares upstream, nodes merely watch theirs */
+static void pool_forward(const stratcore_t __maybe_unused *sc, void __maybe_unused *client,
+			 const stratcore_share_t __maybe_unused *share, const bool __maybe_unused submit)
+{
+}
+
+static void proxy_forward(const stratcore_t *sc, void *client, const stratcore_share_t *share,
+			  const bool submit)
+{
+	if (submit)
+		sc->upstream_share(sc->arg, client, share);
+}
+
+static int64_t pool_log_id(const int64_t id, const int64_t __maybe_unused virtualid)
+{
+	return id;
+}
+
+static int64_t remote_log_id(const int64_t __maybe_unused id, const int64_t virtualid)
+{
+	return virtualid;
+}
+
+static void pool_log(const stratcore_t __maybe_unused *sc, json_t __maybe_unused *val)
+{
+}
+
+static void remote_log(const stratcore_t *sc, json_t *val)
+{
+	sc->upstream(sc->arg, val, SM_SHARE);
+}
+
+static void pool_respond(const stratcore_t *sc, json_t *val, const int64_t client_id)
+{
+	sc->send(sc->arg, val, client_id, SM_SHARERESULT);
+}
+
+/* Nodes only watch shares, the upstream pool answers them */
+static void node_respond(const stratcore_t __maybe_unused *sc, json_t *val,
+			 const int64_t __maybe_unused client_id)
+{
+	json_decref(val);
+}
+
+static const stratcore_path_t stratcore_paths[STRATCORE_MODES] = {
+	{ STRATCORE_POOL, "pool", pool_coinb2, pool_network_diff, pool_retarget, pool_forward,
+	  pool_log_id, pool_log, pool_respond },
+	{ STRATCORE_SOLO, "solo", solo_coinb2, pool_network_diff, pool_retarget, pool_forward,
+	  pool_log_id, pool_log, pool_respond },
+	{ STRATCORE_PROXY, "proxy", pool_coinb2, proxy_network_diff, pool_retarget, proxy_forward,
+	  pool_log_id, pool_log, pool_respond },
+	{ STRATCORE_NODE, "node", pool_coinb2, proxy_network_diff, node_retarget, pool_forward,
+	  pool_log_id, pool_log, node_respond },
+	{ STRATCORE_REMOTE, "remote", pool_coinb2, pool_network_diff, pool_retarget, pool_forward,
+	  remote_log_id, remote_log, pool_respond },
+	{ STRATCORE_REMOTE_SOLO, "remote solo", solo_coinb2, pool_network_diff, pool_retarget,
+	  pool_forward, remote_log_id, remote_log, pool_respond },
+};
+
+/* Which share path the command line options select. Passthroughs and
+ * redirectors never check shares so take the proxy path */
+int stratcore_mode(const ckpool_t *ckp)
+{
+	if (ckp->node)
+		return STRATCORE_NODE;
+	if (ckp->proxy)
+		return STRATCORE_PROXY;
+	if (ckp->remote)
+		return ckp->btcsolo ? STRATCORE_REMOTE_SOLO : STRATCORE_REMOTE;
+	return ckp->btcsolo ? STRATCORE_SOLO : STRATCORE_POOL;
+}
+
+const stratcore_path_t *stratcore_path(const int mode)
+{
+	if (unlikely(mode < 0 || mode >= STRATCORE_MODES))
+		return &stratcore_paths[STRATCORE_POOL];
+	return &stratcore_paths[mode];
+}
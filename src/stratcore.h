@@ -0,0 +1,173 @@
+/*
+ * Share validation, block assembly and coinbase and notify building from the
+ * stratifier with an explicit context. The clock, bitcoind rpc and client
+ * sends go through hooks in the context so benchmarks, fuzzers and tests can
+ * drive the same code as the pool without sockets, threads or a daemon.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef STRATCORE_H
+#define STRATCORE_H
+
+#include "ckpool.h"
+#include "stratifier.h"
+
+typedef struct genwork workbase_t;
+typedef struct stratcore_share stratcore_share_t;
+typedef struct stratcore_enonce1 stratcore_enonce1_t;
+
+/* How far past the workbase ntime a share may roll ntime */
+#define STRATCORE_NTIME_ROLL 7000
+
+/* Longest nonce2 in hex a workbase can have */
+#define STRATCORE_NONCE2_MAX 32
+
+struct stratcore {
+	/* Pool settings coinbases are built from */
+	int nonce1length;
+	int nonce2length;
+	uint32_t version_mask;
+	const char *btcsig;
+	bool btcsolo;
+	double donation; /* Percent, zero without a valid donation address */
+	const char *txnbin;
+	int txnlen;
+	const char *dontxnbin;
+	int dontxnlen;
+
+	/* Hooks, all passed arg. Realtime clock, ts_realtime when NULL */
+	void (*clock)(void *arg, ts_t *ts);
+	/* Block submission to bitcoind, each skipped when NULL */
+	bool (*submitblock)(void *arg, const char *gbt_block);
+	void (*preciousblock)(void *arg, const char *hash);
+	bool (*get_blockhash)(void *arg, int height, char *hash);
+	/* Queue a message for a client absorbing val, dropped when NULL */
+	void (*send)(void *arg, json_t *val, const int64_t client_id, const int msg_type);
+
+	/* Called by the share paths of the modes needing them, never NULL in
+	 * those modes. The coinb2 a user's shares hash, NULL to fall back to
+	 * the workbase's. Entered holding the user's instance read lock. */
+	const uchar *(*user_coinb2)(void *arg, void *user, const workbase_t *wb, int *cb2len);
+	/* Retarget a client's diff after a counted share, given the workbase
+	 * ids a diff change may be anchored at */
+	void (*retarget)(void *arg, void *client, const double diff, tv_t *now,
+			 const double network_diff, const int64_t next_blockid,
+			 const int64_t current_blockid);
+	/* Pass a valid or stale share to the upstream pool */
+	void (*upstream_share)(void *arg, void *client, const stratcore_share_t *share);
+	/* Send json to the upstream pool without absorbing val */
+	void (*upstream)(void *arg, json_t *val, const int msg_type);
+	void *arg;
+};
+
+typedef struct stratcore stratcore_t;
+
+/* One mining.submit. The strings point into the params json until
+ * stratcore_share_diff fixes their lengths into the buffers here */
+struct stratcore_share {
+	const char *workername;
+	const char *job_id;
+	const char *nonce2;
+	const char *ntime;
+	const char *nonce;
+	int64_t id;
+	uint32_t ntime32;
+	uint32_t version_mask32;
+
+	char nonce2buf[STRATCORE_NONCE2_MAX + 1];
+	char noncebuf[12];
+
+	/* Filled in by stratcore_share_diff */
+	char coinbase[1024];
+	int cblen;
+	uchar swap[80];
+	uchar hash[32];
+	double sdiff;
+
+	/* Filled in by stratcore_enonce1_share_diff */
+	char enonce1[36];
+};
+
+/* The enonce1 a client's shares are hashed with, and the one a move with
+ * mining.set_extranonce replaced, which jobs before change_job_id may still
+ * be mined with */
+struct stratcore_enonce1 {
+	uchar enonce1bin[16];
+	uchar old_enonce1bin[16];
+	int64_t change_job_id;
+};
+
+/* Pool modes with a share path of their own */
+enum stratcore_mode {
+	STRATCORE_POOL,
+	STRATCORE_SOLO,		/* -B, each user hashes a coinbase paying them */
+	STRATCORE_PROXY,	/* -p and -u, valid and stale shares go upstream */
+	STRATCORE_NODE,		/* -N, also leaves diff and responses to upstream */
+	STRATCORE_REMOTE,	/* -t, shares logged upstream by upstream's ids */
+	STRATCORE_REMOTE_SOLO,	/* -t with -B */
+	STRATCORE_MODES
+};
+
+typedef struct stratcore_path stratcore_path_t;
+
+/* The steps of a share's path that depend on the mode, one table for each
+ * chosen once at startup so shares take no mode branches */
+struct stratcore_path {
+	int mode;
+	const char *name;
+
+	/* coinb2 a user's shares are hashed with */
+	const uchar *(*coinb2)(const stratcore_t *sc, const workbase_t *wb, void *user, int *cb2len);
+	/* Diff vardiff is capped at, the upstream's share diff in proxy modes */
+	double (*network_diff)(const workbase_t *wb);
+	/* Retarget a client after a counted share, left to upstream on nodes */
+	void (*retarget)(const stratcore_t *sc, void *client, const double diff, tv_t *now,
+			 const double network_diff, const int64_t next_blockid,
+			 const int64_t current_blockid);
+	/* Pass a share on after checking, submit when upstream wants it */
+	void (*forward)(const stratcore_t *sc, void *client, const stratcore_share_t *share,
+			const bool submit);
+	/* Id a client's shares and blocks are logged under */
+	int64_t (*log_id)(const int64_t id, const int64_t virtualid);
+	/* Pass the share's sharelog json on without absorbing val */
+	void (*log)(const stratcore_t *sc, json_t *val);
+	/* Queue the response to a share absorbing val */
+	void (*respond)(const stratcore_t *sc, json_t *val, const int64_t client_id);
+};
+
+int stratcore_mode(const ckpool_t *ckp);
+const stratcore_path_t *stratcore_path(const int mode);
+
+void stratcore_now(const stratcore_t *sc, ts_t *ts);
+void stratcore_send(const stratcore_t *sc, json_t *val, const int64_t client_id, const int msg_type);
+
+void stratcore_header(workbase_t *wb);
+void stratcore_coinbase(const stratcore_t *sc, workbase_t *wb);
+
+enum share_err stratcore_submit_params(const stratcore_t *sc, const json_t *params_val,
+				       stratcore_share_t *share);
+double stratcore_share_diff(const workbase_t *wb, const uchar *enonce1bin, const uchar *coinb2bin,
+			    const int cb2len, stratcore_share_t *share);
+void stratcore_move_enonce1(stratcore_enonce1_t *data, const uchar *enonce1bin,
+			    const int64_t last_job_id);
+double stratcore_enonce1_share_diff(const workbase_t *wb, const stratcore_enonce1_t *data,
+				    const uchar *coinb2bin, const int cb2len, const double diff,
+				    stratcore_share_t *share);
+double stratcore_hash_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb,
+			   const uchar *coinb2bin, const int cb2len, const char *nonce2,
+			   const uint32_t ntime32, uint32_t version_mask, const char *nonce,
+			   uchar *hash, uchar *swap, int *cblen);
+bool stratcore_ntime_valid(const workbase_t *wb, const uint32_t ntime32);
+
+char *stratcore_block(const workbase_t *wb, const char *coinbase, const int cblen,
+		      const uchar *data, const uchar *hash, uchar *flip32, char *blockhash);
+bool stratcore_submit_block(const stratcore_t *sc, char *gbt_block, const uchar *flip32, int height);
+
+json_t *stratcore_notify(const workbase_t *wb, const char *coinb2, const bool clean);
+json_t *stratcore_set_extranonce(const char *enonce1, const int n2len);
+
+#endif /* STRATCORE_H */
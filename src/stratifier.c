@@ -29,14 +29,20 @@
 #include "ckpool.h"
 #include "libckpool.h"
 #include "bitcoin.h"
+#include "evstream.h"
 #include "sha2.h"
 #include "stratifier.h"
+#include "stratcore.h"
 #include "ua_utils.h"
 #include "worker_ua.h"
 #include "uthash.h"
 #include "utlist.h"
 #include "connector.h"
 #include "generator.h"
+#include "capture.h"
+#include "probes.h"
+#include "threadstats.h"
+#include "vardiff.h"
 
 /* normalize_ua_buf is provided by ua_utils.c */
 
@@ -46,6 +52,7 @@ typedef struct ua_item {
 	int count;          /* devices (sum of instance_count for connected workers) */
 	double dsps5;       /* sum of client->dsps5 across connected clients for this UA (5m snapshot) */
 	double best_diff;   /* max best_diff across connected workers for this UA */
+	struct stratum_instance *clients; /* subscribed clients interned to this UA */
 } ua_item_t;
 
 static int ua_sort_cmp(const void *a, const void *b)
@@ -56,9 +63,6 @@ static int ua_sort_cmp(const void *a, const void *b)
 }
 
 /* Consistent across all pool instances */
-static const char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
-static const char *scriptsig_header = "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff";
-static uchar scriptsig_header_bin[41];
 static const double nonces = 4294967296;
 
 /* Add unaccounted shares when they arrive, remove them with each update of
@@ -115,13 +119,24 @@ struct pool_stats {
 
 typedef struct pool_stats pool_stats_t;
 
-typedef struct genwork workbase_t;
+const char *stats_phase_names[SP_PHASES] = {
+	"clients",
+	"useragents",
+	"users",
+	"write",
+	"pool"
+};
 
 struct json_params {
 	json_t *method;
 	json_t *params;
 	json_t *id_val;
 	int64_t client_id;
+	tv_t queued;
+
+	/* Monotonic start and last stage times of sampled shares */
+	int64_t trace_start;
+	int64_t trace_last;
 };
 
 typedef struct json_params json_params_t;
@@ -130,10 +145,27 @@ typedef struct json_params json_params_t;
 struct smsg {
 	json_t *json_msg;
 	int64_t client_id;
+
+	int64_t trace_start;
+	int64_t trace_last;
 };
 
 typedef struct smsg smsg_t;
 
+/* Stages of a sampled share that are timed by the stratifier */
+enum {
+	SLAT_SRECVQ,	/* Queued by the connector to srecv_process */
+	SLAT_DISPATCH,	/* Client lookup and method parsing to queued on sshareq */
+	SLAT_SSHAREQ,	/* Queued on sshareq to sshare_process */
+	SLAT_VALIDATE,	/* Share validation to response queued on ssends */
+	SLAT_SSENDS,	/* Queued on ssends to handed to the connector */
+	SLAT_STAGES
+};
+
+static const char *slat_names[] = {
+	"srecvq", "dispatch", "sshareq", "validate", "ssends"
+};
+
 struct userwb {
 	UT_hash_handle hh;
 	int64_t id;
@@ -237,6 +269,53 @@ struct txntable {
 #define ID_ADDRAUTH 8
 #define ID_HEARTBEAT 9
 
+/* Where a request to update the base template came from */
+enum {
+	UPDATE_POLL,	/* Routine update_interval refresh */
+	UPDATE_NOTIFY,	/* update message, usually from the notifier */
+	UPDATE_GETBEST,	/* blockupdate saw a new best block hash */
+	UPDATE_ZMQ	/* zmq hashblock notification */
+};
+
+static const char *update_sources[] = {
+	"poll", "notify", "getbest", "zmq"
+};
+
+struct update_req {
+	int prio;
+	int source;
+	int64_t requested; /* Monotonic ns when update_base was called */
+};
+
+typedef struct update_req update_req_t;
+
+/* Number of block change traces kept in memory */
+#define BLOCK_TRACES 16
+
+/* Timing of one block change from the new block being noticed to every
+ * miner having been written its clean notify. Phase times are monotonic ns
+ * offsets from start. */
+struct block_trace {
+	int64_t id; /* 0 while the slot is being reused */
+	int64_t workinfoid;
+	int height;
+	char hash[68];
+	const char *source;
+	tv_t when;
+	int64_t start;
+	int64_t queued; /* Waited for update_sem and the updateq */
+	int64_t fetched; /* getblocktemplate fetched and parsed */
+	int64_t built; /* Workbase built and added */
+	int64_t broadcast; /* Notifies queued for every client */
+	int notifies;
+	int delivered;
+	int64_t first; /* Earliest notify write completion */
+	lat_hist_t delivery; /* Per client notify write completion times */
+	bool logged;
+};
+
+typedef struct block_trace block_trace_t;
+
 struct stratifier_data {
 	ckpool_t *ckp;
 
@@ -245,9 +324,15 @@ struct stratifier_data {
 	char dontxnbin[48];
 	int dontxnlen;
 
+	/* Share validation and work building with this sdata's hooks */
+	stratcore_t core;
+	const stratcore_path_t *path; /* Share path of the pool's mode */
+
 	pool_stats_t stats;
 	/* Protects changes to pool stats */
 	mutex_t stats_lock;
+	/* Timing of the last statsupdate pass, under stats_lock */
+	stats_timing_t stats_timing;
 	/* Protects changes to unaccounted pool stats */
 	mutex_t uastats_lock;
 
@@ -286,15 +371,24 @@ struct stratifier_data {
 	char lastswaphash[68];
 
 	ckmsgq_t *updateq;	// Generator base work updates
+
+	/* Ring of recent block change traces indexed by id % BLOCK_TRACES.
+	 * Written only by block_update, with block_trace_lock held against
+	 * readers of the whole ring; notify deliveries update them lock free. */
+	block_trace_t block_traces[BLOCK_TRACES];
+	int64_t block_trace_id;
+	mutex_t block_trace_lock;
 	ckmsgq_t *ssends;	// Stratum sends
 	ckmsgq_t *srecvs;	// Stratum receives
 	ckmsgq_t *sshareq;	// Stratum share sends
 	ckmsgq_t *sauthq;	// Stratum authorisations
 	ckmsgq_t *stxnq;	// Transaction requests
+	ckmsgq_t *smoveq;	// Clients to move with set_extranonce
 
 	int user_instance_id;
 
 	stratum_instance_t *stratum_instances;
+	stratum_instance_t *enonce1_instances; /* By enonce1_key, each key's newest */
 	stratum_instance_t *recycled_instances;
 	stratum_instance_t *node_instances;
 	stratum_instance_t *remote_instances;
@@ -322,6 +416,31 @@ struct stratifier_data {
 
 	/* Persistent UA tracking: incremented on subscribe, decremented on disconnect */
 	ua_item_t *ua_map;
+	/* Protects the running dsps5 and best_diff in ua_map entries and
+	 * client->dsps5 of clients interned into them */
+	mutex_t ua_lock;
+
+	/* Share results indexed by SHARE_RESULT_IDX, SE_NONE being accepted.
+	 * Their slots are cacheline aligned so sdata_t is allocated with
+	 * ckzalloc_aligned. */
+	metric_counter_t share_results[SHARE_RESULTS];
+	metric_slothist_t share_wait; // Time shares spend queued on sshareq
+	metric_slothist_t share_latency; // Time from receipt to result being queued
+	metric_hist_t update_latency; // Time to fetch and broadcast a new template
+
+	/* Stages of shares sampled with latencysample timed by the stratifier */
+	lat_hist_t share_lat[SLAT_STAGES];
+
+	/* Protects user_metrics, rebuilt by statsupdate for the metrics
+	 * endpoint so scraping never needs the instance_lock */
+	mutex_t metrics_lock;
+	char *user_metrics;
+
+	/* Ring of share events published to subscribers if enabled */
+	evstream_t *sharestream;
+
+	/* Ring of pool status, block and template events if enabled */
+	evstream_t *eventstream;
 };
 
 typedef struct json_entry json_entry_t;
@@ -375,230 +494,68 @@ static void info_msg_entries(char_entry_t **entries)
 	}
 }
 
-static const int witnessdata_size = 36; // commitment header + hash
-
+/* Build the coinbase templates then check the first one bitcoind sees is a
+ * valid transaction */
 static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 {
-	uint64_t *u64, g64, d64 = 0;
 	sdata_t *sdata = ckp->sdata;
-	char header[272];
-	int len, ofs = 0;
-	ts_t now;
-
-	/* Set fixed length coinb1 arrays to be more than enough */
-	wb->coinb1 = ckzalloc(256);
-	wb->coinb1bin = ckzalloc(128);
-
-	/* Strings in wb should have been zero memset prior. Generate binary
-	 * templates first, then convert to hex */
-	memcpy(wb->coinb1bin, scriptsig_header_bin, 41);
-	ofs += 41; // Fixed header length;
-
-	ofs++; // Script length is filled in at the end @wb->coinb1bin[41];
-
-	/* Put block height at start of template */
-	len = ser_number(wb->coinb1bin + ofs, wb->height);
-	ofs += len;
-
-	/* Followed by flag */
-	len = strlen(wb->flags) / 2;
-	wb->coinb1bin[ofs++] = len;
-	hex2bin(wb->coinb1bin + ofs, wb->flags, len);
-	ofs += len;
-
-	/* Followed by timestamp */
-	ts_realtime(&now);
-	len = ser_number(wb->coinb1bin + ofs, now.tv_sec);
-	ofs += len;
-
-	/* Followed by our unique randomiser based on the nsec timestamp */
-	len = ser_number(wb->coinb1bin + ofs, now.tv_nsec);
-	ofs += len;
-
-	wb->enonce1varlen = ckp->nonce1length;
-	wb->enonce2varlen = ckp->nonce2length;
-	wb->coinb1bin[ofs++] = wb->enonce1varlen + wb->enonce2varlen;
-
-	wb->coinb1len = ofs;
-
-	len = wb->coinb1len - 41;
-
-	len += wb->enonce1varlen;
-	len += wb->enonce2varlen;
-
-	wb->coinb2bin = ckzalloc(512);
-	memcpy(wb->coinb2bin, "\x0a\x63\x6b\x70\x6f\x6f\x6c\x2d\x6c\x68\x72", 11);
-	wb->coinb2len = 11;
-	if (ckp->btcsig) {
-		int siglen = strlen(ckp->btcsig);
-
-		LOGDEBUG("Len %d sig %s", siglen, ckp->btcsig);
-		if (siglen) {
-			wb->coinb2bin[wb->coinb2len++] = siglen;
-			memcpy(wb->coinb2bin + wb->coinb2len, ckp->btcsig, siglen);
-			wb->coinb2len += siglen;
-		}
-	}
-	len += wb->coinb2len;
-
-	wb->coinb1bin[41] = len - 1; /* Set the length now */
-	__bin2hex(wb->coinb1, wb->coinb1bin, wb->coinb1len);
-	LOGDEBUG("Coinb1: %s", wb->coinb1);
-	/* Coinbase 1 complete */
-
-	memcpy(wb->coinb2bin + wb->coinb2len, "\xff\xff\xff\xff", 4);
-	wb->coinb2len += 4;
-
-	// Generation value
-	g64 = wb->coinbasevalue;
-	if (ckp->donvalid && ckp->donation > 0) {
-		double dbl64 = (double)g64 / 100 * ckp->donation;
-		d64 = dbl64;
-		g64 -= d64; // To guarantee integers add up to the original coinbasevalue
-		wb->coinb2bin[wb->coinb2len++] = 2 + wb->insert_witness;
-	} else
-		wb->coinb2bin[wb->coinb2len++] = 1 + wb->insert_witness;
-
-	u64 = (uint64_t *)&wb->coinb2bin[wb->coinb2len];
-	*u64 = htole64(g64);
-	wb->coinb2len += 8;
-
-	/* Coinb2 address goes here, takes up 23~25 bytes + 1 byte for length */
-
-	wb->coinb3len = 0;
-	wb->coinb3bin = ckzalloc(256 + wb->insert_witness * (8 + witnessdata_size + 2));
+	int coinbase_len, offset = 0;
+	char *coinbase, *cb;
+	json_t *val = NULL;
 
-	if (ckp->donvalid && ckp->donation > 0) {
-		u64 = (uint64_t *)wb->coinb3bin;
-		*u64 = htole64(d64);
-		wb->coinb3len += 8;
+	stratcore_coinbase(&sdata->core, wb);
 
-		wb->coinb3bin[wb->coinb3len++] = sdata->dontxnlen;
-		memcpy(wb->coinb3bin + wb->coinb3len, sdata->dontxnbin, sdata->dontxnlen);
-		wb->coinb3len += sdata->dontxnlen;
-	} else
-		ckp->donation = 0;
-
-	if (wb->insert_witness) {
-		// 0 value
-		wb->coinb3len += 8;
-
-		wb->coinb3bin[wb->coinb3len++] = witnessdata_size + 2; // total scriptPubKey size
-		wb->coinb3bin[wb->coinb3len++] = 0x6a; // OP_RETURN
-		wb->coinb3bin[wb->coinb3len++] = witnessdata_size;
-
-		hex2bin(&wb->coinb3bin[wb->coinb3len], wb->witnessdata, witnessdata_size);
-		wb->coinb3len += witnessdata_size;
-	}
-
-	wb->coinb3len += 4; // Blank lock
-
-	if (!ckp->btcsolo) {
-		int coinbase_len, offset = 0;
-		char *coinbase, *cb;
-		json_t *val = NULL;
-
-		/* Append the generation address and coinb3 in !solo mode */
-		wb->coinb2bin[wb->coinb2len++] = sdata->txnlen;
-		memcpy(wb->coinb2bin + wb->coinb2len, sdata->txnbin, sdata->txnlen);
-		wb->coinb2len += sdata->txnlen;
-		memcpy(wb->coinb2bin + wb->coinb2len, wb->coinb3bin, wb->coinb3len);
-		wb->coinb2len += wb->coinb3len;
-		wb->coinb3len = 0;
-		dealloc(wb->coinb3bin);
-
-		/* Set this only once */
-		if (unlikely(!ckp->coinbase_valid)) {
-			/* We have enough to test the validity of the coinbase here */
-			coinbase_len = wb->coinb1len + ckp->nonce1length + ckp->nonce2length + wb->coinb2len;
-			coinbase = ckzalloc(coinbase_len);
-			memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
-			offset += wb->coinb1len;
-			/* Space for nonce1 and 2 */
-			offset += ckp->nonce1length + ckp->nonce2length;
-			memcpy(coinbase + offset, wb->coinb2bin, wb->coinb2len);
-			offset += wb->coinb2len;
-			cb = bin2hex(coinbase, offset);
-			LOGDEBUG("Coinbase txn %s", cb);
-			free(coinbase);
-			if (generator_checktxn(ckp, cb, &val)) {
-				char *s = json_dumps(val, JSON_NO_UTF8 | JSON_COMPACT);
+	/* Set this only once */
+	if (likely(ckp->coinbase_valid))
+		return;
 
-				json_decref(val);
-				LOGNOTICE("Coinbase transaction confirmed valid");
-				LOGDEBUG("%s", s);
-				free(s);
-			} else {
-				/* This is a fatal error */
-				LOGEMERG("Coinbase failed valid transaction check, aborting!");
-				exit(1);
-			}
-			free(cb);
-			ckp->coinbase_valid = true;
-			LOGWARNING("Mining from any incoming username to address %s", ckp->btcaddress);
-			if (ckp->donation)
-				LOGWARNING("%.1f percent donation to %s", ckp->donation, ckp->donaddress);
-		}
-	} else if (unlikely(!ckp->coinbase_valid)) {
-		/* Create a sample coinbase to test its validity in solo mode */
-		int coinbase_len, offset = 0;
-		char *coinbase, *cb;
-		json_t *val = NULL;
-
-		coinbase_len = wb->coinb1len + ckp->nonce1length + ckp->nonce2length + wb->coinb2len +
-			       sdata->txnlen + wb->coinb3len + 1;
-		coinbase = ckzalloc(coinbase_len);
-		memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
-		offset += wb->coinb1len;
-		offset += ckp->nonce1length + ckp->nonce2length;
-		memcpy(coinbase + offset, wb->coinb2bin, wb->coinb2len);
-		offset += wb->coinb2len;
+	/* We have enough to test the validity of the coinbase here. In solo
+	 * mode create a sample coinbase with the pool's generation address */
+	coinbase_len = wb->coinb1len + ckp->nonce1length + ckp->nonce2length + wb->coinb2len +
+		       sdata->txnlen + wb->coinb3len + 1;
+	coinbase = ckzalloc(coinbase_len);
+	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
+	offset += wb->coinb1len;
+	/* Space for nonce1 and 2 */
+	offset += ckp->nonce1length + ckp->nonce2length;
+	memcpy(coinbase + offset, wb->coinb2bin, wb->coinb2len);
+	offset += wb->coinb2len;
+	if (ckp->btcsolo) {
 		coinbase[offset] = sdata->txnlen;
 		offset += 1;
 		memcpy(coinbase + offset, sdata->txnbin, sdata->txnlen);
 		offset += sdata->txnlen;
 		memcpy(coinbase + offset, wb->coinb3bin, wb->coinb3len);
 		offset += wb->coinb3len;
-		cb = bin2hex(coinbase, offset);
-		LOGDEBUG("Coinbase txn %s", cb);
-		free(coinbase);
-		if (generator_checktxn(ckp, cb, &val)) {
-			char *s = json_dumps(val, JSON_NO_UTF8 | JSON_COMPACT);
-
-			json_decref(val);
-			LOGNOTICE("Coinbase transaction confirmed valid");
-			LOGDEBUG("%s", s);
-			free(s);
-		} else {
-			/* This is a fatal error */
-			LOGEMERG("Coinbase failed valid transaction check, aborting!");
-			exit(1);
-		}
-		free(cb);
-		ckp->coinbase_valid = true;
-		LOGWARNING("Mining solo to any incoming valid BTC address username");
-		if (ckp->donation)
-			LOGWARNING("%.1f percent donation to %s", ckp->donation, ckp->donaddress);
 	}
+	cb = bin2hex(coinbase, offset);
+	LOGDEBUG("Coinbase txn %s", cb);
+	free(coinbase);
+	if (generator_checktxn(ckp, cb, &val)) {
+		char *s = json_dumps(val, JSON_NO_UTF8 | JSON_COMPACT);
 
-	/* Set this just for node compatibility, though it's unused */
-	wb->coinb2 = bin2hex(wb->coinb2bin, wb->coinb2len);
-	LOGDEBUG("Coinb2: %s", wb->coinb2);
-	/* Coinbases 2 +/- 3 templates complete */
-
-	snprintf(header, 270, "%s%s%s%s%s%s%s",
-		 wb->bbversion, wb->prevhash,
-		 "0000000000000000000000000000000000000000000000000000000000000000",
-		 wb->ntime, wb->nbit,
-		 "00000000", /* nonce */
-		 workpadding);
-	header[224] = 0;
-	LOGDEBUG("Header: %s", header);
-	hex2bin(wb->headerbin, header, 112);
+		json_decref(val);
+		LOGNOTICE("Coinbase transaction confirmed valid");
+		LOGDEBUG("%s", s);
+		free(s);
+	} else {
+		/* This is a fatal error */
+		LOGEMERG("Coinbase failed valid transaction check, aborting!");
+		exit(1);
+	}
+	free(cb);
+	ckp->coinbase_valid = true;
+	if (ckp->btcsolo)
+		LOGWARNING("Mining solo to any incoming valid BTC address username");
+	else
+		LOGWARNING("Mining from any incoming username to address %s", ckp->btcaddress);
+	if (ckp->donation)
+		LOGWARNING("%.1f percent donation to %s", ckp->donation, ckp->donaddress);
 }
 
-static void stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, bool clean);
-static void stratum_broadcast_updates(sdata_t *sdata, bool clean);
+static int stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, bool clean,
+				    const int64_t btrace);
+static int stratum_broadcast_updates(sdata_t *sdata, bool clean, const int64_t btrace);
 
 static void clear_userwb(sdata_t *sdata, int64_t id)
 {
@@ -627,6 +584,8 @@ static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 	free(wb->txn_data);
 	free(wb->txn_hashes);
 	free(wb->logdir);
+	if (wb->sharelog)
+		rotlog_close(wb->sharelog);
 	free(wb->coinb1bin);
 	free(wb->coinb1);
 	free(wb->coinb2bin);
@@ -878,6 +837,27 @@ static void generate_userwbs(sdata_t *sdata, workbase_t *wb)
 	ck_wunlock(&sdata->instance_lock);
 }
 
+static const char *pool_event_types[] = {
+	"status",
+	"block_found",
+	"block_solve",
+	"block_reject",
+	"template",
+	"proxy"
+};
+
+/* Publish an event on the pool event stream, stealing the reference to val */
+static void pool_event(ckpool_t *ckp, const int type, const char *user, const char *worker,
+		       json_t *val)
+{
+	sdata_t *sdata = ckp->sdata;
+
+	if (sdata->eventstream)
+		evstream_publish(sdata->eventstream, type, user, worker, val);
+	else
+		json_decref(val);
+}
+
 /* Add a new workbase to the table of workbases. Sdata is the global data in
  * pool mode but unique to each subproxy in proxy mode */
 static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_block)
@@ -892,14 +872,19 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	/* Stats network_diff is not protected by lock but is not a critical
 	 * value */
 	wb->network_diff = diff_from_nbits(wb->headerbin + 72);
+	target256_from_nbits(&wb->network_target, (uchar *)wb->headerbin + 72);
 	/* Allow sub-1.0 network diff only when explicitly enabled (for regtest testing) */
-	if (!ckp->allow_low_diff && wb->network_diff < 1)
+	if (!ckp->allow_low_diff && wb->network_diff < 1) {
 		wb->network_diff = 1;
+		target256_from_diff(&wb->network_target, 1);
+	}
 	stats->network_diff = wb->network_diff;
 	if (stats->network_diff != old_diff)
 		LOGWARNING("Network diff set to %.1f", stats->network_diff);
 	len = strlen(ckp->logdir) + 8 + 1 + 16 + 1;
 	wb->logdir = ckzalloc(len);
+	if (ckp->logshares)
+		wb->sharelog = rotlog_create(NULL, ROTLOG_BUFSIZ);
 
 	/* In proxy mode, the wb->id is received in the notify update and
 	 * we set workbase_id from it. In server mode the stratifier is
@@ -958,6 +943,7 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 		}
 	}
 	ck_wunlock(&sdata->workbase_lock);
+	CKPROBE3(workbase, wb->id, wb->height, *new_block);
 
 	/* This wb can't be pulled out from under us so no workbase lock is
 	 * required to generate_userwbs */
@@ -969,6 +955,20 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 
 	if (!ckp->passthrough)
 		send_workinfo(ckp, sdata, wb);
+
+	if (ckp_sdata->eventstream) {
+		json_t *val;
+
+		JSON_CPACK(val, "{sI,si,ss,sI,si,sf,sb}",
+			   "workinfoid", wb->id,
+			   "height", wb->height,
+			   "prevhash", sdata->lastswaphash,
+			   "reward", wb->coinbasevalue,
+			   "txns", wb->txns,
+			   "netdiff", wb->network_diff,
+			   "new_block", *new_block);
+		pool_event(ckp, POOL_EV_TEMPLATE, NULL, NULL, val);
+	}
 }
 
 static void broadcast_ping(sdata_t *sdata);
@@ -1330,24 +1330,136 @@ static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
 	wb->insert_witness = true;
 }
 
+static json_t *block_trace_json(const block_trace_t *bt)
+{
+	json_t *val;
+
+	JSON_CPACK(val, "{sI,sI,si,ss,ss,sf,sf,sf,sf,sf,si,si,sf}",
+		   "id", bt->id,
+		   "workinfoid", bt->workinfoid,
+		   "height", bt->height,
+		   "hash", bt->hash,
+		   "source", bt->source,
+		   "time", (double)bt->when.tv_sec + (double)bt->when.tv_usec / 1000000,
+		   "queue", (double)bt->queued / 1000,
+		   "fetch", (double)(bt->fetched - bt->queued) / 1000,
+		   "build", (double)(bt->built - bt->fetched) / 1000,
+		   "broadcast", (double)(bt->broadcast - bt->built) / 1000,
+		   "notifies", bt->notifies,
+		   "delivered", __atomic_load_n(&bt->delivered, __ATOMIC_RELAXED),
+		   "first", (double)__atomic_load_n(&bt->first, __ATOMIC_RELAXED) / 1000);
+	json_set_object(val, "delivery", lat_hist_json(&bt->delivery));
+	return val;
+}
+
+/* Log a block trace once, when its last notify is delivered or when the next
+ * block change finds it still incomplete */
+static void log_block_trace(block_trace_t *bt)
+{
+	bool logged = false;
+	json_t *val;
+	char *s;
+
+	if (!__atomic_compare_exchange_n(&bt->logged, &logged, true, false, __ATOMIC_RELAXED,
+					 __ATOMIC_RELAXED))
+		return;
+	val = block_trace_json(bt);
+	s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_REAL_PRECISION(6));
+	json_decref(val);
+	LOGNOTICE("Block trace:%s", s);
+	free(s);
+}
+
+/* Start a trace for a block change in a free slot of the ring */
+static block_trace_t *new_block_trace(sdata_t *sdata, const update_req_t *ureq)
+{
+	block_trace_t *bt;
+	int64_t id;
+
+	mutex_lock(&sdata->block_trace_lock);
+	id = ++sdata->block_trace_id;
+	/* The previous block change may have had notifies that were never
+	 * delivered, such as to clients that disconnected */
+	bt = &sdata->block_traces[(id - 1) % BLOCK_TRACES];
+	if (id > 1 && bt->id == id - 1)
+		log_block_trace(bt);
+	bt = &sdata->block_traces[id % BLOCK_TRACES];
+	__atomic_store_n(&bt->id, 0, __ATOMIC_RELEASE);
+	memset(bt, 0, sizeof(block_trace_t));
+	bt->source = update_sources[ureq->source];
+	bt->start = ureq->requested;
+	tv_time(&bt->when);
+	__atomic_store_n(&bt->id, id, __ATOMIC_RELEASE);
+	mutex_unlock(&sdata->block_trace_lock);
+	return bt;
+}
+
+/* Called by the connector as each notify of a traced block change has been
+ * written to its client */
+void stratifier_block_delivered(ckpool_t *ckp, const int64_t id, const int64_t now)
+{
+	sdata_t *sdata = ckp->sdata;
+	block_trace_t *bt = &sdata->block_traces[id % BLOCK_TRACES];
+	int64_t first, elapsed;
+	int delivered;
+
+	/* Slot has since been reused for a newer block */
+	if (unlikely(__atomic_load_n(&bt->id, __ATOMIC_ACQUIRE) != id))
+		return;
+	elapsed = now - bt->start;
+	lat_observe(&bt->delivery, elapsed);
+	first = __atomic_load_n(&bt->first, __ATOMIC_RELAXED);
+	while (!first || elapsed < first) {
+		if (__atomic_compare_exchange_n(&bt->first, &first, elapsed, true, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			break;
+	}
+	delivered = __atomic_add_fetch(&bt->delivered, 1, __ATOMIC_RELAXED);
+	/* notifies is only valid once broadcast has been set */
+	if (__atomic_load_n(&bt->broadcast, __ATOMIC_ACQUIRE) &&
+	    delivered >= __atomic_load_n(&bt->notifies, __ATOMIC_RELAXED))
+		log_block_trace(bt);
+}
+
+/* Record the template in the stratum capture so a replay knows when the
+ * original pool changed work */
+static void capture_template(const workbase_t *wb, const bool new_block)
+{
+	json_t *val;
+	char *buf;
+
+	JSON_CPACK(val, "{sIsisssb}", "workinfoid", wb->id, "height", wb->height,
+		   "prevhash", wb->prevhash, "new_block", new_block);
+	buf = json_dumps(val, JSON_COMPACT);
+	json_decref(val);
+	capture_record(CAPTURE_TEMPLATE, 0, buf, strlen(buf));
+	free(buf);
+}
+
 /* This function assumes it will only receive a valid json gbt base template
  * since checking should have been done earlier, and creates the base template
  * for generating work templates. This is a ckmsgq so all uses of this function
  * are serialised. */
-static void block_update(ckpool_t *ckp, int *prio)
+static void block_update(ckpool_t *ckp, update_req_t *ureq)
 {
 	bool new_block = false, ret = false;
 	const char *witnessdata_check;
 	sdata_t *sdata = ckp->sdata;
+	block_trace_t *bt = NULL;
+	int64_t started, fetched;
 	json_t *txn_array;
 	txntable_t *txns;
 	int retries = 0;
 	workbase_t *wb;
+	tv_t start, now;
+	int notifies;
 
+	tv_time(&start);
+	started = lat_now();
 retry:
 	wb = generator_getbase(ckp);
 	if (unlikely(!wb)) {
-		if (retries++ < 5 || *prio == GEN_PRIORITY) {
+		if (retries++ < 5 || ureq->prio == GEN_PRIORITY) {
 			LOGWARNING("Generator returned failure in update_base, retry #%d", retries);
 			goto retry;
 		}
@@ -1356,6 +1468,7 @@ retry:
 	}
 	if (unlikely(retries))
 		LOGWARNING("Generator succeeded in update_base after retrying");
+	fetched = lat_now();
 
 	wb->ckp = ckp;
 
@@ -1376,14 +1489,34 @@ retry:
 	generate_coinbase(ckp, wb);
 
 	add_base(ckp, sdata, wb, &new_block);
+	if (unlikely(capture_enabled))
+		capture_template(wb, new_block);
 
-	if (new_block)
+	if (new_block) {
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
+		bt = new_block_trace(sdata, ureq);
+		bt->queued = started - bt->start;
+		bt->fetched = fetched - bt->start;
+		bt->built = lat_now() - bt->start;
+		bt->workinfoid = wb->id;
+		bt->height = wb->height;
+		strcpy(bt->hash, sdata->lastswaphash);
+	}
 	if (ckp->btcsolo)
-		stratum_broadcast_updates(sdata, new_block);
+		notifies = stratum_broadcast_updates(sdata, new_block, bt ? bt->id : 0);
 	else
-		stratum_broadcast_update(sdata, wb, new_block);
+		notifies = stratum_broadcast_update(sdata, wb, new_block, bt ? bt->id : 0);
+	if (bt) {
+		/* Deliveries may already have completed before we know how
+		 * many notifies there were */
+		__atomic_store_n(&bt->notifies, notifies, __ATOMIC_RELEASE);
+		__atomic_store_n(&bt->broadcast, lat_now() - bt->start, __ATOMIC_RELEASE);
+		if (__atomic_load_n(&bt->delivered, __ATOMIC_RELAXED) >= notifies)
+			log_block_trace(bt);
+	}
 	ret = true;
+	tv_time(&now);
+	metric_observe(&sdata->update_latency, tvdiff(&now, &start));
 	LOGINFO("Broadcast updated stratum base");
 	/* Update transactions after stratum broadcast to not delay
 	 * propagation. */
@@ -1404,7 +1537,7 @@ out:
 		LOGINFO("Broadcast ping due to failed stratum base update");
 		broadcast_ping(sdata);
 	}
-	free(prio);
+	free(ureq);
 }
 
 #define SSEND_PREPEND	0
@@ -1685,7 +1818,6 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 	workbase_t *wb = ckzalloc(sizeof(workbase_t));
 	sdata_t *sdata = ckp->sdata;
 	bool new_block = false;
-	char header[272];
 
 	wb->ckp = ckp;
 	/* This is the client id if this workbase came from a remote trusted
@@ -1734,90 +1866,22 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 	json_intcpy(&wb->enonce2varlen, val, "enonce2varlen");
 	ts_realtime(&wb->gentime);
 
-	snprintf(header, 270, "%s%s%s%s%s%s%s",
-		 wb->bbversion, wb->prevhash,
-		 "0000000000000000000000000000000000000000000000000000000000000000",
-		 wb->ntime, wb->nbit,
-		 "00000000", /* nonce */
-		 workpadding);
-	header[224] = 0;
-	LOGDEBUG("Header: %s", header);
-	hex2bin(wb->headerbin, header, 112);
+	stratcore_header(wb);
 
 	/* If this is from a remote trusted server or an upstream server, add
 	 * it to the remote_workbases hashtable */
 	if (trusted)
 		add_remote_base(ckp, sdata, wb);
-	else
+	else {
 		add_base(ckp, sdata, wb, &new_block);
+		if (unlikely(capture_enabled))
+			capture_template(wb, new_block);
+	}
 
 	if (new_block)
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
 }
 
-/* Calculate share diff and fill in hash and swap. Need to hold workbase read count */
-static double
-share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const char *nonce2,
-	   const uint32_t ntime32, uint32_t version_mask, const char *nonce,
-	   uchar *hash, uchar *swap, int *cblen)
-{
-	unsigned char merkle_root[32], merkle_sha[64];
-	uint32_t *data32, *swap32, benonce32;
-	uchar hash1[32];
-	char data[80];
-	int i;
-
-	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
-	*cblen = wb->coinb1len;
-	memcpy(coinbase + *cblen, enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
-	*cblen += wb->enonce1constlen + wb->enonce1varlen;
-	hex2bin(coinbase + *cblen, nonce2, wb->enonce2varlen);
-	*cblen += wb->enonce2varlen;
-	memcpy(coinbase + *cblen, wb->coinb2bin, wb->coinb2len);
-	*cblen += wb->coinb2len;
-
-	gen_hash((uchar *)coinbase, merkle_root, *cblen);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < wb->merkles; i++) {
-		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip_32(swap32, data32);
-
-	/* Copy the cached header binary and insert the merkle root */
-	memcpy(data, wb->headerbin, 80);
-	memcpy(data + 36, merkle_root, 32);
-
-	/* Update nVersion when version_mask is in use */
-	if (version_mask) {
-		version_mask = htobe32(version_mask);
-		data32 = (uint32_t *)data;
-		*data32 |= version_mask;
-	}
-
-	/* Insert the nonce value into the data */
-	hex2bin(&benonce32, nonce, 4);
-	data32 = (uint32_t *)(data + 64 + 12);
-	*data32 = benonce32;
-
-	/* Insert the ntime value into the data */
-	data32 = (uint32_t *)(data + 68);
-	*data32 = htobe32(ntime32);
-
-	/* Hash the share */
-	data32 = (uint32_t *)data;
-	swap32 = (uint32_t *)swap;
-	flip_80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, hash);
-
-	/* Calculate the diff of the share here */
-	return diff_from_target(hash);
-}
-
 static void add_remote_blockdata(ckpool_t *ckp, json_t *val, const int cblen, const char *coinbase,
 				 const uchar *data)
 {
@@ -1896,76 +1960,12 @@ static void send_node_block(ckpool_t *ckp, sdata_t *sdata, const char *enonce1,
 	}
 }
 
-/* Process a block into a message for the generator to submit. Must hold
- * workbase readcount */
-static char *
-process_block(const workbase_t *wb, const char *coinbase, const int cblen,
-	      const uchar *data, const uchar *hash, uchar *flip32, char *blockhash)
-{
-	char *gbt_block, varint[12];
-	int txns = wb->txns + 1;
-	char hexcoinbase[1024];
-
-	flip_32(flip32, hash);
-	__bin2hex(blockhash, flip32, 32);
-
-	/* Message format: "data" */
-	gbt_block = ckzalloc(1024);
-	__bin2hex(gbt_block, data, 80);
-	if (txns < 0xfd) {
-		uint8_t val8 = txns;
-
-		__bin2hex(varint, (const unsigned char *)&val8, 1);
-	} else if (txns <= 0xffff) {
-		uint16_t val16 = htole16(txns);
-
-		strcat(gbt_block, "fd");
-		__bin2hex(varint, (const unsigned char *)&val16, 2);
-	} else {
-		uint32_t val32 = htole32(txns);
-
-		strcat(gbt_block, "fe");
-		__bin2hex(varint, (const unsigned char *)&val32, 4);
-	}
-	strcat(gbt_block, varint);
-	__bin2hex(hexcoinbase, coinbase, cblen);
-	strcat(gbt_block, hexcoinbase);
-	if (wb->txns)
-		realloc_strcat(&gbt_block, wb->txn_data);
-	return gbt_block;
-}
-
 /* Submit block data locally, absorbing and freeing gbt_block */
 static bool local_block_submit(ckpool_t *ckp, char *gbt_block, const uchar *flip32, int height)
 {
-	bool ret = generator_submitblock(ckp, gbt_block);
-	char heighthash[68] = {}, rhash[68] = {};
-	uchar swap256[32];
-
-	free(gbt_block);
-	swap_256(swap256, flip32);
-	__bin2hex(rhash, swap256, 32);
-	generator_preciousblock(ckp, rhash);
+	sdata_t *sdata = ckp->sdata;
 
-	/* Check failures that may be inconclusive but were submitted via other
-	 * means or accepted due to precious block call. */
-	if (!ret) {
-		/* If the block is accepted locally, it means we may have
-		 * displaced a known block, and are now working on this fork.
-		 * This makes the most sense since if we solve the next block,
-		 * it validates this one as the best chain, orphaning the other
-		 * block. In the case of mainnet, it means we have found a stale
-		 * block and are trying to force ours ahead of the other. In
-		 * a low diff environment we may have successive blocks, and
-		 * this will be the last one solved locally. Trying to optimise
-		 * regtest/testnet will optimise against the mainnet case. */
-		if (generator_get_blockhash(ckp, height, heighthash)) {
-			ret = !strncmp(rhash, heighthash, 64);
-			LOGWARNING("Hash for forced possibly stale block, height %d confirms block was %s",
-				   height, ret ? "ACCEPTED" : "REJECTED");
-		}
-	}
-	return ret;
+	return stratcore_submit_block(&sdata->core, gbt_block, flip32, height);
 }
 
 static workbase_t *get_workbase(sdata_t *sdata, const int64_t id)
@@ -2017,7 +2017,7 @@ static void put_workbase(sdata_t *sdata, workbase_t *wb)
 #define put_remote_workbase(sdata, wb) put_workbase(sdata, wb)
 
 static void block_solve(ckpool_t *ckp, json_t *val);
-static void block_reject(json_t *val);
+static void block_reject(ckpool_t *ckp, json_t *val);
 
 static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 {
@@ -2095,11 +2095,12 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 		hex2bin(enonce1bin, enonce1, enonce1len);
 		coinbase = alloca(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len);
 		/* Fill in the hashes */
-		share_diff(coinbase, enonce1bin, wb, nonce2, ntime32, version_mask, nonce, hash, swap, &cblen);
+		stratcore_hash_diff(coinbase, enonce1bin, wb, wb->coinb2bin, wb->coinb2len, nonce2,
+				    ntime32, version_mask, nonce, hash, swap, &cblen);
 	}
 
 	/* Now we have enough to assemble a block */
-	gbt_block = process_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
+	gbt_block = stratcore_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
 	ret = local_block_submit(ckp, gbt_block, flip32, wb->height);
 
 	JSON_CPACK(bval, "{si,ss,ss,sI,ss,ss,si,ss,sI,sf,ss,ss,ss,ss}",
@@ -2122,7 +2123,7 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 	if (ret)
 		block_solve(ckp, bval);
 	else
-		block_reject(bval);
+		block_reject(ckp, bval);
 
 	json_decref(bval);
 out:
@@ -2131,9 +2132,10 @@ out:
 	free(enonce1);
 }
 
-static void update_base(sdata_t *sdata, const int prio)
+static void update_base(sdata_t *sdata, const int prio, const int source)
 {
-	int *uprio;
+	int64_t requested = lat_now();
+	update_req_t *ureq;
 
 	/* All uses of block_update are serialised so if we have more
 	 * update_base calls waiting there is no point servicing them unless
@@ -2148,9 +2150,74 @@ static void update_base(sdata_t *sdata, const int prio)
 	} else
 		cksem_wait(&sdata->update_sem);
 
-	uprio = ckalloc(sizeof(int));
-	*uprio = prio;
-	ckmsgq_add(sdata->updateq, uprio);
+	ureq = ckalloc(sizeof(update_req_t));
+	ureq->prio = prio;
+	ureq->source = source;
+	ureq->requested = requested;
+	ckmsgq_add(sdata->updateq, ureq);
+}
+
+/* Intern the client's normalised useragent into the persistent ua_map. Must
+ * be entered with the instance_lock held for writing. */
+static void __add_ua_client(sdata_t *sdata, stratum_instance_t *client)
+{
+	char normalized_ua[256];
+	const char *ua_key = get_normalized_ua_key(client->useragent, normalized_ua, sizeof(normalized_ua));
+	ua_item_t *ua_it;
+
+	HASH_FIND_STR(sdata->ua_map, ua_key, ua_it);
+	if (!ua_it) {
+		ua_it = ckzalloc(sizeof(ua_item_t));
+		ua_it->ua = strdup(ua_key);
+		HASH_ADD_STR(sdata->ua_map, ua, ua_it);
+	}
+	ua_it->count++;
+	DL_APPEND2(ua_it->clients, client, ua_prev, ua_next);
+
+	mutex_lock(&sdata->ua_lock);
+	ua_it->dsps5 += client->dsps5;
+	if (client->best_diff > ua_it->best_diff)
+		ua_it->best_diff = client->best_diff;
+	client->ua_item = ua_it;
+	mutex_unlock(&sdata->ua_lock);
+}
+
+/* Intern the client's useragent unless it already has been */
+void add_ua_client(sdata_t *sdata, stratum_instance_t *client)
+{
+	ck_wlock(&sdata->instance_lock);
+	if (!client->ua_item)
+		__add_ua_client(sdata, client);
+	ck_wunlock(&sdata->instance_lock);
+}
+
+/* Remove the client's contribution to its interned useragent, recalculating
+ * the best diff from the remaining clients only if this client held it. Must
+ * be entered with the instance_lock held for writing. */
+static void __del_ua_client(sdata_t *sdata, stratum_instance_t *client)
+{
+	ua_item_t *ua_it = client->ua_item;
+	stratum_instance_t *tmp;
+
+	DL_DELETE2(ua_it->clients, client, ua_prev, ua_next);
+
+	mutex_lock(&sdata->ua_lock);
+	client->ua_item = NULL;
+	ua_it->dsps5 -= client->dsps5;
+	if (ua_it->best_diff && client->best_diff >= ua_it->best_diff) {
+		ua_it->best_diff = 0;
+		DL_FOREACH2(ua_it->clients, tmp, ua_next) {
+			if (tmp->best_diff > ua_it->best_diff)
+				ua_it->best_diff = tmp->best_diff;
+		}
+	}
+	mutex_unlock(&sdata->ua_lock);
+
+	if (--ua_it->count <= 0) {
+		HASH_DEL(sdata->ua_map, ua_it);
+		dealloc(ua_it->ua);
+		dealloc(ua_it);
+	}
 }
 
 /* Instead of removing the client instance, we add it to a list of recycled
@@ -2161,6 +2228,10 @@ static void __kill_instance(sdata_t *sdata, stratum_instance_t *client)
 		client->proxy->bound_clients--;
 		client->proxy->parent->combined_clients--;
 	}
+	/* Clients killed without being dropped first, such as by
+	 * drop_allclients, still need removing from the UA map */
+	if (client->ua_item)
+		__del_ua_client(sdata, client);
 	free(client->workername);
 	free(client->password);
 	free(client->useragent);
@@ -2241,11 +2312,14 @@ static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *clien
 
 /* Removes a client instance we know is on the stratum_instances list and from
  * the user client list if it's been placed on it */
+static void __del_enonce1_client(sdata_t *sdata, stratum_instance_t *client);
+
 static void __del_client(sdata_t *sdata, stratum_instance_t *client)
 {
 	user_instance_t *user = client->user_instance;
 
 	HASH_DEL(sdata->stratum_instances, client);
+	__del_enonce1_client(sdata, client);
 	if (user) {
 		DL_DELETE2(user->clients, client, user_prev, user_next );
 		__dec_worker(sdata, user, client->worker_instance);
@@ -2288,10 +2362,106 @@ static void drop_allclients(ckpool_t *ckp)
 		LOGNOTICE("Dropped %d instances for dropall request", kills);
 }
 
+static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
+			     const int msg_type);
+
+static bool core_submitblock(void *arg, const char *gbt_block)
+{
+	sdata_t *sdata = arg;
+
+	return generator_submitblock(sdata->ckp, gbt_block);
+}
+
+static void core_preciousblock(void *arg, const char *hash)
+{
+	sdata_t *sdata = arg;
+
+	generator_preciousblock(sdata->ckp, hash);
+}
+
+static bool core_get_blockhash(void *arg, int height, char *hash)
+{
+	sdata_t *sdata = arg;
+
+	return generator_get_blockhash(sdata->ckp, height, hash);
+}
+
+static void core_send(void *arg, json_t *val, const int64_t client_id, const int msg_type)
+{
+	stratum_add_send(arg, val, client_id, msg_type);
+}
+
+/* Entered with instance_lock held */
+static const uchar *core_user_coinb2(void __maybe_unused *arg, void *user, const workbase_t *wb,
+				     int *cb2len)
+{
+	user_instance_t *instance = user;
+	struct userwb *userwb;
+	int64_t id = wb->id;
+
+	HASH_FIND_I64(instance->userwbs, &id, userwb);
+	if (unlikely(!userwb))
+		return NULL;
+	*cb2len = userwb->coinb2len;
+	return userwb->coinb2bin;
+}
+
+static void core_retarget(void *arg, void *vclient, const double diff, tv_t *now_t,
+			  const double network_diff, const int64_t next_blockid,
+			  const int64_t current_blockid);
+static void submit_share(stratum_instance_t *client, const int64_t jobid, const char *nonce2,
+			 const char *ntime, const char *nonce);
+
+static void core_upstream_share(void __maybe_unused *arg, void *client,
+				const stratcore_share_t *share)
+{
+	char hexhash[68], sharehash[32];
+
+	bswap_256(sharehash, share->hash);
+	__bin2hex(hexhash, sharehash, 32);
+	LOGINFO("Submitting share upstream: %s", hexhash);
+	submit_share(client, share->id, share->nonce2, share->ntime, share->nonce);
+}
+
+static void core_upstream(void *arg, json_t *val, const int msg_type)
+{
+	sdata_t *sdata = arg;
+
+	upstream_json_msgtype(sdata->ckp, val, msg_type);
+}
+
+/* Point the stratcore at the pool settings and this sdata's generator and
+ * send queue, leaving the clock as realtime */
+static void init_stratcore(ckpool_t *ckp, sdata_t *sdata)
+{
+	stratcore_t *sc = &sdata->core;
+
+	sc->nonce1length = ckp->nonce1length;
+	sc->nonce2length = ckp->nonce2length;
+	sc->version_mask = ckp->version_mask;
+	sc->btcsig = ckp->btcsig;
+	sc->btcsolo = ckp->btcsolo;
+	sc->donation = ckp->donation;
+	sc->txnbin = sdata->txnbin;
+	sc->txnlen = sdata->txnlen;
+	sc->dontxnbin = sdata->dontxnbin;
+	sc->dontxnlen = sdata->dontxnlen;
+	sc->submitblock = core_submitblock;
+	sc->preciousblock = core_preciousblock;
+	sc->get_blockhash = core_get_blockhash;
+	sc->send = core_send;
+	sc->user_coinb2 = core_user_coinb2;
+	sc->retarget = core_retarget;
+	sc->upstream_share = core_upstream_share;
+	sc->upstream = core_upstream;
+	sc->arg = sdata;
+	sdata->path = stratcore_path(stratcore_mode(ckp));
+}
+
 /* Copy only the relevant parts of the master sdata for each subproxy */
 static sdata_t *duplicate_sdata(const sdata_t *sdata)
 {
-	sdata_t *dsdata = ckzalloc(sizeof(sdata_t));
+	sdata_t *dsdata = ckzalloc_aligned(__alignof__(sdata_t), sizeof(sdata_t));
 
 	dsdata->ckp = sdata->ckp;
 
@@ -2305,6 +2475,8 @@ static sdata_t *duplicate_sdata(const sdata_t *sdata)
 	dsdata->sshareq = sdata->sshareq;
 	dsdata->sauthq = sdata->sauthq;
 	dsdata->stxnq = sdata->stxnq;
+	dsdata->smoveq = sdata->smoveq;
+	init_stratcore(dsdata->ckp, dsdata);
 
 	/* Give the sbuproxy its own workbase list and lock */
 	cklock_init(&dsdata->workbase_lock);
@@ -2537,6 +2709,26 @@ static int64_t best_userproxy_headroom(sdata_t *sdata, const int userid)
 
 static void reconnect_client(sdata_t *sdata, stratum_instance_t *client);
 
+/* Move clients that sent mining.extranonce.subscribe off their proxy with
+ * mining.set_extranonce instead of reconnecting them. Queued since this is
+ * called holding instance_lock. */
+static void rebind_client(sdata_t *sdata, stratum_instance_t *client)
+{
+	int64_t *client_id;
+
+	if (!client->extranonce_subscribe) {
+		reconnect_client(sdata, client);
+		return;
+	}
+	/* Already queued? */
+	if (client->extranonce_move)
+		return;
+	client->extranonce_move = true;
+	client_id = ckalloc(sizeof(int64_t));
+	*client_id = client->id;
+	ckmsgq_add(sdata->smoveq, client_id);
+}
+
 static void generator_recruit(ckpool_t *ckp, const int proxyid, const int recruits)
 {
 	char buf[256];
@@ -2578,7 +2770,7 @@ static void reconnect_global_clients(sdata_t *sdata)
 		if (headroom-- < 1)
 			continue;
 		reconnects++;
-		reconnect_client(sdata, client);
+		rebind_client(sdata, client);
 	}
 	ck_runlock(&sdata->instance_lock);
 
@@ -2628,8 +2820,13 @@ static void check_bestproxy(sdata_t *sdata)
 	}
 	mutex_unlock(&sdata->proxy_lock);
 
-	if (changed_id != -1)
+	if (changed_id != -1) {
+		json_t *val;
+
 		LOGNOTICE("Stratifier setting active proxy to %d", changed_id);
+		JSON_CPACK(val, "{si}", "current", changed_id);
+		pool_event(sdata->ckp, POOL_EV_PROXY, NULL, NULL, val);
+	}
 }
 
 static proxy_t *best_proxy(sdata_t *sdata)
@@ -2689,7 +2886,7 @@ static void dead_proxyid(sdata_t *sdata, const int id, const int subid, const bo
 			continue;
 		}
 		reconnects++;
-		reconnect_client(sdata, client);
+		rebind_client(sdata, client);
 	}
 	ck_runlock(&sdata->instance_lock);
 
@@ -2863,7 +3060,7 @@ static void check_userproxies(sdata_t *sdata, proxy_t *proxy, const int userid)
 		if (headroom-- < 1)
 			continue;
 		reconnects++;
-		reconnect_client(sdata, client);
+		rebind_client(sdata, client);
 	}
 	ck_runlock(&sdata->instance_lock);
 
@@ -2880,7 +3077,6 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	sdata_t *sdata = ckp->sdata, *dsdata;
 	bool new_block = false, clean;
 	int i, id = 0, subid = 0;
-	char header[272];
 	const char *buf;
 	proxy_t *proxy;
 	workbase_t *wb;
@@ -2935,15 +3131,7 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	sscanf(wb->ntime, "%x", &wb->ntime32);
 	clean = json_is_true(json_object_get(val, "clean"));
 	ts_realtime(&wb->gentime);
-	snprintf(header, 270, "%s%s%s%s%s%s%s",
-		 wb->bbversion, wb->prevhash,
-		 "0000000000000000000000000000000000000000000000000000000000000000",
-		 wb->ntime, wb->nbit,
-		 "00000000", /* nonce */
-		 workpadding);
-	header[224] = 0;
-	LOGDEBUG("Header: %s", header);
-	hex2bin(wb->headerbin, header, 112);
+	stratcore_header(wb);
 	wb->txn_hashes = ckzalloc(1);
 
 	dsdata = proxy->sdata;
@@ -2958,6 +3146,8 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	ck_runlock(&dsdata->workbase_lock);
 
 	add_base(ckp, dsdata, wb, &new_block);
+	if (unlikely(capture_enabled))
+		capture_template(wb, new_block);
 	if (new_block) {
 		if (subid)
 			LOGINFO("Block hash on proxy %d:%d changed to %s", id, subid, dsdata->lastswaphash);
@@ -2969,7 +3159,7 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	clean |= new_block;
 	LOGINFO("Proxy %d:%d broadcast updated stratum notify with%s clean", id,
 		subid, clean ? "" : "out");
-	stratum_broadcast_update(dsdata, wb, clean);
+	stratum_broadcast_update(dsdata, wb, clean, 0);
 out:
 	json_decref(val);
 }
@@ -3174,29 +3364,15 @@ static void __drop_client(sdata_t *sdata, stratum_instance_t *client, bool lazil
 	user_instance_t *user = client->user_instance;
 
 	/* Remove client UA from persistent tracking (only if it was successfully subscribed/added) */
-	if (client->subscribed && client->useragent && client->useragent[0]) {
-		/* Normalize UA to match what was added in parse_subscribe */
-		char normalized_ua[256];
-		const char *ua_key = get_normalized_ua_key(client->useragent, normalized_ua, sizeof(normalized_ua));
-		
-		ua_item_t *ua_it_find = NULL;
-		HASH_FIND_STR(sdata->ua_map, ua_key, ua_it_find);
-		if (ua_it_find) {
-			ua_it_find->count--;
-			if (ua_it_find->count <= 0) {
-				HASH_DEL(sdata->ua_map, ua_it_find);
-				dealloc(ua_it_find->ua);
-				dealloc(ua_it_find);
-			}
-		}
-	}
+	if (client->ua_item)
+		__del_ua_client(sdata, client);
 
 	if (unlikely(client->node))
 		DL_DELETE2(sdata->node_instances, client, node_prev, node_next);
 	else if (unlikely(client->trusted))
 		DL_DELETE2(sdata->remote_instances, client, remote_prev, remote_next);
 
-	if (client->workername) {
+	if (client->workername && msg) {
 		if (user) {
 			/* No message anywhere if throttled, too much flood and
 			 * these only can be LOGNOTICE messages.
@@ -3212,7 +3388,8 @@ static void __drop_client(sdata_t *sdata, stratum_instance_t *client, bool lazil
 				 lazily ? "lazily" : "");
 		}
 	} else {
-		/* Workerless client. Too noisy to log them all */
+		/* Workerless client. Too noisy to log them all. Callers that
+		 * don't want the message at all pass a NULL msg. */
 	}
 	__del_client(sdata, client);
 	__kill_instance(sdata, client);
@@ -3340,6 +3517,18 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 	return client;
 }
 
+/* Add an instance for a client id not seen before */
+stratum_instance_t *stratum_add_instance(ckpool_t *ckp, int64_t id, const char *address, int server)
+{
+	sdata_t *sdata = ckp->sdata;
+	stratum_instance_t *client;
+
+	ck_wlock(&sdata->instance_lock);
+	client = __stratum_add_instance(ckp, id, address, server);
+	ck_wunlock(&sdata->instance_lock);
+	return client;
+}
+
 static uint64_t disconnected_sessionid_exists(sdata_t *sdata, const int session_id,
 					      const int64_t id)
 {
@@ -3388,7 +3577,7 @@ static void connector_test_client(ckpool_t *ckp, const int64_t id)
 /* For creating a list of sends without locking that can then be concatenated
  * to the stratum_sends list. Minimises locking and avoids taking recursive
  * locks. Sends only to sdata bound clients (everyone in ckpool) */
-static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
+static int stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 {
 	ckpool_t *ckp = sdata->ckp;
 	sdata_t *ckp_sdata = ckp->sdata;
@@ -3398,12 +3587,12 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 
 	if (unlikely(!val)) {
 		LOGERR("Sent null json to stratum_broadcast");
-		return;
+		return 0;
 	}
 
 	if (ckp->node) {
 		json_decref(val);
-		return;
+		return 0;
 	}
 
 	ck_rlock(&ckp_sdata->instance_lock);
@@ -3437,6 +3626,7 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 
 	if (likely(bulk_send))
 		ssend_bulk_append(sdata, bulk_send, messages);
+	return messages;
 }
 
 static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
@@ -3553,6 +3743,7 @@ static void reset_bestshares(sdata_t *sdata)
 {
 	user_instance_t *user, *tmpuser;
 	stratum_instance_t *client, *tmp;
+	ua_item_t *ua_it, *ua_tmp;
 
 	/* Can do this unlocked since it's just zeroing the values */
 	sdata->stats.accounted_diff_shares =
@@ -3566,6 +3757,11 @@ static void reset_bestshares(sdata_t *sdata)
 	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
 		client->best_diff = 0;
 	}
+	mutex_lock(&sdata->ua_lock);
+	HASH_ITER(hh, sdata->ua_map, ua_it, ua_tmp) {
+		ua_it->best_diff = 0;
+	}
+	mutex_unlock(&sdata->ua_lock);
 	HASH_ITER(hh, sdata->user_instances, user, tmpuser) {
 		worker_instance_t *worker;
 
@@ -3577,8 +3773,6 @@ static void reset_bestshares(sdata_t *sdata)
 	ck_runlock(&sdata->instance_lock);
 }
 
-static user_instance_t *get_user(sdata_t *sdata, const char *username);
-
 static user_instance_t *user_by_workername(sdata_t *sdata, const char *workername)
 {
 	char *username = strdupa(workername), *ignore;
@@ -3592,8 +3786,6 @@ static user_instance_t *user_by_workername(sdata_t *sdata, const char *workernam
 	return user;
 }
 
-static worker_instance_t *get_worker(sdata_t *sdata, user_instance_t *user, const char *workername);
-
 static json_t *worker_stats(const worker_instance_t *worker)
 {
 	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
@@ -3707,6 +3899,9 @@ static void block_solve(ckpool_t *ckp, json_t *val)
 	json_get_int(&height, val, "height");
 	json_get_double(&diff, val, "diff");
 	json_get_string(&workername, val, "workername");
+	CKPROBE2(block_solve, height, workername);
+	pool_event(ckp, POOL_EV_BLOCK_SOLVE, json_string_value(json_object_get(val, "username")),
+		   workername, json_deep_copy(val));
 
 	if (!workername) {
 		ASPRINTF(&msg, "Block solved by %s!", ckp->name);
@@ -3745,11 +3940,13 @@ static void block_solve(ckpool_t *ckp, json_t *val)
 	reset_bestshares(sdata);
 }
 
-static void block_reject(json_t *val)
+static void block_reject(ckpool_t *ckp, json_t *val)
 {
 	int height = 0;
 
 	json_get_int(&height, val, "height");
+	pool_event(ckp, POOL_EV_BLOCK_REJECT, json_string_value(json_object_get(val, "username")),
+		   json_string_value(json_object_get(val, "workername")), json_deep_copy(val));
 
 	LOGWARNING("Submitted, but had block %d rejected", height);
 }
@@ -3769,20 +3966,62 @@ static void broadcast_ping(sdata_t *sdata)
 	stratum_broadcast(sdata, json_msg, SM_PING);
 }
 
-static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
+/* Add the stratifier's message queue summaries */
+void stratifier_queues(ckpool_t *ckp, json_t *val, const int reader)
 {
-	int64_t memsize, generated;
-	ckmsg_t *msg;
-	int objects;
-
-	mutex_lock(ckmsgq->lock);
-	DL_COUNT(ckmsgq->msgs, msg, objects);
-	generated = ckmsgq->messages;
-	mutex_unlock(ckmsgq->lock);
+	sdata_t *sdata = ckp->sdata;
+	json_t *subval;
 
-	memsize = (sizeof(ckmsg_t) + size) * objects;
-	JSON_CPACK(*val, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
-}
+	/* Not started yet */
+	if (unlikely(!sdata || !sdata->srecvs))
+		return;
+	ckmsgq_stats(sdata->ssends, sizeof(smsg_t), &subval, reader);
+	json_set_object(val, "ssends", subval);
+	/* Don't know exactly how big the string is so just count the pointer for now */
+	ckmsgq_stats(sdata->srecvs, sizeof(char *), &subval, reader);
+	json_set_object(val, "srecvs", subval);
+	ckmsgq_stats(sdata->sshareq, sizeof(json_params_t), &subval, reader);
+	json_set_object(val, "sshareq", subval);
+	ckmsgq_stats(sdata->sauthq, sizeof(json_params_t), &subval, reader);
+	json_set_object(val, "sauthq", subval);
+	ckmsgq_stats(sdata->stxnq, sizeof(json_params_t), &subval, reader);
+	json_set_object(val, "stxnq", subval);
+	ckmsgq_stats(sdata->smoveq, sizeof(int64_t), &subval, reader);
+	json_set_object(val, "smoveq", subval);
+	ckmsgq_stats(sdata->updateq, sizeof(update_req_t), &subval, reader);
+	json_set_object(val, "updateq", subval);
+}
+
+/* Add the per stage share latency summaries measured by the stratifier */
+static void stratifier_latency(sdata_t *sdata, json_t *val)
+{
+	int i;
+
+	for (i = 0; i < SLAT_STAGES; i++)
+		json_set_object(val, slat_names[i], lat_hist_json(&sdata->share_lat[i]));
+}
+
+/* Sizes and phase times in milliseconds of the last statsupdate pass */
+static json_t *stats_timing_json(sdata_t *sdata)
+{
+	json_t *val, *subval = json_object();
+	stats_timing_t st;
+	int i;
+
+	mutex_lock(&sdata->stats_lock);
+	st = sdata->stats_timing;
+	mutex_unlock(&sdata->stats_lock);
+
+	JSON_CPACK(val, "{si,si,si,sf}", "clients", st.clients, "users", st.users,
+		   "workers", st.workers, "total_ms", st.total / 1e6);
+	for (i = 0; i < SP_PHASES; i++)
+		json_set_double(subval, stats_phase_names[i], st.phase[i] / 1e6);
+	json_set_object(val, "phase_ms", subval);
+	JSON_CPACK(subval, "{si,sf,sf}", "count", st.wlocks, "total_ms", st.wlock_total / 1e6,
+		   "max_ms", st.wlock_max / 1e6);
+	json_set_object(val, "wlock", subval);
+	return val;
+}
 
 char *stratifier_stats(ckpool_t *ckp, void *data)
 {
@@ -3858,13 +4097,14 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	json_set_object(val, "transactions", subval);
 	ck_runlock(&sdata->txn_lock);
 
-	ckmsgq_stats(sdata->ssends, sizeof(smsg_t), &subval);
-	json_set_object(val, "ssends", subval);
-	/* Don't know exactly how big the string is so just count the pointer for now */
-	ckmsgq_stats(sdata->srecvs, sizeof(char *), &subval);
-	json_set_object(val, "srecvs", subval);
-	ckmsgq_stats(sdata->stxnq, sizeof(json_params_t), &subval);
-	json_set_object(val, "stxnq", subval);
+	stratifier_queues(ckp, val, QREAD_PROCSTATS);
+
+	if (ckp->latencysample) {
+		subval = json_object();
+		stratifier_latency(sdata, subval);
+		json_set_object(val, "latency", subval);
+	}
+	json_set_object(val, "statsupdate", stats_timing_json(sdata));
 
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
@@ -3872,6 +4112,87 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	return buf;
 }
 
+static void queue_metric(metrics_buf_t *mb, const char *queue, ckmsgq_t *ckmsgq)
+{
+	char labels[32];
+
+	snprintf(labels, 32, "queue=\"%s\"", queue);
+	metrics_value(mb, "ckpool_stratifier_queue_depth", labels, ckmsgq_count(ckmsgq));
+}
+
+/* Render the stratifier metrics. Only the stats_lock and the queue locks are
+ * taken here; user and worker gauges are served from the copy published by
+ * statsupdate so scraping never contends with the instance_lock. */
+void stratifier_metrics(ckpool_t *ckp, metrics_buf_t *mb)
+{
+	sdata_t *sdata = ckp->sdata;
+	pool_stats_t stats;
+	char labels[64];
+	int i;
+
+	mutex_lock(&sdata->stats_lock);
+	memcpy(&stats, &sdata->stats, sizeof(pool_stats_t));
+	mutex_unlock(&sdata->stats_lock);
+
+	metrics_header(mb, "ckpool_pool_users", "gauge", "Users with active workers");
+	metrics_value(mb, "ckpool_pool_users", NULL, stats.users + stats.remote_users);
+	metrics_header(mb, "ckpool_pool_workers", "gauge", "Active workers");
+	metrics_value(mb, "ckpool_pool_workers", NULL, stats.workers + stats.remote_workers);
+	metrics_header(mb, "ckpool_pool_disconnected", "gauge", "Disconnected workers");
+	metrics_value(mb, "ckpool_pool_disconnected", NULL, stats.disconnected);
+	metrics_header(mb, "ckpool_pool_hashrate", "gauge", "Pool hashrate in hashes per second");
+	metrics_value(mb, "ckpool_pool_hashrate", "window=\"1m\"", stats.dsps1 * nonces);
+	metrics_value(mb, "ckpool_pool_hashrate", "window=\"5m\"", stats.dsps5 * nonces);
+	metrics_value(mb, "ckpool_pool_hashrate", "window=\"15m\"", stats.dsps15 * nonces);
+	metrics_value(mb, "ckpool_pool_hashrate", "window=\"1h\"", stats.dsps60 * nonces);
+	metrics_value(mb, "ckpool_pool_hashrate", "window=\"6h\"", stats.dsps360 * nonces);
+	metrics_value(mb, "ckpool_pool_hashrate", "window=\"1d\"", stats.dsps1440 * nonces);
+	metrics_value(mb, "ckpool_pool_hashrate", "window=\"7d\"", stats.dsps10080 * nonces);
+	metrics_header(mb, "ckpool_pool_shares_per_second", "gauge", "Pool shares per second");
+	metrics_value(mb, "ckpool_pool_shares_per_second", "window=\"1m\"", stats.sps1);
+	metrics_value(mb, "ckpool_pool_shares_per_second", "window=\"5m\"", stats.sps5);
+	metrics_value(mb, "ckpool_pool_shares_per_second", "window=\"15m\"", stats.sps15);
+	metrics_value(mb, "ckpool_pool_shares_per_second", "window=\"1h\"", stats.sps60);
+	metrics_header(mb, "ckpool_pool_best_share", "gauge", "Best share diff this round");
+	metrics_value(mb, "ckpool_pool_best_share", NULL, stats.best_diff);
+	metrics_header(mb, "ckpool_network_difficulty", "gauge", "Current network difficulty");
+	metrics_value(mb, "ckpool_network_difficulty", NULL, stats.network_diff);
+
+	metrics_header(mb, "ckpool_shares_accepted_total", "counter", "Accepted shares");
+	metrics_counter(mb, "ckpool_shares_accepted_total", NULL, &sdata->share_results[SHARE_RESULT_IDX(SE_NONE)]);
+	metrics_header(mb, "ckpool_shares_rejected_total", "counter", "Rejected shares by reason");
+	for (i = SE_INVALID_NONCE2; i <= SE_INVALID_VERSION_MASK; i++) {
+		if (i == SE_NONE)
+			continue;
+		snprintf(labels, 64, "reason=\"%s\"", SHARE_ERR(i));
+		metrics_counter(mb, "ckpool_shares_rejected_total", labels, &sdata->share_results[SHARE_RESULT_IDX(i)]);
+	}
+
+	metrics_header(mb, "ckpool_share_queue_seconds", "histogram",
+		       "Time shares wait for a share processing thread");
+	metrics_slothist(mb, "ckpool_share_queue_seconds", NULL, &sdata->share_wait);
+	metrics_header(mb, "ckpool_share_latency_seconds", "histogram",
+		       "Time from share receipt to result being queued to the miner");
+	metrics_slothist(mb, "ckpool_share_latency_seconds", NULL, &sdata->share_latency);
+	metrics_header(mb, "ckpool_template_update_seconds", "histogram",
+		       "Time to fetch, build and broadcast a new block template");
+	metrics_hist(mb, "ckpool_template_update_seconds", NULL, &sdata->update_latency);
+
+	metrics_header(mb, "ckpool_stratifier_queue_depth", "gauge", "Messages waiting on stratifier queues");
+	queue_metric(mb, "updater", sdata->updateq);
+	queue_metric(mb, "ssends", sdata->ssends);
+	queue_metric(mb, "srecvs", sdata->srecvs);
+	queue_metric(mb, "sshareq", sdata->sshareq);
+	queue_metric(mb, "sauthq", sdata->sauthq);
+	queue_metric(mb, "stxnq", sdata->stxnq);
+	queue_metric(mb, "smoveq", sdata->smoveq);
+
+	mutex_lock(&sdata->metrics_lock);
+	if (sdata->user_metrics)
+		metrics_printf(mb, "%s", sdata->user_metrics);
+	mutex_unlock(&sdata->metrics_lock);
+}
+
 /* Send a single client a reconnect request, setting the time we sent the
  * request so we can drop the client lazily if it hasn't reconnected on its
  * own more than one minute later if we call reconnect again */
@@ -4441,6 +4762,21 @@ static void get_uptime(sdata_t *sdata, int *sockd)
 	send_api_response(val, *sockd);
 }
 
+/* Recent block change traces, newest first */
+static void get_blocktraces(sdata_t *sdata, int *sockd)
+{
+	json_t *val = json_object(), *arr_val = json_array();
+	int64_t id;
+
+	mutex_lock(&sdata->block_trace_lock);
+	for (id = sdata->block_trace_id; id > 0 && id > sdata->block_trace_id - BLOCK_TRACES; id--)
+		json_array_append_new(arr_val, block_trace_json(&sdata->block_traces[id % BLOCK_TRACES]));
+	mutex_unlock(&sdata->block_trace_lock);
+
+	json_set_object(val, "blocktraces", arr_val);
+	send_api_response(val, *sockd);
+}
+
 static void stratum_loop(ckpool_t *ckp, proc_instance_t *pi)
 {
 	sdata_t *sdata = ckp->sdata;
@@ -4464,7 +4800,7 @@ retry:
 			if (!ckp->proxy) {
 				LOGDEBUG("%ds elapsed in strat_loop, updating gbt base",
 					 ckp->update_interval);
-				update_base(sdata, GEN_NORMAL);
+				update_base(sdata, GEN_NORMAL, UPDATE_POLL);
 			} else if (!ckp->passthrough) {
 				LOGDEBUG("%ds elapsed in strat_loop, pinging miners",
 					 ckp->update_interval);
@@ -4554,6 +4890,10 @@ retry:
 		get_uptime(sdata, &umsg->sockd);
 		goto retry;
 	}
+	if (cmdmatch(buf, "blocktraces")) {
+		get_blocktraces(sdata, &umsg->sockd);
+		goto retry;
+	}
 	if (cmdmatch(buf, "wcinfo")) {
 		worker_clientinfo(sdata, buf + 7, &umsg->sockd);
 		goto retry;
@@ -4561,7 +4901,7 @@ retry:
 
 	LOGDEBUG("Stratifier received request: %s", buf);
 	if (cmdmatch(buf, "update")) {
-		update_base(sdata, GEN_PRIORITY);
+		update_base(sdata, GEN_PRIORITY, UPDATE_NOTIFY);
 	} else if (cmdmatch(buf, "subscribe")) {
 		/* Proxifier has a new subscription */
 		update_subscribe(ckp, buf);
@@ -4622,7 +4962,7 @@ static void *blockupdate(void *arg)
 				break;
 			case GETBEST_SUCCESS:
 				if (strcmp(hash, sdata->lastswaphash)) {
-					update_base(sdata, GEN_PRIORITY);
+					update_base(sdata, GEN_PRIORITY, UPDATE_GETBEST);
 					break;
 				}
 				[[fallthrough]];
@@ -4634,27 +4974,93 @@ static void *blockupdate(void *arg)
 	return NULL;
 }
 
-/* Enter holding workbase_lock and client a ref count. */
-static void __fill_enonce1data(const workbase_t *wb, stratum_instance_t *client)
+/* Fill in the enonce1 for enonce1_64 on wb. Enter holding workbase_lock. */
+static void __fill_enonce1data(const workbase_t *wb, const uint64_t *enonce1_64, uchar *enonce1bin,
+			       char *enonce1var, char *enonce1)
 {
 	if (wb->enonce1constlen)
-		memcpy(client->enonce1bin, wb->enonce1constbin, wb->enonce1constlen);
+		memcpy(enonce1bin, wb->enonce1constbin, wb->enonce1constlen);
 	if (wb->enonce1varlen) {
-		memcpy(client->enonce1bin + wb->enonce1constlen, &client->enonce1_64, wb->enonce1varlen);
-		__bin2hex(client->enonce1var, &client->enonce1_64, wb->enonce1varlen);
+		memcpy(enonce1bin + wb->enonce1constlen, enonce1_64, wb->enonce1varlen);
+		__bin2hex(enonce1var, enonce1_64, wb->enonce1varlen);
 	}
-	__bin2hex(client->enonce1, client->enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
+	__bin2hex(enonce1, enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
+}
+
+/* How many values past a wrapped enonce1_64 to try for one not in use before
+ * rejecting a client */
+#define ENONCE1_PROBES 64
+
+/* Whether the enonce1_64 counter has gone round the nonce1length bytes of it
+ * clients get, after which a new or resumed enonce1 may already be in use.
+ * Proxies never wrap since they reject clients past max_clients instead. */
+static bool enonce1_wrapped(const ckpool_t *ckp, const uint64_t enonce1)
+{
+	if (ckp->proxy || ckp->nonce1length >= 8)
+		return false;
+	return enonce1 >> (ckp->nonce1length * 8);
+}
+
+/* The bytes of enonce1_64 clients get, which enonce1_instances is keyed on */
+static uint64_t enonce1_key(const ckpool_t *ckp, const uint64_t enonce1)
+{
+	if (ckp->nonce1length >= 8)
+		return enonce1;
+	return enonce1 & ((1ULL << (ckp->nonce1length * 8)) - 1);
+}
+
+/* Enter holding instance_lock */
+static void __del_enonce1_client(sdata_t *sdata, stratum_instance_t *client)
+{
+	stratum_instance_t *owner;
+
+	/* A newer client may have taken the key over after this one dropped */
+	HASH_FIND(eh, sdata->enonce1_instances, &client->enonce1_key, sizeof(uint64_t), owner);
+	if (owner == client)
+		HASH_DELETE(eh, sdata->enonce1_instances, client);
+}
+
+/* Hash client by the enonce1 bytes it now has, taking them over from any
+ * dropped client that had them. Enter holding instance_lock. */
+static void __add_enonce1_client(const ckpool_t *ckp, sdata_t *ckp_sdata,
+				 stratum_instance_t *client)
+{
+	stratum_instance_t *old;
+
+	__del_enonce1_client(ckp_sdata, client);
+	client->enonce1_key = enonce1_key(ckp, le64toh(client->enonce1_64));
+	HASH_REPLACE(eh, ckp_sdata->enonce1_instances, enonce1_key, sizeof(uint64_t), client, old);
+}
+
+/* Find a live client other than client on sdata using enonce1 in the bytes
+ * clients get. Enter holding instance_lock. */
+static stratum_instance_t *__enonce1_client(const ckpool_t *ckp, sdata_t *ckp_sdata,
+					    const sdata_t *sdata, const stratum_instance_t *client,
+					    const uint64_t enonce1)
+{
+	const uint64_t key = enonce1_key(ckp, enonce1);
+	stratum_instance_t *other;
+
+	HASH_FIND(eh, ckp_sdata->enonce1_instances, &key, sizeof(uint64_t), other);
+	if (!other || other == client || other->dropped || other->sdata != sdata)
+		return NULL;
+	return other;
 }
 
 /* Create a new enonce1 from the 64 bit enonce1_64 value, using only the number
  * of bytes we have to work with when we are proxying with a split nonce2.
- * When the proxy space is less than 32 bits to work with, we look for an
- * unused enonce1 value and reject clients instead if there is no space left.
- * Needs to be entered with client holding a ref count. */
-static bool new_enonce1(ckpool_t *ckp, sdata_t *ckp_sdata, sdata_t *sdata, stratum_instance_t *client)
-{
+ * Once the space has wrapped, we look for an unused enonce1 value and reject
+ * clients instead if there is no space left. Shares on jobs up to last_job_id
+ * may still use the client's old enonce1, -1 for none. Needs to be entered
+ * with client holding a ref count. */
+static bool new_enonce1(ckpool_t *ckp, sdata_t *ckp_sdata, sdata_t *sdata, stratum_instance_t *client,
+			const int64_t last_job_id)
+{
+	char enonce1hex[36], enonce1var[20] = {};
+	uchar enonce1bin[16] = {};
 	proxy_t *proxy = NULL;
 	uint64_t enonce1;
+	int probes = 0;
 
 	if (ckp->proxy) {
 		if (!ckp_sdata->proxy)
@@ -4683,7 +5089,18 @@ static bool new_enonce1(ckpool_t *ckp, sdata_t *ckp_sdata, sdata_t *sdata, strat
 	ck_wlock(&ckp_sdata->instance_lock);
 	enonce1 = le64toh(ckp_sdata->enonce1_64);
 	enonce1++;
+	while (unlikely(enonce1_wrapped(ckp, enonce1)) &&
+	       __enonce1_client(ckp, ckp_sdata, sdata, client, enonce1)) {
+		if (++probes >= ENONCE1_PROBES) {
+			ckp_sdata->enonce1_64 = htole64(enonce1);
+			ck_wunlock(&ckp_sdata->instance_lock);
+			LOGWARNING("Failed to find an unused enonce1 in %d tries", probes);
+			return false;
+		}
+		enonce1++;
+	}
 	client->enonce1_64 = ckp_sdata->enonce1_64 = htole64(enonce1);
+	__add_enonce1_client(ckp, ckp_sdata, client);
 	if (proxy) {
 		client->proxy = proxy;
 		proxy->clients++;
@@ -4693,9 +5110,17 @@ static bool new_enonce1(ckpool_t *ckp, sdata_t *ckp_sdata, sdata_t *sdata, strat
 	ck_wunlock(&ckp_sdata->instance_lock);
 
 	ck_rlock(&sdata->workbase_lock);
-	__fill_enonce1data(sdata->current_workbase, client);
+	__fill_enonce1data(sdata->current_workbase, &client->enonce1_64, enonce1bin, enonce1var,
+			   enonce1hex);
 	ck_runlock(&sdata->workbase_lock);
 
+	/* Share threads hash with enonce1data so swap it in under the lock */
+	ck_wlock(&ckp_sdata->instance_lock);
+	stratcore_move_enonce1(&client->enonce1data, enonce1bin, last_job_id);
+	strcpy(client->enonce1var, enonce1var);
+	strcpy(client->enonce1, enonce1hex);
+	ck_wunlock(&ckp_sdata->instance_lock);
+
 	return true;
 }
 
@@ -4836,6 +5261,49 @@ out_unlock:
 	return ret;
 }
 
+static bool set_client_extranonce(sdata_t *sdata, stratum_instance_t *client);
+
+/* Once enonce1_64 has wrapped a resumed session's enonce1 may be in use by
+ * another client. Move that client to a fresh enonce1 if it sent
+ * mining.extranonce.subscribe, otherwise don't resume the old enonce1. Needs
+ * to be entered with client holding a ref count. */
+static bool resume_enonce1(ckpool_t *ckp, sdata_t *ckp_sdata, sdata_t *sdata,
+			   stratum_instance_t *client)
+{
+	stratum_instance_t *other;
+	bool ret = true;
+
+	ck_wlock(&ckp_sdata->instance_lock);
+	if (likely(!enonce1_wrapped(ckp, le64toh(ckp_sdata->enonce1_64))))
+		goto out_add;
+	other = __enonce1_client(ckp, ckp_sdata, sdata, client, le64toh(client->enonce1_64));
+	if (!other)
+		goto out_add;
+	if (!other->extranonce_subscribe) {
+		ret = false;
+		goto out_unlock;
+	}
+	__inc_instance_ref(other);
+	ck_wunlock(&ckp_sdata->instance_lock);
+
+	LOGINFO("Client %s resuming enonce1 %s in use by client %s, moving it",
+		client->identity, client->enonce1, other->identity);
+	ret = set_client_extranonce(sdata, other);
+	dec_instance_ref(ckp_sdata, other);
+	if (!ret)
+		return ret;
+	ck_wlock(&ckp_sdata->instance_lock);
+out_add:
+	__add_enonce1_client(ckp, ckp_sdata, client);
+out_unlock:
+	ck_wunlock(&ckp_sdata->instance_lock);
+	if (!ret) {
+		LOGINFO("Client %s not resuming enonce1 %s in use by another client",
+			client->identity, client->enonce1);
+	}
+	return ret;
+}
+
 /* Extranonce1 must be set here. Needs to be entered with client holding a ref
  * count. */
 static json_t *parse_subscribe(stratum_instance_t *client, const int64_t client_id, const json_t *params_val)
@@ -4904,11 +5372,15 @@ static json_t *parse_subscribe(stratum_instance_t *client, const int64_t client_
 		if (!ckp->proxy && session_id && !subclient(client_id)) {
 			if ((client->enonce1_64 = disconnected_sessionid_exists(sdata, session_id, client_id))) {
 				sprintf(client->enonce1, "%016lx", client->enonce1_64);
-				old_match = true;
 
+				/* Not subscribed yet so no shares hash with it */
 				ck_rlock(&ckp_sdata->workbase_lock);
-				__fill_enonce1data(sdata->current_workbase, client);
+				__fill_enonce1data(sdata->current_workbase, &client->enonce1_64,
+						   client->enonce1data.enonce1bin, client->enonce1var,
+						   client->enonce1);
 				ck_runlock(&ckp_sdata->workbase_lock);
+
+				old_match = resume_enonce1(ckp, ckp_sdata, sdata, client);
 			}
 		}
 	} else {
@@ -4960,7 +5432,7 @@ static json_t *parse_subscribe(stratum_instance_t *client, const int64_t client_
 
 	if (!old_match) {
 		/* Create a new extranonce1 based on a uint64_t pointer */
-		if (!new_enonce1(ckp, ckp_sdata, sdata, client)) {
+		if (!new_enonce1(ckp, ckp_sdata, sdata, client, -1)) {
 			stratum_send_message(sdata, client, "Pool full of clients");
 			client->reject = 3;
 			return json_string("proxy full");
@@ -4982,31 +5454,10 @@ static json_t *parse_subscribe(stratum_instance_t *client, const int64_t client_
 
 	client->subscribed = true;
 
-	/* Add client UA to persistent tracking (protected by instance_lock) */
-	if (client->useragent && client->useragent[0]) {
-		ck_wlock(&sdata->instance_lock);
-		/* Normalize UA to stable identifier (e.g., "cpuminer-multi" from "cpuminer-multi/1.3.7") */
-		char normalized_ua[256];
-		const char *ua_key = get_normalized_ua_key(client->useragent, normalized_ua, sizeof(normalized_ua));
-		
-		ua_item_t *ua_it_find = NULL;
-		HASH_FIND_STR(sdata->ua_map, ua_key, ua_it_find);
-		if (ua_it_find) {
-			ua_it_find->count++;
-		} else {
-			ua_item_t *ua_new = ckalloc(sizeof(ua_item_t));
-			ua_new->ua = strdup(ua_key);
-			if (ua_new->ua) {
-				ua_new->count = 1;
-				ua_new->dsps5 = 0;
-				ua_new->best_diff = 0;
-				HASH_ADD_STR(sdata->ua_map, ua, ua_new);
-			} else {
-				dealloc(ua_new);
-			}
-		}
-		ck_wunlock(&sdata->instance_lock);
-	}
+	/* Add client UA to persistent tracking. The UA map is always global,
+	 * even when the client is bound to a subproxy's sdata in proxy mode. */
+	if (client->useragent && client->useragent[0])
+		add_ua_client(ckp_sdata, client);
 
 	return ret;
 }
@@ -5065,7 +5516,19 @@ static void decay_client(stratum_instance_t *client, double diff, tv_t *now_t)
 	client->uadiff = 0;
 	decay_time(&client->dsps1, diff, tdiff, MIN1);
 	decay_time(&client->dsps15s, diff, tdiff, SEC15);
-	decay_time(&client->dsps5, diff, tdiff, MIN5);
+	if (client->ua_item) {
+		sdata_t *ckp_sdata = client->ckp->sdata;
+		double old_dsps5;
+
+		/* Keep the running per-UA hashrate in step with this client */
+		mutex_lock(&ckp_sdata->ua_lock);
+		old_dsps5 = client->dsps5;
+		decay_time(&client->dsps5, diff, tdiff, MIN5);
+		if (likely(client->ua_item))
+			client->ua_item->dsps5 += client->dsps5 - old_dsps5;
+		mutex_unlock(&ckp_sdata->ua_lock);
+	} else
+		decay_time(&client->dsps5, diff, tdiff, MIN5);
 	decay_time(&client->dsps60, diff, tdiff, HOUR);
 	decay_time(&client->dsps1440, diff, tdiff, DAY);
 	decay_time(&client->dsps10080, diff, tdiff, WEEK);
@@ -5300,7 +5763,7 @@ static user_instance_t *get_create_user(sdata_t *sdata, const char *username, bo
 	return user;
 }
 
-static user_instance_t *get_user(sdata_t *sdata, const char *username)
+user_instance_t *get_user(sdata_t *sdata, const char *username)
 {
 	bool dummy = false;
 
@@ -5351,13 +5814,28 @@ static worker_instance_t *get_create_worker(sdata_t *sdata, user_instance_t *use
 	return worker;
 }
 
-static worker_instance_t *get_worker(sdata_t *sdata, user_instance_t *user, const char *workername)
+worker_instance_t *get_worker(sdata_t *sdata, user_instance_t *user, const char *workername)
 {
 	bool dummy = false;
 
 	return get_create_worker(sdata, user, workername, &dummy);
 }
 
+/* Add the client to its user and its worker instance, which combines the data
+ * from workers of the same name */
+void add_client_worker(sdata_t *sdata, stratum_instance_t *client, user_instance_t *user,
+		       worker_instance_t *worker)
+{
+	ck_wlock(&sdata->instance_lock);
+	client->user_instance = user;
+	client->worker_instance = worker;
+	DL_APPEND2(user->clients, client, user_prev, user_next);
+	__inc_worker(sdata, user, worker);
+	/* Recalculate worker useragent based on current active instances */
+	recalc_worker_useragent(sdata, user, worker);
+	ck_wunlock(&sdata->instance_lock);
+}
+
 /* This simply strips off the first part of the workername and matches it to a
  * user or creates a new one. Needs to be entered with client holding a ref
  * count. */
@@ -5381,16 +5859,7 @@ static user_instance_t *generate_user(ckpool_t *ckp, stratum_instance_t *client,
 	user = get_create_user(sdata, username, &new_user);
 	worker = get_create_worker(sdata, user, workername, &new_worker);
 
-	/* Create one worker instance for combined data from workers of the
-	 * same name */
-	ck_wlock(&sdata->instance_lock);
-	client->user_instance = user;
-	client->worker_instance = worker;
-	DL_APPEND2(user->clients, client, user_prev, user_next);
-	__inc_worker(sdata, user, worker);
-	/* Recalculate worker useragent based on current active instances */
-	recalc_worker_useragent(sdata, user, worker);
-	ck_wunlock(&sdata->instance_lock);
+	add_client_worker(sdata, client, user, worker);
 
 	if (!ckp->proxy && (new_user || !user->btcaddress)) {
 		/* Is this a btc address based username? */
@@ -5731,14 +6200,81 @@ static void stratum_send_message(sdata_t *sdata, const stratum_instance_t *clien
 	stratum_add_send(sdata, json_msg, client->id, SM_MSG);
 }
 
-double time_bias(const double tdiff, const double period)
+/* The stratcore retarget hook called by the share paths of modes setting
+ * their own diff. Needs to be entered with client holding a ref count. */
+static void core_retarget(void *arg, void *vclient, const double diff, tv_t *now_t,
+			  const double network_diff, const int64_t next_blockid,
+			  const int64_t current_blockid)
 {
-	double dexp = tdiff / period;
+	stratum_instance_t *client = vclient;
+	worker_instance_t *worker = client->worker_instance;
+	sdata_t *sdata = arg;
+	ckpool_t *ckp = sdata->ckp;
+	vardiff_share_t vsh;
+	vardiff_conf_t vc;
+	double new_diff;
+
+	client->ssdc++;
+	vsh.diff = client->diff;
+	vsh.share_diff = diff;
+	vsh.ssdc = client->ssdc;
+	vsh.bdiff = sane_tdiff(now_t, &client->first_share);
+	vsh.tdiff = sane_tdiff(now_t, &client->ldc);
+	vsh.dsps15s = client->dsps15s;
+	vsh.dsps1 = client->dsps1;
+	vsh.dsps5 = client->dsps5;
+	/* Respect miner's hint as a floor. Two sources, in priority order:
+	 *   suggest_diff: set by mining.suggest_difficulty (takes precedence)
+	 *   worker->mindiff: set by password diff=N (used if no suggest_diff)
+	 * vardiff adjusts up freely. */
+	if (client->suggest_diff)
+		vsh.floor = client->suggest_diff;
+	else
+		vsh.floor = worker->mindiff;
+	vsh.network_diff = network_diff;
+
+	vc.policy = ckp->vardiff;
+	vc.mindiff = ckp->mindiff;
+	vc.maxdiff = ckp->maxdiff;
+	vc.target = ckp->vardifftarget;
+	switch (vardiff_adjust(&vc, &client->vardiff, &vsh, &new_diff)) {
+		case VARDIFF_CHANGE:
+			break;
+		case VARDIFF_RESET:
+			client->ssdc = 0;
+			return;
+		case VARDIFF_DEFER:
+			copy_tv(&client->ldc, now_t);
+			return;
+		case VARDIFF_RESTART:
+			client->ssdc = 0;
+			copy_tv(&client->ldc, now_t);
+			return;
+		default:
+			return;
+	}
+
+	LOGINFO("Client %s %s vardiff adjust diff from %lf to: %lf ",
+		client->identity, vardiff_policy_name(vc.policy), client->diff, new_diff);
+	LOGDEBUG("Client %s tier %s ssdc %.0f tdiff %.1fs dsps15s %.2f dsps1 %.2f dsps5 %.2f",
+		client->identity, client->vardiff.tier, client->ssdc, vsh.tdiff, client->dsps15s,
+		client->dsps1, client->dsps5);
+
+	client->ssdc = 0;
 
-	/* Sanity check to prevent silly numbers for double accuracy **/
-	if (unlikely(dexp > 36))
-		dexp = 36;
-	return 1.0 - 1.0 / exp(dexp);
+	copy_tv(&client->ldc, now_t);
+	/* Pass next_blockid (W+1) so UP changes anchor at W+2, giving miners two jobs
+	 * to flush in-flight work at the old easier diff. Pool-initiated vardiff changes
+	 * need this extra buffer because the miner has no advance notice. By contrast:
+	 *   - password diff (parse_authorise): applied at auth before mining starts, so
+	 *     no in-flight shares exist; any buffer is harmless but unnecessary (W+1).
+	 *   - mining.suggest_difficulty (apply_suggest_diff): miner-requested mid-session,
+	 *     so W+1 buffer (via workbase_id) covers shares in-flight at the old diff. */
+	client->diff_change_job_id = select_diff_change_anchor(client->diff, new_diff,
+		next_blockid, current_blockid);
+	client->old_diff = client->diff;
+	client->diff = new_diff;
+	stratum_send_diff(sdata, client);
 }
 
 /* Needs to be entered with client holding a ref count. */
@@ -5747,10 +6283,9 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 {
 	sdata_t *ckp_sdata = ckp->sdata, *sdata = client->sdata;
 	worker_instance_t *worker = client->worker_instance;
-	double tdiff, bdiff, dsps, drr, network_diff, bias, optimal;
 	user_instance_t *user = client->user_instance;
 	int64_t next_blockid, current_blockid;
-	double mindiff;
+	double network_diff;
 	tv_t now_t;
 
 	mutex_lock(&ckp_sdata->uastats_lock);
@@ -5774,12 +6309,9 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 	tv_time(&now_t);
 
 	ck_rlock(&sdata->workbase_lock);
+	network_diff = sdata->path->network_diff(sdata->current_workbase);
 	next_blockid = sdata->workbase_id + 1;
 	current_blockid = sdata->current_workbase->id;
-	if (ckp->proxy)
-		network_diff = sdata->current_workbase->diff;
-	else
-		network_diff = sdata->current_workbase->network_diff;
 	ck_runlock(&sdata->workbase_lock);
 
 	if (unlikely(!client->first_share.tv_sec)) {
@@ -5798,126 +6330,8 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 	copy_tv(&user->last_share, &now_t);
 	client->idle = false;
 
-	/* Once we've updated user/client statistics in node mode, we can't
-	 * alter diff ourselves. */
-	if (ckp->node)
-		return;
-
-	client->ssdc++;
-	bdiff = sane_tdiff(&now_t, &client->first_share);
-	tdiff = sane_tdiff(&now_t, &client->ldc);
-
-	/* Check difficulty if any condition is met:
-	 * 1. Ultra-fast: 144+ shares in <15 seconds since last change
-	 * 2. Fast: 72+ shares at any time
-	 * 3. Time: 240 seconds elapsed since last change */
-	if (client->ssdc >= 144 && tdiff < 15) {
-		/* Ultra-fast threshold met - proceed with check */
-	} else if (client->ssdc < 72 && tdiff < 240) {
-		/* Neither fast nor time threshold met - return early */
-		return;
-	}
-
-	if (diff != client->diff) {
-		client->ssdc = 0;
-		return;
-	}
-
-	/* Diff rate ratio.
-	 * Use different time windows based on share submission rate:
-	 * - Ultra-fast (144+ shares in <15s): 15-second rolling average
-	 * - Fast (72+ shares): 60-second rolling average
-	 * - Normal: 5-minute rolling average for stable tracking */
-	const char *adjustment_tier;
-	if (client->ssdc >= 144 && tdiff < 15) {
-		/* Ultra-fast path: 15-second EMA with time bias compensation */
-		bias = time_bias(bdiff, 15);
-		dsps = client->dsps15s / bias;
-		adjustment_tier = "15s";
-	} else if (client->ssdc >= 72) {
-		/* Fast path: 60-second EMA with time bias compensation */
-		bias = time_bias(bdiff, 60);
-		dsps = client->dsps1 / bias;
-		adjustment_tier = "1m";
-	} else {
-		/* Normal path: 5-minute rolling average */
-		bias = time_bias(bdiff, 300);
-		dsps = client->dsps5 / bias;
-		adjustment_tier = "5m";
-	}
-	drr = dsps / (double)client->diff;
-
-	/* Optimal rate product is 0.3, allow some hysteresis. */
-	if (drr > 0.15 && drr < 0.4)
-		return;
-
-	/* Respect miner's hint as a floor. Two sources, in priority order:
-	 *   suggest_diff: set by mining.suggest_difficulty (takes precedence)
-	 *   worker->mindiff: set by password diff=N (used if no suggest_diff)
-	 * The floor is enforced below via MAX(optimal, mindiff); vardiff adjusts up freely. */
-	if (client->suggest_diff)
-		mindiff = client->suggest_diff;
-	else
-		mindiff = worker->mindiff;
-	optimal = dsps * 3.33;
-
-	/* Clamp to mindiff ~ network_diff */
-
-	/* Clamp to effective normalized bounds: compare against ceil/floor of config
-	 * values so normalize_pool_diff() cannot push the result outside operator limits. */
-	optimal = MAX(optimal, normalize_pool_diff_ceil(ckp->mindiff));
-
-	/* Set to higher of optimal and user chosen diff */
-	optimal = MAX(optimal, mindiff);
-
-	if (ckp->maxdiff)
-		optimal = MIN(optimal, normalize_pool_diff_floor(ckp->maxdiff));
-
-	/* Set to lower of optimal and network_diff */
-	optimal = MIN(optimal, network_diff);
-
-	/* Sanity check: optimal should never be <= 0 due to clamping above,
-	 * but guard against pathological cases */
-	if (unlikely(optimal <= 0.0))
-		return;
-
-	/* Use epsilon comparison for floating-point equality to handle rounding errors */
-	if (fabs(client->diff - optimal) < DIFF_EPSILON)
-		return;
-
-	/* If this is the first share in a change, reset the last diff change
-	 * to make sure the client hasn't just fallen back after a leave of
-	 * absence */
-	if (optimal < client->diff && client->ssdc == 1) {
-		copy_tv(&client->ldc, &now_t);
-		return;
-	}
-
-	double new_diff = normalize_pool_diff(optimal);
-
-	if (fabs(client->diff - new_diff) < DIFF_EPSILON)
-		return;
-
-	LOGINFO("Client %s biased dsps %.2f dsps %.2f drr %.2f adjust diff from %lf to: %lf ",
-		client->identity, dsps, client->dsps5, drr, client->diff, new_diff);
-	LOGDEBUG("Client %s tier %s ssdc %.0f tdiff %.1fs dsps15s %.2f dsps1 %.2f dsps5 %.2f",
-		client->identity, adjustment_tier, client->ssdc, tdiff, client->dsps15s, client->dsps1, client->dsps5);
-
-	client->ssdc = 0;
-
-	copy_tv(&client->ldc, &now_t);
-	/* Pass next_blockid (W+1) so UP changes anchor at W+2, giving miners two jobs
-	 * to flush in-flight work at the old easier diff. Pool-initiated vardiff changes
-	 * need this extra buffer because the miner has no advance notice. By contrast:
-	 *   - password diff (parse_authorise): applied at auth before mining starts, so
-	 *     no in-flight shares exist; any buffer is harmless but unnecessary (W+1).
-	 *   - mining.suggest_difficulty (apply_suggest_diff): miner-requested mid-session,
-	 *     so W+1 buffer (via workbase_id) covers shares in-flight at the old diff. */
-	client->diff_change_job_id = select_diff_change_anchor(client->diff, new_diff,
-		next_blockid, current_blockid);
-	client->old_diff = client->diff;
-	client->diff = new_diff;
-	stratum_send_diff(sdata, client);
+	sdata->path->retarget(&sdata->core, client, diff, &now_t, network_diff, next_blockid,
+			      current_blockid);
 }
 
 static void
@@ -5938,21 +6352,19 @@ downstream_block(ckpool_t *ckp, sdata_t *sdata, const json_t *val, const int cbl
 static void
 test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uchar *data,
 		const uchar *hash, const double diff, const char *coinbase, int cblen,
-		const char *nonce2, const char *nonce, const uint32_t ntime32, const uint32_t version_mask,
-		const bool stale)
+		const char *enonce1, const char *nonce2, const char *nonce, const uint32_t ntime32,
+		const uint32_t version_mask, const bool stale)
 {
 	char blockhash[68], cdfield[64], *gbt_block;
 	sdata_t *sdata = client->sdata;
 	ckpool_t *ckp = wb->ckp;
-	double network_diff;
 	json_t *val = NULL;
 	uchar flip32[32];
 	ts_t ts_now;
 	bool ret;
 
-	/* Submit anything over 99.9% of the diff in case of rounding errors */
-	network_diff = sdata->current_workbase->network_diff * 0.999;
-	if (likely(diff < network_diff))
+	/* The exact network target leaves no rounding to allow for */
+	if (likely(!target256_meets(hash, &sdata->current_workbase->network_target)))
 		return;
 
 	LOGWARNING("Possible %sblock solve diff %lf !", stale ? "stale share " : "", diff);
@@ -5960,11 +6372,11 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	if (!ckp->node && wb->proxy)
 		return;
 
-	ts_realtime(&ts_now);
+	stratcore_now(&((sdata_t *)ckp->sdata)->core, &ts_now);
 	sprintf(cdfield, "%lu,%lu", ts_now.tv_sec, ts_now.tv_nsec);
 
-	gbt_block = process_block(wb, coinbase, cblen, data, hash, flip32, blockhash);
-	send_node_block(ckp, sdata, client->enonce1, nonce, nonce2, ntime32, version_mask,
+	gbt_block = stratcore_block(wb, coinbase, cblen, data, hash, flip32, blockhash);
+	send_node_block(ckp, sdata, enonce1, nonce, nonce2, ntime32, version_mask,
 			wb->id, diff, client->id, coinbase, cblen, data);
 
 	val = json_object();
@@ -5974,11 +6386,8 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	json_set_int64(val, "workinfoid", wb->id);
 	json_set_string(val, "username", client->user_instance->username);
 	json_set_string(val, "workername", client->workername);
-	if (ckp->remote)
-		json_set_int64(val, "clientid", client->virtualid);
-	else
-		json_set_int64(val, "clientid", client->id);
-	json_set_string(val, "enonce1", client->enonce1);
+	json_set_int64(val, "clientid", sdata->path->log_id(client->id, client->virtualid));
+	json_set_string(val, "enonce1", enonce1);
 	json_set_string(val, "nonce2", nonce2);
 	json_set_string(val, "nonce", nonce);
 	json_set_uint32(val, "ntime32", ntime32);
@@ -5989,6 +6398,8 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	json_set_string(val, "createby", "code");
 	json_set_string(val, "createcode", __func__);
 	json_set_string(val, "createinet", ckp->serverurl[client->server]);
+	pool_event(ckp, POOL_EV_BLOCK_FOUND, client->user_instance->username, client->workername,
+		   json_deep_copy(val));
 
 	if (ckp->remote) {
 		add_remote_blockdata(ckp, val, cblen, coinbase, data);
@@ -6003,108 +6414,42 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	if (ret)
 		block_solve(ckp, val);
 	else
-		block_reject(val);
+		block_reject(ckp, val);
 
 	json_decref(val);
 }
 
-/* Entered with instance_lock held */
-static inline uchar *__user_coinb2(const stratum_instance_t *client, const workbase_t *wb, int *cb2len)
-{
-	struct userwb *userwb;
-	int64_t id;
-
-	if (!client->ckp->btcsolo)
-		goto out_nouserwb;
-
-	id = wb->id;
-	HASH_FIND_I64(client->user_instance->userwbs, &id, userwb);
-	if (unlikely(!userwb))
-		goto out_nouserwb;
-	*cb2len = userwb->coinb2len;
-	return userwb->coinb2bin;
-
-out_nouserwb:
-	*cb2len = wb->coinb2len;
-	return wb->coinb2bin;
-}
-
 /* Needs to be entered with workbase readcount and client holding a ref count. */
 static double submission_diff(sdata_t *sdata, const stratum_instance_t *client, const workbase_t *wb,
-			      const char *nonce2, const uint32_t ntime32, uint32_t version_mask,
-			      const char *nonce, uchar *hash, const bool stale)
+			      stratcore_share_t *share, const bool stale)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
-	uint32_t *data32, *swap32, benonce32;
-	char *coinbase, data[80];
-	uchar swap[80], hash1[32];
-	int cblen, i, cb2len;
-	uchar *coinb2bin;
-	double ret;
-
-	/* Leave ample enough room for donation generation address (~25) + length counter + user generation
-	 * wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len + 25 + cb2len */
-
-	coinbase = alloca(1024);
-	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
-	cblen = wb->coinb1len;
-	memcpy(coinbase + cblen, &client->enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
-	cblen += wb->enonce1constlen + wb->enonce1varlen;
-	hex2bin(coinbase + cblen, nonce2, wb->enonce2varlen);
-	cblen += wb->enonce2varlen;
-
-	ck_rlock(&sdata->instance_lock);
-	coinb2bin = __user_coinb2(client, wb, &cb2len);
-	memcpy(coinbase + cblen, coinb2bin, cb2len);
-	ck_runlock(&sdata->instance_lock);
-
-	cblen += cb2len;
-
-	gen_hash((uchar *)coinbase, merkle_root, cblen);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < wb->merkles; i++) {
-		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip_32(swap32, data32);
+	sdata_t *ckp_sdata = client->ckp->sdata;
+	stratcore_enonce1_t enonce1data;
+	const uchar *coinb2bin;
+	uchar *cb2;
+	int cb2len;
 
-	/* Copy the cached header binary and insert the merkle root */
-	memcpy(data, wb->headerbin, 80);
-	memcpy(data + 36, merkle_root, 32);
-
-	/* Update nVersion when version_mask is in use */
-	if (version_mask) {
-		version_mask = htobe32(version_mask);
-		data32 = (uint32_t *)data;
-		*data32 |= version_mask;
-	}
-
-	/* Insert the nonce value into the data */
-	hex2bin(&benonce32, nonce, 4);
-	data32 = (uint32_t *)(data + 64 + 12);
-	*data32 = benonce32;
-
-	/* Insert the ntime value into the data */
-	data32 = (uint32_t *)(data + 68);
-	*data32 = htobe32(ntime32);
-
-	/* Hash the share */
-	data32 = (uint32_t *)data;
-	swap32 = (uint32_t *)swap;
-	flip_80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, hash);
+	/* Copy the user's coinb2 and the client's enonce1s out so the lock
+	 * isn't held while hashing. Only solo users have their own coinb2 and
+	 * solo never proxies so the one lock covers both */
+	ck_rlock(&ckp_sdata->instance_lock);
+	coinb2bin = sdata->path->coinb2(&sdata->core, wb, client->user_instance, &cb2len);
+	cb2 = alloca(cb2len);
+	memcpy(cb2, coinb2bin, cb2len);
+	memcpy(&enonce1data, &client->enonce1data, sizeof(stratcore_enonce1_t));
+	ck_runlock(&ckp_sdata->instance_lock);
 
-	/* Calculate the diff of the share here */
-	ret = diff_from_target(hash);
+	/* Jobs from before a set_extranonce may have the old enonce1 */
+	stratcore_enonce1_share_diff(wb, &enonce1data, cb2, cb2len,
+				     share->id < client->diff_change_job_id ? client->old_diff : client->diff,
+				     share);
 
 	/* Test we haven't solved a block regardless of share status */
-	test_blocksolve(client, wb, swap, hash, ret, coinbase, cblen, nonce2, nonce, ntime32, version_mask, stale);
+	test_blocksolve(client, wb, share->swap, share->hash, share->sdiff, share->coinbase,
+			share->cblen, share->enonce1, share->nonce2, share->nonce, share->ntime32,
+			share->version_mask32, stale);
 
-	return ret;
+	return share->sdiff;
 }
 
 /* Optimised for the common case where shares are new */
@@ -6189,6 +6534,40 @@ static void check_best_diff(sdata_t *sdata, user_instance_t *user,worker_instanc
 
 #define JSON_ERR(err) json_err_array(err)
 
+static const char *share_event_types[] = {
+	"accepted",
+	"rejected",
+	"block"
+};
+
+/* Compact binary form of the sharelog json for share stream subscribers */
+static char *share_event_bin(const evstream_event_t *ev, int *len)
+{
+	int ulen = ev->user ? strlen(ev->user) + 1 : 1;
+	int wlen = ev->worker ? strlen(ev->worker) + 1 : 1;
+	struct share_event_bin *seb;
+	const char *hash;
+	char *ret;
+
+	*len = sizeof(struct share_event_bin) + ulen + wlen;
+	ret = ckzalloc(*len);
+	seb = (struct share_event_bin *)ret;
+	seb->workinfoid = htole64(json_integer_value(json_object_get(ev->val, "workinfoid")));
+	seb->clientid = htole64(json_integer_value(json_object_get(ev->val, "clientid")));
+	seb->diff = json_real_value(json_object_get(ev->val, "diff"));
+	seb->sdiff = json_real_value(json_object_get(ev->val, "sdiff"));
+	seb->errn = htole32(json_integer_value(json_object_get(ev->val, "errn")));
+	seb->result = json_is_true(json_object_get(ev->val, "result"));
+	hash = json_string_value(json_object_get(ev->val, "hash"));
+	if (hash && strlen(hash) == 64)
+		hex2bin(seb->hash, hash, 32);
+	if (ev->user)
+		memcpy(ret + sizeof(struct share_event_bin), ev->user, ulen);
+	if (ev->worker)
+		memcpy(ret + sizeof(struct share_event_bin) + ulen, ev->worker, wlen);
+	return ret;
+}
+
 /* Format difficulty for logging with trailing zeros stripped */
 static void format_diff(char *buf, size_t len, double diff)
 {
@@ -6207,91 +6586,41 @@ static void format_diff(char *buf, size_t len, double diff)
 static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 			    const json_t *params_val, json_t **err_val)
 {
-	bool share = false, result = false, invalid = true, submit = false, stale = false;
-	const char *workername, *job_id, *ntime, *version_mask;
+	bool isshare = false, result = false, invalid = true, submit = false, stale = false;
+	bool candidate = false;
 	double diff = client->diff, wdiff = 0, sdiff = -1;
 	char hexhash[68] = {}, sharehash[32], cdfield[64];
 	user_instance_t *user = client->user_instance;
-	char *fname = NULL, *s, *nonce, *nonce2;
-	uint32_t ntime32, version_mask32 = 0;
 	sdata_t *sdata = client->sdata;
 	enum share_err err = SE_NONE;
 	ckpool_t *ckp = client->ckp;
+	sdata_t *ckp_sdata = ckp->sdata;
+	char *fname = NULL, *s;
 	char idstring[24] = {};
+	stratcore_share_t share;
 	workbase_t *wb = NULL;
-	uchar hash[32];
-	int nlen, len;
 	time_t now_t;
 	json_t *val;
 	int64_t id;
 	ts_t now;
-	FILE *fp;
 
-	ts_realtime(&now);
+	stratcore_now(&ckp_sdata->core, &now);
 	now_t = now.tv_sec;
 	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 
-	if (unlikely(!json_is_array(params_val))) {
-		err = SE_NOT_ARRAY;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	if (unlikely(json_array_size(params_val) < 5)) {
-		err = SE_INVALID_SIZE;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	workername = json_string_value(json_array_get(params_val, 0));
-	if (unlikely(!workername || !strlen(workername))) {
-		err = SE_NO_USERNAME;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	job_id = json_string_value(json_array_get(params_val, 1));
-	if (unlikely(!job_id || !strlen(job_id))) {
-		err = SE_NO_JOBID;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
-	if (unlikely(!nonce2 || !strlen(nonce2) || !validhex(nonce2))) {
-		err = SE_NO_NONCE2;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	ntime = json_string_value(json_array_get(params_val, 3));
-	if (unlikely(!ntime || !strlen(ntime) || !validhex(ntime))) {
-		err = SE_NO_NTIME;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	nonce = (char *)json_string_value(json_array_get(params_val, 4));
-	if (unlikely(!nonce || strlen(nonce) < 8 || !validhex(nonce))) {
-		err = SE_NO_NONCE;
+	err = stratcore_submit_params(&ckp_sdata->core, params_val, &share);
+	if (unlikely(err != SE_NONE)) {
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-
-	version_mask = json_string_value(json_array_get(params_val, 5));
-	if (version_mask && strlen(version_mask) && validhex(version_mask)) {
-		sscanf(version_mask, "%x", &version_mask32);
-		// check version mask
-		if (version_mask32 && ((~ckp->version_mask) & version_mask32) != 0) {
-			// means client changed some bits which server doesn't allow to change
-			err = SE_INVALID_VERSION_MASK;
-			*err_val = JSON_ERR(err);
-			goto out;
-		}
-	}
-	if (safecmp(workername, client->workername)) {
+	if (safecmp(share.workername, client->workername)) {
 		err = SE_WORKER_MISMATCH;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	sscanf(job_id, "%lx", &id);
-	sscanf(ntime, "%x", &ntime32);
+	id = share.id;
 
-	share = true;
+	isshare = true;
 
 	if (unlikely(!sdata->current_workbase))
 		return json_boolean(false);
@@ -6301,49 +6630,37 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 		id = sdata->current_workbase->id;
 		err = SE_INVALID_JOBID;
 		*err_val = JSON_ERR(err);
-		strncpy(idstring, job_id, 19);
-		ASPRINTF(&fname, "%s.sharelog", sdata->current_workbase->logdir);
+		strncpy(idstring, share.job_id, 19);
+		/* Never hashed so log the enonce1 the client has now */
+		ck_rlock(&ckp_sdata->instance_lock);
+		strcpy(share.enonce1, client->enonce1);
+		ck_runlock(&ckp_sdata->instance_lock);
+		/* Log it to the current workbase's sharelog if it's still there */
+		wb = get_workbase(sdata, id);
 		goto out_nowb;
 	}
 	wdiff = wb->diff;
 	strncpy(idstring, wb->idstring, 20);
-	ASPRINTF(&fname, "%s.sharelog", wb->logdir);
-	/* Fix broken clients sending too many chars. Nonce2 is part of the
-	 * read only json so use a temporary variable and modify it. */
-	len = wb->enonce2varlen * 2;
-	nlen = strlen(nonce2);
-	if (unlikely(nlen != len)) {
-		if (nlen > len) {
-			nonce2 = strdupa(nonce2);
-			nonce2[len] = '\0';
-		} else if (nlen < len) {
-			char *tmp = nonce2;
-
-			nonce2 = strdupa("0000000000000000");
-			memcpy(nonce2, tmp, nlen);
-			nonce2[len] = '\0';
-		}
-	}
-	/* Same with nonce, but we need at least 8 chars. We checked for this
-	 * earlier. */
-	len = 8;
-	nlen = strlen(nonce);
-	if (unlikely(nlen > len)) {
-		nonce = strdupa(nonce);
-		nonce[len] = '\0';
-	}
 	if (id < sdata->blockchange_id)
 		stale = true;
-	sdiff = submission_diff(sdata, client, wb, nonce2, ntime32, version_mask32, nonce, hash, stale);
+	sdiff = submission_diff(sdata, client, wb, &share, stale);
 	if (sdiff > client->best_diff) {
 		worker_instance_t *worker = client->worker_instance;
 
 		client->best_diff = sdiff;
+		if (client->ua_item) {
+			sdata_t *ckp_sdata = ckp->sdata;
+
+			mutex_lock(&ckp_sdata->ua_lock);
+			if (client->ua_item && sdiff > client->ua_item->best_diff)
+				client->ua_item->best_diff = sdiff;
+			mutex_unlock(&ckp_sdata->ua_lock);
+		}
 		LOGINFO("User %s worker %s client %s new best diff %.10g", user->username,
 			worker->workername, client->identity, sdiff);
 		check_best_diff(sdata, user, worker, sdiff, client);
 	}
-	bswap_256(sharehash, hash);
+	bswap_256(sharehash, share.hash);
 	__bin2hex(hexhash, sharehash, 32);
 
 	if (stale) {
@@ -6366,23 +6683,23 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 		goto out_submit;
 	}
 no_stale:
-	/* Ntime cannot be less, but allow forward ntime rolling up to max */
-	if (ntime32 < wb->ntime32 || ntime32 > wb->ntime32 + 7000) {
+	if (!stratcore_ntime_valid(wb, share.ntime32)) {
 		err = SE_NTIME_INVALID;
 		*err_val = JSON_ERR(err);
-		goto out_put;
+		goto out_nowb;
 	}
 	invalid = false;
 out_submit:
-	if (sdiff >= wdiff)
+	/* Thresholds are checked exactly against the hash, sdiff is only for
+	 * accounting */
+	if (target256_meets_diff(share.hash, wdiff))
 		submit = true;
-	if (unlikely(sdiff >= sdata->current_workbase->network_diff)) {
+	if (unlikely(target256_meets(share.hash, &sdata->current_workbase->network_target))) {
 		/* Make sure we always submit any possible block solve */
 		LOGWARNING("Submitting possible block solve share diff %lf !", sdiff);
 		submit = true;
+		candidate = true;
 	}
-out_put:
-	put_workbase(sdata, wb);
 out_nowb:
 
 	/* Accept shares of the old diff until the next update */
@@ -6395,8 +6712,8 @@ out_nowb:
 		format_diff(sdiff_str, sizeof(sdiff_str), sdiff);
 		format_diff(diff_str, sizeof(diff_str), diff);
 		suffix_string(wdiff, wdiffsuffix, 16, 0);
-		if (sdiff >= diff) {
-			if (new_share(sdata, hash, id)) {
+		if (target256_meets_diff(share.hash, diff)) {
+			if (new_share(sdata, share.hash, id)) {
 				LOGINFO("Accepted client %s share diff %s/%s/%s: %s",
 					client->identity, sdiff_str, diff_str, wdiffsuffix, hexhash);
 				result = true;
@@ -6419,24 +6736,19 @@ out_nowb:
 
 	/* Submit share to upstream pool in proxy mode. We submit valid and
 	 * stale shares and filter out the rest. */
-	if (wb && wb->proxy && submit) {
-		LOGINFO("Submitting share upstream: %s", hexhash);
-		submit_share(client, id, nonce2, ntime, nonce);
-	}
+	sdata->path->forward(&sdata->core, client, &share, submit);
 
 	add_submit(ckp, client, diff, result, submit);
+	CKPROBE4(share, client->id, (int64_t)(sdiff * 1000), result, err);
 
 	/* Now write to the pool's sharelog. */
 	val = json_object();
 	json_set_int(val, "workinfoid", id);
-	if (ckp->remote)
-		json_set_int64(val, "clientid", client->virtualid);
-	else
-		json_set_int64(val, "clientid", client->id);
-	json_set_string(val, "enonce1", client->enonce1);
-	json_set_string(val, "nonce2", nonce2);
-	json_set_string(val, "nonce", nonce);
-	json_set_string(val, "ntime", ntime);
+	json_set_int64(val, "clientid", sdata->path->log_id(client->id, client->virtualid));
+	json_set_string(val, "enonce1", share.enonce1);
+	json_set_string(val, "nonce2", share.nonce2);
+	json_set_string(val, "nonce", share.nonce);
+	json_set_string(val, "ntime", share.ntime);
 	json_set_double(val, "diff", diff);
 	json_set_double(val, "sdiff", sdiff);
 	json_set_string(val, "hash", hexhash);
@@ -6452,24 +6764,25 @@ out_nowb:
         json_set_string(val, "address", client->address);
         json_set_string(val, "agent", client->useragent ? client->useragent : "");
 
-	if (ckp->logshares) {
-		fp = fopen(fname, "ae");
-		if (likely(fp)) {
+	if (wb) {
+		if (wb->sharelog) {
+			ASPRINTF(&fname, "%s.sharelog", wb->logdir);
 			s = json_dumps(val, JSON_EOL);
-			len = strlen(s);
-			len = fprintf(fp, "%s", s);
+			rotlog_write_to(wb->sharelog, fname, s, strlen(s));
 			free(s);
-			fclose(fp);
-			if (unlikely(len < 0))
-				LOGERR("Failed to fwrite to %s", fname);
-		} else
-			LOGERR("Failed to fopen %s", fname);
+		}
+		put_workbase(sdata, wb);
 	}
-	if (ckp->remote)
-		upstream_json_msgtype(ckp, val, SM_SHARE);
-	json_decref(val);
+	sdata->path->log(&sdata->core, val);
+	if (ckp_sdata->sharestream) {
+		evstream_publish(ckp_sdata->sharestream,
+				 candidate ? SHARE_EV_BLOCK : result ? SHARE_EV_ACCEPTED : SHARE_EV_REJECTED,
+				 user->username, client->workername, val);
+	} else
+		json_decref(val);
 out:
-	if (!sdata->wbincomplete && ((!result && !submit) || !share)) {
+	metric_inc(&ckp_sdata->share_results[SHARE_RESULT_IDX(err)]);
+	if (!sdata->wbincomplete && ((!result && !submit) || !isshare)) {
 		/* Is this the first in a run of invalids? */
 		if (client->first_invalid < client->last_share.tv_sec || !client->first_invalid)
 			client->first_invalid = now_t;
@@ -6495,7 +6808,7 @@ out:
 		client->reject = 0;
 	}
 
-	if (!share) {
+	if (!isshare) {
 		if (ckp->remote) {
 			val = json_object();
 			if (ckp->remote)
@@ -6522,36 +6835,24 @@ out:
 	return json_boolean(result);
 }
 
-/* Must enter with workbase_lock held */
-static json_t *__stratum_notify(const workbase_t *wb, const bool clean)
-{
-	json_t *val;
-
-	JSON_CPACK(val, "{s:[ssssosssb],s:o,s:s}",
-			"params",
-			wb->idstring,
-			wb->prevhash,
-			wb->coinb1,
-			wb->coinb2,
-			json_deep_copy(wb->merkle_array),
-			wb->bbversion,
-			wb->nbit,
-			wb->ntime,
-			clean,
-			"id", json_null(),
-			"method", "mining.notify");
-	return val;
-}
-
-static void stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, const bool clean)
+/* Returns the number of notifies queued. A non zero btrace tags them so the
+ * connector reports back when each has been written. */
+static int stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, const bool clean,
+				    const int64_t btrace)
 {
 	json_t *json_msg;
+	int messages;
 
+	CKPROBE2(notify_start, wb->id, clean);
 	ck_rlock(&sdata->workbase_lock);
-	json_msg = __stratum_notify(wb, clean);
+	json_msg = stratcore_notify(wb, wb->coinb2, clean);
 	ck_runlock(&sdata->workbase_lock);
 
-	stratum_broadcast(sdata, json_msg, SM_UPDATE);
+	if (btrace)
+		json_object_set_new_nocheck(json_msg, "btrace", json_integer(btrace));
+	messages = stratum_broadcast(sdata, json_msg, SM_UPDATE);
+	CKPROBE2(notify_end, wb->id, messages);
+	return messages;
 }
 
 /* For sending a single stratum template update */
@@ -6569,10 +6870,10 @@ static void stratum_send_update(sdata_t *sdata, const int64_t client_id, const b
 	}
 
 	ck_rlock(&sdata->workbase_lock);
-	json_msg = __stratum_notify(sdata->current_workbase, clean);
+	json_msg = stratcore_notify(sdata->current_workbase, sdata->current_workbase->coinb2, clean);
 	ck_runlock(&sdata->workbase_lock);
 
-	stratum_add_send(sdata, json_msg, client_id, SM_UPDATE);
+	stratcore_send(&sdata->core, json_msg, client_id, SM_UPDATE);
 }
 
 /* Hold instance and workbase lock */
@@ -6580,7 +6881,6 @@ static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user,
 {
 	int64_t id = wb->id;
 	struct userwb *userwb;
-	json_t *val;
 
 	HASH_FIND_I64(user->userwbs, &id, userwb);
 	if (unlikely(!userwb)) {
@@ -6588,29 +6888,19 @@ static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user,
 		return NULL;
 	}
 
-	JSON_CPACK(val, "{s:[ssssosssb],s:o,s:s}",
-			"params",
-			wb->idstring,
-			wb->prevhash,
-			wb->coinb1,
-			userwb->coinb2,
-			json_deep_copy(wb->merkle_array),
-			wb->bbversion,
-			wb->nbit,
-			wb->ntime,
-			clean,
-			"id", json_null(),
-			"method", "mining.notify");
-	return val;
+	return stratcore_notify(wb, userwb->coinb2, clean);
 }
 
 /* Sends a stratum update with a unique coinb2 for every client. Avoid
  * recursive locking. */
-static void stratum_broadcast_updates(sdata_t *sdata, bool clean)
+static int stratum_broadcast_updates(sdata_t *sdata, bool clean, const int64_t btrace)
 {
+	const int64_t id = sdata->current_workbase->id;
 	stratum_instance_t *client, *tmp;
+	int messages = 0;
 	json_t *json_msg;
 
+	CKPROBE2(notify_start, id, clean);
 	ck_wlock(&sdata->instance_lock);
 	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
 		if (!client->user_instance)
@@ -6622,13 +6912,19 @@ static void stratum_broadcast_updates(sdata_t *sdata, bool clean)
 		json_msg = __user_notify(sdata->current_workbase, client->user_instance, clean);
 		ck_runlock(&sdata->workbase_lock);
 
-		if (likely(json_msg))
+		if (likely(json_msg)) {
+			if (btrace)
+				json_object_set_new_nocheck(json_msg, "btrace", json_integer(btrace));
 			stratum_add_send(sdata, json_msg, client->id, SM_UPDATE);
+			messages++;
+		}
 
 		ck_wlock(&sdata->instance_lock);
 		__dec_instance_ref(client);
 	}
 	ck_wunlock(&sdata->instance_lock);
+	CKPROBE2(notify_end, id, messages);
+	return messages;
 }
 
 static void send_json_err(sdata_t *sdata, const int64_t client_id, json_t *id_val, const char *err_msg)
@@ -6696,6 +6992,8 @@ static json_params_t
 	jp->params = json_deep_copy(params);
 	jp->id_val = json_deep_copy(id_val);
 	jp->client_id = client_id;
+	tv_time(&jp->queued);
+	jp->trace_start = 0;
 	return jp;
 }
 
@@ -6770,6 +7068,83 @@ static void init_client(const stratum_instance_t *client, const int64_t client_i
 	}
 }
 
+/* Move a client that sent mining.extranonce.subscribe to a new enonce1 on
+ * sdata, a new subproxy's or a fresh local one, without it reconnecting. It
+ * gets its diff and a clean notify after the set_extranonce like a new
+ * subscription. Jobs from before a local move may still be mined with the old
+ * enonce1, while an old subproxy's jobs go with it. Needs to be entered with
+ * client holding a ref count. */
+static bool set_client_extranonce(sdata_t *sdata, stratum_instance_t *client)
+{
+	const int proxyid = client->proxyid, subproxyid = client->subproxyid;
+	ckpool_t *ckp = client->ckp;
+	sdata_t *ckp_sdata = ckp->sdata;
+	proxy_t *proxy = client->proxy;
+	int64_t last_job_id = -1;
+	json_t *json_msg;
+	int n2len;
+
+	if (unlikely(!sdata->current_workbase))
+		return false;
+	if (sdata == client->sdata) {
+		ck_rlock(&sdata->workbase_lock);
+		last_job_id = sdata->current_workbase->id;
+		ck_runlock(&sdata->workbase_lock);
+	}
+
+	if (!new_enonce1(ckp, ckp_sdata, sdata, client, last_job_id)) {
+		client->proxyid = proxyid;
+		client->subproxyid = subproxyid;
+		return false;
+	}
+
+	/* new_enonce1 bound the client to its new subproxy */
+	ck_wlock(&ckp_sdata->instance_lock);
+	if (proxy) {
+		proxy->bound_clients--;
+		proxy->parent->combined_clients--;
+	}
+	client->sdata = sdata;
+	client->reconnect = false;
+	ck_wunlock(&ckp_sdata->instance_lock);
+
+	ck_rlock(&sdata->workbase_lock);
+	n2len = sdata->current_workbase->enonce2varlen;
+	ck_runlock(&sdata->workbase_lock);
+
+	LOGINFO("Moved client %s to enonce1 %s with set_extranonce", client->identity,
+		client->enonce1);
+	json_msg = stratcore_set_extranonce(client->enonce1, n2len);
+	stratum_add_send(sdata, json_msg, client->id, SM_SETEXTRANONCE);
+	init_client(client, client->id);
+	return true;
+}
+
+/* Move a client queued by rebind_client to the best subproxy for it, or
+ * reconnect it instead if there's nowhere to move it to. */
+static void smove_process(ckpool_t *ckp, int64_t *client_id)
+{
+	sdata_t *ckp_sdata = ckp->sdata, *sdata = NULL;
+	stratum_instance_t *client;
+
+	client = ref_instance_by_id(ckp_sdata, *client_id);
+	dealloc(client_id);
+	if (unlikely(!client))
+		return;
+
+	if (client->user_id && best_userproxy_headroom(ckp_sdata, client->user_id) > 0)
+		sdata = select_sdata(ckp, ckp_sdata, client->user_id);
+	if (!sdata)
+		sdata = select_sdata(ckp, ckp_sdata, 0);
+	if (sdata != client->sdata && (!sdata || !set_client_extranonce(sdata, client)))
+		reconnect_client(ckp_sdata, client);
+
+	ck_wlock(&ckp_sdata->instance_lock);
+	client->extranonce_move = false;
+	ck_wunlock(&ckp_sdata->instance_lock);
+	dec_instance_ref(ckp_sdata, client);
+}
+
 /* When a node first connects it has no transactions so we have to send all
  * current ones to it. */
 static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
@@ -6850,7 +7225,7 @@ static void add_remote_server(sdata_t *sdata, stratum_instance_t *client)
 /* Enter with client holding ref count */
 static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *client,
 			 const int64_t client_id, json_t *id_val, json_t *method_val,
-			 json_t *params_val)
+			 json_t *params_val, const smsg_t *msg)
 {
 	const char *method;
 
@@ -6861,6 +7236,11 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	if (likely(cmdmatch(method, "mining.submit") && client->authorised)) {
 		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
 
+		if (unlikely(msg->trace_start)) {
+			jp->trace_start = msg->trace_start;
+			jp->trace_last = lat_now();
+			lat_observe(&sdata->share_lat[SLAT_DISPATCH], jp->trace_last - msg->trace_last);
+		}
 		ckmsgq_add(sdata->sshareq, jp);
 		return;
 	}
@@ -6995,6 +7375,31 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 		return;
 	}
 
+	/* Miners usually ask for set_extranonce before authorising. Enonce1
+	 * comes from upstream on nodes and from the node for its clients. */
+	if (cmdmatch(method, "mining.extranonce.subscribe")) {
+		json_t *val, *err_array;
+
+		val = json_object();
+		if (!ckp->node && !ckp->passthrough && !subclient(client_id)) {
+			LOGINFO("Client %s %s subscribed to set_extranonce", client->identity,
+				client->address);
+			client->extranonce_subscribe = true;
+			json_object_set_new_nocheck(val, "result", json_true());
+			json_object_set_new_nocheck(val, "error", json_null());
+		} else {
+			err_array = json_array();
+			json_array_append_new(err_array, json_integer(20));
+			json_array_append_new(err_array, json_string("Not supported."));
+			json_array_append_new(err_array, json_null());
+			json_object_set_new_nocheck(val, "result", json_null());
+			json_object_set_new_nocheck(val, "error", err_array);
+		}
+		json_object_set_nocheck(val, "id", id_val);
+		stratum_add_send(sdata, val, client_id, SM_EXTRANONCERESULT);
+		return;
+	}
+
 	/* We should only accept authorised requests from here on */
 	if (!client->authorised) {
 		/* Accept early suggest_difficulty and queue it to apply after auth. */
@@ -7037,22 +7442,6 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 		return;
 	}
 
-	if (cmdmatch(method, "mining.extranonce.subscribe")) {
-		json_t *val, *err_array;
-
-		err_array = json_array();
-		json_array_append_new(err_array, json_integer(20));
-		json_array_append_new(err_array, json_string("Not supported."));
-		json_array_append_new(err_array, json_null());
-
-		val = json_object();
-		json_object_set_new_nocheck(val, "result", json_null());
-		json_object_set_new_nocheck(val, "error", err_array);
-		json_object_set_nocheck(val, "id", id_val);
-		stratum_add_send(sdata, val, client_id, SM_EXTRANONCERESULT);
-		return;
-	}
-
 	/* Unhandled message here */
 	LOGINFO("Unhandled client %s %s method %s", client->identity, client->address, method);
 	return;
@@ -7100,8 +7489,8 @@ static void parse_subscribe_result(stratum_instance_t *client, json_t *val)
 
 	strncpy(client->enonce1, json_string_value(json_array_get(val, 1)), 16);
 	len = strlen(client->enonce1) / 2;
-	hex2bin(client->enonce1bin, client->enonce1, len);
-	memcpy(&client->enonce1_64, client->enonce1bin, 8);
+	hex2bin(client->enonce1data.enonce1bin, client->enonce1, len);
+	memcpy(&client->enonce1_64, client->enonce1data.enonce1bin, 8);
 	LOGINFO("Client %s got enonce1 %lx string %s", client->identity, client->enonce1_64, client->enonce1);
 }
 
@@ -7445,7 +7834,7 @@ static void parse_remote_block(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 		hex2bin(swap, swaphex, 80);
 		sha256(swap, 80, hash1);
 		sha256(hash1, 32, hash);
-		gbt_block = process_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
+		gbt_block = stratcore_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
 		/* Note nodes use jobid of the mapped_id instead of workinfoid */
 		json_set_int64(val, "jobid", wb->mapped_id);
 		send_nodes_block(sdata, val, client_id);
@@ -7774,7 +8163,7 @@ static void parse_instance_msg(ckpool_t *ckp, sdata_t *sdata, smsg_t *msg, strat
 		if (!(++delays % 50))
 			LOGWARNING("%d Second delay waiting for bitcoind at startup", delays / 10);
 	}
-	parse_method(ckp, sdata, client, client_id, id_val, method, params);
+	parse_method(ckp, sdata, client, client_id, id_val, method, params, msg);
 }
 
 static void srecv_process(ckpool_t *ckp, json_t *val)
@@ -7825,6 +8214,15 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 	server = json_integer_value(val);
 	json_object_clear(val);
 
+	/* Sampled shares carry the times they were read and queued for us */
+	if (unlikely(ckp->latencysample && (val = json_object_get(msg->json_msg, "trace")))) {
+		msg->trace_start = json_integer_value(json_array_get(val, 0));
+		msg->trace_last = lat_now();
+		lat_observe(&sdata->share_lat[SLAT_SRECVQ],
+			    msg->trace_last - json_integer_value(json_array_get(val, 1)));
+		json_object_del(msg->json_msg, "trace");
+	}
+
 	/* Parse the message here */
 	ck_wlock(&sdata->instance_lock);
 	client = __instance_by_id(sdata, msg->client_id);
@@ -7874,12 +8272,24 @@ void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const ch
 
 static void ssend_process(ckpool_t *ckp, smsg_t *msg)
 {
+	json_t *trace_val;
+
 	if (unlikely(!msg->json_msg)) {
 		LOGERR("Sent null json msg to stratum_sender");
 		free(msg);
 		return;
 	}
 
+	/* Pass the time sampled share responses left us to the connector */
+	if (unlikely(ckp->latencysample && (trace_val = json_object_get(msg->json_msg, "trace")))) {
+		sdata_t *sdata = ckp->sdata;
+		int64_t now = lat_now();
+
+		lat_observe(&sdata->share_lat[SLAT_SSENDS],
+			    now - json_integer_value(json_array_get(trace_val, 1)));
+		json_array_set_new(trace_val, 1, json_integer(now));
+	}
+
 	/* Add client_id to the json message and send it to the
 	 * connector process to be delivered */
 	json_object_set_new_nocheck(msg->json_msg, "client_id", json_integer(msg->client_id));
@@ -7910,8 +8320,17 @@ static void sshare_process(ckpool_t *ckp, json_params_t *jp)
 	stratum_instance_t *client;
 	sdata_t *sdata = ckp->sdata;
 	int64_t client_id;
+	tv_t now;
 
 	client_id = jp->client_id;
+	tv_time(&now);
+	metric_slot_observe(&sdata->share_wait, tvdiff(&now, &jp->queued));
+	if (unlikely(jp->trace_start)) {
+		int64_t tnow = lat_now();
+
+		lat_observe(&sdata->share_lat[SLAT_SSHAREQ], tnow - jp->trace_last);
+		jp->trace_last = tnow;
+	}
 
 	client = ref_instance_by_id(sdata, client_id);
 	if (unlikely(!client)) {
@@ -7927,7 +8346,16 @@ static void sshare_process(ckpool_t *ckp, json_params_t *jp)
 	json_object_set_new_nocheck(json_msg, "result", result_val);
 	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
 	steal_json_id(json_msg, jp);
-	stratum_add_send(sdata, json_msg, client_id, SM_SHARERESULT);
+	if (unlikely(jp->trace_start)) {
+		int64_t tnow = lat_now();
+
+		lat_observe(&sdata->share_lat[SLAT_VALIDATE], tnow - jp->trace_last);
+		json_object_set_new_nocheck(json_msg, "trace", json_pack("[II]",
+					    (json_int_t)jp->trace_start, (json_int_t)tnow));
+	}
+	sdata->path->respond(&sdata->core, json_msg, client_id);
+	tv_time(&now);
+	metric_slot_observe(&sdata->share_latency, tvdiff(&now, &jp->queued));
 out_decref:
 	dec_instance_ref(sdata, client);
 out:
@@ -8221,424 +8649,568 @@ static void lazy_drop_client(ckpool_t *ckp, stratum_instance_t *client)
 	connector_drop_client(ckp, client->id);
 }
 
-static void *statsupdate(void *arg)
+static void add_hashrate_metrics(metrics_buf_t *mb, const char *name, const char *labels,
+				 const double dsps1, const double dsps5, const double dsps60,
+				 const double dsps1440, const double dsps10080)
 {
-	ckpool_t *ckp = (ckpool_t *)arg;
-	sdata_t *sdata = ckp->sdata;
-	pool_stats_t *stats = &sdata->stats;
+	metrics_printf(mb, "%s{%s,window=\"1m\"} %.17g\n", name, labels, dsps1 * nonces);
+	metrics_printf(mb, "%s{%s,window=\"5m\"} %.17g\n", name, labels, dsps5 * nonces);
+	metrics_printf(mb, "%s{%s,window=\"1h\"} %.17g\n", name, labels, dsps60 * nonces);
+	metrics_printf(mb, "%s{%s,window=\"1d\"} %.17g\n", name, labels, dsps1440 * nonces);
+	metrics_printf(mb, "%s{%s,window=\"7d\"} %.17g\n", name, labels, dsps10080 * nonces);
+}
 
-	pthread_detach(pthread_self());
-	rename_proc("statsupdate");
+static void add_user_metrics(metrics_buf_t *mb, const user_instance_t *user)
+{
+	char *username = metrics_escape(user->username), *labels;
 
-	tv_time(&stats->start_time);
-	cksleep_prepare_r(&stats->last_update);
-	sleep(1);
+	ASPRINTF(&labels, "user=\"%s\"", username);
+	add_hashrate_metrics(mb, "ckpool_user_hashrate", labels, user->dsps1, user->dsps5,
+			     user->dsps60, user->dsps1440, user->dsps10080);
+	free(labels);
+	free(username);
+}
 
-	while (42) {
-		double ghs, ghs1, ghs5, ghs15, ghs60, ghs360, ghs1440, ghs10080,
-			per_tdiff, percent;
-		char suffix1[16], suffix5[16], suffix15[16], suffix60[16], cdfield[64];
-		char suffix360[16], suffix1440[16], suffix10080[16];
-		int remote_users = 0, remote_workers = 0, idle_workers = 0;
-		log_entry_t *log_entries = NULL;
-		char_entry_t *char_list = NULL;
-		ua_item_t *ua_map = NULL, *ua_it, *ua_tmp;
-		stratum_instance_t *client, *tmp;
-		user_instance_t *user;
-		char *fname, *s, *sp;
-		tv_t now, diff;
-		ts_t ts_now;
-		json_t *val;
-		FILE *fp;
-		int i;
+static void add_worker_metrics(metrics_buf_t *mb, const user_instance_t *user,
+			       const worker_instance_t *worker)
+{
+	char *username = metrics_escape(user->username), *labels;
+	char *workername = metrics_escape(worker->workername);
 
-		tv_time(&now);
-		timersub(&now, &stats->start_time, &diff);
+	ASPRINTF(&labels, "user=\"%s\",worker=\"%s\"", username, workername);
+	add_hashrate_metrics(mb, "ckpool_worker_hashrate", labels, worker->dsps1, worker->dsps5,
+			     worker->dsps60, worker->dsps1440, worker->dsps10080);
+	free(labels);
+	free(workername);
+	free(username);
+}
 
-		ck_wlock(&sdata->instance_lock);
-		/* Grab the first entry */
-		client = sdata->stratum_instances;
-		if (likely(client))
-			__inc_instance_ref(client);
-		ck_wunlock(&sdata->instance_lock);
+/* Swap in the freshly generated user and worker gauges for the metrics
+ * endpoint to serve until the next statsupdate cycle */
+static void publish_user_metrics(sdata_t *sdata, metrics_buf_t *umb, metrics_buf_t *wmb)
+{
+	metrics_buf_t mb = {};
 
-		while (client) {
-			tv_time(&now);
-			/* Look for clients that have been dropped which the
-			 * connector may not have been informed about and should
-			 * disconnect. */
-			if (client->dropped) {
-				/* Check if client still exists in connector. If not,
-				 * it was already removed - clean up from stratifier's
-				 * hashtable to prevent repeated drop attempts. */
-				if (!connector_client_exists(ckp, client->id)) {
-					/* Client doesn't exist in connector - this is a zombie.
-					 * Log detection with context for troubleshooting. */
-					time_t now_t = time(NULL);
-					int age_seconds = now_t - client->start_time;
-					ck_wlock(&sdata->instance_lock);
-					LOGDEBUG("Watchdog: Detected zombie client %"PRId64" (not in connector, ref: %d, age: %ds, authorized: %d, subscribed: %d)",
-						 client->id, client->ref, age_seconds, client->authorised, client->subscribed);
-					/* Only remove if no other references exist */
-					if (client->ref == 1) {
-						LOGDEBUG("Watchdog: Cleaning up zombie client %"PRId64" (ref == 1, age: %ds)",
-							 client->id, age_seconds);
-						/* Save next pointer before removal */
-						stratum_instance_t *next = client->hh.next;
-						__dec_instance_ref(client);
-						__drop_client(sdata, client, true, NULL);
-						client = next;
-						if (likely(client))
-							__inc_instance_ref(client);
-						ck_wunlock(&sdata->instance_lock);
-						continue;
-					} else {
-						LOGDEBUG("Watchdog: Cannot cleanup zombie client %"PRId64" yet (ref: %d > 1, age: %ds) - waiting for refs to drop",
-							 client->id, client->ref, age_seconds);
-					}
-					ck_wunlock(&sdata->instance_lock);
+	metrics_header(&mb, "ckpool_user_hashrate", "gauge", "User hashrate in hashes per second");
+	if (umb->buf)
+		metrics_printf(&mb, "%s", umb->buf);
+	metrics_header(&mb, "ckpool_worker_hashrate", "gauge", "Worker hashrate in hashes per second");
+	if (wmb->buf)
+		metrics_printf(&mb, "%s", wmb->buf);
+	free(umb->buf);
+	free(wmb->buf);
+
+	mutex_lock(&sdata->metrics_lock);
+	free(sdata->user_metrics);
+	sdata->user_metrics = mb.buf;
+	mutex_unlock(&sdata->metrics_lock);
+}
+
+/* Take and release the instance_lock for writing in statsupdate, accounting
+ * for how long it was held */
+static void stats_wlock(sdata_t *sdata, int64_t *locked)
+{
+	ck_wlock(&sdata->instance_lock);
+	*locked = lat_now();
+}
+
+static void stats_wunlock(sdata_t *sdata, stats_timing_t *st, const int64_t locked)
+{
+	int64_t held = lat_now() - locked;
+
+	ck_wunlock(&sdata->instance_lock);
+	st->wlocks++;
+	st->wlock_total += held;
+	if (held > st->wlock_max)
+		st->wlock_max = held;
+}
+
+/* Add the time since the last phase ended to this one */
+static void stats_phase(stats_timing_t *st, const int phase_id, int64_t *phase)
+{
+	int64_t now = lat_now();
+
+	st->phase[phase_id] += now - *phase;
+	*phase = now;
+}
+
+/* One pass over every client, user and worker decaying their stats, writing
+ * the user files and pool status, timing each phase into st */
+void stats_pass(ckpool_t *ckp, sdata_t *sdata, stats_timing_t *st)
+{
+	pool_stats_t *stats = &sdata->stats;
+	double ghs, per_tdiff, percent;
+	char suffix1[16], suffix5[16], suffix15[16], suffix60[16];
+	char suffix360[16], suffix1440[16], suffix10080[16];
+	int remote_users = 0, remote_workers = 0, idle_workers = 0;
+	metrics_buf_t umb = {}, wmb = {};
+	log_entry_t *log_entries = NULL;
+	char_entry_t *char_list = NULL;
+	ua_item_t *ua_map = NULL, *ua_it, *ua_tmp;
+	stratum_instance_t *client;
+	char *fname, *s, *sp, *msg = NULL;
+	user_instance_t *user;
+	int64_t start, phase, locked;
+	tv_t now, diff;
+	json_t *val, *status = NULL;
+	FILE *fp;
+
+	start = phase = lat_now();
+	tv_time(&now);
+	timersub(&now, &stats->start_time, &diff);
+
+	stats_wlock(sdata, &locked);
+	/* Grab the first entry */
+	client = sdata->stratum_instances;
+	if (likely(client))
+		__inc_instance_ref(client);
+	stats_wunlock(sdata, st, locked);
+
+	while (client) {
+		st->clients++;
+		tv_time(&now);
+		/* Look for clients that have been dropped which the
+		 * connector may not have been informed about and should
+		 * disconnect. */
+		if (client->dropped) {
+			/* Check if client still exists in connector. If not,
+			 * it was already removed - clean up from stratifier's
+			 * hashtable to prevent repeated drop attempts. */
+			if (!connector_client_exists(ckp, client->id)) {
+				/* Client doesn't exist in connector - this is a zombie.
+				 * Log detection with context for troubleshooting. */
+				time_t now_t = time(NULL);
+				int age_seconds = now_t - client->start_time;
+				stats_wlock(sdata, &locked);
+				LOGDEBUG("Watchdog: Detected zombie client %"PRId64" (not in connector, ref: %d, age: %ds, authorized: %d, subscribed: %d)",
+					 client->id, client->ref, age_seconds, client->authorised, client->subscribed);
+				/* Only remove if no other references exist */
+				if (client->ref == 1) {
+					LOGDEBUG("Watchdog: Cleaning up zombie client %"PRId64" (ref == 1, age: %ds)",
+						 client->id, age_seconds);
+					/* Save next pointer before removal */
+					stratum_instance_t *next = client->hh.next;
+					__dec_instance_ref(client);
+					__drop_client(sdata, client, true, &msg);
+					add_msg_entry(&char_list, &msg);
+					client = next;
+					if (likely(client))
+						__inc_instance_ref(client);
+					stats_wunlock(sdata, st, locked);
+					continue;
 				} else {
-					/* Client exists in connector - legitimate drop */
-					connector_drop_client(ckp, client->id);
-				}
-			}
-			else if (remote_server(client)) {
-				/* Do nothing to these */
-			} else if (!client->authorised) {
-				/* Test for clients that haven't authed in over a minute
-				 * and drop them lazily */
-				if (now.tv_sec > client->start_time + 60) {
-					client->dropped = true;
-					connector_drop_client(ckp, client->id);
+					LOGDEBUG("Watchdog: Cannot cleanup zombie client %"PRId64" yet (ref: %d > 1, age: %ds) - waiting for refs to drop",
+						 client->id, client->ref, age_seconds);
 				}
+				stats_wunlock(sdata, st, locked);
 			} else {
-				/* UA aggregation iterates connected clients but groups by worker-level
-				 * normalized UA to avoid double-counting devices when a worker has
-				 * multiple stratum instances. See UA aggregation block below.
-				 */
-
-				per_tdiff = tvdiff(&now, &client->last_share);
-				/* Decay times per connected instance */
-				if (per_tdiff > 60) {
-					/* No shares for over a minute, decay to 0 */
-					decay_client(client, 0, &now);
-					idle_workers++;
-					if (ckp->dropidle && per_tdiff > ckp->dropidle) {
-						/* Drop clients idle for longer than
-						 * ckp->dropidle in seconds if set */
-						LOGINFO("Dropping client %"PRId64" due to being idle", client->id);
-						lazy_drop_client(ckp, client);
-					} else if (per_tdiff > 600) {
-						client->idle = true;
-						/* Test idle clients are still connected */
-						connector_test_client(ckp, client->id);
-					}
-				}
+				/* Client exists in connector - legitimate drop */
+				connector_drop_client(ckp, client->id);
 			}
-
-			ck_wlock(&sdata->instance_lock);
-			/* Drop the reference of the last entry we examined,
-			 * then grab the next client. */
-			__dec_instance_ref(client);
-			client = client->hh.next;
-			/* Grab a reference to this client allowing us to examine
-			 * it without holding the lock */
-			if (likely(client))
-				__inc_instance_ref(client);
-			ck_wunlock(&sdata->instance_lock);
 		}
-
-		/* Use persistent UA map for accurate device counts (build snapshot for metrics) */
-		if (ckp->max_pool_useragents != 0 && sdata->ua_map != NULL) {
-			ck_rlock(&sdata->instance_lock);
-
-			/* First, copy persistent ua_map to snapshot ua_map (keep lock held) */
-			ua_item_t *ua_it_src, *ua_tmp_src;
-			HASH_ITER(hh, sdata->ua_map, ua_it_src, ua_tmp_src) {
-				ua_item_t *ua_new = ckalloc(sizeof(ua_item_t));
-				ua_new->ua = strdup(ua_it_src->ua);
-				if (!ua_new->ua) {
-					dealloc(ua_new);
-					continue;
-				}
-				ua_new->count = ua_it_src->count;
-				ua_new->dsps5 = 0;  /* Will be aggregated from clients */
-				ua_new->best_diff = 0;  /* Will be aggregated from clients */
-				HASH_ADD_STR(ua_map, ua, ua_new);
+		else if (remote_server(client)) {
+			/* Do nothing to these */
+		} else if (!client->authorised) {
+			/* Test for clients that haven't authed in over a minute
+			 * and drop them lazily */
+			if (now.tv_sec > client->start_time + 60) {
+				client->dropped = true;
+				connector_drop_client(ckp, client->id);
 			}
+		} else {
+			/* UA aggregation iterates connected clients but groups by worker-level
+			 * normalized UA to avoid double-counting devices when a worker has
+			 * multiple stratum instances. See UA aggregation block below.
+			 */
 
-			/* Then, aggregate performance metrics from current connected clients */
-			if (ua_map != NULL) {
-				stratum_instance_t *snap_client;
-				HASH_ITER(hh, sdata->stratum_instances, snap_client, tmp) {
-					if (!snap_client->authorised || !snap_client->useragent || !snap_client->useragent[0])
-						continue;
-					/* Normalize client UA to match snapshot keys */
-					char normalized_ua[256];
-					const char *ua_key = get_normalized_ua_key(snap_client->useragent, normalized_ua, sizeof(normalized_ua));
-					
-					ua_item_t *ua_it_find = NULL;
-					HASH_FIND_STR(ua_map, ua_key, ua_it_find);
-					if (ua_it_find) {
-						/* Update performance metrics for this UA type */
-						ua_it_find->dsps5 += snap_client->dsps5;
-						if (snap_client->best_diff > ua_it_find->best_diff)
-							ua_it_find->best_diff = snap_client->best_diff;
-					}
+			per_tdiff = tvdiff(&now, &client->last_share);
+			/* Decay times per connected instance */
+			if (per_tdiff > 60) {
+				/* No shares for over a minute, decay to 0 */
+				decay_client(client, 0, &now);
+				idle_workers++;
+				if (ckp->dropidle && per_tdiff > ckp->dropidle) {
+					/* Drop clients idle for longer than
+					 * ckp->dropidle in seconds if set */
+					LOGINFO("Dropping client %"PRId64" due to being idle", client->id);
+					lazy_drop_client(ckp, client);
+				} else if (per_tdiff > 600) {
+					client->idle = true;
+					/* Test idle clients are still connected */
+					connector_test_client(ckp, client->id);
 				}
 			}
-			ck_runlock(&sdata->instance_lock);
 		}
 
-		user = NULL;
-		while ((user = next_user(sdata, user)) != NULL) {
-			worker_instance_t *worker;
-			json_t *user_array;
+		stats_wlock(sdata, &locked);
+		/* Drop the reference of the last entry we examined,
+		 * then grab the next client. */
+		__dec_instance_ref(client);
+		client = client->hh.next;
+		/* Grab a reference to this client allowing us to examine
+		 * it without holding the lock */
+		if (likely(client))
+			__inc_instance_ref(client);
+		stats_wunlock(sdata, st, locked);
+	}
+	stats_phase(st, SP_CLIENTS, &phase);
 
-			if (!user->authorised)
-				continue;
+	/* Snapshot the persistent UA map. Device counts, hashrates and
+	 * best diffs are all kept up to date as clients subscribe,
+	 * submit, decay and disconnect so no client walk is needed. */
+	if (ckp->max_pool_useragents != 0 && sdata->ua_map != NULL) {
+		ua_item_t *ua_it_src, *ua_tmp_src;
 
-			tv_time(&now);
+		ck_rlock(&sdata->instance_lock);
+		mutex_lock(&sdata->ua_lock);
+		HASH_ITER(hh, sdata->ua_map, ua_it_src, ua_tmp_src) {
+			ua_item_t *ua_new = ckzalloc(sizeof(ua_item_t));
+
+			ua_new->ua = strdup(ua_it_src->ua);
+			ua_new->count = ua_it_src->count;
+			/* Clamp rounding residue from incremental updates */
+			ua_new->dsps5 = ua_it_src->dsps5 > 0 ? ua_it_src->dsps5 : 0;
+			ua_new->best_diff = ua_it_src->best_diff;
+			HASH_ADD_STR(ua_map, ua, ua_new);
+		}
+		mutex_unlock(&sdata->ua_lock);
+		ck_runlock(&sdata->instance_lock);
+	}
+	stats_phase(st, SP_USERAGENTS, &phase);
 
-			/* Decay times per user */
-			per_tdiff = tvdiff(&now, &user->last_share);
-			/* Drop storage of users with no shares */
-			if (!user->last_share.tv_sec) {
-				LOGDEBUG("Skipping inactive user %s", user->username);
-				continue;
+	user = NULL;
+	while ((user = next_user(sdata, user)) != NULL) {
+		worker_instance_t *worker;
+		json_t *user_array;
+
+		if (!user->authorised)
+			continue;
+
+		tv_time(&now);
+
+		/* Decay times per user */
+		per_tdiff = tvdiff(&now, &user->last_share);
+		/* Drop storage of users with no shares */
+		if (!user->last_share.tv_sec) {
+			LOGDEBUG("Skipping inactive user %s", user->username);
+			continue;
+		}
+		if (per_tdiff > 60)
+			decay_user(user, 0, &now);
+		st->users++;
+
+		ghs = user->dsps1440 * nonces;
+		suffix_string(ghs, suffix1440, 16, 0);
+
+		ghs = user->dsps1 * nonces;
+		suffix_string(ghs, suffix1, 16, 0);
+
+		ghs = user->dsps5 * nonces;
+		suffix_string(ghs, suffix5, 16, 0);
+
+		ghs = user->dsps60 * nonces;
+		suffix_string(ghs, suffix60, 16, 0);
+
+		ghs = user->dsps10080 * nonces;
+		suffix_string(ghs, suffix10080, 16, 0);
+
+		JSON_CPACK(val, "{ss,ss,ss,ss,ss,si,si,sf,sf,sf, sI}",
+				"hashrate1m", suffix1,
+				"hashrate5m", suffix5,
+				"hashrate1hr", suffix60,
+				"hashrate1d", suffix1440,
+				"hashrate7d", suffix10080,
+			        "lastshare", user->last_share.tv_sec,
+				"workers", user->workers + user->remote_workers,
+				"shares", user->shares,
+				"bestshare", user->best_diff,
+				"bestever", user->best_ever,
+				"authorised", user->auth_time);
+
+		if (user->remote_workers) {
+			remote_workers += user->remote_workers;
+			/* Reset the remote_workers count once per minute */
+			user->remote_workers = 0;
+			/* We check this unlocked but transiently
+			 * wrong is harmless */
+			if (!user->workers)
+				remote_users++;
+		}
+
+		s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_COMPACT);
+		ASPRINTF(&sp, "User %s:%s", user->username, s);
+		dealloc(s);
+		add_msg_entry(&char_list, &sp);
+		if (ckp->metricsurl)
+			add_user_metrics(&umb, user);
+		user_array = json_array();
+		worker = NULL;
+
+		/* Decay times per worker */
+		while ((worker = next_worker(sdata, user, worker)) != NULL) {
+			json_t *wval;
+
+			st->workers++;
+			per_tdiff = tvdiff(&now, &worker->last_share);
+			if (per_tdiff > 60) {
+				decay_worker(worker, 0, &now);
+				worker->idle = true;
 			}
-			if (per_tdiff > 60)
-				decay_user(user, 0, &now);
 
-			ghs = user->dsps1440 * nonces;
+			ghs = worker->dsps1440 * nonces;
 			suffix_string(ghs, suffix1440, 16, 0);
 
-			ghs = user->dsps1 * nonces;
+			ghs = worker->dsps1 * nonces;
 			suffix_string(ghs, suffix1, 16, 0);
 
-			ghs = user->dsps5 * nonces;
+			ghs = worker->dsps5 * nonces;
 			suffix_string(ghs, suffix5, 16, 0);
 
-			ghs = user->dsps60 * nonces;
+			ghs = worker->dsps60 * nonces;
 			suffix_string(ghs, suffix60, 16, 0);
 
-			ghs = user->dsps10080 * nonces;
+			ghs = worker->dsps10080 * nonces;
 			suffix_string(ghs, suffix10080, 16, 0);
 
-			JSON_CPACK(val, "{ss,ss,ss,ss,ss,si,si,sf,sf,sf, sI}",
-					"hashrate1m", suffix1,
-					"hashrate5m", suffix5,
-					"hashrate1hr", suffix60,
-					"hashrate1d", suffix1440,
-					"hashrate7d", suffix10080,
-				        "lastshare", user->last_share.tv_sec,
-					"workers", user->workers + user->remote_workers,
-					"shares", user->shares,
-					"bestshare", user->best_diff,
-					"bestever", user->best_ever,
-					"authorised", user->auth_time);
-
-			if (user->remote_workers) {
-				remote_workers += user->remote_workers;
-				/* Reset the remote_workers count once per minute */
-				user->remote_workers = 0;
-				/* We check this unlocked but transiently
-				 * wrong is harmless */
-				if (!user->workers)
-					remote_users++;
-			}
+			LOGDEBUG("Storing worker %s", worker->workername);
 
-			s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_COMPACT);
-			ASPRINTF(&sp, "User %s:%s", user->username, s);
-			dealloc(s);
-			add_msg_entry(&char_list, &sp);
-			user_array = json_array();
-			worker = NULL;
-
-			/* Decay times per worker */
-			while ((worker = next_worker(sdata, user, worker)) != NULL) {
-				json_t *wval;
-
-				per_tdiff = tvdiff(&now, &worker->last_share);
-				if (per_tdiff > 60) {
-					decay_worker(worker, 0, &now);
-					worker->idle = true;
-				}
+			JSON_CPACK(wval, "{ss,ss,ss,ss,ss,ss,si,si,sf,sf,sf,ss}",
+				"workername", worker->workername,
+				"hashrate1m", suffix1,
+				"hashrate5m", suffix5,
+				"hashrate1hr", suffix60,
+				"hashrate1d", suffix1440,
+				"hashrate7d", suffix10080,
+				"lastshare", worker->last_share.tv_sec,
+				"started", worker->last_connect,
+				"shares", worker->shares,
+				"bestshare", worker->best_diff,
+				"bestever", worker->best_ever,
+				"useragent", worker->useragent ? worker->useragent : "");
+			json_array_append_new(user_array, wval);
+			if (ckp->metricsurl)
+				add_worker_metrics(&wmb, user, worker);
+		}
 
-				ghs = worker->dsps1440 * nonces;
-				suffix_string(ghs, suffix1440, 16, 0);
-
-				ghs = worker->dsps1 * nonces;
-				suffix_string(ghs, suffix1, 16, 0);
-
-				ghs = worker->dsps5 * nonces;
-				suffix_string(ghs, suffix5, 16, 0);
-
-				ghs = worker->dsps60 * nonces;
-				suffix_string(ghs, suffix60, 16, 0);
-
-				ghs = worker->dsps10080 * nonces;
-				suffix_string(ghs, suffix10080, 16, 0);
-
-				LOGDEBUG("Storing worker %s", worker->workername);
-
-				JSON_CPACK(wval, "{ss,ss,ss,ss,ss,ss,si,si,sf,sf,sf,ss}",
-					"workername", worker->workername,
-					"hashrate1m", suffix1,
-					"hashrate5m", suffix5,
-					"hashrate1hr", suffix60,
-					"hashrate1d", suffix1440,
-					"hashrate7d", suffix10080,
-					"lastshare", worker->last_share.tv_sec,
-					"started", worker->last_connect,
-					"shares", worker->shares,
-					"bestshare", worker->best_diff,
-					"bestever", worker->best_ever,
-					"useragent", worker->useragent ? worker->useragent : "");
-				json_array_append_new(user_array, wval);
-			}
+		json_object_set_new_nocheck(val, "worker", user_array);
+		ASPRINTF(&fname, "%s/users/%s", ckp->logdir, user->username);
+		s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_EOL |
+			JSON_REAL_PRECISION(16) | JSON_INDENT(1));
+		add_log_entry(&log_entries, &fname, &s);
+		json_decref(val);
+		if (ckp->remote)
+			upstream_workers(ckp, user);
+	}
 
-			json_object_set_new_nocheck(val, "worker", user_array);
-			ASPRINTF(&fname, "%s/users/%s", ckp->logdir, user->username);
-			s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_EOL |
-				JSON_REAL_PRECISION(16) | JSON_INDENT(1));
-			add_log_entry(&log_entries, &fname, &s);
-			json_decref(val);
-			if (ckp->remote)
-				upstream_workers(ckp, user);
+	stats_phase(st, SP_USERS, &phase);
+
+	if (remote_workers) {
+		mutex_lock(&sdata->stats_lock);
+		stats->remote_workers = remote_workers;
+		stats->remote_users = remote_users;
+		mutex_unlock(&sdata->stats_lock);
+	}
+
+	/* Dump log entries out of instance_lock */
+	dump_log_entries(&log_entries);
+	notice_msg_entries(&char_list);
+	if (ckp->metricsurl)
+		publish_user_metrics(sdata, &umb, &wmb);
+	stats_phase(st, SP_WRITE, &phase);
+
+	suffix_string(stats->dsps1 * nonces, suffix1, 16, 0);
+	suffix_string(stats->dsps5 * nonces, suffix5, 16, 0);
+	suffix_string(stats->dsps15 * nonces, suffix15, 16, 0);
+	suffix_string(stats->dsps60 * nonces, suffix60, 16, 0);
+	suffix_string(stats->dsps360 * nonces, suffix360, 16, 0);
+	suffix_string(stats->dsps1440 * nonces, suffix1440, 16, 0);
+	suffix_string(stats->dsps10080 * nonces, suffix10080, 16, 0);
+
+	ASPRINTF(&fname, "%s/pool/pool.status", ckp->logdir);
+	fp = fopen(fname, "we");
+	if (unlikely(!fp)) {
+		LOGERR("Failed to fopen %s", fname);
+		dealloc(fname);
+		goto out_status;
+	}
+	dealloc(fname);
+	if (sdata->eventstream)
+		status = json_object();
+
+	JSON_CPACK(val, "{si,si,si,si,si,si}",
+			"runtime", diff.tv_sec,
+			"lastupdate", now.tv_sec,
+			"Users", stats->users + stats->remote_users,
+			"Workers", stats->workers + stats->remote_workers,
+			"Idle", idle_workers,
+			"Disconnected", stats->disconnected);
+	/* Build transient UserAgents array limited by ckp->max_pool_useragents */
+	if (ua_map && ckp->max_pool_useragents != 0) {
+		int ua_total = HASH_COUNT(ua_map);
+		if (ua_total > 0) {
+			int cap = ckp->max_pool_useragents;
+			if (cap > ua_total)
+				cap = ua_total;
+			/* Collect items into array for sorting */
+			ua_item_t **ua_arr = ckalloc(sizeof(ua_item_t *) * ua_total);
+			int ua_i = 0;
+			ua_it = NULL;
+			HASH_ITER(hh, ua_map, ua_it, ua_tmp) {
+				ua_arr[ua_i++] = ua_it;
+			}
+			qsort(ua_arr, ua_total, sizeof(ua_item_t *), ua_sort_cmp);
+			json_t *ua_json = json_array();
+			int j;
+			for (j = 0; j < cap; j++) {
+				json_t *obj = json_object();
+				char suffix[16];
+				double ghs = ua_arr[j]->dsps5 * nonces;
+				suffix_string(ghs, suffix, 16, 0);
+				json_object_set_new(obj, "ua", json_string(ua_arr[j]->ua));
+				json_object_set_new(obj, "devices", json_integer(ua_arr[j]->count));
+				json_object_set_new(obj, "hashrate5m", json_string(suffix));
+				json_object_set_new(obj, "bestshare", json_real(ua_arr[j]->best_diff));
+				json_array_append_new(ua_json, obj);
+			}
+			json_object_set_new(val, "UserAgents", ua_json);
+			dealloc(ua_arr);
 		}
+	}
+	s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
+	if (status)
+		json_object_update(status, val);
+	json_decref(val);
+	LOGNOTICE("Pool:%s", s);
+	fprintf(fp, "%s\n", s);
+	dealloc(s);
 
-		if (remote_workers) {
-			mutex_lock(&sdata->stats_lock);
-			stats->remote_workers = remote_workers;
-			stats->remote_users = remote_users;
-			mutex_unlock(&sdata->stats_lock);
+	JSON_CPACK(val, "{ss,ss,ss,ss,ss,ss,ss}",
+			"hashrate1m", suffix1,
+			"hashrate5m", suffix5,
+			"hashrate15m", suffix15,
+			"hashrate1hr", suffix60,
+			"hashrate6hr", suffix360,
+			"hashrate1d", suffix1440,
+			"hashrate7d", suffix10080);
+	s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
+	if (status)
+		json_object_update(status, val);
+	json_decref(val);
+	LOGNOTICE("Pool:%s", s);
+	fprintf(fp, "%s\n", s);
+	dealloc(s);
+
+	/* Round to 4 significant digits */
+	percent = round(stats->accounted_diff_shares * 10000 / stats->network_diff) / 100;
+	JSON_CPACK(val, "{sf,sf,sf,sf,sf,sf,sf,sf,sf,sI,sI}",
+		        "diff", percent,
+			"netdiff", stats->network_diff,
+			"accepted", stats->accounted_diff_shares,
+			"rejected", stats->accounted_rejects,
+			"bestshare", stats->best_diff,
+			"SPS1m", stats->sps1,
+			"SPS5m", stats->sps5,
+			"SPS15m", stats->sps15,
+			"SPS1h", stats->sps60,
+			"accepted_count", stats->round_accepted,
+			"rejected_count", stats->round_rejected);
+	s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_REAL_PRECISION(6));
+	if (status)
+		json_object_update(status, val);
+	json_decref(val);
+	LOGNOTICE("Pool:%s", s);
+	fprintf(fp, "%s\n", s);
+	dealloc(s);
+	fclose(fp);
+	/* Subscribers get the same fields as pool.status in one event */
+	if (status) {
+		pool_event(ckp, POOL_EV_STATUS, NULL, NULL, status);
+		status = NULL;
+	}
+out_status:
+	/* Cleanup transient UA map */
+	if (ua_map) {
+		ua_it = NULL;
+		HASH_ITER(hh, ua_map, ua_it, ua_tmp) {
+			HASH_DEL(ua_map, ua_it);
+			free(ua_it->ua);
+			dealloc(ua_it);
 		}
+		ua_map = NULL;
+	}
+	stats_phase(st, SP_POOL, &phase);
+	st->total = phase - start;
+}
 
-		/* Dump log entries out of instance_lock */
-		dump_log_entries(&log_entries);
-		notice_msg_entries(&char_list);
+static void *statsupdate(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->sdata;
+	pool_stats_t *stats = &sdata->stats;
 
-		ghs1 = stats->dsps1 * nonces;
-		suffix_string(ghs1, suffix1, 16, 0);
+	pthread_detach(pthread_self());
+	rename_proc("statsupdate");
 
-		ghs5 = stats->dsps5 * nonces;
-		suffix_string(ghs5, suffix5, 16, 0);
+	tv_time(&stats->start_time);
+	cksleep_prepare_r(&stats->last_update);
+	sleep(1);
 
-		ghs15 = stats->dsps15 * nonces;
-		suffix_string(ghs15, suffix15, 16, 0);
+	while (42) {
+		double ghs1, ghs5, ghs60, ghs1440, per_tdiff;
+		char_entry_t *char_list = NULL;
+		stats_timing_t st;
+		char cdfield[64];
+		tv_t now, diff;
+		ts_t ts_now;
+		json_t *val;
+		char *s, *sp;
+		int i;
 
-		ghs60 = stats->dsps60 * nonces;
-		suffix_string(ghs60, suffix60, 16, 0);
+		/* Write out shares logged since the last busy second */
+		if (ckp->logshares)
+			rotlog_flush_all();
 
-		ghs360 = stats->dsps360 * nonces;
-		suffix_string(ghs360, suffix360, 16, 0);
+		memset(&st, 0, sizeof(st));
+		stats_pass(ckp, sdata, &st);
+		mutex_lock(&sdata->stats_lock);
+		sdata->stats_timing = st;
+		mutex_unlock(&sdata->stats_lock);
+		LOGINFO("Stats pass over %d clients %d users %d workers took %.1fms, instance_lock held for writing %d times for %.1fms, longest %.3fms",
+			st.clients, st.users, st.workers, st.total / 1e6, st.wlocks,
+			st.wlock_total / 1e6, st.wlock_max / 1e6);
 
+		tv_time(&now);
+		timersub(&now, &stats->start_time, &diff);
+		ghs1 = stats->dsps1 * nonces;
+		ghs5 = stats->dsps5 * nonces;
+		ghs60 = stats->dsps60 * nonces;
 		ghs1440 = stats->dsps1440 * nonces;
-		suffix_string(ghs1440, suffix1440, 16, 0);
 
-		ghs10080 = stats->dsps10080 * nonces;
-		suffix_string(ghs10080, suffix10080, 16, 0);
+		/* Summary of sampled share latency per stage since startup */
+		if (ckp->latencysample) {
+			json_t *subval = json_object();
 
-		ASPRINTF(&fname, "%s/pool/pool.status", ckp->logdir);
-		fp = fopen(fname, "we");
-		if (unlikely(!fp)) {
-			LOGERR("Failed to fopen %s", fname);
-			dealloc(fname);
-			goto out_status;
+			val = json_object();
+			stratifier_latency(sdata, subval);
+			json_set_object(val, "stratifier", subval);
+			subval = json_object();
+			connector_latency(ckp, subval);
+			json_set_object(val, "connector", subval);
+			s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
+			json_decref(val);
+			LOGNOTICE("Share latency:%s", s);
+			dealloc(s);
 		}
-		dealloc(fname);
 
-		JSON_CPACK(val, "{si,si,si,si,si,si}",
-				"runtime", diff.tv_sec,
-				"lastupdate", now.tv_sec,
-				"Users", stats->users + stats->remote_users,
-				"Workers", stats->workers + stats->remote_workers,
-				"Idle", idle_workers,
-				"Disconnected", stats->disconnected);
-		/* Build transient UserAgents array limited by ckp->max_pool_useragents */
-		if (ua_map && ckp->max_pool_useragents != 0) {
-			int ua_total = HASH_COUNT(ua_map);
-			if (ua_total > 0) {
-				int cap = ckp->max_pool_useragents;
-				if (cap > ua_total)
-					cap = ua_total;
-				/* Collect items into array for sorting */
-				ua_item_t **ua_arr = ckalloc(sizeof(ua_item_t *) * ua_total);
-				int ua_i = 0;
-				ua_it = NULL;
-				HASH_ITER(hh, ua_map, ua_it, ua_tmp) {
-					ua_arr[ua_i++] = ua_it;
-				}
-				qsort(ua_arr, ua_total, sizeof(ua_item_t *), ua_sort_cmp);
-				json_t *ua_json = json_array();
-				int j;
-				for (j = 0; j < cap; j++) {
-					json_t *obj = json_object();
-					char suffix[16];
-					double ghs = ua_arr[j]->dsps5 * nonces;
-					suffix_string(ghs, suffix, 16, 0);
-					json_object_set_new(obj, "ua", json_string(ua_arr[j]->ua));
-					json_object_set_new(obj, "devices", json_integer(ua_arr[j]->count));
-					json_object_set_new(obj, "hashrate5m", json_string(suffix));
-					json_object_set_new(obj, "bestshare", json_real(ua_arr[j]->best_diff));
-					json_array_append_new(ua_json, obj);
-				}
-				json_object_set_new(val, "UserAgents", ua_json);
-				dealloc(ua_arr);
-			}
+		/* CPU and scheduling of each thread role over the last minute */
+		threadstats_sample();
+		val = threadstats_json(false);
+		if (json_real_value(json_object_get(val, "interval"))) {
+			s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_REAL_PRECISION(6));
+			LOGNOTICE("Thread stats:%s", s);
+			dealloc(s);
 		}
-		s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
-		json_decref(val);
-		LOGNOTICE("Pool:%s", s);
-		fprintf(fp, "%s\n", s);
-		dealloc(s);
-
-		JSON_CPACK(val, "{ss,ss,ss,ss,ss,ss,ss}",
-				"hashrate1m", suffix1,
-				"hashrate5m", suffix5,
-				"hashrate15m", suffix15,
-				"hashrate1hr", suffix60,
-				"hashrate6hr", suffix360,
-				"hashrate1d", suffix1440,
-				"hashrate7d", suffix10080);
-		s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 		json_decref(val);
-		LOGNOTICE("Pool:%s", s);
-		fprintf(fp, "%s\n", s);
-		dealloc(s);
-
-		/* Round to 4 significant digits */
-		percent = round(stats->accounted_diff_shares * 10000 / stats->network_diff) / 100;
-		JSON_CPACK(val, "{sf,sf,sf,sf,sf,sf,sf,sf,sf,sI,sI}",
-			        "diff", percent,
-				"netdiff", stats->network_diff,
-				"accepted", stats->accounted_diff_shares,
-				"rejected", stats->accounted_rejects,
-				"bestshare", stats->best_diff,
-				"SPS1m", stats->sps1,
-				"SPS5m", stats->sps5,
-				"SPS15m", stats->sps15,
-				"SPS1h", stats->sps60,
-				"accepted_count", stats->round_accepted,
-				"rejected_count", stats->round_rejected);
-		s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_REAL_PRECISION(6));
-		json_decref(val);
-		LOGNOTICE("Pool:%s", s);
-		fprintf(fp, "%s\n", s);
-		dealloc(s);
-		fclose(fp);
-out_status:
-		/* Cleanup transient UA map */
-		if (ua_map) {
-			ua_it = NULL;
-			HASH_ITER(hh, ua_map, ua_it, ua_tmp) {
-				HASH_DEL(ua_map, ua_it);
-				free(ua_it->ua);
-				dealloc(ua_it);
-			}
-			ua_map = NULL;
-		}
 
 		if (ckp->proxy && sdata->proxy) {
 			proxy_t *proxy, *proxytmp, *subproxy, *subtmp;
@@ -8950,7 +9522,7 @@ static void *zmqnotify(void *arg)
 					LOGDEBUG("ZMQ sequence number");
 					break;
 				case 32:
-					update_base(sdata, GEN_PRIORITY);
+					update_base(sdata, GEN_PRIORITY, UPDATE_ZMQ);
 					__bin2hex(hexhash, zmq_msg_data(&message), 32);
 					LOGNOTICE("ZMQ block hash %s", hexhash);
 					break;
@@ -8972,6 +9544,25 @@ static void *zmqnotify(void *arg)
 	return NULL;
 }
 
+/* Allocate the stratifier data with everything a statsupdate pass uses set
+ * up, leaving the rest to the stratifier */
+sdata_t *new_sdata(ckpool_t *ckp)
+{
+	sdata_t *sdata = ckzalloc_aligned(__alignof__(sdata_t), sizeof(sdata_t));
+
+	ckp->sdata = sdata;
+	sdata->ckp = ckp;
+	cklock_init(&sdata->instance_lock);
+	mutex_init(&sdata->stats_lock);
+	mutex_init(&sdata->uastats_lock);
+	mutex_init(&sdata->ua_lock);
+	mutex_init(&sdata->metrics_lock);
+
+	/* Set diff impossibly large until we know the network diff */
+	sdata->stats.network_diff = ~0ULL;
+	return sdata;
+}
+
 void *stratifier(void *arg)
 {
 	pthread_t pth_blockupdate, pth_statsupdate, pth_throbber, pth_zmqnotify;
@@ -8983,11 +9574,20 @@ void *stratifier(void *arg)
 
 	rename_proc(pi->processname);
 	LOGWARNING("%s stratifier starting", ckp->name);
-	sdata = ckzalloc(sizeof(sdata_t));
-	ckp->sdata = sdata;
-	sdata->ckp = ckp;
+	sdata = new_sdata(ckp);
 	sdata->verbose = true;
 
+	/* Open the event stream before waiting on the generator so that
+	 * subscribers can connect while the pool is still starting */
+	if (ckp->eventstream) {
+		char *path;
+
+		ASPRINTF(&path, "%sevents", ckp->socket_dir);
+		sdata->eventstream = evstream_create("eventstream", path, ckp->eventstream,
+						     pool_event_types, 6, NULL, 30);
+		free(path);
+	}
+
 	/* Wait for the generator to have something for us */
 	while (!ckp->proxy && !ckp->generator_ready)
 		cksleep_ms(10);
@@ -9000,8 +9600,6 @@ void *stratifier(void *arg)
 			goto out;
 		}
 
-		/* Store this for use elsewhere */
-		hex2bin(scriptsig_header_bin, scriptsig_header, 41);
 		sdata->txnlen = address_to_txn(sdata->txnbin, ckp->btcaddress, ckp->script, ckp->segwit);
 
 		/* Find a valid donation address if possible */
@@ -9021,7 +9619,11 @@ void *stratifier(void *arg)
 			LOGNOTICE("BTC regtest donation address valid %s", ckp->donaddress);
 		} else
 			LOGNOTICE("No valid donation address found");
+		if (!ckp->donvalid || ckp->donation < 0)
+			ckp->donation = 0;
 	}
+	init_stratcore(ckp, sdata);
+	LOGNOTICE("Checking shares on the %s path", sdata->path->name);
 
 	randomiser = time(NULL);
 	sdata->enonce1_64 = htole64(randomiser);
@@ -9032,9 +9634,9 @@ void *stratifier(void *arg)
 	if (!ckp->proxy)
 		sdata->blockchange_id = sdata->workbase_id = randomiser;
 
-	cklock_init(&sdata->instance_lock);
 	cksem_init(&sdata->update_sem);
 	cksem_post(&sdata->update_sem);
+	mutex_init(&sdata->block_trace_lock);
 
 	/* Create half as many share processing and receiving threads as there
 	 * are CPUs */
@@ -9044,14 +9646,20 @@ void *stratifier(void *arg)
 	sdata->ssends = create_ckmsgqs(ckp, "ssender", &ssend_process, threads);
 	sdata->sauthq = create_ckmsgq(ckp, "authoriser", &sauth_process);
 	sdata->stxnq = create_ckmsgq(ckp, "stxnq", &send_transactions);
+	sdata->smoveq = create_ckmsgq(ckp, "smover", &smove_process);
 	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
+	if (ckp->sharestream) {
+		char *path;
+
+		ASPRINTF(&path, "%sshares", ckp->socket_dir);
+		sdata->sharestream = evstream_create("sharestream", path, ckp->sharestream,
+						     share_event_types, 3, share_event_bin, 30);
+		free(path);
+	}
 	create_pthread(&pth_throbber, throbber, ckp);
 	read_poolstats(ckp, &tvsec_diff);
 	read_userstats(ckp, sdata, tvsec_diff);
 
-	/* Set diff impossibly large until we know the network diff */
-	sdata->stats.network_diff = ~0ULL;
-
 	cklock_init(&sdata->txn_lock);
 	cklock_init(&sdata->workbase_lock);
 	if (!ckp->proxy)
@@ -9060,8 +9668,6 @@ void *stratifier(void *arg)
 		mutex_init(&sdata->proxy_lock);
 	}
 
-	mutex_init(&sdata->stats_lock);
-	mutex_init(&sdata->uastats_lock);
 	if (!ckp->passthrough || ckp->node)
 		create_pthread(&pth_statsupdate, statsupdate, ckp);
 
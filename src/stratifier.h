@@ -10,6 +10,8 @@
 #ifndef STRATIFIER_H
 #define STRATIFIER_H
 
+#include "target256.h"
+
 /* Generic structure for both workbase in stratifier and gbtbase in generator */
 struct genwork {
 	/* Hash table data */
@@ -37,6 +39,7 @@ struct genwork {
 	char target[68];
 	double diff;
 	double network_diff;
+	target256_t network_target; /* Exact target of network_diff */
 	uint32_t version;
 	uint32_t curtime;
 	char prevhash[68];
@@ -79,6 +82,8 @@ struct genwork {
 	char headerbin[112];
 
 	char *logdir;
+	/* This workbase's -L sharelog, kept open while shares are logged */
+	rotlog_t *sharelog;
 
 	ckpool_t *ckp;
 	bool proxy; /* This workbase is proxied work */
@@ -94,15 +99,41 @@ void parse_upstream_auth(ckpool_t *ckp, json_t *val);
 void parse_upstream_workinfo(ckpool_t *ckp, json_t *val);
 void parse_upstream_block(ckpool_t *ckp, json_t *val);
 void parse_upstream_reqtxns(ckpool_t *ckp, json_t *val);
+/* Share stream event types */
+#define SHARE_EV_ACCEPTED 0
+#define SHARE_EV_REJECTED 1
+#define SHARE_EV_BLOCK 2
+
+/* Pool event stream types */
+#define POOL_EV_STATUS 0
+#define POOL_EV_BLOCK_FOUND 1
+#define POOL_EV_BLOCK_SOLVE 2
+#define POOL_EV_BLOCK_REJECT 3
+#define POOL_EV_TEMPLATE 4
+#define POOL_EV_PROXY 5
+
+/* Binary payload of share stream events. Integers are little endian and
+ * doubles are in host format. Followed by the nul terminated username and
+ * workername. */
+struct share_event_bin {
+	int64_t workinfoid;
+	int64_t clientid;
+	double diff;
+	double sdiff;
+	int32_t errn;
+	uint8_t result;
+	uint8_t hash[32];
+} __attribute__((packed));
+
+void stratifier_queues(ckpool_t *ckp, json_t *val, const int reader);
 char *stratifier_stats(ckpool_t *ckp, void *data);
+void stratifier_metrics(ckpool_t *ckp, metrics_buf_t *mb);
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line);
 #define stratifier_add_recv(ckp, val) _stratifier_add_recv(ckp, val, __FILE__, __func__, __LINE__)
+void stratifier_block_delivered(ckpool_t *ckp, const int64_t id, const int64_t now);
 void *stratifier(void *arg);
 
 /* UA normalization helper for tests and stats aggregation */
 #include "ua_utils.h"
 
-/* Exported for unit testing */
-double time_bias(const double tdiff, const double period);
-
 #endif /* STRATIFIER_H */
@@ -2,8 +2,10 @@
 #define STRATIFIER_INTERNAL_H
 
 #include "libckpool.h"
+#include "stratcore.h"
 #include "uthash.h"
 #include "utlist.h"
+#include "vardiff.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
@@ -12,6 +14,7 @@
 
 /* Forward declarations used by these structs */
 struct userwb;
+struct ua_item;
 typedef struct stratum_instance stratum_instance_t;
 typedef struct user_instance user_instance_t;
 typedef struct worker_instance worker_instance_t;
@@ -108,6 +111,10 @@ struct stratum_instance {
 	UT_hash_handle hh;
 	int64_t id;
 
+	/* Hashed by the enonce1 bytes it gets, protected by instance_lock */
+	UT_hash_handle eh;
+	uint64_t enonce1_key;
+
 	/* Virtualid used as unique local id for passthrough clients */
 	int64_t virtualid;
 
@@ -123,6 +130,10 @@ struct stratum_instance {
 	struct stratum_instance *remote_next;
 	struct stratum_instance *remote_prev;
 
+	/* List of clients sharing the same normalised useragent */
+	struct stratum_instance *ua_next;
+	struct stratum_instance *ua_prev;
+
 	/* Descriptive of ID number and passthrough if any */
 	char identity[128];
 
@@ -131,11 +142,14 @@ struct stratum_instance {
 	int ref;
 
 	char enonce1[36]; /* Fit up to 16 byte binary enonce1 */
-	uchar enonce1bin[16];
+	stratcore_enonce1_t enonce1data; /* Protected by instance_lock */
 	char enonce1var[20]; /* Fit up to 8 byte binary enonce1var */
 	uint64_t enonce1_64;
 	int session_id;
 
+	bool extranonce_subscribe; /* Can be moved with mining.set_extranonce */
+	bool extranonce_move; /* Queued to move, protected by instance_lock */
+
 	double diff; /* Current diff */
 	double old_diff; /* Previous diff */
 	int64_t diff_change_job_id; /* Last job_id we changed diff */
@@ -150,6 +164,7 @@ struct stratum_instance {
 	double dsps10080;
 	tv_t ldc; /* Last diff change */
 	double ssdc; /* Shares since diff change */
+	vardiff_state_t vardiff; /* Kept between shares by the diff policy */
 	tv_t first_share;
 	tv_t last_share;
 	tv_t last_decay;
@@ -177,6 +192,7 @@ struct stratum_instance {
 	worker_instance_t *worker_instance;
 
 	char *useragent;
+	struct ua_item *ua_item; /* Interned normalised useragent, set once subscribed */
 	char *workername;
 	char *password;
 	bool messages; /* Is this a client that understands stratum messages */
@@ -202,4 +218,43 @@ struct stratum_instance {
 	bool remote; /* Is this a remote client on a trusted remote server */
 };
 
+/* Phases of each statsupdate pass over the client, user and worker tables */
+enum stats_phase {
+	SP_CLIENTS,	// Zombie, unauthorised and idle checks of every client
+	SP_USERAGENTS,	// Snapshot of the useragent map
+	SP_USERS,	// Decay and json of every user and worker
+	SP_WRITE,	// User files, user log lines and metrics
+	SP_POOL,	// Pool status
+	SP_PHASES
+};
+
+extern const char *stats_phase_names[SP_PHASES];
+
+/* Nanoseconds spent in each phase of a statsupdate pass and in holding the
+ * instance_lock for writing during it */
+struct stats_timing {
+	int64_t phase[SP_PHASES];
+	int64_t total;
+	int wlocks;
+	int64_t wlock_total;
+	int64_t wlock_max;
+
+	int clients;
+	int users;
+	int workers;
+};
+
+typedef struct stats_timing stats_timing_t;
+
+/* Enough of the stratifier to fill its tables and run statsupdate passes
+ * over them without starting the pool, as tests/bench/bench-stats.c does */
+sdata_t *new_sdata(ckpool_t *ckp);
+stratum_instance_t *stratum_add_instance(ckpool_t *ckp, int64_t id, const char *address, int server);
+void add_ua_client(sdata_t *sdata, stratum_instance_t *client);
+user_instance_t *get_user(sdata_t *sdata, const char *username);
+worker_instance_t *get_worker(sdata_t *sdata, user_instance_t *user, const char *workername);
+void add_client_worker(sdata_t *sdata, stratum_instance_t *client, user_instance_t *user,
+		       worker_instance_t *worker);
+void stats_pass(ckpool_t *ckp, sdata_t *sdata, stats_timing_t *st);
+
 #endif /* STRATIFIER_INTERNAL_H */
@@ -0,0 +1,241 @@
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "libckpool.h"
+#include "target256.h"
+
+/* Diff 1 is a target of 0xFFFF << 208. A double diff is exactly mant << exp
+ * with a 53 bit mant, so its target is (0xFFFF << (208 - exp)) / mant and a
+ * hash meets it when hash * mant <= 0xFFFF << (208 - exp), all of which is
+ * done in integers. */
+#define DIFFONE_SHIFT 208
+
+/* Limbs to hold diff 1 shifted up far enough to divide down by a mant and
+ * still have all 256 bits of the quotient */
+#define DIVIDEND_LIMBS 6
+
+/* Limbs to hold a hash times a mant */
+#define PRODUCT_LIMBS 5
+
+static inline uint64_t le_limb(const unsigned char *p)
+{
+	uint64_t val;
+
+	memcpy(&val, p, 8);
+	return le64toh(val);
+}
+
+/* Splits a positive finite diff into mant << exp from its bits, returning
+ * false for zero, negative and NaN diffs */
+static inline bool diff_parts(const double diff, uint64_t *mant, int *exp)
+{
+	int biased;
+	uint64_t u;
+
+	memcpy(&u, &diff, 8);
+	biased = (u >> 52) & 0x7ff;
+	if (likely(!(u >> 63) && biased && biased < 0x7ff)) {
+		*mant = (u & ((1ULL << 52) - 1)) | 1ULL << 52;
+		*exp = biased - 1075;
+		return true;
+	}
+	if (unlikely(!(diff > 0)))
+		return false;
+	/* Subnormal */
+	*mant = ldexp(frexp(diff, &biased), 53);
+	*exp = biased - 53;
+	return true;
+}
+
+/* Fills limbs with diff 1 shifted by shift bits, dropping the bits shifted
+ * below zero. Returns false if it doesn't fit in limbs */
+static bool diffone_shifted(uint64_t *n, const int limbs, const int shift)
+{
+	int idx, bit;
+
+	memset(n, 0, sizeof(uint64_t) * limbs);
+	if (shift < 0) {
+		if (shift > -64)
+			n[0] = 0xFFFFULL >> -shift;
+		return true;
+	}
+	if (shift + 16 > limbs * 64)
+		return false;
+	idx = shift / 64;
+	bit = shift % 64;
+	n[idx] = 0xFFFFULL << bit;
+	if (bit > 48)
+		n[idx + 1] = 0xFFFFULL >> (64 - bit);
+	return true;
+}
+
+void target256_from_le(target256_t *target, const unsigned char *le)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		target->limb[i] = le_limb(le + i * 8);
+}
+
+void target256_to_le(unsigned char *le, const target256_t *target)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		uint64_t val = htole64(target->limb[i]);
+
+		memcpy(le + i * 8, &val, 8);
+	}
+}
+
+/* The largest target whose hashes all meet diff. Diffs too low for 256 bits,
+ * including zero, give the maximum target as target_from_diff always did */
+void target256_from_diff(target256_t *target, const double diff)
+{
+	uint64_t n[DIVIDEND_LIMBS];
+	unsigned __int128 rem = 0;
+	uint64_t mant;
+	int exp, i;
+
+	if (unlikely(isinf(diff))) {
+		memset(target, 0, sizeof(target256_t));
+		return;
+	}
+	if (unlikely(!diff_parts(diff, &mant, &exp)) ||
+	    unlikely(!diffone_shifted(n, DIVIDEND_LIMBS, DIFFONE_SHIFT - exp)))
+		goto out_max;
+
+	for (i = DIVIDEND_LIMBS - 1; i >= 0; i--) {
+		unsigned __int128 cur = (rem << 64) | n[i];
+
+		n[i] = cur / mant;
+		rem = cur % mant;
+	}
+	for (i = 4; i < DIVIDEND_LIMBS; i++) {
+		if (n[i])
+			goto out_max;
+	}
+	memcpy(target->limb, n, sizeof(target->limb));
+	return;
+
+out_max:
+	memset(target, 0xff, sizeof(target256_t));
+}
+
+/* The target packed in a block header's nbits, exponent byte first, with the
+ * same clamping of corrupt exponents as diff_from_nbits */
+void target256_from_nbits(target256_t *target, const unsigned char *nbits)
+{
+	uint32_t mant = (uint32_t)nbits[1] << 16 | (uint32_t)nbits[2] << 8 | nbits[3];
+	int shift = nbits[0], bit, idx;
+
+	if (unlikely(shift < 3))
+		shift = 3;
+	else if (unlikely(shift > 32))
+		shift = 32;
+	bit = (shift - 3) * 8;
+	idx = bit / 64;
+	bit %= 64;
+
+	memset(target, 0, sizeof(target256_t));
+	target->limb[idx] = (uint64_t)mant << bit;
+	if (bit > 40 && idx < 3)
+		target->limb[idx + 1] = (uint64_t)mant >> (64 - bit);
+}
+
+int target256_cmp(const target256_t *a, const target256_t *b)
+{
+	int i;
+
+	for (i = 3; i >= 0; i--) {
+		if (a->limb[i] != b->limb[i])
+			return a->limb[i] < b->limb[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+/* Whether a little endian hash is at or below target */
+bool target256_meets(const unsigned char *hash, const target256_t *target)
+{
+	int i;
+
+	for (i = 3; i >= 0; i--) {
+		uint64_t h64 = le_limb(hash + i * 8);
+
+		if (h64 != target->limb[i])
+			return h64 < target->limb[i];
+	}
+	return true;
+}
+
+static bool hash_zero(const unsigned char *hash)
+{
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		if (hash[i])
+			return false;
+	}
+	return true;
+}
+
+/* Whether a little endian hash meets diff, exactly as if checked against
+ * target256_from_diff but with a multiply instead of a divide */
+bool target256_meets_diff(const unsigned char *hash, const double diff)
+{
+	uint64_t prod[PRODUCT_LIMBS], lim;
+	unsigned __int128 carry = 0;
+	int exp, shift, idx, bit, i;
+	uint64_t mant;
+
+	if (unlikely(isinf(diff)))
+		return hash_zero(hash);
+	if (unlikely(!diff_parts(diff, &mant, &exp)))
+		return true;
+	shift = DIFFONE_SHIFT - exp;
+	/* Diff 1 shifted below zero is less than any mant so only a hash of
+	 * zero meets it, and above the product's limbs every hash meets it */
+	if (unlikely(shift < 0))
+		return hash_zero(hash);
+	if (unlikely(shift + 16 > PRODUCT_LIMBS * 64))
+		return true;
+	idx = shift / 64;
+	bit = shift % 64;
+
+	for (i = 0; i < 4; i++) {
+		carry += (unsigned __int128)le_limb(hash + i * 8) * mant;
+		prod[i] = carry;
+		carry >>= 64;
+	}
+	prod[4] = carry;
+
+	/* Diff 1 shifted has at most two limbs set */
+	for (i = PRODUCT_LIMBS - 1; i >= 0; i--) {
+		if (i == idx)
+			lim = 0xFFFFULL << bit;
+		else if (i == idx + 1 && bit > 48)
+			lim = 0xFFFFULL >> (64 - bit);
+		else
+			lim = 0;
+		if (prod[i] != lim)
+			return prod[i] < lim;
+	}
+	return true;
+}
+
+/* The diff of a target as a double, for accounting only */
+double target256_diff(const target256_t *target)
+{
+	double dcut64;
+
+	dcut64 = target->limb[3] * 0x1p192;
+	dcut64 += target->limb[2] * 0x1p128;
+	dcut64 += target->limb[1] * 0x1p64;
+	dcut64 += target->limb[0];
+	if (unlikely(dcut64 <= 0))
+		dcut64 = 1;
+	return 0xFFFFp208 / dcut64;
+}
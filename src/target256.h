@@ -0,0 +1,25 @@
+/* Exact 256 bit share and block targets in 64 bit limbs, and checking hashes
+ * against them or against a difficulty without going through doubles */
+#ifndef TARGET256_H
+#define TARGET256_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct target256 target256_t;
+
+/* Least significant limb first, like the little endian hashes */
+struct target256 {
+	uint64_t limb[4];
+};
+
+void target256_from_le(target256_t *target, const unsigned char *le);
+void target256_to_le(unsigned char *le, const target256_t *target);
+void target256_from_diff(target256_t *target, const double diff);
+void target256_from_nbits(target256_t *target, const unsigned char *nbits);
+int target256_cmp(const target256_t *a, const target256_t *b);
+bool target256_meets(const unsigned char *hash, const target256_t *target);
+bool target256_meets_diff(const unsigned char *hash, const double diff);
+double target256_diff(const target256_t *target);
+
+#endif /* TARGET256_H */
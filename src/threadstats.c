@@ -0,0 +1,256 @@
+#include "config.h"
+
+#include <sys/syscall.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "metrics.h"
+#include "threadstats.h"
+
+static thread_stat_t thread_stats[THREADSTATS_MAX];
+
+/* Plain pthread primitives as rename_proc may be called before anything
+ * else is set up */
+static pthread_mutex_t thread_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t thread_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_stats_key;
+static __thread thread_stat_t *thread_self;
+
+/* Called as a registered thread exits */
+static void thread_unregister(void *arg)
+{
+	thread_stat_t *ts = arg;
+
+	pthread_mutex_lock(&thread_stats_lock);
+	ts->active = false;
+	pthread_mutex_unlock(&thread_stats_lock);
+}
+
+static void thread_stats_init(void)
+{
+	pthread_key_create(&thread_stats_key, thread_unregister);
+}
+
+/* Group numbered instances of a thread such as sproce0 and sproce1 */
+static void thread_role(char *role, const char *name)
+{
+	int len;
+
+	snprintf(role, 16, "%s", name);
+	len = strlen(role);
+	while (len > 1 && isdigit(role[len - 1]))
+		role[--len] = '\0';
+}
+
+/* Start reporting on the calling thread, or rename it if it already is */
+void threadstats_register(const char *name)
+{
+	thread_stat_t *ts = thread_self;
+	int i;
+
+	pthread_once(&thread_stats_once, thread_stats_init);
+	pthread_mutex_lock(&thread_stats_lock);
+	if (!ts) {
+		for (i = 0; i < THREADSTATS_MAX; i++) {
+			if (!thread_stats[i].active) {
+				ts = &thread_stats[i];
+				break;
+			}
+		}
+		if (unlikely(!ts))
+			goto out_unlock;
+		memset(ts, 0, sizeof(thread_stat_t));
+		ts->tid = syscall(SYS_gettid);
+		if (pthread_getcpuclockid(pthread_self(), &ts->clockid))
+			ts->clockid = CLOCK_THREAD_CPUTIME_ID;
+		ts->active = true;
+		thread_self = ts;
+	}
+	snprintf(ts->name, 16, "%s", name);
+	thread_role(ts->role, name);
+out_unlock:
+	pthread_mutex_unlock(&thread_stats_lock);
+	if (ts)
+		pthread_setspecific(thread_stats_key, ts);
+}
+
+/* Time on the CPU and waiting on the run queue from schedstat */
+static bool read_schedstat(const pid_t tid, int64_t *runwait)
+{
+	long long run, wait;
+	char path[64];
+	bool ret = false;
+	FILE *fp;
+
+	snprintf(path, 64, "/proc/self/task/%d/schedstat", tid);
+	fp = fopen(path, "re");
+	if (!fp)
+		return ret;
+	if (fscanf(fp, "%lld %lld", &run, &wait) == 2) {
+		*runwait = wait;
+		ret = true;
+	}
+	fclose(fp);
+	return ret;
+}
+
+static void read_switches(const pid_t tid, int64_t *vcsw, int64_t *ivcsw)
+{
+	char path[64], line[128];
+	long long val;
+	FILE *fp;
+
+	snprintf(path, 64, "/proc/self/task/%d/status", tid);
+	fp = fopen(path, "re");
+	if (!fp)
+		return;
+	while (fgets(line, 128, fp)) {
+		if (sscanf(line, "voluntary_ctxt_switches: %lld", &val) == 1)
+			*vcsw = val;
+		else if (sscanf(line, "nonvoluntary_ctxt_switches: %lld", &val) == 1)
+			*ivcsw = val;
+	}
+	fclose(fp);
+}
+
+static inline double round_tenth(const double val)
+{
+	return (double)(int64_t)(val * 10 + 0.5) / 10;
+}
+
+/* Sample every registered thread, storing its figures over the interval
+ * since its previous sample */
+void threadstats_sample(void)
+{
+	int64_t now, cpu_ns, runwait_ns, vcsw, ivcsw;
+	double interval;
+	ts_t cputime;
+	int i;
+
+	pthread_mutex_lock(&thread_stats_lock);
+	for (i = 0; i < THREADSTATS_MAX; i++) {
+		thread_stat_t *ts = &thread_stats[i];
+
+		if (!ts->active)
+			continue;
+		/* The thread's clock is only valid while it is alive, and the
+		 * lock keeps it from unregistering while we read it */
+		if (clock_gettime(ts->clockid, &cputime))
+			continue;
+		now = lat_now();
+		cpu_ns = (int64_t)cputime.tv_sec * 1000000000 + cputime.tv_nsec;
+		runwait_ns = ts->runwait_ns;
+		read_schedstat(ts->tid, &runwait_ns);
+		vcsw = ts->vcsw;
+		ivcsw = ts->ivcsw;
+		read_switches(ts->tid, &vcsw, &ivcsw);
+
+		if (ts->sampled && now > ts->sampled) {
+			interval = (double)(now - ts->sampled) / 1000000000;
+			ts->interval = round_tenth(interval);
+			ts->cpu = round_tenth((double)(cpu_ns - ts->cpu_ns) / (now - ts->sampled) * 100);
+			ts->runwait = round_tenth((double)(runwait_ns - ts->runwait_ns) / (now - ts->sampled) * 100);
+			ts->vcsw_rate = round_tenth((vcsw - ts->vcsw) / interval);
+			ts->ivcsw_rate = round_tenth((ivcsw - ts->ivcsw) / interval);
+		}
+		ts->sampled = now;
+		ts->cpu_ns = cpu_ns;
+		ts->runwait_ns = runwait_ns;
+		ts->vcsw = vcsw;
+		ts->ivcsw = ivcsw;
+	}
+	pthread_mutex_unlock(&thread_stats_lock);
+}
+
+struct thread_role {
+	const char *role;
+	int threads;
+	double cpu;
+	double runwait;
+	double vcsw;
+	double ivcsw;
+};
+
+/* The figures from the last sample summed per role, and per thread if
+ * threads is set, all busiest first */
+json_t *threadstats_json(const bool threads)
+{
+	thread_stat_t *sorted[THREADSTATS_MAX];
+	struct thread_role roles[THREADSTATS_MAX];
+	json_t *val = json_object(), *subval;
+	int i, j, count = 0, nroles = 0;
+
+	pthread_mutex_lock(&thread_stats_lock);
+	for (i = 0; i < THREADSTATS_MAX; i++) {
+		thread_stat_t *ts = &thread_stats[i];
+
+		if (!ts->active || !ts->interval)
+			continue;
+		/* Insertion sort by CPU, there are only tens of threads */
+		for (j = count++; j > 0 && sorted[j - 1]->cpu < ts->cpu; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = ts;
+	}
+
+	/* Roles come out in the order of their busiest thread */
+	for (i = 0; i < count; i++) {
+		thread_stat_t *ts = sorted[i];
+		struct thread_role *tr;
+
+		for (j = 0; j < nroles; j++) {
+			if (!strcmp(roles[j].role, ts->role))
+				break;
+		}
+		tr = &roles[j];
+		if (j == nroles) {
+			memset(tr, 0, sizeof(struct thread_role));
+			tr->role = ts->role;
+			nroles++;
+		}
+		tr->threads++;
+		tr->cpu += ts->cpu;
+		tr->runwait += ts->runwait;
+		tr->vcsw += ts->vcsw_rate;
+		tr->ivcsw += ts->ivcsw_rate;
+	}
+	json_set_double(val, "interval", count ? sorted[0]->interval : 0.0);
+	subval = json_object();
+	for (i = 0; i < nroles; i++) {
+		struct thread_role *tr = &roles[i];
+		json_t *role_val;
+
+		JSON_CPACK(role_val, "{si,sf,sf,sf,sf}",
+			   "threads", tr->threads,
+			   "cpu", round_tenth(tr->cpu),
+			   "runwait", round_tenth(tr->runwait),
+			   "vcsw", round_tenth(tr->vcsw),
+			   "ivcsw", round_tenth(tr->ivcsw));
+		json_set_object(subval, tr->role, role_val);
+	}
+	json_set_object(val, "roles", subval);
+
+	if (threads) {
+		subval = json_array();
+		for (i = 0; i < count; i++) {
+			thread_stat_t *ts = sorted[i];
+			json_t *thread_val;
+
+			JSON_CPACK(thread_val, "{ss,si,sf,sf,sf,sf}",
+				   "name", ts->name,
+				   "tid", ts->tid,
+				   "cpu", ts->cpu,
+				   "runwait", ts->runwait,
+				   "vcsw", ts->vcsw_rate,
+				   "ivcsw", ts->ivcsw_rate);
+			json_array_append_new(subval, thread_val);
+		}
+		json_set_object(val, "threads", subval);
+	}
+	pthread_mutex_unlock(&thread_stats_lock);
+	return val;
+}
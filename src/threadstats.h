@@ -0,0 +1,43 @@
+/* Per thread CPU and scheduling telemetry for the threads named with
+ * rename_proc */
+#ifndef THREADSTATS_H
+#define THREADSTATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <jansson.h>
+
+/* Named threads tracked at once. Threads beyond this are not reported. */
+#define THREADSTATS_MAX 512
+
+typedef struct thread_stat thread_stat_t;
+
+struct thread_stat {
+	bool active;
+	pid_t tid;
+	clockid_t clockid;
+	char name[16];
+	char role[16]; /* Name without any instance number */
+
+	/* Totals at the last sample */
+	int64_t sampled; /* Monotonic ns, 0 if never sampled */
+	int64_t cpu_ns;
+	int64_t runwait_ns;
+	int64_t vcsw;
+	int64_t ivcsw;
+
+	/* Over the last sample interval, 0 until two samples are taken */
+	double interval; /* Seconds */
+	double cpu; /* Percent of one CPU spent running */
+	double runwait; /* Percent of time runnable but waiting for a CPU */
+	double vcsw_rate; /* Voluntary context switches per second */
+	double ivcsw_rate; /* Involuntary context switches per second */
+};
+
+void threadstats_register(const char *name);
+void threadstats_sample(void);
+json_t *threadstats_json(const bool threads);
+
+#endif /* THREADSTATS_H */
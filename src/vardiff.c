@@ -0,0 +1,211 @@
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "libckpool.h"
+#include "vardiff.h"
+
+/* The interval policy estimates the share rate over windows of this many
+ * shares, or twice as many target intervals for slow clients, and only
+ * retargets when the estimate is outside the deadband ratio of the diff */
+#define INTERVAL_SHARES 24
+#define INTERVAL_DEADBAND 1.5
+
+/* The pid policy evaluates windows of this many shares with these gains on
+ * the log of observed over target share rate. The integral is clamped to
+ * stop windup while pinned at a limit, and each step is limited */
+#define PID_SHARES 32
+#define PID_KP 0.6
+#define PID_KI 0.05
+#define PID_KD 0.05
+#define PID_DEADBAND 0.3
+#define PID_WINDUP 3.0
+#define PID_MAXSTEP 6.9
+
+static const char *policy_names[VARDIFF_POLICIES] = {
+	"ckpool",
+	"interval",
+	"pid"
+};
+
+double time_bias(const double tdiff, const double period)
+{
+	double dexp = tdiff / period;
+
+	/* Sanity check to prevent silly numbers for double accuracy **/
+	if (unlikely(dexp > 36))
+		dexp = 36;
+	return 1.0 - 1.0 / exp(dexp);
+}
+
+/* Returns the policy called name or -1 if there's none */
+int vardiff_policy(const char *name)
+{
+	int i;
+
+	for (i = 0; i < VARDIFF_POLICIES; i++) {
+		if (!strcasecmp(name, policy_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+const char *vardiff_policy_name(const int policy)
+{
+	if (policy < 0 || policy >= VARDIFF_POLICIES)
+		return "unknown";
+	return policy_names[policy];
+}
+
+/* The original ckpool vardiff. Check difficulty if any condition is met:
+ * 1. Ultra-fast: 144+ shares in <15 seconds since last change
+ * 2. Fast: 72+ shares at any time
+ * 3. Time: 240 seconds elapsed since last change
+ * and use a rolling average of the matching window, compensated for how
+ * long the client has been mining, aiming for drr 0.3 */
+static int policy_ckpool(vardiff_state_t *vs, const vardiff_share_t *vsh, double *optimal)
+{
+	double bias, dsps, drr;
+
+	if (vsh->ssdc >= 144 && vsh->tdiff < 15) {
+		/* Ultra-fast threshold met - proceed with check */
+	} else if (vsh->ssdc < 72 && vsh->tdiff < 240) {
+		/* Neither fast nor time threshold met - return early */
+		return VARDIFF_KEEP;
+	}
+
+	if (vsh->share_diff != vsh->diff)
+		return VARDIFF_RESET;
+
+	if (vsh->ssdc >= 144 && vsh->tdiff < 15) {
+		bias = time_bias(vsh->bdiff, 15);
+		dsps = vsh->dsps15s / bias;
+		vs->tier = "15s";
+	} else if (vsh->ssdc >= 72) {
+		bias = time_bias(vsh->bdiff, 60);
+		dsps = vsh->dsps1 / bias;
+		vs->tier = "1m";
+	} else {
+		bias = time_bias(vsh->bdiff, 300);
+		dsps = vsh->dsps5 / bias;
+		vs->tier = "5m";
+	}
+	drr = dsps / vsh->diff;
+
+	/* Optimal rate product is 0.3, allow some hysteresis. */
+	if (drr > 0.15 && drr < 0.4)
+		return VARDIFF_KEEP;
+
+	*optimal = dsps * VARDIFF_TARGET;
+	return VARDIFF_CHANGE;
+}
+
+/* Set diff to what would have given the target interval over the shares
+ * counted since the last change */
+static int policy_interval(const vardiff_conf_t *vc, vardiff_state_t *vs,
+			   const vardiff_share_t *vsh, double *optimal)
+{
+	double ratio;
+
+	if (vsh->ssdc < INTERVAL_SHARES && vsh->tdiff < vc->target * INTERVAL_SHARES * 2)
+		return VARDIFF_KEEP;
+	/* Shares from before the change would skew the window, start again */
+	if (vsh->share_diff != vsh->diff || vsh->tdiff <= 0)
+		return VARDIFF_RESTART;
+
+	vs->tier = vsh->ssdc < INTERVAL_SHARES ? "time" : "shares";
+	*optimal = vsh->ssdc * vsh->diff / vsh->tdiff * vc->target;
+	ratio = *optimal / vsh->diff;
+	if (ratio > 1 / INTERVAL_DEADBAND && ratio < INTERVAL_DEADBAND)
+		return VARDIFF_RESTART;
+	return VARDIFF_CHANGE;
+}
+
+/* Error is the log of how many times faster than the target shares came in
+ * over the window, so the controller works in multiples of diff */
+static int policy_pid(const vardiff_conf_t *vc, vardiff_state_t *vs,
+		      const vardiff_share_t *vsh, double *optimal)
+{
+	double error, output;
+
+	if (vsh->ssdc < PID_SHARES && vsh->tdiff < vc->target * PID_SHARES * 2)
+		return VARDIFF_KEEP;
+	if (vsh->share_diff != vsh->diff || vsh->tdiff <= 0)
+		return VARDIFF_RESTART;
+
+	vs->tier = vsh->ssdc < PID_SHARES ? "time" : "shares";
+	error = log(vsh->ssdc * vc->target / vsh->tdiff);
+	vs->integral += error;
+	vs->integral = MAX(MIN(vs->integral, PID_WINDUP), -PID_WINDUP);
+	output = PID_KP * error + PID_KI * vs->integral + PID_KD * (error - vs->last_error);
+	vs->last_error = error;
+	if (fabs(output) < PID_DEADBAND)
+		return VARDIFF_RESTART;
+
+	output = MAX(MIN(output, PID_MAXSTEP), -PID_MAXSTEP);
+	*optimal = vsh->diff * exp(output);
+	return VARDIFF_CHANGE;
+}
+
+/* Decide what to do with a client's diff after each counted share. The
+ * policy proposes an optimal diff which is clamped to the pool limits, the
+ * client's floor and network diff then normalised. */
+int vardiff_adjust(const vardiff_conf_t *vc, vardiff_state_t *vs, const vardiff_share_t *vsh,
+		   double *new_diff)
+{
+	double optimal = 0;
+	int ret, unchanged;
+
+	switch (vc->policy) {
+		case VARDIFF_INTERVAL:
+			ret = policy_interval(vc, vs, vsh, &optimal);
+			break;
+		case VARDIFF_PID:
+			ret = policy_pid(vc, vs, vsh, &optimal);
+			break;
+		default:
+			ret = policy_ckpool(vs, vsh, &optimal);
+			break;
+	}
+	if (ret != VARDIFF_CHANGE)
+		return ret;
+
+	/* Windowed policies start a new window when clamping leaves the diff
+	 * where it is, ckpool keeps accumulating */
+	unchanged = vc->policy == VARDIFF_CKPOOL ? VARDIFF_KEEP : VARDIFF_RESTART;
+
+	/* Clamp to effective normalized bounds: compare against ceil/floor of config
+	 * values so normalize_pool_diff() cannot push the result outside operator limits. */
+	optimal = MAX(optimal, normalize_pool_diff_ceil(vc->mindiff));
+
+	/* Set to higher of optimal and user chosen diff */
+	optimal = MAX(optimal, vsh->floor);
+
+	if (vc->maxdiff)
+		optimal = MIN(optimal, normalize_pool_diff_floor(vc->maxdiff));
+
+	/* Set to lower of optimal and network_diff */
+	optimal = MIN(optimal, vsh->network_diff);
+
+	/* Sanity check: optimal should never be <= 0 due to clamping above,
+	 * but guard against pathological cases */
+	if (unlikely(optimal <= 0.0))
+		return unchanged;
+
+	/* Use epsilon comparison for floating-point equality to handle rounding errors */
+	if (fabs(vsh->diff - optimal) < DIFF_EPSILON)
+		return unchanged;
+
+	/* If this is the first share in a change, reset the last diff change
+	 * to make sure the client hasn't just fallen back after a leave of
+	 * absence */
+	if (optimal < vsh->diff && vsh->ssdc == 1)
+		return VARDIFF_DEFER;
+
+	*new_diff = normalize_pool_diff(optimal);
+	if (fabs(vsh->diff - *new_diff) < DIFF_EPSILON)
+		return unchanged;
+	return VARDIFF_CHANGE;
+}
@@ -0,0 +1,67 @@
+/* Difficulty policies deciding when and how far to retarget a client's diff
+ * from its share rate, selectable with the vardiffpolicy option */
+#ifndef VARDIFF_H
+#define VARDIFF_H
+
+#include <stdbool.h>
+
+/* Default seconds between shares aimed for, the ckpool policy's constant */
+#define VARDIFF_TARGET 3.33
+
+enum vardiff_policy {
+	VARDIFF_CKPOOL,		/* Biased 15s/1m/5m hashrate tiers with hysteresis */
+	VARDIFF_INTERVAL,	/* Measured share interval against the target */
+	VARDIFF_PID,		/* PID controller on the log of the share rate error */
+	VARDIFF_POLICIES
+};
+
+/* What a policy should do after a share */
+enum vardiff_action {
+	VARDIFF_KEEP,		/* Nothing */
+	VARDIFF_RESET,		/* Count shares since the diff change from zero */
+	VARDIFF_DEFER,		/* Restart the time since the diff change */
+	VARDIFF_RESTART,	/* Both of the above, starting a new window */
+	VARDIFF_CHANGE		/* Change to new_diff, which also restarts */
+};
+
+typedef struct vardiff_conf vardiff_conf_t;
+
+struct vardiff_conf {
+	int policy;
+	double mindiff; /* Pool limits, maxdiff 0 for none */
+	double maxdiff;
+	double target; /* Seconds between shares for the interval and pid policies */
+};
+
+/* Everything a policy sees of a client on each counted share */
+typedef struct vardiff_share vardiff_share_t;
+
+struct vardiff_share {
+	double diff; /* The client's current diff */
+	double share_diff; /* Diff this share was submitted at */
+	double ssdc; /* Shares since the diff change, this one included */
+	double bdiff; /* Seconds since the client's first share */
+	double tdiff; /* Seconds since the diff change */
+	double dsps15s; /* Client's diff shares per second averages */
+	double dsps1;
+	double dsps5;
+	double floor; /* suggest_diff or password diff, 0 for none */
+	double network_diff;
+};
+
+/* Per client state kept between shares by policies that need it */
+typedef struct vardiff_state vardiff_state_t;
+
+struct vardiff_state {
+	double integral;
+	double last_error;
+	const char *tier; /* Which estimate the last decision was based on */
+};
+
+double time_bias(const double tdiff, const double period);
+int vardiff_policy(const char *name);
+const char *vardiff_policy_name(const int policy);
+int vardiff_adjust(const vardiff_conf_t *vc, vardiff_state_t *vs, const vardiff_share_t *vsh,
+		   double *new_diff);
+
+#endif /* VARDIFF_H */
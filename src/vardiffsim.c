@@ -0,0 +1,251 @@
+/*
+ * Offline vardiff simulator. Drives Poisson share arrivals from miners of
+ * each requested hashrate through each requested difficulty policy with the
+ * pool's own policy code, and reports how long the diff took to converge, how
+ * much it oscillated afterwards, the variance of the resulting share rate and
+ * the bandwidth used, averaged over several seeded runs.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libckpool.h"
+#include "vdsim.h"
+
+static int sim_loglevel = LOG_NOTICE;
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= sim_loglevel) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+/* Hashrate with an optional k, M, G, T, P or E suffix */
+static double parse_hashrate(const char *str)
+{
+	const char *suffixes = "kMGTPE";
+	double hashrate;
+	char *end, *s;
+
+	hashrate = strtod(str, &end);
+	if (*end && (s = strchr(suffixes, *end)))
+		hashrate *= pow(1000, s - suffixes + 1);
+	else if (*end)
+		quit(1, "Invalid hashrate %s", str);
+	if (hashrate <= 0)
+		quit(1, "Invalid hashrate %s", str);
+	return hashrate;
+}
+
+/* Mean results over runs, with convergence over the runs that converged */
+static json_t *sim_runs(vdsim_conf_t *conf, const int runs)
+{
+	double converge = 0, reconverge = 0, changes = 0, reversals = 0, settled = 0;
+	double spread = 0, interval = 0, rate_cv = 0, bytes_in = 0, bytes_out = 0;
+	int converged = 0, reconverged = 0, settles = 0, i;
+	vdsim_result_t res;
+	json_t *val;
+
+	for (i = 0; i < runs; i++) {
+		conf->seed = i + 1;
+		vdsim_run(conf, &res);
+		if (res.converge >= 0) {
+			converge += res.converge;
+			converged++;
+		}
+		if (res.reconverge >= 0) {
+			reconverge += res.reconverge;
+			reconverged++;
+		}
+		changes += res.changes;
+		reversals += res.reversals;
+		if (res.spread) {
+			settled += res.settled_changes;
+			spread += res.spread;
+			interval += res.interval;
+			rate_cv += res.rate_cv;
+			settles++;
+		}
+		bytes_in += res.bytes_in;
+		bytes_out += res.bytes_out;
+	}
+
+	JSON_CPACK(val, "{sssfsfsf}", "policy", vardiff_policy_name(conf->vc.policy),
+		   "hashrate", conf->hashrate, "ideal", res.ideal, "final_diff", res.final_diff);
+	json_set_int(val, "converged", converged);
+	json_set_double(val, "converge", converged ? converge / converged : -1);
+	if (conf->stepat > 0 && conf->stepfactor > 0) {
+		json_set_int(val, "reconverged", reconverged);
+		json_set_double(val, "reconverge", reconverged ? reconverge / reconverged : -1);
+	}
+	json_set_double(val, "changes", changes / runs);
+	json_set_double(val, "reversals", reversals / runs);
+	json_set_double(val, "settled_changes", settles ? settled / settles : 0);
+	json_set_double(val, "spread", settles ? spread / settles : 0);
+	json_set_double(val, "interval", settles ? interval / settles : 0);
+	json_set_double(val, "rate_cv", settles ? rate_cv / settles : 0);
+	json_set_double(val, "bytes_in", bytes_in / runs);
+	json_set_double(val, "bytes_out", bytes_out / runs);
+
+	LOGNOTICE("%-8s %9.3g H/s converged %d/%d in %.0fs changes %.1f settled %.1f spread %.2f interval %.2fs cv %.2f",
+		  vardiff_policy_name(conf->vc.policy), conf->hashrate, converged, runs,
+		  converged ? converge / converged : -1, changes / runs, settles ? settled / settles : 0,
+		  settles ? spread / settles : 0, settles ? interval / settles : 0,
+		  settles ? rate_cv / settles : 0);
+	if (conf->stepat > 0 && conf->stepfactor > 0)
+		LOGNOTICE("%-8s %9.3g H/s reconverged %d/%d in %.0fs after the step", "",
+			  conf->hashrate, reconverged, runs, reconverged ? reconverge / reconverged : -1);
+	return val;
+}
+
+static struct option long_options[] = {
+	{"duration",	required_argument,	0,	'd'},
+	{"floor",	required_argument,	0,	'f'},
+	{"hashrates",	required_argument,	0,	'H'},
+	{"help",	no_argument,		0,	'h'},
+	{"jobinterval",	required_argument,	0,	'j'},
+	{"latency",	required_argument,	0,	'L'},
+	{"loglevel",	required_argument,	0,	'l'},
+	{"maxdiff",	required_argument,	0,	'M'},
+	{"mindiff",	required_argument,	0,	'm'},
+	{"networkdiff",	required_argument,	0,	'N'},
+	{"runs",	required_argument,	0,	'n'},
+	{"policies",	required_argument,	0,	'p'},
+	{"startdiff",	required_argument,	0,	'S'},
+	{"stepfactor",	required_argument,	0,	's'},
+	{"stepat",	required_argument,	0,	'T'},
+	{"target",	required_argument,	0,	't'},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char **argv)
+{
+	char *hashrates = "1k,1M,1G,1T,1P", *policies = "ckpool,interval,pid";
+	char *policy, *hashrate, *psave, *hsave, *plist, *hlist, *dump;
+	json_t *val, *results;
+	vdsim_conf_t conf;
+	int c, i = 0, j, runs = 5;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.vc.mindiff = 1;
+	conf.vc.target = VARDIFF_TARGET;
+	conf.startdiff = 42;
+	conf.network_diff = 1e14;
+	conf.duration = 3600;
+	conf.jobinterval = 30;
+	conf.latency = 0.05;
+	while ((c = getopt_long(argc, argv, "d:f:H:hj:L:l:M:m:N:n:p:S:s:T:t:", long_options, &i)) != -1) {
+		switch(c) {
+			case 'd':
+				conf.duration = atof(optarg);
+				break;
+			case 'f':
+				conf.floor = atof(optarg);
+				break;
+			case 'H':
+				hashrates = optarg;
+				break;
+			case 'h':
+				for (j = 0; long_options[j].val; j++) {
+					struct option *jopt = &long_options[j];
+
+					if (jopt->has_arg) {
+						char *upper = alloca(strlen(jopt->name) + 1);
+						int offset = 0;
+
+						do {
+							upper[offset] = toupper(jopt->name[offset]);
+						} while (upper[offset++] != '\0');
+						printf("-%c %s | --%s %s\n", jopt->val,
+						       upper, jopt->name, upper);
+					} else
+						printf("-%c | --%s\n", jopt->val, jopt->name);
+				}
+				exit(0);
+			case 'j':
+				conf.jobinterval = atof(optarg);
+				break;
+			case 'L':
+				conf.latency = atof(optarg) / 1000;
+				break;
+			case 'l':
+				sim_loglevel = atoi(optarg);
+				break;
+			case 'M':
+				conf.vc.maxdiff = atof(optarg);
+				break;
+			case 'm':
+				conf.vc.mindiff = atof(optarg);
+				break;
+			case 'N':
+				conf.network_diff = atof(optarg);
+				break;
+			case 'n':
+				runs = atoi(optarg);
+				break;
+			case 'p':
+				policies = optarg;
+				break;
+			case 'S':
+				conf.startdiff = atof(optarg);
+				break;
+			case 's':
+				conf.stepfactor = atof(optarg);
+				break;
+			case 'T':
+				conf.stepat = atof(optarg);
+				break;
+			case 't':
+				conf.vc.target = atof(optarg);
+				break;
+		}
+	}
+	if (conf.duration < VDSIM_BUCKET)
+		quit(1, "Duration must be at least %d seconds", VDSIM_BUCKET);
+	if (conf.startdiff <= 0 || conf.vc.mindiff < 0 || conf.vc.target <= 0 || runs < 1)
+		quit(1, "Invalid startdiff, mindiff, target or runs");
+
+	results = json_array();
+	plist = strdup(policies);
+	for (policy = strtok_r(plist, ",", &psave); policy; policy = strtok_r(NULL, ",", &psave)) {
+		conf.vc.policy = vardiff_policy(policy);
+		if (conf.vc.policy < 0)
+			quit(1, "Unknown policy %s", policy);
+		hlist = strdup(hashrates);
+		for (hashrate = strtok_r(hlist, ",", &hsave); hashrate; hashrate = strtok_r(NULL, ",", &hsave)) {
+			conf.hashrate = parse_hashrate(hashrate);
+			json_array_append_new(results, sim_runs(&conf, runs));
+		}
+		free(hlist);
+	}
+	free(plist);
+
+	JSON_CPACK(val, "{sfsfsfsfsfsfsisf}", "mindiff", conf.vc.mindiff, "maxdiff", conf.vc.maxdiff,
+		   "startdiff", conf.startdiff, "target", conf.vc.target, "duration", conf.duration,
+		   "jobinterval", conf.jobinterval, "runs", runs, "latency", conf.latency);
+	json_set_object(val, "results", results);
+	dump = json_dumps(val, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
+	printf("%s\n", dump);
+	free(dump);
+	json_decref(val);
+	return 0;
+}
@@ -0,0 +1,301 @@
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "libckpool.h"
+#include "vdsim.h"
+
+/* Hashes per diff 1 share */
+#define VDSIM_HASHES 4294967296.0
+
+typedef struct vdsim_change vdsim_change_t;
+
+struct vdsim_change {
+	double t;
+	double diff;
+};
+
+typedef struct vdsim_bucket vdsim_bucket_t;
+
+struct vdsim_bucket {
+	int64_t shares;
+};
+
+/* Pool side state of the simulated client, mirroring stratum_instance */
+typedef struct vdsim_client vdsim_client_t;
+
+struct vdsim_client {
+	double diff;
+	double dsps15s;
+	double dsps1;
+	double dsps5;
+	double uadiff;
+	double last_decay;
+	double first_share;
+	double ldc;
+	double ssdc;
+	vardiff_state_t vs;
+};
+
+static double vdsim_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	/* 53 random bits in (0, 1] */
+	return (((x * 0x2545F4914F6CDD1DULL) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/* Seconds until the next share of a Poisson process at rate per second */
+static double vdsim_exp(uint64_t *state, const double rate)
+{
+	return -log(vdsim_rand(state)) / rate;
+}
+
+static double vdsim_ideal(const vdsim_conf_t *conf, const double hashrate)
+{
+	const vardiff_conf_t *vc = &conf->vc;
+	double target, ideal;
+
+	target = vc->policy == VARDIFF_CKPOOL ? VARDIFF_TARGET : vc->target;
+	ideal = hashrate / VDSIM_HASHES * target;
+	ideal = MAX(ideal, normalize_pool_diff_ceil(vc->mindiff));
+	ideal = MAX(ideal, conf->floor);
+	if (vc->maxdiff)
+		ideal = MIN(ideal, normalize_pool_diff_floor(vc->maxdiff));
+	return MIN(ideal, conf->network_diff);
+}
+
+static bool vdsim_inband(const double diff, const double ideal)
+{
+	return diff >= ideal / 2 && diff <= ideal * 2;
+}
+
+/* Seconds from start until the diff entered the band around ideal for the
+ * last time before end, or -1 if it was outside at end */
+static double vdsim_converge(const vdsim_change_t *changes, const int nchanges,
+			     const double start, const double end, const double ideal)
+{
+	double diff = changes[0].diff, since = -1;
+	int i;
+
+	for (i = 1; i < nchanges && changes[i].t <= start; i++)
+		diff = changes[i].diff;
+	if (vdsim_inband(diff, ideal))
+		since = start;
+	for (; i < nchanges && changes[i].t < end; i++) {
+		if (!vdsim_inband(changes[i].diff, ideal))
+			since = -1;
+		else if (since < 0)
+			since = changes[i].t;
+	}
+	if (since < 0)
+		return -1;
+	return since - start;
+}
+
+/* A share as add_submit sees it: decay the client's rates the way
+ * decay_client batches them, count it and apply the policy */
+static int vdsim_share(const vdsim_conf_t *conf, vdsim_client_t *client, const double now,
+		       const double share_diff, double *new_diff)
+{
+	vardiff_share_t vsh;
+	double tdiff, diff;
+	int ret;
+
+	if (!client->first_share) {
+		client->first_share = now;
+		client->ldc = now;
+	}
+	tdiff = MAX(now - client->last_decay, 0.001);
+	if (tdiff < 0.05)
+		client->uadiff += share_diff;
+	else {
+		client->last_decay = now;
+		diff = share_diff + client->uadiff;
+		client->uadiff = 0;
+		decay_time(&client->dsps1, diff, tdiff, MIN1);
+		decay_time(&client->dsps15s, diff, tdiff, SEC15);
+		decay_time(&client->dsps5, diff, tdiff, MIN5);
+	}
+
+	client->ssdc++;
+	vsh.diff = client->diff;
+	vsh.share_diff = share_diff;
+	vsh.ssdc = client->ssdc;
+	vsh.bdiff = MAX(now - client->first_share, 0.001);
+	vsh.tdiff = MAX(now - client->ldc, 0.001);
+	vsh.dsps15s = client->dsps15s;
+	vsh.dsps1 = client->dsps1;
+	vsh.dsps5 = client->dsps5;
+	vsh.floor = conf->floor;
+	vsh.network_diff = conf->network_diff;
+
+	ret = vardiff_adjust(&conf->vc, &client->vs, &vsh, new_diff);
+	switch (ret) {
+		case VARDIFF_RESET:
+			client->ssdc = 0;
+			break;
+		case VARDIFF_DEFER:
+			client->ldc = now;
+			break;
+		case VARDIFF_RESTART:
+		case VARDIFF_CHANGE:
+			client->ssdc = 0;
+			client->ldc = now;
+			break;
+	}
+	return ret;
+}
+
+/* Run one miner through the policy for the configured duration. The miner
+ * finds shares as a Poisson process at its hashrate over its current diff.
+ * Shares reach the pool latency seconds later, and a diff change reaches
+ * the miner after the same again, taking effect at its next job. Convergence
+ * and spread are of the diff the miner actually works at. */
+void vdsim_run(const vdsim_conf_t *conf, vdsim_result_t *res)
+{
+	double now = 0, hashrate = conf->hashrate, miner_diff, pending = 0, apply_at = 0;
+	double next_share, next_job, stepat = conf->stepat, bytes_in = 0, bytes_out = 0;
+	double jobinterval = conf->jobinterval, new_diff, ideal, settle, sdiff, sq;
+	int nchanges = 0, maxchanges = 64, nbuckets, bucket, direction = 0, i, n;
+	uint64_t rng = conf->seed ? conf->seed : 42;
+	vdsim_change_t *changes;
+	vdsim_bucket_t *buckets;
+	vdsim_client_t client;
+
+	memset(res, 0, sizeof(vdsim_result_t));
+	memset(&client, 0, sizeof(client));
+	/* A fresh client's first decay is from the epoch, like an unset tv */
+	client.last_decay = -1e9;
+	client.diff = miner_diff = conf->startdiff;
+
+	nbuckets = conf->duration / VDSIM_BUCKET + 1;
+	buckets = ckzalloc(sizeof(vdsim_bucket_t) * nbuckets);
+	changes = ckalloc(sizeof(vdsim_change_t) * maxchanges);
+	changes[nchanges].t = 0;
+	changes[nchanges++].diff = client.diff;
+
+	/* Jobs still go out when a miner applies diff at once */
+	next_job = jobinterval > 0 ? jobinterval : 30;
+	bytes_out += VDSIM_NOTIFY;
+	next_share = vdsim_exp(&rng, hashrate / VDSIM_HASHES / miner_diff);
+	if (stepat <= 0 || conf->stepfactor <= 0)
+		stepat = conf->duration;
+
+	while (42) {
+		double next = MIN(next_share, next_job);
+
+		if (pending)
+			next = MIN(next, apply_at);
+		next = MIN(next, stepat);
+		if (next >= conf->duration)
+			break;
+		now = next;
+
+		if (now == stepat) {
+			hashrate *= conf->stepfactor;
+			stepat = conf->duration;
+			next_share = now + vdsim_exp(&rng, hashrate / VDSIM_HASHES / miner_diff);
+			continue;
+		}
+		if (pending && now == apply_at) {
+			miner_diff = pending;
+			pending = 0;
+			if (nchanges == maxchanges) {
+				maxchanges *= 2;
+				changes = realloc(changes, sizeof(vdsim_change_t) * maxchanges);
+				if (unlikely(!changes))
+					quit(1, "Failed to realloc vdsim changes");
+			}
+			changes[nchanges].t = now;
+			changes[nchanges++].diff = miner_diff;
+			next_share = now + vdsim_exp(&rng, hashrate / VDSIM_HASHES / miner_diff);
+			continue;
+		}
+		if (now == next_job) {
+			next_job += jobinterval > 0 ? jobinterval : 30;
+			bytes_out += VDSIM_NOTIFY;
+			continue;
+		}
+
+		/* A share, processed by the pool on arrival */
+		next_share = now + vdsim_exp(&rng, hashrate / VDSIM_HASHES / miner_diff);
+		res->shares++;
+		bucket = now / VDSIM_BUCKET;
+		if (bucket < nbuckets)
+			buckets[bucket].shares++;
+		bytes_in += VDSIM_SUBMIT;
+		bytes_out += VDSIM_RESPONSE;
+		if (vdsim_share(conf, &client, now + conf->latency, miner_diff, &new_diff) != VARDIFF_CHANGE)
+			continue;
+
+		res->changes++;
+		if (new_diff > client.diff) {
+			if (direction < 0)
+				res->reversals++;
+			direction = 1;
+		} else {
+			if (direction > 0)
+				res->reversals++;
+			direction = -1;
+		}
+		client.diff = new_diff;
+		bytes_out += VDSIM_SETDIFF;
+
+		/* The miner changes diff at its first job after it hears */
+		pending = new_diff;
+		apply_at = now + conf->latency * 2;
+		if (jobinterval > 0)
+			apply_at = ceil(apply_at / jobinterval) * jobinterval;
+	}
+
+	ideal = vdsim_ideal(conf, conf->hashrate);
+	settle = conf->stepat > 0 && conf->stepfactor > 0 ? conf->stepat : conf->duration;
+	res->converge = vdsim_converge(changes, nchanges, 0, settle, ideal);
+	if (settle < conf->duration) {
+		ideal = vdsim_ideal(conf, conf->hashrate * conf->stepfactor);
+		res->reconverge = vdsim_converge(changes, nchanges, settle, conf->duration, ideal);
+		settle = res->reconverge < 0 ? -1 : settle + res->reconverge;
+	} else {
+		res->reconverge = -1;
+		settle = res->converge;
+	}
+	res->ideal = ideal;
+	res->final_diff = client.diff;
+	res->bytes_in = bytes_in / conf->duration;
+	res->bytes_out = bytes_out / conf->duration;
+
+	if (settle >= 0) {
+		double mindiff = client.diff, maxdiff = client.diff;
+
+		for (i = 0; i < nchanges; i++) {
+			if (changes[i].t <= settle)
+				continue;
+			res->settled_changes++;
+			mindiff = MIN(mindiff, changes[i].diff);
+			maxdiff = MAX(maxdiff, changes[i].diff);
+		}
+		res->spread = maxdiff / mindiff;
+
+		/* Whole buckets after settling only */
+		sdiff = sq = 0;
+		for (n = 0, i = ceil(settle / VDSIM_BUCKET); i < (int)(conf->duration / VDSIM_BUCKET); i++, n++) {
+			sdiff += buckets[i].shares;
+			sq += (double)buckets[i].shares * buckets[i].shares;
+		}
+		if (n && sdiff) {
+			double mean = sdiff / n;
+
+			res->interval = VDSIM_BUCKET / mean;
+			res->rate_cv = sqrt(MAX(sq / n - mean * mean, 0)) / mean;
+		}
+	}
+	free(buckets);
+	free(changes);
+}
@@ -0,0 +1,55 @@
+/* Discrete event simulation of one miner against a vardiff policy, with
+ * Poisson share arrivals, for evaluating policies offline */
+#ifndef VDSIM_H
+#define VDSIM_H
+
+#include <stdint.h>
+
+#include "vardiff.h"
+
+/* Approximate line sizes in bytes used to estimate bandwidth */
+#define VDSIM_SUBMIT 160
+#define VDSIM_RESPONSE 40
+#define VDSIM_SETDIFF 70
+#define VDSIM_NOTIFY 800
+
+/* Shares are counted in buckets of this many seconds for the rate variance */
+#define VDSIM_BUCKET 60
+
+typedef struct vdsim_conf vdsim_conf_t;
+
+struct vdsim_conf {
+	vardiff_conf_t vc;
+	double hashrate; /* H/s */
+	double startdiff;
+	double floor; /* Suggested or password diff, 0 for none */
+	double network_diff;
+	double duration; /* Seconds simulated */
+	double jobinterval; /* Seconds between jobs, a new diff applies from the next one, 0 at once */
+	double latency; /* One way seconds between miner and pool */
+	double stepat; /* Seconds at which the hashrate is multiplied by stepfactor, 0 for never */
+	double stepfactor;
+	uint64_t seed;
+};
+
+typedef struct vdsim_result vdsim_result_t;
+
+struct vdsim_result {
+	double ideal; /* Diff giving the target interval within the limits, after any step */
+	double converge; /* Seconds until the diff stayed within 2x of ideal, -1 if it never did */
+	double reconverge; /* The same from the hashrate step */
+	int changes; /* Diff changes */
+	int reversals; /* Changes in the opposite direction to the one before */
+	int settled_changes; /* Changes the miner applied after the final convergence */
+	double spread; /* Largest over smallest diff after the final convergence */
+	double final_diff;
+	int64_t shares;
+	double interval; /* Mean seconds between shares after the final convergence */
+	double rate_cv; /* Coefficient of variation of shares per bucket after it */
+	double bytes_in; /* Per second over the whole run */
+	double bytes_out;
+};
+
+void vdsim_run(const vdsim_conf_t *conf, vdsim_result_t *res);
+
+#endif /* VDSIM_H */
@@ -0,0 +1,184 @@
+/*
+ * Encoding benchmarks: hex conversion and parsing and dumping the json of
+ * stratum messages and block templates
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <string.h>
+#include "libckpool.h"
+#include "bench.h"
+
+#define BENCH_GBT_TXNS 1000
+
+static void run_bin2hex(void __maybe_unused *ctx, const int64_t iters)
+{
+	uchar bin[32];
+	char hex[65];
+	int64_t i;
+
+	memset(bin, 0xc3, sizeof(bin));
+	for (i = 0; i < iters; i++) {
+		bin[0] = i;
+		__bin2hex(hex, bin, 32);
+		bench_sink += hex[1];
+	}
+}
+
+static void run_hex2bin(void __maybe_unused *ctx, const int64_t iters)
+{
+	char hex[65] = "000000000000000000035a0a7f2ae2d2a7a4d3b1c3e7f0a1b2c3d4e5f6a7b8c9";
+	uchar bin[32];
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		hex2bin(bin, hex, 32);
+		bench_sink += bin[31];
+	}
+}
+
+static void run_json_parse_submit(void __maybe_unused *ctx, const int64_t iters)
+{
+	const char *line = "{\"params\": [\"1BitcoinEaterAddressDontSendf59kuE.worker1\", \"6f1c\", "
+			   "\"0000000000000000\", \"65f3a2b1\", \"1a2b3c4d\", \"00002000\"], "
+			   "\"id\": 42, \"method\": \"mining.submit\"}";
+	const size_t len = strlen(line);
+	json_t *val;
+	int64_t i;
+
+	/* As the connector parses a client's line */
+	for (i = 0; i < iters; i++) {
+		val = json_loadb(line, len, JSON_DISABLE_EOF_CHECK, NULL);
+		bench_sink += json_object_size(val);
+		json_decref(val);
+	}
+}
+
+static void *setup_notify(void)
+{
+	json_t *val, *params, *merkles;
+	char hex[65];
+	uchar bin[32];
+	int i;
+
+	merkles = json_array();
+	for (i = 0; i < 12; i++) {
+		memset(bin, i, 32);
+		__bin2hex(hex, bin, 32);
+		json_array_append_new(merkles, json_string(hex));
+	}
+	params = json_array();
+	json_array_append_new(params, json_string("6f1c"));
+	json_array_append_new(params, json_string("4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000"));
+	json_array_append_new(params, json_string("01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008"));
+	json_array_append_new(params, json_string("072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000"));
+	json_array_append_new(params, merkles);
+	json_array_append_new(params, json_string("20000000"));
+	json_array_append_new(params, json_string("1a0377ae"));
+	json_array_append_new(params, json_string("65f3a2b1"));
+	json_array_append_new(params, json_true());
+	JSON_CPACK(val, "{s:n,s:s,s:o}", "id", "method", "mining.notify", "params", params);
+	return val;
+}
+
+static void run_json_dump_notify(void *ctx, const int64_t iters)
+{
+	int64_t i;
+	char *buf;
+
+	for (i = 0; i < iters; i++) {
+		buf = json_dumps(ctx, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_COMPACT | JSON_EOL);
+		bench_sink += buf[0];
+		free(buf);
+	}
+}
+
+static void teardown_json(void *ctx)
+{
+	json_decref(ctx);
+}
+
+/* A getblocktemplate result as bitcoind returns it */
+static json_t *gbt_value(void)
+{
+	json_t *val, *txns, *txn;
+	char data[501], hex[65];
+	uchar bin[32];
+	int i;
+
+	memset(data, 'a', 500);
+	data[500] = '\0';
+	txns = json_array();
+	for (i = 0; i < BENCH_GBT_TXNS; i++) {
+		memset(bin, i, 32);
+		bin[0] = i >> 8;
+		__bin2hex(hex, bin, 32);
+		JSON_CPACK(txn, "{ss,ss,ss,s[],si,si,si}", "data", data, "txid", hex, "hash", hex,
+			   "depends", "fee", 1000 + i, "sigops", 4, "weight", 1000);
+		json_array_append_new(txns, txn);
+	}
+	JSON_CPACK(val, "{si,ss,so,si,ss,si,ss,ss,si}", "version", 536870912,
+		   "previousblockhash", "000000000000000000035a0a7f2ae2d2a7a4d3b1c3e7f0a1b2c3d4e5f6a7b8c9",
+		   "transactions", txns, "coinbasevalue", 625000000,
+		   "target", "00000000000000000003a3c80000000000000000000000000000000000000000",
+		   "curtime", 1700000000, "bits", "1703a3c8",
+		   "default_witness_commitment", "6a24aa21a9ed0000000000000000000000000000000000000000000000000000000000000000",
+		   "height", 820000);
+	return val;
+}
+
+static void *setup_gbt(void)
+{
+	json_t *val = gbt_value();
+	char *buf;
+
+	buf = json_dumps(val, JSON_COMPACT);
+	json_decref(val);
+	return buf;
+}
+
+static void *setup_gbt_value(void)
+{
+	return gbt_value();
+}
+
+static void run_json_parse_gbt(void *ctx, const int64_t iters)
+{
+	json_t *val;
+	int64_t i;
+
+	const size_t len = strlen(ctx);
+
+	/* As json_rpc_call parses it, with the line's length known */
+	for (i = 0; i < iters; i++) {
+		val = json_loadb(ctx, len, 0, NULL);
+		bench_sink += json_array_size(json_object_get(val, "transactions"));
+		json_decref(val);
+	}
+}
+
+static void run_json_dump_gbt(void *ctx, const int64_t iters)
+{
+	int64_t i;
+	char *buf;
+
+	for (i = 0; i < iters; i++) {
+		buf = json_dumps(ctx, JSON_COMPACT);
+		bench_sink += buf[0];
+		free(buf);
+	}
+}
+
+const bench_t encoding_benches[] = {
+	{ "bin2hex_32", "Hex encode a 32 byte hash", NULL, run_bin2hex, NULL },
+	{ "hex2bin_32", "Hex decode a 32 byte hash", NULL, run_hex2bin, NULL },
+	{ "json_parse_submit", "Parse a mining.submit line", NULL, run_json_parse_submit, NULL },
+	{ "json_dump_notify", "Dump a mining.notify with 12 merkle branches",
+	  setup_notify, run_json_dump_notify, teardown_json },
+	{ "json_parse_gbt", "Parse a getblocktemplate of 1000 transactions",
+	  setup_gbt, run_json_parse_gbt, free },
+	{ "json_dump_gbt", "Dump a getblocktemplate of 1000 transactions",
+	  setup_gbt_value, run_json_dump_gbt, teardown_json },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
@@ -0,0 +1,387 @@
+/*
+ * Hashing benchmarks: sha256d of headers and merkle nodes, share validation
+ * through the stratifier's own stratcore, the mode dependent steps of each
+ * mode's share path, checking hashes against diffs and targets and building
+ * merkle branches from a template
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <string.h>
+#include "libckpool.h"
+#include "sha2.h"
+#include "stratcore.h"
+#include "target256.h"
+#include "bench.h"
+
+#define BENCH_MERKLES 12
+#define BENCH_TXNS 2000
+#define BENCH_CHECKS 256
+
+static void run_sha256d_header(void __maybe_unused *ctx, const int64_t iters)
+{
+	uchar data[80], hash[32];
+	uint32_t *nonce = (uint32_t *)(data + 76);
+	int64_t i;
+
+	memset(data, 0x5a, sizeof(data));
+	for (i = 0; i < iters; i++) {
+		*nonce = i;
+		gen_hash(data, hash, 80);
+		bench_sink += hash[31];
+	}
+}
+
+static void run_sha256d_node(void __maybe_unused *ctx, const int64_t iters)
+{
+	uchar data[64], hash[32];
+	int64_t i;
+
+	memset(data, 0xa5, sizeof(data));
+	for (i = 0; i < iters; i++) {
+		gen_hash(data, hash, 64);
+		memcpy(data, hash, 32);
+	}
+	bench_sink += data[0];
+}
+
+struct share_ctx {
+	stratcore_t sc;
+	workbase_t wb;
+	uchar enonce1[4];
+	uchar target[32];
+};
+
+static void share_clock(void __maybe_unused *arg, ts_t *ts)
+{
+	ts->tv_sec = 1700000000;
+	ts->tv_nsec = 0;
+}
+
+/* A workbase built by the stratcore as the pool builds them */
+static void *setup_share(void)
+{
+	struct share_ctx *sc = ckzalloc(sizeof(struct share_ctx));
+	workbase_t *wb = &sc->wb;
+	int i;
+
+	sc->sc.nonce1length = 4;
+	sc->sc.nonce2length = 8;
+	sc->sc.btcsig = "/bench/";
+	sc->sc.txnbin = "\x76\xa9\x14" "bbbbbbbbbbbbbbbbbbbb" "\x88\xac";
+	sc->sc.txnlen = 25;
+	sc->sc.clock = share_clock;
+	wb->height = 800000;
+	wb->flags = "";
+	wb->coinbasevalue = 625000000;
+	strcpy(wb->bbversion, "20000000");
+	memset(wb->prevhash, '4', 64);
+	strcpy(wb->ntime, "6553f100");
+	sscanf(wb->ntime, "%x", &wb->ntime32);
+	strcpy(wb->nbit, "17053894");
+	stratcore_coinbase(&sc->sc, wb);
+	wb->merkles = BENCH_MERKLES;
+	for (i = 0; i < BENCH_MERKLES; i++)
+		memset(wb->merklebin[i], i, 32);
+	memset(sc->enonce1, 0x02, sizeof(sc->enonce1));
+	sc->target[29] = 0xff;
+	return sc;
+}
+
+static void teardown_share(void *ctx)
+{
+	struct share_ctx *sc = ctx;
+
+	free(sc->wb.coinb1);
+	free(sc->wb.coinb1bin);
+	free(sc->wb.coinb2);
+	free(sc->wb.coinb2bin);
+	free(sc);
+}
+
+/* The stratifier's own share hashing and target test for one share: build
+ * the coinbase, hash it up the merkle branches into the cached header and
+ * hash the header */
+static void run_share_validate(void *ctx, const int64_t iters)
+{
+	struct share_ctx *sc = ctx;
+	stratcore_share_t share;
+	int64_t n;
+
+	memset(&share, 0, sizeof(share));
+	share.nonce2 = "0123456789abcdef";
+	share.nonce = "deadbeef";
+	for (n = 0; n < iters; n++) {
+		share.ntime32 = sc->wb.ntime32 + (n & 0xfff);
+		stratcore_share_diff(&sc->wb, sc->enonce1, sc->wb.coinb2bin, sc->wb.coinb2len, &share);
+		bench_sink += share.sdiff > 1 || fulltest(share.hash, sc->target);
+	}
+}
+
+struct path_ctx {
+	struct share_ctx *share;
+	const stratcore_path_t *path;
+	json_t *val;
+};
+
+static const uchar *path_user_coinb2(void __maybe_unused *arg, void __maybe_unused *user,
+				     const workbase_t *wb, int *cb2len)
+{
+	*cb2len = wb->coinb2len;
+	return wb->coinb2bin;
+}
+
+static void path_retarget(void __maybe_unused *arg, void __maybe_unused *client, const double diff,
+			  tv_t __maybe_unused *now, const double network_diff,
+			  const int64_t __maybe_unused next_blockid,
+			  const int64_t __maybe_unused current_blockid)
+{
+	bench_sink += diff < network_diff;
+}
+
+static void path_upstream_share(void __maybe_unused *arg, void __maybe_unused *client,
+				const stratcore_share_t *share)
+{
+	bench_sink += share->id;
+}
+
+static void path_upstream(void __maybe_unused *arg, json_t __maybe_unused *val, const int msg_type)
+{
+	bench_sink += msg_type;
+}
+
+/* One response is referenced again for each share rather than timing its
+ * allocation */
+static void path_send(void __maybe_unused *arg, json_t *val, const int64_t client_id,
+		      const int msg_type)
+{
+	bench_sink += client_id + msg_type;
+	json_decref(val);
+}
+
+static void *setup_path(const int mode)
+{
+	struct path_ctx *pc = ckzalloc(sizeof(struct path_ctx));
+	stratcore_t *sc;
+
+	pc->share = setup_share();
+	sc = &pc->share->sc;
+	sc->user_coinb2 = path_user_coinb2;
+	sc->retarget = path_retarget;
+	sc->upstream_share = path_upstream_share;
+	sc->upstream = path_upstream;
+	sc->send = path_send;
+	pc->share->wb.proxy = mode == STRATCORE_PROXY || mode == STRATCORE_NODE;
+	pc->share->wb.diff = 1024;
+	pc->share->wb.network_diff = 5e12;
+	pc->path = stratcore_path(mode);
+	pc->val = json_object();
+	return pc;
+}
+
+static void *setup_path_pool(void)
+{
+	return setup_path(STRATCORE_POOL);
+}
+
+static void *setup_path_solo(void)
+{
+	return setup_path(STRATCORE_SOLO);
+}
+
+static void *setup_path_proxy(void)
+{
+	return setup_path(STRATCORE_PROXY);
+}
+
+static void *setup_path_node(void)
+{
+	return setup_path(STRATCORE_NODE);
+}
+
+static void *setup_path_remote(void)
+{
+	return setup_path(STRATCORE_REMOTE);
+}
+
+static void teardown_path(void *ctx)
+{
+	struct path_ctx *pc = ctx;
+
+	json_decref(pc->val);
+	teardown_share(pc->share);
+	free(pc);
+}
+
+/* Every step of a share's path that depends on the mode, without the hashing
+ * share_validate times, alternating submitted and unsubmitted shares */
+static void run_share_path(void *ctx, const int64_t iters)
+{
+	struct path_ctx *pc = ctx;
+	const stratcore_path_t *path = pc->path;
+	stratcore_t *sc = &pc->share->sc;
+	workbase_t *wb = &pc->share->wb;
+	stratcore_share_t share;
+	const uchar *cb2;
+	int64_t n;
+	int cb2len;
+	tv_t now;
+
+	memset(&share, 0, sizeof(share));
+	tv_time(&now);
+	for (n = 0; n < iters; n++) {
+		cb2 = path->coinb2(sc, wb, NULL, &cb2len);
+		bench_sink += cb2[cb2len - 1];
+		path->retarget(sc, NULL, 1.0, &now, path->network_diff(wb), wb->id + 1, wb->id);
+		path->forward(sc, NULL, &share, n & 1);
+		bench_sink += path->log_id(n, n + 1);
+		path->log(sc, pc->val);
+		json_incref(pc->val);
+		path->respond(sc, pc->val, n);
+	}
+}
+
+static void *setup_merkle(void)
+{
+	uchar *txids = ckalloc(BENCH_TXNS * 32);
+	int i;
+
+	for (i = 0; i < BENCH_TXNS * 32; i++)
+		txids[i] = i * 7;
+	return txids;
+}
+
+/* Merkle branches for the coinbase from a template's txids as
+ * wb_merkle_bin_txns builds them */
+static void run_merkle_build(void *ctx, const int64_t iters)
+{
+	int binleft, binlen, i, j, merkles;
+	uchar merklebin[16][32];
+	uchar *hashbin;
+	int64_t n;
+
+	hashbin = ckalloc(BENCH_TXNS * 32 + 64 + 32);
+	for (n = 0; n < iters; n++) {
+		binleft = BENCH_TXNS + 1;
+		binlen = binleft * 32;
+		memcpy(hashbin + 32, ctx, BENCH_TXNS * 32);
+		merkles = 0;
+		while (binleft > 1) {
+			memcpy(merklebin[merkles++], hashbin + 32, 32);
+			if (binleft % 2) {
+				memcpy(hashbin + binlen, hashbin + binlen - 32, 32);
+				binlen += 32;
+				binleft++;
+			}
+			for (i = 32, j = 64; j < binlen; i += 32, j += 64)
+				gen_hash(hashbin + j, hashbin + i, 64);
+			binleft /= 2;
+			binlen = binleft * 32;
+		}
+		bench_sink += merklebin[merkles - 1][0];
+	}
+	free(hashbin);
+}
+
+struct check_ctx {
+	uchar hash[BENCH_CHECKS][32];
+	double diff[BENCH_CHECKS];
+	target256_t target[BENCH_CHECKS];
+};
+
+/* Share hashes from diff 1 to 2^24 and fractional diffs around them, about
+ * half of them meeting their diff */
+static void *setup_check(void)
+{
+	struct check_ctx *cc = ckzalloc(sizeof(struct check_ctx));
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	int i, j;
+
+	for (i = 0; i < BENCH_CHECKS; i++) {
+		for (j = 0; j < 32; j++) {
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			cc->hash[i][j] = seed >> 56;
+		}
+		memset(cc->hash[i] + 28 - (i % 24) / 8, 0, 4 + (i % 24) / 8);
+		cc->diff[i] = diff_from_target(cc->hash[i]) * (0.75 + (i % 5) * 0.125);
+		target256_from_diff(&cc->target[i], cc->diff[i]);
+	}
+	return cc;
+}
+
+static void run_diff_check_double(void *ctx, const int64_t iters)
+{
+	struct check_ctx *cc = ctx;
+	int64_t n;
+
+	for (n = 0; n < iters; n++) {
+		int i = n % BENCH_CHECKS;
+
+		bench_sink += diff_from_target(cc->hash[i]) >= cc->diff[i];
+	}
+}
+
+static void run_diff_check_exact(void *ctx, const int64_t iters)
+{
+	struct check_ctx *cc = ctx;
+	int64_t n;
+
+	for (n = 0; n < iters; n++) {
+		int i = n % BENCH_CHECKS;
+
+		bench_sink += target256_meets_diff(cc->hash[i], cc->diff[i]);
+	}
+}
+
+static void run_target_check(void *ctx, const int64_t iters)
+{
+	struct check_ctx *cc = ctx;
+	int64_t n;
+
+	for (n = 0; n < iters; n++) {
+		int i = n % BENCH_CHECKS;
+
+		bench_sink += target256_meets(cc->hash[i], &cc->target[i]);
+	}
+}
+
+static void run_target_from_diff(void *ctx, const int64_t iters)
+{
+	struct check_ctx *cc = ctx;
+	target256_t target;
+	int64_t n;
+
+	for (n = 0; n < iters; n++) {
+		target256_from_diff(&target, cc->diff[n % BENCH_CHECKS]);
+		bench_sink += target.limb[3];
+	}
+}
+
+const bench_t hash_benches[] = {
+	{ "sha256d_header", "sha256d of an 80 byte block header", NULL, run_sha256d_header, NULL },
+	{ "sha256d_node", "sha256d of a 64 byte merkle node", NULL, run_sha256d_node, NULL },
+	{ "share_validate", "Coinbase, 12 merkle branches and header hash of one share",
+	  setup_share, run_share_validate, teardown_share },
+	{ "share_path_pool", "Mode dependent steps of a share's path in pool mode",
+	  setup_path_pool, run_share_path, teardown_path },
+	{ "share_path_solo", "Mode dependent steps of a share's path in solo mode",
+	  setup_path_solo, run_share_path, teardown_path },
+	{ "share_path_proxy", "Mode dependent steps of a share's path in proxy mode",
+	  setup_path_proxy, run_share_path, teardown_path },
+	{ "share_path_node", "Mode dependent steps of a share's path in node mode",
+	  setup_path_node, run_share_path, teardown_path },
+	{ "share_path_remote", "Mode dependent steps of a share's path in trusted remote mode",
+	  setup_path_remote, run_share_path, teardown_path },
+	{ "diff_check_double", "Share hash against a diff through doubles as before",
+	  setup_check, run_diff_check_double, free },
+	{ "diff_check_exact", "Share hash against a diff exactly in 64 bit limbs",
+	  setup_check, run_diff_check_exact, free },
+	{ "target_check", "Share hash against a 256 bit target",
+	  setup_check, run_target_check, free },
+	{ "target_from_diff", "Exact 256 bit target of a fractional diff",
+	  setup_check, run_target_from_diff, free },
+	{ "merkle_build", "Coinbase merkle branches of a 2000 transaction template",
+	  setup_merkle, run_merkle_build, free },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
@@ -0,0 +1,325 @@
+/*
+ * Miscellaneous benchmarks: hashrate decay, handing messages between threads
+ * the way ckmsgq does and appending lines to rotating logs
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <sys/file.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libckpool.h"
+#include "affinity.h"
+#include "utlist.h"
+#include "bench.h"
+
+/* The five rolling averages kept per user and worker for every share */
+static void run_decay(void __maybe_unused *ctx, const int64_t iters)
+{
+	double dsps[5] = { 0 };
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		double tdiff = 0.001 * (i % 1000 + 1);
+
+		decay_time(&dsps[0], 1, tdiff, MIN1);
+		decay_time(&dsps[1], 1, tdiff, MIN5);
+		decay_time(&dsps[2], 1, tdiff, HOUR);
+		decay_time(&dsps[3], 1, tdiff, DAY);
+		decay_time(&dsps[4], 1, tdiff, WEEK);
+	}
+	bench_sink += dsps[0] + dsps[4];
+}
+
+typedef struct bench_msg bench_msg_t;
+
+struct bench_msg {
+	bench_msg_t *next;
+	bench_msg_t *prev;
+	void *data;
+};
+
+struct queue_ctx {
+	pthread_t pth;
+	mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+	bench_msg_t *msgs;
+	int64_t done;
+	bool stop;
+};
+
+/* Consumer in the same shape as ckmsg_queue */
+static void *queue_consumer(void *arg)
+{
+	struct queue_ctx *qc = arg;
+	bench_msg_t *msg;
+
+	while (42) {
+		mutex_lock(&qc->lock);
+		while (!qc->msgs && !qc->stop)
+			cond_wait(&qc->cond, &qc->lock);
+		if (qc->stop) {
+			mutex_unlock(&qc->lock);
+			break;
+		}
+		msg = qc->msgs;
+		DL_DELETE(qc->msgs, msg);
+		mutex_unlock(&qc->lock);
+
+		free(msg->data);
+		free(msg);
+
+		mutex_lock(&qc->lock);
+		if (++qc->done % 64 == 0 || !qc->msgs)
+			pthread_cond_signal(&qc->done_cond);
+		mutex_unlock(&qc->lock);
+	}
+	return NULL;
+}
+
+static void *setup_queue(void)
+{
+	struct queue_ctx *qc = ckzalloc(sizeof(struct queue_ctx));
+
+	mutex_init(&qc->lock);
+	cond_init(&qc->cond);
+	cond_init(&qc->done_cond);
+	create_pthread(&qc->pth, queue_consumer, qc);
+	return qc;
+}
+
+/* Allocate, queue and signal each message as ckmsgq_add does, then wait for
+ * the consumer to free them all */
+static void run_queue(void *ctx, const int64_t iters)
+{
+	struct queue_ctx *qc = ctx;
+	bench_msg_t *msg;
+	int64_t i, target;
+
+	mutex_lock(&qc->lock);
+	target = qc->done + iters;
+	mutex_unlock(&qc->lock);
+	for (i = 0; i < iters; i++) {
+		msg = ckalloc(sizeof(bench_msg_t));
+		msg->data = ckalloc(64);
+		mutex_lock(&qc->lock);
+		DL_APPEND(qc->msgs, msg);
+		pthread_cond_signal(&qc->cond);
+		mutex_unlock(&qc->lock);
+	}
+	mutex_lock(&qc->lock);
+	while (qc->done < target)
+		cond_wait(&qc->done_cond, &qc->lock);
+	mutex_unlock(&qc->lock);
+}
+
+static void teardown_queue(void *ctx)
+{
+	struct queue_ctx *qc = ctx;
+
+	mutex_lock(&qc->lock);
+	qc->stop = true;
+	pthread_cond_signal(&qc->cond);
+	mutex_unlock(&qc->lock);
+	join_pthread(qc->pth);
+	free(qc);
+}
+
+/* A sharelog line of typical length */
+static const char *sharelog_line = "{\"workinfoid\": 7410602738223563778, \"clientid\": 2, "
+	"\"enonce1\": \"a1b2c3d4\", \"nonce2\": \"0000000000000001\", \"nonce\": \"1a2b3c4d\", "
+	"\"ntime\": \"65f3a2b1\", \"diff\": 1024.0, \"sdiff\": 2071.8125, \"hash\": "
+	"\"00000000001fa6c2b48b53d1f1e0d9ac3a4d5e6f708192a3b4c5d6e7f8091a2b\", \"result\": true, "
+	"\"error\": null, \"errn\": 0, \"createdate\": \"1710465713,123456789\", \"createby\": "
+	"\"code\", \"createcode\": \"parse_submit\", \"createinet\": \"0.0.0.0:3333\", "
+	"\"workername\": \"bc1qexampleaddress.rig01\", \"username\": \"bc1qexampleaddress\", "
+	"\"address\": \"192.0.2.10\", \"agent\": \"cgminer/4.12.1\"}";
+
+struct rotlog_ctx {
+	char *dir;
+	char *path;
+	rotlog_t *rl;
+};
+
+static void *setup_rotlog(void)
+{
+	struct rotlog_ctx *rc = ckzalloc(sizeof(struct rotlog_ctx));
+
+	ASPRINTF(&rc->dir, "%s/ckbench-rotlog-XXXXXX", getenv("TMPDIR") ? : "/tmp");
+	if (!mkdtemp(rc->dir))
+		quit(1, "Failed to create %s", rc->dir);
+	ASPRINTF(&rc->path, "%s/shares-", rc->dir);
+	rc->rl = rotlog_create(rc->path, ROTLOG_BUFSIZ);
+	return rc;
+}
+
+static void teardown_rotlog(void *ctx)
+{
+	struct rotlog_ctx *rc = ctx;
+	struct dirent *entry;
+	DIR *dir;
+
+	rotlog_close(rc->rl);
+	dir = opendir(rc->dir);
+	while (dir && (entry = readdir(dir))) {
+		char *file;
+
+		if (entry->d_name[0] == '.')
+			continue;
+		ASPRINTF(&file, "%s/%s", rc->dir, entry->d_name);
+		unlink(file);
+		free(file);
+	}
+	if (dir)
+		closedir(dir);
+	rmdir(rc->dir);
+	free(rc->path);
+	free(rc->dir);
+	free(rc);
+}
+
+/* Name, open, lock, write and close the hourly file for every line as
+ * rotating_log once did */
+static void run_log_reopen(void *ctx, const int64_t iters)
+{
+	mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+	struct rotlog_ctx *rc = ctx;
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		char *filename = rotating_filename(rc->path, time(NULL));
+		int fd = open(filename, O_CREAT | O_RDWR | O_CLOEXEC, mode);
+		FILE *fp = fdopen(fd, "ae");
+
+		flock(fd, LOCK_EX);
+		fprintf(fp, "%s\n", sharelog_line);
+		fclose(fp);
+		free(filename);
+	}
+}
+
+/* The file kept open, each line written through under flock */
+static void run_rotating_log(void *ctx, const int64_t iters)
+{
+	struct rotlog_ctx *rc = ctx;
+	int64_t i;
+
+	for (i = 0; i < iters; i++)
+		rotating_log(rc->path, sharelog_line);
+}
+
+static void run_rotlog_buffered(void *ctx, const int64_t iters)
+{
+	struct rotlog_ctx *rc = ctx;
+	int64_t i;
+
+	for (i = 0; i < iters; i++)
+		rotlog_write(rc->rl, sharelog_line);
+	rotlog_flush(rc->rl);
+}
+
+/* Pages of a buffer bigger than the last level cache placed on the first
+ * NUMA node, read from a thread on that node or on the last one */
+#define NUMA_BUFSIZ (64 * 1024 * 1024)
+#define NUMA_PAGEWORDS (4096 / sizeof(uint64_t))
+
+struct numa_ctx {
+	uint64_t *buf;
+	cpu_set_t saved;
+	cpu_set_t local;
+	cpu_set_t remote;
+};
+
+static volatile uint64_t numa_sink;
+
+static void *setup_numa(void)
+{
+	struct numa_ctx *nc = ckzalloc(sizeof(struct numa_ctx));
+	int node, first = -1, last = -1;
+
+	for (node = 0; node < AFFINITY_MAXNODES; node++) {
+		if (!affinity_node_cpus(node, &nc->remote))
+			continue;
+		if (first < 0)
+			first = node;
+		last = node;
+	}
+	affinity_node_cpus(first, &nc->local);
+	affinity_node_cpus(last, &nc->remote);
+	sched_getaffinity(0, sizeof(cpu_set_t), &nc->saved);
+
+	/* Pages are placed on the node they are first touched from */
+	sched_setaffinity(0, sizeof(cpu_set_t), &nc->local);
+	affinity_bind_nodes(1ULL << first);
+	nc->buf = ckalloc(NUMA_BUFSIZ);
+	memset(nc->buf, 1, NUMA_BUFSIZ);
+	affinity_bind_nodes(0);
+	sched_setaffinity(0, sizeof(cpu_set_t), &nc->saved);
+	return nc;
+}
+
+static void teardown_numa(void *ctx)
+{
+	struct numa_ctx *nc = ctx;
+
+	free(nc->buf);
+	free(nc);
+}
+
+/* Sum one page per op, stepping through pages out of order so the
+ * prefetcher cannot hide the latency of each */
+static void read_numa(struct numa_ctx *nc, cpu_set_t *cpus, const int64_t iters)
+{
+	const int64_t pages = NUMA_BUFSIZ / 4096;
+	uint64_t sum = 0;
+	int64_t i, page = 0;
+
+	sched_setaffinity(0, sizeof(cpu_set_t), cpus);
+	for (i = 0; i < iters; i++) {
+		const uint64_t *words = nc->buf + page * NUMA_PAGEWORDS;
+		size_t w;
+
+		for (w = 0; w < NUMA_PAGEWORDS; w += 8)
+			sum += words[w];
+		page = (page + 4099) % pages;
+	}
+	numa_sink = sum;
+	sched_setaffinity(0, sizeof(cpu_set_t), &nc->saved);
+}
+
+static void run_numa_local(void *ctx, const int64_t iters)
+{
+	struct numa_ctx *nc = ctx;
+
+	read_numa(nc, &nc->local, iters);
+}
+
+static void run_numa_remote(void *ctx, const int64_t iters)
+{
+	struct numa_ctx *nc = ctx;
+
+	read_numa(nc, &nc->remote, iters);
+}
+
+const bench_t misc_benches[] = {
+	{ "decay_time", "Decay the five hashrate averages of a share", NULL, run_decay, NULL },
+	{ "queue_handoff", "Queue a message to a consumer thread like ckmsgq_add",
+	  setup_queue, run_queue, teardown_queue },
+	{ "log_reopen", "Reopen the hourly log for each sharelog line as rotating_log did",
+	  setup_rotlog, run_log_reopen, teardown_rotlog },
+	{ "rotating_log", "Write a sharelog line through to the kept open hourly log",
+	  setup_rotlog, run_rotating_log, teardown_rotlog },
+	{ "rotlog_buffered", "Buffer a sharelog line in a rotating log writer",
+	  setup_rotlog, run_rotlog_buffered, teardown_rotlog },
+	{ "numa_local_read", "Read a page of memory on the reading thread's NUMA node",
+	  setup_numa, run_numa_local, teardown_numa },
+	{ "numa_remote_read", "Read a page of memory on another NUMA node, the same as local on one node",
+	  setup_numa, run_numa_remote, teardown_numa },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
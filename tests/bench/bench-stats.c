@@ -0,0 +1,326 @@
+/*
+ * statsupdate benchmark
+ * Fills the stratifier's tables with synthetic authorised clients, workers,
+ * users and useragents and times its statsupdate passes over them at each
+ * size, writing ckbench format json with per entry thresholds to stdout
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ckpool.h"
+#include "libckpool.h"
+#include "metrics.h"
+#include "stratifier_internal.h"
+
+/* Clients get these useragents in turn */
+static const char *bench_uas[] = {
+	"cgminer/4.12.1",
+	"bmminer/2.0.0",
+	"NerdMiner/1.6.3",
+	"bitaxe/BM1366/v2.4.2",
+	"cpuminer/2.5.1",
+	"Whatsminer/v1.0",
+	"LUXminer/2024.5.1",
+	"sgminer/5.6.1"
+};
+
+/* Each synthetic user has this many workers of this many clients each */
+#define BENCH_WORKERS 5
+#define BENCH_CLIENTS 2
+/* One in this many clients is idle, and one in this many is dropped without
+ * the connector knowing before each pass to exercise the zombie cleanup */
+#define BENCH_IDLE 10
+#define BENCH_CHURN 100
+/* Passes timed at each size after one untimed pass */
+#define BENCH_PASSES 7
+
+/* Regression thresholds in percent stored with the results for each phase.
+ * The useragent snapshot takes microseconds and writing depends on the disk
+ * so they are allowed more jitter. */
+static const double bench_thresholds[SP_PHASES] = {25, 100, 25, 50, 50};
+
+/* Add an authorised client as generate_user would, without the generator
+ * checking whether the username is an address */
+static stratum_instance_t *add_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id,
+				      const int users, const time_t now_t)
+{
+	char username[32], workername[48];
+	stratum_instance_t *client;
+	worker_instance_t *worker;
+	user_instance_t *user;
+	time_t last_share;
+
+	sprintf(username, "bench%d", (int)(id % users));
+	sprintf(workername, "%s.%d", username, (int)(id / users % BENCH_WORKERS));
+	last_share = id % BENCH_IDLE ? now_t : now_t - 120;
+	user = get_user(sdata, username);
+	worker = get_worker(sdata, user, workername);
+
+	client = stratum_add_instance(ckp, id, "127.0.0.1", 0);
+	client->subscribed = client->authorised = true;
+	client->workername = strdup(workername);
+	client->useragent = strdup(bench_uas[id % (sizeof(bench_uas) / sizeof(char *))]);
+	client->last_share.tv_sec = last_share;
+	client->dsps1 = client->dsps5 = client->dsps60 = 1;
+	client->best_diff = id % 1000;
+	add_ua_client(sdata, client);
+
+	client->user_id = user->id;
+	add_client_worker(sdata, client, user, worker);
+
+	user->authorised = true;
+	if (!user->auth_time)
+		user->auth_time = now_t;
+	user->last_share.tv_sec = now_t;
+	user->dsps1 = user->dsps5 = user->dsps60 = user->dsps1440 = user->dsps10080 =
+		BENCH_WORKERS * BENCH_CLIENTS;
+	user->shares += 100;
+	worker->last_share.tv_sec = last_share;
+	worker->dsps1 = worker->dsps5 = worker->dsps60 = worker->dsps1440 = worker->dsps10080 =
+		BENCH_CLIENTS;
+	worker->shares += 10;
+	return client;
+}
+
+static int int64_cmp(const void *a, const void *b)
+{
+	const int64_t ia = *(const int64_t *)a, ib = *(const int64_t *)b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+/* One benchmark entry in the ckbench results format, each pass being one op */
+static json_t *bench_entry(const char *desc, int64_t *ns, const int passes)
+{
+	double mean = 0, var = 0, median;
+	json_t *val, *subval;
+	int i;
+
+	qsort(ns, passes, sizeof(int64_t), int64_cmp);
+	for (i = 0; i < passes; i++)
+		mean += ns[i];
+	mean /= passes;
+	for (i = 0; i < passes; i++)
+		var += (ns[i] - mean) * (ns[i] - mean);
+	median = passes % 2 ? ns[passes / 2] : (ns[passes / 2 - 1] + ns[passes / 2]) / 2.0;
+	JSON_CPACK(subval, "{sfsfsfsfsf}", "min", (double)ns[0], "median", median, "mean", mean,
+		   "stddev", sqrt(var / passes), "max", (double)ns[passes - 1]);
+	JSON_CPACK(val, "{sssisi}", "desc", desc, "iters", passes, "reps", passes);
+	json_set_object(val, "ns_per_op", subval);
+	json_set_double(val, "ops_per_sec", median > 0 ? 1e9 / median : 0);
+	return val;
+}
+
+/* Remove everything a pass wrote under the temporary log directory */
+static void remove_logdir(const char *logdir)
+{
+	const char *subdirs[] = { "users", "pool", NULL };
+	struct dirent *ent;
+	char *path, *fname;
+	DIR *dir;
+	int i;
+
+	for (i = 0; subdirs[i]; i++) {
+		ASPRINTF(&path, "%s/%s", logdir, subdirs[i]);
+		dir = opendir(path);
+		while (dir && (ent = readdir(dir))) {
+			if (ent->d_name[0] == '.')
+				continue;
+			ASPRINTF(&fname, "%s/%s", path, ent->d_name);
+			unlink(fname);
+			free(fname);
+		}
+		if (dir)
+			closedir(dir);
+		rmdir(path);
+		free(path);
+	}
+	rmdir(logdir);
+}
+
+/* Time passes over tables of each size, a count of clients with an optional
+ * k or M suffix, adding their entries and returning false on an invalid size */
+static bool bench_sizes(ckpool_t *ckp, sdata_t *sdata, const char *sizes, json_t *benches,
+			json_t *thresholds)
+{
+	int64_t ns[SP_PHASES + 3][BENCH_PASSES];
+	char *list, *size, *saveptr, *end;
+	int loglevel = ckp->loglevel;
+	char name[64], desc[128];
+	int64_t id = 0;
+	bool ret = false;
+	int i, j;
+
+	list = strdup(sizes);
+	for (size = strtok_r(list, ",", &saveptr); size; size = strtok_r(NULL, ",", &saveptr)) {
+		stratum_instance_t **clients;
+		double count = strtod(size, &end);
+		int nclients, users;
+		stats_timing_t st;
+		time_t now_t;
+		int64_t start;
+
+		if (*end == 'k')
+			count *= 1000;
+		else if (*end == 'M')
+			count *= 1000000;
+		else if (*end)
+			count = 0;
+		if (count < 1 || count > 10000000) {
+			LOGEMERG("Invalid size %s", size);
+			goto out;
+		}
+		nclients = count;
+		users = nclients / (BENCH_WORKERS * BENCH_CLIENTS) ? : 1;
+
+		start = lat_now();
+		now_t = time(NULL);
+		clients = ckalloc(sizeof(stratum_instance_t *) * nclients);
+		for (i = 0; i < nclients; i++)
+			clients[i] = add_client(ckp, sdata, id++, users, now_t);
+		LOGWARNING("Filled %d clients of %d users in %.1fs", nclients, users,
+			   (lat_now() - start) / 1e9);
+
+		/* The per user log lines are formatted but not printed */
+		ckp->loglevel = MIN(loglevel, LOG_WARNING);
+		for (i = -1; i < BENCH_PASSES; i++) {
+			/* Clients marked dropped are unknown to the connector
+			 * so the pass removes them, then they're replaced */
+			for (j = BENCH_CHURN - 1; j < nclients; j += BENCH_CHURN)
+				clients[j]->dropped = true;
+			memset(&st, 0, sizeof(st));
+			stats_pass(ckp, sdata, &st);
+			now_t = time(NULL);
+			for (j = BENCH_CHURN - 1; j < nclients; j += BENCH_CHURN)
+				clients[j] = add_client(ckp, sdata, id++, users, now_t);
+			if (i < 0)
+				continue;
+			for (j = 0; j < SP_PHASES; j++)
+				ns[j][i] = st.phase[j];
+			ns[SP_PHASES][i] = st.total;
+			ns[SP_PHASES + 1][i] = st.wlock_total;
+			ns[SP_PHASES + 2][i] = st.wlock_max;
+			ckp->loglevel = loglevel;
+			LOGWARNING("Pass over %d clients %d users %d workers took %.1fms, instance_lock held for writing %d times for %.1fms, longest %.3fms",
+				   st.clients, st.users, st.workers, st.total / 1e6, st.wlocks,
+				   st.wlock_total / 1e6, st.wlock_max / 1e6);
+			ckp->loglevel = MIN(loglevel, LOG_WARNING);
+		}
+
+		/* Drop every client so the next size starts empty, keeping the
+		 * users and workers as the pool does */
+		for (i = 0; i < nclients; i++)
+			clients[i]->dropped = true;
+		memset(&st, 0, sizeof(st));
+		stats_pass(ckp, sdata, &st);
+		ckp->loglevel = loglevel;
+		free(clients);
+
+		sprintf(name, "stats_%s", size);
+		sprintf(desc, "statsupdate pass over %s clients", size);
+		json_set_object(benches, name, bench_entry(desc, ns[SP_PHASES], BENCH_PASSES));
+		json_set_double(thresholds, name, 25);
+		for (j = 0; j < SP_PHASES; j++) {
+			sprintf(name, "stats_%s_%s", size, stats_phase_names[j]);
+			sprintf(desc, "%s phase of a pass over %s clients", stats_phase_names[j], size);
+			json_set_object(benches, name, bench_entry(desc, ns[j], BENCH_PASSES));
+			json_set_double(thresholds, name, bench_thresholds[j]);
+		}
+		sprintf(name, "stats_%s_wlock", size);
+		sprintf(desc, "instance_lock held for writing per pass over %s clients", size);
+		json_set_object(benches, name, bench_entry(desc, ns[SP_PHASES + 1], BENCH_PASSES));
+		json_set_double(thresholds, name, 25);
+		/* The longest single hold is at the mercy of the scheduler */
+		sprintf(name, "stats_%s_wlock_max", size);
+		sprintf(desc, "longest instance_lock write hold in a pass over %s clients", size);
+		json_set_object(benches, name, bench_entry(desc, ns[SP_PHASES + 2], BENCH_PASSES));
+		json_set_double(thresholds, name, 100);
+	}
+	ret = true;
+out:
+	free(list);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *sizes = argc > 1 ? argv[1] : "10k,100k,500k";
+	json_t *val, *benches, *thresholds;
+	struct utsname un;
+	char *logdir, *dump;
+	sdata_t *sdata;
+	ckpool_t ckp;
+	int ret = 1;
+
+	if (argc > 2 || !strcmp(sizes, "-h") || !strcmp(sizes, "--help")) {
+		fprintf(stderr, "Usage: %s [SIZES]\n"
+			"Time statsupdate passes over each comma separated number of clients,\n"
+			"with k or M suffixes, default 10k,100k,500k. User files are written\n"
+			"under TMPDIR, which is best a tmpfs.\n", argv[0]);
+		return argc > 2;
+	}
+
+	json_set_alloc_funcs(json_ckalloc, free);
+	memset(&ckp, 0, sizeof(ckp));
+	global_ckp = &ckp;
+	ckp.loglevel = LOG_WARNING;
+	ckp.max_pool_useragents = 100;
+	ckp.startdiff = 42;
+
+	/* User files are written to TMPDIR which may be a tmpfs to leave the
+	 * disk out of the write phase */
+	ASPRINTF(&logdir, "%s/ckpool-benchstats-XXXXXX", getenv("TMPDIR") ? : "/tmp");
+	if (!mkdtemp(logdir)) {
+		LOGEMERG("Failed to create temporary log directory");
+		goto out_free;
+	}
+	ckp.logdir = logdir;
+	ASPRINTF(&dump, "%s/users", logdir);
+	mkdir(dump, 0750);
+	free(dump);
+	ASPRINTF(&dump, "%s/pool", logdir);
+	mkdir(dump, 0750);
+	free(dump);
+
+	sdata = new_sdata(&ckp);
+	benches = json_object();
+	thresholds = json_object();
+	if (!bench_sizes(&ckp, sdata, sizes, benches, thresholds)) {
+		json_decref(benches);
+		json_decref(thresholds);
+		goto out;
+	}
+
+	val = json_object();
+	json_set_string(val, "version", VERSION);
+	json_set_string(val, "label", "statsupdate");
+	json_set_int64(val, "time", time(NULL));
+	if (!uname(&un)) {
+		json_set_string(val, "host", un.nodename);
+		json_set_string(val, "machine", un.machine);
+	}
+	json_set_int(val, "cpus", sysconf(_SC_NPROCESSORS_ONLN));
+	json_set_int(val, "reps", BENCH_PASSES);
+	json_set_object(val, "benchmarks", benches);
+	json_set_object(val, "thresholds", thresholds);
+	dump = json_dumps(val, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
+	printf("%s\n", dump);
+	free(dump);
+	json_decref(val);
+	ret = 0;
+out:
+	remove_logdir(logdir);
+out_free:
+	free(logdir);
+	return ret;
+}
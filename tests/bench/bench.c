@@ -0,0 +1,391 @@
+/*
+ * Microbenchmark runner
+ * Runs the named benchmarks with warmup and repetitions, writes ns per op
+ * statistics as json and compares them against a stored baseline, exiting
+ * non zero when any benchmark regressed by more than its threshold
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <sys/utsname.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libckpool.h"
+#include "metrics.h"
+#include "bench.h"
+
+#define BENCH_MAXREPS 1000
+
+volatile uint64_t bench_sink;
+
+static const bench_t *bench_lists[] = { hash_benches, encoding_benches, misc_benches, NULL };
+
+static const char *bench_stats[] = { "min", "median", "mean", NULL };
+
+struct bench_conf {
+	char *filter;
+	int reps;
+	int warmup_ms;
+	int rep_ms;
+	char *output;
+	char *label;
+	char *baseline;
+	char *current;
+	double threshold;
+	json_t *thresholds;
+	const char *stat;
+};
+
+static struct bench_conf conf = {
+	.reps = 10,
+	.warmup_ms = 100,
+	.rep_ms = 50,
+	.threshold = 10,
+	.stat = "median",
+};
+
+/* Logs go to stderr leaving stdout for results */
+void logmsg(int __maybe_unused loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	va_start(ap, fmt);
+	VASPRINTF(&buf, fmt, ap);
+	va_end(ap);
+
+	fprintf(stderr, "%s\n", buf);
+	free(buf);
+}
+
+/* Filters are a comma separated list of substrings of benchmark names */
+static bool bench_selected(const char *name)
+{
+	char *filter, *tok, *save = NULL;
+	bool ret = false;
+
+	if (!conf.filter)
+		return true;
+	filter = strdup(conf.filter);
+	for (tok = strtok_r(filter, ",", &save); tok && !ret; tok = strtok_r(NULL, ",", &save))
+		ret = strstr(name, tok) != NULL;
+	free(filter);
+	return ret;
+}
+
+static int64_t time_run(const bench_t *b, void *ctx, const int64_t iters)
+{
+	int64_t start = lat_now();
+
+	b->run(ctx, iters);
+	return lat_now() - start;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+static json_t *bench_one(const bench_t *b)
+{
+	int64_t iters = 1, elapsed, rep_ns = (int64_t)conf.rep_ms * 1000000, end;
+	double ns[BENCH_MAXREPS], sum = 0, var = 0, mean, median;
+	json_t *val, *stat_val;
+	void *ctx = NULL;
+	int i;
+
+	if (b->setup)
+		ctx = b->setup();
+
+	/* Double the iterations until a run takes a tenth of a repetition,
+	 * which also warms up caches and branch predictors */
+	while (42) {
+		elapsed = time_run(b, ctx, iters);
+		if (elapsed >= rep_ns / 10 || iters >= (1LL << 40))
+			break;
+		iters *= 2;
+	}
+	iters = iters * rep_ns / (elapsed > 0 ? elapsed : 1);
+	if (iters < 1)
+		iters = 1;
+	end = lat_now() + (int64_t)conf.warmup_ms * 1000000;
+	while (lat_now() < end)
+		time_run(b, ctx, iters / 10 + 1);
+
+	for (i = 0; i < conf.reps; i++) {
+		ns[i] = (double)time_run(b, ctx, iters) / iters;
+		sum += ns[i];
+	}
+	if (b->teardown)
+		b->teardown(ctx);
+
+	mean = sum / conf.reps;
+	for (i = 0; i < conf.reps; i++)
+		var += (ns[i] - mean) * (ns[i] - mean);
+	qsort(ns, conf.reps, sizeof(double), cmp_double);
+	median = conf.reps % 2 ? ns[conf.reps / 2] :
+		 (ns[conf.reps / 2 - 1] + ns[conf.reps / 2]) / 2;
+
+	val = json_object();
+	json_set_string(val, "desc", b->desc);
+	json_set_int64(val, "iters", iters);
+	json_set_int(val, "reps", conf.reps);
+	stat_val = json_object();
+	json_set_double(stat_val, "min", ns[0]);
+	json_set_double(stat_val, "median", median);
+	json_set_double(stat_val, "mean", mean);
+	json_set_double(stat_val, "stddev", conf.reps > 1 ? sqrt(var / (conf.reps - 1)) : 0);
+	json_set_double(stat_val, "max", ns[conf.reps - 1]);
+	json_set_object(val, "ns_per_op", stat_val);
+	json_set_double(val, "ops_per_sec", median > 0 ? 1000000000 / median : 0);
+	fprintf(stderr, "%-20s %12.1f ns/op (min %.1f max %.1f, %d x %"PRId64")\n", b->name,
+		median, ns[0], ns[conf.reps - 1], conf.reps, iters);
+	return val;
+}
+
+static json_t *bench_run(void)
+{
+	json_t *val = json_object(), *benches = json_object();
+	const bench_t *b;
+	struct utsname un;
+	int i;
+
+	json_set_string(val, "version", VERSION);
+	if (conf.label)
+		json_set_string(val, "label", conf.label);
+	json_set_int64(val, "time", time(NULL));
+	if (!uname(&un)) {
+		json_set_string(val, "host", un.nodename);
+		json_set_string(val, "machine", un.machine);
+	}
+	json_set_int(val, "cpus", sysconf(_SC_NPROCESSORS_ONLN));
+	json_set_int(val, "reps", conf.reps);
+	json_set_int(val, "rep_ms", conf.rep_ms);
+	for (i = 0; bench_lists[i]; i++) {
+		for (b = bench_lists[i]; b->name; b++) {
+			if (bench_selected(b->name))
+				json_set_object(benches, b->name, bench_one(b));
+		}
+	}
+	json_set_object(val, "benchmarks", benches);
+	return val;
+}
+
+static double bench_stat(json_t *bench, const char *stat)
+{
+	return json_number_value(json_object_get(json_object_get(bench, "ns_per_op"), stat));
+}
+
+/* Command line thresholds override any stored with the baseline, which
+ * override the default */
+static double bench_threshold(json_t *baseline, const char *name)
+{
+	json_t *thr_val = json_object_get(conf.thresholds, name);
+
+	if (!thr_val)
+		thr_val = json_object_get(json_object_get(baseline, "thresholds"), name);
+	return thr_val ? json_number_value(thr_val) : conf.threshold;
+}
+
+/* Adds a comparison to each current benchmark and returns how many
+ * regressed */
+static int bench_compare(json_t *baseline, json_t *current)
+{
+	json_t *base_benches = json_object_get(baseline, "benchmarks"), *bench, *base, *cmp;
+	json_t *cur_benches = json_object_get(current, "benchmarks");
+	const char *name, *status;
+	double before, after, change, thr;
+	int regressions = 0;
+
+	printf("%-20s %12s %12s %9s %7s  %s\n", "benchmark", "baseline", "current", "change",
+	       "limit", "status");
+	json_object_foreach(cur_benches, name, bench) {
+		base = json_object_get(base_benches, name);
+		after = bench_stat(bench, conf.stat);
+		if (!base) {
+			printf("%-20s %12s %12.1f %9s %7s  new\n", name, "-", after, "-", "-");
+			continue;
+		}
+		before = bench_stat(base, conf.stat);
+		change = before > 0 ? (after - before) / before * 100 : 0;
+		thr = bench_threshold(baseline, name);
+		if (change > thr) {
+			status = "REGRESSED";
+			regressions++;
+		} else if (change < -thr)
+			status = "improved";
+		else
+			status = "ok";
+		printf("%-20s %12.1f %12.1f %+8.1f%% %6.1f%%  %s\n", name, before, after, change,
+		       thr, status);
+		JSON_CPACK(cmp, "{sfsfsfss}", "baseline", before, "change_pct", change,
+			   "threshold_pct", thr, "status", status);
+		json_set_object(bench, "comparison", cmp);
+	}
+	json_object_foreach(base_benches, name, base) {
+		if (!json_object_get(cur_benches, name) && bench_selected(name))
+			printf("%-20s %12.1f %12s %9s %7s  missing\n", name, bench_stat(base, conf.stat),
+			       "-", "-", "-");
+	}
+	printf("%d regressions comparing %s ns/op against %s\n", regressions, conf.stat,
+	       conf.baseline);
+	return regressions;
+}
+
+static json_t *load_results(const char *path)
+{
+	json_error_t err;
+	json_t *val;
+
+	val = json_load_file(path, 0, &err);
+	if (!val || !json_is_object(json_object_get(val, "benchmarks")))
+		quit(2, "Failed to load benchmark results from %s: %s", path, val ? "no benchmarks" : err.text);
+	return val;
+}
+
+static void write_results(json_t *val)
+{
+	FILE *fp = stdout;
+	char *dump;
+
+	if (conf.output && strcmp(conf.output, "-")) {
+		fp = fopen(conf.output, "we");
+		if (!fp)
+			quit(2, "Failed to open %s", conf.output);
+	}
+	dump = json_dumps(val, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
+	fprintf(fp, "%s\n", dump);
+	free(dump);
+	if (fp != stdout)
+		fclose(fp);
+}
+
+static void add_threshold(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	char *name;
+
+	if (!eq || eq == arg)
+		quit(2, "Threshold %s is not name=percent", arg);
+	name = strndup(arg, eq - arg);
+	if (!conf.thresholds)
+		conf.thresholds = json_object();
+	json_set_double(conf.thresholds, name, atof(eq + 1));
+	free(name);
+}
+
+static struct option long_options[] = {
+	{"baseline",	required_argument,	0,	'b'},
+	{"compare",	required_argument,	0,	'c'},
+	{"filter",	required_argument,	0,	'f'},
+	{"help",	no_argument,		0,	'h'},
+	{"list",	no_argument,		0,	'l'},
+	{"repms",	required_argument,	0,	'm'},
+	{"label",	required_argument,	0,	'n'},
+	{"output",	required_argument,	0,	'o'},
+	{"reps",	required_argument,	0,	'r'},
+	{"stat",	required_argument,	0,	's'},
+	{"threshold",	required_argument,	0,	't'},
+	{"warmup",	required_argument,	0,	'w'},
+	{"limit",	required_argument,	0,	'x'},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char **argv)
+{
+	json_t *current, *baseline = NULL;
+	const bench_t *b;
+	int c, i = 0, j, ret = 0;
+
+	while ((c = getopt_long(argc, argv, "b:c:f:hlm:n:o:r:s:t:w:x:", long_options, &i)) != -1) {
+		switch(c) {
+			case 'b':
+				conf.baseline = optarg;
+				break;
+			case 'c':
+				conf.current = optarg;
+				break;
+			case 'f':
+				conf.filter = optarg;
+				break;
+			case 'h':
+				for (j = 0; long_options[j].val; j++) {
+					struct option *jopt = &long_options[j];
+
+					if (jopt->has_arg) {
+						char *upper = alloca(strlen(jopt->name) + 1);
+						int offset = 0;
+
+						do {
+							upper[offset] = toupper(jopt->name[offset]);
+						} while (upper[offset++] != '\0');
+						printf("-%c %s | --%s %s\n", jopt->val,
+						       upper, jopt->name, upper);
+					} else
+						printf("-%c | --%s\n", jopt->val, jopt->name);
+				}
+				exit(0);
+			case 'l':
+				for (j = 0; bench_lists[j]; j++) {
+					for (b = bench_lists[j]; b->name; b++)
+						printf("%-20s %s\n", b->name, b->desc);
+				}
+				exit(0);
+			case 'm':
+				conf.rep_ms = atoi(optarg);
+				break;
+			case 'n':
+				conf.label = optarg;
+				break;
+			case 'o':
+				conf.output = optarg;
+				break;
+			case 'r':
+				conf.reps = atoi(optarg);
+				break;
+			case 's':
+				conf.stat = optarg;
+				break;
+			case 't':
+				conf.threshold = atof(optarg);
+				break;
+			case 'w':
+				conf.warmup_ms = atoi(optarg);
+				break;
+			case 'x':
+				add_threshold(optarg);
+				break;
+		}
+	}
+	if (conf.reps < 1 || conf.reps > BENCH_MAXREPS || conf.rep_ms < 1 || conf.warmup_ms < 0)
+		quit(2, "Reps must be 1 to %d, repms positive and warmup not negative", BENCH_MAXREPS);
+	for (j = 0; bench_stats[j]; j++) {
+		if (!strcmp(conf.stat, bench_stats[j]))
+			break;
+	}
+	if (!bench_stats[j])
+		quit(2, "Unknown statistic %s, use min, median or mean", conf.stat);
+	if (conf.current && !conf.baseline)
+		quit(2, "Comparing results needs a baseline");
+
+	if (conf.baseline)
+		baseline = load_results(conf.baseline);
+	current = conf.current ? load_results(conf.current) : bench_run();
+	if (baseline) {
+		ret = bench_compare(baseline, current) ? 1 : 0;
+		json_decref(baseline);
+	}
+	/* Results go to stdout unless the comparison table does */
+	if (!conf.current && (conf.output || !baseline))
+		write_results(current);
+	json_decref(current);
+	return ret;
+}
@@ -0,0 +1,34 @@
+/*
+ * Microbenchmark harness
+ * Each benchmark runs its operation a requested number of times; the harness
+ * warms it up, sizes repetitions to a target time and reports ns per op
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct bench bench_t;
+
+struct bench {
+	const char *name;
+	const char *desc;
+	/* Optional, returns the context passed to run */
+	void *(*setup)(void);
+	/* Perform the operation iters times */
+	void (*run)(void *ctx, const int64_t iters);
+	/* Optional, frees the context */
+	void (*teardown)(void *ctx);
+};
+
+/* Each file of benchmarks ends its list with an empty entry */
+extern const bench_t hash_benches[];
+extern const bench_t encoding_benches[];
+extern const bench_t misc_benches[];
+
+/* Results are folded into this so the compiler can't discard the work */
+extern volatile uint64_t bench_sink;
+
+#endif /* BENCH_H */
@@ -0,0 +1,43 @@
+/*
+ * Common stratcore test fixture
+ * Fills in a workbase as a mainnet template at a fixed height and time for
+ * the tests driving the stratcore share and work core, and frees what
+ * building its coinbase allocated
+ */
+
+#ifndef STRATCORE_TEST_H
+#define STRATCORE_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libckpool.h"
+#include "stratcore.h"
+
+static void init_wb(workbase_t *wb)
+{
+    memset(wb, 0, sizeof(workbase_t));
+    wb->id = 0x65a1b2c3d4;
+    snprintf(wb->idstring, sizeof(wb->idstring), "%016lx", (long)wb->id);
+    wb->height = 800000;
+    wb->flags = "";
+    wb->coinbasevalue = 625000000;
+    strcpy(wb->bbversion, "20000000");
+    strcpy(wb->prevhash, "00000000000000000002a7c4c1e48d76c5a37902165a270156b7a8d72728a054");
+    strcpy(wb->ntime, "6553f100");
+    sscanf(wb->ntime, "%x", &wb->ntime32);
+    strcpy(wb->nbit, "17053894");
+    wb->merkle_array = json_array();
+}
+
+static void clear_wb(workbase_t *wb)
+{
+    free(wb->coinb1);
+    free(wb->coinb1bin);
+    free(wb->coinb2);
+    free(wb->coinb2bin);
+    free(wb->coinb3bin);
+    json_decref(wb->merkle_array);
+}
+
+#endif /* STRATCORE_TEST_H */
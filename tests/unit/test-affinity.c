@@ -0,0 +1,140 @@
+/*
+ * Unit tests for thread affinity
+ * Tests CPU list parsing and formatting, NUMA node discovery and placing
+ * threads on CPUs by the role in their name
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "affinity.h"
+
+static void test_parse_cpus(void)
+{
+    char buf[64];
+    cpu_set_t set;
+
+    assert_true(affinity_parse_cpus("0-3,8", &set));
+    assert_int_equal(CPU_COUNT(&set), 5);
+    assert_true(CPU_ISSET(0, &set) && CPU_ISSET(3, &set) && CPU_ISSET(8, &set));
+    assert_false(CPU_ISSET(4, &set));
+    affinity_format_cpus(&set, buf, 64);
+    assert_string_equal(buf, "0-3,8");
+
+    /* sysfs cpulists end with a newline */
+    assert_true(affinity_parse_cpus("2,4-5\n", &set));
+    affinity_format_cpus(&set, buf, 64);
+    assert_string_equal(buf, "2,4-5");
+
+    assert_false(affinity_parse_cpus("", &set));
+    assert_false(affinity_parse_cpus("3-1", &set));
+    assert_false(affinity_parse_cpus("1-", &set));
+    assert_false(affinity_parse_cpus("cpu1", &set));
+    assert_false(affinity_parse_cpus("1x", &set));
+    assert_false(affinity_parse_cpus("-1", &set));
+    assert_false(affinity_parse_cpus("100000", &set));
+}
+
+/* There is always at least node 0, whose CPUs nodeN names */
+static void test_nodes(void)
+{
+    cpu_set_t node0, set;
+
+    assert_true(affinity_nodes() >= 1);
+    assert_true(affinity_node_cpus(0, &node0));
+    assert_true(CPU_COUNT(&node0) > 0);
+    assert_false(affinity_node_cpus(-1, &set));
+    assert_false(affinity_node_cpus(AFFINITY_MAXNODES, &set));
+
+    assert_true(affinity_parse_cpus("node0", &set));
+    assert_true(CPU_EQUAL(&set, &node0));
+    assert_true(affinity_cpus_nodes(&set) & 1);
+    assert_false(affinity_parse_cpus("node64", &set));
+    assert_false(affinity_parse_cpus("node", &set));
+}
+
+struct placed {
+    const char *name;
+    cpu_set_t cpus;
+};
+
+static void *placed_thread(void *arg)
+{
+    struct placed *pl = arg;
+
+    rename_proc(pl->name);
+    sched_getaffinity(0, sizeof(cpu_set_t), &pl->cpus);
+    return NULL;
+}
+
+static void place(struct placed *pl, const char *name)
+{
+    pthread_t pth;
+
+    pl->name = name;
+    create_pthread(&pth, placed_thread, pl);
+    join_pthread(pth);
+}
+
+/* Configured roles are pinned whatever their instance number, numbered
+ * instances of nic roles get the CPUs of one NIC node the process started
+ * on each and threads without a role are left on every CPU the process
+ * started with */
+static void test_configure_apply(void)
+{
+    char *serverurl[] = { "0.0.0.0:3333" };
+    struct placed pl;
+    cpu_set_t start, one, node;
+    int cpu;
+    json_t *roles;
+
+    sched_getaffinity(0, sizeof(cpu_set_t), &start);
+    for (cpu = 0; !CPU_ISSET(cpu, &start); cpu++);
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+
+    /* Start on a single CPU so nic instances have to leave the rest of
+     * their node out */
+    assert_int_equal(sched_setaffinity(0, sizeof(cpu_set_t), &one), 0);
+    roles = json_pack("{sissss}", "badtype", 1, "spread", "nic", "bad", "x-y");
+    json_object_set_new(roles, "pinned", json_sprintf("%d", cpu));
+    /* An invalid role does not stop the valid ones being placed */
+    assert_false(affinity_configure(roles, false, serverurl, 1));
+    json_decref(roles);
+
+    place(&pl, "pinned");
+    assert_true(CPU_EQUAL(&pl.cpus, &one));
+    place(&pl, "pinned12");
+    assert_true(CPU_EQUAL(&pl.cpus, &one));
+
+    /* Spread instances stay on a single node */
+    place(&pl, "spread1");
+    assert_true(CPU_EQUAL(&pl.cpus, &one));
+    assert_int_equal(__builtin_popcountll(affinity_cpus_nodes(&pl.cpus)), 1);
+    assert_true(affinity_node_cpus(__builtin_ctzll(affinity_cpus_nodes(&pl.cpus)), &node));
+    assert_true(CPU_ISSET(cpu, &node));
+
+    place(&pl, "other");
+    assert_true(CPU_EQUAL(&pl.cpus, &one));
+    place(&pl, "bad");
+    assert_true(CPU_EQUAL(&pl.cpus, &one));
+    sched_setaffinity(0, sizeof(cpu_set_t), &start);
+}
+
+int main(void)
+{
+    printf("Running affinity tests...\n\n");
+
+    run_test(test_parse_cpus);
+    run_test(test_nodes);
+    run_test(test_configure_apply);
+
+    printf("\nAll affinity tests passed!\n");
+    return 0;
+}
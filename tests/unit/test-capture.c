@@ -0,0 +1,313 @@
+/*
+ * Unit tests for stratum traffic capture
+ * Tests writing records and reading them back, the file header, stripping of
+ * line endings, rotation by size, runtime disabling and truncated files
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "capture.h"
+
+static bool perf_tests_enabled(void)
+{
+    const char *val = getenv("CKPOOL_PERF_TESTS");
+
+    return val && val[0] == '1';
+}
+
+static char *test_dir(const char *name)
+{
+    char *path;
+
+    ASPRINTF(&path, "/tmp/ckpool-test-capture-%d-%s", (int)getpid(), name);
+    assert_int_equal(mkdir(path, 0700), 0);
+    return path;
+}
+
+static int not_dot(const struct dirent *entry)
+{
+    return entry->d_name[0] != '.';
+}
+
+/* Capture files in a directory sorted into the order they were written */
+static int list_files(const char *dir, char ***paths)
+{
+    struct dirent **names;
+    int i, n;
+
+    n = scandir(dir, &names, not_dot, alphasort);
+    assert_true(n >= 0);
+    *paths = calloc(n + 1, sizeof(char *));
+    for (i = 0; i < n; i++) {
+        ASPRINTF(&(*paths)[i], "%s/%s", dir, names[i]->d_name);
+        free(names[i]);
+    }
+    free(names);
+    return n;
+}
+
+static void remove_dir(char *dir)
+{
+    char **paths;
+    int i, n;
+
+    n = list_files(dir, &paths);
+    for (i = 0; i < n; i++) {
+        unlink(paths[i]);
+        free(paths[i]);
+    }
+    free(paths);
+    rmdir(dir);
+    free(dir);
+}
+
+static char *start_capture(const char *name, const int size_mb, char **dir)
+{
+    char *prefix;
+
+    *dir = test_dir(name);
+    ASPRINTF(&prefix, "%s/capture", *dir);
+    assert_true(capture_configure(prefix, size_mb));
+    assert_true(capture_enable(true));
+    assert_true(capture_enabled);
+    return prefix;
+}
+
+/* Records come back in order with their types, ids and payloads intact */
+static void test_roundtrip(void)
+{
+    const char *subscribe = "{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}";
+    capture_reader_t *cr;
+    capture_rec_t rec;
+    char **paths, *dir, *prefix;
+    int64_t last_ns = 0, now_us;
+    tv_t now;
+    int n;
+
+    prefix = start_capture("roundtrip", 0, &dir);
+    capture_record(CAPTURE_TEMPLATE, 0, "{\"new_block\":true}", 18);
+    capture_record(CAPTURE_CONNECT, 1, "127.0.0.1:3333", 14);
+    capture_record(CAPTURE_IN, 1, subscribe, strlen(subscribe));
+    capture_record(CAPTURE_OUT, 1, "{\"id\":1}\n", 9);
+    capture_record(CAPTURE_IN, 300, "line\r\n", 6);
+    capture_record(CAPTURE_CLOSE, 1, NULL, 0);
+    assert_true(capture_enable(false));
+    assert_false(capture_enabled);
+
+    n = list_files(dir, &paths);
+    assert_int_equal(n, 1);
+    cr = capture_open(paths[0]);
+    assert_non_null(cr);
+    tv_time(&now);
+    now_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    assert_true(cr->start_us <= now_us && cr->start_us > now_us - 60000000);
+
+    assert_true(capture_read(cr, &rec));
+    assert_int_equal(rec.type, CAPTURE_TEMPLATE);
+    assert_int_equal(rec.client_id, 0);
+    assert_string_equal(rec.buf, "{\"new_block\":true}");
+    last_ns = rec.ns;
+
+    assert_true(capture_read(cr, &rec));
+    assert_int_equal(rec.type, CAPTURE_CONNECT);
+    assert_int_equal(rec.client_id, 1);
+    assert_string_equal(rec.buf, "127.0.0.1:3333");
+    assert_true(rec.ns >= last_ns);
+    last_ns = rec.ns;
+
+    assert_true(capture_read(cr, &rec));
+    assert_int_equal(rec.type, CAPTURE_IN);
+    assert_string_equal(rec.buf, subscribe);
+    assert_int_equal(rec.len, strlen(subscribe));
+    assert_true(rec.ns >= last_ns);
+
+    /* Line endings are not recorded */
+    assert_true(capture_read(cr, &rec));
+    assert_int_equal(rec.type, CAPTURE_OUT);
+    assert_string_equal(rec.buf, "{\"id\":1}");
+    assert_true(capture_read(cr, &rec));
+    assert_int_equal(rec.client_id, 300);
+    assert_string_equal(rec.buf, "line");
+
+    assert_true(capture_read(cr, &rec));
+    assert_int_equal(rec.type, CAPTURE_CLOSE);
+    assert_int_equal(rec.len, 0);
+    assert_false(capture_read(cr, &rec));
+    capture_close(cr);
+
+    free(paths[0]);
+    free(paths);
+    free(prefix);
+    remove_dir(dir);
+}
+
+/* Nothing is written while disabled and enabling again starts a new file */
+static void test_disabled(void)
+{
+    capture_reader_t *cr;
+    capture_rec_t rec;
+    char **paths, *dir, *prefix;
+    int i, n, records = 0;
+
+    prefix = start_capture("disabled", 0, &dir);
+    capture_record(CAPTURE_IN, 1, "first", 5);
+    assert_true(capture_enable(false));
+    capture_record(CAPTURE_IN, 1, "dropped", 7);
+    assert_true(capture_enable(true));
+    capture_record(CAPTURE_IN, 1, "second", 6);
+    assert_true(capture_enable(false));
+
+    n = list_files(dir, &paths);
+    assert_int_equal(n, 2);
+    for (i = 0; i < n; i++) {
+        cr = capture_open(paths[i]);
+        assert_non_null(cr);
+        while (capture_read(cr, &rec)) {
+            assert_string_equal(rec.buf, i ? "second" : "first");
+            records++;
+        }
+        capture_close(cr);
+        free(paths[i]);
+    }
+    assert_int_equal(records, 2);
+    free(paths);
+    free(prefix);
+    remove_dir(dir);
+}
+
+/* Files rotate at the size limit without splitting records */
+static void test_rotation(void)
+{
+    capture_reader_t *cr;
+    capture_rec_t rec;
+    char **paths, *dir, *prefix, line[1024];
+    int i, n, records = 0;
+    int64_t id = 0;
+
+    memset(line, 'x', sizeof(line));
+    prefix = start_capture("rotation", 1, &dir);
+    for (i = 0; i < 3000; i++)
+        capture_record(CAPTURE_IN, i, line, sizeof(line));
+    assert_true(capture_enable(false));
+
+    n = list_files(dir, &paths);
+    assert_int_equal(n, 3);
+    for (i = 0; i < n; i++) {
+        cr = capture_open(paths[i]);
+        assert_non_null(cr);
+        while (capture_read(cr, &rec)) {
+            assert_int_equal(rec.client_id, id++);
+            assert_int_equal(rec.len, sizeof(line));
+            records++;
+        }
+        capture_close(cr);
+        free(paths[i]);
+    }
+    assert_int_equal(records, 3000);
+    free(paths);
+    free(prefix);
+    remove_dir(dir);
+}
+
+/* A file cut off mid record reads up to the last whole record, and files
+ * without the header are refused */
+static void test_truncated(void)
+{
+    capture_reader_t *cr;
+    capture_rec_t rec;
+    char **paths, *dir, *prefix;
+    long size;
+    FILE *fp;
+    int n;
+
+    prefix = start_capture("truncated", 0, &dir);
+    capture_record(CAPTURE_IN, 1, "whole", 5);
+    capture_record(CAPTURE_IN, 1, "partial", 7);
+    assert_true(capture_enable(false));
+
+    n = list_files(dir, &paths);
+    assert_int_equal(n, 1);
+    fp = fopen(paths[0], "r+");
+    assert_non_null(fp);
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+    assert_int_equal(truncate(paths[0], size - 3), 0);
+
+    cr = capture_open(paths[0]);
+    assert_non_null(cr);
+    assert_true(capture_read(cr, &rec));
+    assert_string_equal(rec.buf, "whole");
+    assert_false(capture_read(cr, &rec));
+    capture_close(cr);
+
+    fp = fopen(paths[0], "w");
+    assert_non_null(fp);
+    fputs("not a capture file", fp);
+    fclose(fp);
+    assert_null(capture_open(paths[0]));
+
+    free(paths[0]);
+    free(paths);
+    free(prefix);
+    remove_dir(dir);
+}
+
+/* Cost of a record on the connector's paths while capturing */
+static void test_record_performance(void)
+{
+    const char *submit = "{\"params\":[\"ckload.1\",\"6f1c\",\"00000000\",\"65f3a2b1\",\"1a2b3c4d\"],"
+                         "\"id\":42,\"method\":\"mining.submit\"}";
+    struct timespec start, end;
+    char **paths, *dir, *prefix;
+    double elapsed;
+    int i, n;
+
+    prefix = start_capture("perf", 0, &dir);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < 1000000; i++)
+        capture_record(CAPTURE_IN, i & 1023, submit, strlen(submit));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert_true(capture_enable(false));
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("    Capturing 1M share submissions: %.0fns per record\n", elapsed * 1000);
+
+    n = list_files(dir, &paths);
+    for (i = 0; i < n; i++)
+        free(paths[i]);
+    free(paths);
+    free(prefix);
+    remove_dir(dir);
+}
+
+int main(void)
+{
+    printf("Running capture tests...\n\n");
+
+    run_test(test_roundtrip);
+    run_test(test_disabled);
+    run_test(test_rotation);
+    run_test(test_truncated);
+
+    if (perf_tests_enabled()) {
+        printf("\n[PERFORMANCE REGRESSION TESTS]\n");
+        printf("BEGIN PERF TESTS: test-capture\n");
+        run_test(test_record_performance);
+        printf("END PERF TESTS: test-capture\n");
+    }
+
+    printf("\nAll capture tests passed!\n");
+    return 0;
+}
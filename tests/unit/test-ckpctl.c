@@ -0,0 +1,306 @@
+/*
+ * Unit tests for the persistent control channel
+ * Tests framing, request parsing, pipelined tagged requests and replies and
+ * that malformed requests drop the connection
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "ckpctl.h"
+
+#define TEST_TIMEOUT 5
+#define TEST_LARGE 1048576
+
+static bool perf_tests_enabled(void)
+{
+    const char *val = getenv("CKPOOL_PERF_TESTS");
+
+    return val && val[0] == '1';
+}
+
+static char *test_path(const char *name)
+{
+    char *path;
+
+    ASPRINTF(&path, "/tmp/ckpool-test-ckpctl-%d-%s", (int)getpid(), name);
+    return path;
+}
+
+/* Minimal control server serving a single connection the way ckpool's
+ * control sessions do: "<target>:<cmd>" is echoed back under the request's
+ * tag, "large" returns a big reply, "empty" an empty one. */
+static void *echo_server(void *arg)
+{
+    int sockd = *(int *)arg, fd;
+    char *buf, *target, *cmd, *reply;
+    uint32_t len, tag;
+    int replylen;
+
+    fd = accept(sockd, NULL, NULL);
+    assert_true(fd >= 0);
+    while ((buf = ckpctl_read_frame(fd, &len, 0)) != NULL) {
+        if (!ckpctl_parse_request(buf, &tag, &target, &cmd)) {
+            free(buf);
+            break;
+        }
+        if (!strcmp(cmd, "large")) {
+            reply = ckalloc(TEST_LARGE + 1);
+            replylen = sprintf(reply, "%u ", tag);
+            memset(reply + replylen, 'x', TEST_LARGE - replylen);
+            replylen = TEST_LARGE;
+            reply[replylen] = '\0';
+        } else if (!strcmp(cmd, "empty")) {
+            ASPRINTF(&reply, "%u ", tag);
+            replylen = strlen(reply);
+        } else {
+            ASPRINTF(&reply, "%u %s:%s", tag, target, cmd);
+            replylen = strlen(reply);
+        }
+        free(buf);
+        assert_true(ckpctl_write_frame(fd, reply, replylen));
+        free(reply);
+    }
+    close(fd);
+    return NULL;
+}
+
+static ckpctl_t *start_server(const char *name, pthread_t *pth, int *sockd, char **path)
+{
+    ckpctl_t *ctl;
+
+    *path = test_path(name);
+    *sockd = open_unix_server(*path);
+    assert_true(*sockd >= 0);
+    create_pthread(pth, echo_server, sockd);
+    ctl = ckpctl_open(*path);
+    assert_non_null(ctl);
+    return ctl;
+}
+
+static void stop_server(ckpctl_t *ctl, pthread_t *pth, int sockd, char *path)
+{
+    ckpctl_close(ctl);
+    join_pthread(*pth);
+    close(sockd);
+    unlink(path);
+    free(path);
+}
+
+static void test_frame_roundtrip(void)
+{
+    uint32_t len;
+    char *buf;
+    int sv[2];
+
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    assert_true(ckpctl_write_frame(sv[0], "1 listener ping", 15));
+    assert_true(ckpctl_write_frame(sv[0], "", 0));
+    assert_true(ckpctl_write_frame(sv[0], "2 stratifier stats", 18));
+
+    buf = ckpctl_read_frame(sv[1], &len, TEST_TIMEOUT);
+    assert_non_null(buf);
+    assert_int_equal(len, 15);
+    assert_string_equal(buf, "1 listener ping");
+    free(buf);
+    buf = ckpctl_read_frame(sv[1], &len, TEST_TIMEOUT);
+    assert_non_null(buf);
+    assert_int_equal(len, 0);
+    assert_string_equal(buf, "");
+    free(buf);
+    buf = ckpctl_read_frame(sv[1], &len, TEST_TIMEOUT);
+    assert_non_null(buf);
+    assert_string_equal(buf, "2 stratifier stats");
+    free(buf);
+
+    /* Nothing left to read times out, a closed peer returns NULL */
+    assert_null(ckpctl_read_frame(sv[1], &len, 0.1));
+    close(sv[0]);
+    assert_null(ckpctl_read_frame(sv[1], &len, TEST_TIMEOUT));
+    close(sv[1]);
+}
+
+static void test_parse_request(void)
+{
+    char buf[64], *target, *cmd;
+    uint32_t tag;
+
+    strcpy(buf, "7 listener loglevel=7");
+    assert_true(ckpctl_parse_request(buf, &tag, &target, &cmd));
+    assert_int_equal(tag, 7);
+    assert_string_equal(target, "listener");
+    assert_string_equal(cmd, "loglevel=7");
+
+    /* Only the first two spaces separate fields */
+    strcpy(buf, "4294967295 stratifier getuser {\"user\":\"a b\"}");
+    assert_true(ckpctl_parse_request(buf, &tag, &target, &cmd));
+    assert_true(tag == 4294967295U);
+    assert_string_equal(target, "stratifier");
+    assert_string_equal(cmd, "getuser {\"user\":\"a b\"}");
+
+    strcpy(buf, "ping");
+    assert_false(ckpctl_parse_request(buf, &tag, &target, &cmd));
+    strcpy(buf, "1 listener");
+    assert_false(ckpctl_parse_request(buf, &tag, &target, &cmd));
+    strcpy(buf, "1 listener ");
+    assert_false(ckpctl_parse_request(buf, &tag, &target, &cmd));
+    strcpy(buf, "1  ping");
+    assert_false(ckpctl_parse_request(buf, &tag, &target, &cmd));
+    strcpy(buf, "x listener ping");
+    assert_false(ckpctl_parse_request(buf, &tag, &target, &cmd));
+}
+
+/* Many requests written before any reply is read come back in order with
+ * their own tags */
+static void test_pipelined(void)
+{
+    char *path, *reply, expect[64];
+    pthread_t pth;
+    ckpctl_t *ctl;
+    uint32_t tag;
+    int sockd, i;
+
+    ctl = start_server("pipelined", &pth, &sockd, &path);
+    for (i = 0; i < 100; i++) {
+        snprintf(expect, 64, "cmd%d", i);
+        assert_true(ckpctl_send(ctl, i % 2 ? "stratifier" : "listener", expect) == i + 1);
+    }
+    assert_int_equal(ctl->pending, 100);
+    for (i = 0; i < 100; i++) {
+        reply = ckpctl_recv(ctl, &tag, TEST_TIMEOUT);
+        assert_non_null(reply);
+        assert_int_equal(tag, i + 1);
+        snprintf(expect, 64, "%s:cmd%d", i % 2 ? "stratifier" : "listener", i);
+        assert_string_equal(reply, expect);
+        free(reply);
+    }
+    assert_int_equal(ctl->pending, 0);
+
+    /* A synchronous request skips replies to earlier pipelined ones */
+    ckpctl_send(ctl, "listener", "early");
+    reply = ckpctl_request(ctl, "connector", "late", TEST_TIMEOUT);
+    assert_non_null(reply);
+    assert_string_equal(reply, "connector:late");
+    assert_int_equal(ctl->pending, 0);
+    free(reply);
+
+    stop_server(ctl, &pth, sockd, path);
+}
+
+static void test_empty_large(void)
+{
+    char *path, *reply;
+    pthread_t pth;
+    ckpctl_t *ctl;
+    int sockd, i;
+
+    ctl = start_server("large", &pth, &sockd, &path);
+    reply = ckpctl_request(ctl, "listener", "empty", TEST_TIMEOUT);
+    assert_non_null(reply);
+    assert_string_equal(reply, "");
+    free(reply);
+
+    reply = ckpctl_request(ctl, "listener", "large", TEST_TIMEOUT);
+    assert_non_null(reply);
+    assert_int_equal((int)strlen(reply), TEST_LARGE - 2);
+    for (i = 0; i < TEST_LARGE - 2; i++) {
+        if (reply[i] != 'x')
+            break;
+    }
+    assert_int_equal(i, TEST_LARGE - 2);
+    free(reply);
+
+    /* The connection is still usable afterwards */
+    reply = ckpctl_request(ctl, "generator", "ping", TEST_TIMEOUT);
+    assert_non_null(reply);
+    assert_string_equal(reply, "generator:ping");
+    free(reply);
+
+    stop_server(ctl, &pth, sockd, path);
+}
+
+/* A malformed request closes the connection rather than desynchronising
+ * later replies */
+static void test_malformed(void)
+{
+    uint32_t tag;
+    char *path, *reply;
+    pthread_t pth;
+    ckpctl_t *ctl;
+    int sockd;
+
+    ctl = start_server("malformed", &pth, &sockd, &path);
+    assert_true(ckpctl_write_frame(ctl->sockd, "nonsense", 8));
+    reply = ckpctl_recv(ctl, &tag, TEST_TIMEOUT);
+    assert_null(reply);
+    stop_server(ctl, &pth, sockd, path);
+}
+
+static void test_roundtrip_performance(void)
+{
+    char *path, *reply;
+    struct timespec start, end;
+    pthread_t pth;
+    ckpctl_t *ctl;
+    uint32_t tag;
+    int sockd, i, j;
+    double elapsed;
+
+    ctl = start_server("perf", &pth, &sockd, &path);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < 10000; i++) {
+        reply = ckpctl_request(ctl, "listener", "ping", TEST_TIMEOUT);
+        assert_non_null(reply);
+        free(reply);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("    10000 synchronous requests: %.3fs (%.0f/s)\n", elapsed, 10000 / elapsed);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < 10000; i += 16) {
+        for (j = 0; j < 16; j++)
+            assert_true(ckpctl_send(ctl, "listener", "ping") > 0);
+        for (j = 0; j < 16; j++) {
+            reply = ckpctl_recv(ctl, &tag, TEST_TIMEOUT);
+            assert_non_null(reply);
+            free(reply);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("    10000 requests pipelined 16 deep: %.3fs (%.0f/s)\n", elapsed, 10000 / elapsed);
+
+    stop_server(ctl, &pth, sockd, path);
+}
+
+int main(void)
+{
+    printf("Running control channel tests...\n\n");
+
+    run_test(test_frame_roundtrip);
+    run_test(test_parse_request);
+    run_test(test_pipelined);
+    run_test(test_empty_large);
+    run_test(test_malformed);
+
+    if (perf_tests_enabled()) {
+        printf("\n[PERFORMANCE REGRESSION TESTS]\n");
+        printf("BEGIN PERF TESTS: test-ckpctl\n");
+        run_test(test_roundtrip_performance);
+        printf("END PERF TESTS: test-ckpctl\n");
+    }
+
+    printf("\nAll control channel tests passed!\n");
+    return 0;
+}
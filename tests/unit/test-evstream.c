@@ -0,0 +1,387 @@
+/*
+ * Unit tests for the event stream used to publish share events
+ * Tests request parsing, resume, filtering, encodings, ring overflow gaps and
+ * that slow subscribers never block publishers
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "evstream.h"
+
+#define TEST_RING 64
+
+static bool perf_tests_enabled(void)
+{
+    const char *val = getenv("CKPOOL_PERF_TESTS");
+
+    return val && val[0] == '1';
+}
+
+static const char *test_types[] = { "accepted", "rejected", "block" };
+
+static char *test_path(const char *name)
+{
+    char *path;
+
+    ASPRINTF(&path, "/tmp/ckpool-test-evstream-%d-%s", (int)getpid(), name);
+    return path;
+}
+
+static char *test_bin(const evstream_event_t *ev, int *len)
+{
+    char *buf = ckalloc(8);
+
+    memcpy(buf, &ev->seq, 8);
+    *len = 8;
+    return buf;
+}
+
+static json_t *test_val(int i)
+{
+    return json_pack("{si}", "n", i);
+}
+
+/* Read one frame with a timeout so a broken stream fails rather than hangs */
+static char *recv_frame(int sockd, int *len)
+{
+    struct timeval tv = { 5, 0 };
+
+    setsockopt(sockd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return evstream_recv(sockd, len);
+}
+
+static json_t *recv_json(int sockd)
+{
+    json_t *val;
+    char *buf;
+    int len;
+
+    buf = recv_frame(sockd, &len);
+    assert_non_null(buf);
+    val = json_loads(buf, 0, NULL);
+    assert_non_null(val);
+    free(buf);
+    return val;
+}
+
+/* Wait for the stream thread to register a subscription */
+static void wait_subscribers(evstream_t *es, int count)
+{
+    int i;
+
+    for (i = 0; i < 500 && evstream_subscribers(es) != count; i++)
+        cksleep_ms(10);
+    assert_int_equal(evstream_subscribers(es), count);
+}
+
+static void test_parse_request(void)
+{
+    char *user, *worker;
+    int64_t seq;
+    int format;
+
+    assert_true(evstream_parse_request("subscribe", &seq, &user, &worker, &format));
+    assert_true(seq == -1);
+    assert_null(user);
+    assert_null(worker);
+    assert_int_equal(format, EVSTREAM_JSON);
+
+    assert_true(evstream_parse_request("subscribe seq=42 user=bob worker=bob.rig format=binary",
+                                       &seq, &user, &worker, &format));
+    assert_true(seq == 42);
+    assert_string_equal(user, "bob");
+    assert_string_equal(worker, "bob.rig");
+    assert_int_equal(format, EVSTREAM_BINARY);
+    free(user);
+    free(worker);
+
+    assert_false(evstream_parse_request("unsubscribe", &seq, &user, &worker, &format));
+    assert_false(evstream_parse_request("subscribe seq=x", &seq, &user, &worker, &format));
+    assert_false(evstream_parse_request("subscribe seq=-5", &seq, &user, &worker, &format));
+    assert_false(evstream_parse_request("subscribe user=bob bogus", &seq, &user, &worker, &format));
+    assert_null(user);
+    assert_false(evstream_parse_request(NULL, &seq, &user, &worker, &format));
+}
+
+/* Resume from an old seq, live tail after it and filtering by user/worker */
+static void test_resume_filter(void)
+{
+    char *path = test_path("resume");
+    evstream_t *es;
+    int64_t first;
+    json_t *val;
+    char req[64];
+    int sockd, i;
+
+    es = evstream_create("testresume", path, TEST_RING, test_types, 3, NULL, 0);
+    assert_non_null(es);
+    first = evstream_seq(es);
+    for (i = 0; i < 10; i++)
+        evstream_publish(es, i % 2, i % 2 ? "alice" : "bob", i % 2 ? "alice.1" : "bob.1",
+                         test_val(i));
+    assert_true(evstream_seq(es) == first + 10);
+
+    /* Resume from the 4th event, filtered to alice */
+    snprintf(req, 64, "subscribe seq=%"PRId64" user=alice", first + 3);
+    sockd = evstream_subscribe(path, req);
+    assert_true(sockd >= 0);
+    for (i = 3; i < 10; i += 2) {
+        val = recv_json(sockd);
+        assert_true(json_integer_value(json_object_get(val, "seq")) == first + i);
+        assert_string_equal(json_string_value(json_object_get(val, "type")), "rejected");
+        assert_int_equal((int)json_integer_value(json_object_get(json_object_get(val, "data"), "n")), i);
+        assert_non_null(json_object_get(val, "time"));
+        json_decref(val);
+    }
+
+    /* Live events after the backlog, only the matching one arrives */
+    evstream_publish(es, 2, "bob", "bob.1", test_val(10));
+    evstream_publish(es, 2, "alice", "alice.2", test_val(11));
+    val = recv_json(sockd);
+    assert_true(json_integer_value(json_object_get(val, "seq")) == first + 11);
+    assert_string_equal(json_string_value(json_object_get(val, "type")), "block");
+    json_decref(val);
+    close(sockd);
+    wait_subscribers(es, 0);
+
+    /* Worker filter with a future seq starts at the live tail */
+    sockd = evstream_subscribe(path, "subscribe seq=9223372036854775807 worker=bob.1");
+    assert_true(sockd >= 0);
+    wait_subscribers(es, 1);
+    evstream_publish(es, 0, "alice", "alice.1", test_val(12));
+    evstream_publish(es, 0, "bob", "bob.1", test_val(13));
+    val = recv_json(sockd);
+    assert_true(json_integer_value(json_object_get(val, "seq")) == first + 13);
+    json_decref(val);
+    close(sockd);
+    free(path);
+}
+
+/* Binary frames carry the header and the binfn payload */
+static void test_binary(void)
+{
+    char *path = test_path("binary");
+    struct evstream_binhdr hdr;
+    evstream_t *es;
+    int64_t first, payload;
+    char req[64], *buf;
+    int sockd, len;
+
+    es = evstream_create("testbinary", path, TEST_RING, test_types, 3, test_bin, 0);
+    assert_non_null(es);
+    first = evstream_publish(es, 1, "bob", "bob.1", test_val(0));
+
+    snprintf(req, 64, "subscribe seq=%"PRId64" format=binary", first);
+    sockd = evstream_subscribe(path, req);
+    assert_true(sockd >= 0);
+    buf = recv_frame(sockd, &len);
+    assert_non_null(buf);
+    assert_int_equal(len, (int)sizeof(hdr) + 8);
+    memcpy(&hdr, buf, sizeof(hdr));
+    assert_true((int64_t)le64toh(hdr.seq) == first);
+    assert_int_equal((int)le32toh(hdr.type), 1);
+    assert_int_equal((int)le32toh(hdr.len), 8);
+    assert_true(le64toh(hdr.time_us) > 0);
+    memcpy(&payload, buf + sizeof(hdr), 8);
+    assert_true(payload == first);
+    free(buf);
+    close(sockd);
+    free(path);
+}
+
+/* Streams without a binary encoder send the JSON event data after the header */
+static void test_binary_json(void)
+{
+    char *path = test_path("binjson");
+    struct evstream_binhdr hdr;
+    evstream_t *es;
+    int64_t first;
+    char req[64], *buf;
+    int sockd, len;
+
+    es = evstream_create("testbinjson", path, TEST_RING, test_types, 3, NULL, 0);
+    assert_non_null(es);
+    first = evstream_publish(es, 2, NULL, NULL, test_val(7));
+
+    snprintf(req, 64, "subscribe seq=%"PRId64" format=binary", first);
+    sockd = evstream_subscribe(path, req);
+    assert_true(sockd >= 0);
+    buf = recv_frame(sockd, &len);
+    assert_non_null(buf);
+    memcpy(&hdr, buf, sizeof(hdr));
+    assert_int_equal((int)le32toh(hdr.type), 2);
+    assert_int_equal((int)le32toh(hdr.len), len - (int)sizeof(hdr));
+    assert_string_equal(buf + sizeof(hdr), "{\"n\":7}");
+    free(buf);
+    close(sockd);
+    free(path);
+}
+
+/* Resuming from before the oldest event in the ring reports the gap */
+static void test_gap(void)
+{
+    char *path = test_path("gap");
+    evstream_t *es;
+    int64_t first;
+    json_t *val, *data;
+    char req[64];
+    int sockd, i;
+
+    es = evstream_create("testgap", path, TEST_RING, test_types, 3, NULL, 0);
+    assert_non_null(es);
+    first = evstream_seq(es);
+    for (i = 0; i < TEST_RING + 10; i++)
+        evstream_publish(es, 0, "bob", "bob.1", test_val(i));
+
+    snprintf(req, 64, "subscribe seq=%"PRId64, first);
+    sockd = evstream_subscribe(path, req);
+    assert_true(sockd >= 0);
+    val = recv_json(sockd);
+    assert_string_equal(json_string_value(json_object_get(val, "type")), "gap");
+    data = json_object_get(val, "data");
+    assert_true(json_integer_value(json_object_get(data, "from")) == first);
+    assert_true(json_integer_value(json_object_get(data, "to")) == first + 9);
+    json_decref(val);
+    val = recv_json(sockd);
+    assert_true(json_integer_value(json_object_get(val, "seq")) == first + 10);
+    json_decref(val);
+    close(sockd);
+    free(path);
+}
+
+/* A subscriber that never reads must not stall publishing, and falls behind
+ * the ring instead */
+static void test_slow_subscriber(void)
+{
+    char *path = test_path("slow");
+    struct timespec start, end;
+    int sockd, i, count = 200000;
+    evstream_t *es;
+    double elapsed;
+    json_t *val;
+
+    es = evstream_create("testslow", path, TEST_RING, test_types, 3, NULL, 0);
+    assert_non_null(es);
+    sockd = evstream_subscribe(path, "subscribe");
+    assert_true(sockd >= 0);
+    wait_subscribers(es, 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++)
+        evstream_publish(es, 0, "bob", "bob.1", test_val(i));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("    %d events published with a stalled subscriber in %.3f sec\n", count, elapsed);
+    assert_true(elapsed < 10.0);
+
+    /* Draining eventually shows a gap since the ring is far smaller */
+    while (42) {
+        const char *type;
+
+        val = recv_json(sockd);
+        type = json_string_value(json_object_get(val, "type"));
+        if (!strcmp(type, "gap")) {
+            json_decref(val);
+            break;
+        }
+        json_decref(val);
+    }
+    close(sockd);
+    wait_subscribers(es, 0);
+    free(path);
+}
+
+static void test_heartbeat(void)
+{
+    char *path = test_path("heartbeat");
+    evstream_t *es;
+    json_t *val;
+    int sockd;
+
+    es = evstream_create("testheartbeat", path, TEST_RING, test_types, 3, NULL, 1);
+    assert_non_null(es);
+    sockd = evstream_subscribe(path, "subscribe");
+    assert_true(sockd >= 0);
+    val = recv_json(sockd);
+    assert_string_equal(json_string_value(json_object_get(val, "type")), "heartbeat");
+    assert_true(json_integer_value(json_object_get(val, "seq")) == evstream_seq(es));
+    json_decref(val);
+    close(sockd);
+    free(path);
+}
+
+/* Invalid requests are dropped without any frames */
+static void test_bad_request(void)
+{
+    char *path = test_path("bad");
+    evstream_t *es;
+    char *buf;
+    int sockd, len;
+
+    es = evstream_create("testbad", path, TEST_RING, test_types, 3, NULL, 1);
+    assert_non_null(es);
+    sockd = evstream_subscribe(path, "subscribe format=xml");
+    assert_true(sockd >= 0);
+    buf = recv_frame(sockd, &len);
+    assert_null(buf);
+    close(sockd);
+    free(path);
+}
+
+static void test_publish_performance(void)
+{
+    char *path = test_path("perf");
+    struct timespec start, end;
+    int i, count = 1000000;
+    evstream_t *es;
+    double elapsed;
+
+    es = evstream_create("testperf", path, 65536, test_types, 3, NULL, 0);
+    assert_non_null(es);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++)
+        evstream_publish(es, 0, "bob", "bob.1", test_val(i));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (elapsed > 0.0) {
+        printf("    evstream_publish: %.2fM events/sec (%.3f sec for %d events)\n",
+               count / elapsed / 1e6, elapsed, count);
+    }
+    assert_true(elapsed < 10.0);
+    free(path);
+}
+
+int main(void)
+{
+    printf("Running event stream tests...\n\n");
+
+    run_test(test_parse_request);
+    run_test(test_resume_filter);
+    run_test(test_binary);
+    run_test(test_binary_json);
+    run_test(test_gap);
+    run_test(test_slow_subscriber);
+    run_test(test_heartbeat);
+    run_test(test_bad_request);
+
+    if (perf_tests_enabled()) {
+        printf("\n[PERFORMANCE REGRESSION TESTS]\n");
+        printf("BEGIN PERF TESTS: test-evstream\n");
+        run_test(test_publish_performance);
+        printf("END PERF TESTS: test-evstream\n");
+    }
+
+    printf("\nAll event stream tests passed!\n");
+    return 0;
+}
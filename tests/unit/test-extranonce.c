@@ -0,0 +1,443 @@
+/*
+ * Unit tests for moving clients with mining.set_extranonce
+ * Drives a simulated miner that sent mining.extranonce.subscribe through a
+ * move to a new enonce1 with the stratcore send hook, switching either as
+ * soon as it's told or with the next notify, and checks its shares on jobs
+ * either side of the move hash with the enonce1 it mined them with and are
+ * logged with it, across a diff change at the same time
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "stratcore.h"
+#include "../stratcore_test.h"
+
+static const char txnbin[25] = "\x76\xa9\x14" "aaaaaaaaaaaaaaaaaaaa" "\x88\xac";
+
+/* About one hash in sixteen meets it */
+#define SHARE_DIFF 0x1p-28
+
+#define CLIENT_ID 42
+
+/* A fixed clock and the messages queued to the miner through the send hook */
+struct hooks {
+    ts_t now;
+    json_t *sent[8];
+    int64_t sent_id[8];
+    int sent_type[8];
+    int nsent;
+};
+
+static void fake_clock(void *arg, ts_t *ts)
+{
+    struct hooks *h = arg;
+
+    *ts = h->now;
+}
+
+static void fake_send(void *arg, json_t *val, const int64_t client_id, const int msg_type)
+{
+    struct hooks *h = arg;
+
+    assert_true(h->nsent < 8);
+    h->sent[h->nsent] = val;
+    h->sent_id[h->nsent] = client_id;
+    h->sent_type[h->nsent++] = msg_type;
+}
+
+static void clear_sent(struct hooks *h)
+{
+    while (h->nsent)
+        json_decref(h->sent[--h->nsent]);
+}
+
+/* The stratifier's view of the client */
+struct pool_client {
+    stratcore_enonce1_t enonce1data;
+    char enonce1[36];
+    double diff;
+};
+
+/* The miner's view, switching enonce1 on set_extranonce or the next notify */
+struct miner {
+    uchar enonce1bin[16];
+    uchar pending[16];
+    bool has_pending;
+    bool immediate;
+    int n2len;
+    double diff;
+    int64_t job_id;
+    bool clean;
+};
+
+static void init_core(stratcore_t *sc, struct hooks *h)
+{
+    memset(sc, 0, sizeof(stratcore_t));
+    memset(h, 0, sizeof(struct hooks));
+    h->now.tv_sec = 1700000000;
+    h->now.tv_nsec = 123456789;
+    sc->nonce1length = 4;
+    sc->nonce2length = 8;
+    sc->btcsig = "/test/";
+    sc->txnbin = txnbin;
+    sc->txnlen = sizeof(txnbin);
+    sc->clock = fake_clock;
+    sc->send = fake_send;
+    sc->arg = h;
+}
+
+/* A job with its own id whose coinbase is built at the fixed time */
+static void init_job(const stratcore_t *sc, workbase_t *wb, const int64_t id)
+{
+    init_wb(wb);
+    wb->id = id;
+    snprintf(wb->idstring, sizeof(wb->idstring), "%016lx", (long)wb->id);
+    stratcore_coinbase(sc, wb);
+}
+
+static void enonce1_bin(uchar *enonce1bin, const uint32_t enonce1)
+{
+    memset(enonce1bin, 0, 16);
+    memcpy(enonce1bin, &enonce1, 4);
+}
+
+static void set_enonce1(struct pool_client *client, const uint32_t enonce1,
+                        const int64_t last_job_id)
+{
+    uchar enonce1bin[16];
+
+    enonce1_bin(enonce1bin, enonce1);
+    stratcore_move_enonce1(&client->enonce1data, enonce1bin, last_job_id);
+    __bin2hex(client->enonce1, enonce1bin, 4);
+}
+
+/* A local move as the stratifier's set_client_extranonce does it: keep the
+ * old enonce1 for jobs up to the current one, then send set_extranonce and,
+ * as init_client does, the diff and a clean notify of the current job */
+static void pool_move(const stratcore_t *sc, struct pool_client *client, const workbase_t *wb,
+                      const uint32_t enonce1)
+{
+    json_t *val;
+
+    set_enonce1(client, enonce1, wb->id);
+    stratcore_send(sc, stratcore_set_extranonce(client->enonce1, wb->enonce2varlen),
+                   CLIENT_ID, SM_SETEXTRANONCE);
+    JSON_CPACK(val, "{s[f]soss}", "params", client->diff, "id", json_null(),
+               "method", "mining.set_difficulty");
+    stratcore_send(sc, val, CLIENT_ID, SM_DIFF);
+    stratcore_send(sc, stratcore_notify(wb, wb->coinb2, true), CLIENT_ID, SM_UPDATE);
+}
+
+static void miner_receive(struct miner *m, const json_t *val)
+{
+    const char *method = json_string_value(json_object_get(val, "method"));
+    const json_t *params = json_object_get(val, "params");
+
+    assert_non_null(method);
+    if (!strcmp(method, "mining.set_extranonce")) {
+        const char *enonce1 = json_string_value(json_array_get(params, 0));
+
+        assert_int_equal(strlen(enonce1), 8);
+        assert_true(hex2bin(m->pending, enonce1, 4));
+        m->n2len = json_integer_value(json_array_get(params, 1));
+        m->has_pending = true;
+        if (m->immediate) {
+            memcpy(m->enonce1bin, m->pending, 16);
+            m->has_pending = false;
+        }
+    } else if (!strcmp(method, "mining.set_difficulty")) {
+        m->diff = json_number_value(json_array_get(params, 0));
+    } else if (!strcmp(method, "mining.notify")) {
+        if (m->has_pending) {
+            memcpy(m->enonce1bin, m->pending, 16);
+            m->has_pending = false;
+        }
+        sscanf(json_string_value(json_array_get(params, 0)), "%lx", (long *)&m->job_id);
+        m->clean = json_is_true(json_array_get(params, 8));
+    }
+}
+
+static void deliver(struct hooks *h, struct miner *m)
+{
+    int i;
+
+    for (i = 0; i < h->nsent; i++) {
+        assert_true(h->sent_id[i] == CLIENT_ID);
+        miner_receive(m, h->sent[i]);
+    }
+    clear_sent(h);
+}
+
+static void hash_share(const workbase_t *wb, const uchar *enonce1bin, const char *nonce,
+                       stratcore_share_t *share)
+{
+    memset(share, 0, sizeof(stratcore_share_t));
+    share->id = wb->id;
+    share->nonce2 = "0011223344556677";
+    share->nonce = nonce;
+    share->ntime32 = wb->ntime32;
+    stratcore_share_diff(wb, enonce1bin, wb->coinb2bin, wb->coinb2len, share);
+}
+
+/* Find a nonce whose hash with the miner's enonce1 meets diff but whose hash
+ * with the other enonce1 doesn't, so a share hashed with the wrong one is
+ * always told apart by its diff */
+static void miner_mine(const struct miner *m, const workbase_t *wb, const double diff,
+                       const uchar *other, stratcore_share_t *share, char *nonce)
+{
+    uint32_t n;
+
+    for (n = 0; n < 1000000; n++) {
+        sprintf(nonce, "%08x", n);
+        hash_share(wb, other, nonce, share);
+        if (target256_meets_diff(share->hash, diff))
+            continue;
+        hash_share(wb, m->enonce1bin, nonce, share);
+        if (target256_meets_diff(share->hash, diff))
+            return;
+    }
+    assert_true(false);
+}
+
+/* Hash a share as submission_diff does, at the diff its job was sent at */
+static double pool_share_diff(const struct pool_client *client, const workbase_t *wb,
+                              const double diff, stratcore_share_t *share)
+{
+    return stratcore_enonce1_share_diff(wb, &client->enonce1data, wb->coinb2bin, wb->coinb2len,
+                                        diff, share);
+}
+
+/* Whether a share was hashed with enonce1 and would be logged with it */
+static bool hashed_with(const stratcore_share_t *share, const workbase_t *wb, const uchar *enonce1bin)
+{
+    char enonce1[36];
+
+    __bin2hex(enonce1, enonce1bin, 4);
+    return !memcmp(share->coinbase + wb->coinb1len, enonce1bin, 4) &&
+           !strcmp(share->enonce1, enonce1);
+}
+
+static void init_client(struct pool_client *client, struct miner *m, const bool immediate)
+{
+    memset(client, 0, sizeof(struct pool_client));
+    set_enonce1(client, 0x01000000, -1);
+    client->diff = SHARE_DIFF;
+    memset(m, 0, sizeof(struct miner));
+    memcpy(m->enonce1bin, client->enonce1data.enonce1bin, 16);
+    m->immediate = immediate;
+    m->diff = SHARE_DIFF;
+}
+
+static void test_message(void)
+{
+    json_t *val, *params;
+
+    val = stratcore_set_extranonce("0a0b0c0d", 8);
+    assert_string_equal(json_string_value(json_object_get(val, "method")), "mining.set_extranonce");
+    assert_true(json_is_null(json_object_get(val, "id")));
+    params = json_object_get(val, "params");
+    assert_int_equal(json_array_size(params), 2);
+    assert_string_equal(json_string_value(json_array_get(params, 0)), "0a0b0c0d");
+    assert_int_equal(json_integer_value(json_array_get(params, 1)), 8);
+    json_decref(val);
+    assert_string_equal(stratum_msgs[SM_SETEXTRANONCE], "mining.set_extranonce");
+}
+
+/* The miner hears of the move, then its diff, then gets a clean notify of
+ * the current job it switches enonce1 on */
+static void test_move_messages(void)
+{
+    struct pool_client client;
+    stratcore_t sc;
+    struct hooks h;
+    struct miner m;
+    workbase_t wb;
+
+    init_core(&sc, &h);
+    init_job(&sc, &wb, 100);
+    init_client(&client, &m, false);
+
+    pool_move(&sc, &client, &wb, 0x02000000);
+    assert_int_equal(h.nsent, 3);
+    assert_int_equal(h.sent_type[0], SM_SETEXTRANONCE);
+    assert_int_equal(h.sent_type[1], SM_DIFF);
+    assert_int_equal(h.sent_type[2], SM_UPDATE);
+
+    /* Nothing changes until the notify */
+    miner_receive(&m, h.sent[0]);
+    assert_memory_equal(m.enonce1bin, client.enonce1data.old_enonce1bin, 4);
+    assert_int_equal(m.n2len, wb.enonce2varlen);
+    deliver(&h, &m);
+    assert_memory_equal(m.enonce1bin, client.enonce1data.enonce1bin, 4);
+    assert_true(m.job_id == wb.id);
+    assert_true(m.clean);
+    assert_double_equal(m.diff, SHARE_DIFF, 1e-20);
+    clear_wb(&wb);
+}
+
+/* Shares on the job of the move hash with whichever enonce1 the miner used,
+ * and on later jobs only with the new one */
+static void check_move(const bool immediate)
+{
+    struct pool_client client;
+    stratcore_share_t share;
+    workbase_t wb, next;
+    uchar old[16], moved[16];
+    stratcore_t sc;
+    struct hooks h;
+    struct miner m;
+    char nonce[12];
+    double sdiff;
+
+    init_core(&sc, &h);
+    init_job(&sc, &wb, 100);
+    init_job(&sc, &next, 101);
+    init_client(&client, &m, immediate);
+    memcpy(old, client.enonce1data.enonce1bin, 16);
+    enonce1_bin(moved, 0x02000000);
+
+    /* Mined before the move, submitted after it */
+    miner_mine(&m, &wb, m.diff, moved, &share, nonce);
+    pool_move(&sc, &client, &wb, 0x02000000);
+    sdiff = pool_share_diff(&client, &wb, client.diff, &share);
+    assert_true(hashed_with(&share, &wb, old));
+    assert_true(target256_meets_diff(share.hash, client.diff));
+    assert_true(sdiff >= client.diff);
+
+    /* Mined with the new enonce1 on the same job once switched */
+    miner_receive(&m, h.sent[0]);
+    if (immediate)
+        assert_memory_equal(m.enonce1bin, client.enonce1data.enonce1bin, 4);
+    deliver(&h, &m);
+    miner_mine(&m, &wb, m.diff, old, &share, nonce);
+    pool_share_diff(&client, &wb, client.diff, &share);
+    assert_true(hashed_with(&share, &wb, client.enonce1data.enonce1bin));
+    assert_true(target256_meets_diff(share.hash, client.diff));
+
+    /* A later job is only ever hashed with the new enonce1 */
+    stratcore_send(&sc, stratcore_notify(&next, next.coinb2, false), CLIENT_ID, SM_UPDATE);
+    deliver(&h, &m);
+    assert_true(m.job_id == next.id);
+    miner_mine(&m, &next, m.diff, old, &share, nonce);
+    pool_share_diff(&client, &next, client.diff, &share);
+    assert_true(hashed_with(&share, &next, client.enonce1data.enonce1bin));
+    assert_true(target256_meets_diff(share.hash, client.diff));
+
+    memcpy(m.enonce1bin, old, 16);
+    miner_mine(&m, &next, m.diff, moved, &share, nonce);
+    pool_share_diff(&client, &next, client.diff, &share);
+    assert_true(hashed_with(&share, &next, client.enonce1data.enonce1bin));
+    assert_false(target256_meets_diff(share.hash, client.diff));
+    clear_wb(&wb);
+    clear_wb(&next);
+}
+
+static void test_move_deferred(void)
+{
+    check_move(false);
+}
+
+static void test_move_immediate(void)
+{
+    check_move(true);
+}
+
+/* A diff raised with the move still lets old jobs hash with the old enonce1
+ * at the old diff instead of falling back to the new enonce1 */
+static void test_move_diff_change(void)
+{
+    struct pool_client client;
+    stratcore_share_t share;
+    stratcore_t sc;
+    struct hooks h;
+    struct miner m;
+    workbase_t wb;
+    char nonce[12];
+    uchar old[16];
+    int found = 0;
+    uint32_t n;
+
+    init_core(&sc, &h);
+    init_job(&sc, &wb, 100);
+    init_client(&client, &m, false);
+    memcpy(old, client.enonce1data.enonce1bin, 16);
+    client.diff = SHARE_DIFF * 256;
+    pool_move(&sc, &client, &wb, 0x02000000);
+    clear_sent(&h);
+
+    /* Old enonce1 shares meeting only the old diff */
+    for (n = 0; found < 8 && n < 100000; n++) {
+        memset(&share, 0, sizeof(share));
+        share.id = wb.id;
+        share.nonce2 = "8899aabbccddeeff";
+        sprintf(nonce, "%08x", n);
+        share.nonce = nonce;
+        share.ntime32 = wb.ntime32;
+        stratcore_share_diff(&wb, old, wb.coinb2bin, wb.coinb2len, &share);
+        if (!target256_meets_diff(share.hash, SHARE_DIFF) ||
+            target256_meets_diff(share.hash, client.diff))
+            continue;
+        found++;
+        pool_share_diff(&client, &wb, SHARE_DIFF, &share);
+        assert_true(hashed_with(&share, &wb, old));
+        assert_true(target256_meets_diff(share.hash, SHARE_DIFF));
+    }
+    assert_int_equal(found, 8);
+
+    /* At the new diff they would have been hashed again with the new one */
+    pool_share_diff(&client, &wb, client.diff, &share);
+    assert_true(hashed_with(&share, &wb, client.enonce1data.enonce1bin));
+    clear_wb(&wb);
+}
+
+/* A move to another subproxy takes the old jobs with it, so nothing is
+ * hashed with the old enonce1 afterwards */
+static void test_move_subproxy(void)
+{
+    struct pool_client client;
+    stratcore_share_t share;
+    stratcore_t sc;
+    struct hooks h;
+    struct miner m;
+    workbase_t wb;
+    char nonce[12];
+    uchar old[16], moved[16];
+
+    init_core(&sc, &h);
+    init_job(&sc, &wb, 100);
+    init_client(&client, &m, false);
+    memcpy(old, client.enonce1data.enonce1bin, 16);
+    enonce1_bin(moved, 0x02000000);
+
+    miner_mine(&m, &wb, m.diff, moved, &share, nonce);
+    set_enonce1(&client, 0x02000000, -1);
+    assert_true(client.enonce1data.change_job_id == 0);
+    pool_share_diff(&client, &wb, client.diff, &share);
+    assert_true(hashed_with(&share, &wb, client.enonce1data.enonce1bin));
+    assert_false(hashed_with(&share, &wb, old));
+    assert_false(target256_meets_diff(share.hash, client.diff));
+    clear_wb(&wb);
+}
+
+int main(void)
+{
+    printf("Running set_extranonce tests...\n\n");
+
+    run_test(test_message);
+    run_test(test_move_messages);
+    run_test(test_move_deferred);
+    run_test(test_move_immediate);
+    run_test(test_move_diff_change);
+    run_test(test_move_subproxy);
+
+    printf("\nAll set_extranonce tests passed!\n");
+    return 0;
+}
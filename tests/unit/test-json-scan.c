@@ -0,0 +1,265 @@
+/*
+ * Unit tests for the bulk string scanning in the bundled jansson
+ * Tests the plain ASCII scanner against a byte at a time reference, and
+ * checks strings loaded from memory and dumped with the scanner match the
+ * byte at a time callback loader and a reference escaper, with the special
+ * byte at every offset and alignment
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../test_common.h"
+#include "libckpool.h"
+
+/* Access internal functions for testing */
+size_t jsonp_scan_plain(const char *str, size_t len, int slash);
+
+#define MAXLEN 100
+#define ALIGNS 32
+
+/* Bytes that end a plain run, then ones that don't */
+static const unsigned char specials[] = { '"', '\\', '/', 0x00, 0x01, 0x1f, 0x80, 0xc3, 0xff };
+static const unsigned char plains[] = { ' ', '0', 'a', '~', 0x7f };
+
+static size_t ref_scan(const char *str, size_t len, int slash)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = str[i];
+
+        if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\' || (slash && c == '/'))
+            break;
+    }
+    return i;
+}
+
+/* Hex such as a coinbase makes up most of the strings the pool handles */
+static void fill_hex(char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = "0123456789abcdef"[(i * 7 + 3) & 15];
+}
+
+static void test_scan_plain(void)
+{
+    static char area[ALIGNS + MAXLEN + 1];
+    size_t align, len, at, s, p;
+    int slash;
+
+    for (align = 0; align < ALIGNS; align++) {
+        char *buf = area + align;
+
+        for (len = 0; len <= MAXLEN; len++) {
+            fill_hex(buf, len);
+            for (slash = 0; slash < 2; slash++) {
+                assert_int_equal(jsonp_scan_plain(buf, len, slash), len);
+                for (p = 0; p < sizeof(plains) && len; p++) {
+                    buf[len - 1] = plains[p];
+                    assert_int_equal(jsonp_scan_plain(buf, len, slash), len);
+                }
+                fill_hex(buf, len);
+            }
+            for (at = 0; at < len; at++) {
+                for (s = 0; s < sizeof(specials); s++) {
+                    buf[at] = specials[s];
+                    for (slash = 0; slash < 2; slash++) {
+                        assert_int_equal(jsonp_scan_plain(buf, len, slash),
+                                         ref_scan(buf, len, slash));
+                    }
+                }
+                buf[at] = '5';
+            }
+        }
+    }
+}
+
+struct callback_data {
+    const char *str;
+    size_t len, pos;
+};
+
+/* Hand out one byte per call so the loader can't scan ahead */
+static size_t one_byte(void *buffer, size_t buflen, void *arg)
+{
+    struct callback_data *cd = arg;
+
+    if (!buflen || cd->pos >= cd->len)
+        return 0;
+    *(char *)buffer = cd->str[cd->pos++];
+    return 1;
+}
+
+static json_t *load_bytewise(const char *str, json_error_t *error)
+{
+    struct callback_data cd = { str, strlen(str), 0 };
+
+    return json_load_callback(one_byte, &cd, 0, error);
+}
+
+/* Loading from a string and a buffer gives the same values and errors, down
+ * to the line, column and position, as loading a byte at a time */
+static void check_load(const char *doc)
+{
+    json_error_t err, berr, ref;
+    json_t *val, *bval, *rval;
+
+    val = json_loads(doc, 0, &err);
+    bval = json_loadb(doc, strlen(doc), 0, &berr);
+    rval = load_bytewise(doc, &ref);
+    if (!rval) {
+        assert_null(val);
+        assert_null(bval);
+        assert_string_equal(err.text, ref.text);
+        assert_string_equal(berr.text, ref.text);
+        assert_int_equal(err.line, ref.line);
+        assert_int_equal(err.column, ref.column);
+        assert_int_equal(err.position, ref.position);
+        assert_int_equal(berr.column, ref.column);
+        assert_int_equal(berr.position, ref.position);
+        return;
+    }
+    assert_non_null(val);
+    assert_non_null(bval);
+    assert_true(json_equal(val, rval));
+    assert_true(json_equal(bval, rval));
+    json_decref(val);
+    json_decref(bval);
+    json_decref(rval);
+}
+
+static void test_load(void)
+{
+    /* Escapes, a two byte and a three byte character, and bad input */
+    static const char *inserts[] = {
+        "\\\"", "\\\\", "\\/", "\\n", "\\u00e9", "\\ud83d\\ude00", "/", "\xc3\xa9",
+        "\xe2\x82\xac", "\x7f", "\x01", "\n", "\xc3", "\xff", "\\x", "\\u12", "\"",
+    };
+    char doc[MAXLEN + 32];
+    char hex[MAXLEN];
+    size_t len, at, i;
+
+    for (len = 1; len < MAXLEN - 16; len += 3) {
+        fill_hex(hex, len);
+        for (at = 0; at <= len; at++) {
+            for (i = 0; i < sizeof(inserts) / sizeof(inserts[0]); i++) {
+                snprintf(doc, sizeof(doc), "[\"%.*s%s%.*s\", 1]", (int)at, hex,
+                         inserts[i], (int)(len - at), hex + at);
+                check_load(doc);
+            }
+        }
+    }
+
+    /* Strings on later lines, and unterminated ones */
+    check_load("{\n  \"job_id\": \"0123456789abcdef\",\n  \"x\": \"ab\x02\"\n}");
+    check_load("[\"0123456789abcdef0123456789abcdef0123456789abcdef");
+    check_load("\"0123456789abcdef0123456789abcdef\"");
+}
+
+/* Escape the way jansson documents, one character at a time */
+static void ref_dump(const char *str, size_t len, size_t flags, char *out)
+{
+    size_t i;
+
+    *out++ = '"';
+    for (i = 0; i < len; i++) {
+        unsigned char c = str[i];
+
+        if (c == '"' || c == '\\')
+            out += sprintf(out, "\\%c", c);
+        else if (c == '/' && (flags & JSON_ESCAPE_SLASH))
+            out += sprintf(out, "\\/");
+        else if (c == '\n')
+            out += sprintf(out, "\\n");
+        else if (c == '\t')
+            out += sprintf(out, "\\t");
+        else if (c < 0x20)
+            out += sprintf(out, "\\u%04X", c);
+        else if (c == 0xc3 && (flags & JSON_ENSURE_ASCII)) {
+            /* only ever é in this test */
+            out += sprintf(out, "\\u00E9");
+            i++;
+        } else
+            *out++ = c;
+    }
+    *out++ = '"';
+    *out = '\0';
+}
+
+/* The connector parses pipelined lines from a buffer that isn't terminated
+ * after the first, so only the line's bytes may be read */
+static void test_load_line(void)
+{
+    static const char buf[] = "{\"id\":1,\"method\":\"mining.submit\"}\n{\"id\":2,\"par";
+    const int len = strchr(buf, '\n') - buf + 1;
+    json_error_t err;
+    json_t *val;
+
+    val = json_loadb(buf, len, JSON_DISABLE_EOF_CHECK, &err);
+    assert_non_null(val);
+    assert_int_equal(json_integer_value(json_object_get(val, "id")), 1);
+    assert_int_equal(err.position, len - 1);
+    json_decref(val);
+
+    /* A string stops at the end of its first value */
+    val = json_loads(buf, JSON_DISABLE_EOF_CHECK, &err);
+    assert_non_null(val);
+    assert_int_equal(err.position, len - 1);
+    json_decref(val);
+
+    /* A value cut off by the line's end is an error, not read past it */
+    assert_null(json_loadb(buf + len, sizeof(buf) - 1 - len, JSON_DISABLE_EOF_CHECK, &err));
+}
+
+static void test_dump(void)
+{
+    static const char *inserts[] = { "\"", "\\", "/", "\n", "\t", "\x01", "\x1f", "\x7f",
+                                     "\xc3\xa9", "" };
+    static const size_t flagsets[] = { JSON_ENCODE_ANY, JSON_ENCODE_ANY | JSON_ESCAPE_SLASH,
+                                       JSON_ENCODE_ANY | JSON_ENSURE_ASCII };
+    char str[MAXLEN + 8], want[MAXLEN * 6 + 16];
+    size_t len, at, i, f;
+
+    for (len = 0; len < MAXLEN; len++) {
+        for (at = 0; at <= len; at++) {
+            for (i = 0; i < sizeof(inserts) / sizeof(inserts[0]); i++) {
+                size_t ilen = strlen(inserts[i]);
+                json_t *val;
+
+                fill_hex(str, len);
+                memmove(str + at + ilen, str + at, len - at);
+                memcpy(str + at, inserts[i], ilen);
+                val = json_stringn(str, len + ilen);
+                assert_non_null(val);
+                for (f = 0; f < sizeof(flagsets) / sizeof(flagsets[0]); f++) {
+                    char *got = json_dumps(val, flagsets[f]);
+
+                    ref_dump(str, len + ilen, flagsets[f], want);
+                    assert_non_null(got);
+                    assert_string_equal(got, want);
+                    free(got);
+                }
+                json_decref(val);
+            }
+        }
+    }
+}
+
+int main(void)
+{
+    printf("Running JSON string scan tests...\n\n");
+
+    run_test(test_scan_plain);
+    run_test(test_load);
+    run_test(test_load_line);
+    run_test(test_dump);
+
+    printf("\nAll JSON string scan tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * Unit tests for the lock contention profiler
+ * Tests per call site acquisition counts, contended acquisitions, wait and
+ * hold times, read locks, cond waits and the sorted top-N report
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "lockprof.h"
+
+#define TEST_THREADS 4
+#define TEST_LOCKS 10000
+
+static bool perf_tests_enabled(void)
+{
+    const char *val = getenv("CKPOOL_PERF_TESTS");
+
+    return val && val[0] == '1';
+}
+
+/* Find a site in the report by function name and lock type */
+static json_t *report_site(json_t *report, const char *func, const char *type)
+{
+    json_t *arr_val = json_object_get(report, "top"), *site;
+    size_t i;
+
+    json_array_foreach(arr_val, i, site) {
+        if (!strcmp(json_string_value(json_object_get(site, "func")), func) &&
+            !strcmp(json_string_value(json_object_get(site, "type")), type))
+            return site;
+    }
+    return NULL;
+}
+
+static int64_t site_int(json_t *site, const char *key)
+{
+    return json_integer_value(json_object_get(site, key));
+}
+
+static double hist_value(json_t *site, const char *hist, const char *key)
+{
+    return json_real_value(json_object_get(json_object_get(site, hist), key));
+}
+
+/* Nothing is recorded while profiling is disabled */
+static void test_disabled(void)
+{
+    mutex_t lock;
+    json_t *report;
+
+    mutex_init(&lock);
+    mutex_lock(&lock);
+    mutex_unlock(&lock);
+    report = lockprof_json(LOCKPROF_TOP);
+    assert_false(json_is_true(json_object_get(report, "enabled")));
+    assert_null(report_site(report, __func__, "mutex"));
+    json_decref(report);
+    mutex_destroy(&lock);
+}
+
+/* Uncontended acquisitions are counted with their hold times */
+static void test_uncontended(void)
+{
+    json_t *report, *site;
+    mutex_t lock;
+    int i;
+
+    lockprof_enable(true);
+    mutex_init(&lock);
+    for (i = 0; i < 100; i++) {
+        mutex_lock(&lock);
+        cksleep_us(10);
+        mutex_unlock(&lock);
+    }
+    lockprof_enable(false);
+
+    report = lockprof_json(LOCKPROF_SITES);
+    site = report_site(report, __func__, "mutex");
+    assert_non_null(site);
+    assert_int_equal(site_int(site, "acquires"), 100);
+    assert_int_equal(site_int(site, "contended"), 0);
+    assert_int_equal(json_integer_value(json_object_get(json_object_get(site, "hold"), "count")), 100);
+    /* Held for at least the 10us sleep each time */
+    assert_true(hist_value(site, "hold", "p50") >= 8);
+    assert_true(hist_value(site, "wait", "max") < 1);
+    json_decref(report);
+    mutex_destroy(&lock);
+}
+
+static mutex_t contended_lock;
+
+static void *contend_thread(void __maybe_unused *arg)
+{
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        mutex_lock(&contended_lock);
+        cksleep_us(50);
+        mutex_unlock(&contended_lock);
+    }
+    return NULL;
+}
+
+/* Threads fighting over one lock show up as contended with wait times */
+static void test_contended(void)
+{
+    pthread_t pth[TEST_THREADS];
+    json_t *report, *site;
+    int i;
+
+    lockprof_enable(true);
+    mutex_init(&contended_lock);
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_create(&pth[i], NULL, contend_thread, NULL);
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_join(pth[i], NULL);
+    lockprof_enable(false);
+
+    report = lockprof_json(LOCKPROF_SITES);
+    site = report_site(report, "contend_thread", "mutex");
+    assert_non_null(site);
+    assert_int_equal(site_int(site, "acquires"), TEST_THREADS * 200);
+    assert_true(site_int(site, "contended") > 0);
+    assert_true(hist_value(site, "wait", "max") >= 10);
+    json_decref(report);
+    mutex_destroy(&contended_lock);
+}
+
+/* Read locks only record waits, write locks record holds, and the cklock
+ * variants are recorded against the caller's site */
+static void test_rwlocks(void)
+{
+    json_t *report, *site;
+    cklock_t lock;
+    int i;
+
+    lockprof_enable(true);
+    cklock_init(&lock);
+    for (i = 0; i < 10; i++) {
+        ck_rlock(&lock);
+        ck_runlock(&lock);
+    }
+    for (i = 0; i < 5; i++) {
+        ck_wlock(&lock);
+        ck_wunlock(&lock);
+    }
+    lockprof_enable(false);
+
+    report = lockprof_json(LOCKPROF_SITES);
+    site = report_site(report, __func__, "read");
+    assert_non_null(site);
+    assert_int_equal(site_int(site, "acquires"), 10);
+    assert_null(json_object_get(site, "hold"));
+    site = report_site(report, __func__, "write");
+    assert_non_null(site);
+    assert_int_equal(site_int(site, "acquires"), 5);
+    assert_int_equal(json_integer_value(json_object_get(json_object_get(site, "hold"), "count")), 5);
+    json_decref(report);
+}
+
+/* Time spent waiting on a condition does not count as holding the mutex */
+static void test_cond_wait(void)
+{
+    pthread_cond_t cond;
+    json_t *report, *site;
+    mutex_t lock;
+    ts_t abs;
+    tv_t now;
+
+    lockprof_enable(true);
+    mutex_init(&lock);
+    cond_init(&cond);
+    mutex_lock(&lock);
+    tv_time(&now);
+    tv_to_ts(&abs, &now);
+    abs.tv_nsec += 50000000;
+    if (abs.tv_nsec >= 1000000000) {
+        abs.tv_sec++;
+        abs.tv_nsec -= 1000000000;
+    }
+    cond_timedwait(&cond, &lock, &abs);
+    mutex_unlock(&lock);
+    lockprof_enable(false);
+
+    report = lockprof_json(LOCKPROF_SITES);
+    site = report_site(report, __func__, "mutex");
+    assert_non_null(site);
+    /* The hold before and after the wait, both well under the 50ms wait */
+    assert_int_equal(json_integer_value(json_object_get(json_object_get(site, "hold"), "count")), 2);
+    assert_true(hist_value(site, "hold", "max") < 10000);
+    json_decref(report);
+    mutex_destroy(&lock);
+}
+
+/* The report is ordered by total wait and limited to the top N */
+static void test_report_order(void)
+{
+    json_t *report, *arr_val;
+    double last = -1, wait;
+    size_t i;
+
+    report = lockprof_json(2);
+    assert_true(site_int(report, "sites") >= 4);
+    arr_val = json_object_get(report, "top");
+    assert_int_equal((int)json_array_size(arr_val), 2);
+    json_decref(report);
+
+    report = lockprof_json(LOCKPROF_SITES);
+    arr_val = json_object_get(report, "top");
+    for (i = 0; i < json_array_size(arr_val); i++) {
+        json_t *site = json_array_get(arr_val, i);
+
+        wait = hist_value(site, "wait", "mean") * site_int(site, "acquires");
+        if (last >= 0)
+            assert_true(wait <= last * 1.01 + 1);
+        last = wait;
+    }
+    json_decref(report);
+}
+
+static double lock_loop_ns(mutex_t *lock)
+{
+    struct timespec start, end;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < TEST_LOCKS * 100; i++) {
+        mutex_lock(lock);
+        mutex_unlock(lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / (TEST_LOCKS * 100);
+}
+
+static void test_overhead_performance(void)
+{
+    mutex_t lock;
+    double off, on;
+
+    mutex_init(&lock);
+    off = lock_loop_ns(&lock);
+    lockprof_enable(true);
+    on = lock_loop_ns(&lock);
+    lockprof_enable(false);
+    printf("    Uncontended lock/unlock: %.1fns disabled, %.1fns profiled\n", off, on);
+    mutex_destroy(&lock);
+}
+
+int main(void)
+{
+    printf("Running lock profiler tests...\n\n");
+
+    run_test(test_disabled);
+    run_test(test_uncontended);
+    run_test(test_contended);
+    run_test(test_rwlocks);
+    run_test(test_cond_wait);
+    run_test(test_report_order);
+
+    if (perf_tests_enabled()) {
+        printf("\n[PERFORMANCE REGRESSION TESTS]\n");
+        printf("BEGIN PERF TESTS: test-lockprof\n");
+        run_test(test_overhead_performance);
+        printf("END PERF TESTS: test-lockprof\n");
+    }
+
+    printf("\nAll lock profiler tests passed!\n");
+    return 0;
+}
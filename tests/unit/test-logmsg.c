@@ -1,5 +1,6 @@
 /*
- * Unit tests for LOGMSGSIZ chunking logic in libckpool.h
+ * Unit tests for LOGMSGSIZ chunking logic in libckpool.h and the per thread
+ * log rings in logring.c
  *
  * LOGMSGSIZ splits messages longer than DEFLOGBUFSIZ-2 (510) bytes into
  * multiple chunks, each delivered via logmsg(). This test verifies that
@@ -12,14 +13,26 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "../test_common.h"
 #include "libckpool.h"
+#include "logring.h"
+
+static bool perf_tests_enabled(void)
+{
+	const char *val = getenv("CKPOOL_PERF_TESTS");
+
+	return val && val[0] == '1';
+}
 
 /* ── Capture infrastructure ─────────────────────────────────────────────── */
 
@@ -29,6 +42,9 @@ static char  g_captured[CAPTURE_BUF_SIZE];
 static int   g_captured_len = 0;
 static int   g_chunk_count  = 0;
 
+/* When set logmsg forwards to the log rings as ckpool's does */
+static bool  g_ring = false;
+
 static void reset_capture(void)
 {
 	memset(g_captured, 0, sizeof(g_captured));
@@ -40,11 +56,15 @@ static void reset_capture(void)
  * Each call appends the formatted string to g_captured. */
 void logmsg(int loglevel, const char *fmt, ...)
 {
-	(void)loglevel;
 	va_list ap;
 	char *buf = NULL;
 
 	va_start(ap, fmt);
+	if (g_ring) {
+		logring_vlog(loglevel, 0, fmt, ap);
+		va_end(ap);
+		return;
+	}
 	if (vasprintf(&buf, fmt, ap) < 0)
 		buf = NULL;
 	va_end(ap);
@@ -187,6 +207,428 @@ static void test_one_over_boundary(void)
 	printf("  ✓ one-over boundary (%d bytes): 2 chunks, complete\n", DEFLOGBUFSIZ - 1);
 }
 
+/* ── Log rings ───────────────────────────────────────────────────────────── */
+
+static int g_logfd = -1;
+
+static int test_logfd(void *arg)
+{
+	(void)arg;
+	return g_logfd;
+}
+
+static void ring_log(int loglevel, int errn, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	logring_vlog(loglevel, errn, fmt, ap);
+	va_end(ap);
+}
+
+static int temp_fd(char *path)
+{
+	int fd;
+
+	strcpy(path, "/tmp/ckpool-test-logmsg-XXXXXX");
+	fd = mkstemp(path);
+	assert_true(fd >= 0);
+	return fd;
+}
+
+/* Start the flusher writing to a new temporary log file and optionally a
+ * temporary console file */
+static void start_rings(char *logpath, char *conpath, int *confd)
+{
+	logring_sink_t sink = {
+		.logfd = test_logfd,
+		.console_level = LOG_WARNING,
+		.console_fd = -1,
+		.console_clear = true,
+		.flush_ms = 5,
+	};
+
+	g_logfd = temp_fd(logpath);
+	if (conpath)
+		sink.console_fd = *confd = temp_fd(conpath);
+	else
+		sink.console_level = -1;
+	assert_true(logring_start(&sink));
+}
+
+/* Stop the flusher, returning the whole log file with its file closed */
+static char *stop_rings(const char *logpath)
+{
+	char *buf;
+	FILE *fp;
+	long len;
+
+	logring_stop();
+	close(g_logfd);
+	g_logfd = -1;
+	fp = fopen(logpath, "r");
+	assert_non_null(fp);
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	buf = ckzalloc(len + 1);
+	assert_int_equal((int)fread(buf, 1, len, fp), (int)len);
+	fclose(fp);
+	unlink(logpath);
+	return buf;
+}
+
+/* Length of the [YYYY-MM-DD HH:MM:SS.mmm] stamp and space starting line */
+static int stamp_len(const char *line)
+{
+	int y, mo, d, h, mi, sec, ms, n = 0;
+
+	assert_int_equal(sscanf(line, "[%4d-%2d-%2d %2d:%2d:%2d.%3d] %n",
+				&y, &mo, &d, &h, &mi, &sec, &ms, &n), 7);
+	assert_int_equal(n, 26);
+	return n;
+}
+
+typedef struct {
+	int id;
+	int lines;
+	bool macro;
+} log_thread_t;
+
+static void *log_thread(void *arg)
+{
+	log_thread_t *lt = arg;
+	int i;
+
+	for (i = 0; i < lt->lines; i++) {
+		if (lt->macro)
+			LOGNOTICE("Accepted client %d share %d diff %.1f", lt->id, i, 1024.5);
+		else
+			ring_log(LOG_NOTICE, 0, "t%d n%d", lt->id, i);
+	}
+	return NULL;
+}
+
+/*
+ * Lines from many threads each appear once, whole and in the order each
+ * thread logged them, even though the threads fill their rings faster than
+ * the flusher empties them.
+ */
+static void test_ring_threads(void)
+{
+	pthread_t threads[8];
+	log_thread_t lt[8];
+	int next[8] = {}, i, lines = 0;
+	char logpath[64], *buf, *line, *eol;
+	json_t *stats;
+
+	start_rings(logpath, NULL, NULL);
+	for (i = 0; i < 8; i++) {
+		lt[i].id = i;
+		lt[i].lines = 2000;
+		lt[i].macro = false;
+		create_pthread(&threads[i], log_thread, &lt[i]);
+	}
+	for (i = 0; i < 8; i++)
+		join_pthread(threads[i]);
+	buf = stop_rings(logpath);
+
+	for (line = buf; *line; line = eol + 1) {
+		int t, n;
+
+		eol = strchr(line, '\n');
+		assert_non_null(eol);
+		assert_int_equal(sscanf(line + stamp_len(line), "t%d n%d", &t, &n), 2);
+		assert_true(t >= 0 && t < 8);
+		assert_int_equal(n, next[t]);
+		next[t]++;
+		lines++;
+	}
+	assert_int_equal(lines, 16000);
+
+	/* Rings of the exited threads are freed once drained */
+	stats = logring_stats();
+	assert_true(json_integer_value(json_object_get(stats, "lines")) >= 16000);
+	assert_int_equal(json_integer_value(json_object_get(stats, "pending")), 0);
+	assert_true(json_integer_value(json_object_get(stats, "rings")) <= 1);
+	json_decref(stats);
+	free(buf);
+	printf("  ✓ 8 threads x 2000 lines: all present, in order per thread\n");
+}
+
+static void *log_one(void *arg)
+{
+	ring_log(LOG_NOTICE, 0, "%s", (const char *)arg);
+	return NULL;
+}
+
+/*
+ * Lines logged one after another by different threads are merged from their
+ * rings back into the order they were logged.
+ */
+static void test_ring_merge_order(void)
+{
+	const char *expect[] = { "first", "second", "third", "fourth", "fifth" };
+	char logpath[64], *buf, *line;
+	pthread_t thread;
+	int i;
+
+	start_rings(logpath, NULL, NULL);
+	for (i = 0; i < 5; i++) {
+		if (i % 2) {
+			ring_log(LOG_NOTICE, 0, "%s", expect[i]);
+		} else {
+			create_pthread(&thread, log_one, (void *)expect[i]);
+			join_pthread(thread);
+		}
+	}
+	buf = stop_rings(logpath);
+
+	line = buf;
+	for (i = 0; i < 5; i++) {
+		int len = stamp_len(line), slen = strlen(expect[i]);
+
+		assert_int_equal(strncmp(line + len, expect[i], slen), 0);
+		assert_int_equal(line[len + slen], '\n');
+		line += len + slen + 1;
+	}
+	assert_int_equal(*line, '\0');
+	free(buf);
+	printf("  ✓ lines from alternating threads merged in logged order\n");
+}
+
+/*
+ * A line longer than a record spans consecutive records and comes out as
+ * one line with one timestamp. errno is appended when passed.
+ */
+static void test_ring_long_and_errno(void)
+{
+	char logpath[64], *buf, *msg, *line;
+	const char *err = " with errno 2: No such file or directory\n";
+	int len;
+
+	msg = make_message(LOGRING_RECSIZ * 3 + 17);
+	start_rings(logpath, NULL, NULL);
+	ring_log(LOG_NOTICE, 0, "%s", msg);
+	ring_log(LOG_ERR, ENOENT, "Failed to open %s", "ckpool.conf");
+	buf = stop_rings(logpath);
+
+	line = buf;
+	len = stamp_len(line);
+	assert_int_equal(strncmp(line + len, msg, strlen(msg)), 0);
+	line += len + strlen(msg);
+	assert_int_equal(*line++, '\n');
+	len = stamp_len(line);
+	assert_string_equal(line + len, "Failed to open ckpool.conf with errno 2: No such file or directory\n");
+	assert_true(strstr(buf, err) != NULL);
+	free(buf);
+	free(msg);
+	printf("  ✓ %d byte line spans records, errno appended\n", LOGRING_RECSIZ * 3 + 17);
+}
+
+/*
+ * Only lines at the console level or more urgent go to the console, each
+ * after a clear line, while the log file gets everything.
+ */
+static void test_ring_console(void)
+{
+	char logpath[64], conpath[64], *buf, *con;
+	int confd;
+
+	start_rings(logpath, conpath, &confd);
+	ring_log(LOG_NOTICE, 0, "quiet");
+	ring_log(LOG_WARNING, 0, "loud");
+	buf = stop_rings(logpath);
+
+	con = ckzalloc(256);
+	assert_true(pread(confd, con, 255, 0) > 0);
+	close(confd);
+	unlink(conpath);
+	assert_int_equal(strncmp(con, "\33[2K\r", 5), 0);
+	assert_string_equal(con + 5 + stamp_len(con + 5), "loud\n");
+	assert_true(strstr(buf, "] quiet\n") != NULL);
+	assert_true(strstr(buf, "] loud\n") != NULL);
+	free(con);
+	free(buf);
+	printf("  ✓ console gets warnings only, with clear line\n");
+}
+
+/*
+ * LOGMSGSIZ discards messages below logmsg_level without formatting them.
+ */
+static void test_level_filter(void)
+{
+	reset_capture();
+	logmsg_level = LOG_NOTICE;
+	LOGDEBUG("%s", "filtered");
+	LOGNOTICE("%s", "kept");
+	logmsg_level = LOG_DEBUG;
+
+	assert_int_equal(g_chunk_count, 1);
+	assert_string_equal(g_captured, "kept");
+	printf("  ✓ messages below logmsg_level are discarded\n");
+}
+
+/* ── Throughput ──────────────────────────────────────────────────────────── */
+
+/* The logging path before the rings: LOGMSGSIZ asprintfs the message, logmsg
+ * vasprintfs it again, formats a timestamp, asprintfs the line and strdups
+ * it into a mutex protected queue for a logger thread to write and free. */
+typedef struct legacy_msg legacy_msg_t;
+
+struct legacy_msg {
+	legacy_msg_t *next;
+	legacy_msg_t *prev;
+	char *log;
+};
+
+static legacy_msg_t *legacy_msgs;
+static pthread_mutex_t legacy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t legacy_cond = PTHREAD_COND_INITIALIZER;
+static bool legacy_done;
+static int legacy_fd;
+
+static void legacy_logmsg(const char *fmt, ...)
+{
+	char *log, *buf, stamp[128];
+	legacy_msg_t *msg;
+	struct tm tm;
+	tv_t now_tv;
+	va_list ap;
+
+	va_start(ap, fmt);
+	VASPRINTF(&buf, fmt, ap);
+	va_end(ap);
+	tv_time(&now_tv);
+	localtime_r(&now_tv.tv_sec, &tm);
+	sprintf(stamp, "[%d-%02d-%02d %02d:%02d:%02d.%03d]", tm.tm_year + 1900,
+		tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+		(int)(now_tv.tv_usec / 1000));
+	ASPRINTF(&log, "%s %s\n", stamp, buf);
+	msg = ckalloc(sizeof(legacy_msg_t));
+	msg->log = strdup(log);
+	pthread_mutex_lock(&legacy_lock);
+	DL_APPEND(legacy_msgs, msg);
+	pthread_cond_signal(&legacy_cond);
+	pthread_mutex_unlock(&legacy_lock);
+	free(log);
+	free(buf);
+}
+
+static void *legacy_logger(void *arg)
+{
+	FILE *fp = fdopen(legacy_fd, "a");
+
+	(void)arg;
+	setvbuf(fp, NULL, _IOLBF, 0);
+	while (42) {
+		legacy_msg_t *msg;
+
+		pthread_mutex_lock(&legacy_lock);
+		while (!legacy_msgs && !legacy_done)
+			pthread_cond_wait(&legacy_cond, &legacy_lock);
+		msg = legacy_msgs;
+		if (msg)
+			DL_DELETE(legacy_msgs, msg);
+		pthread_mutex_unlock(&legacy_lock);
+		if (!msg)
+			break;
+		fprintf(fp, "%s", msg->log);
+		free(msg->log);
+		free(msg);
+	}
+	fclose(fp);
+	return NULL;
+}
+
+static void *legacy_thread(void *arg)
+{
+	log_thread_t *lt = arg;
+	int i;
+
+	for (i = 0; i < lt->lines; i++) {
+		char *buf;
+
+		ASPRINTF(&buf, "Accepted client %d share %d diff %.1f", lt->id, i, 1024.5);
+		legacy_logmsg("%s", buf);
+		free(buf);
+	}
+	return NULL;
+}
+
+static double run_threads(void *(*func)(void *), const int nthreads, const int lines)
+{
+	pthread_t threads[16];
+	log_thread_t lt[16];
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		lt[i].id = i;
+		lt[i].lines = lines;
+		lt[i].macro = true;
+		create_pthread(&threads[i], func, &lt[i]);
+	}
+	for (i = 0; i < nthreads; i++)
+		join_pthread(threads[i]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Lines per second logged through LOGNOTICE to /dev/null by 1 to 8 threads,
+ * before and with the rings. Times include draining everything logged. */
+static void test_throughput(void)
+{
+	const int lines = 200000;
+	int nthreads;
+
+	for (nthreads = 1; nthreads <= 8; nthreads *= 2) {
+		pthread_t logger;
+		double legacy, ring;
+		struct timespec start, end;
+		char logpath[64];
+		int64_t waits;
+		json_t *stats;
+
+		legacy_fd = open("/dev/null", O_WRONLY);
+		legacy_done = false;
+		create_pthread(&logger, legacy_logger, NULL);
+		legacy = run_threads(legacy_thread, nthreads, lines);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pthread_mutex_lock(&legacy_lock);
+		legacy_done = true;
+		pthread_cond_signal(&legacy_cond);
+		pthread_mutex_unlock(&legacy_lock);
+		join_pthread(logger);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		legacy += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+		stats = logring_stats();
+		waits = json_integer_value(json_object_get(stats, "waits"));
+		json_decref(stats);
+		start_rings(logpath, NULL, NULL);
+		close(g_logfd);
+		g_logfd = open("/dev/null", O_WRONLY);
+		g_ring = true;
+		ring = run_threads(log_thread, nthreads, lines);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		logring_stop();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ring += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		g_ring = false;
+		close(g_logfd);
+		unlink(logpath);
+
+		stats = logring_stats();
+		printf("    %d thread%s: queue %.0f lines/s, rings %.0f lines/s (%.1fx), %"PRId64" waits\n",
+		       nthreads, nthreads > 1 ? "s" : " ", nthreads * lines / legacy,
+		       nthreads * lines / ring, legacy / ring,
+		       (int64_t)json_integer_value(json_object_get(stats, "waits")) - waits);
+		json_decref(stats);
+	}
+}
+
 /* ── main ────────────────────────────────────────────────────────────────── */
 
 int main(void)
@@ -199,7 +641,22 @@ int main(void)
 	run_test(test_extra_long_message_complete);
 	run_test(test_exact_chunk_boundary);
 	run_test(test_one_over_boundary);
+	run_test(test_level_filter);
+
+	printf("Running log ring tests...\n");
+
+	run_test(test_ring_threads);
+	run_test(test_ring_merge_order);
+	run_test(test_ring_long_and_errno);
+	run_test(test_ring_console);
+
+	if (perf_tests_enabled()) {
+		printf("\n[PERFORMANCE REGRESSION TESTS]\n");
+		printf("BEGIN PERF TESTS: test-logmsg\n");
+		run_test(test_throughput);
+		printf("END PERF TESTS: test-logmsg\n");
+	}
 
-	printf("All LOGMSGSIZ tests passed.\n");
+	printf("All LOGMSGSIZ and log ring tests passed.\n");
 	return 0;
 }
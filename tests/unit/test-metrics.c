@@ -0,0 +1,377 @@
+/*
+ * Unit tests for the metrics primitives behind the prometheus endpoint
+ * Tests per-thread counters, latency histogram bucketing and text rendering,
+ * and the log-linear share latency histograms and their percentiles
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "metrics.h"
+
+#define TEST_THREADS 8
+#define TEST_INCREMENTS 100000
+
+static bool perf_tests_enabled(void)
+{
+    const char *val = getenv("CKPOOL_PERF_TESTS");
+
+    return val && val[0] == '1';
+}
+
+static metric_counter_t shared_counter;
+
+static void *counter_thread(void *arg)
+{
+    int i, count = *(int *)arg;
+
+    for (i = 0; i < count; i++)
+        metric_inc(&shared_counter);
+    return NULL;
+}
+
+static metric_slothist_t shared_hist;
+
+static void *slothist_thread(void *arg)
+{
+    int i, count = *(int *)arg;
+
+    for (i = 0; i < count; i++)
+        metric_slot_observe(&shared_hist, 0.0005);
+    return NULL;
+}
+
+/* Concurrent increments from many threads must all be accounted for */
+static void test_counter_threads(void)
+{
+    pthread_t pth[TEST_THREADS];
+    int count = TEST_INCREMENTS;
+    int i;
+
+    memset(&shared_counter, 0, sizeof(shared_counter));
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_create(&pth[i], NULL, counter_thread, &count);
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_join(pth[i], NULL);
+
+    assert_true(metric_read(&shared_counter) == (uint64_t)TEST_THREADS * TEST_INCREMENTS);
+}
+
+static void test_counter_add(void)
+{
+    metric_counter_t mc;
+
+    memset(&mc, 0, sizeof(mc));
+    assert_true(metric_read(&mc) == 0);
+    metric_add(&mc, 5);
+    metric_inc(&mc);
+    assert_true(metric_read(&mc) == 6);
+}
+
+/* Slots must not share cachelines */
+static void test_counter_layout(void)
+{
+    metric_counter_t mc;
+
+    assert_int_equal((int)sizeof(struct metric_slot), 64);
+    assert_int_equal((int)((char *)&mc.slot[1] - (char *)&mc.slot[0]), 64);
+}
+
+/* Bucket i holds values <= 2^i microseconds with the last being +Inf */
+static void test_bucket_boundaries(void)
+{
+    assert_int_equal(metric_bucket(0), 0);
+    assert_int_equal(metric_bucket(-1), 0);
+    assert_int_equal(metric_bucket(0.000001), 0);
+    assert_int_equal(metric_bucket(0.0000015), 1);
+    assert_int_equal(metric_bucket(0.000002), 1);
+    assert_int_equal(metric_bucket(0.000003), 2);
+    assert_int_equal(metric_bucket(0.000004), 2);
+    assert_int_equal(metric_bucket(0.000005), 3);
+    assert_int_equal(metric_bucket(0.001), 10);
+    assert_int_equal(metric_bucket(0.001024), 10);
+    assert_int_equal(metric_bucket(0.001025), 11);
+    assert_int_equal(metric_bucket(1), 20);
+    assert_int_equal(metric_bucket(33), METRIC_BUCKETS - 2);
+    assert_int_equal(metric_bucket(33.554432), METRIC_BUCKETS - 2);
+    assert_int_equal(metric_bucket(33.554433), METRIC_BUCKETS - 1);
+    assert_int_equal(metric_bucket(34), METRIC_BUCKETS - 1);
+    assert_int_equal(metric_bucket(3600), METRIC_BUCKETS - 1);
+}
+
+static void test_hist_observe(void)
+{
+    metric_hist_t mh;
+
+    memset(&mh, 0, sizeof(mh));
+    metric_observe(&mh, 0.0005);
+    metric_observe(&mh, 0.0005);
+    metric_observe(&mh, 2);
+    assert_true(mh.count == 3);
+    assert_true(mh.bucket[metric_bucket(0.0005)] == 2);
+    assert_true(mh.bucket[metric_bucket(2)] == 1);
+    assert_double_equal((double)mh.sum_ns / 1000000000, 2.001, 1e-6);
+}
+
+/* Rendered buckets are cumulative and end with a +Inf equal to the count */
+static void test_hist_render(void)
+{
+    metrics_buf_t mb = {};
+    metric_hist_t mh;
+    char *line;
+
+    memset(&mh, 0, sizeof(mh));
+    metric_observe(&mh, 0.000001);
+    metric_observe(&mh, 0.5);
+    metric_observe(&mh, 100);
+    metrics_hist(&mb, "test_seconds", "btcd=\"a\"", &mh);
+
+    assert_non_null(mb.buf);
+    assert_true(strstr(mb.buf, "test_seconds_bucket{btcd=\"a\",le=\"1e-06\"} 1\n") != NULL);
+    assert_true(strstr(mb.buf, "test_seconds_bucket{btcd=\"a\",le=\"0.524288\"} 2\n") != NULL);
+    assert_true(strstr(mb.buf, "test_seconds_bucket{btcd=\"a\",le=\"+Inf\"} 3\n") != NULL);
+    assert_true(strstr(mb.buf, "test_seconds_count{btcd=\"a\"} 3\n") != NULL);
+    line = strstr(mb.buf, "test_seconds_sum{btcd=\"a\"} ");
+    assert_non_null(line);
+    assert_double_equal(atof(line + strlen("test_seconds_sum{btcd=\"a\"} ")), 100.500001, 1e-6);
+    free(mb.buf);
+
+    /* Unlabelled histograms have no leading comma */
+    memset(&mb, 0, sizeof(mb));
+    metrics_hist(&mb, "bare_seconds", NULL, &mh);
+    assert_true(strstr(mb.buf, "bare_seconds_bucket{le=\"+Inf\"} 3\n") != NULL);
+    assert_true(strstr(mb.buf, "bare_seconds_count 3\n") != NULL);
+    free(mb.buf);
+}
+
+/* Observations from every thread's slot are summed, and rendered as one */
+static void test_slothist_threads(void)
+{
+    pthread_t pth[TEST_THREADS];
+    int count = TEST_INCREMENTS;
+    metrics_buf_t mb = {};
+    metric_hist_t mh;
+    int i;
+
+    assert_int_equal((int)(sizeof(struct metric_hist_slot) % 64), 0);
+    memset(&shared_hist, 0, sizeof(shared_hist));
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_create(&pth[i], NULL, slothist_thread, &count);
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_join(pth[i], NULL);
+    metric_slot_observe(&shared_hist, 2);
+
+    metric_slothist_read(&mh, &shared_hist);
+    assert_true(mh.count == (uint64_t)TEST_THREADS * TEST_INCREMENTS + 1);
+    assert_true(mh.bucket[metric_bucket(0.0005)] == (uint64_t)TEST_THREADS * TEST_INCREMENTS);
+    assert_true(mh.bucket[metric_bucket(2)] == 1);
+    assert_double_equal((double)mh.sum_ns / 1000000000, TEST_THREADS * TEST_INCREMENTS * 0.0005 + 2, 1e-3);
+
+    metrics_slothist(&mb, "slot_seconds", NULL, &shared_hist);
+    assert_true(strstr(mb.buf, "slot_seconds_count 800001\n") != NULL);
+    free(mb.buf);
+}
+
+static void test_render_values(void)
+{
+    metrics_buf_t mb = {};
+    metric_counter_t mc;
+
+    memset(&mc, 0, sizeof(mc));
+    metric_add(&mc, 42);
+    metrics_header(&mb, "ckpool_test_total", "counter", "Test counter");
+    metrics_counter(&mb, "ckpool_test_total", "reason=\"Stale\"", &mc);
+    metrics_value(&mb, "ckpool_test_gauge", NULL, 1.5);
+    assert_string_equal(mb.buf,
+        "# HELP ckpool_test_total Test counter\n"
+        "# TYPE ckpool_test_total counter\n"
+        "ckpool_test_total{reason=\"Stale\"} 42\n"
+        "ckpool_test_gauge 1.5\n");
+    assert_int_equal((int)mb.len, (int)strlen(mb.buf));
+    free(mb.buf);
+}
+
+/* The buffer grows past a page without losing or truncating content */
+static void test_buffer_growth(void)
+{
+    metrics_buf_t mb = {};
+    int i;
+
+    for (i = 0; i < 10000; i++)
+        metrics_printf(&mb, "line %d\n", i);
+    assert_true(mb.len == strlen(mb.buf));
+    assert_true(mb.size > mb.len);
+    assert_true(strstr(mb.buf, "line 0\nline 1\n") == mb.buf);
+    assert_true(strstr(mb.buf, "line 9999\n") != NULL);
+    free(mb.buf);
+}
+
+static void test_escape(void)
+{
+    char *s;
+
+    s = metrics_escape("plain.worker");
+    assert_string_equal(s, "plain.worker");
+    free(s);
+    s = metrics_escape("a\"b\\c\nd");
+    assert_string_equal(s, "a\\\"b\\\\c\\nd");
+    free(s);
+    s = metrics_escape(NULL);
+    assert_string_equal(s, "");
+    free(s);
+}
+
+/* Every value lands in a bucket whose range contains it and buckets cover
+ * the range contiguously */
+static void test_lat_buckets(void)
+{
+    uint64_t ns;
+    int i, bucket;
+
+    for (i = 0; i < 16; i++)
+        assert_int_equal(lat_bucket(i), i);
+    assert_int_equal(lat_bucket(16), 16);
+    assert_int_equal(lat_bucket(17), 16);
+    assert_int_equal(lat_bucket(18), 17);
+    assert_int_equal(lat_bucket(31), 23);
+    assert_int_equal(lat_bucket(32), 24);
+    assert_int_equal(lat_bucket(UINT64_MAX), LAT_BUCKETS - 1);
+
+    for (i = 1; i < LAT_BUCKETS; i++) {
+        assert_int_equal(lat_bucket(lat_bucket_max(i - 1) + 1), i);
+        assert_int_equal(lat_bucket(lat_bucket_max(i)), i);
+    }
+    for (ns = 1; ns < 1000000000000ULL; ns = ns * 3 / 2 + 1) {
+        bucket = lat_bucket(ns);
+        assert_true(ns <= lat_bucket_max(bucket));
+        assert_true(!bucket || ns > lat_bucket_max(bucket - 1));
+        /* Relative width of a bucket is at most one sub-bucket */
+        assert_true(lat_bucket_max(bucket) - ns <= ns / LAT_SUBBUCKETS + 1);
+    }
+}
+
+static void test_lat_percentiles(void)
+{
+    lat_hist_t lh, copy;
+    uint64_t p50, p99, p999;
+    json_t *val;
+    int i;
+
+    memset(&lh, 0, sizeof(lh));
+    lat_hist_copy(&copy, &lh);
+    assert_true(lat_percentile(&copy, 50) == 0);
+
+    /* 1us to 1000us uniformly */
+    for (i = 1; i <= 1000; i++)
+        lat_observe(&lh, i * 1000);
+    lat_observe(&lh, -5);
+    lat_hist_copy(&copy, &lh);
+    assert_true(copy.count == 1001);
+    assert_true(copy.max_ns == 1000000);
+    p50 = lat_percentile(&copy, 50);
+    p99 = lat_percentile(&copy, 99);
+    p999 = lat_percentile(&copy, 99.9);
+    assert_true(p50 >= 500000 && p50 <= 500000 * 9 / 8);
+    assert_true(p99 >= 990000 && p99 <= 1000000);
+    assert_true(p999 >= 999000 && p999 <= 1000000);
+    assert_true(lat_percentile(&copy, 100) == 1000000);
+
+    val = lat_hist_json(&lh);
+    assert_true(json_integer_value(json_object_get(val, "count")) == 1001);
+    assert_double_equal(json_real_value(json_object_get(val, "max")), 1000.0, 0.001);
+    assert_true(json_real_value(json_object_get(val, "p50")) >= 500.0);
+    json_decref(val);
+}
+
+static lat_hist_t shared_lat;
+
+static void *lat_thread(void *arg)
+{
+    int i, count = *(int *)arg;
+
+    for (i = 0; i < count; i++)
+        lat_observe(&shared_lat, i);
+    return NULL;
+}
+
+/* Concurrent observations are all counted and the max is never lost */
+static void test_lat_threads(void)
+{
+    pthread_t pth[TEST_THREADS];
+    int count = TEST_INCREMENTS;
+    lat_hist_t copy;
+    int i;
+
+    memset(&shared_lat, 0, sizeof(shared_lat));
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_create(&pth[i], NULL, lat_thread, &count);
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_join(pth[i], NULL);
+    lat_hist_copy(&copy, &shared_lat);
+    assert_true(copy.count == (uint64_t)TEST_THREADS * TEST_INCREMENTS);
+    assert_true(copy.max_ns == TEST_INCREMENTS - 1);
+}
+
+static void test_counter_performance(void)
+{
+    pthread_t pth[TEST_THREADS];
+    int count = TEST_INCREMENTS * 10;
+    struct timespec start, end;
+    double elapsed;
+    int i;
+
+    memset(&shared_counter, 0, sizeof(shared_counter));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_create(&pth[i], NULL, counter_thread, &count);
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_join(pth[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (elapsed > 0.0) {
+        printf("    metric_inc %d threads: %.2fM ops/sec (%.3f sec for %d ops)\n",
+               TEST_THREADS, (double)TEST_THREADS * count / elapsed / 1e6, elapsed,
+               TEST_THREADS * count);
+    }
+    assert_true(metric_read(&shared_counter) == (uint64_t)TEST_THREADS * count);
+    assert_true(elapsed < 5.0);
+}
+
+int main(void)
+{
+    printf("Running metrics tests...\n\n");
+
+    run_test(test_counter_add);
+    run_test(test_counter_layout);
+    run_test(test_counter_threads);
+    run_test(test_bucket_boundaries);
+    run_test(test_hist_observe);
+    run_test(test_hist_render);
+    run_test(test_slothist_threads);
+    run_test(test_render_values);
+    run_test(test_buffer_growth);
+    run_test(test_escape);
+    run_test(test_lat_buckets);
+    run_test(test_lat_percentiles);
+    run_test(test_lat_threads);
+
+    if (perf_tests_enabled()) {
+        printf("\n[PERFORMANCE REGRESSION TESTS]\n");
+        printf("BEGIN PERF TESTS: test-metrics\n");
+        run_test(test_counter_performance);
+        printf("END PERF TESTS: test-metrics\n");
+    }
+
+    printf("\nAll metrics tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,600 @@
+/*
+ * Unit tests for the mock bitcoind
+ * Tests the template and chain RPCs, blocks built from the template being
+ * accepted, tampered blocks being rejected with bitcoind's reasons, adding
+ * transactions to the mempool and latency, error and drop injection
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "metrics.h"
+#include "mockbtc.h"
+
+#define TEST_BITS "207fffff"
+#define TEST_HEIGHT 500
+
+static bool perf_tests_enabled(void)
+{
+    const char *val = getenv("CKPOOL_PERF_TESTS");
+
+    return val && val[0] == '1';
+}
+
+static mockbtc_t *start_mock(const int txns)
+{
+    mockbtc_conf_t conf;
+    mockbtc_t *mb;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.url = "127.0.0.1:0";
+    conf.bits = TEST_BITS;
+    conf.height = TEST_HEIGHT;
+    conf.txns = txns;
+    conf.txnsize = 200;
+    mb = mockbtc_start(&conf);
+    assert_non_null(mb);
+    assert_true(mockbtc_port(mb) > 0);
+    return mb;
+}
+
+/* Make one call the way ckpool's json_rpc_call does, a connection per call,
+ * returning the whole reply and the HTTP status, or NULL if it was dropped */
+static json_t *rpc(mockbtc_t *mb, const char *method, const char *params, int *status)
+{
+    int fd, len = 0, size = 65536, ret;
+    char port[8], *req, *buf, *body;
+    json_t *val = NULL;
+
+    snprintf(port, 8, "%d", mockbtc_port(mb));
+    fd = connect_socket("127.0.0.1", port);
+    assert_true(fd >= 0);
+    ASPRINTF(&body, "{\"method\": \"%s\", \"params\": %s, \"id\": 0}", method, params);
+    ASPRINTF(&req, "POST / HTTP/1.1\nAuthorization: Basic dTpw\nHost: 127.0.0.1\n"
+             "Content-type: application/json\nContent-Length: %d\n\n%s",
+             (int)strlen(body), body);
+    assert_true(write_socket(fd, req, strlen(req)) > 0);
+    free(req);
+    free(body);
+    buf = ckalloc(size);
+    while (wait_read_select(fd, 5) > 0) {
+        if (len + 1 >= size) {
+            size *= 2;
+            buf = realloc(buf, size);
+            assert_non_null(buf);
+        }
+        ret = read(fd, buf + len, size - 1 - len);
+        if (ret < 1)
+            break;
+        len += ret;
+    }
+    buf[len] = '\0';
+    close(fd);
+    if (len) {
+        *status = atoi(buf + 9);
+        body = strstr(buf, "\r\n\r\n");
+        assert_non_null(body);
+        val = json_loads(body + 4, 0, NULL);
+        assert_non_null(val);
+    }
+    free(buf);
+    return val;
+}
+
+static json_t *rpc_result(mockbtc_t *mb, const char *method, const char *params)
+{
+    json_t *val, *res_val;
+    int status = 0;
+
+    val = rpc(mb, method, params, &status);
+    assert_non_null(val);
+    assert_int_equal(status, 200);
+    assert_true(json_is_null(json_object_get(val, "error")));
+    res_val = json_incref(json_object_get(val, "result"));
+    json_decref(val);
+    return res_val;
+}
+
+static int rpc_error_code(mockbtc_t *mb, const char *method, const char *params)
+{
+    json_t *val;
+    int status = 0, code;
+
+    val = rpc(mb, method, params, &status);
+    assert_non_null(val);
+    assert_int_equal(status, 500);
+    code = json_integer_value(json_object_get(json_object_get(val, "error"), "code"));
+    json_decref(val);
+    return code;
+}
+
+/* Header byte order from the display order hex bitcoind uses */
+static void hash_bin(uchar *hash, const char *hex)
+{
+    uchar swap[32];
+
+    assert_true(hex2bin(swap, hex, 32));
+    bswap_256(hash, swap);
+}
+
+typedef struct test_block test_block_t;
+
+struct test_block {
+    json_t *gbt;
+    uchar cb[256];
+    int cblen;
+    uchar header[80];
+    uchar *txns;
+    int txnslen;
+    int ntxns;
+    uchar *txids; /* Coinbase slot first and room to pad an odd count */
+};
+
+/* Coinbase paying value to OP_TRUE at height, with a witness commitment
+ * output when witness is set */
+static void build_coinbase(test_block_t *tb, const int height, const uint64_t value,
+                           const char *witness)
+{
+    uint64_t le = htole64(value);
+    uchar *cb = tb->cb;
+    int ofs, len;
+
+    memcpy(cb, "\x01\x00\x00\x00\x01", 5);
+    ofs = 5;
+    memset(cb + ofs, 0, 32);
+    ofs += 32;
+    memset(cb + ofs, 0xff, 4);
+    ofs += 4;
+    len = ser_number(cb + ofs + 1, height);
+    cb[ofs] = len + 4;
+    ofs += 1 + len;
+    memcpy(cb + ofs, "test", 4);
+    ofs += 4;
+    memset(cb + ofs, 0xff, 4);
+    ofs += 4;
+    cb[ofs++] = witness ? 2 : 1;
+    memcpy(cb + ofs, &le, 8);
+    ofs += 8;
+    memcpy(cb + ofs, "\x01\x51", 2);
+    ofs += 2;
+    if (witness) {
+        memset(cb + ofs, 0, 8);
+        ofs += 8;
+        len = strlen(witness) / 2;
+        cb[ofs++] = len;
+        assert_true(hex2bin(cb + ofs, witness, len));
+        ofs += len;
+    }
+    memset(cb + ofs, 0, 4);
+    ofs += 4;
+    tb->cblen = ofs;
+}
+
+/* Fetch a template and serialise its transactions */
+static void get_template(mockbtc_t *mb, test_block_t *tb)
+{
+    json_t *txn_array, *txn_val;
+    size_t i;
+
+    memset(tb, 0, sizeof(test_block_t));
+    tb->gbt = rpc_result(mb, "getblocktemplate", "[{\"rules\": [\"segwit\"]}]");
+    txn_array = json_object_get(tb->gbt, "transactions");
+    tb->ntxns = json_array_size(txn_array);
+    tb->txids = ckzalloc(32 * (tb->ntxns + 2));
+    tb->txns = ckzalloc(1);
+    json_array_foreach(txn_array, i, txn_val) {
+        const char *data = json_string_value(json_object_get(txn_val, "data"));
+        int len = strlen(data) / 2;
+
+        tb->txns = realloc(tb->txns, tb->txnslen + len);
+        assert_true(hex2bin(tb->txns + tb->txnslen, data, len));
+        tb->txnslen += len;
+        hash_bin(tb->txids + 32 * (i + 1), json_string_value(json_object_get(txn_val, "txid")));
+    }
+}
+
+/* Build the header over the current coinbase and the template's txids */
+static void build_header(test_block_t *tb)
+{
+    uchar *hashes = ckalloc(32 * (tb->ntxns + 2)), bits[4];
+    uint32_t val;
+    int count, i;
+
+    memcpy(hashes, tb->txids, 32 * (tb->ntxns + 1));
+    gen_hash(tb->cb, hashes, tb->cblen);
+    for (count = tb->ntxns + 1; count > 1; count = (count + 1) / 2) {
+        if (count % 2)
+            memcpy(hashes + 32 * count, hashes + 32 * (count - 1), 32);
+        for (i = 0; i < count; i += 2)
+            gen_hash(hashes + 32 * i, hashes + 32 * (i / 2), 64);
+    }
+
+    val = htole32(json_integer_value(json_object_get(tb->gbt, "version")));
+    memcpy(tb->header, &val, 4);
+    hash_bin(tb->header + 4, json_string_value(json_object_get(tb->gbt, "previousblockhash")));
+    memcpy(tb->header + 36, hashes, 32);
+    free(hashes);
+    val = htole32(json_integer_value(json_object_get(tb->gbt, "curtime")));
+    memcpy(tb->header + 68, &val, 4);
+    assert_true(hex2bin(bits, json_string_value(json_object_get(tb->gbt, "bits")), 4));
+    for (i = 0; i < 4; i++)
+        tb->header[72 + i] = bits[3 - i];
+}
+
+/* A block on the current template claiming all the coinbase value it
+ * allows, the way ckpool builds one */
+static void build_block(mockbtc_t *mb, test_block_t *tb, const bool witness)
+{
+    get_template(mb, tb);
+    build_coinbase(tb, json_integer_value(json_object_get(tb->gbt, "height")),
+                   json_integer_value(json_object_get(tb->gbt, "coinbasevalue")),
+                   witness ? json_string_value(json_object_get(tb->gbt,
+                                               "default_witness_commitment")) : NULL);
+    build_header(tb);
+}
+
+/* Find a nonce whose hash does, or deliberately doesn't, meet the target */
+static void solve_block(test_block_t *tb, const bool meet)
+{
+    uchar target[32], hash[32];
+    uint32_t nonce;
+
+    hash_bin(target, json_string_value(json_object_get(tb->gbt, "target")));
+    for (nonce = 0; ; nonce++) {
+        *(uint32_t *)(tb->header + 76) = htole32(nonce);
+        gen_hash(tb->header, hash, 80);
+        if (fulltest(hash, target) == meet)
+            break;
+    }
+}
+
+static char *block_hex(const test_block_t *tb)
+{
+    int len = 80 + 3 + tb->cblen + tb->txnslen, ofs = 81;
+    uchar *block = ckalloc(len);
+    char *hex;
+
+    memcpy(block, tb->header, 80);
+    if (tb->ntxns + 1 < 0xfd)
+        block[80] = tb->ntxns + 1;
+    else {
+        block[80] = 0xfd;
+        block[81] = (tb->ntxns + 1) & 0xff;
+        block[82] = (tb->ntxns + 1) >> 8;
+        ofs = 83;
+    }
+    memcpy(block + ofs, tb->cb, tb->cblen);
+    memcpy(block + ofs + tb->cblen, tb->txns, tb->txnslen);
+    len = ofs + tb->cblen + tb->txnslen;
+    hex = bin2hex(block, len);
+    free(block);
+    return hex;
+}
+
+static void free_block(test_block_t *tb)
+{
+    json_decref(tb->gbt);
+    free(tb->txns);
+    free(tb->txids);
+}
+
+/* Submit a block, returning NULL if accepted or the reject reason */
+static char *submit(mockbtc_t *mb, const test_block_t *tb)
+{
+    char *hex = block_hex(tb), *params, *ret = NULL;
+    json_t *res_val;
+
+    ASPRINTF(&params, "[\"%s\"]", hex);
+    res_val = rpc_result(mb, "submitblock", params);
+    if (json_is_string(res_val))
+        ret = strdup(json_string_value(res_val));
+    else
+        assert_true(json_is_null(res_val));
+    json_decref(res_val);
+    free(params);
+    free(hex);
+    return ret;
+}
+
+static void assert_rejected(mockbtc_t *mb, const test_block_t *tb, const char *reason)
+{
+    char *ret = submit(mb, tb);
+
+    assert_non_null(ret);
+    assert_string_equal(ret, reason);
+    free(ret);
+}
+
+/* Template fields ckpool needs and the chain RPCs agreeing with it */
+static void test_template(void)
+{
+    mockbtc_t *mb = start_mock(10);
+    json_t *gbt, *val, *txn_val;
+    const char *prevhash;
+    int64_t fees = 0;
+    char params[128];
+    size_t i;
+
+    gbt = rpc_result(mb, "getblocktemplate", "[{\"rules\": [\"segwit\"]}]");
+    assert_int_equal(json_integer_value(json_object_get(gbt, "height")), TEST_HEIGHT + 1);
+    assert_string_equal(json_string_value(json_object_get(gbt, "bits")), TEST_BITS);
+    assert_int_equal(strlen(json_string_value(json_object_get(gbt, "target"))), 64);
+    assert_true(json_integer_value(json_object_get(gbt, "curtime")) > 0);
+    assert_non_null(json_object_get(gbt, "coinbaseaux"));
+    assert_string_equal(json_string_value(json_array_get(json_object_get(gbt, "rules"), 1)),
+                        "!segwit");
+    assert_int_equal(strncmp(json_string_value(json_object_get(gbt, "default_witness_commitment")),
+                             "6a24aa21a9ed", 12), 0);
+    assert_int_equal(json_array_size(json_object_get(gbt, "transactions")), 10);
+    json_array_foreach(json_object_get(gbt, "transactions"), i, txn_val) {
+        assert_non_null(json_string_value(json_object_get(txn_val, "data")));
+        assert_non_null(json_string_value(json_object_get(txn_val, "hash")));
+        fees += json_integer_value(json_object_get(txn_val, "fee"));
+    }
+    assert_true(fees > 0);
+    assert_int_equal(json_integer_value(json_object_get(gbt, "coinbasevalue")), 312500000 + fees);
+
+    prevhash = json_string_value(json_object_get(gbt, "previousblockhash"));
+    val = rpc_result(mb, "getbestblockhash", "[]");
+    assert_string_equal(json_string_value(val), prevhash);
+    json_decref(val);
+    val = rpc_result(mb, "getblockcount", "[]");
+    assert_int_equal(json_integer_value(val), TEST_HEIGHT);
+    json_decref(val);
+    snprintf(params, 128, "[%d]", TEST_HEIGHT);
+    val = rpc_result(mb, "getblockhash", params);
+    assert_string_equal(json_string_value(val), prevhash);
+    json_decref(val);
+
+    /* Mempool transactions can be looked up by txid */
+    txn_val = json_array_get(json_object_get(gbt, "transactions"), 3);
+    snprintf(params, 128, "[\"%s\"]", json_string_value(json_object_get(txn_val, "txid")));
+    val = rpc_result(mb, "getrawtransaction", params);
+    assert_string_equal(json_string_value(val), json_string_value(json_object_get(txn_val, "data")));
+    json_decref(val);
+
+    val = rpc_result(mb, "validateaddress", "[\"bc1q8qkesw5kyplv7hdxyseqls5m78w5tqdfd40lf5\"]");
+    assert_true(json_is_true(json_object_get(val, "isvalid")));
+    assert_true(json_is_true(json_object_get(val, "iswitness")));
+    assert_true(json_is_false(json_object_get(val, "isscript")));
+    json_decref(val);
+    val = rpc_result(mb, "validateaddress", "[\"not-an-address\"]");
+    assert_true(json_is_false(json_object_get(val, "isvalid")));
+    json_decref(val);
+    assert_int_equal(rpc_error_code(mb, "getpeerinfo", "[]"), -32601);
+
+    /* A block found elsewhere moves the tip and regenerates the mempool */
+    mockbtc_newblock(mb);
+    val = rpc_result(mb, "getbestblockhash", "[]");
+    assert_true(strcmp(json_string_value(val), prevhash));
+    json_decref(val);
+    val = rpc_result(mb, "getblockcount", "[]");
+    assert_int_equal(json_integer_value(val), TEST_HEIGHT + 1);
+    json_decref(val);
+
+    json_decref(gbt);
+    mockbtc_stop(mb);
+}
+
+/* Blocks built from the template are accepted and extend the chain */
+static void test_submit_accepted(void)
+{
+    mockbtc_t *mb = start_mock(25);
+    test_block_t tb;
+    json_t *val;
+    char *ret;
+
+    build_block(mb, &tb, true);
+    solve_block(&tb, true);
+    ret = submit(mb, &tb);
+    assert_null(ret);
+    assert_rejected(mb, &tb, "duplicate");
+    free_block(&tb);
+
+    /* Coinbase only blocks without a witness commitment are fine too */
+    mockbtc_stop(mb);
+    mb = start_mock(0);
+    build_block(mb, &tb, false);
+    solve_block(&tb, true);
+    assert_null(submit(mb, &tb));
+    free_block(&tb);
+
+    val = mockbtc_stats(mb);
+    assert_int_equal(json_integer_value(json_object_get(val, "height")), TEST_HEIGHT + 1);
+    assert_int_equal(json_integer_value(json_object_get(val, "accepted")), 1);
+    assert_int_equal(json_integer_value(json_object_get(json_object_get(val, "calls"),
+                                                        "submitblock")), 1);
+    json_decref(val);
+    mockbtc_stop(mb);
+}
+
+/* Each way of tampering with a block gets bitcoind's reject reason */
+static void test_submit_rejected(void)
+{
+    mockbtc_t *mb = start_mock(5);
+    char *bad_witness;
+    const char *witness;
+    test_block_t tb;
+    json_t *val;
+    int height;
+
+    build_block(mb, &tb, true);
+    witness = json_string_value(json_object_get(tb.gbt, "default_witness_commitment"));
+    height = json_integer_value(json_object_get(tb.gbt, "height"));
+    solve_block(&tb, false);
+    assert_rejected(mb, &tb, "high-hash");
+
+    tb.header[4] ^= 1;
+    solve_block(&tb, true);
+    assert_rejected(mb, &tb, "prev-blk-not-found");
+
+    build_header(&tb);
+    tb.header[36] ^= 1;
+    solve_block(&tb, true);
+    assert_rejected(mb, &tb, "bad-txnmrklroot");
+
+    build_coinbase(&tb, height + 1, 1, witness);
+    build_header(&tb);
+    solve_block(&tb, true);
+    assert_rejected(mb, &tb, "bad-cb-height");
+
+    build_coinbase(&tb, height, json_integer_value(json_object_get(tb.gbt, "coinbasevalue")) + 1,
+                   witness);
+    build_header(&tb);
+    solve_block(&tb, true);
+    assert_rejected(mb, &tb, "bad-cb-amount");
+
+    bad_witness = strdup(witness);
+    bad_witness[20] = bad_witness[20] == '0' ? '1' : '0';
+    build_coinbase(&tb, height, 1, bad_witness);
+    free(bad_witness);
+    build_header(&tb);
+    solve_block(&tb, true);
+    assert_rejected(mb, &tb, "bad-witness-merkle-match");
+
+    /* A transaction that isn't in the mempool */
+    build_coinbase(&tb, height, 1, witness);
+    tb.txns[tb.txnslen - 5] ^= 1;
+    solve_block(&tb, true);
+    assert_rejected(mb, &tb, "bad-txns-inputs-missingorspent");
+
+    tb.txnslen--;
+    assert_rejected(mb, &tb, "bad-txns-decode");
+    free_block(&tb);
+
+    val = mockbtc_stats(mb);
+    assert_int_equal(json_integer_value(json_object_get(val, "height")), TEST_HEIGHT);
+    assert_int_equal(json_integer_value(json_object_get(val, "rejected")), 8);
+    assert_string_equal(json_string_value(json_object_get(val, "lastreject")), "bad-txns-decode");
+    json_decref(val);
+    mockbtc_stop(mb);
+}
+
+/* Transactions sent to the mock join the template and its commitment */
+static void test_sendrawtransaction(void)
+{
+    mockbtc_t *mb = start_mock(2);
+    char *txn, *params, *witness;
+    test_block_t tb;
+    json_t *val;
+
+    get_template(mb, &tb);
+    witness = strdup(json_string_value(json_object_get(tb.gbt, "default_witness_commitment")));
+    /* A copy of the first mempool transaction spending a different output */
+    txn = strdup(json_string_value(json_object_get(json_array_get(json_object_get(tb.gbt,
+                 "transactions"), 0), "data")));
+    txn[10] = txn[10] == '0' ? '1' : '0';
+    free_block(&tb);
+
+    ASPRINTF(&params, "[\"%s\"]", txn);
+    val = rpc_result(mb, "sendrawtransaction", params);
+    assert_int_equal(strlen(json_string_value(val)), 64);
+    json_decref(val);
+    free(params);
+    free(txn);
+    assert_int_equal(rpc_error_code(mb, "sendrawtransaction", "[\"00\"]"), -22);
+
+    build_block(mb, &tb, true);
+    assert_int_equal(tb.ntxns, 3);
+    assert_true(strcmp(json_string_value(json_object_get(tb.gbt, "default_witness_commitment")),
+                       witness));
+    solve_block(&tb, true);
+    assert_null(submit(mb, &tb));
+    free_block(&tb);
+    free(witness);
+    mockbtc_stop(mb);
+}
+
+/* Latency, RPC errors and dropped connections can be switched on and off */
+static void test_faults(void)
+{
+    mockbtc_t *mb = start_mock(0);
+    int64_t start, elapsed;
+    int status = 0;
+    json_t *val;
+
+    mockbtc_faults(mb, 100, 0, 0, 0);
+    start = lat_now();
+    val = rpc_result(mb, "getblockcount", "[]");
+    elapsed = lat_now() - start;
+    json_decref(val);
+    assert_true(elapsed >= 100000000LL);
+
+    mockbtc_faults(mb, 0, 0, 100, 0);
+    assert_int_equal(rpc_error_code(mb, "getblockcount", "[]"), -28);
+
+    mockbtc_faults(mb, 0, 0, 0, 100);
+    assert_null(rpc(mb, "getblockcount", "[]", &status));
+
+    mockbtc_faults(mb, 0, 0, 0, 0);
+    val = rpc_result(mb, "getblockcount", "[]");
+    assert_int_equal(json_integer_value(val), TEST_HEIGHT);
+    json_decref(val);
+
+    /* Every call is counted whatever happened to it */
+    val = mockbtc_stats(mb);
+    assert_int_equal(json_integer_value(json_object_get(json_object_get(val, "calls"),
+                                                        "getblockcount")), 4);
+    json_decref(val);
+    mockbtc_stop(mb);
+}
+
+static void test_template_performance(void)
+{
+    mockbtc_t *mb = start_mock(3000);
+    struct timespec start, end;
+    test_block_t tb;
+    double elapsed;
+    json_t *val;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < 50; i++) {
+        val = rpc_result(mb, "getblocktemplate", "[{\"rules\": [\"segwit\"]}]");
+        json_decref(val);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("    50 templates of 3000 transactions: %.3fs (%.1fms each)\n", elapsed,
+           elapsed * 1000 / 50);
+
+    build_block(mb, &tb, true);
+    solve_block(&tb, true);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert_null(submit(mb, &tb));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("    Validating a block of 3000 transactions: %.1fms\n", elapsed * 1000);
+    free_block(&tb);
+    mockbtc_stop(mb);
+}
+
+int main(void)
+{
+    printf("Running mock bitcoind tests...\n\n");
+
+    run_test(test_template);
+    run_test(test_submit_accepted);
+    run_test(test_submit_rejected);
+    run_test(test_sendrawtransaction);
+    run_test(test_faults);
+
+    if (perf_tests_enabled()) {
+        printf("\n[PERFORMANCE REGRESSION TESTS]\n");
+        printf("BEGIN PERF TESTS: test-mockbtc\n");
+        run_test(test_template_performance);
+        printf("END PERF TESTS: test-mockbtc\n");
+    }
+
+    printf("\nAll mock bitcoind tests passed!\n");
+    return 0;
+}
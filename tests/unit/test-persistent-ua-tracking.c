@@ -8,6 +8,7 @@
 #include <ctype.h>
 
 #include "uthash.h"
+#include "utlist.h"
 
 #define UA_OTHER "Other"
 
@@ -52,8 +53,20 @@ typedef struct ua_item {
 	int count;
 	double dsps5;
 	double best_diff;
+	struct test_client *clients;
 } ua_item_t;
 
+/* Minimal client carrying the fields the incremental UA aggregates use */
+typedef struct test_client {
+	char *useragent;
+	bool authorised;
+	double dsps5;
+	double best_diff;
+	ua_item_t *ua_item;
+	struct test_client *ua_next;
+	struct test_client *ua_prev;
+} test_client_t;
+
 /* Helper: Add or increment UA in the persistent map (with normalization) */
 static void ua_tracking_add_client(ua_item_t **ua_map, const char *useragent)
 {
@@ -129,6 +142,165 @@ static void ua_tracking_cleanup(ua_item_t **ua_map)
 	}
 }
 
+/* Interned client add (mirror of __add_ua_client) */
+static void ua_intern_add(ua_item_t **ua_map, test_client_t *client)
+{
+	char normalized_ua[256];
+	const char *ua_key = get_normalized_ua_key(client->useragent, normalized_ua, sizeof(normalized_ua));
+	ua_item_t *ua_it;
+
+	HASH_FIND_STR(*ua_map, ua_key, ua_it);
+	if (!ua_it) {
+		ua_it = calloc(1, sizeof(ua_item_t));
+		assert_non_null(ua_it);
+		ua_it->ua = strdup(ua_key);
+		HASH_ADD_STR(*ua_map, ua, ua_it);
+	}
+	ua_it->count++;
+	DL_APPEND2(ua_it->clients, client, ua_prev, ua_next);
+	ua_it->dsps5 += client->dsps5;
+	if (client->best_diff > ua_it->best_diff)
+		ua_it->best_diff = client->best_diff;
+	client->ua_item = ua_it;
+}
+
+/* Interned client removal (mirror of __del_ua_client) */
+static void ua_intern_del(ua_item_t **ua_map, test_client_t *client)
+{
+	ua_item_t *ua_it = client->ua_item;
+	test_client_t *tmp;
+
+	DL_DELETE2(ua_it->clients, client, ua_prev, ua_next);
+	client->ua_item = NULL;
+	ua_it->dsps5 -= client->dsps5;
+	if (ua_it->best_diff && client->best_diff >= ua_it->best_diff) {
+		ua_it->best_diff = 0;
+		DL_FOREACH2(ua_it->clients, tmp, ua_next) {
+			if (tmp->best_diff > ua_it->best_diff)
+				ua_it->best_diff = tmp->best_diff;
+		}
+	}
+	if (--ua_it->count <= 0) {
+		HASH_DEL(*ua_map, ua_it);
+		free(ua_it->ua);
+		free(ua_it);
+	}
+}
+
+/* Hashrate change as done in decay_client */
+static void ua_intern_set_dsps5(test_client_t *client, double dsps5)
+{
+	double old = client->dsps5;
+
+	client->dsps5 = dsps5;
+	if (client->ua_item)
+		client->ua_item->dsps5 += client->dsps5 - old;
+}
+
+/* New best share as done in parse_submit */
+static void ua_intern_set_best(test_client_t *client, double best)
+{
+	client->best_diff = best;
+	if (client->ua_item && best > client->ua_item->best_diff)
+		client->ua_item->best_diff = best;
+}
+
+/* The old per-minute rescan of every authorised client, for comparison */
+static void ua_rescan(const test_client_t *clients, int nclients, const char *useragent,
+		      double *dsps5, double *best_diff)
+{
+	char want[256], normalized_ua[256];
+	int i;
+
+	strcpy(want, get_normalized_ua_key(useragent, normalized_ua, sizeof(normalized_ua)));
+	*dsps5 = *best_diff = 0;
+	for (i = 0; i < nclients; i++) {
+		const test_client_t *c = &clients[i];
+
+		if (!c->ua_item || !c->authorised)
+			continue;
+		if (strcmp(get_normalized_ua_key(c->useragent, normalized_ua, sizeof(normalized_ua)), want))
+			continue;
+		*dsps5 += c->dsps5;
+		if (c->best_diff > *best_diff)
+			*best_diff = c->best_diff;
+	}
+}
+
+static void assert_ua_matches_rescan(ua_item_t *ua_map, const test_client_t *clients,
+				     int nclients, const char *useragent)
+{
+	char normalized_ua[256];
+	const char *ua_key = get_normalized_ua_key(useragent, normalized_ua, sizeof(normalized_ua));
+	double dsps5, best_diff;
+	ua_item_t *ua_it;
+
+	ua_rescan(clients, nclients, useragent, &dsps5, &best_diff);
+	HASH_FIND_STR(ua_map, ua_key, ua_it);
+	if (!ua_it) {
+		assert_true(dsps5 == 0 && best_diff == 0);
+		return;
+	}
+	assert_true(ua_it->dsps5 > dsps5 - 1e-9 && ua_it->dsps5 < dsps5 + 1e-9);
+	assert_true(ua_it->best_diff == best_diff);
+}
+
+/* Test: Incremental hashrate and best diff aggregates match a full rescan
+ * through subscribes, decays, new bests and disconnects */
+static void test_incremental_aggregates(void **state)
+{
+	test_client_t clients[6];
+	ua_item_t *ua_map = NULL;
+	const char *uas[] = { "bitaxe/2.1", "bitaxe/2.2", "NerdQAxe++", "bitaxe", "cgminer/4.12", "NerdQAxe" };
+	int i;
+
+	(void)state;
+	memset(clients, 0, sizeof(clients));
+	for (i = 0; i < 6; i++) {
+		clients[i].useragent = (char *)uas[i];
+		clients[i].authorised = true;
+		ua_intern_add(&ua_map, &clients[i]);
+	}
+	assert_int_equal(ua_tracking_get_count(ua_map, "bitaxe"), 3);
+	assert_int_equal(ua_tracking_get_count(ua_map, "NerdQAxe"), 1);
+	assert_int_equal(ua_tracking_get_count(ua_map, "NerdQAxe++"), 1);
+
+	for (i = 0; i < 6; i++) {
+		ua_intern_set_dsps5(&clients[i], 100.0 * (i + 1));
+		ua_intern_set_best(&clients[i], 1000.0 * (6 - i));
+	}
+	/* Decays go both ways */
+	ua_intern_set_dsps5(&clients[0], 50.5);
+	ua_intern_set_dsps5(&clients[3], 999.25);
+	for (i = 0; i < 6; i++)
+		assert_ua_matches_rescan(ua_map, clients, 6, uas[i]);
+
+	/* Dropping the best share holder recalculates from the rest */
+	ua_intern_del(&ua_map, &clients[0]);
+	assert_ua_matches_rescan(ua_map, clients, 6, "bitaxe");
+	assert_true(ua_tracking_get_count(ua_map, "bitaxe") == 2);
+
+	/* Dropping a client that didn't hold the best keeps it */
+	ua_intern_del(&ua_map, &clients[3]);
+	assert_ua_matches_rescan(ua_map, clients, 6, "bitaxe");
+
+	/* Last client of a UA removes the entry entirely */
+	ua_intern_del(&ua_map, &clients[4]);
+	assert_int_equal(ua_tracking_get_count(ua_map, "cgminer"), 0);
+	assert_ua_matches_rescan(ua_map, clients, 6, "cgminer");
+
+	/* Reconnecting starts from the client's current values */
+	ua_intern_add(&ua_map, &clients[0]);
+	for (i = 0; i < 6; i++)
+		assert_ua_matches_rescan(ua_map, clients, 6, uas[i]);
+
+	for (i = 0; i < 6; i++) {
+		if (clients[i].ua_item)
+			ua_intern_del(&ua_map, &clients[i]);
+	}
+	assert_null(ua_map);
+}
+
 /* Test: Single client subscribe and unsubscribe */
 static void test_single_client_lifecycle(void **state)
 {
@@ -390,6 +562,7 @@ int main(void)
 		cmocka_unit_test(test_ua_normalization),
 		cmocka_unit_test(test_ua_special_chars),
 		cmocka_unit_test(test_whitespace_ua_falls_back_to_other),
+		cmocka_unit_test(test_incremental_aggregates),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,193 @@
+/*
+ * Unit tests for the USDT tracepoints
+ * Tests that every probe is present in the built ckpool binary's
+ * .note.stapsdt section with the expected number of arguments, and that
+ * argument sizes and signedness are described correctly
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <elf.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "probes.h"
+
+#define MAX_PROBES 256
+
+struct probe {
+    char provider[32];
+    char name[32];
+    char args[256];
+};
+
+static struct probe probes[MAX_PROBES];
+static int nprobes;
+
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    char *buf;
+    long size;
+
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = malloc(size);
+    if (fread(buf, 1, size, fp) != (size_t)size) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    *len = size;
+    return buf;
+}
+
+/* Collect every stapsdt note from an ELF64 binary */
+static void load_probes(const char *path)
+{
+    const Elf64_Shdr *shdr, *strtab;
+    const Elf64_Ehdr *ehdr;
+    size_t len, ofs, end;
+    char *buf;
+    int i;
+
+    nprobes = 0;
+    buf = read_file(path, &len);
+    assert_non_null(buf);
+    ehdr = (const Elf64_Ehdr *)buf;
+    assert_true(!memcmp(ehdr->e_ident, ELFMAG, SELFMAG));
+    assert_int_equal(ehdr->e_ident[EI_CLASS], ELFCLASS64);
+
+    shdr = (const Elf64_Shdr *)(buf + ehdr->e_shoff);
+    strtab = &shdr[ehdr->e_shstrndx];
+    for (i = 0; i < ehdr->e_shnum; i++) {
+        if (shdr[i].sh_type != SHT_NOTE ||
+            strcmp(buf + strtab->sh_offset + shdr[i].sh_name, ".note.stapsdt"))
+            continue;
+        ofs = shdr[i].sh_offset;
+        end = ofs + shdr[i].sh_size;
+        while (ofs + sizeof(Elf64_Nhdr) <= end) {
+            const Elf64_Nhdr *nhdr = (const Elf64_Nhdr *)(buf + ofs);
+            const char *desc, *name = buf + ofs + sizeof(Elf64_Nhdr);
+
+            desc = name + ((nhdr->n_namesz + 3) & ~3);
+            if (nhdr->n_type == 3 && !strcmp(name, "stapsdt") && nprobes < MAX_PROBES) {
+                struct probe *probe = &probes[nprobes++];
+
+                /* Probe address, base address and semaphore */
+                desc += 3 * sizeof(uint64_t);
+                snprintf(probe->provider, sizeof(probe->provider), "%s", desc);
+                desc += strlen(desc) + 1;
+                snprintf(probe->name, sizeof(probe->name), "%s", desc);
+                desc += strlen(desc) + 1;
+                snprintf(probe->args, sizeof(probe->args), "%s", desc);
+            }
+            ofs = (name - buf) + ((nhdr->n_namesz + 3) & ~3) + ((nhdr->n_descsz + 3) & ~3);
+        }
+    }
+    free(buf);
+}
+
+static struct probe *find_probe(const char *name)
+{
+    int i;
+
+    for (i = 0; i < nprobes; i++) {
+        if (!strcmp(probes[i].provider, "ckpool") && !strcmp(probes[i].name, name))
+            return &probes[i];
+    }
+    return NULL;
+}
+
+static int probe_nargs(const struct probe *probe)
+{
+    const char *s;
+    int ret = 0;
+
+    for (s = probe->args; *s; s++) {
+        if (*s == '@')
+            ret++;
+    }
+    return ret;
+}
+
+/* Every probe site in the pool with its argument count */
+static void test_binary_probes(void)
+{
+    static const struct {
+        const char *name;
+        int nargs;
+    } expected[] = {
+        { "client_accept", 3 },
+        { "client_close", 2 },
+        { "client_parse", 2 },
+        { "share", 4 },
+        { "block_solve", 2 },
+        { "workbase", 3 },
+        { "notify_start", 2 },
+        { "notify_end", 2 },
+        { "rpc_start", 2 },
+        { "rpc_end", 2 },
+        { "queue_enqueue", 1 },
+        { "queue_dequeue", 2 },
+    };
+    size_t i;
+
+    load_probes(CKPOOL_BINARY);
+    for (i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        struct probe *probe = find_probe(expected[i].name);
+
+        if (!probe)
+            printf("    Missing probe %s\n", expected[i].name);
+        assert_non_null(probe);
+        assert_int_equal(probe_nargs(probe), expected[i].nargs);
+    }
+}
+
+static int64_t test_signed = -1;
+static uint32_t test_unsigned = 1;
+static const char *test_string = "probe";
+
+/* Argument descriptors are "size@location" with negative sizes for signed
+ * types, as consumers of sys/sdt.h expect */
+static void test_arg_encoding(void)
+{
+    struct probe *probe;
+
+    CKPROBE3(test_args, test_signed, test_unsigned, test_string);
+    CKPROBE(test_noargs);
+
+    load_probes("/proc/self/exe");
+    probe = find_probe("test_args");
+    assert_non_null(probe);
+    assert_int_equal(probe_nargs(probe), 3);
+    assert_true(!strncmp(probe->args, "-8@", 3));
+    assert_non_null(strstr(probe->args, " 4@"));
+    assert_non_null(strstr(probe->args, " 8@"));
+    probe = find_probe("test_noargs");
+    assert_non_null(probe);
+    assert_string_equal(probe->args, "");
+}
+
+int main(void)
+{
+    printf("Running USDT probe tests...\n\n");
+
+#ifdef CKPROBE_NONE
+    printf("USDT probes are not built, skipping\n");
+#else
+    run_test(test_binary_probes);
+    run_test(test_arg_encoding);
+#endif
+
+    printf("\nAll USDT probe tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Unit tests for rotating log writers
+ * Tests hourly file naming, buffering until flushed, switching files, lines
+ * longer than the buffer and rotating_log writing each line through
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "../test_common.h"
+#include "libckpool.h"
+
+static char *test_dir(const char *name)
+{
+    char *path;
+
+    ASPRINTF(&path, "/tmp/ckpool-test-rotlog-%d-%s", (int)getpid(), name);
+    assert_int_equal(mkdir(path, 0700), 0);
+    return path;
+}
+
+/* Whole contents of a file, empty if it does not exist */
+static char *read_file(const char *path)
+{
+    char *buf;
+    FILE *fp;
+    long len;
+
+    fp = fopen(path, "r");
+    if (!fp)
+        return strdup("");
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = ckzalloc(len + 1);
+    assert_int_equal((int)fread(buf, 1, len, fp), (int)len);
+    fclose(fp);
+    return buf;
+}
+
+static void remove_file(const char *dir, const char *name)
+{
+    char *path;
+
+    ASPRINTF(&path, "%s/%s", dir, name);
+    unlink(path);
+    free(path);
+}
+
+/* Lines are named by the hour, buffered until flushed, and get a newline
+ * only when they lack one */
+static void test_hourly_buffered(void)
+{
+    char *dir = test_dir("hourly"), *prefix, *filename, *buf;
+    rotlog_t *rl;
+
+    ASPRINTF(&prefix, "%s/blocks-", dir);
+    rl = rotlog_create(prefix, ROTLOG_BUFSIZ);
+    filename = rotating_filename(prefix, time(NULL));
+
+    assert_true(rotlog_write(rl, "first"));
+    assert_true(rotlog_write(rl, "second\n"));
+    assert_string_equal(rl->filename, filename);
+    assert_int_equal(rl->opens, 1);
+
+    /* Nothing is written before a flush unless the second changed */
+    if (!rl->writes) {
+        buf = read_file(filename);
+        assert_string_equal(buf, "");
+        free(buf);
+    }
+    rotlog_flush(rl);
+    buf = read_file(filename);
+    assert_string_equal(buf, "first\nsecond\n");
+    free(buf);
+    assert_int_equal(rl->lines, 2);
+
+    rotlog_close(rl);
+    unlink(filename);
+    rmdir(dir);
+    free(filename);
+    free(prefix);
+    free(dir);
+}
+
+/* Writing to another file flushes the previous one and appends to files
+ * that already exist */
+static void test_switch_files(void)
+{
+    char *dir = test_dir("switch"), *a, *b, *buf;
+    rotlog_t *rl;
+
+    ASPRINTF(&a, "%s/a.sharelog", dir);
+    ASPRINTF(&b, "%s/b.sharelog", dir);
+    rl = rotlog_create(NULL, ROTLOG_BUFSIZ);
+
+    assert_true(rotlog_write_to(rl, a, "one\n", 4));
+    assert_true(rotlog_write_to(rl, a, "two\n", 4));
+    assert_true(rotlog_write_to(rl, b, "three\n", 6));
+    buf = read_file(a);
+    assert_string_equal(buf, "one\ntwo\n");
+    free(buf);
+    assert_true(rotlog_write_to(rl, a, "four\n", 5));
+    assert_int_equal(rl->opens, 3);
+    rotlog_close(rl);
+
+    buf = read_file(a);
+    assert_string_equal(buf, "one\ntwo\nfour\n");
+    free(buf);
+    buf = read_file(b);
+    assert_string_equal(buf, "three\n");
+    free(buf);
+
+    remove_file(dir, "a.sharelog");
+    remove_file(dir, "b.sharelog");
+    rmdir(dir);
+    free(a);
+    free(b);
+    free(dir);
+}
+
+/* Lines longer than the buffer are written straight out after what is
+ * buffered, keeping their order */
+static void test_long_line(void)
+{
+    char *dir = test_dir("long"), *path, *buf, *line, *expect;
+    rotlog_t *rl;
+
+    ASPRINTF(&path, "%s/long.log", dir);
+    rl = rotlog_create(NULL, 64);
+    line = ckzalloc(201);
+    memset(line, 'x', 200);
+
+    assert_true(rotlog_write_to(rl, path, "short", 5));
+    assert_true(rotlog_write_to(rl, path, line, 200));
+    assert_true(rotlog_write_to(rl, path, "after", 5));
+    rotlog_flush(rl);
+
+    ASPRINTF(&expect, "short\n%s\nafter\n", line);
+    buf = read_file(path);
+    assert_string_equal(buf, expect);
+    free(buf);
+
+    rotlog_close(rl);
+    remove_file(dir, "long.log");
+    rmdir(dir);
+    free(expect);
+    free(line);
+    free(path);
+    free(dir);
+}
+
+/* rotating_log keeps each path's file open but every line is in the file as
+ * soon as it returns */
+static void test_rotating_log(void)
+{
+    char *dir = test_dir("through"), *prefix, *filename, *buf;
+
+    ASPRINTF(&prefix, "%s/pool-", dir);
+    filename = rotating_filename(prefix, time(NULL));
+    assert_true(rotating_log(prefix, "block 1"));
+    buf = read_file(filename);
+    if (strcmp(buf, "block 1\n")) {
+        /* The hour changed between the write and the name */
+        free(buf);
+        goto out;
+    }
+    free(buf);
+    assert_true(rotating_log(prefix, "block 2"));
+    buf = read_file(filename);
+    assert_string_equal(buf, "block 1\nblock 2\n");
+    free(buf);
+out:
+    unlink(filename);
+    rmdir(dir);
+    free(filename);
+    free(prefix);
+    free(dir);
+}
+
+int main(void)
+{
+    printf("Running rotating log tests...\n\n");
+
+    run_test(test_hourly_buffered);
+    run_test(test_switch_files);
+    run_test(test_long_line);
+    run_test(test_rotating_log);
+
+    printf("\nAll rotating log tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,662 @@
+/*
+ * Unit tests for the stratcore share and work core
+ * Drives coinbase building with an injected clock, mining.submit param
+ * validation, share hashing and nonce fixups, block assembly and submission
+ * through fake rpc hooks, notify building and sending through a fake send
+ * hook, and each mode's share path against the mode checks it replaces, with
+ * no sockets, threads or bitcoind
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "sha2.h"
+#include "stratcore.h"
+#include "../stratcore_test.h"
+
+static const char *scriptsig_header = "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff";
+
+/* P2PKH scripts standing in for the pool and donation addresses */
+static const char txnbin[25] = "\x76\xa9\x14" "aaaaaaaaaaaaaaaaaaaa" "\x88\xac";
+static const char dontxnbin[25] = "\x76\xa9\x14" "dddddddddddddddddddd" "\x88\xac";
+
+struct hooks {
+    ts_t now;
+    int clocks;
+    bool submit_ret;
+    int submits;
+    char precious[68];
+    char heighthash[68];
+    int height;
+    json_t *sent;
+    int64_t sent_id;
+    int sent_type;
+
+    /* Share path hooks */
+    const uchar *user_cb2;
+    int user_cb2len;
+    int retargets;
+    double retarget_diff;
+    double retarget_network_diff;
+    int64_t retarget_next_blockid;
+    int64_t retarget_current_blockid;
+    int upstream_shares;
+    int upstreams;
+    int upstream_type;
+};
+
+static void fake_clock(void *arg, ts_t *ts)
+{
+    struct hooks *h = arg;
+
+    h->clocks++;
+    *ts = h->now;
+}
+
+static bool fake_submitblock(void *arg, const char __maybe_unused *gbt_block)
+{
+    struct hooks *h = arg;
+
+    h->submits++;
+    return h->submit_ret;
+}
+
+static void fake_preciousblock(void *arg, const char *hash)
+{
+    struct hooks *h = arg;
+
+    strcpy(h->precious, hash);
+}
+
+static bool fake_get_blockhash(void *arg, int height, char *hash)
+{
+    struct hooks *h = arg;
+
+    h->height = height;
+    strcpy(hash, h->heighthash);
+    return true;
+}
+
+static void fake_send(void *arg, json_t *val, const int64_t client_id, const int msg_type)
+{
+    struct hooks *h = arg;
+
+    if (h->sent)
+        json_decref(h->sent);
+    h->sent = val;
+    h->sent_id = client_id;
+    h->sent_type = msg_type;
+}
+
+static const uchar *fake_user_coinb2(void *arg, void __maybe_unused *user,
+                                     const workbase_t __maybe_unused *wb, int *cb2len)
+{
+    struct hooks *h = arg;
+
+    *cb2len = h->user_cb2len;
+    return h->user_cb2;
+}
+
+static void fake_retarget(void *arg, void __maybe_unused *client, const double diff,
+                          tv_t __maybe_unused *now, const double network_diff,
+                          const int64_t next_blockid, const int64_t current_blockid)
+{
+    struct hooks *h = arg;
+
+    h->retargets++;
+    h->retarget_diff = diff;
+    h->retarget_network_diff = network_diff;
+    h->retarget_next_blockid = next_blockid;
+    h->retarget_current_blockid = current_blockid;
+}
+
+static void fake_upstream_share(void *arg, void __maybe_unused *client,
+                                const stratcore_share_t __maybe_unused *share)
+{
+    struct hooks *h = arg;
+
+    h->upstream_shares++;
+}
+
+static void fake_upstream(void *arg, json_t __maybe_unused *val, const int msg_type)
+{
+    struct hooks *h = arg;
+
+    h->upstreams++;
+    h->upstream_type = msg_type;
+}
+
+static void init_core(stratcore_t *sc, struct hooks *h)
+{
+    memset(sc, 0, sizeof(stratcore_t));
+    memset(h, 0, sizeof(struct hooks));
+    h->now.tv_sec = 1700000000;
+    h->now.tv_nsec = 123456789;
+    sc->nonce1length = 4;
+    sc->nonce2length = 8;
+    sc->version_mask = 0x1fffe000;
+    sc->btcsig = "/test/";
+    sc->txnbin = txnbin;
+    sc->txnlen = sizeof(txnbin);
+    sc->dontxnbin = dontxnbin;
+    sc->dontxnlen = sizeof(dontxnbin);
+    sc->clock = fake_clock;
+    sc->submitblock = fake_submitblock;
+    sc->preciousblock = fake_preciousblock;
+    sc->get_blockhash = fake_get_blockhash;
+    sc->send = fake_send;
+    sc->user_coinb2 = fake_user_coinb2;
+    sc->retarget = fake_retarget;
+    sc->upstream_share = fake_upstream_share;
+    sc->upstream = fake_upstream;
+    sc->arg = h;
+}
+
+static uint64_t get_le64(const uchar *p)
+{
+    uint64_t val;
+
+    memcpy(&val, p, 8);
+    return le64toh(val);
+}
+
+static void test_coinbase(void)
+{
+    uchar header[41];
+    workbase_t wb, wb2;
+    stratcore_t sc;
+    struct hooks h;
+    int ofs;
+
+    init_core(&sc, &h);
+    init_wb(&wb);
+    stratcore_coinbase(&sc, &wb);
+    assert_int_equal(h.clocks, 1);
+
+    /* Fixed header then a scriptsig covering coinb1, both nonces and the
+     * ckpool-lhr tag and btcsig at the start of coinb2 */
+    hex2bin(header, scriptsig_header, 41);
+    assert_memory_equal(wb.coinb1bin, header, 41);
+    assert_int_equal(wb.coinb1bin[41], wb.coinb1len - 42 + 4 + 8 + 11 + 1 + 6);
+    assert_int_equal(wb.enonce1varlen, 4);
+    assert_int_equal(wb.enonce2varlen, 8);
+    assert_int_equal(wb.coinb1bin[wb.coinb1len - 1], 12);
+    assert_int_equal(strlen(wb.coinb1), wb.coinb1len * 2);
+
+    assert_memory_equal(wb.coinb2bin + 1, "ckpool-lhr", 10);
+    ofs = 11;
+    assert_int_equal(wb.coinb2bin[ofs++], 6);
+    assert_memory_equal(wb.coinb2bin + ofs, "/test/", 6);
+    ofs += 6;
+    assert_memory_equal(wb.coinb2bin + ofs, "\xff\xff\xff\xff", 4);
+    ofs += 4;
+    assert_int_equal(wb.coinb2bin[ofs++], 1);
+    assert_true(get_le64(wb.coinb2bin + ofs) == wb.coinbasevalue);
+    ofs += 8;
+    assert_int_equal(wb.coinb2bin[ofs++], sizeof(txnbin));
+    assert_memory_equal(wb.coinb2bin + ofs, txnbin, sizeof(txnbin));
+    ofs += sizeof(txnbin);
+    /* Blank lock time with coinb3 folded into coinb2 without btcsolo */
+    assert_int_equal(wb.coinb2len, ofs + 4);
+    assert_int_equal(wb.coinb3len, 0);
+    assert_null(wb.coinb3bin);
+    assert_int_equal(strlen(wb.coinb2), wb.coinb2len * 2);
+
+    /* The clock is the only source of variation */
+    init_wb(&wb2);
+    stratcore_coinbase(&sc, &wb2);
+    assert_string_equal(wb2.coinb1, wb.coinb1);
+    assert_string_equal(wb2.coinb2, wb.coinb2);
+    assert_memory_equal(wb2.headerbin, wb.headerbin, 112);
+    clear_wb(&wb2);
+    h.now.tv_nsec++;
+    init_wb(&wb2);
+    stratcore_coinbase(&sc, &wb2);
+    assert_true(strcmp(wb2.coinb1, wb.coinb1) != 0);
+    assert_string_equal(wb2.coinb2, wb.coinb2);
+    clear_wb(&wb2);
+    clear_wb(&wb);
+}
+
+static void test_coinbase_donation_solo(void)
+{
+    uint64_t g64, d64;
+    stratcore_t sc;
+    struct hooks h;
+    workbase_t wb;
+    int ofs;
+
+    init_core(&sc, &h);
+    sc.donation = 1.5;
+    init_wb(&wb);
+    stratcore_coinbase(&sc, &wb);
+    ofs = 11 + 1 + 6 + 4;
+    assert_int_equal(wb.coinb2bin[ofs++], 2);
+    g64 = get_le64(wb.coinb2bin + ofs);
+    ofs += 8 + 1 + sizeof(txnbin);
+    d64 = get_le64(wb.coinb2bin + ofs);
+    ofs += 8;
+    assert_true(g64 + d64 == wb.coinbasevalue);
+    assert_true(d64 == (uint64_t)(wb.coinbasevalue / 100.0 * 1.5));
+    assert_int_equal(wb.coinb2bin[ofs++], sizeof(dontxnbin));
+    assert_memory_equal(wb.coinb2bin + ofs, dontxnbin, sizeof(dontxnbin));
+    clear_wb(&wb);
+
+    /* Solo keeps coinb3 for each user's coinb2 to follow their address */
+    sc.donation = 0;
+    sc.btcsolo = true;
+    init_wb(&wb);
+    wb.insert_witness = true;
+    memset(wb.witnessdata, 'a', 72);
+    stratcore_coinbase(&sc, &wb);
+    assert_int_equal(wb.coinb2bin[11 + 1 + 6 + 4], 2);
+    assert_int_equal(wb.coinb2len, 11 + 1 + 6 + 4 + 1 + 8);
+    assert_int_equal(wb.coinb3len, 8 + 1 + 2 + 36 + 4);
+    assert_int_equal((uchar)wb.coinb3bin[9], 0x6a);
+    clear_wb(&wb);
+}
+
+static enum share_err submit(const stratcore_t *sc, stratcore_share_t *share, const char *params)
+{
+    json_t *val = json_loads(params, 0, NULL);
+    enum share_err ret;
+
+    assert_non_null(val);
+    ret = stratcore_submit_params(sc, val, share);
+    json_decref(val);
+    return ret;
+}
+
+static void test_submit_params(void)
+{
+    stratcore_share_t share;
+    stratcore_t sc;
+    struct hooks h;
+    json_t *val;
+
+    init_core(&sc, &h);
+    assert_int_equal(submit(&sc, &share, "{}"), SE_NOT_ARRAY);
+    assert_int_equal(submit(&sc, &share, "[\"w\", \"1\", \"00\", \"00\"]"), SE_INVALID_SIZE);
+    assert_int_equal(submit(&sc, &share, "[\"\", \"1\", \"00\", \"00\", \"deadbeef\"]"), SE_NO_USERNAME);
+    assert_int_equal(submit(&sc, &share, "[\"w\", null, \"00\", \"00\", \"deadbeef\"]"), SE_NO_JOBID);
+    assert_int_equal(submit(&sc, &share, "[\"w\", \"1\", \"0g\", \"00\", \"deadbeef\"]"), SE_NO_NONCE2);
+    assert_int_equal(submit(&sc, &share, "[\"w\", \"1\", \"00\", \"\", \"deadbeef\"]"), SE_NO_NTIME);
+    assert_int_equal(submit(&sc, &share, "[\"w\", \"1\", \"00\", \"00\", \"deadbee\"]"), SE_NO_NONCE);
+    assert_int_equal(submit(&sc, &share, "[\"w\", \"1\", \"00\", \"00\", \"deadbeef\", \"00000001\"]"),
+                     SE_INVALID_VERSION_MASK);
+    sc.version_mask = 0;
+    assert_int_equal(submit(&sc, &share, "[\"w\", \"1\", \"00\", \"00\", \"deadbeef\", \"00002000\"]"),
+                     SE_INVALID_VERSION_MASK);
+
+    /* The strings stay in the params so parse and check them with it held */
+    sc.version_mask = 0x1fffe000;
+    val = json_loads("[\"w.1\", \"65a1b2c3d4\", \"0011223344556677\", \"6553f1ff\", \"deadbeef\", \"00002000\"]",
+                     0, NULL);
+    assert_int_equal(stratcore_submit_params(&sc, val, &share), SE_NONE);
+    assert_string_equal(share.workername, "w.1");
+    assert_string_equal(share.nonce2, "0011223344556677");
+    assert_true(share.id == 0x65a1b2c3d4);
+    assert_true(share.ntime32 == 0x6553f1ff);
+    assert_true(share.version_mask32 == 0x2000);
+    json_decref(val);
+
+    /* A mask the client doesn't use is fine */
+    assert_int_equal(submit(&sc, &share, "[\"w\", \"1\", \"00\", \"00\", \"deadbeef\", \"zz\"]"), SE_NONE);
+    assert_true(share.version_mask32 == 0);
+}
+
+static void init_share(stratcore_share_t *share, const char *nonce2, const char *nonce,
+                       const uint32_t ntime32, const uint32_t version_mask32)
+{
+    memset(share, 0, sizeof(stratcore_share_t));
+    share->nonce2 = nonce2;
+    share->nonce = nonce;
+    share->ntime32 = ntime32;
+    share->version_mask32 = version_mask32;
+}
+
+static void test_share_diff(void)
+{
+    const uchar enonce1bin[4] = {1, 2, 3, 4};
+    stratcore_share_t share, fixed;
+    uchar coinbase[256], root[32], hash1[32], hash[32], data[80];
+    uint32_t *data32;
+    stratcore_t sc;
+    struct hooks h;
+    workbase_t wb;
+    int cblen;
+
+    init_core(&sc, &h);
+    init_wb(&wb);
+    stratcore_coinbase(&sc, &wb);
+
+    init_share(&share, "0011223344556677", "deadbeef", wb.ntime32 + 1, 0x2000);
+    stratcore_share_diff(&wb, enonce1bin, wb.coinb2bin, wb.coinb2len, &share);
+
+    /* The coinbase with the client's enonce1 and the submitted nonce2 */
+    memcpy(coinbase, wb.coinb1bin, wb.coinb1len);
+    cblen = wb.coinb1len;
+    memcpy(coinbase + cblen, enonce1bin, 4);
+    cblen += 4;
+    hex2bin(coinbase + cblen, "0011223344556677", 8);
+    cblen += 8;
+    memcpy(coinbase + cblen, wb.coinb2bin, wb.coinb2len);
+    cblen += wb.coinb2len;
+    assert_int_equal(share.cblen, cblen);
+    assert_memory_equal(share.coinbase, coinbase, cblen);
+
+    /* With no merkle branches the root is the coinbase txid */
+    flip_80(data, share.swap);
+    gen_hash(coinbase, hash, cblen);
+    flip_32(root, hash);
+    assert_memory_equal(data + 36, root, 32);
+    data32 = (uint32_t *)data;
+    assert_true(data32[0] == (htobe32(0x20000000) | htobe32(0x2000)));
+    assert_true(data32[17] == htobe32(wb.ntime32 + 1));
+    assert_memory_equal(data + 4, wb.headerbin + 4, 32);
+
+    sha256(share.swap, 80, hash1);
+    sha256(hash1, 32, hash);
+    assert_memory_equal(share.hash, hash, 32);
+    assert_double_equal(share.sdiff, diff_from_target(hash), EPSILON);
+
+    /* Broken clients get their nonce2 padded or truncated and extra nonce
+     * chars dropped, hashing the same as the corrected share */
+    init_share(&fixed, "00112233", "deadbeef", wb.ntime32 + 1, 0x2000);
+    stratcore_share_diff(&wb, enonce1bin, wb.coinb2bin, wb.coinb2len, &fixed);
+    assert_string_equal(fixed.nonce2, "0011223300000000");
+    init_share(&share, "0011223300000000", "deadbeef", wb.ntime32 + 1, 0x2000);
+    stratcore_share_diff(&wb, enonce1bin, wb.coinb2bin, wb.coinb2len, &share);
+    assert_memory_equal(fixed.hash, share.hash, 32);
+
+    init_share(&fixed, "00112233445566778899", "deadbeef00", wb.ntime32 + 1, 0x2000);
+    stratcore_share_diff(&wb, enonce1bin, wb.coinb2bin, wb.coinb2len, &fixed);
+    assert_string_equal(fixed.nonce2, "0011223344556677");
+    assert_string_equal(fixed.nonce, "deadbeef");
+    init_share(&share, "0011223344556677", "deadbeef", wb.ntime32 + 1, 0x2000);
+    stratcore_share_diff(&wb, enonce1bin, wb.coinb2bin, wb.coinb2len, &share);
+    assert_memory_equal(fixed.hash, share.hash, 32);
+
+    assert_false(stratcore_ntime_valid(&wb, wb.ntime32 - 1));
+    assert_true(stratcore_ntime_valid(&wb, wb.ntime32));
+    assert_true(stratcore_ntime_valid(&wb, wb.ntime32 + STRATCORE_NTIME_ROLL));
+    assert_false(stratcore_ntime_valid(&wb, wb.ntime32 + STRATCORE_NTIME_ROLL + 1));
+    clear_wb(&wb);
+}
+
+static void test_block(void)
+{
+    const uchar enonce1bin[4] = {1, 2, 3, 4};
+    char blockhash[68], expected[1024], rhash[68], *gbt_block;
+    uchar flip32[32], swap256[32];
+    stratcore_share_t share;
+    stratcore_t sc;
+    struct hooks h;
+    workbase_t wb;
+
+    init_core(&sc, &h);
+    init_wb(&wb);
+    stratcore_coinbase(&sc, &wb);
+    init_share(&share, "0011223344556677", "deadbeef", wb.ntime32, 0);
+    stratcore_share_diff(&wb, enonce1bin, wb.coinb2bin, wb.coinb2len, &share);
+
+    /* Header, one transaction and the coinbase */
+    gbt_block = stratcore_block(&wb, share.coinbase, share.cblen, share.swap, share.hash,
+                                flip32, blockhash);
+    __bin2hex(expected, share.swap, 80);
+    strcat(expected, "01");
+    __bin2hex(expected + 162, share.coinbase, share.cblen);
+    assert_string_equal(gbt_block, expected);
+    swap_256(swap256, flip32);
+    __bin2hex(rhash, swap256, 32);
+
+    /* Accepted by submitblock */
+    h.submit_ret = true;
+    assert_true(stratcore_submit_block(&sc, gbt_block, flip32, wb.height));
+    assert_int_equal(h.submits, 1);
+    assert_string_equal(h.precious, rhash);
+    assert_int_equal(h.height, 0);
+
+    /* Rejected but then found at its height after the precious block call */
+    h.submit_ret = false;
+    strcpy(h.heighthash, rhash);
+    gbt_block = stratcore_block(&wb, share.coinbase, share.cblen, share.swap, share.hash,
+                                flip32, blockhash);
+    assert_true(stratcore_submit_block(&sc, gbt_block, flip32, wb.height));
+    assert_int_equal(h.height, wb.height);
+
+    /* Another block at its height */
+    h.heighthash[0] = h.heighthash[0] == 'f' ? 'e' : 'f';
+    gbt_block = stratcore_block(&wb, share.coinbase, share.cblen, share.swap, share.hash,
+                                flip32, blockhash);
+    assert_false(stratcore_submit_block(&sc, gbt_block, flip32, wb.height));
+    assert_int_equal(h.submits, 3);
+
+    /* No rpc hooks can't submit anything */
+    memset(&sc, 0, sizeof(stratcore_t));
+    gbt_block = stratcore_block(&wb, share.coinbase, share.cblen, share.swap, share.hash,
+                                flip32, blockhash);
+    assert_false(stratcore_submit_block(&sc, gbt_block, flip32, wb.height));
+    clear_wb(&wb);
+}
+
+static void test_notify_send(void)
+{
+    stratcore_t sc;
+    struct hooks h;
+    workbase_t wb;
+    json_t *val, *params;
+
+    init_core(&sc, &h);
+    init_wb(&wb);
+    stratcore_coinbase(&sc, &wb);
+    json_array_append_new(wb.merkle_array, json_string("ab"));
+
+    val = stratcore_notify(&wb, "c0ffee", true);
+    assert_string_equal(json_string_value(json_object_get(val, "method")), "mining.notify");
+    assert_true(json_is_null(json_object_get(val, "id")));
+    params = json_object_get(val, "params");
+    assert_int_equal(json_array_size(params), 9);
+    assert_string_equal(json_string_value(json_array_get(params, 0)), wb.idstring);
+    assert_string_equal(json_string_value(json_array_get(params, 2)), wb.coinb1);
+    assert_string_equal(json_string_value(json_array_get(params, 3)), "c0ffee");
+    assert_int_equal(json_array_size(json_array_get(params, 4)), 1);
+    assert_true(json_is_true(json_array_get(params, 8)));
+
+    stratcore_send(&sc, val, 42, 3);
+    assert_ptr_equal(h.sent, val);
+    assert_true(h.sent_id == 42);
+    assert_int_equal(h.sent_type, 3);
+    json_decref(h.sent);
+
+    /* Without a send hook messages are dropped */
+    sc.send = NULL;
+    stratcore_send(&sc, stratcore_notify(&wb, wb.coinb2, false), 42, 3);
+    clear_wb(&wb);
+}
+
+/* The mode flags each share path stands in for */
+struct mode_flags {
+    bool proxy;
+    bool passthrough;
+    bool node;
+    bool remote;
+    bool btcsolo;
+};
+
+static const struct mode_flags mode_flags[STRATCORE_MODES] = {
+    [STRATCORE_POOL] = { false, false, false, false, false },
+    [STRATCORE_SOLO] = { false, false, false, false, true },
+    [STRATCORE_PROXY] = { true, false, false, false, false },
+    [STRATCORE_NODE] = { true, true, true, false, false },
+    [STRATCORE_REMOTE] = { false, false, false, true, false },
+    [STRATCORE_REMOTE_SOLO] = { false, false, false, true, true },
+};
+
+static void set_mode_flags(ckpool_t *ckp, const struct mode_flags *mf)
+{
+    memset(ckp, 0, sizeof(ckpool_t));
+    ckp->proxy = mf->proxy;
+    ckp->passthrough = mf->passthrough;
+    ckp->node = mf->node;
+    ckp->remote = mf->remote;
+    ckp->btcsolo = mf->btcsolo;
+}
+
+static void test_path_select(void)
+{
+    ckpool_t ckp;
+    int mode, other;
+
+    for (mode = 0; mode < STRATCORE_MODES; mode++) {
+        const stratcore_path_t *path = stratcore_path(mode);
+
+        set_mode_flags(&ckp, &mode_flags[mode]);
+        assert_int_equal(stratcore_mode(&ckp), mode);
+        assert_int_equal(path->mode, mode);
+        for (other = 0; other < mode; other++)
+            assert_true(strcmp(path->name, stratcore_path(other)->name));
+    }
+
+    /* Passthroughs and redirectors never check shares */
+    set_mode_flags(&ckp, &mode_flags[STRATCORE_PROXY]);
+    ckp.passthrough = ckp.redirector = true;
+    assert_int_equal(stratcore_mode(&ckp), STRATCORE_PROXY);
+    ckp.userproxy = true;
+    ckp.passthrough = ckp.redirector = false;
+    assert_int_equal(stratcore_mode(&ckp), STRATCORE_PROXY);
+    assert_int_equal(stratcore_path(STRATCORE_MODES)->mode, STRATCORE_POOL);
+}
+
+/* Every mode's path does what the mode checks it replaced did for the same
+ * share and hashes it to the same result when the coinb2 is the same */
+static void test_path_equivalence(void)
+{
+    const uchar enonce1bin[4] = {1, 2, 3, 4};
+    const uchar user_cb2[] = "user coinb2 paying a solo miner";
+    stratcore_share_t share, pool_share;
+    int mode, user, submit;
+
+    for (mode = 0; mode < STRATCORE_MODES; mode++) {
+        const struct mode_flags *mf = &mode_flags[mode];
+        const stratcore_path_t *path = stratcore_path(mode);
+
+        for (user = 0; user < 2; user++) {
+            for (submit = 0; submit < 2; submit++) {
+                const uchar *cb2, *expect_cb2;
+                int cb2len, expect_cb2len;
+                stratcore_share_t ref;
+                stratcore_t sc;
+                struct hooks h;
+                workbase_t wb;
+                tv_t now;
+                json_t *val;
+
+                init_core(&sc, &h);
+                init_wb(&wb);
+                stratcore_coinbase(&sc, &wb);
+                /* Nodes build their workbases from the pool's, not a
+                 * proxy's notify */
+                wb.proxy = mf->proxy && !mf->node;
+                wb.diff = 1024;
+                wb.network_diff = 5e12;
+                if (user) {
+                    h.user_cb2 = user_cb2;
+                    h.user_cb2len = sizeof(user_cb2);
+                }
+
+                /* Users have their own coinb2 only in solo modes, when
+                 * one was generated for the workbase */
+                if (mf->btcsolo && user) {
+                    expect_cb2 = user_cb2;
+                    expect_cb2len = sizeof(user_cb2);
+                } else {
+                    expect_cb2 = wb.coinb2bin;
+                    expect_cb2len = wb.coinb2len;
+                }
+                cb2 = path->coinb2(&sc, &wb, NULL, &cb2len);
+                assert_ptr_equal(cb2, expect_cb2);
+                assert_int_equal(cb2len, expect_cb2len);
+
+                init_share(&share, "0011223344556677", "deadbeef", wb.ntime32 + 1, 0);
+                init_share(&ref, "0011223344556677", "deadbeef", wb.ntime32 + 1, 0);
+                stratcore_share_diff(&wb, enonce1bin, cb2, cb2len, &share);
+                stratcore_share_diff(&wb, enonce1bin, expect_cb2, expect_cb2len, &ref);
+                assert_memory_equal(share.hash, ref.hash, 32);
+                assert_double_equal(share.sdiff, ref.sdiff, EPSILON);
+                if (expect_cb2 == wb.coinb2bin) {
+                    if (mode == STRATCORE_POOL && !user && !submit)
+                        memcpy(&pool_share, &share, sizeof(stratcore_share_t));
+                    assert_memory_equal(share.hash, pool_share.hash, 32);
+                }
+
+                assert_double_equal(path->network_diff(&wb),
+                                    mf->proxy ? wb.diff : wb.network_diff, EPSILON);
+
+                /* Nodes leave diff to their upstream pool */
+                tv_time(&now);
+                path->retarget(&sc, NULL, 2.5, &now, 5e12, wb.id + 1, wb.id);
+                assert_int_equal(h.retargets, mf->node ? 0 : 1);
+                if (!mf->node) {
+                    assert_double_equal(h.retarget_diff, 2.5, EPSILON);
+                    assert_double_equal(h.retarget_network_diff, 5e12, EPSILON);
+                    assert_true(h.retarget_next_blockid == wb.id + 1);
+                    assert_true(h.retarget_current_blockid == wb.id);
+                }
+
+                /* Proxied workbases' shares go upstream when wanted,
+                 * never a node's */
+                path->forward(&sc, NULL, &share, submit);
+                if (mf->node)
+                    assert_int_equal(h.upstream_shares, 0);
+                else
+                    assert_int_equal(h.upstream_shares, wb.proxy && submit ? 1 : 0);
+
+                assert_true(path->log_id(7, 70) == (mf->remote ? 70 : 7));
+                val = json_object();
+                path->log(&sc, val);
+                assert_int_equal(h.upstreams, mf->remote ? 1 : 0);
+                if (mf->remote)
+                    assert_int_equal(h.upstream_type, SM_SHARE);
+                json_decref(val);
+
+                /* Nodes never answer shares */
+                val = json_object();
+                path->respond(&sc, val, 42);
+                if (mf->node)
+                    assert_null(h.sent);
+                else {
+                    assert_ptr_equal(h.sent, val);
+                    assert_true(h.sent_id == 42);
+                    assert_int_equal(h.sent_type, SM_SHARERESULT);
+                    json_decref(h.sent);
+                }
+                clear_wb(&wb);
+            }
+        }
+    }
+}
+
+int main(void)
+{
+    printf("Running stratcore tests...\n\n");
+
+    run_test(test_coinbase);
+    run_test(test_coinbase_donation_solo);
+    run_test(test_submit_params);
+    run_test(test_share_diff);
+    run_test(test_block);
+    run_test(test_notify_send);
+    run_test(test_path_select);
+    run_test(test_path_equivalence);
+
+    printf("\nAll stratcore tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,295 @@
+/*
+ * Unit tests for exact 256 bit targets
+ * Tests targets from diffs against exact values, the limits of the diffs
+ * that fit, nbits, and that hashes either side of each boundary meet or miss
+ * a diff exactly where its target says they should
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "target256.h"
+
+static void assert_limbs(const target256_t *t, uint64_t l0, uint64_t l1, uint64_t l2, uint64_t l3)
+{
+    assert_true(t->limb[0] == l0);
+    assert_true(t->limb[1] == l1);
+    assert_true(t->limb[2] == l2);
+    assert_true(t->limb[3] == l3);
+}
+
+static bool is_max(const target256_t *t)
+{
+    return !~t->limb[0] && !~t->limb[1] && !~t->limb[2] && !~t->limb[3];
+}
+
+static bool is_zero(const target256_t *t)
+{
+    return !t->limb[0] && !t->limb[1] && !t->limb[2] && !t->limb[3];
+}
+
+static void add1(target256_t *t)
+{
+    int i;
+
+    for (i = 0; i < 4 && !++t->limb[i]; i++);
+}
+
+static void sub1(target256_t *t)
+{
+    int i;
+
+    for (i = 0; i < 4 && !t->limb[i]--; i++);
+}
+
+/* Against floor(diff 1 target / diff) worked out with exact fractions */
+static void test_from_diff_exact(void)
+{
+    target256_t t;
+
+    target256_from_diff(&t, 1.0);
+    assert_limbs(&t, 0, 0, 0, 0x00000000ffff0000ULL);
+    target256_from_diff(&t, 0.5);
+    assert_limbs(&t, 0, 0, 0, 0x00000001fffe0000ULL);
+    target256_from_diff(&t, 3.0);
+    assert_limbs(&t, 0, 0, 0, 0x0000000055550000ULL);
+    target256_from_diff(&t, 7.0);
+    assert_limbs(&t, 0x2492492492492492ULL, 0x9249249249249249ULL, 0x4924924924924924ULL,
+                 0x0000000024922492ULL);
+    target256_from_diff(&t, 0.1);
+    assert_limbs(&t, 0x80028000000009ffULL, 0x009fff5ffffffffdULL, 0xffffd80028000000ULL,
+                 0x00000009fff5ffffULL);
+    target256_from_diff(&t, 1.0 / 3);
+    assert_limbs(&t, 0xbfff4000000002ffULL, 0x002fffd000000000ULL, 0x00000bfff4000000ULL,
+                 0x00000002fffd0000ULL);
+    target256_from_diff(&t, 0.001);
+    assert_limbs(&t, 0xd10d2f00000013c6ULL, 0x08c9f735fffffff2ULL, 0xfffa2405dc000000ULL,
+                 0x000003e7fc17ffffULL);
+    target256_from_diff(&t, 1e-9);
+    assert_limbs(&t, 0xcfbaa4c14955fdb7ULL, 0x1619e09d7e3f36fcULL, 0x81b5fe088151b079ULL,
+                 0x3b9a8e6535fffef4ULL);
+    target256_from_diff(&t, 123456.789);
+    assert_limbs(&t, 0xcdf0e652f3bcfe45ULL, 0x7e78e4308b2b8f81ULL, 0xb45ede50c6ef489aULL,
+                 0x00000000000087e4ULL);
+    target256_from_diff(&t, 5e12);
+    assert_limbs(&t, 0x42464ecea75e19b1ULL, 0x97c6949f63182f9aULL, 0x00384b4c850e1c70ULL, 0);
+    target256_from_diff(&t, 2.5e-10);
+    assert_limbs(&t, 0x3eea93052557f6dfULL, 0x58678275f8fcdbf3ULL, 0x06d7f8220546c1e4ULL,
+                 0xee6a3994d7fffbd2ULL);
+}
+
+/* Diffs whose targets don't fit in 256 bits get the maximum target, and
+ * diffs too high for any target but zero get zero */
+static void test_from_diff_limits(void)
+{
+    double lowest = 0xFFFF / 0x1p48; /* target of exactly 2^256 */
+    target256_t t;
+
+    target256_from_diff(&t, 0.0);
+    assert_true(is_max(&t));
+    target256_from_diff(&t, -1.0);
+    assert_true(is_max(&t));
+    target256_from_diff(&t, NAN);
+    assert_true(is_max(&t));
+    target256_from_diff(&t, 1e-300);
+    assert_true(is_max(&t));
+    target256_from_diff(&t, 4.9e-324);
+    assert_true(is_max(&t));
+    target256_from_diff(&t, lowest);
+    assert_true(is_max(&t));
+    target256_from_diff(&t, nextafter(lowest, 1));
+    assert_false(is_max(&t));
+    assert_true(t.limb[3] > 0xfffff00000000000ULL);
+
+    /* The diff 1 target itself has a target of 1 */
+    target256_from_diff(&t, 0xFFFFp208);
+    assert_limbs(&t, 1, 0, 0, 0);
+    target256_from_diff(&t, nextafter(0xFFFFp208, INFINITY));
+    assert_true(is_zero(&t));
+    target256_from_diff(&t, 1e300);
+    assert_true(is_zero(&t));
+    target256_from_diff(&t, INFINITY);
+    assert_true(is_zero(&t));
+}
+
+/* A hash equal to a diff's target meets it and one more misses it */
+static void check_boundary(const double diff)
+{
+    uchar hash[32];
+    target256_t t, h;
+
+    target256_from_diff(&t, diff);
+    h = t;
+    target256_to_le(hash, &h);
+    assert_true(target256_meets_diff(hash, diff));
+    assert_true(target256_meets(hash, &t));
+    assert_true(fulltest(hash, hash));
+    if (!is_zero(&t)) {
+        sub1(&h);
+        target256_to_le(hash, &h);
+        assert_true(target256_meets_diff(hash, diff));
+        assert_true(target256_meets(hash, &t));
+        assert_int_equal(target256_cmp(&h, &t), -1);
+    }
+    if (!is_max(&t)) {
+        h = t;
+        add1(&h);
+        target256_to_le(hash, &h);
+        assert_false(target256_meets_diff(hash, diff));
+        assert_false(target256_meets(hash, &t));
+        assert_int_equal(target256_cmp(&h, &t), 1);
+    }
+}
+
+static void test_boundaries(void)
+{
+    double fixed[] = { 1.0, 0.5, 0.1, 1.0 / 3, 0.001, 1e-9, 2.5e-10, 0.75, 1.5, 7.0, 42.0,
+                       65535.0, 65536.0, 123456.789, 1e9, 5e12, 1e15, 0xFFFFp208, 1e30 };
+    uint64_t seed = 1;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+        check_boundary(fixed[i]);
+
+    /* Diffs from 2^-32 to 2^80 with random mantissas */
+    for (i = 0; i < 20000; i++) {
+        uint64_t bits;
+        double diff;
+
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        bits = (seed >> 12) | ((uint64_t)(1023 - 32 + i % 112) << 52);
+        memcpy(&diff, &bits, 8);
+        check_boundary(diff);
+    }
+}
+
+/* Away from the boundary the exact check agrees with the old double one */
+static void test_meets_diff_double(void)
+{
+    uint64_t seed = 7;
+    int i, j;
+
+    for (i = 0; i < 20000; i++) {
+        double diff, sdiff;
+        uchar hash[32];
+
+        for (j = 0; j < 32; j++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            hash[j] = seed >> 56;
+        }
+        memset(hash + 32 - 4 - i % 8, 0, 4 + i % 8);
+        sdiff = diff_from_target(hash);
+        diff = sdiff * (0.5 + (i % 101) / 100.0);
+        if (fabs(diff / sdiff - 1) < 1e-12)
+            continue;
+        assert_true(target256_meets_diff(hash, diff) == (sdiff >= diff));
+    }
+
+    /* Every hash meets diffs with no target below 2^256, only zero meets
+     * infinity */
+    {
+        uchar hash[32];
+
+        memset(hash, 0xff, 32);
+        assert_true(target256_meets_diff(hash, 0.0));
+        assert_true(target256_meets_diff(hash, 1e-12));
+        assert_false(target256_meets_diff(hash, 1.0));
+        memset(hash, 0, 32);
+        assert_true(target256_meets_diff(hash, INFINITY));
+        assert_true(target256_meets_diff(hash, 1e300));
+        hash[0] = 1;
+        assert_false(target256_meets_diff(hash, INFINITY));
+        assert_false(target256_meets_diff(hash, 1e300));
+        assert_true(target256_meets_diff(hash, 0xFFFFp208));
+        hash[0] = 2;
+        assert_false(target256_meets_diff(hash, 0xFFFFp208));
+    }
+}
+
+static void test_nbits(void)
+{
+    uchar diff1[4] = { 0x1d, 0x00, 0xff, 0xff };
+    uchar regtest[4] = { 0x20, 0x7f, 0xff, 0xff };
+    uchar mainnet[4] = { 0x17, 0x03, 0xa3, 0xc8 };
+    uchar split[4] = { 0x09, 0x12, 0x34, 0x56 };
+    target256_t t, one;
+
+    target256_from_nbits(&t, diff1);
+    target256_from_diff(&one, 1.0);
+    assert_int_equal(target256_cmp(&t, &one), 0);
+    assert_double_equal(target256_diff(&t), 1.0, 1e-12);
+
+    target256_from_nbits(&t, regtest);
+    assert_limbs(&t, 0, 0, 0, 0x7fffff0000000000ULL);
+    assert_double_equal(target256_diff(&t), diff_from_nbits((char *)regtest), 1e-15);
+
+    target256_from_nbits(&t, mainnet);
+    assert_limbs(&t, 0, 0, 0x0003a3c800000000ULL, 0);
+    assert_true(fabs(target256_diff(&t) / diff_from_nbits((char *)mainnet) - 1) < 1e-12);
+
+    /* Mantissa across two limbs */
+    target256_from_nbits(&t, split);
+    assert_limbs(&t, 0x3456000000000000ULL, 0x12, 0, 0);
+}
+
+/* Limb order and endianness against the byte at a time comparison */
+static void test_meets_bytes(void)
+{
+    uchar hash[32], target[32];
+    uint64_t seed = 3;
+    target256_t t;
+    int i, j, cmp;
+
+    for (i = 0; i < 10000; i++) {
+        for (j = 0; j < 32; j++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            target[j] = seed >> 56;
+        }
+        memcpy(hash, target, 32);
+        /* Change one byte either way so the first difference is anywhere */
+        hash[i % 32] += (i & 32) ? 1 : -1;
+        for (j = 31, cmp = 0; j >= 0 && !cmp; j--)
+            cmp = hash[j] < target[j] ? -1 : hash[j] > target[j];
+        target256_from_le(&t, target);
+        assert_true(target256_meets(hash, &t) == (cmp <= 0));
+        assert_true(fulltest(hash, target) == (cmp <= 0));
+        target256_to_le(hash, &t);
+        assert_memory_equal(hash, target, 32);
+    }
+}
+
+/* target_from_diff is now exact and diff_from_target still reads it back */
+static void test_libckpool(void)
+{
+    uchar target[32], le[32];
+    target256_t t;
+
+    target_from_diff(target, 0.001);
+    target256_from_diff(&t, 0.001);
+    target256_to_le(le, &t);
+    assert_memory_equal(target, le, 32);
+    assert_double_equal(diff_from_target(target), 0.001, 1e-15);
+    assert_double_equal(target256_diff(&t), diff_from_target(target), 1e-18);
+}
+
+int main(void)
+{
+    printf("Running 256 bit target tests...\n\n");
+
+    run_test(test_from_diff_exact);
+    run_test(test_from_diff_limits);
+    run_test(test_boundaries);
+    run_test(test_meets_diff_double);
+    run_test(test_nbits);
+    run_test(test_meets_bytes);
+    run_test(test_libckpool);
+
+    printf("\nAll 256 bit target tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Unit tests for per thread CPU and scheduling telemetry
+ * Tests registration through rename_proc, CPU of busy threads against idle
+ * threads, grouping numbered threads by role and removal on thread exit
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "threadstats.h"
+
+#define TEST_INTERVAL_MS 300
+
+static volatile bool test_stop;
+static int test_started;
+
+static void *busy_thread(void *arg)
+{
+    volatile uint64_t spin = 0;
+
+    rename_proc((const char *)arg);
+    __atomic_add_fetch(&test_started, 1, __ATOMIC_SEQ_CST);
+    while (!test_stop)
+        spin++;
+    return NULL;
+}
+
+static void *idle_thread(void *arg)
+{
+    rename_proc((const char *)arg);
+    __atomic_add_fetch(&test_started, 1, __ATOMIC_SEQ_CST);
+    while (!test_stop)
+        cksleep_ms(5);
+    return NULL;
+}
+
+static json_t *find_thread(json_t *val, const char *name)
+{
+    json_t *arr_val = json_object_get(val, "threads"), *thread;
+    size_t i;
+
+    json_array_foreach(arr_val, i, thread) {
+        if (!strcmp(json_string_value(json_object_get(thread, "name")), name))
+            return thread;
+    }
+    return NULL;
+}
+
+static double field(json_t *val, const char *key)
+{
+    return json_real_value(json_object_get(val, key));
+}
+
+static int64_t cpu_ns(const clockid_t clockid)
+{
+    ts_t cputime;
+
+    assert_int_equal(clock_gettime(clockid, &cputime), 0);
+    return (int64_t)cputime.tv_sec * 1000000000 + cputime.tv_nsec;
+}
+
+static void start_threads(pthread_t *pth)
+{
+    test_stop = false;
+    test_started = 0;
+    pthread_create(&pth[0], NULL, busy_thread, "tbusy0");
+    pthread_create(&pth[1], NULL, busy_thread, "tbusy1");
+    pthread_create(&pth[2], NULL, idle_thread, "tidle");
+    while (__atomic_load_n(&test_started, __ATOMIC_SEQ_CST) < 3)
+        cksleep_ms(1);
+}
+
+static void stop_threads(pthread_t *pth)
+{
+    int i;
+
+    test_stop = true;
+    for (i = 0; i < 3; i++)
+        pthread_join(pth[i], NULL);
+}
+
+/* Nothing is reported for a thread until it has been sampled twice */
+static void test_first_sample(void)
+{
+    pthread_t pth[3];
+    json_t *val;
+
+    start_threads(pth);
+    threadstats_sample();
+    val = threadstats_json(true);
+    assert_null(find_thread(val, "tbusy0"));
+    json_decref(val);
+    stop_threads(pth);
+}
+
+/* A spinning thread shows more CPU than a sleeping one, whatever else the
+ * machine is running, and numbered threads are summed under their role */
+static void test_cpu_and_roles(void)
+{
+    json_t *val, *thread, *idle, *role;
+    int64_t cpu_ns_start;
+    clockid_t clockid;
+    pthread_t pth[3];
+
+    start_threads(pth);
+    assert_int_equal(pthread_getcpuclockid(pth[0], &clockid), 0);
+    cpu_ns_start = cpu_ns(clockid);
+    threadstats_sample();
+    cksleep_ms(TEST_INTERVAL_MS);
+    threadstats_sample();
+    val = threadstats_json(true);
+    assert_true(cpu_ns(clockid) > cpu_ns_start);
+
+    assert_true(field(val, "interval") > 0);
+    thread = find_thread(val, "tbusy0");
+    assert_non_null(thread);
+    assert_true(json_integer_value(json_object_get(thread, "tid")) > 0);
+    idle = find_thread(val, "tidle");
+    assert_non_null(idle);
+    assert_true(field(thread, "cpu") > field(idle, "cpu"));
+    /* Sleeping in a loop switches voluntarily */
+    assert_true(field(idle, "vcsw") > 0);
+
+    role = json_object_get(json_object_get(val, "roles"), "tbusy");
+    assert_non_null(role);
+    assert_int_equal(json_integer_value(json_object_get(role, "threads")), 2);
+    assert_true(field(role, "cpu") >= field(idle, "cpu"));
+    assert_null(json_object_get(json_object_get(val, "roles"), "tbusy0"));
+
+    /* Threads are ordered busiest first */
+    assert_true(field(json_array_get(json_object_get(val, "threads"), 0), "cpu") >=
+                field(idle, "cpu"));
+    json_decref(val);
+    stop_threads(pth);
+}
+
+/* Exited threads are no longer reported */
+static void test_thread_exit(void)
+{
+    pthread_t pth[3];
+    json_t *val;
+
+    start_threads(pth);
+    threadstats_sample();
+    cksleep_ms(50);
+    stop_threads(pth);
+    threadstats_sample();
+    val = threadstats_json(true);
+    assert_null(find_thread(val, "tbusy0"));
+    assert_null(find_thread(val, "tidle"));
+    json_decref(val);
+}
+
+int main(void)
+{
+    printf("Running thread telemetry tests...\n\n");
+
+    run_test(test_first_sample);
+    run_test(test_cpu_and_roles);
+    run_test(test_thread_exit);
+
+    printf("\nAll thread telemetry tests passed!\n");
+    return 0;
+}
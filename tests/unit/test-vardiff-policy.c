@@ -0,0 +1,388 @@
+/*
+ * Unit tests for the pluggable vardiff policies and the offline simulator
+ * Tests policy lookup, the ckpool policy's thresholds, tiers and hysteresis,
+ * clamping to pool limits, floors and network diff at fractional diffs, the
+ * interval and pid policies, and simulated convergence from kH/s to PH/s
+ */
+
+/* config.h must be first to define _GNU_SOURCE before system headers */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "../test_common.h"
+#include "libckpool.h"
+#include "vardiff.h"
+#include "vdsim.h"
+
+static bool perf_tests_enabled(void)
+{
+    const char *val = getenv("CKPOOL_PERF_TESTS");
+
+    return val && val[0] == '1';
+}
+
+static void init_conf(vardiff_conf_t *vc, const int policy)
+{
+    memset(vc, 0, sizeof(vardiff_conf_t));
+    vc->policy = policy;
+    vc->mindiff = 1;
+    vc->target = VARDIFF_TARGET;
+}
+
+/* A client at diff with a steady dsps on every average, mining since long
+ * enough ago that the time bias is 1 */
+static void init_share(vardiff_share_t *vsh, const double diff, const double dsps)
+{
+    memset(vsh, 0, sizeof(vardiff_share_t));
+    vsh->diff = vsh->share_diff = diff;
+    vsh->bdiff = 3600;
+    vsh->dsps15s = vsh->dsps1 = vsh->dsps5 = dsps;
+    vsh->network_diff = 1e14;
+}
+
+static void test_policy_names(void)
+{
+    int i;
+
+    for (i = 0; i < VARDIFF_POLICIES; i++)
+        assert_int_equal(vardiff_policy(vardiff_policy_name(i)), i);
+    assert_int_equal(vardiff_policy("ckpool"), VARDIFF_CKPOOL);
+    assert_int_equal(vardiff_policy("Interval"), VARDIFF_INTERVAL);
+    assert_int_equal(vardiff_policy("PID"), VARDIFF_PID);
+    assert_int_equal(vardiff_policy("bogus"), -1);
+    assert_string_equal(vardiff_policy_name(-1), "unknown");
+    assert_string_equal(vardiff_policy_name(VARDIFF_POLICIES), "unknown");
+}
+
+/* The thresholds, tiers and hysteresis of the original add_submit logic */
+static void test_ckpool_policy(void)
+{
+    vardiff_state_t vs = {0};
+    vardiff_share_t vsh;
+    vardiff_conf_t vc;
+    double new_diff;
+
+    init_conf(&vc, VARDIFF_CKPOOL);
+
+    /* Not enough shares or time yet */
+    init_share(&vsh, 100, 100);
+    vsh.ssdc = 71;
+    vsh.tdiff = 239;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_KEEP);
+
+    /* A share at the old diff restarts the count */
+    vsh.ssdc = 72;
+    vsh.share_diff = 50;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_RESET);
+
+    /* drr of 0.3 is within hysteresis */
+    init_share(&vsh, 100, 30);
+    vsh.ssdc = 72;
+    vsh.tdiff = 100;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_KEEP);
+
+    /* 72 shares uses the 1 minute average */
+    vsh.dsps1 = 100;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_CHANGE);
+    assert_double_equal(new_diff, 333, 0.001);
+    assert_string_equal(vs.tier, "1m");
+
+    /* 144 shares in under 15 seconds uses the 15 second average */
+    vsh.ssdc = 144;
+    vsh.tdiff = 10;
+    vsh.dsps15s = 1000;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_CHANGE);
+    assert_double_equal(new_diff, 3330, 0.001);
+    assert_string_equal(vs.tier, "15s");
+
+    /* 240 seconds with few shares uses the 5 minute average, compensated
+     * for a client that only started 300 seconds ago */
+    init_share(&vsh, 100, 10);
+    vsh.ssdc = 5;
+    vsh.tdiff = 240;
+    vsh.bdiff = 300;
+    vsh.dsps5 = 10 * time_bias(300, 300);
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_CHANGE);
+    assert_double_equal(new_diff, 33, 0.001);
+    assert_string_equal(vs.tier, "5m");
+
+    /* The first share after a change can't lower diff, it may be a client
+     * returning from a leave of absence */
+    vsh.ssdc = 1;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_DEFER);
+}
+
+/* Clamping to mindiff, the client's floor, maxdiff and network diff, with
+ * normalisation of fractional diffs */
+static void test_clamping(void)
+{
+    vardiff_state_t vs = {0};
+    vardiff_share_t vsh;
+    vardiff_conf_t vc;
+    double new_diff;
+
+    init_conf(&vc, VARDIFF_CKPOOL);
+    vc.mindiff = 0.00001;
+
+    /* Fractional diffs normalise to one significant figure */
+    init_share(&vsh, 0.01, 0.0011);
+    vsh.ssdc = 72;
+    vsh.tdiff = 100;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_CHANGE);
+    assert_double_equal(new_diff, 0.004, 1e-9);
+
+    /* An LHR miner far below mindiff stops at its normalised ceiling */
+    vc.mindiff = 0.000015;
+    init_share(&vsh, 0.001, 0.0000001);
+    vsh.ssdc = 2;
+    vsh.tdiff = 300;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_CHANGE);
+    assert_double_equal(new_diff, 0.00002, 1e-12);
+
+    /* Already there is no change */
+    vsh.diff = vsh.share_diff = 0.00002;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_KEEP);
+
+    /* A suggested or password diff is a floor */
+    init_share(&vsh, 100, 1);
+    vsh.ssdc = 72;
+    vsh.tdiff = 100;
+    vsh.floor = 50;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_CHANGE);
+    assert_double_equal(new_diff, 50, 0.001);
+
+    /* maxdiff caps at its normalised floor */
+    vc.maxdiff = 0.0375;
+    init_share(&vsh, 0.01, 1);
+    vsh.ssdc = 72;
+    vsh.tdiff = 100;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_CHANGE);
+    assert_double_equal(new_diff, 0.03, 1e-9);
+
+    /* Network diff caps below maxdiff on regtest */
+    vsh.network_diff = 0.02;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_CHANGE);
+    assert_double_equal(new_diff, 0.02, 1e-9);
+}
+
+static void test_interval_policy(void)
+{
+    vardiff_state_t vs = {0};
+    vardiff_share_t vsh;
+    vardiff_conf_t vc;
+    double new_diff;
+
+    init_conf(&vc, VARDIFF_INTERVAL);
+    vc.target = 5;
+
+    /* Waits for a window of shares */
+    init_share(&vsh, 10, 0);
+    vsh.ssdc = 23;
+    vsh.tdiff = 20;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_KEEP);
+
+    /* 24 shares of diff 10 in 24 seconds is 10 dsps, so 50 for one per 5s */
+    vsh.ssdc = 24;
+    vsh.tdiff = 24;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_CHANGE);
+    assert_double_equal(new_diff, 50, 0.001);
+
+    /* Within the deadband starts a new window */
+    vsh.tdiff = 100;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_RESTART);
+
+    /* So does a share at the old diff */
+    vsh.tdiff = 24;
+    vsh.share_diff = 5;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_RESTART);
+
+    /* Slow clients are evaluated after twice the window's target time */
+    vc.mindiff = 0.0001;
+    init_share(&vsh, 10, 0);
+    vsh.ssdc = 2;
+    vsh.tdiff = 240;
+    assert_int_equal(vardiff_adjust(&vc, &vs, &vsh, &new_diff), VARDIFF_CHANGE);
+    assert_double_equal(new_diff, 0.4, 1e-9);
+    assert_string_equal(vs.tier, "time");
+}
+
+static void test_pid_policy(void)
+{
+    vardiff_state_t vs = {0};
+    vardiff_share_t vsh;
+    vardiff_conf_t vc;
+    double diff = 10, dsps = 300, new_diff;
+    int i, ret;
+
+    init_conf(&vc, VARDIFF_PID);
+
+    /* Drive a noiseless client whose shares come at dsps / diff per second
+     * until the controller settles within its deadband of the target */
+    for (i = 0; i < 20; i++) {
+        init_share(&vsh, diff, dsps);
+        vsh.ssdc = 32;
+        vsh.tdiff = vsh.ssdc * diff / dsps;
+        ret = vardiff_adjust(&vc, &vs, &vsh, &new_diff);
+        if (ret != VARDIFF_CHANGE)
+            break;
+        /* Never overshoots on the way up */
+        assert_true(new_diff > diff);
+        assert_true(new_diff <= dsps * vc.target * 1.5);
+        diff = new_diff;
+    }
+    assert_true(i < 20);
+    assert_int_equal(ret, VARDIFF_RESTART);
+    assert_true(fabs(log(dsps * vc.target / diff)) < 0.6);
+
+    /* The integral is clamped while pinned at maxdiff */
+    vc.maxdiff = 100;
+    memset(&vs, 0, sizeof(vs));
+    for (i = 0; i < 100; i++) {
+        init_share(&vsh, 100, 1e6);
+        vsh.ssdc = 32;
+        vsh.tdiff = 1;
+        vardiff_adjust(&vc, &vs, &vsh, &new_diff);
+    }
+    assert_true(vs.integral <= 3.0);
+}
+
+static void init_sim(vdsim_conf_t *conf, const int policy, const double hashrate)
+{
+    memset(conf, 0, sizeof(vdsim_conf_t));
+    init_conf(&conf->vc, policy);
+    conf->hashrate = hashrate;
+    conf->startdiff = 42;
+    conf->network_diff = 1e14;
+    conf->duration = 3600;
+    conf->jobinterval = 30;
+    conf->latency = 0.05;
+    conf->seed = 1;
+}
+
+/* Every policy converges on TH/s to PH/s miners and holds the target rate */
+static void test_simulator(void)
+{
+    double hashrates[] = { 1e12, 1e15 };
+    vdsim_result_t res;
+    vdsim_conf_t conf;
+    int policy, i;
+
+    for (policy = 0; policy < VARDIFF_POLICIES; policy++) {
+        for (i = 0; i < 2; i++) {
+            init_sim(&conf, policy, hashrates[i]);
+            vdsim_run(&conf, &res);
+            assert_true(res.converge >= 0);
+            assert_true(res.converge < 900);
+            assert_true(res.final_diff > res.ideal / 2 && res.final_diff < res.ideal * 2);
+            assert_true(res.interval > 2 && res.interval < 6);
+            assert_true(res.rate_cv < 0.6);
+            assert_true(res.bytes_in > 0 && res.bytes_out > 0);
+        }
+    }
+
+    /* Runs are reproducible from their seed */
+    init_sim(&conf, VARDIFF_PID, 1e12);
+    vdsim_run(&conf, &res);
+    {
+        vdsim_result_t again;
+
+        vdsim_run(&conf, &again);
+        assert_int_equal(res.shares, again.shares);
+        assert_int_equal(res.changes, again.changes);
+    }
+}
+
+/* A kH/s miner at startdiff 42 never submits a share so can never come
+ * down, but converges from a fractional startdiff with a low mindiff */
+static void test_simulator_lhr(void)
+{
+    vdsim_result_t res;
+    vdsim_conf_t conf;
+    int policy;
+
+    for (policy = 0; policy < VARDIFF_POLICIES; policy++) {
+        init_sim(&conf, policy, 100e3);
+        vdsim_run(&conf, &res);
+        assert_int_equal(res.shares, 0);
+        assert_double_equal(res.converge, -1, 0);
+
+        conf.vc.mindiff = 0.00001;
+        conf.startdiff = 0.001;
+        vdsim_run(&conf, &res);
+        assert_true(res.converge >= 0);
+        assert_true(res.final_diff < 0.001);
+        assert_true(res.final_diff >= 0.00001);
+    }
+}
+
+/* Re-converges after the hashrate steps up tenfold */
+static void test_simulator_step(void)
+{
+    vdsim_result_t res;
+    vdsim_conf_t conf;
+    int policy;
+
+    for (policy = 0; policy < VARDIFF_POLICIES; policy++) {
+        init_sim(&conf, policy, 1e12);
+        conf.stepat = 1800;
+        conf.stepfactor = 10;
+        vdsim_run(&conf, &res);
+        assert_true(res.reconverge >= 0);
+        assert_true(res.reconverge < 900);
+        assert_double_equal(res.ideal, 1e13 / 4294967296.0 * VARDIFF_TARGET, 0.001);
+    }
+}
+
+static void test_adjust_performance(void)
+{
+    struct timespec start, end;
+    vardiff_state_t vs = {0};
+    vardiff_share_t vsh;
+    vardiff_conf_t vc;
+    double new_diff, elapsed;
+    int policy, i;
+
+    for (policy = 0; policy < VARDIFF_POLICIES; policy++) {
+        init_conf(&vc, policy);
+        init_share(&vsh, 100, 30);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < 1000000; i++) {
+            vsh.ssdc = i % 100 + 1;
+            vsh.tdiff = i % 300;
+            vardiff_adjust(&vc, &vs, &vsh, &new_diff);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("    %s policy: %.1fns per share\n", vardiff_policy_name(policy), elapsed * 1000);
+    }
+}
+
+int main(void)
+{
+    printf("Running vardiff policy tests...\n\n");
+
+    run_test(test_policy_names);
+    run_test(test_ckpool_policy);
+    run_test(test_clamping);
+    run_test(test_interval_policy);
+    run_test(test_pid_policy);
+    run_test(test_simulator);
+    run_test(test_simulator_lhr);
+    run_test(test_simulator_step);
+
+    if (perf_tests_enabled()) {
+        printf("\n[PERFORMANCE REGRESSION TESTS]\n");
+        printf("BEGIN PERF TESTS: test-vardiff-policy\n");
+        run_test(test_adjust_performance);
+        printf("END PERF TESTS: test-vardiff-policy\n");
+    }
+
+    printf("\nAll vardiff policy tests passed!\n");
+    return 0;
+}